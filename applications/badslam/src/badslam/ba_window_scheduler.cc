@@ -0,0 +1,103 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "badslam/ba_window_scheduler.h"
+
+#include <libvis/logging.h>
+
+namespace vis {
+
+BAWindowScheduler::BAWindowScheduler(
+    int local_window_size,
+    int global_iteration_interval,
+    float global_time_interval)
+    : local_window_size_(local_window_size),
+      global_iteration_interval_(global_iteration_interval),
+      global_time_interval_(global_time_interval) {
+  CHECK_GE(local_window_size_, 0);
+  CHECK_GE(global_iteration_interval_, 0);
+  CHECK_GE(global_time_interval_, 0);
+}
+
+void BAWindowScheduler::NotifyLoopClosure() {
+  loop_closure_pending_ = true;
+}
+
+BAWindowScheduler::Window BAWindowScheduler::ScheduleIteration(
+    int keyframe_count,
+    const std::function<bool (int)>& keyframe_exists,
+    double current_time) {
+  if (last_global_time_ < 0) {
+    last_global_time_ = current_time;
+  }
+  
+  Window window;
+  window.global = true;
+  window.active_keyframe_window_start = 0;
+  window.active_keyframe_window_end = keyframe_count - 1;
+  
+  // Find the first keyframe of the local window by going back from the end
+  // until local_window_size_ existing keyframes have been found.
+  int local_window_start = 0;
+  if (local_window_size_ > 0) {
+    int existing_count = 0;
+    for (int i = keyframe_count - 1; i >= 0; -- i) {
+      if (keyframe_exists(i)) {
+        ++ existing_count;
+        if (existing_count == local_window_size_) {
+          local_window_start = i;
+          break;
+        }
+      }
+    }
+  }
+  
+  bool global_due =
+      local_window_start == 0 ||
+      loop_closure_pending_ ||
+      (global_iteration_interval_ > 0 &&
+       iterations_since_global_ + 1 >= global_iteration_interval_) ||
+      (global_time_interval_ > 0 &&
+       current_time - last_global_time_ >= global_time_interval_);
+  
+  if (global_due) {
+    loop_closure_pending_ = false;
+    iterations_since_global_ = 0;
+    last_global_time_ = current_time;
+    ++ global_iteration_count_;
+  } else {
+    window.global = false;
+    window.active_keyframe_window_start = local_window_start;
+    ++ iterations_since_global_;
+    ++ local_iteration_count_;
+  }
+  
+  return window;
+}
+
+}
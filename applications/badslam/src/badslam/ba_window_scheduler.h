@@ -0,0 +1,109 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <functional>
+
+#include <libvis/libvis.h>
+
+namespace vis {
+
+// Decides which keyframes the parallel bundle adjustment thread optimizes in
+// each of its iterations. Most iterations are local: only the newest
+// keyframes form the active window, which DirectBA extends by their co-visible
+// keyframes (see DirectBA::DetermineCovisibleActiveKeyframes()). All other
+// keyframes are held fixed in local iterations. Global iterations over all
+// keyframes are run after loop closures and at regular intervals, which can
+// be given as a number of iterations and / or as a time span.
+// 
+// This class only contains the scheduling logic, it does not access the
+// keyframes or DirectBA itself. It is not thread-safe.
+class BAWindowScheduler {
+ public:
+  // The keyframe window for one BA iteration, in the format expected by the
+  // active_keyframe_window_start / end parameters of
+  // DirectBA::BundleAdjustment().
+  struct Window {
+    // Whether all keyframes are active in this iteration.
+    bool global;
+    
+    // Index range of the active keyframes (inclusive).
+    int active_keyframe_window_start;
+    int active_keyframe_window_end;
+  };
+  
+  // Creates the scheduler. local_window_size is the number of the newest
+  // (existing) keyframes which are active in local iterations. If it is 0,
+  // every iteration is global. A global iteration is forced every
+  // global_iteration_interval iterations, and at least every
+  // global_time_interval seconds. Setting these to 0 disables the
+  // corresponding trigger.
+  BAWindowScheduler(
+      int local_window_size,
+      int global_iteration_interval,
+      float global_time_interval);
+  
+  // Requests that the next iteration is global. This should be called after a
+  // loop closure, since this changes the poses of keyframes which may be
+  // outside of the local window.
+  void NotifyLoopClosure();
+  
+  // Determines the keyframe window for the next BA iteration.
+  // keyframe_count is the size of the keyframe vector of DirectBA, and
+  // keyframe_exists(i) must return whether the keyframe with index i exists
+  // (i.e., has not been deleted). current_time is the current time in seconds
+  // (relative to an arbitrary, but fixed, origin).
+  Window ScheduleIteration(
+      int keyframe_count,
+      const std::function<bool (int)>& keyframe_exists,
+      double current_time);
+  
+  inline int local_window_size() const { return local_window_size_; }
+  
+  // Returns the number of local respectively global iterations scheduled so far.
+  inline int local_iteration_count() const { return local_iteration_count_; }
+  inline int global_iteration_count() const { return global_iteration_count_; }
+  
+ private:
+  // Settings.
+  int local_window_size_;
+  int global_iteration_interval_;
+  float global_time_interval_;
+  
+  // State.
+  bool loop_closure_pending_ = false;
+  int iterations_since_global_ = 0;
+  double last_global_time_ = -1;
+  
+  // Statistics.
+  int local_iteration_count_ = 0;
+  int global_iteration_count_ = 0;
+};
+
+}
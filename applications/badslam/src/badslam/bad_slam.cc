@@ -29,12 +29,15 @@
 #include "badslam/bad_slam.h"
 
 #include <iomanip>
+#include <sstream>
 
 #include <boost/filesystem.hpp>
 
+#include "badslam/ba_window_scheduler.h"
 #include "badslam/cuda_depth_processing.cuh"
 #include "badslam/cuda_depth_processing.h"
 #include "badslam/cuda_image_processing.cuh"
+#include "badslam/image_conversion.h"
 #include "badslam/kernels.cuh"
 #include "badslam/keyframe.h"
 #include "badslam/loop_detector.h"
@@ -57,6 +60,8 @@ BadSlam::BadSlam(
       pairwise_tracking_buffers_for_loops_(rgbd_video->depth_camera()->width(),
                                            rgbd_video->depth_camera()->height(),
                                            config.num_scales),
+      parallel_ba_iteration_queue_("BA iteration"),
+      queued_keyframes_("Keyframe"),
       frame_timer_("FRAME (w/o IO)", /*construct_stopped*/ true),
       rgbd_video_(rgbd_video),
       last_frame_index_(0),
@@ -65,6 +70,17 @@ BadSlam::BadSlam(
       config_(config) {
   valid_ = true;
   
+  keyframe_selector_.reset(new KeyframeSelector(
+      config_.keyframe_interval,
+      config_.keyframe_min_overlap,
+      config_.keyframe_max_translation,
+      config_.keyframe_max_rotation,
+      config_.keyframe_max_residual_increase));
+  
+  motion_predictor_ = MotionPredictor::Create(
+      config_.use_motion_model,
+      config_.multi_hypothesis_motion_model);
+  
   // Initialize CUDA stream(s).
   int stream_priority_low, stream_priority_high;
   cudaDeviceGetStreamPriorityRange(&stream_priority_low, &stream_priority_high);
@@ -81,20 +97,8 @@ BadSlam::BadSlam(
   int color_height = rgbd_video->color_camera()->height();
   
   depth_buffer_.reset(new CUDABuffer<u16>(depth_height, depth_width));
-  filtered_depth_buffer_A_.reset(new CUDABuffer<u16>(depth_height, depth_width));
   filtered_depth_buffer_B_.reset(new CUDABuffer<u16>(depth_height, depth_width));
-  normals_buffer_.reset(new CUDABuffer<u16>(depth_height, depth_width));
-  radius_buffer_.reset(new CUDABuffer<u16>(depth_height, depth_width));
-  
   rgb_buffer_.reset(new CUDABuffer<uchar3>(color_height, color_width));
-  color_buffer_.reset(new CUDABuffer<uchar4>(color_height, color_width));
-  color_buffer_->CreateTextureObject(
-      cudaAddressModeClamp,
-      cudaAddressModeClamp,
-      cudaFilterModeLinear,
-      cudaReadModeNormalizedFloat,
-      /*use_normalized_coordinates*/ false,
-      &color_texture_);
   
   ComputeMinMaxDepthCUDA_InitializeBuffers(
       &min_max_depth_init_buffer_,
@@ -137,6 +141,10 @@ BadSlam::BadSlam(
           rgbd_video->depth_frame(config_.start_frame)->global_T_frame() :
           SE3f()));
   
+  // The buffers which are handed over to keyframes come from the keyframe
+  // buffer pool of DirectBA.
+  AcquireKeyframeBuffers();
+  
   if (config.enable_loop_detection) {
     if (!boost::filesystem::exists(config.loop_detection_vocabulary_path)) {
       LOG(ERROR) << "File given as config.loop_detection_vocabulary_path does not exist: " << config.loop_detection_vocabulary_path;
@@ -157,7 +165,10 @@ BadSlam::BadSlam(
           rgbd_video->depth_camera()->height(),
           config.num_scales,
           config.GetLoopDetectionImageFrequency(),
-          config.parallel_loop_detection));
+          config.parallel_loop_detection,
+          config.loop_detection_worker_threads,
+          config.loop_detection_max_query_words,
+          config.loop_detection_max_keyframes_per_word));
     }
   }
   
@@ -170,10 +181,11 @@ BadSlam::BadSlam(
 void BadSlam::ProcessFrame(int frame_index, bool force_keyframe) {
   // Get the images. This should be before starting the "without I/O" timer
   // since it can lead to the images being loaded from disk (in case they are
-  // not cached yet).
-  const Image<Vec3u8>* rgb_image =
-      rgbd_video_->color_frame_mutable(frame_index)->GetImage().get();
-  /*const shared_ptr<Image<u16>>& depth_image =*/
+  // not cached yet). Holding the references keeps the images from being
+  // evicted from the image cache while the frame is processed.
+  shared_ptr<Image<Vec3u8>> rgb_image =
+      rgbd_video_->color_frame_mutable(frame_index)->GetImage();
+  shared_ptr<Image<u16>> depth_image =
       rgbd_video_->depth_frame_mutable(frame_index)->GetImage();
   
   // After I/O is done, start the "no I/O" frame timer.
@@ -193,17 +205,29 @@ void BadSlam::ProcessFrame(int frame_index, bool force_keyframe) {
     pose_estimated_ = true;
   }
   
-  // Use a very basic keyframe selection strategy: regularly select one
-  // keyframe every keyframe_interval frames.
-  bool create_keyframe =
-      force_keyframe ||
-      ((frame_index - config_.start_frame) % config_.keyframe_interval == 0);
+  // Decide whether to create a keyframe. With adaptive keyframes, this is
+  // decided based on the odometry result (with keyframe_interval as the maximum
+  // interval). Otherwise, use a very basic keyframe selection strategy:
+  // regularly select one keyframe every keyframe_interval frames.
+  bool create_keyframe;
+  if (force_keyframe) {
+    create_keyframe = true;
+  } else if (config_.adaptive_keyframes && pose_estimated_) {
+    create_keyframe =
+        keyframe_selector_->Decide(
+            base_kf_tr_frame_.back(),
+            odometry_residual_count_,
+            odometry_residual_sum_) != KeyframeSelector::Decision::kNoKeyframe;
+  } else {
+    create_keyframe = ((frame_index - config_.start_frame) % config_.keyframe_interval == 0);
+  }
   
   if (create_keyframe) {
     CreateKeyframe(frame_index,
-                   rgb_image,
+                   rgb_image.get(),
                    final_cpu_depth_map,
                    *final_depth_buffer_);
+    keyframe_selector_->NotifyKeyframeCreated();
   }
   
   keyframe_created_ = create_keyframe;
@@ -211,7 +235,8 @@ void BadSlam::ProcessFrame(int frame_index, bool force_keyframe) {
   // Perform bundle adjustment until convergence / reaching the maximum (planned) iteration count in offline mode,
   // or additionally only until the time for the current frame ran out in real-time mode.
   if (num_planned_ba_iterations_ > 0) {
-    // Is there time to do at least one iteration?
+    // Is there time left in this frame? (Within BA, the time limit is checked
+    // before each work item, see DirectBA::BundleAdjustment().)
     bool start_ba = true;
     if (!config_.parallel_ba && config_.target_frame_rate > 0) {
       double elapsed_frame_time = frame_timer_.GetTimeSinceStart();
@@ -273,6 +298,12 @@ void BadSlam::ProcessFrame(int frame_index, bool force_keyframe) {
         } else {
           num_planned_ba_iterations_ = std::max<int>(0, num_planned_ba_iterations_ - iterations_done);
         }
+        
+        // If the time limit interrupted an iteration, continue it in the
+        // next frame(s).
+        if (direct_ba_->has_interrupted_ba_iteration()) {
+          num_planned_ba_iterations_ = std::max<int>(1, num_planned_ba_iterations_);
+        }
       }
     }
   }
@@ -283,8 +314,25 @@ BadSlam::~BadSlam() {
     StopBAThreadAndWaitForIt();
   }
   
-  for (cudaEvent_t event : queued_keyframes_events_) {
-    cudaEventDestroy(event);
+  for (const QueuedKeyframe& queued_keyframe : queued_keyframes_) {
+    if (queued_keyframe.event) {
+      cudaEventDestroy(queued_keyframe.event);
+    }
+  }
+  
+  if (config_.parallel_ba) {
+    parallel_ba_iteration_queue_.LogStatistics();
+    queued_keyframes_.LogStatistics();
+  }
+  
+  if (config_.adaptive_keyframes) {
+    std::ostringstream keyframe_statistics;
+    for (int i = 1; i < static_cast<int>(KeyframeSelector::Decision::kNumDecisions); ++ i) {
+      KeyframeSelector::Decision decision = static_cast<KeyframeSelector::Decision>(i);
+      keyframe_statistics << (i > 1 ? ", " : "") << KeyframeSelector::DecisionToString(decision)
+                          << ": " << keyframe_selector_->decision_count(decision);
+    }
+    LOG(INFO) << "Adaptive keyframe selection reasons: " << keyframe_statistics.str();
   }
   
   cudaDestroyTextureObject(color_texture_);
@@ -329,10 +377,10 @@ void BadSlam::UpdateOdometryVisualization(
     AppendQueuedKeyframesToVisualization(&keyframe_poses, &keyframe_ids);
   }
   
-  PinholeCamera4f depth_camera = direct_ba_->depth_camera_no_lock();
-  
   direct_ba_->Unlock();
   
+  PinholeCamera4f depth_camera = direct_ba_->depth_camera();
+  
   
   unique_lock<mutex> render_mutex_lock(render_window_->render_mutex());
   
@@ -593,19 +641,23 @@ void BadSlam::RestartBAThread() {
 void BadSlam::SetQueuedKeyframes(
     const vector<shared_ptr<Keyframe>>& queued_keyframes,
     const vector<SE3f>& queued_keyframes_last_kf_tr_this_kf,
-    const vector<cv::Mat_<u8>>& queued_keyframe_gray_images,
+    const vector<shared_ptr<Image<u8>>>& queued_keyframe_gray_images,
     const vector<shared_ptr<Image<u16>>>& queued_keyframe_depth_images) {
-  queued_keyframes_ = queued_keyframes;
-  queued_keyframes_last_kf_tr_this_kf_ = queued_keyframes_last_kf_tr_this_kf;
-  queued_keyframe_gray_images_ = queued_keyframe_gray_images;
-  queued_keyframe_depth_images_ = queued_keyframe_depth_images;
-  
-  for (usize i = 0; i < queued_keyframes_events_.size(); ++ i) {
-    cudaEventDestroy(queued_keyframes_events_[i]);
+  for (const QueuedKeyframe& queued_keyframe : queued_keyframes_) {
+    if (queued_keyframe.event) {
+      cudaEventDestroy(queued_keyframe.event);
+    }
   }
-  queued_keyframes_events_.resize(queued_keyframes_.size());
-  for (usize i = 0; i < queued_keyframes_events_.size(); ++ i) {
-    queued_keyframes_events_[i] = nullptr;
+  queued_keyframes_.Clear();
+  
+  for (usize i = 0; i < queued_keyframes.size(); ++ i) {
+    QueuedKeyframe queued_keyframe;
+    queued_keyframe.keyframe = queued_keyframes[i];
+    queued_keyframe.last_kf_tr_this_kf = queued_keyframes_last_kf_tr_this_kf[i];
+    queued_keyframe.gray_image = queued_keyframe_gray_images[i];
+    queued_keyframe.depth_image = queued_keyframe_depth_images[i];
+    queued_keyframe.event = nullptr;
+    queued_keyframes_.Push(queued_keyframe);
   }
 }
 
@@ -619,20 +671,17 @@ void BadSlam::AppendQueuedKeyframesToVisualization(
     last_global_tr_frame = direct_ba_->keyframes().back()->global_T_frame();
   }
   
-  for (usize i = 0; i < queued_keyframes_.size(); ++ i) {
-    shared_ptr<Keyframe> new_keyframe = queued_keyframes_[i];
-    
+  for (const QueuedKeyframe& queued_keyframe : queued_keyframes_) {
     // Convert relative to absolute pose
-    const SE3f& last_kf_tr_this_kf = queued_keyframes_last_kf_tr_this_kf_[i];
     if (have_last_global_tr_frame) {
-      last_global_tr_frame = last_global_tr_frame * last_kf_tr_this_kf;
+      last_global_tr_frame = last_global_tr_frame * queued_keyframe.last_kf_tr_this_kf;
     } else {
-      last_global_tr_frame = new_keyframe->global_T_frame();
+      last_global_tr_frame = queued_keyframe.keyframe->global_T_frame();
       have_last_global_tr_frame = true;
     }
     
     keyframe_poses->push_back(last_global_tr_frame.matrix());
-    keyframe_ids->push_back(new_keyframe->id());
+    keyframe_ids->push_back(queued_keyframe.keyframe->id());
   }
 }
 
@@ -645,16 +694,15 @@ void BadSlam::PreprocessFrame(
   // Perform median filtering and densification.
   // TODO: Do this on the GPU for better performance.
   shared_ptr<Image<u16>> temp_depth_map;
-  shared_ptr<Image<u16>> temp_depth_map_2;
-  shared_ptr<Image<u16>> temp_depth_map_3;
   if (!final_cpu_depth_map) {
-    final_cpu_depth_map = &temp_depth_map_3;
+    final_cpu_depth_map = &temp_depth_map;
   }
   *final_cpu_depth_map = rgbd_video_->depth_frame_mutable(frame_index)->GetImage();
   for (int iteration = 0; iteration < config_.median_filter_and_densify_iterations; ++ iteration) {
-    shared_ptr<Image<u16>> target_depth_map = (final_cpu_depth_map->get() == temp_depth_map.get()) ? temp_depth_map_2 : temp_depth_map;
-    
-    target_depth_map->SetSize((*final_cpu_depth_map)->size());
+    // The previous intermediate result returns to the pool once it is
+    // replaced below.
+    shared_ptr<Image<u16>> target_depth_map = depth_image_pool_.Acquire(
+        (*final_cpu_depth_map)->width(), (*final_cpu_depth_map)->height());
     MedianFilterAndDensifyDepthMap(**final_cpu_depth_map, target_depth_map.get());
     
     *final_cpu_depth_map = target_depth_map;
@@ -668,15 +716,15 @@ void BadSlam::PreprocessFrame(
       LOG(FATAL) << "Simultaneous downscaling and median filtering of depth maps is not implemented.";
     }
     
-    Image<u16> downscaled_image(depth_buffer_->width(), depth_buffer_->height());
-    (*final_cpu_depth_map)->DownscaleUsingMedianWhileExcluding(0, depth_buffer_->width(), depth_buffer_->height(), &downscaled_image);
-    depth_buffer_->UploadAsync(stream_, downscaled_image);
+    shared_ptr<Image<u16>> downscaled_image = depth_image_pool_.Acquire(depth_buffer_->width(), depth_buffer_->height());
+    (*final_cpu_depth_map)->DownscaleUsingMedianWhileExcluding(0, depth_buffer_->width(), depth_buffer_->height(), downscaled_image.get());
+    depth_buffer_->UploadAsync(stream_, *downscaled_image);
   }
   
   if (config_.pyramid_level_for_color == 0) {
-    const Image<Vec3u8>* rgb_image =
-        rgbd_video_->color_frame_mutable(frame_index)->GetImage().get();
-    rgb_buffer_->UploadAsync(stream_, *reinterpret_cast<const Image<uchar3>*>(rgb_image));
+    shared_ptr<Image<Vec3u8>> rgb_image =
+        rgbd_video_->color_frame_mutable(frame_index)->GetImage();
+    rgb_buffer_->UploadAsync(stream_, *reinterpret_cast<const Image<uchar3>*>(rgb_image.get()));
   } else {
     rgb_buffer_->UploadAsync(stream_, *reinterpret_cast<const Image<uchar3>*>(
         ImagePyramid(rgbd_video_->color_frame_mutable(frame_index).get(),
@@ -701,13 +749,13 @@ void BadSlam::PreprocessFrame(
       depth_buffer_->ToCUDA(),
       &filtered_depth_buffer_A_->ToCUDA());
   
-  // Thread-safe camera / depth params access.
+  // Thread-safe camera / depth params access (from a single calibration
+  // snapshot, without taking the BA lock).
   // Be aware though that the content of the cfactor_buffer in depth_params can
   // still change since this points to GPU data.
-  direct_ba_->Lock();
-  PinholeCamera4f depth_camera = direct_ba_->depth_camera_no_lock();
-  DepthParameters depth_params = direct_ba_->depth_params_no_lock();
-  direct_ba_->Unlock();
+  shared_ptr<const Snapshot<DirectBA::Calibration>> calibration = direct_ba_->calibration_snapshot();
+  const PinholeCamera4f& depth_camera = calibration->value.depth_camera;
+  const DepthParameters& depth_params = calibration->value.depth_params;
   
   ComputeNormalsCUDA(
       stream_,
@@ -761,10 +809,7 @@ void BadSlam::PreprocessFrame(
 }
 
 void BadSlam::PredictFramePose(
-    SE3f* base_kf_tr_frame_initial_estimate,
-    SE3f* base_kf_tr_frame_initial_estimate_2) {
-  usize stored_frames = base_kf_tr_frame_.size();
-  
+    vector<SE3f>* base_kf_tr_frame_initial_estimates) {
 //   constexpr float kMaxDepthToMaxTranslationFactor = 0.8f;  // TODO: make parameter?
 //   constexpr float kMaxAngleThreshold = 90.f * M_PI / 180.f;
 //   
@@ -780,35 +825,8 @@ void BadSlam::PredictFramePose(
 //       kMaxDepthToMaxTranslationFactor * base_kf_max_depth *
 //       kMaxDepthToMaxTranslationFactor * base_kf_max_depth;
   
-  if (config_.use_motion_model) {
-    // Constant motion model
-    if (stored_frames >= 2) {
-      *base_kf_tr_frame_initial_estimate =
-          base_kf_tr_frame_[stored_frames - 1] *
-          frame_tr_base_kf_[stored_frames - 2] *
-          base_kf_tr_frame_[stored_frames - 1];
-    } else {
-      CHECK_EQ(base_kf_tr_frame_.size(), 1);
-      *base_kf_tr_frame_initial_estimate = base_kf_tr_frame_[stored_frames - 1];
-    }
-    
-    // Constant motion model without the last frame (for robustness against
-    // outlier frames)
-    if (stored_frames >= 3) {
-      SE3f prev_frame_T_last_frame =
-          frame_tr_base_kf_[stored_frames - 3] *
-          base_kf_tr_frame_[stored_frames - 2];
-      *base_kf_tr_frame_initial_estimate_2 =
-          base_kf_tr_frame_[stored_frames - 2] *
-          prev_frame_T_last_frame * prev_frame_T_last_frame;
-    } else {
-      *base_kf_tr_frame_initial_estimate_2 = *base_kf_tr_frame_initial_estimate;
-    }
-  } else {
-    // Use the last frame's pose as initial estimate for the next frame.
-    *base_kf_tr_frame_initial_estimate = base_kf_tr_frame_[stored_frames - 1];
-    *base_kf_tr_frame_initial_estimate_2 = *base_kf_tr_frame_initial_estimate;
-  }
+  // If the motion model is disabled, this only predicts the last frame's pose.
+  motion_predictor_->Predict(base_kf_tr_frame_, base_kf_tr_frame_initial_estimates);
   
   // This does not work if moving frames manually
 //   auto check_prediction = [&](SE3f* pose) {
@@ -820,8 +838,9 @@ void BadSlam::PredictFramePose(
 //       *pose = SE3f();
 //     }
 //   };
-//   check_prediction(base_kf_tr_frame_initial_estimate);
-//   check_prediction(base_kf_tr_frame_initial_estimate_2);
+//   for (SE3f& estimate : *base_kf_tr_frame_initial_estimates) {
+//     check_prediction(&estimate);
+//   }
 }
 
 void BadSlam::RunOdometry(int frame_index) {
@@ -831,11 +850,20 @@ void BadSlam::RunOdometry(int frame_index) {
   constexpr bool use_gradmag = false;
   
   // Predict the frame's pose using (a) motion model(s).
-  SE3f base_kf_tr_frame_initial_estimate;
-  SE3f base_kf_tr_frame_initial_estimate_2;
-  PredictFramePose(
-      &base_kf_tr_frame_initial_estimate,
-      &base_kf_tr_frame_initial_estimate_2);
+  vector<SE3f> base_kf_tr_frame_initial_estimates;
+  PredictFramePose(&base_kf_tr_frame_initial_estimates);
+  
+  KeyframeResidencyPin base_kf_pin = base_kf_->Pin(stream_);
+  if (!base_kf_pin) {
+    LOG(ERROR) << "Cannot track frame " << frame_index << " since the base keyframe's data is not available, using the predicted pose.";
+    direct_ba_->Lock();
+    SE3f new_global_T_frame = base_kf_global_T_frame_ * base_kf_tr_frame_initial_estimates.front();
+    rgbd_video_->depth_frame_mutable(frame_index)->SetGlobalTFrame(new_global_T_frame);
+    rgbd_video_->color_frame_mutable(frame_index)->SetGlobalTFrame(new_global_T_frame);
+    last_frame_index_ = frame_index;
+    direct_ba_->Unlock();
+    return;
+  }
   
   // Convert the raw u16 depths of the current frame to calibrated float
   // depths and transform the color image to depth intrinsics (and image size)
@@ -869,12 +897,12 @@ void BadSlam::RunOdometry(int frame_index) {
   }
   
   // Get a consistent set of camera and depth parameters for odometry
-  // tracking (important for the parallel BA case).
-  direct_ba_->Lock();
-  PinholeCamera4f color_camera = direct_ba_->color_camera_no_lock();
-  PinholeCamera4f depth_camera = direct_ba_->depth_camera_no_lock();
-  DepthParameters depth_params = direct_ba_->depth_params_no_lock();
-  direct_ba_->Unlock();
+  // tracking (important for the parallel BA case). Reading them from a
+  // snapshot avoids waiting for the BA thread to release its lock.
+  shared_ptr<const Snapshot<DirectBA::Calibration>> calibration = direct_ba_->calibration_snapshot();
+  const PinholeCamera4f& color_camera = calibration->value.color_camera;
+  const PinholeCamera4f& depth_camera = calibration->value.depth_camera;
+  const DepthParameters& depth_params = calibration->value.depth_params;
   
   CalibrateDepthAndTransformColorToDepthCUDA(
       stream_,
@@ -929,10 +957,10 @@ void BadSlam::RunOdometry(int frame_index) {
       calibrated_gradmag_texture_,
       /* input / output poses */
       base_kf_global_T_frame,
-      /*test_different_initial_estimates*/ true,
-      base_kf_tr_frame_initial_estimate,
-      base_kf_tr_frame_initial_estimate_2,
-      &base_T_frame_estimate);
+      base_kf_tr_frame_initial_estimates,
+      &base_T_frame_estimate,
+      &odometry_residual_count_,
+      &odometry_residual_sum_);
   
   direct_ba_->Lock();
   SE3f new_global_T_frame = base_kf_global_T_frame_ * base_T_frame_estimate;
@@ -955,16 +983,35 @@ shared_ptr<Keyframe> BadSlam::CreateKeyframe(
     const Image<Vec3u8>* rgb_image,
     const shared_ptr<Image<u16>>& depth_image,
     const CUDABuffer<u16>& depth_buffer) {
-  // Merge keyframes if not enough free memory left.
+  // Evict inactive keyframes from GPU memory, or merge keyframes if not
+  // enough free memory left. The buffers of evicted and deleted keyframes are
+  // returned to the keyframe buffer pool instead of being freed. Since the new
+  // keyframe re-uses them, the pooled memory counts as free here.
   constexpr u32 kApproxKeyframeSize = 4 * 1024 * 1024;
+  constexpr usize kEvictCount = 10;
+  const usize reserved_bytes = static_cast<usize>(config_.min_free_gpu_memory_mb) * 1024 * 1024;
+  const usize min_free_bytes = reserved_bytes + kApproxKeyframeSize;
+  CUDABufferPool* pool = direct_ba_->keyframe_buffer_pool().get();
   size_t free_bytes;
   size_t total_bytes;
   CUDA_CHECKED_CALL(cudaMemGetInfo(&free_bytes, &total_bytes));
-  if (free_bytes < static_cast<usize>(config_.min_free_gpu_memory_mb) * 1024 * 1024 + kApproxKeyframeSize) {
+  if (free_bytes + pool->metrics().pooled_bytes < min_free_bytes && direct_ba_->keyframe_storage()) {
+    direct_ba_->Lock();
+    direct_ba_->EvictInactiveKeyframes(stream_, kEvictCount);
+    direct_ba_->Unlock();
+    CUDA_CHECKED_CALL(cudaMemGetInfo(&free_bytes, &total_bytes));
+  }
+  if (free_bytes + pool->metrics().pooled_bytes < min_free_bytes) {
     LOG(WARNING) << "The available GPU memory becomes low. Merging keyframes now, but be aware that this has received little testing and may lead to instability.";
     direct_ba_->Lock();
     direct_ba_->MergeKeyframes(stream_, loop_detector_.get());
     direct_ba_->Unlock();
+    CUDA_CHECKED_CALL(cudaMemGetInfo(&free_bytes, &total_bytes));
+  }
+  // The reserved memory is for other allocations which cannot use the pooled
+  // blocks, so free them if they hold on to it.
+  if (free_bytes < reserved_bytes) {
+    pool->Trim();
   }
   
   cudaEventRecord(keyframe_creation_pre_event_, stream_);
@@ -980,6 +1027,16 @@ shared_ptr<Keyframe> BadSlam::CreateKeyframe(
       &keyframe_min_depth,
       &keyframe_max_depth);
   
+  // The keyframe takes ownership of the preprocessed frame buffers. Only the
+  // depth buffer needs to be copied if it is not one of our own buffers.
+  CUDABufferPtr<u16> keyframe_depth_buffer;
+  if (&depth_buffer == filtered_depth_buffer_A_.get()) {
+    keyframe_depth_buffer = filtered_depth_buffer_A_;
+  } else {
+    keyframe_depth_buffer = direct_ba_->keyframe_buffer_pool()->Acquire<u16>(depth_buffer.height(), depth_buffer.width(), stream_);
+    keyframe_depth_buffer->SetTo(depth_buffer, stream_);
+  }
+  
   // Allocate and add keyframe.
   // TODO: Should the min/max depth here be extended by the half association
   //       range at these depths?
@@ -989,10 +1046,11 @@ shared_ptr<Keyframe> BadSlam::CreateKeyframe(
       frame_index,
       keyframe_min_depth,
       keyframe_max_depth,
-      depth_buffer,
-      *normals_buffer_,
-      *radius_buffer_,
-      *color_buffer_,
+      keyframe_depth_buffer,
+      normals_buffer_,
+      radius_buffer_,
+      color_buffer_,
+      color_texture_,
       rgbd_video_->depth_frame_mutable(frame_index),
       rgbd_video_->color_frame_mutable(frame_index)));
   base_kf_ = new_keyframe.get();
@@ -1009,17 +1067,22 @@ shared_ptr<Keyframe> BadSlam::CreateKeyframe(
   // during BA).
   base_kf_global_T_frame_ = base_kf_->global_T_frame();
   direct_ba_->Unlock();
+  
+  // Continue with new buffers for the following frames. The keyframe owns the
+  // previous buffers and color texture now. The pool orders re-use of the
+  // buffers after the work queued on stream_, so there is no need to wait here.
+  AcquireKeyframeBuffers();
+  
   cudaEventRecord(keyframe_creation_post_event_, stream_);
   
-  cv::Mat_<u8> gray_image;
+  shared_ptr<Image<u8>> gray_image;
   
   if (loop_detector_) {
     gray_image = CreateGrayImageForLoopDetection(*rgb_image);
     
     if (config_.parallel_loop_detection) {
       loop_detector_->QueueForLoopDetection(gray_image, depth_image);
-      gray_image.release();
-      CHECK(gray_image.empty());
+      gray_image.reset();
     }
   }
   
@@ -1029,17 +1092,18 @@ shared_ptr<Keyframe> BadSlam::CreateKeyframe(
     // in a queue from which it will be added later.
     direct_ba_->Lock();
     
-    cudaEvent_t keyframe_event;
-    cudaEventCreate(&keyframe_event, cudaEventDisableTiming);
-    cudaEventRecord(keyframe_event, stream_);
-    queued_keyframes_events_.push_back(keyframe_event);
-    queued_keyframes_.push_back(new_keyframe);
-    queued_keyframes_last_kf_tr_this_kf_.push_back(
-        base_kf_tr_frame_.empty() ? SE3f() : base_kf_tr_frame_.back());
+    QueuedKeyframe queued_keyframe;
+    queued_keyframe.keyframe = new_keyframe;
+    queued_keyframe.last_kf_tr_this_kf =
+        base_kf_tr_frame_.empty() ? SE3f() : base_kf_tr_frame_.back();
     
     // Also queue keyframe image data for loop detection.
-    queued_keyframe_gray_images_.push_back(gray_image);
-    queued_keyframe_depth_images_.push_back(config_.parallel_loop_detection ? nullptr : depth_image);
+    queued_keyframe.gray_image = gray_image;
+    queued_keyframe.depth_image = config_.parallel_loop_detection ? nullptr : depth_image;
+    
+    cudaEventCreate(&queued_keyframe.event, cudaEventDisableTiming);
+    cudaEventRecord(queued_keyframe.event, stream_);
+    queued_keyframes_.Push(queued_keyframe);
     
     keyframes_added = queued_keyframes_.size() + direct_ba_->keyframes().size();
     
@@ -1096,15 +1160,29 @@ shared_ptr<Keyframe> BadSlam::CreateKeyframe(
   return new_keyframe;
 }
 
-cv::Mat_<u8> BadSlam::CreateGrayImageForLoopDetection(const Image<Vec3u8>& rgb_image) {
-  cv::Mat_<u8> gray_image;
-  gray_image.create(rgb_image.height(), rgb_image.width());
-  for (u32 y = 0; y < rgb_image.height(); ++ y) {
-    for (u32 x = 0; x < rgb_image.width(); ++ x) {
-      const Vec3u8& color = rgb_image(x, y);
-      gray_image(y, x) = 0.299f * color.x() + 0.587f * color.y() + 0.114f * color.z();
-    }
-  }
+void BadSlam::AcquireKeyframeBuffers() {
+  CUDABufferPool* pool = direct_ba_->keyframe_buffer_pool().get();
+  
+  int depth_width = rgbd_video_->depth_camera()->width();
+  int depth_height = rgbd_video_->depth_camera()->height();
+  filtered_depth_buffer_A_ = pool->Acquire<u16>(depth_height, depth_width, stream_);
+  normals_buffer_ = pool->Acquire<u16>(depth_height, depth_width, stream_);
+  radius_buffer_ = pool->Acquire<u16>(depth_height, depth_width, stream_);
+  
+  color_buffer_ = pool->Acquire<uchar4>(
+      rgbd_video_->color_camera()->height(), rgbd_video_->color_camera()->width(), stream_);
+  color_buffer_->CreateTextureObject(
+      cudaAddressModeClamp,
+      cudaAddressModeClamp,
+      cudaFilterModeLinear,
+      cudaReadModeNormalizedFloat,
+      /*use_normalized_coordinates*/ false,
+      &color_texture_);
+}
+
+shared_ptr<Image<u8>> BadSlam::CreateGrayImageForLoopDetection(const Image<Vec3u8>& rgb_image) {
+  shared_ptr<Image<u8>> gray_image = gray_image_pool_.Acquire(rgb_image.width(), rgb_image.height());
+  ConvertRGBToBrightness(rgb_image, gray_image.get());
   return gray_image;
 }
 
@@ -1117,27 +1195,29 @@ void BadSlam::SetBaseKF(Keyframe* kf) {
   }
 }
 
-void BadSlam::AddKeyframeToBA(
+bool BadSlam::AddKeyframeToBA(
     cudaStream_t stream,
     const shared_ptr<Keyframe>& new_keyframe,
-    cv::Mat_<u8> gray_image,
+    const shared_ptr<Image<u8>>& gray_image,
     const shared_ptr<Image<u16>>& depth_image) {
   direct_ba_->Lock();
   direct_ba_->AddKeyframe(new_keyframe);
+  direct_ba_->Unlock();
   
   // Get a consistent set of camera and depth parameters for loop
   // closure handling (important for the parallel BA case).
-  PinholeCamera4f color_camera = direct_ba_->color_camera_no_lock();
-  PinholeCamera4f depth_camera = direct_ba_->depth_camera_no_lock();
-  DepthParameters depth_params = direct_ba_->depth_params_no_lock();
-  direct_ba_->Unlock();
+  shared_ptr<const Snapshot<DirectBA::Calibration>> calibration = direct_ba_->calibration_snapshot();
+  const PinholeCamera4f& color_camera = calibration->value.color_camera;
+  const PinholeCamera4f& depth_camera = calibration->value.depth_camera;
+  const DepthParameters& depth_params = calibration->value.depth_params;
   
   // Check for loops.
+  bool loop_closed = false;
   if (loop_detector_) {
     PinholeCamera4f* full_scale_color_camera = color_camera.Scaled(powf(2, config_.pyramid_level_for_color));
     
     // NOTE: This uses the raw depth image without any bilinear filtering or correction.
-    loop_detector_->AddImage(
+    loop_closed = loop_detector_->AddImage(
         stream,
         config_.start_frame,
         last_frame_index_,  // TODO: This should use the most current value in the parallel case, not the one which was most current at the start of this function call!
@@ -1155,6 +1235,8 @@ void BadSlam::AddKeyframeToBA(
     
     delete full_scale_color_camera;
   }
+  
+  return loop_closed;
 }
 
 void BadSlam::StartParallelIterations(
@@ -1178,11 +1260,8 @@ void BadSlam::StartParallelIterations(
   int iterations_to_queue =
       std::min<int>(max_queued_iterations - parallel_ba_iteration_queue_.size(),
                     num_planned_iterations);
-  if (iterations_to_queue > 0) {
-    parallel_ba_iteration_queue_.reserve(parallel_ba_iteration_queue_.size() + iterations_to_queue);
-    for (int i = 0; i < iterations_to_queue; ++ i) {
-      parallel_ba_iteration_queue_.push_back(options);
-    }
+  for (int i = 0; i < iterations_to_queue; ++ i) {
+    parallel_ba_iteration_queue_.Push(options);
   }
   
   direct_ba_->Unlock();
@@ -1200,6 +1279,14 @@ void BadSlam::BAThreadMain(OpenGLContext* opengl_context) {
     SwitchOpenGLContext(*opengl_context, &no_context);
   }
   
+  // Decides which keyframes are optimized in each iteration (local windows
+  // around the newest keyframes, or all keyframes).
+  BAWindowScheduler window_scheduler(
+      config_.ba_local_window_size,
+      config_.ba_global_iteration_interval,
+      config_.ba_global_time_interval);
+  Timer window_scheduler_timer;
+  
   while (true) {
     unique_lock<mutex> lock(direct_ba_->Mutex());
     
@@ -1211,8 +1298,7 @@ void BadSlam::BAThreadMain(OpenGLContext* opengl_context) {
     }
     
     // Pop item from parallel_ba_iteration_queue_
-    ParallelBAOptions options = parallel_ba_iteration_queue_.front();
-    parallel_ba_iteration_queue_.erase(parallel_ba_iteration_queue_.begin());
+    ParallelBAOptions options = parallel_ba_iteration_queue_.Pop();
     
     // Add any queued keyframes (within the lock).
     bool mutex_locked = true;
@@ -1222,38 +1308,31 @@ void BadSlam::BAThreadMain(OpenGLContext* opengl_context) {
         mutex_locked = true;
       }
       
-      shared_ptr<Keyframe> new_keyframe = queued_keyframes_.front();
-      const SE3f& last_kf_tr_this_kf = queued_keyframes_last_kf_tr_this_kf_.front();
+      QueuedKeyframe queued_keyframe = queued_keyframes_.Pop();
       
       // Convert relative to absolute pose
       if (!direct_ba_->keyframes().empty()) {
-        new_keyframe->set_global_T_frame(
-            direct_ba_->keyframes().back()->global_T_frame() * last_kf_tr_this_kf);
+        queued_keyframe.keyframe->set_global_T_frame(
+            direct_ba_->keyframes().back()->global_T_frame() * queued_keyframe.last_kf_tr_this_kf);
       }
       
-      cv::Mat_<u8> gray_image = queued_keyframe_gray_images_.front();
-      shared_ptr<Image<u16>> depth_image = queued_keyframe_depth_images_.front();
-      cudaEvent_t keyframe_event = queued_keyframes_events_.front();
-      
-      queued_keyframes_.erase(queued_keyframes_.begin());
-      queued_keyframes_last_kf_tr_this_kf_.erase(queued_keyframes_last_kf_tr_this_kf_.begin());
-      queued_keyframe_gray_images_.erase(queued_keyframe_gray_images_.begin());
-      queued_keyframe_depth_images_.erase(queued_keyframe_depth_images_.begin());
-      queued_keyframes_events_.erase(queued_keyframes_events_.begin());
-      
       // Release lock while performing loop detection.
       lock.unlock();
       mutex_locked = false;
       
       // Wait for the "odometry" stream to fully upload the data of the latest
       // keyframe before (potentially) issuing GPU commands on it with the "BA" stream.
-      cudaStreamWaitEvent(thread_stream, keyframe_event, 0);
-      cudaEventDestroy(keyframe_event);
+      if (queued_keyframe.event) {
+        cudaStreamWaitEvent(thread_stream, queued_keyframe.event, 0);
+        cudaEventDestroy(queued_keyframe.event);
+      }
       
-      AddKeyframeToBA(thread_stream,
-                      new_keyframe,
-                      gray_image,
-                      depth_image);
+      if (AddKeyframeToBA(thread_stream,
+                          queued_keyframe.keyframe,
+                          queued_keyframe.gray_image,
+                          queued_keyframe.depth_image)) {
+        window_scheduler.NotifyLoopClosure();
+      }
     }
     if (mutex_locked) {
       lock.unlock();
@@ -1263,9 +1342,15 @@ void BadSlam::BAThreadMain(OpenGLContext* opengl_context) {
     vector<SE3f> original_keyframe_T_global;
     RememberKeyframePoses(direct_ba_.get(), &original_keyframe_T_global);
     
-    // TODO: Currently, this always runs on all keyframes using the
-    //       active_keyframe_window_start/end parameters (i.e., there is no
-    //       support for keyframe deactivation).
+    // Keyframes outside of the window (and not co-visible with a keyframe
+    // within it) remain fixed in this iteration.
+    direct_ba_->Lock();
+    BAWindowScheduler::Window window = window_scheduler.ScheduleIteration(
+        direct_ba_->keyframes().size(),
+        [&](int keyframe_index) { return direct_ba_->keyframes()[keyframe_index] != nullptr; },
+        window_scheduler_timer.GetTimeSinceStart());
+    direct_ba_->Unlock();
+    
     if (config_.use_pcg) {
       // The PCG-based solver implementation does not do any locking, so it is unsafe to use it in parallel.
       LOG(WARNING) << "PCG-based solving is not supported for real-time running, using the alternating solver instead. Use --sequential_ba to be able to use the PCG-based solver.";
@@ -1280,8 +1365,8 @@ void BadSlam::BAThreadMain(OpenGLContext* opengl_context) {
         /*min_iterations*/ 0,
         /*max_iterations*/ 1,
         /*use_pcg*/ false,
-        /*active_keyframe_window_start*/ 0,
-        /*active_keyframe_window_end*/ direct_ba_->keyframes().size() - 1,
+        window.active_keyframe_window_start,
+        window.active_keyframe_window_end,
         /*increase_ba_iteration_count*/ false,
         nullptr,
         nullptr,
@@ -33,6 +33,7 @@
 
 #include <cuda_runtime.h>
 #include <libvis/cuda/cuda_buffer.h>
+#include <libvis/image_pool.h>
 #include <libvis/libvis.h>
 #include <libvis/sophus.h>
 #include <libvis/timing.h>
@@ -40,7 +41,10 @@
 
 #include "badslam/bad_slam_config.h"
 #include "badslam/kernels.h"
+#include "badslam/keyframe_selector.h"
+#include "badslam/motion_model.h"
 #include "badslam/pairwise_frame_tracking.h"
+#include "badslam/work_queue.h"
 
 namespace vis {
 
@@ -162,9 +166,10 @@ class BadSlam {
       const shared_ptr<Image<u16>>& depth_image,
       const CUDABuffer<u16>& depth_buffer);
   
-  // Creates an OpenCV grayscale image for loop detection. Normally, this
-  // function does not need to be called externally.
-  cv::Mat_<u8> CreateGrayImageForLoopDetection(const Image<Vec3u8>& rgb_image);
+  // Creates a grayscale image for loop detection. The image is taken from a
+  // pool and returns to it once it is released. Normally, this function does
+  // not need to be called externally.
+  shared_ptr<Image<u8>> CreateGrayImageForLoopDetection(const Image<Vec3u8>& rgb_image);
   
   // Returns whether the BadSlam object was initialized correctly.
   inline bool valid() const { return valid_; }
@@ -204,8 +209,12 @@ class BadSlam {
   inline void GetQueuedKeyframes(
       vector<shared_ptr<Keyframe>>* queued_keyframes,
       vector<SE3f>* queued_keyframes_last_kf_tr_this_kf) const {
-    *queued_keyframes = queued_keyframes_;
-    *queued_keyframes_last_kf_tr_this_kf = queued_keyframes_last_kf_tr_this_kf_;
+    queued_keyframes->clear();
+    queued_keyframes_last_kf_tr_this_kf->clear();
+    for (const QueuedKeyframe& queued_keyframe : queued_keyframes_) {
+      queued_keyframes->push_back(queued_keyframe.keyframe);
+      queued_keyframes_last_kf_tr_this_kf->push_back(queued_keyframe.last_kf_tr_this_kf);
+    }
   }
   
   // Sets the queued keyframes. The GPU data for these keyframes must be fully
@@ -214,7 +223,7 @@ class BadSlam {
   void SetQueuedKeyframes(
       const vector<shared_ptr<Keyframe>>& queued_keyframes,
       const vector<SE3f>& queued_keyframes_last_kf_tr_this_kf,
-      const vector<cv::Mat_<u8>>& queued_keyframe_gray_images,
+      const vector<shared_ptr<Image<u8>>>& queued_keyframe_gray_images,
       const vector<shared_ptr<Image<u16>>>& queued_keyframe_depth_images);
   
  private:
@@ -226,20 +235,21 @@ class BadSlam {
       vector<int>* keyframe_ids);
   
   // Using (a) motion model(s), predicts the pose of the next frame based on the
-  // poses of the previous frames.
+  // poses of the previous frames. Returns one initial estimate per distinct
+  // prediction of the motion hypotheses.
   void PredictFramePose(
-      SE3f* base_kf_tr_frame_initial_estimate,
-      SE3f* base_kf_tr_frame_initial_estimate_2);
+      vector<SE3f>* base_kf_tr_frame_initial_estimates);
   
   // Estimates the RGB-D frame's pose from odometry based on the last keyframe.
   void RunOdometry(int frame_index);
   
   // Adds a keyframe to bundle adjustment. Perform loop detection and closure.
-  // If loop detection is disabled, gray_image may be empty.
-  void AddKeyframeToBA(
+  // If loop detection is disabled, gray_image may be null. Returns true if a
+  // loop closure was performed.
+  bool AddKeyframeToBA(
       cudaStream_t stream,
       const shared_ptr<Keyframe>& new_keyframe,
-      cv::Mat_<u8> gray_image,
+      const shared_ptr<Image<u8>>& gray_image,
       const shared_ptr<Image<u16>>& depth_image);
   
   // In the parallel-BA case (i.e., if parallel_ba is set to true in the
@@ -253,6 +263,11 @@ class BadSlam {
       bool optimize_poses,
       bool optimize_geometry);
   
+  // Allocates new buffers for the preprocessing results that are handed over
+  // to keyframes (filtered depth, normals, radius, and color) from the
+  // keyframe buffer pool, and creates color_texture_.
+  void AcquireKeyframeBuffers();
+  
   // Main function of the thread which runs bundle adjustment in parallel. This
   // is only used if BA is configured to run in parallel.
   void BAThreadMain(OpenGLContext* opengl_context);
@@ -271,6 +286,16 @@ class BadSlam {
   vector<SE3f> base_kf_tr_frame_;
   vector<SE3f> frame_tr_base_kf_;
   
+  // Motion hypotheses which predict the initial estimates for odometry.
+  unique_ptr<MotionPredictor> motion_predictor_;
+  
+  // Residual statistics of the last odometry tracking result.
+  u32 odometry_residual_count_ = 0;
+  float odometry_residual_sum_ = 0;
+  
+  // Decides when to create keyframes if config_.adaptive_keyframes is set.
+  unique_ptr<KeyframeSelector> keyframe_selector_;
+  
   CUDABufferPtr<float> calibrated_depth_;
   CUDABufferPtr<uchar> calibrated_gradmag_;
   CUDABufferPtr<uchar> base_kf_gradmag_;
@@ -289,7 +314,15 @@ class BadSlam {
   
   CUDABufferPtr<uchar3> rgb_buffer_;
   CUDABufferPtr<uchar4> color_buffer_;
-  cudaTextureObject_t color_texture_;
+  cudaTextureObject_t color_texture_ = 0;
+  
+  // Pool for the CPU depth images created during preprocessing. These images
+  // may be kept by keyframes (for loop detection), and are returned to the
+  // pool afterwards.
+  ImagePool<u16> depth_image_pool_;
+  
+  // Pool for the grayscale images which are handed to loop detection.
+  ImagePool<u8> gray_image_pool_;
   
   CUDABufferPtr<float> min_max_depth_init_buffer_;
   CUDABufferPtr<float> min_max_depth_result_buffer_;
@@ -307,14 +340,27 @@ class BadSlam {
     bool optimize_geometry;
   };
   
-  vector<ParallelBAOptions> parallel_ba_iteration_queue_;
-  
-  vector<shared_ptr<Keyframe>> queued_keyframes_;
-  vector<SE3f> queued_keyframes_last_kf_tr_this_kf_;
-  vector<cudaEvent_t> queued_keyframes_events_;
+  // A keyframe which was created by odometry and waits for the BA thread to
+  // add it to BA.
+  struct QueuedKeyframe {
+    shared_ptr<Keyframe> keyframe;
+    
+    // Pose relative to the previous keyframe, which is converted to an
+    // absolute pose once the keyframe is added.
+    SE3f last_kf_tr_this_kf;
+    
+    // Image data for loop detection.
+    shared_ptr<Image<u8>> gray_image;
+    shared_ptr<Image<u16>> depth_image;
+    
+    // Recorded in the odometry stream after the keyframe's data was uploaded
+    // (or null).
+    cudaEvent_t event;
+  };
   
-  vector<cv::Mat_<u8>> queued_keyframe_gray_images_;
-  vector<shared_ptr<Image<u16>>> queued_keyframe_depth_images_;
+  // Both queues are protected by the DirectBA mutex.
+  WorkQueue<ParallelBAOptions> parallel_ba_iteration_queue_;
+  WorkQueue<QueuedKeyframe> queued_keyframes_;
   
   std::atomic<bool> quit_requested_;
   std::atomic<bool> quit_done_;
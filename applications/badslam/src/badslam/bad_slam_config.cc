@@ -72,8 +72,14 @@ bool BadSlamConfig::Save(FILE* file) const {
   
   SaveInt32(num_scales);
   SaveBool(use_motion_model);
+  SaveBool(multi_hypothesis_motion_model);
   
   SaveInt32(keyframe_interval);
+  SaveBool(adaptive_keyframes);
+  fwrite(&keyframe_min_overlap, sizeof(float), 1, file);
+  fwrite(&keyframe_max_translation, sizeof(float), 1, file);
+  fwrite(&keyframe_max_rotation, sizeof(float), 1, file);
+  fwrite(&keyframe_max_residual_increase, sizeof(float), 1, file);
   SaveInt32(max_num_ba_iterations_per_keyframe);
   SaveBool(disable_deactivation);
   SaveBool(use_geometric_residuals);
@@ -83,12 +89,18 @@ bool BadSlamConfig::Save(FILE* file) const {
   SaveBool(do_surfel_updates);
   SaveBool(parallel_ba);
   SaveBool(use_pcg);
+  SaveInt32(ba_local_window_size);
+  SaveInt32(ba_global_iteration_interval);
+  fwrite(&ba_global_time_interval, sizeof(float), 1, file);
   SaveBool(estimate_poses);
   
   SaveInt32(min_free_gpu_memory_mb);
   
   SaveBool(enable_loop_detection);
   SaveBool(parallel_loop_detection);
+  SaveInt32(loop_detection_worker_threads);
+  SaveInt32(loop_detection_max_query_words);
+  SaveInt32(loop_detection_max_keyframes_per_word);
   
   SaveString(loop_detection_vocabulary_path);
   SaveString(loop_detection_pattern_path);
@@ -169,8 +181,14 @@ bool BadSlamConfig::Load(FILE* file) {
   
   num_scales = LoadInt32();
   use_motion_model = LoadBool();
+  multi_hypothesis_motion_model = LoadBool();
   
   keyframe_interval = LoadInt32();
+  adaptive_keyframes = LoadBool();
+  keyframe_min_overlap = LoadFloat();
+  keyframe_max_translation = LoadFloat();
+  keyframe_max_rotation = LoadFloat();
+  keyframe_max_residual_increase = LoadFloat();
   max_num_ba_iterations_per_keyframe = LoadInt32();
   disable_deactivation = LoadBool();
   use_geometric_residuals = LoadBool();
@@ -180,12 +198,18 @@ bool BadSlamConfig::Load(FILE* file) {
   do_surfel_updates = LoadBool();
   parallel_ba = LoadBool();
   use_pcg = LoadBool();
+  ba_local_window_size = LoadInt32();
+  ba_global_iteration_interval = LoadInt32();
+  ba_global_time_interval = LoadFloat();
   estimate_poses = LoadBool();
   
   min_free_gpu_memory_mb = LoadInt32();
   
   enable_loop_detection = LoadBool();
   parallel_loop_detection = LoadBool();
+  loop_detection_worker_threads = LoadInt32();
+  loop_detection_max_query_words = LoadInt32();
+  loop_detection_max_keyframes_per_word = LoadInt32();
   
   loop_detection_vocabulary_path = LoadString();
   loop_detection_pattern_path = LoadString();
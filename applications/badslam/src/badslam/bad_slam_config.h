@@ -170,14 +170,53 @@ struct BadSlamConfig {
       "Whether to use a constant motion model to predict the next frame's pose.";
   bool use_motion_model = true;
   
+  static constexpr const char* multi_hypothesis_motion_model_help =
+      "Whether to additionally predict the next frame's pose with constant"
+      " acceleration, zero motion, and rotation-only hypotheses. Odometry"
+      " chooses the best of all predictions on the coarsest pyramid level."
+      " Only has an effect if the motion model is used.";
+  bool multi_hypothesis_motion_model = false;
+  
   
   // --- Bundle adjustment parameters ---
   
   static constexpr const char* keyframe_interval_help =
       "Determines the interval in frames for creating keyframes. By setting this"
-      " to 1, a keyframe is created for every frame.";
+      " to 1, a keyframe is created for every frame. If adaptive_keyframes is"
+      " enabled, this is the maximum interval.";
   int keyframe_interval = 10;
   
+  static constexpr const char* adaptive_keyframes_help =
+      "Decides whether to create a keyframe based on the odometry result for"
+      " each frame (see the keyframe_min_overlap, keyframe_max_translation,"
+      " keyframe_max_rotation, and keyframe_max_residual_increase parameters)"
+      " instead of creating keyframes at a fixed interval.";
+  bool adaptive_keyframes = false;
+  
+  static constexpr const char* keyframe_min_overlap_help =
+      "For adaptive keyframes: creates a keyframe once the number of valid"
+      " odometry residuals drops below this fraction of that of the first frame"
+      " tracked against the last keyframe. 0 disables this criterion.";
+  float keyframe_min_overlap = 0.7f;
+  
+  static constexpr const char* keyframe_max_translation_help =
+      "For adaptive keyframes: creates a keyframe once the camera moved more"
+      " than this distance (in meters) from the last keyframe. 0 disables this"
+      " criterion.";
+  float keyframe_max_translation = 0.1f;
+  
+  static constexpr const char* keyframe_max_rotation_help =
+      "For adaptive keyframes: creates a keyframe once the camera rotated more"
+      " than this angle (in degrees) relative to the last keyframe. 0 disables"
+      " this criterion.";
+  float keyframe_max_rotation = 10.f;
+  
+  static constexpr const char* keyframe_max_residual_increase_help =
+      "For adaptive keyframes: creates a keyframe once the mean odometry"
+      " residual exceeds this multiple of that of the first frame tracked"
+      " against the last keyframe. 0 disables this criterion.";
+  float keyframe_max_residual_increase = 2.f;
+  
   static constexpr const char* max_num_ba_iterations_per_keyframe_help =
       "The maximum number of bundle adjustment iterations performed after"
       " creating a keyframe.\n"
@@ -229,6 +268,26 @@ struct BadSlamConfig {
       " the default alternating optimization scheme is used instead.";
   bool use_pcg = false;
   
+  static constexpr const char* ba_local_window_size_help =
+      "Number of the newest keyframes which are optimized in local bundle"
+      " adjustment iterations of the parallel BA thread. Keyframes which are"
+      " co-visible with these are optimized as well, while all other keyframes"
+      " remain fixed. Set this to 0 to optimize all keyframes in every"
+      " iteration. Only has an effect if parallel_ba is true.";
+  int ba_local_window_size = 0;
+  
+  static constexpr const char* ba_global_iteration_interval_help =
+      "If local bundle adjustment is used, this specifies that every Xth"
+      " parallel BA iteration optimizes all keyframes. Set to 0 to disable"
+      " this. Loop closures always trigger a global iteration.";
+  int ba_global_iteration_interval = 10;
+  
+  static constexpr const char* ba_global_time_interval_help =
+      "If local bundle adjustment is used, a parallel BA iteration that"
+      " optimizes all keyframes is run at least every X seconds. Set to 0 to"
+      " disable this.";
+  float ba_global_time_interval = 5.f;
+  
   static constexpr const char* estimate_poses_help =
       "If set to false, the given frame poses will be used instead of estimating"
       " their poses. This disables odometry and bundle adjustment. This is intended"
@@ -257,6 +316,27 @@ struct BadSlamConfig {
       " the other components.";
   bool parallel_loop_detection = true;
   
+  static constexpr const char* loop_detection_worker_threads_help =
+      "Number of threads which extract features and verify loop candidates if"
+      " loop detection runs in parallel. The image database is queried by an"
+      " additional thread.";
+  int loop_detection_worker_threads = 2;
+  
+  static constexpr const char* loop_detection_max_query_words_help =
+      "Maximum number of visual words that are scored when querying the image"
+      " database for loop candidates (the words with the highest weight in the"
+      " query are used). This bounds the query cost for large databases. Zero"
+      " scores all words.";
+  int loop_detection_max_query_words = 0;
+  
+  static constexpr const char* loop_detection_max_keyframes_per_word_help =
+      "Visual words which occur in more keyframes than this are treated as stop"
+      " words and are not scored when querying the image database for loop"
+      " candidates. Together with the number of words in a query, this bounds"
+      " the query cost independently of the number of keyframes. Zero scores"
+      " all words.";
+  int loop_detection_max_keyframes_per_word = 1000;
+  
   static constexpr const char* loop_detection_vocabulary_path_help =
       "Path to the .voc file for loop detection.";
   string loop_detection_vocabulary_path = "";
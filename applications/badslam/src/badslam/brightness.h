@@ -0,0 +1,61 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <libvis/libvis.h>
+
+#include "badslam/constants.h"
+
+namespace vis {
+
+// Weights of the color channels for computing the brightness (intensity) of an
+// RGB color. These are the Rec. 601 luma weights.
+constexpr float kBrightnessWeightR = 0.299f;
+constexpr float kBrightnessWeightG = 0.587f;
+constexpr float kBrightnessWeightB = 0.114f;
+
+// Returns the unrounded brightness of an RGB color in [0, 255].
+BADSLAM_HOST_DEVICE float ComputeBrightnessFloat(float r, float g, float b) {
+  return kBrightnessWeightR * r + kBrightnessWeightG * g + kBrightnessWeightB * b;
+}
+
+// Returns the brightness of an RGB color, truncated to an integer. This is
+// used for the grayscale images for loop detection.
+BADSLAM_HOST_DEVICE u8 ComputeBrightness(u8 r, u8 g, u8 b) {
+  return static_cast<u8>(ComputeBrightnessFloat(r, g, b));
+}
+
+// Returns the rounded brightness of an RGB color. This is used for the
+// intensity channel of the keyframe color images, both on the GPU and on the
+// CPU, which therefore must always compute the same result.
+BADSLAM_HOST_DEVICE u8 ComputeRoundedBrightness(u8 r, u8 g, u8 b) {
+  return static_cast<u8>(ComputeBrightnessFloat(r, g, b) + 0.5f);
+}
+
+}
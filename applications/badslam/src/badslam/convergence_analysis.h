@@ -29,7 +29,7 @@
 
 #pragma once
 
-#include <cuda_runtime.h>
+#include <vector>
 
 #include <libvis/libvis.h>
 #include <libvis/sophus.h>
@@ -62,4 +62,23 @@ inline bool IsScaleNPoseEstimationConverged(const Eigen::Matrix<float, 6, 1>& x,
   return (scaled_x.squaredNorm() < scaling_factor * scaling_factor * translation_threshold);
 }
 
+// Returns the index of the best pose estimate based on the residual counts and
+// costs of all estimates. An estimate with more than twice the residual count
+// of another one is considered better; otherwise, the one with lower cost is.
+inline usize SelectBestPoseEstimate(
+    const vector<u32>& residual_counts,
+    const vector<float>& costs) {
+  usize best = 0;
+  for (usize i = 1; i < residual_counts.size(); ++ i) {
+    if (residual_counts[best] > 2 * residual_counts[i]) {
+      continue;
+    }
+    if (residual_counts[i] > 2 * residual_counts[best] ||
+        costs[i] <= costs[best]) {
+      best = i;
+    }
+  }
+  return best;
+}
+
 }
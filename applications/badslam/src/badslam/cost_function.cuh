@@ -32,26 +32,15 @@
 #include <cuda_runtime.h>
 #include <libvis/libvis.h>
 
+#include "badslam/constants.h"
 #include "badslam/cuda_util.cuh"
 #include "badslam/util.cuh"
-#include "badslam/robust_weighting.cuh"
+#include "badslam/robust_weighting.h"
 
 namespace vis {
 
 // --- Depth (geometric) residual ---
 
-// Weight factor on the depth residual in the cost term.
-constexpr float kDepthResidualWeight = 1.f;
-
-// Default Tukey parameter (= factor on standard deviation at which the
-// residuals have zero weight). This gets scaled for multi-res pose estimation.
-constexpr float kDepthResidualDefaultTukeyParam = 10.f;
-
-// Expected stereo matching uncertainty in pixels in the depth estimation
-// process. Determines the final propagated depth uncertainty.
-constexpr float kDepthUncertaintyEmpiricalFactor = 0.1f;
-
-
 // Computes the "raw" depth (geometric) residual, i.e., without any weighting.
 __forceinline__ __device__ void ComputeRawDepthResidual(
     const PixelCenterUnprojector& unprojector,
@@ -100,15 +89,6 @@ __forceinline__ __device__ float ComputeWeightedDepthResidual(float raw_residual
 
 // --- Descriptor (photometric) residual ---
 
-// Weight factor from the cost term.
-// TODO: Tune further. Make parameter?
-constexpr float kDescriptorResidualWeight = 1e-2f;
-
-// Parameter for the Huber robust loss function for photometric residuals.
-// TODO: Make parameter?
-constexpr float kDescriptorResidualHuberParameter = 10.f;
-
-
 // Computes the projections in an image of two (mostly) fixed points on the
 // border of a surfel, whose direction to the surfel center differs by 90
 // degrees. These points are used to compute the descriptor residual.
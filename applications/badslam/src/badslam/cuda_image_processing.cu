@@ -32,6 +32,7 @@
 #include <libvis/cuda/cuda_auto_tuner.h>
 #include <math_constants.h>
 
+#include "badslam/brightness.h"
 #include "badslam/cuda_util.cuh"
 #include "badslam/cuda_matrix.cuh"
 #include "badslam/util.cuh"
@@ -49,7 +50,7 @@ __global__ void ComputeSobelGradientMagnitudeKernel(
   
   uchar3 color = rgb_buffer(::max(0, ::min(color_buffer.height() - 1, y)),
                             ::max(0, ::min(color_buffer.width() - 1, x)));
-  intensity[threadIdx.y][threadIdx.x] = 0.299f * color.x + 0.587f * color.y + 0.114f * color.z;
+  intensity[threadIdx.y][threadIdx.x] = ComputeBrightnessFloat(color.x, color.y, color.z);
   
   __syncthreads();
   
@@ -170,7 +171,7 @@ __global__ void ComputeBrightnessKernel(
   
   if (x < color_buffer.width() && y < color_buffer.height()) {
     uchar3 color = rgb_buffer(y, x);
-    u8 intensity = (0.299f * color.x + 0.587f * color.y + 0.114f * color.z) + 0.5f;
+    u8 intensity = ComputeRoundedBrightness(color.x, color.y, color.z);
     color_buffer(y, x) = make_uchar4(color.x, color.y, color.z, intensity);
   }
 }
@@ -0,0 +1,79 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "badslam/depth_parameters_cpu.h"
+
+#include <cmath>
+
+#include "badslam/constants.h"
+
+namespace vis {
+
+float DepthParametersCPU::RawToDepth(int x, int y, u16 raw_depth) const {
+  if (cfactor.empty()) {
+    return raw_to_float_depth * raw_depth;
+  }
+  const float c = cfactor(x / sparse_surfel_cell_size, y / sparse_surfel_cell_size);
+  const float inv_depth = 1.0f / (raw_to_float_depth * raw_depth);
+  return 1.f / (inv_depth + c * expf(- a * inv_depth));
+}
+
+u16 DepthParametersCPU::DepthToRaw(int x, int y, float depth) const {
+  if (!(depth > 0)) {
+    return 0;
+  }
+  
+  float raw_inv_depth = 1.f / depth;
+  if (!cfactor.empty()) {
+    // Solve inv_raw + c * exp(-a * inv_raw) = 1 / depth for inv_raw with
+    // Newton's method. The deformation is small, so starting from the
+    // calibrated value converges within a few iterations.
+    const float c = cfactor(x / sparse_surfel_cell_size, y / sparse_surfel_cell_size);
+    const float calibrated_inv_depth = 1.f / depth;
+    for (int iteration = 0; iteration < 5; ++ iteration) {
+      const float c_exp = c * expf(- a * raw_inv_depth);
+      const float f = raw_inv_depth + c_exp - calibrated_inv_depth;
+      const float derivative = 1 - a * c_exp;
+      if (fabs(derivative) < 1e-6f) {
+        break;
+      }
+      raw_inv_depth -= f / derivative;
+    }
+    if (!(raw_inv_depth > 0)) {
+      return 0;
+    }
+  }
+  
+  const float raw = 1.f / (raw_inv_depth * raw_to_float_depth) + 0.5f;
+  if (!(raw >= 1) || raw >= kInvalidDepthBit) {
+    return 0;
+  }
+  return static_cast<u16>(raw);
+}
+
+}
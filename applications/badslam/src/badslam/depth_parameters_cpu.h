@@ -0,0 +1,66 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <libvis/image.h>
+#include <libvis/libvis.h>
+
+namespace vis {
+
+// Host-side counterpart of DepthParameters (see surfel_projection.cuh): the
+// depth deformation parameters, used to convert between raw and calibrated
+// depth values on the CPU.
+struct DepthParametersCPU {
+  // Converts the raw depth at pixel (x, y) to calibrated metric depth.
+  float RawToDepth(int x, int y, u16 raw_depth) const;
+  
+  // Inverse of RawToDepth(). Returns 0 if the depth cannot be represented.
+  u16 DepthToRaw(int x, int y, float depth) const;
+  
+  // Image of "c" factors, with one value per sparse_surfel_cell_size^2 pixels.
+  // If empty, no depth deformation is applied.
+  Image<float> cfactor;
+  
+  // Factor \alpha_1 in depth distortion compensation.
+  float a = 0;
+  
+  // Factor which is applied to the raw depth values (of type unsigned short) to
+  // obtain metric depth values in meters.
+  float raw_to_float_depth = 1.f / 1000.f;
+  
+  // The baseline (in meters) times the focal length (in pixels) of the
+  // stereo system which was used to estimate the input depth images. Used
+  // to estimate the depth uncertainty.
+  float baseline_fx = 0;
+  
+  // Surfel sparsification grid cell size (see DepthParameters).
+  int sparse_surfel_cell_size = 1;
+};
+
+}
@@ -36,6 +36,7 @@
 #include "badslam/direct_ba.h"
 
 #include <algorithm>
+#include <unordered_map>
 
 #include <libvis/camera_frustum.h>
 #include <libvis/image_display.h>
@@ -43,10 +44,11 @@
 
 #include "badslam/bad_slam.h"
 #include "badslam/convergence_analysis.h"
+#include "badslam/keyframe_merging.h"
 #include "badslam/util.cuh"
 #include "badslam/loop_detector.h"
 #include "badslam/pose_graph_optimizer.h"
-#include "badslam/robust_weighting.cuh"
+#include "badslam/robust_weighting.h"
 #include "badslam/util.h"
 
 
@@ -105,6 +107,8 @@ DirectBA::DirectBA(
           /*a_rows*/ 4 + 1),
       render_window_(render_window),
       global_T_anchor_frame_(global_T_anchor_frame) {
+  keyframe_buffer_pool_.reset(new CUDABufferPool());
+  
   depth_params_.a = 0;
   cfactor_buffer_.reset(new CUDABuffer<float>(
       (depth_camera_.height() - 1) / sparse_surfel_cell_size + 1,
@@ -117,6 +121,9 @@ DirectBA::DirectBA(
   depth_params_.baseline_fx = baseline_fx;
   depth_params_.sparse_surfel_cell_size = sparse_surfel_cell_size;
   
+  PublishCalibration();
+  PublishKeyframePoses();
+  
   surfels_size_ = 0;
   surfel_count_ = 0;
   surfels_.reset(new CUDABuffer<float>(kSurfelAttributeCount, max_surfel_count));
@@ -124,6 +131,7 @@ DirectBA::DirectBA(
   
   ba_iteration_count_ = 0;
   last_ba_iteration_count_ = -1;
+  keyframe_generation_ = 0;
   
   new_surfels_temp_storage_ = nullptr;
   new_surfels_temp_storage_bytes_ = 0;
@@ -198,13 +206,16 @@ void DirectBA::AddKeyframe(
   DetermineNewKeyframeCoVisibility(new_keyframe);
   
   keyframes_.push_back(new_keyframe);
+  
+  PublishKeyframePoses();
 }
 
 void DirectBA::DeleteKeyframe(
     int keyframe_index,
     LoopDetector* loop_detector) {
-  // TODO: Re-use the deleted keyframe's buffers for new keyframes, since
-  //       CUDA memory allocation is very slow.
+  // NOTE: The deleted keyframe's buffers are returned to
+  //       keyframe_buffer_pool_ (if they came from it) and re-used for new
+  //       keyframes, since CUDA memory allocation is very slow.
   shared_ptr<Keyframe> frame_to_delete = keyframes_[keyframe_index];
   for (u32 covis_keyframe_index : frame_to_delete->co_visibility_list()) {
     Keyframe* covis_frame = keyframes_[covis_keyframe_index].get();
@@ -218,10 +229,35 @@ void DirectBA::DeleteKeyframe(
   }
   
   keyframes_[keyframe_index].reset();
+  ++ keyframe_generation_;
   
   if (loop_detector) {
     loop_detector->RemoveImage(keyframe_index);
   }
+  
+  PublishKeyframePoses();
+}
+
+void DirectBA::PublishKeyframePoses() {
+  KeyframePoses poses;
+  poses.global_T_keyframe.resize(keyframes_.size());
+  poses.keyframe_exists.resize(keyframes_.size());
+  for (usize keyframe_index = 0; keyframe_index < keyframes_.size(); ++ keyframe_index) {
+    const shared_ptr<Keyframe>& keyframe = keyframes_[keyframe_index];
+    poses.keyframe_exists[keyframe_index] = (keyframe != nullptr);
+    if (keyframe) {
+      poses.global_T_keyframe[keyframe_index] = keyframe->global_T_frame();
+    }
+  }
+  keyframe_poses_.Publish(poses);
+}
+
+void DirectBA::PublishCalibration() {
+  Calibration calibration;
+  calibration.color_camera = color_camera_;
+  calibration.depth_camera = depth_camera_;
+  calibration.depth_params = depth_params_;
+  calibration_.Publish(calibration);
 }
 
 void DirectBA::DetermineNewKeyframeCoVisibility(const shared_ptr<Keyframe>& new_keyframe) {
@@ -244,13 +280,64 @@ void DirectBA::DetermineNewKeyframeCoVisibility(const shared_ptr<Keyframe>& new_
   }
 }
 
+usize DirectBA::EvictInactiveKeyframes(
+    cudaStream_t stream,
+    usize max_evict_count) {
+  if (!keyframe_storage_) {
+    return 0;
+  }
+  
+  // Order the candidates by the last BA iteration in which they were active or
+  // co-visible active.
+  vector<pair<int, Keyframe*>> candidates;
+  for (const shared_ptr<Keyframe>& keyframe : keyframes_) {
+    if (keyframe &&
+        keyframe->activation() == Keyframe::Activation::kInactive &&
+        keyframe->is_resident() &&
+        !keyframe->is_pinned()) {
+      candidates.emplace_back(
+          std::max(keyframe->last_active_in_ba_iteration(),
+                   keyframe->last_covis_in_ba_iteration()),
+          keyframe.get());
+    }
+  }
+  std::sort(candidates.begin(), candidates.end(),
+            [](const pair<int, Keyframe*>& a, const pair<int, Keyframe*>& b) {
+              return a.first < b.first;
+            });
+  
+  usize evict_count = 0;
+  for (usize i = 0; i < candidates.size() && evict_count < max_evict_count; ++ i) {
+    if (!candidates[i].second->Evict(stream, keyframe_storage_, keyframe_buffer_pool_)) {
+      if (candidates[i].second->is_pinned()) {
+        // The keyframe is in use by another thread.
+        continue;
+      }
+      LOG(ERROR) << "Failed to evict keyframe " << candidates[i].second->id();
+      break;
+    }
+    ++ evict_count;
+  }
+  
+  if (evict_count > 0) {
+    LOG(INFO) << "Evicted " << evict_count << " inactive keyframes from GPU memory ("
+              << keyframe_storage_->stored_keyframe_count() << " keyframes in storage, using "
+              << (keyframe_storage_->stored_bytes() / (1024 * 1024)) << " MB)";
+  }
+  return evict_count;
+}
+
 void DirectBA::MergeKeyframes(
-    cudaStream_t /*stream*/,
+    cudaStream_t stream,
     LoopDetector* loop_detector,
     usize approx_merge_count) {
   // TODO: Make parameters:
   constexpr float kMaxAngleDifference = 0.5f * M_PI_2;
   constexpr float kMaxEuclideanDistance = 0.3f;
+  // Since this runs on the odometry thread while holding the BA lock, limit
+  // the number of keyframes whose images are read per call.
+  constexpr usize kMaxCandidateCount = 15;
+  constexpr usize kMaxNeighborCount = 6;
   
   if (keyframes_.size() <= 1) {
     return;
@@ -298,34 +385,158 @@ void DirectBA::MergeKeyframes(
     }
     prev_half_distance = next_half_distance;
     prev_keyframe_id = keyframe_id;
-    
-    // TODO: Idea for additional criteria:
-    //       Maybe try to compute whether the co-vis frames cover all of one of
-    //       the frames' frustum (such that no geometry is lost in the merge)?
   }
   
-  usize number_of_sorted_distances = std::min(approx_merge_count, distances.size());
+  // Pre-select candidates with the pose criterion, then rank them by how much
+  // of their geometry is also observed by other keyframes.
+  constexpr usize kCandidateFactor = 3;
+  usize number_of_sorted_distances = std::min(
+      std::min(kCandidateFactor * approx_merge_count, kMaxCandidateCount),
+      distances.size());
   std::partial_sort(distances.begin(), distances.begin() + number_of_sorted_distances, distances.end());
+  distances.erase(distances.begin() + number_of_sorted_distances, distances.end());
+  
+  DepthParametersCPU calibration;
+  calibration.raw_to_float_depth = depth_params_.raw_to_float_depth;
+  calibration.a = depth_params_.a;
+  calibration.sparse_surfel_cell_size = depth_params_.sparse_surfel_cell_size;
+  calibration.cfactor.SetSize(cfactor_buffer_->width(), cfactor_buffer_->height());
+  cfactor_buffer_->DownloadAsync(stream, &calibration.cfactor);
+  
+  KeyframeMergeOptions options;
+  
+  // Host copies of the keyframe images, downloaded on first use. Null if the
+  // images are not available.
+  unordered_map<int, shared_ptr<KeyframeImageData>> host_images;
+  auto get_host_images = [&](int keyframe_id) {
+    auto it = host_images.find(keyframe_id);
+    if (it != host_images.end()) {
+      return it->second;
+    }
+    shared_ptr<KeyframeImageData> images(new KeyframeImageData());
+    if (!keyframes_[keyframe_id]->DownloadImages(stream, images.get())) {
+      images.reset();
+    }
+    host_images[keyframe_id] = images;
+    return images;
+  };
+  
+  struct MergeCandidate {
+    bool operator< (const MergeCandidate& other) const {
+      return coverage.coverage > other.coverage.coverage;
+    }
+    
+    int keyframe_id;
+    int target_keyframe_id;
+    KeyframeCoverage coverage;
+  };
+  vector<MergeCandidate> candidates;
+  candidates.reserve(distances.size());
+  
+  for (const MergeKeyframeDistance& merge : distances) {
+    const Keyframe* keyframe = keyframes_[merge.keyframe_id].get();
+    
+    // Use the neighbors in time and the closest co-visible keyframes as merge
+    // targets.
+    vector<pair<float, int>> covisible_by_distance;
+    for (int covisible_id : keyframe->co_visibility_list()) {
+      if (covisible_id == static_cast<int>(merge.prev_keyframe_id) ||
+          covisible_id == static_cast<int>(merge.next_keyframe_id) ||
+          !keyframes_[covisible_id]) {
+        continue;
+      }
+      covisible_by_distance.emplace_back(
+          (keyframes_[covisible_id]->global_T_frame().translation() - keyframe->global_T_frame().translation()).squaredNorm(),
+          covisible_id);
+    }
+    usize covisible_count = std::min(kMaxNeighborCount - 2, covisible_by_distance.size());
+    std::partial_sort(covisible_by_distance.begin(), covisible_by_distance.begin() + covisible_count, covisible_by_distance.end());
+    
+    vector<int> neighbor_ids = {static_cast<int>(merge.prev_keyframe_id), static_cast<int>(merge.next_keyframe_id)};
+    for (usize i = 0; i < covisible_count; ++ i) {
+      neighbor_ids.push_back(covisible_by_distance[i].second);
+    }
+    
+    vector<KeyframeMergeNeighbor> neighbors;
+    vector<int> valid_neighbor_ids;
+    for (int neighbor_id : neighbor_ids) {
+      if (neighbor_id == static_cast<int>(merge.keyframe_id) || !keyframes_[neighbor_id]) {
+        continue;
+      }
+      shared_ptr<KeyframeImageData> neighbor_images = get_host_images(neighbor_id);
+      if (!neighbor_images) {
+        continue;
+      }
+      neighbors.push_back({neighbor_images.get(), keyframes_[neighbor_id]->global_T_frame()});
+      valid_neighbor_ids.push_back(neighbor_id);
+    }
+    
+    shared_ptr<KeyframeImageData> keyframe_images = get_host_images(merge.keyframe_id);
+    if (!keyframe_images) {
+      continue;
+    }
+    
+    MergeCandidate candidate;
+    candidate.keyframe_id = merge.keyframe_id;
+    candidate.coverage = ComputeKeyframeCoverage(
+        *keyframe_images, keyframe->global_T_frame(),
+        neighbors, depth_camera_, calibration, options);
+    // Do not merge keyframes whose geometry is not observed by any neighbor,
+    // since all of it would be lost.
+    if (candidate.coverage.best_neighbor < 0 || candidate.coverage.coverage <= 0) {
+      continue;
+    }
+    candidate.target_keyframe_id = valid_neighbor_ids[candidate.coverage.best_neighbor];
+    candidates.push_back(candidate);
+  }
+  
+  // Merge the best-covered keyframes first, since they lose the least
+  // geometry.
+  std::stable_sort(candidates.begin(), candidates.end());
   
   if (loop_detector) {
     loop_detector->LockDetectorMutex();
   }
   
-  for (usize i = 0; i < number_of_sorted_distances; ++ i) {
-    const MergeKeyframeDistance& merge = distances[i];
-    if (!keyframes_[merge.prev_keyframe_id] || !keyframes_[merge.keyframe_id] || !keyframes_[merge.next_keyframe_id]) {
+  usize merge_count = 0;
+  for (const MergeCandidate& candidate : candidates) {
+    if (merge_count >= approx_merge_count) {
+      break;
+    }
+    if (!keyframes_[candidate.keyframe_id] || !keyframes_[candidate.target_keyframe_id]) {
       // One of the keyframes has been deleted by a previous merge.
       // Since we only do an approximate number of merges, simply ignore this
-      // merge entry (instead of updating the distance).
+      // merge entry (instead of updating the coverage).
+      continue;
+    }
+    
+    const shared_ptr<Keyframe>& keyframe = keyframes_[candidate.keyframe_id];
+    const shared_ptr<Keyframe>& target = keyframes_[candidate.target_keyframe_id];
+    shared_ptr<KeyframeImageData> target_images = get_host_images(candidate.target_keyframe_id);
+    if (!target_images) {
       continue;
     }
+    KeyframeMergeStatistics statistics;
+    MergeKeyframeImages(
+        *get_host_images(candidate.keyframe_id), keyframe->global_T_frame(),
+        target_images.get(), target->global_T_frame(),
+        depth_camera_, color_camera_, calibration, options, &statistics);
+    if (statistics.fused_pixel_count + statistics.filled_pixel_count > 0) {
+      if (target->UploadImages(stream, *target_images)) {
+        target->ExtendDepthRange(statistics.min_depth, statistics.max_depth);
+      } else {
+        LOG(ERROR) << "Failed to update the images of keyframe " << candidate.target_keyframe_id << " after merging";
+      }
+    }
     
-    // TODO: Actually merge the frame into the other (and possibly other
-    //       frames with co-visibility). At the moment, the frame is simply
-    //       deleted.
-    DeleteKeyframe(merge.keyframe_id, loop_detector);
+    host_images.erase(candidate.keyframe_id);
+    DeleteKeyframe(candidate.keyframe_id, loop_detector);
+    ++ merge_count;
     
-    LOG(ERROR) << "Deleted keyframe with ID " << merge.keyframe_id;
+    LOG(INFO) << "Merged keyframe " << candidate.keyframe_id << " into keyframe "
+              << candidate.target_keyframe_id << " (coverage: " << candidate.coverage.coverage
+              << ", fused pixels: " << statistics.fused_pixel_count
+              << ", filled pixels: " << statistics.filled_pixel_count << ")";
   }
   
   if (loop_detector) {
@@ -337,6 +548,11 @@ void DirectBA::CreateSurfelsForKeyframe(
     cudaStream_t stream,
     bool filter_new_surfels,
     const shared_ptr<Keyframe>& keyframe) {
+  KeyframeResidencyPin pin = keyframe->Pin(stream);
+  if (!pin) {
+    return;
+  }
+  
   CUDABuffer<u32>* supporting_surfels[kMergeBufferCount];
   for (int i = 0; i < kMergeBufferCount; ++ i) {
     supporting_surfels[i] = supporting_surfels_[i].get();
@@ -579,6 +795,10 @@ void DirectBA::PerformBASchemeEndTasks(
       }
       
       if (keyframe->last_active_in_ba_iteration() == ba_iteration_count_) {
+        KeyframeResidencyPin pin = keyframe->Pin(stream);
+        if (!pin) {
+          continue;
+        }
         DetermineSupportingSurfelsAndMergeSurfelsCUDA(
             stream,
             surfel_merge_dist_factor_,
@@ -43,6 +43,8 @@
 #include "badslam/kernels.cuh"
 #include "badslam/kernels.h"
 #include "badslam/keyframe.h"
+#include "badslam/resumable_ba_iteration.h"
+#include "badslam/snapshot.h"
 
 // #define DEBUG_LOCKING
 
@@ -100,14 +102,32 @@ class DirectBA {
       int keyframe_index,
       LoopDetector* loop_detector);
   
-  // Merges keyframes to free up GPU memory.
+  // Merges keyframes to free up GPU memory. A limited number of candidates is
+  // pre-selected by their pose distance to the neighboring keyframes and
+  // ranked by how much of their depth is observed by their neighbors in time
+  // and their closest co-visible keyframes. Candidates which no neighbor
+  // observes are not merged. The depth and color of each merged keyframe is
+  // fused into the neighbor which observes most of it (see
+  // MergeKeyframeImages()), then the keyframe is deleted. The images of evicted
+  // keyframes are read from and written to the keyframe storage, without
+  // transferring them back to the GPU.
   // NOTE: This leads to nullptr entries in the keyframes vector.
-  // TODO: This is currently misnamed, since it does not merge keyframes but simply delete them.
   void MergeKeyframes(
       cudaStream_t stream,
       LoopDetector* loop_detector,
       usize approx_merge_count = 10);
   
+  // Evicts the GPU image data of up to max_evict_count inactive keyframes (see
+  // Keyframe::Activation) to the keyframe storage, preferring the keyframes
+  // that have been inactive for the longest time. Pinned keyframes are skipped.
+  // Evicted keyframes are transferred back to the GPU when they are pinned
+  // again (see Keyframe::Pin()). Does nothing if no keyframe storage is set.
+  // Returns the number of evicted keyframes.
+  // NOTE: Keyframes only become inactive if deactivation is enabled.
+  usize EvictInactiveKeyframes(
+      cudaStream_t stream,
+      usize max_evict_count);
+  
   // Creates new surfels for the depth pixels of the given keyframe which do not
   // correspond to existing surfels. If filter_new_surfels is true, applies
   // outlier filtering to discard new surfels which are considered outliers.
@@ -137,6 +157,11 @@ class DirectBA {
   // update equation instead of an alternating optimization scheme. This means
   // that a single optimization iteration will take more time, but it might
   // converge faster overall.
+  // If a timer is given, the alternating scheme stops once the timer exceeds
+  // time_limit. This is checked before each work item within an iteration
+  // (for example, the pose optimization of a single keyframe). The remaining
+  // work of an interrupted iteration is continued in the next call. The PCG
+  // scheme only checks the time limit between iterations.
   // NOTE: The implementation to this function is in separate files due to its
   //       length. For use_pcg == false, it is in direct_ba_alternating.cc, and
   //       for use_pcg == true, it is in direct_ba_pcg.cc.
@@ -184,15 +209,53 @@ class DirectBA {
   void UpdateKeyframeCoVisibility(const shared_ptr<Keyframe>& keyframe);
   
   
+  // Camera intrinsics and depth parameters, which are always published
+  // together such that readers get a consistent set of them.
+  struct Calibration {
+    PinholeCamera4f color_camera;
+    PinholeCamera4f depth_camera;
+    DepthParameters depth_params;
+  };
+  
+  // Global poses of the keyframes, indexed by keyframe ID. For deleted
+  // keyframes, keyframe_exists is false.
+  struct KeyframePoses {
+    vector<SE3f> global_T_keyframe;
+    vector<bool> keyframe_exists;
+  };
+  
+  // Returns the current snapshot of the calibration. This does not lock
+  // ba_thread_mutex_, so it is cheap to call from the odometry and loop
+  // detection threads while BA is running. Be aware though that the content
+  // of the cfactor_buffer in the depth parameters can still change, since it
+  // points to GPU data.
+  inline shared_ptr<const Snapshot<Calibration>> calibration_snapshot() const {
+    return calibration_.Read();
+  }
+  
+  // Returns the current snapshot of the keyframe poses, without locking
+  // ba_thread_mutex_. The snapshot is updated after each pose optimization
+  // pass of BA, and when keyframes are added or deleted. Code outside of
+  // DirectBA which modifies keyframe poses must call PublishKeyframePoses()
+  // afterwards.
+  inline shared_ptr<const Snapshot<KeyframePoses>> keyframe_poses_snapshot() const {
+    return keyframe_poses_.Read();
+  }
+  
+  // Publishes a new snapshot of the current keyframe poses. If using parallel
+  // BA, ba_thread_mutex_ must be locked when calling this.
+  void PublishKeyframePoses();
+  
   // Locks the ba_thread_mutex_ which is used with parallel BA.
   // If using parallel BA, this mutex must be locked for accessing:
   // - keyframes()
-  // - color_camera()
-  // - depth_camera()
-  // - depth_params()
-  // - a()
+  // - color_camera_no_lock()
+  // - depth_camera_no_lock()
+  // - depth_params_no_lock()
   // - ba_iteration_count_
   // - TODO: for which other accesses as well?
+  // The calibration (color_camera(), depth_camera(), depth_params(), a()) and
+  // the keyframe poses can be read without locking from their snapshots.
   inline void Lock() const {
     ba_thread_mutex_.lock();
   }
@@ -233,16 +296,18 @@ class DirectBA {
 #endif
     return keyframes_;
   }
+  // Since the caller may change the keyframe set, this discards an interrupted
+  // BA iteration (see keyframe_generation_).
   inline vector<shared_ptr<Keyframe>>* keyframes_mutable() {
 #ifdef DEBUG_LOCKING
     CHECK(!ba_thread_mutex_.try_lock());
 #endif
+    ++ keyframe_generation_;
     return &keyframes_;
   }
   
   inline PinholeCamera4f color_camera() const {
-    lock_guard<mutex> lock(ba_thread_mutex_);
-    return color_camera_;
+    return calibration_.Read()->value.color_camera;
   }
   inline PinholeCamera4f color_camera_no_lock() const {
 #ifdef DEBUG_LOCKING
@@ -253,14 +318,14 @@ class DirectBA {
   inline void SetColorCamera(const PinholeCamera4f& camera) {
     lock_guard<mutex> lock(ba_thread_mutex_);
     color_camera_ = camera;
+    PublishCalibration();
   }
   
   inline int pyramid_level_for_color() const { return pyramid_level_for_color_; }
   inline void SetPyramidLevelForColor(int level) { pyramid_level_for_color_ = level; }
   
   inline PinholeCamera4f depth_camera() const {
-    lock_guard<mutex> lock(ba_thread_mutex_);
-    return depth_camera_;
+    return calibration_.Read()->value.depth_camera;
   }
   inline PinholeCamera4f depth_camera_no_lock() const {
 #ifdef DEBUG_LOCKING
@@ -271,11 +336,11 @@ class DirectBA {
   inline void SetDepthCamera(const PinholeCamera4f& camera) {
     lock_guard<mutex> lock(ba_thread_mutex_);
     depth_camera_ = camera;
+    PublishCalibration();
   }
   
   inline DepthParameters depth_params() const {
-    lock_guard<mutex> lock(ba_thread_mutex_);
-    return depth_params_;
+    return calibration_.Read()->value.depth_params;
   }
   inline DepthParameters depth_params_no_lock() const {
 #ifdef DEBUG_LOCKING
@@ -286,16 +351,16 @@ class DirectBA {
   inline void SetDepthParams(const DepthParameters& params) {
     lock_guard<mutex> lock(ba_thread_mutex_);
     depth_params_ = params;
+    PublishCalibration();
   }
   
-  inline float& a() {
-#ifdef DEBUG_LOCKING
-    CHECK(!ba_thread_mutex_.try_lock());
-#endif
-    return depth_params_.a;
-  }
   inline float a() const {
-    return depth_params_.a;
+    return calibration_.Read()->value.depth_params.a;
+  }
+  inline void SetA(float a) {
+    lock_guard<mutex> lock(ba_thread_mutex_);
+    depth_params_.a = a;
+    PublishCalibration();
   }
   
   inline CUDABufferPtr<float> cfactor_buffer() {
@@ -305,8 +370,10 @@ class DirectBA {
     return cfactor_buffer_;
   }
   inline void SetCFactorBuffer(const CUDABufferPtr<float>& cfactor_buffer) {
+    lock_guard<mutex> lock(ba_thread_mutex_);
     cfactor_buffer_ = cfactor_buffer;
     depth_params_.cfactor_buffer = cfactor_buffer_->ToCUDA();
+    PublishCalibration();
   }
   
   inline void IncreaseBAIterationCount() {
@@ -332,7 +399,9 @@ class DirectBA {
     return depth_params_.sparse_surfel_cell_size;
   }
   inline void SetSparsificationSideFactor(int sparse_surfel_cell_size) {
+    lock_guard<mutex> lock(ba_thread_mutex_);
     depth_params_.sparse_surfel_cell_size = sparse_surfel_cell_size;
+    PublishCalibration();
   }
   
   inline int min_observation_count_while_bootstrapping_1() const {
@@ -376,11 +445,25 @@ class DirectBA {
   inline int last_ba_iteration_count() const { return last_ba_iteration_count_; }
   inline void SetLastBAIterationCount(int count) { last_ba_iteration_count_ = count; }
   
+  // Returns whether an alternating BA iteration was interrupted because it
+  // reached its time limit. Its remaining work is done by the next call to
+  // BundleAdjustment().
+  inline bool has_interrupted_ba_iteration() const { return alternating_ba_iteration_.in_progress(); }
+  
   inline float surfel_merge_dist_factor() const { return surfel_merge_dist_factor_; }
   inline void SetSurfelMergeDistFactor(float factor) { surfel_merge_dist_factor_ = factor; }
   
   inline void SetSaveTimings(std::ofstream* stream) { timings_stream_ = stream; }
   
+  // Pool for the GPU buffers of keyframes. Deleted and evicted keyframes
+  // return their buffers to this pool such that new keyframes can re-use them.
+  // The pool is not size-limited; BadSlam::CreateKeyframe() counts the pooled
+  // memory as free and trims the pool if the GPU memory becomes low.
+  inline const shared_ptr<CUDABufferPool>& keyframe_buffer_pool() const { return keyframe_buffer_pool_; }
+  
+  inline const shared_ptr<KeyframeStorage>& keyframe_storage() const { return keyframe_storage_; }
+  inline void SetKeyframeStorage(const shared_ptr<KeyframeStorage>& storage) { keyframe_storage_ = storage; }
+  
   inline void SetVisualization(bool visualize_normals, bool visualize_descriptors, bool visualize_radii) {
     visualize_normals_ = visualize_normals;
     visualize_descriptors_ = visualize_descriptors;
@@ -430,6 +513,11 @@ class DirectBA {
   
   void DetermineCovisibleActiveKeyframes();
   
+  // Publishes a new snapshot of color_camera_, depth_camera_, and
+  // depth_params_. Must be called after each change to them. If using
+  // parallel BA, ba_thread_mutex_ must be locked when calling this.
+  void PublishCalibration();
+  
   void DetermineNewKeyframeCoVisibility(const shared_ptr<Keyframe>& new_keyframe);
   
   void PerformBASchemeEndTasks(
@@ -456,11 +544,22 @@ class DirectBA {
   
   DepthParameters depth_params_;
   
+  // Snapshots of the calibration above, and of the keyframe poses, for
+  // lock-free reading.
+  SnapshotPublisher<Calibration> calibration_;
+  SnapshotPublisher<KeyframePoses> keyframe_poses_;
+  
   // Vector of all keyframes. Indexed by: [keyframe_id].
   // The ordering is such that keyframes with larger ID correspond to frames
   // that are later in the video.
   vector<shared_ptr<Keyframe>> keyframes_;
   
+  shared_ptr<CUDABufferPool> keyframe_buffer_pool_;
+  
+  // Storage for the image data of evicted keyframes. May be null, which
+  // disables keyframe eviction.
+  shared_ptr<KeyframeStorage> keyframe_storage_;
+  
   // Number of valid surfels.
   u32 surfel_count_;
   
@@ -484,6 +583,48 @@ class DirectBA {
   int ba_iteration_count_;
   int last_ba_iteration_count_;
   
+  // Incremented whenever keyframes are deleted or keyframes_ is modified
+  // otherwise, except for appending keyframes. An interrupted BA iteration is
+  // discarded if this changed in the meantime, since its phases index
+  // keyframes_ based on the keyframe set that it was started with. Appended
+  // keyframes keep these indices valid.
+  u64 keyframe_generation_;
+  
+  // State of the current alternating BA iteration which is shared between its
+  // phases (see BundleAdjustmentAlternating()). If the iteration is
+  // interrupted by reaching the time limit, this is kept until the iteration
+  // is continued in the next call.
+  struct AlternatingBAIterationState {
+    // Options that the iteration was started with.
+    bool optimize_depth_intrinsics;
+    bool optimize_color_intrinsics;
+    bool do_surfel_updates;
+    bool optimize_poses;
+    bool optimize_geometry;
+    int active_keyframe_window_start;
+    int active_keyframe_window_end;
+    bool local_keyframe_window;
+    int fixed_ba_iteration_count;
+    u64 keyframe_generation;
+    
+    // IDs of the keyframes for which surfels are created in this iteration.
+    vector<u32> keyframes_with_new_surfels;
+    
+    // Surfel buffer size before surfel creation.
+    usize old_surfels_size;
+    
+    // Number of keyframes whose pose did not change in pose optimization.
+    usize num_converged;
+  };
+  ResumableBAIteration alternating_ba_iteration_;
+  AlternatingBAIterationState alternating_ba_iteration_state_;
+  
+  // Whether the warning about local keyframe windows in
+  // BundleAdjustmentAlternating() has been printed. It is only printed once,
+  // since the parallel BA thread may use local keyframe windows in most of its
+  // iterations (see BAWindowScheduler).
+  bool window_warning_printed_ = false;
+  
   // Settings.
   bool use_depth_residuals_;
   bool use_descriptor_residuals_;
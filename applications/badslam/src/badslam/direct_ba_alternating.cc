@@ -39,6 +39,10 @@ namespace vis {
 
 constexpr bool kDebugVerifySurfelCount = false;
 
+// Verifies that surfel activation within local keyframe windows only activates
+// the surfels observed by the window's keyframes.
+constexpr bool kDebugVerifyActiveSurfelCount = false;
+
 void DirectBA::EstimateFramePose(cudaStream_t stream,
                                  const SE3f& global_T_frame_initial_estimate,
                                  const CUDABuffer<u16>& depth_buffer,
@@ -318,37 +322,60 @@ void DirectBA::BundleAdjustmentAlternating(
         do_surfel_updates);
   }
   
+  // Read after the end tasks above, which may delete keyframes.
+  Lock();
+  u64 keyframe_generation = keyframe_generation_;
+  Unlock();
+  
+  // An iteration which was interrupted by the time limit in a previous call is
+  // continued with the options it was started with. It is discarded if the BA
+  // iteration block has changed in the meantime, since the end tasks of the
+  // block may have deleted keyframes and surfels, or if keyframes have been
+  // deleted, since the phases would then skip or repeat keyframes. Keyframes
+  // which have been appended in the meantime are included by the phases which
+  // iterate over all keyframes, and otherwise handled in the next iteration.
+  // The surfel counts are consistent in either case, since the iteration is
+  // only interrupted at points where they are (see the surfel merge phase).
+  AlternatingBAIterationState& state = alternating_ba_iteration_state_;
+  if (alternating_ba_iteration_.in_progress() &&
+      (state.fixed_ba_iteration_count != fixed_ba_iteration_count ||
+       state.keyframe_generation != keyframe_generation)) {
+    alternating_ba_iteration_.Reset();
+  }
+  bool resuming_iteration = alternating_ba_iteration_.in_progress();
+  
   CUDABuffer<u32>* supporting_surfels[kMergeBufferCount];
   for (int i = 0; i < kMergeBufferCount; ++ i) {
     supporting_surfels[i] = supporting_surfels_[i].get();
   }
   
-  vector<u32> keyframes_with_new_surfels;
-  keyframes_with_new_surfels.reserve(keyframes_.size());
-  
-  
-  bool fixed_active_keyframe_set =
-      active_keyframe_window_start > 0 || active_keyframe_window_end > 0;
-  
-  if (active_keyframe_window_start != 0 || active_keyframe_window_end != keyframes_.size() - 1) {
+  if ((active_keyframe_window_start != 0 || active_keyframe_window_end != keyframes_.size() - 1) &&
+      !window_warning_printed_) {
+    window_warning_printed_ = true;
     LOG(WARNING) << "Currently, only using all keyframes in every optimization iteration will work properly. Deactivated keyframes will not be used for surfel descriptor optimization, potentially leaving some surfel descriptors in a bad state.";
   }
   
-  // Initialize surfel active states.
-  cudaMemsetAsync(active_surfels_->ToCUDA().address(), 0, surfels_size_ * sizeof(u8), stream);
+  // Initialize surfel active states (unless continuing an iteration which
+  // already determined them).
+  if (!resuming_iteration) {
+    cudaMemsetAsync(active_surfels_->ToCUDA().address(), 0, surfels_size_ * sizeof(u8), stream);
+  }
   
   if (kDebugVerifySurfelCount) {
     DebugVerifySurfelCount(stream, surfel_count_, surfels_size_, *surfels_);
   }
   
-  // Perform BA iterations.
-  for (int iteration = 0; iteration < max_iterations; ++ iteration) {
-    if (progress_function && !progress_function(iteration)) {
-      break;
-    }
-    if (num_iterations_done) {
-      ++ *num_iterations_done;
-    }
+  // Each iteration is split into phases and work items (see
+  // ResumableBAIteration), such that it can be interrupted if the time limit
+  // is reached within the iteration. State which is shared between the phases
+  // is kept in alternating_ba_iteration_state_ such that it is preserved
+  // until the iteration is continued.
+  vector<BAPhase> phases(6);
+  
+  // --- SURFEL CREATION ---
+  phases[0].begin = [&]() -> usize {
+    bool fixed_active_keyframe_set =
+        state.active_keyframe_window_start > 0 || state.active_keyframe_window_end > 0;
     
     // Keyframe activation in case of fixed window
     if (fixed_active_keyframe_set) {
@@ -359,7 +386,7 @@ void DirectBA::BundleAdjustmentAlternating(
           continue;
         }
         
-        if (keyframe_index >= static_cast<u32>(active_keyframe_window_start) && keyframe_index <= static_cast<u32>(active_keyframe_window_end)) {
+        if (keyframe_index >= static_cast<u32>(state.active_keyframe_window_start) && keyframe_index <= static_cast<u32>(state.active_keyframe_window_end)) {
           keyframes_[keyframe_index]->SetActivation(Keyframe::Activation::kActive);
         } else {
           keyframes_[keyframe_index]->SetActivation(Keyframe::Activation::kInactive);
@@ -390,70 +417,100 @@ void DirectBA::BundleAdjustmentAlternating(
         }
       }
       
-      LOG(INFO) << "[iteration " << iteration << "] active: " << debug_active_count << ", covis-active: " << debug_covisible_active_count << ", inactive: " << debug_inactive_count;
+      LOG(INFO) << "active: " << debug_active_count << ", covis-active: " << debug_covisible_active_count << ", inactive: " << debug_inactive_count;
     }
     
-    
-    // --- SURFEL CREATION ---
-    keyframes_with_new_surfels.clear();
+    state.keyframes_with_new_surfels.clear();
     
     CHECK_EQ(surfels_size_, surfel_count_);
-    usize old_surfels_size = surfels_size_;
+    state.old_surfels_size = surfels_size_;
     
-    if (optimize_geometry && do_surfel_updates) {
-      Lock();
-      for (shared_ptr<Keyframe>& keyframe : keyframes_) {
-        if (!keyframe) {
-          continue;
-        }
-        if (keyframe->activation() == Keyframe::Activation::kActive &&
-            keyframe->last_active_in_ba_iteration() != fixed_ba_iteration_count) {
-          keyframe->SetLastActiveInBAIteration(fixed_ba_iteration_count);
-          
-          // This keyframe has become active the first time within this BA
-          // iteration block.
-          keyframes_with_new_surfels.push_back(keyframe->id());
-        } else if (keyframe->activation() == Keyframe::Activation::kCovisibleActive &&
-                  keyframe->last_covis_in_ba_iteration() != fixed_ba_iteration_count) {
-          keyframe->SetLastCovisInBAIteration(fixed_ba_iteration_count);
-        }
+    if (!state.optimize_geometry || !state.do_surfel_updates) {
+      return 0;
+    }
+    
+    Lock();
+    for (shared_ptr<Keyframe>& keyframe : keyframes_) {
+      if (!keyframe) {
+        continue;
       }
-      Unlock();
-      
-      cudaEventRecord(ba_surfel_creation_pre_event_, stream);
-      for (u32 keyframe_id : keyframes_with_new_surfels) {
-        // TODO: Would it be better for performance to group all keyframes
-        //       together that become active in an iteration?
-        CreateSurfelsForKeyframe(stream, /* filter_new_surfels */ true, keyframes_[keyframe_id]);
+      if (keyframe->activation() == Keyframe::Activation::kActive &&
+          keyframe->last_active_in_ba_iteration() != state.fixed_ba_iteration_count) {
+        keyframe->SetLastActiveInBAIteration(state.fixed_ba_iteration_count);
+        
+        // This keyframe has become active the first time within this BA
+        // iteration block.
+        state.keyframes_with_new_surfels.push_back(keyframe->id());
+      } else if (keyframe->activation() == Keyframe::Activation::kCovisibleActive &&
+                keyframe->last_covis_in_ba_iteration() != state.fixed_ba_iteration_count) {
+        keyframe->SetLastCovisInBAIteration(state.fixed_ba_iteration_count);
       }
-      cudaEventRecord(ba_surfel_creation_post_event_, stream);
     }
+    Unlock();
     
-    
-    // --- SURFEL ACTIVATION ---
+    cudaEventRecord(ba_surfel_creation_pre_event_, stream);
+    return state.keyframes_with_new_surfels.size();
+  };
+  phases[0].process_item = [&](usize item_index) {
+    // TODO: Would it be better for performance to group all keyframes
+    //       together that become active in an iteration?
+    const shared_ptr<Keyframe>& keyframe = keyframes_[state.keyframes_with_new_surfels[item_index]];
+    if (keyframe) {
+      CreateSurfelsForKeyframe(stream, /* filter_new_surfels */ true, keyframe);
+    }
+  };
+  phases[0].end = [&]() {
+    if (state.optimize_geometry && state.do_surfel_updates) {
+      cudaEventRecord(ba_surfel_creation_post_event_, stream);
+    }
+  };
+  
+  // --- SURFEL ACTIVATION ---
+  phases[1].begin = []() -> usize {
+    return 1;
+  };
+  phases[1].process_item = [&](usize /*item_index*/) {
     cudaEventRecord(ba_surfel_activation_pre_event_, stream);
     
     // Set new surfels to active | have_been_active.
-    if (optimize_geometry &&
-        surfels_size_ > old_surfels_size) {
-      cudaMemsetAsync(active_surfels_->ToCUDA().address() + old_surfels_size,
+    if (state.optimize_geometry &&
+        surfels_size_ > state.old_surfels_size) {
+      cudaMemsetAsync(active_surfels_->ToCUDA().address() + state.old_surfels_size,
                       kSurfelActiveFlag,
-                      (surfels_size_ - old_surfels_size) * sizeof(u8),
+                      (surfels_size_ - state.old_surfels_size) * sizeof(u8),
                       stream);
     }
     
-    // Update activation state of old surfels.
-    if (active_keyframe_window_start != 0 || active_keyframe_window_end != keyframes_.size() - 1) {
-      cudaMemsetAsync(active_surfels_->ToCUDA().address(), kSurfelActiveFlag, old_surfels_size * sizeof(u8), stream);
-    } else {
-      UpdateSurfelActivationCUDA(
+    // Update activation state of old surfels. Within a local keyframe window
+    // (see BAWindowScheduler), only the surfels observed by the window's
+    // keyframes and the keyframes co-visible with it are activated, such that
+    // the cost of the iteration depends on the window size instead of the map
+    // size.
+    bool local_window = state.local_keyframe_window;
+    UpdateSurfelActivationCUDA(
+        stream,
+        depth_camera_,
+        depth_params_,
+        keyframes_,
+        state.old_surfels_size,
+        surfels_.get(),
+        active_surfels_.get(),
+        /*include_covisible_keyframes*/ local_window);
+    
+    if (kDebugVerifyActiveSurfelCount && local_window) {
+      // Each keyframe pixel is associated with at most one surfel.
+      u32 observing_keyframe_count = 0;
+      for (const shared_ptr<Keyframe>& keyframe : keyframes_) {
+        if (keyframe && keyframe->activation() != Keyframe::Activation::kInactive) {
+          ++ observing_keyframe_count;
+        }
+      }
+      DebugVerifyActiveSurfelCount(
           stream,
-          depth_camera_,
-          depth_params_,
-          keyframes_,
-          old_surfels_size,
-          surfels_.get(),
-          active_surfels_.get());
+          observing_keyframe_count * depth_camera_.width() * depth_camera_.height() +
+              (surfels_size_ - state.old_surfels_size),
+          surfels_size_,
+          *active_surfels_);
     }
     
     cudaEventRecord(ba_surfel_activation_post_event_, stream);
@@ -461,168 +518,245 @@ void DirectBA::BundleAdjustmentAlternating(
     if (kDebugVerifySurfelCount) {
       DebugVerifySurfelCount(stream, surfel_count_, surfels_size_, *surfels_);
     }
+  };
+  
+  // --- GEOMETRY OPTIMIZATION ---
+  phases[2].begin = [&]() -> usize {
+    return state.optimize_geometry ? 1 : 0;
+  };
+  phases[2].process_item = [&](usize /*item_index*/) {
+    cudaEventRecord(ba_geometry_optimization_pre_event_, stream);
+    OptimizeGeometryIterationCUDA(
+        stream,
+        use_depth_residuals_,
+        use_descriptor_residuals_,
+        color_camera_,
+        depth_camera_,
+        depth_params_,
+        keyframes_,
+        surfels_size_,
+        *surfels_,
+        *active_surfels_);
+    cudaEventRecord(ba_geometry_optimization_post_event_, stream);
     
-    
-    // --- GEOMETRY OPTIMIZATION ---
-    if (optimize_geometry) {
-      cudaEventRecord(ba_geometry_optimization_pre_event_, stream);
-      OptimizeGeometryIterationCUDA(
-          stream,
-          use_depth_residuals_,
-          use_descriptor_residuals_,
-          color_camera_,
-          depth_camera_,
-          depth_params_,
-          keyframes_,
-          surfels_size_,
-          *surfels_,
-          *active_surfels_);
-      cudaEventRecord(ba_geometry_optimization_post_event_, stream);
-      
-      if (kDebugVerifySurfelCount) {
-        DebugVerifySurfelCount(stream, surfel_count_, surfels_size_, *surfels_);
-      }
+    if (kDebugVerifySurfelCount) {
+      DebugVerifySurfelCount(stream, surfel_count_, surfels_size_, *surfels_);
+    }
+  };
+  
+  // --- SURFEL MERGE ---
+  // For keyframes for which new surfels were created at the start of the
+  // iteration (a subset of the active keyframes). Merging updates
+  // surfel_count_, while surfels_size_ is only updated by the compaction at
+  // the end of the phase, so the phase must not be interrupted in between.
+  phases[3].preemptible = false;
+  phases[3].begin = [&]() -> usize {
+    if (!state.do_surfel_updates) {
+      return 0;
+    }
+    cudaEventRecord(ba_surfel_merge_pre_event_, stream);
+    return state.keyframes_with_new_surfels.size();
+  };
+  phases[3].process_item = [&](usize item_index) {
+    const shared_ptr<Keyframe>& keyframe = keyframes_[state.keyframes_with_new_surfels[item_index]];
+    if (!keyframe) {
+      return;
+    }
+    KeyframeResidencyPin pin = keyframe->Pin(stream);
+    if (!pin) {
+      return;
+    }
+    
+    // TODO: Run this on the active surfels only if faster, should still be correct
+    u32 surfel_count = surfel_count_;
+    DetermineSupportingSurfelsAndMergeSurfelsCUDA(
+        stream,
+        surfel_merge_dist_factor_,
+        depth_camera_,
+        keyframe->frame_T_global_cuda(),
+        depth_params_,
+        keyframe->depth_buffer(),
+        keyframe->normals_buffer(),
+        surfels_size_,
+        surfels_.get(),
+        supporting_surfels,
+        &surfel_count,
+        &deleted_count_buffer_);
+    Lock();
+    surfel_count_ = surfel_count;
+    Unlock();
+  };
+  phases[3].end = [&]() {
+    if (!state.do_surfel_updates) {
+      return;
     }
+    cudaEventRecord(ba_surfel_merge_post_event_, stream);
     
+    if (kDebugVerifySurfelCount) {
+      DebugVerifySurfelCount(stream, surfel_count_, surfels_size_, *surfels_);
+    }
     
-    // --- SURFEL MERGE ---
-    // For keyframes for which new surfels were created at the start of the
-    // iteration (a subset of the active keyframes).
-    if (do_surfel_updates) {
-      u32 surfel_count = surfel_count_;
-      cudaEventRecord(ba_surfel_merge_pre_event_, stream);
-      for (int keyframe_id : keyframes_with_new_surfels) {
-        const shared_ptr<Keyframe>& keyframe = keyframes_[keyframe_id];
-        if (!keyframe) {
-          continue;
-        }
-        
-        // TODO: Run this on the active surfels only if faster, should still be correct
-        DetermineSupportingSurfelsAndMergeSurfelsCUDA(
-            stream,
-            surfel_merge_dist_factor_,
-            depth_camera_,
-            keyframe->frame_T_global_cuda(),
-            depth_params_,
-            keyframe->depth_buffer(),
-            keyframe->normals_buffer(),
-            surfels_size_,
-            surfels_.get(),
-            supporting_surfels,
-            &surfel_count,
-            &deleted_count_buffer_);
-      }
-      cudaEventRecord(ba_surfel_merge_post_event_, stream);
+    cudaEventRecord(ba_surfel_compaction_pre_event_, stream);
+    if (!state.keyframes_with_new_surfels.empty()) {
+      // Compact the surfels list to increase performance of subsequent kernel calls.
+      // TODO: Only run on the new surfels if possible
+      
+      u32 surfels_size = surfels_size_;
+      CompactSurfelsCUDA(stream, &free_spots_temp_storage_, &free_spots_temp_storage_bytes_, surfel_count_, &surfels_size, &surfels_->ToCUDA(), &active_surfels_->ToCUDA());
       Lock();
-      surfel_count_ = surfel_count;
+      surfels_size_ = surfels_size;
       Unlock();
-      
-      if (kDebugVerifySurfelCount) {
-        DebugVerifySurfelCount(stream, surfel_count_, surfels_size_, *surfels_);
-      }
-      
-      cudaEventRecord(ba_surfel_compaction_pre_event_, stream);
-      if (!keyframes_with_new_surfels.empty()) {
-        // Compact the surfels list to increase performance of subsequent kernel calls.
-        // TODO: Only run on the new surfels if possible
-        
-        u32 surfels_size = surfels_size_;
-        CompactSurfelsCUDA(stream, &free_spots_temp_storage_, &free_spots_temp_storage_bytes_, surfel_count_, &surfels_size, &surfels_->ToCUDA(), &active_surfels_->ToCUDA());
-        Lock();
-        surfels_size_ = surfels_size;
-        Unlock();
-      }
-      cudaEventRecord(ba_surfel_compaction_post_event_, stream);
-      
-      if (kDebugVerifySurfelCount) {
-        DebugVerifySurfelCount(stream, surfel_count_, surfels_size_, *surfels_);
-      }
     }
+    cudaEventRecord(ba_surfel_compaction_post_event_, stream);
+    
+    if (kDebugVerifySurfelCount) {
+      DebugVerifySurfelCount(stream, surfel_count_, surfels_size_, *surfels_);
+    }
+  };
+  
+  // --- POSE OPTIMIZATION ---
+  phases[4].begin = [&]() -> usize {
+    state.num_converged = 0;
+    if (!state.optimize_poses) {
+      return 0;
+    }
+    cudaEventRecord(ba_pose_optimization_pre_event_, stream);
+    return keyframes_.size();
+  };
+  phases[4].resume = [&]() -> usize {
+    // Include the keyframes which were added while the phase was interrupted.
+    return state.optimize_poses ? keyframes_.size() : 0;
+  };
+  phases[4].process_item = [&](usize item_index) {
+    const shared_ptr<Keyframe>& keyframe = keyframes_[item_index];
+    
+    // Only estimate pose for active and covisible-active keyframes.
+    if (!keyframe || keyframe->activation() == Keyframe::Activation::kInactive) {
+      ++ state.num_converged;
+      return;
+    }
+    KeyframeResidencyPin pin = keyframe->Pin(stream);
+    if (!pin) {
+      ++ state.num_converged;
+      return;
+    }
+    
+    SE3f global_T_frame_estimate;
+    EstimateFramePose(stream,
+                      keyframe->global_T_frame(),
+                      keyframe->depth_buffer(),
+                      keyframe->normals_buffer(),
+                      keyframe->color_texture(),
+                      &global_T_frame_estimate,
+                      true);
+    SE3f pose_difference = keyframe->frame_T_global() * global_T_frame_estimate;
+    bool frame_moved = !IsScale1PoseEstimationConverged(pose_difference.log());
     
+    Lock();
+    keyframe->set_global_T_frame(global_T_frame_estimate);
     
-    // --- POSE OPTIMIZATION ---
-    usize num_converged = 0;
-    if (optimize_poses) {
-      cudaEventRecord(ba_pose_optimization_pre_event_, stream);
-      for (const shared_ptr<Keyframe>& keyframe : keyframes_) {
-        // Only estimate pose for active and covisible-active keyframes.
-        if (!keyframe || keyframe->activation() == Keyframe::Activation::kInactive) {
-          ++ num_converged;
-          continue;
-        }
-        
-        SE3f global_T_frame_estimate;
-        EstimateFramePose(stream,
-                          keyframe->global_T_frame(),
-                          keyframe->depth_buffer(),
-                          keyframe->normals_buffer(),
-                          keyframe->color_texture(),
-                          &global_T_frame_estimate,
-                          true);
-        SE3f pose_difference = keyframe->frame_T_global() * global_T_frame_estimate;
-        bool frame_moved = !IsScale1PoseEstimationConverged(pose_difference.log());
-        
-        Lock();
-        keyframe->set_global_T_frame(global_T_frame_estimate);
-        
-        if (frame_moved) {
-          keyframe->SetActivation(Keyframe::Activation::kActive);
-        } else {
-          keyframe->SetActivation(Keyframe::Activation::kInactive);
-          ++ num_converged;
-        }
-        Unlock();
-      }
+    if (frame_moved) {
+      keyframe->SetActivation(Keyframe::Activation::kActive);
+    } else {
+      keyframe->SetActivation(Keyframe::Activation::kInactive);
+      ++ state.num_converged;
+    }
+    Unlock();
+  };
+  phases[4].end = [&]() {
+    if (state.optimize_poses) {
       cudaEventRecord(ba_pose_optimization_post_event_, stream);
+      
+      Lock();
+      PublishKeyframePoses();
+      Unlock();
     }
     
     if (kDebugVerifySurfelCount) {
       DebugVerifySurfelCount(stream, surfel_count_, surfels_size_, *surfels_);
     }
+  };
+  
+  // --- INTRINSICS OPTIMIZATION ---
+  phases[5].begin = [&]() -> usize {
+    return (state.optimize_depth_intrinsics || state.optimize_color_intrinsics) ? 1 : 0;
+  };
+  phases[5].process_item = [&](usize /*item_index*/) {
+    cudaEventRecord(ba_intrinsics_optimization_pre_event_, stream);
+    PinholeCamera4f out_color_camera;
+    PinholeCamera4f out_depth_camera;
+    float out_a = depth_params_.a;
+    
+    OptimizeIntrinsicsCUDA(
+        stream,
+        state.optimize_depth_intrinsics,
+        state.optimize_color_intrinsics,
+        keyframes_,
+        color_camera_,
+        depth_camera_,
+        depth_params_,
+        surfels_size_,
+        *surfels_,
+        &out_color_camera,
+        &out_depth_camera,
+        &out_a,
+        &cfactor_buffer_,
+        &intrinsics_optimization_helper_buffers_);
+    
+    if (surfels_size_ > 0) {
+      Lock();
+      if (state.optimize_color_intrinsics) {
+        color_camera_ = out_color_camera;
+      }
+      if (state.optimize_depth_intrinsics) {
+        depth_camera_ = out_depth_camera;
+        depth_params_.a = out_a;
+      }
+      PublishCalibration();
+      Unlock();
+    }
     
+    cudaEventRecord(ba_intrinsics_optimization_post_event_, stream);
     
-    // --- INTRINSICS OPTIMIZATION ---
-    bool optimize_intrinsics =
-        optimize_depth_intrinsics || optimize_color_intrinsics;
-    if (optimize_intrinsics) {
-      cudaEventRecord(ba_intrinsics_optimization_pre_event_, stream);
-      PinholeCamera4f out_color_camera;
-      PinholeCamera4f out_depth_camera;
-      float out_a = depth_params_.a;
-      
-      OptimizeIntrinsicsCUDA(
-          stream,
-          optimize_depth_intrinsics,
-          optimize_color_intrinsics,
-          keyframes_,
-          color_camera_,
-          depth_camera_,
-          depth_params_,
-          surfels_size_,
-          *surfels_,
-          &out_color_camera,
-          &out_depth_camera,
-          &out_a,
-          &cfactor_buffer_,
-          &intrinsics_optimization_helper_buffers_);
-      
-      if (surfels_size_ > 0) {
-        Lock();
-        if (optimize_color_intrinsics) {
-          color_camera_ = out_color_camera;
-        }
-        if (optimize_depth_intrinsics) {
-          depth_camera_ = out_depth_camera;
-          depth_params_.a = out_a;
-        }
-        Unlock();
+    if (intrinsics_updated_callback_) {
+      intrinsics_updated_callback_();
+    }
+  };
+  
+  // The time limit is checked before each work item if a timer is given.
+  BADeadline deadline;
+  if (timer) {
+    deadline = BADeadline([timer]() { return timer->GetTimeSinceStart(); }, time_limit);
+  }
+  
+  // Perform BA iterations.
+  for (int iteration = 0; iteration < max_iterations; ++ iteration) {
+    if (!alternating_ba_iteration_.in_progress()) {
+      if (progress_function && !progress_function(iteration)) {
+        break;
       }
       
-      cudaEventRecord(ba_intrinsics_optimization_post_event_, stream);
-      
-      if (intrinsics_updated_callback_) {
-        intrinsics_updated_callback_();
-      }
+      state.optimize_depth_intrinsics = optimize_depth_intrinsics;
+      state.optimize_color_intrinsics = optimize_color_intrinsics;
+      state.do_surfel_updates = do_surfel_updates;
+      state.optimize_poses = optimize_poses;
+      state.optimize_geometry = optimize_geometry;
+      state.active_keyframe_window_start = active_keyframe_window_start;
+      state.active_keyframe_window_end = active_keyframe_window_end;
+      state.local_keyframe_window =
+          active_keyframe_window_start != 0 ||
+          active_keyframe_window_end != keyframes_.size() - 1;
+      state.fixed_ba_iteration_count = fixed_ba_iteration_count;
+      state.keyframe_generation = keyframe_generation;
+    }
+    
+    if (!alternating_ba_iteration_.Run(phases, deadline)) {
+      // The time limit was reached. The remaining work of this iteration is
+      // done in the next call.
+      break;
+    }
+    if (num_iterations_done) {
+      ++ *num_iterations_done;
     }
     
     
@@ -632,11 +766,12 @@ void DirectBA::BundleAdjustmentAlternating(
                        << " surfel_count " << surfel_count_ << endl;
     }
     
-    // Store timings for events used within this loop.
+    // Store timings for events used within this iteration. For an iteration
+    // which was interrupted, these include the time between the calls.
     cudaEventSynchronize(ba_intrinsics_optimization_post_event_);
     float elapsed_milliseconds;
     
-    if (optimize_geometry && do_surfel_updates) {
+    if (state.optimize_geometry && state.do_surfel_updates) {
       cudaEventElapsedTime(&elapsed_milliseconds, ba_surfel_creation_pre_event_, ba_surfel_creation_post_event_);
       Timing::addTime(Timing::getHandle("BA surfel creation"), 0.001 * elapsed_milliseconds);
       if (timings_stream_) {
@@ -650,7 +785,7 @@ void DirectBA::BundleAdjustmentAlternating(
       *timings_stream_ << "BA_surfel_activation " << elapsed_milliseconds << endl;
     }
     
-    if (optimize_geometry) {
+    if (state.optimize_geometry) {
       cudaEventElapsedTime(&elapsed_milliseconds, ba_geometry_optimization_pre_event_, ba_geometry_optimization_post_event_);
       Timing::addTime(Timing::getHandle("BA geometry optimization"), 0.001 * elapsed_milliseconds);
       if (timings_stream_) {
@@ -658,7 +793,7 @@ void DirectBA::BundleAdjustmentAlternating(
       }
     }
     
-    if (do_surfel_updates) {
+    if (state.do_surfel_updates) {
       cudaEventElapsedTime(&elapsed_milliseconds, ba_surfel_merge_pre_event_, ba_surfel_merge_post_event_);
       Timing::addTime(Timing::getHandle("BA initial surfel merge"), 0.001 * elapsed_milliseconds);
       if (timings_stream_) {
@@ -672,7 +807,7 @@ void DirectBA::BundleAdjustmentAlternating(
       }
     }
     
-    if (optimize_poses) {
+    if (state.optimize_poses) {
       cudaEventElapsedTime(&elapsed_milliseconds, ba_pose_optimization_pre_event_, ba_pose_optimization_post_event_);
       Timing::addTime(Timing::getHandle("BA pose optimization"), 0.001 * elapsed_milliseconds);
       if (timings_stream_) {
@@ -680,7 +815,7 @@ void DirectBA::BundleAdjustmentAlternating(
       }
     }
     
-    if (optimize_intrinsics) {
+    if (state.optimize_depth_intrinsics || state.optimize_color_intrinsics) {
       cudaEventElapsedTime(&elapsed_milliseconds, ba_intrinsics_optimization_pre_event_, ba_intrinsics_optimization_post_event_);
       Timing::addTime(Timing::getHandle("BA intrinsics optimization"), 0.001 * elapsed_milliseconds);
       if (timings_stream_) {
@@ -691,7 +826,7 @@ void DirectBA::BundleAdjustmentAlternating(
     
     // --- CONVERGENCE ---
     if (iteration >= min_iterations - 1 &&
-        (num_converged == keyframes_.size() || !optimize_poses)) {
+        (state.num_converged == keyframes_.size() || !state.optimize_poses)) {
       // All frames are inactive. Early exit.
 //       LOG(INFO) << "Early global BA exit after " << (iteration + 1) << " iterations";
       if (converged) {
@@ -700,12 +835,9 @@ void DirectBA::BundleAdjustmentAlternating(
       break;
     }
     
-    // Test for timeout if a timer is given
-    if (timer) {
-      double elapsed_time = timer->GetTimeSinceStart();
-      if (elapsed_time > time_limit) {
-        break;
-      }
+    // Test for timeout
+    if (deadline.Expired()) {
+      break;
     }
     
     // Partial convergence: keyframes have been set to kActive or kInactive
@@ -722,7 +854,9 @@ void DirectBA::BundleAdjustmentAlternating(
   }
   
   
-  if (increase_ba_iteration_count) {
+  // If an iteration was interrupted, the BA iteration block must not end
+  // before it has been completed.
+  if (increase_ba_iteration_count && !alternating_ba_iteration_.in_progress()) {
     PerformBASchemeEndTasks(
         stream,
         do_surfel_updates);
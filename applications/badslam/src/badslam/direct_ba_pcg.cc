@@ -95,7 +95,7 @@ void DirectBA::BundleAdjustmentPCG(
   //   J^T W J x = -J^T W F
   // Finally, we have to ensure that H is positive definite (instead of only
   // semi-positive definite), so we add a small value "lambda" to its diagonal
-  // (this is the value "kDiagEpsilon" in kernel_pcg.cu), as it would also be
+  // (this is the value "kDiagEpsilon" in constants.h), as it would also be
   // done in Levenberg-Marquardt:
   //   (J^T W J + lambda I) x = -J^T W F
   // 
@@ -341,6 +341,10 @@ void DirectBA::BundleAdjustmentPCG(
       if (!keyframe) {
         continue;
       }
+      KeyframeResidencyPin pin = keyframe->Pin(stream);
+      if (!pin) {
+        continue;
+      }
       
       PCGInitCUDA(
           stream,
@@ -398,6 +402,10 @@ void DirectBA::BundleAdjustmentPCG(
         if (!keyframe) {
           continue;
         }
+        KeyframeResidencyPin pin = keyframe->Pin(stream);
+        if (!pin) {
+          continue;
+        }
         
         PCGStep1CUDA(
             stream,
@@ -482,6 +490,10 @@ void DirectBA::BundleAdjustmentPCG(
         if (!keyframe) {
           continue;
         }
+        KeyframeResidencyPin pin = keyframe->Pin(stream);
+        if (!pin) {
+          continue;
+        }
         bool fix_kf_pose = keyframe->id() == kFixGaugeWithKeyframeID;
         PCGInitCUDA(
             stream,
@@ -511,6 +523,10 @@ void DirectBA::BundleAdjustmentPCG(
         if (!keyframe) {
           continue;
         }
+        KeyframeResidencyPin pin = keyframe->Pin(stream);
+        if (!pin) {
+          continue;
+        }
         
         PCGStep1CUDA(
             stream,
@@ -573,6 +589,7 @@ void DirectBA::BundleAdjustmentPCG(
           ++ num_converged;
         }
       }
+      PublishKeyframePoses();
     }
     
     // Surfel positions:
@@ -641,8 +658,11 @@ void DirectBA::BundleAdjustmentPCG(
       color_camera_ = PinholeCamera4f(color_camera_.width(), color_camera_.height(), new_color_camera_parameters);
     }
     
-    if ((optimize_depth_intrinsics || optimize_color_intrinsics) && intrinsics_updated_callback_) {
-      intrinsics_updated_callback_();
+    if (optimize_depth_intrinsics || optimize_color_intrinsics) {
+      PublishCalibration();
+      if (intrinsics_updated_callback_) {
+        intrinsics_updated_callback_();
+      }
     }
     
     // --- SURFEL MERGE ---
@@ -655,6 +675,10 @@ void DirectBA::BundleAdjustmentPCG(
         if (!keyframe) {
           continue;
         }
+        KeyframeResidencyPin pin = keyframe->Pin(stream);
+        if (!pin) {
+          continue;
+        }
         
         // TODO: Run this on the active surfels only if faster, should still be correct
         DetermineSupportingSurfelsAndMergeSurfelsCUDA(
@@ -780,6 +804,10 @@ void DirectBA::BundleAdjustmentPCG(
       if (!keyframe) {
         continue;
       }
+      KeyframeResidencyPin pin = keyframe->Pin(stream);
+      if (!pin) {
+        continue;
+      }
       
       // TODO: Run this on the active surfels only if faster, should still be correct
       DetermineSupportingSurfelsAndMergeSurfelsCUDA(
@@ -0,0 +1,688 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "badslam/direct_ba_pcg_cpu.h"
+
+#include <cmath>
+#include <limits>
+
+#include <libvis/logging.h>
+#include <libvis/util.h>
+
+#include "badslam/convergence_analysis.h"
+#include "badslam/surfel_projection_cpu.h"
+
+namespace vis {
+
+namespace {
+
+constexpr u32 kInvalidUnknownIndex = numeric_limits<u32>::max();
+
+// Unknown ordering (as in DirectBA::BundleAdjustmentPCG(), but with compact
+// keyframe indices):
+// - 6 unknowns for each non-null keyframe except the gauge keyframe
+// - 1 for each surfel (position offset along the normal)
+// - 4 + 1 + cfactor count for the depth intrinsics (fx_inv, fy_inv, cx_inv,
+//   cy_inv, a, cfactors)
+struct UnknownLayoutCPU {
+  // For each entry of the keyframes vector, the index of its first pose
+  // unknown, or kInvalidUnknownIndex for null keyframes and the gauge keyframe.
+  vector<u32> pose_unknown_index;
+  u32 pose_unknown_count;
+  
+  u32 surfel_unknown_start_index;
+  u32 surfel_unknown_count;
+  
+  u32 depth_intrinsics_unknown_start_index;
+  u32 depth_intrinsics_unknown_count;
+  
+  u32 unknown_count;
+  
+  // Unknowns which are shared by the residuals of different surfels (poses and
+  // depth intrinsics), for which each thread accumulates partial sums. This
+  // maps an unknown index to the index in the shared unknowns.
+  inline u32 SharedIndex(u32 unknown_index) const {
+    return (unknown_index < surfel_unknown_start_index) ?
+           unknown_index :
+           (unknown_index - surfel_unknown_count);
+  }
+  
+  inline u32 SharedUnknownCount() const {
+    return pose_unknown_count + depth_intrinsics_unknown_count;
+  }
+};
+
+// Depth residual of one surfel in one keyframe, and its Jacobians. See
+// PCGInitCUDAKernel() in kernel_pcg.cu.
+struct DepthResidualCPU {
+  float raw_residual;
+  float weight;
+  
+  float pose_jacobian[6];
+  float position_jacobian;
+  
+  // Only set if intrinsics Jacobians are requested. Jacobians wrt. fx_inv,
+  // fy_inv, cx_inv, cy_inv, a, and the cfactor with index cfactor_index.
+  // intrinsics_valid is false if the corrected inverse depth is too close to
+  // zero, in which case the residual does not contribute to the intrinsics.
+  bool intrinsics_valid;
+  float intrinsics_jacobian[5];
+  float cfactor_jacobian;
+  u32 cfactor_index;
+};
+
+// Computes the depth residual of a surfel in a keyframe. Returns false if the
+// surfel is not associated with a pixel of the keyframe.
+bool ComputeDepthResidualCPU(
+    const SurfelProjectionParametersCPU& s,
+    u32 surfel_index,
+    bool compute_intrinsics_jacobians,
+    DepthResidualCPU* residual) {
+  SurfelProjectionResultCPU r;
+  if (!SurfelProjectsToAssociatedPixelCPU(surfel_index, s, &r)) {
+    return false;
+  }
+  
+  const Vec3f rn = s.frame_T_global.rotationMatrix() * r.surfel_normal;
+  
+  // Version of PixelCenterUnprojector.
+  const float* camera_parameters = s.camera->parameters();
+  const float fx_inv = 1.f / camera_parameters[0];
+  const float fy_inv = 1.f / camera_parameters[1];
+  const float cx_inv = -(camera_parameters[2] - 0.5f) * fx_inv;
+  const float cy_inv = -(camera_parameters[3] - 0.5f) * fy_inv;
+  const float nx = fx_inv * r.px + cx_inv;
+  const float ny = fy_inv * r.py + cy_inv;
+  
+  const float dot = rn.x() * nx + rn.y() * ny + rn.z();
+  const float depth_residual_inv_stddev =
+      s.calibration->baseline_fx / (kDepthUncertaintyEmpiricalFactor * fabs(dot) * (r.pixel_calibrated_depth * r.pixel_calibrated_depth));
+  const Vec3f local_unproj = r.pixel_calibrated_depth * Vec3f(nx, ny, 1);
+  residual->raw_residual = depth_residual_inv_stddev * rn.dot(local_unproj - r.surfel_local_position);
+  residual->weight = kDepthResidualWeight * TukeyWeight(residual->raw_residual, kDepthResidualDefaultTukeyParam);
+  
+  residual->position_jacobian = -depth_residual_inv_stddev;
+  
+  residual->pose_jacobian[0] = depth_residual_inv_stddev * rn.x();
+  residual->pose_jacobian[1] = depth_residual_inv_stddev * rn.y();
+  residual->pose_jacobian[2] = depth_residual_inv_stddev * rn.z();
+  residual->pose_jacobian[3] = depth_residual_inv_stddev * (-rn.y() * local_unproj.z() + rn.z() * local_unproj.y());
+  residual->pose_jacobian[4] = depth_residual_inv_stddev * ( rn.x() * local_unproj.z() - rn.z() * local_unproj.x());
+  residual->pose_jacobian[5] = depth_residual_inv_stddev * (-rn.x() * local_unproj.y() + rn.y() * local_unproj.x());
+  
+  if (compute_intrinsics_jacobians) {
+    const DepthParametersCPU& calibration = *s.calibration;
+    const int sparse_px = r.px / calibration.sparse_surfel_cell_size;
+    const int sparse_py = r.py / calibration.sparse_surfel_cell_size;
+    const float cfactor = calibration.cfactor(sparse_px, sparse_py);
+    
+    const float raw_inv_depth = 1.0f / (calibration.raw_to_float_depth * (*s.depth_buffer)(r.px, r.py));
+    const float exp_inv_depth = expf(- calibration.a * raw_inv_depth);
+    const float corrected_inv_depth = cfactor * exp_inv_depth + raw_inv_depth;
+    residual->intrinsics_valid = fabs(corrected_inv_depth) >= 1e-4f;  // NOTE: Corresponds to 1000 meters
+    
+    const float jac_base = depth_residual_inv_stddev * dot * exp_inv_depth / (corrected_inv_depth * corrected_inv_depth);
+    
+    // Note that rn.x() and rn.y() equal the dot products of the surfel normal
+    // with the first two rows of the rotation matrix, as used by the CUDA code.
+    const float d_residual_d_cx_inv = depth_residual_inv_stddev * r.pixel_calibrated_depth * rn.x();
+    const float d_residual_d_cy_inv = depth_residual_inv_stddev * r.pixel_calibrated_depth * rn.y();
+    residual->intrinsics_jacobian[0] = r.px * d_residual_d_cx_inv;
+    residual->intrinsics_jacobian[1] = r.py * d_residual_d_cy_inv;
+    residual->intrinsics_jacobian[2] = d_residual_d_cx_inv;
+    residual->intrinsics_jacobian[3] = d_residual_d_cy_inv;
+    residual->intrinsics_jacobian[4] = cfactor * raw_inv_depth * jac_base;
+    residual->cfactor_jacobian = -jac_base;
+    residual->cfactor_index = sparse_px + sparse_py * calibration.cfactor.width();
+  }
+  
+  return true;
+}
+
+// The problem as seen by one Gauss-Newton iteration.
+struct ProblemCPU {
+  const BundleAdjustmentPCGOptionsCPU* options;
+  const vector<BundleAdjustmentKeyframeCPU*>* keyframes;
+  vector<SurfelProjectionParametersCPU> projection_parameters;  // one per entry of keyframes
+  const UnknownLayoutCPU* layout;
+  u32 surfels_size;
+  usize worker_count;
+};
+
+// Calls func(block_index, keyframe_index, surfel_index, residual) for all
+// surfel-keyframe pairs which have a depth residual. The surfels are split into
+// worker_count contiguous tiles, such that each surfel is handled by exactly
+// one block, which thus owns the surfel's unknowns. Within a tile, the
+// keyframes are iterated over in the outer loop to make the image accesses
+// more local.
+template <typename Func>
+void ForEachDepthResidualCPU(const ProblemCPU& problem, const Func& func) {
+  const bool compute_intrinsics_jacobians = problem.options->optimize_depth_intrinsics;
+  ParallelForBlocks(0, problem.surfels_size, problem.worker_count, [&](usize block_index, usize block_begin, usize block_end) {
+    DepthResidualCPU residual;
+    for (usize keyframe_index = 0; keyframe_index < problem.keyframes->size(); ++ keyframe_index) {
+      if (!(*problem.keyframes)[keyframe_index]) {
+        continue;
+      }
+      const SurfelProjectionParametersCPU& s = problem.projection_parameters[keyframe_index];
+      for (u32 surfel_index = block_begin; surfel_index < block_end; ++ surfel_index) {
+        if (ComputeDepthResidualCPU(s, surfel_index, compute_intrinsics_jacobians, &residual)) {
+          func(block_index, keyframe_index, surfel_index, residual);
+        }
+      }
+    }
+  });
+}
+
+// Block-Jacobi preconditioner. The diagonal blocks of J^T W J are accumulated
+// into these (with the surfel and cfactor blocks being scalars), and are then
+// replaced by their inverses in Invert().
+struct BlockJacobiPreconditionerCPU {
+  void Resize(const UnknownLayoutCPU& layout) {
+    pose_blocks.resize(layout.pose_unknown_count / 6);
+    for (Eigen::Matrix<double, 6, 6>& block : pose_blocks) {
+      block.setZero();
+    }
+    intrinsics_block.setZero();
+    diagonal.assign(layout.unknown_count, 0);
+  }
+  
+  void Add(const BlockJacobiPreconditionerCPU& other) {
+    for (usize i = 0; i < pose_blocks.size(); ++ i) {
+      pose_blocks[i] += other.pose_blocks[i];
+    }
+    intrinsics_block += other.intrinsics_block;
+    for (usize i = 0; i < diagonal.size(); ++ i) {
+      diagonal[i] += other.diagonal[i];
+    }
+  }
+  
+  // Adds kDiagEpsilon and the prior on a (like the CUDA code does for the
+  // diagonal) and inverts the blocks.
+  void Invert(const UnknownLayoutCPU& layout) {
+    for (Eigen::Matrix<double, 6, 6>& block : pose_blocks) {
+      block.diagonal().array() += kDiagEpsilon;
+      block = block.ldlt().solve(Eigen::Matrix<double, 6, 6>::Identity()).eval();
+    }
+    if (layout.depth_intrinsics_unknown_count > 0) {
+      intrinsics_block.diagonal().array() += kDiagEpsilon;
+      intrinsics_block(4, 4) += kAPriorWeight * kAPriorWeight;
+      intrinsics_block = intrinsics_block.ldlt().solve(Eigen::Matrix<double, 5, 5>::Identity()).eval();
+    }
+    for (double& value : diagonal) {
+      value = 1. / (value + kDiagEpsilon);
+    }
+  }
+  
+  // Computes z = M^-1 r, once Invert() has been called.
+  void Apply(const UnknownLayoutCPU& layout, const vector<double>& r, vector<double>* z) const {
+    for (usize i = 0; i < pose_blocks.size(); ++ i) {
+      Eigen::Matrix<double, 6, 1>::Map(&(*z)[6 * i]) = pose_blocks[i] * Eigen::Matrix<double, 6, 1>::Map(&r[6 * i]);
+    }
+    for (u32 i = layout.surfel_unknown_start_index; i < layout.surfel_unknown_start_index + layout.surfel_unknown_count; ++ i) {
+      (*z)[i] = diagonal[i] * r[i];
+    }
+    if (layout.depth_intrinsics_unknown_count > 0) {
+      const u32 start = layout.depth_intrinsics_unknown_start_index;
+      Eigen::Matrix<double, 5, 1>::Map(&(*z)[start]) = intrinsics_block * Eigen::Matrix<double, 5, 1>::Map(&r[start]);
+      for (u32 i = start + 5; i < layout.unknown_count; ++ i) {
+        (*z)[i] = diagonal[i] * r[i];
+      }
+    }
+  }
+  
+  vector<Eigen::Matrix<double, 6, 6>> pose_blocks;
+  Eigen::Matrix<double, 5, 5> intrinsics_block;
+  vector<double> diagonal;  // for the unknowns that are not in one of the blocks above
+};
+
+// Computes r = -J^T W F and the preconditioner blocks of J^T W J. This
+// corresponds to PCGInitCUDA().
+void ComputeRightHandSideAndPreconditionerCPU(
+    const ProblemCPU& problem,
+    vector<double>* r,
+    BlockJacobiPreconditionerCPU* preconditioner) {
+  const UnknownLayoutCPU& layout = *problem.layout;
+  const bool optimize_geometry = problem.options->optimize_geometry;
+  const bool optimize_depth_intrinsics = problem.options->optimize_depth_intrinsics;
+  
+  r->assign(layout.unknown_count, 0);
+  preconditioner->Resize(layout);
+  
+  // The surfel unknowns are owned by the blocks and are written directly. The
+  // shared unknowns are accumulated per block.
+  vector<vector<double>> block_r(problem.worker_count, vector<double>(layout.SharedUnknownCount(), 0));
+  vector<BlockJacobiPreconditionerCPU> block_preconditioners(problem.worker_count);
+  for (BlockJacobiPreconditionerCPU& block_preconditioner : block_preconditioners) {
+    block_preconditioner.Resize(layout);
+  }
+  
+  ForEachDepthResidualCPU(problem, [&](usize block_index, usize keyframe_index, u32 surfel_index, const DepthResidualCPU& residual) {
+    vector<double>& shared_r = block_r[block_index];
+    BlockJacobiPreconditionerCPU& block_preconditioner = block_preconditioners[block_index];
+    const double weight = residual.weight;
+    const double weighted_residual = weight * residual.raw_residual;
+    
+    if (optimize_geometry) {
+      const u32 unknown_index = layout.surfel_unknown_start_index + surfel_index;
+      (*r)[unknown_index] -= residual.position_jacobian * weighted_residual;
+      preconditioner->diagonal[unknown_index] += weight * residual.position_jacobian * residual.position_jacobian;
+    }
+    
+    const u32 pose_unknown_index = layout.pose_unknown_index[keyframe_index];
+    if (pose_unknown_index != kInvalidUnknownIndex) {
+      Eigen::Matrix<double, 6, 1> jacobian = Eigen::Matrix<float, 6, 1>::Map(residual.pose_jacobian).cast<double>();
+      Eigen::Matrix<double, 6, 1>::Map(&shared_r[pose_unknown_index]) -= jacobian * weighted_residual;
+      block_preconditioner.pose_blocks[pose_unknown_index / 6] += (weight * jacobian) * jacobian.transpose();
+    }
+    
+    if (optimize_depth_intrinsics && residual.intrinsics_valid) {
+      const u32 start = layout.SharedIndex(layout.depth_intrinsics_unknown_start_index);
+      Eigen::Matrix<double, 5, 1> jacobian = Eigen::Matrix<float, 5, 1>::Map(residual.intrinsics_jacobian).cast<double>();
+      Eigen::Matrix<double, 5, 1>::Map(&shared_r[start]) -= jacobian * weighted_residual;
+      block_preconditioner.intrinsics_block += (weight * jacobian) * jacobian.transpose();
+      
+      const u32 cfactor_unknown_index = layout.depth_intrinsics_unknown_start_index + 5 + residual.cfactor_index;
+      shared_r[layout.SharedIndex(cfactor_unknown_index)] -= residual.cfactor_jacobian * weighted_residual;
+      block_preconditioner.diagonal[cfactor_unknown_index] += weight * residual.cfactor_jacobian * residual.cfactor_jacobian;
+    }
+  });
+  
+  // Add the partial sums in a fixed order.
+  for (usize block_index = 0; block_index < problem.worker_count; ++ block_index) {
+    for (u32 i = 0; i < layout.pose_unknown_count; ++ i) {
+      (*r)[i] += block_r[block_index][i];
+    }
+    for (u32 i = layout.depth_intrinsics_unknown_start_index; i < layout.depth_intrinsics_unknown_start_index + layout.depth_intrinsics_unknown_count; ++ i) {
+      (*r)[i] += block_r[block_index][layout.SharedIndex(i)];
+    }
+    preconditioner->Add(block_preconditioners[block_index]);
+  }
+}
+
+// Computes g = (J^T W J + lambda I) p, including the prior on a. This
+// corresponds to PCGStep1CUDA() and AddAlphaDEpsilonTermsCUDAKernel().
+void MultiplyCPU(
+    const ProblemCPU& problem,
+    const vector<double>& p,
+    vector<double>* g) {
+  const UnknownLayoutCPU& layout = *problem.layout;
+  const bool optimize_geometry = problem.options->optimize_geometry;
+  const bool optimize_depth_intrinsics = problem.options->optimize_depth_intrinsics;
+  
+  g->assign(layout.unknown_count, 0);
+  vector<vector<double>> block_g(problem.worker_count, vector<double>(layout.SharedUnknownCount(), 0));
+  
+  ForEachDepthResidualCPU(problem, [&](usize block_index, usize keyframe_index, u32 surfel_index, const DepthResidualCPU& residual) {
+    vector<double>& shared_g = block_g[block_index];
+    
+    // Compute (J p) for this residual.
+    const u32 surfel_unknown_index = layout.surfel_unknown_start_index + surfel_index;
+    const u32 pose_unknown_index = layout.pose_unknown_index[keyframe_index];
+    const bool use_intrinsics = optimize_depth_intrinsics && residual.intrinsics_valid;
+    const u32 intrinsics_start = layout.depth_intrinsics_unknown_start_index;
+    const u32 cfactor_unknown_index = intrinsics_start + 5 + residual.cfactor_index;
+    
+    double jp = 0;
+    if (optimize_geometry) {
+      jp += residual.position_jacobian * p[surfel_unknown_index];
+    }
+    if (pose_unknown_index != kInvalidUnknownIndex) {
+      for (int i = 0; i < 6; ++ i) {
+        jp += residual.pose_jacobian[i] * p[pose_unknown_index + i];
+      }
+    }
+    if (use_intrinsics) {
+      for (int i = 0; i < 5; ++ i) {
+        jp += residual.intrinsics_jacobian[i] * p[intrinsics_start + i];
+      }
+      jp += residual.cfactor_jacobian * p[cfactor_unknown_index];
+    }
+    
+    // Add J^T W (J p).
+    const double weighted_jp = residual.weight * jp;
+    if (optimize_geometry) {
+      (*g)[surfel_unknown_index] += residual.position_jacobian * weighted_jp;
+    }
+    if (pose_unknown_index != kInvalidUnknownIndex) {
+      for (int i = 0; i < 6; ++ i) {
+        shared_g[pose_unknown_index + i] += residual.pose_jacobian[i] * weighted_jp;
+      }
+    }
+    if (use_intrinsics) {
+      const u32 shared_intrinsics_start = layout.SharedIndex(intrinsics_start);
+      for (int i = 0; i < 5; ++ i) {
+        shared_g[shared_intrinsics_start + i] += residual.intrinsics_jacobian[i] * weighted_jp;
+      }
+      shared_g[layout.SharedIndex(cfactor_unknown_index)] += residual.cfactor_jacobian * weighted_jp;
+    }
+  });
+  
+  for (usize block_index = 0; block_index < problem.worker_count; ++ block_index) {
+    for (u32 i = 0; i < layout.pose_unknown_count; ++ i) {
+      (*g)[i] += block_g[block_index][i];
+    }
+    for (u32 i = layout.depth_intrinsics_unknown_start_index; i < layout.depth_intrinsics_unknown_start_index + layout.depth_intrinsics_unknown_count; ++ i) {
+      (*g)[i] += block_g[block_index][layout.SharedIndex(i)];
+    }
+  }
+  
+  for (u32 i = 0; i < layout.unknown_count; ++ i) {
+    (*g)[i] += kDiagEpsilon * p[i];
+  }
+  if (layout.depth_intrinsics_unknown_count > 0) {
+    const u32 a_unknown_index = layout.depth_intrinsics_unknown_start_index + 4;
+    (*g)[a_unknown_index] += kAPriorWeight * kAPriorWeight * p[a_unknown_index];
+  }
+}
+
+double Dot(const vector<double>& a, const vector<double>& b) {
+  double result = 0;
+  for (usize i = 0; i < a.size(); ++ i) {
+    result += a[i] * b[i];
+  }
+  return result;
+}
+
+SurfelProjectionParametersCPU CreateSurfelProjectionParametersCPU(
+    const BundleAdjustmentKeyframeCPU& keyframe,
+    const PinholeCamera4f& depth_camera,
+    const DepthParametersCPU& depth_calibration,
+    u32 surfels_size,
+    const Image<float>& surfels) {
+  SurfelProjectionParametersCPU s;
+  // The surfels are only modified by surfel merging, which is not used here.
+  s.surfels = const_cast<Image<float>*>(&surfels);
+  s.surfels_size = surfels_size;
+  s.depth_buffer = keyframe.depth_buffer;
+  s.normals_buffer = keyframe.normals_buffer;
+  s.camera = &depth_camera;
+  s.frame_T_global = keyframe.global_T_frame.inverse();
+  s.calibration = &depth_calibration;
+  return s;
+}
+
+}  // namespace
+
+bool BundleAdjustmentPCGCPU(
+    const BundleAdjustmentPCGOptionsCPU& options,
+    const vector<BundleAdjustmentKeyframeCPU*>& keyframes,
+    PinholeCamera4f* depth_camera,
+    DepthParametersCPU* depth_calibration,
+    u32 surfels_size,
+    Image<float>* surfels,
+    BundleAdjustmentPCGSummaryCPU* summary) {
+  BundleAdjustmentPCGSummaryCPU local_summary;
+  if (!summary) {
+    summary = &local_summary;
+  }
+  *summary = BundleAdjustmentPCGSummaryCPU();
+  
+  int gauge_keyframe_index = options.gauge_keyframe_index;
+  for (usize keyframe_index = 0; keyframe_index < keyframes.size(); ++ keyframe_index) {
+    if (keyframes[keyframe_index]) {
+      ++ summary->keyframe_count;
+      if (gauge_keyframe_index < 0) {
+        gauge_keyframe_index = keyframe_index;
+      }
+    }
+  }
+  if (summary->keyframe_count == 0) {
+    LOG(ERROR) << "BundleAdjustmentPCGCPU(): No keyframes given.";
+    return false;
+  }
+  if (gauge_keyframe_index >= static_cast<int>(keyframes.size()) || !keyframes[gauge_keyframe_index]) {
+    LOG(ERROR) << "BundleAdjustmentPCGCPU(): The gauge keyframe index " << gauge_keyframe_index << " does not refer to a valid keyframe.";
+    return false;
+  }
+  if (options.optimize_depth_intrinsics && depth_calibration->cfactor.empty()) {
+    LOG(ERROR) << "BundleAdjustmentPCGCPU(): Optimizing the depth intrinsics requires cfactors.";
+    return false;
+  }
+  
+  // Assign the unknowns. The poses of the non-null keyframes are indexed
+  // compactly, skipping the deleted keyframes and the gauge keyframe.
+  UnknownLayoutCPU layout;
+  layout.pose_unknown_index.assign(keyframes.size(), kInvalidUnknownIndex);
+  u32 current_unknown_index = 0;
+  if (options.optimize_poses) {
+    for (usize keyframe_index = 0; keyframe_index < keyframes.size(); ++ keyframe_index) {
+      if (keyframes[keyframe_index] && static_cast<int>(keyframe_index) != gauge_keyframe_index) {
+        layout.pose_unknown_index[keyframe_index] = current_unknown_index;
+        current_unknown_index += 6;
+      }
+    }
+  }
+  layout.pose_unknown_count = current_unknown_index;
+  
+  layout.surfel_unknown_start_index = current_unknown_index;
+  layout.surfel_unknown_count = options.optimize_geometry ? surfels_size : 0;
+  current_unknown_index += layout.surfel_unknown_count;
+  
+  layout.depth_intrinsics_unknown_start_index = current_unknown_index;
+  layout.depth_intrinsics_unknown_count =
+      options.optimize_depth_intrinsics ?
+      (4 + 1 + depth_calibration->cfactor.width() * depth_calibration->cfactor.height()) :
+      0;
+  current_unknown_index += layout.depth_intrinsics_unknown_count;
+  
+  layout.unknown_count = current_unknown_index;
+  summary->unknown_count = layout.unknown_count;
+  
+  ProblemCPU problem;
+  problem.options = &options;
+  problem.keyframes = &keyframes;
+  problem.projection_parameters.resize(keyframes.size());
+  problem.layout = &layout;
+  problem.surfels_size = surfels_size;
+  problem.worker_count = (options.thread_count > 0) ? options.thread_count : DefaultThreadCount();
+  
+  vector<double> pcg_r;
+  vector<double> pcg_delta;
+  vector<double> pcg_g;
+  vector<double> pcg_p;
+  vector<double> pcg_z;
+  BlockJacobiPreconditionerCPU preconditioner;
+  
+  for (int iteration = 0; iteration < options.max_iterations; ++ iteration) {
+    ++ summary->iterations_done;
+    
+    for (usize keyframe_index = 0; keyframe_index < keyframes.size(); ++ keyframe_index) {
+      if (keyframes[keyframe_index]) {
+        problem.projection_parameters[keyframe_index] = CreateSurfelProjectionParametersCPU(
+            *keyframes[keyframe_index], *depth_camera, *depth_calibration, surfels_size, *surfels);
+      }
+    }
+    
+    // PCG init (see the description in DirectBA::BundleAdjustmentPCG()).
+    ComputeRightHandSideAndPreconditionerCPU(problem, &pcg_r, &preconditioner);
+    if (layout.depth_intrinsics_unknown_count > 0) {
+      pcg_r[layout.depth_intrinsics_unknown_start_index + 4] -= kAPriorWeight * kAPriorWeight * depth_calibration->a;
+    }
+    preconditioner.Invert(layout);
+    
+    pcg_z.resize(layout.unknown_count);
+    preconditioner.Apply(layout, pcg_r, &pcg_z);
+    pcg_p = pcg_z;
+    pcg_delta.assign(layout.unknown_count, 0);
+    double alpha_n = Dot(pcg_r, pcg_z);
+    
+    double prev_r_norm = numeric_limits<double>::infinity();
+    int num_iterations_without_improvement = 0;
+    
+    for (int step = 0; step < options.max_inner_iterations; ++ step) {
+      ++ summary->inner_iterations_done;
+      
+      // PCG step 1
+      MultiplyCPU(problem, pcg_p, &pcg_g);
+      const double alpha_d = Dot(pcg_p, pcg_g);
+      
+      // PCG step 2
+      const double alpha = (alpha_d >= 1e-35) ? (alpha_n / alpha_d) : 0;
+      for (u32 i = 0; i < layout.unknown_count; ++ i) {
+        pcg_delta[i] += alpha * pcg_p[i];
+        pcg_r[i] -= alpha * pcg_g[i];
+      }
+      preconditioner.Apply(layout, pcg_r, &pcg_z);
+      const double beta_n = Dot(pcg_z, pcg_r);
+      
+      // Check for convergence
+      const double r_norm = sqrt(beta_n);
+      if (r_norm < prev_r_norm - 1e-3) {
+        num_iterations_without_improvement = 0;
+      } else {
+        ++ num_iterations_without_improvement;
+        if (num_iterations_without_improvement >= 3) {
+          break;
+        }
+      }
+      prev_r_norm = r_norm;
+      
+      // PCG step 3
+      if (step < options.max_inner_iterations - 1) {
+        const double beta = (alpha_n >= 1e-35) ? (beta_n / alpha_n) : 0;
+        for (u32 i = 0; i < layout.unknown_count; ++ i) {
+          pcg_p[i] = pcg_z[i] + beta * pcg_p[i];
+        }
+        alpha_n = beta_n;
+      }
+    }
+    
+    // Update the variables from pcg_delta.
+    // Keyframe poses:
+    int num_converged = 0;
+    for (usize keyframe_index = 0; keyframe_index < keyframes.size(); ++ keyframe_index) {
+      if (!keyframes[keyframe_index]) {
+        continue;
+      }
+      const u32 pose_unknown_index = layout.pose_unknown_index[keyframe_index];
+      if (pose_unknown_index == kInvalidUnknownIndex) {
+        ++ num_converged;
+        continue;
+      }
+      
+      SE3f delta = SE3f::exp(Eigen::Matrix<double, 6, 1>::Map(&pcg_delta[pose_unknown_index]).cast<float>());
+      keyframes[keyframe_index]->global_T_frame = keyframes[keyframe_index]->global_T_frame * delta;
+      
+      if (IsScale1PoseEstimationConverged(delta.log())) {
+        ++ num_converged;
+      }
+    }
+    
+    // Surfel positions:
+    if (options.optimize_geometry) {
+      for (u32 surfel_index = 0; surfel_index < surfels_size; ++ surfel_index) {
+        const float t = pcg_delta[layout.surfel_unknown_start_index + surfel_index];
+        if (t != 0) {
+          const Vec3f position = SurfelGetPositionCPU(*surfels, surfel_index) + t * SurfelGetNormalCPU(*surfels, surfel_index);
+          (*surfels)(surfel_index, kSurfelX) = position.x();
+          (*surfels)(surfel_index, kSurfelY) = position.y();
+          (*surfels)(surfel_index, kSurfelZ) = position.z();
+        }
+      }
+    }
+    
+    // Depth intrinsics:
+    if (options.optimize_depth_intrinsics) {
+      const double* buffer = &pcg_delta[layout.depth_intrinsics_unknown_start_index];
+      
+      double old_depth_fx_inv = 1. / depth_camera->parameters()[0];
+      double old_depth_fy_inv = 1. / depth_camera->parameters()[1];
+      const double old_depth_cx_pixel_center = depth_camera->parameters()[2] - 0.5;
+      const double old_depth_cy_pixel_center = depth_camera->parameters()[3] - 0.5;
+      double old_depth_cx_inv = -old_depth_cx_pixel_center * old_depth_fx_inv;
+      double old_depth_cy_inv = -old_depth_cy_pixel_center * old_depth_fy_inv;
+      
+      double new_depth_fx = 1. / (old_depth_fx_inv + buffer[0]);
+      double new_depth_fy = 1. / (old_depth_fy_inv + buffer[1]);
+      double new_depth_cx = -(new_depth_fx * (old_depth_cx_inv + buffer[2])) + 0.5;
+      double new_depth_cy = -(new_depth_fy * (old_depth_cy_inv + buffer[3])) + 0.5;
+      float new_depth_camera_parameters[4] = {
+          static_cast<float>(new_depth_fx),
+          static_cast<float>(new_depth_fy),
+          static_cast<float>(new_depth_cx),
+          static_cast<float>(new_depth_cy)};
+      *depth_camera = PinholeCamera4f(depth_camera->width(), depth_camera->height(), new_depth_camera_parameters);
+      
+      depth_calibration->a += buffer[4];
+      
+      Image<float>& cfactor = depth_calibration->cfactor;
+      for (u32 y = 0; y < cfactor.height(); ++ y) {
+        for (u32 x = 0; x < cfactor.width(); ++ x) {
+          cfactor(x, y) += buffer[5 + x + y * cfactor.width()];
+        }
+      }
+    }
+    
+    // Test for convergence
+    if (num_converged == summary->keyframe_count || !options.optimize_poses) {
+      summary->converged = true;
+      break;
+    }
+  }
+  
+  return true;
+}
+
+double ComputeBundleAdjustmentCostCPU(
+    const vector<BundleAdjustmentKeyframeCPU*>& keyframes,
+    const PinholeCamera4f& depth_camera,
+    const DepthParametersCPU& depth_calibration,
+    u32 surfels_size,
+    const Image<float>& surfels,
+    int thread_count) {
+  BundleAdjustmentPCGOptionsCPU options;
+  options.optimize_depth_intrinsics = false;
+  
+  ProblemCPU problem;
+  problem.options = &options;
+  problem.keyframes = &keyframes;
+  problem.projection_parameters.resize(keyframes.size());
+  for (usize keyframe_index = 0; keyframe_index < keyframes.size(); ++ keyframe_index) {
+    if (keyframes[keyframe_index]) {
+      problem.projection_parameters[keyframe_index] = CreateSurfelProjectionParametersCPU(
+          *keyframes[keyframe_index], depth_camera, depth_calibration, surfels_size, surfels);
+    }
+  }
+  problem.layout = nullptr;
+  problem.surfels_size = surfels_size;
+  problem.worker_count = (thread_count > 0) ? thread_count : DefaultThreadCount();
+  
+  vector<double> block_costs(problem.worker_count, 0);
+  ForEachDepthResidualCPU(problem, [&](usize block_index, usize /*keyframe_index*/, u32 /*surfel_index*/, const DepthResidualCPU& residual) {
+    block_costs[block_index] += kDepthResidualWeight * TukeyResidual(residual.raw_residual, kDepthResidualDefaultTukeyParam);
+  });
+  
+  double cost = 0;
+  for (double block_cost : block_costs) {
+    cost += block_cost;
+  }
+  return cost;
+}
+
+}
@@ -0,0 +1,136 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <libvis/camera.h>
+#include <libvis/image.h>
+#include <libvis/libvis.h>
+#include <libvis/sophus.h>
+
+#include "badslam/depth_parameters_cpu.h"
+
+namespace vis {
+
+// A keyframe as seen by the CPU bundle adjustment: its pose, which gets
+// optimized, and host copies of its depth and normals buffers.
+struct BundleAdjustmentKeyframeCPU {
+  SE3f global_T_frame;
+  const Image<u16>* depth_buffer;
+  const Image<u16>* normals_buffer;
+};
+
+struct BundleAdjustmentPCGOptionsCPU {
+  bool optimize_poses = true;
+  bool optimize_geometry = true;
+  
+  // Optimizes the depth camera intrinsics, the depth deformation factor a, and
+  // the cfactors. This requires a non-empty cfactor image in the depth
+  // calibration.
+  bool optimize_depth_intrinsics = false;
+  
+  // Maximum number of Gauss-Newton iterations, and of PCG iterations within
+  // each Gauss-Newton iteration.
+  int max_iterations = 10;
+  int max_inner_iterations = 30;
+  
+  // Index (in the keyframes vector) of the keyframe whose pose is fixed to
+  // remove the gauge freedom. -1 selects the first keyframe that is not null.
+  // In contrast to the CUDA implementation, which picks a random keyframe in
+  // each iteration, this is deterministic.
+  int gauge_keyframe_index = -1;
+  
+  // Number of threads used to evaluate the residuals and Jacobians. 0 uses
+  // DefaultThreadCount(). The result depends on the thread count only due to
+  // the floating-point summation order.
+  int thread_count = 0;
+};
+
+struct BundleAdjustmentPCGSummaryCPU {
+  // Number of keyframes that are not null, i.e., that take part in the
+  // optimization.
+  int keyframe_count = 0;
+  
+  // Number of unknowns in the last Gauss-Newton iteration.
+  u32 unknown_count = 0;
+  
+  int iterations_done = 0;
+  int inner_iterations_done = 0;
+  
+  // Set to true if the pose updates of all keyframes were below the
+  // convergence threshold in the last iteration.
+  bool converged = false;
+};
+
+// Host version of DirectBA::BundleAdjustmentPCG(): jointly optimizes the
+// keyframe poses, the surfel positions (along their normals) and optionally
+// the depth intrinsics with Gauss-Newton, using the same matrix-free
+// preconditioned conjugate gradients solver and the same depth residuals,
+// Jacobians and unknown ordering as kernel_pcg.cu.
+// 
+// Differences to the CUDA implementation:
+// - Null entries in keyframes (deleted keyframes) are skipped, and the poses
+//   of the remaining keyframes are indexed compactly.
+// - The preconditioner is block-Jacobi instead of Jacobi: the 6x6 blocks of
+//   the keyframe poses and the 5x5 block of the global depth intrinsics
+//   (fx, fy, cx, cy, a) are inverted exactly, while the surfel and cfactor
+//   unknowns keep scalar blocks.
+// - Only the depth (geometric) residuals are used, so the surfel descriptors
+//   and the color intrinsics are not optimized.
+// - Surfel creation, normal updates and merging are not performed; this only
+//   runs the optimization on the given surfels.
+// 
+// The surfels are given as a host copy of DirectBA's surfel buffer (see
+// SurfelGetPositionCPU()). The residuals and Jacobians are evaluated for
+// contiguous tiles of surfels in parallel, where each thread accumulates the
+// sums for the unknowns that are shared among surfels (poses and intrinsics)
+// separately. These partial sums are then added in a fixed order.
+// 
+// Returns false if no keyframe is given, if the gauge keyframe is invalid, or
+// if optimizing the depth intrinsics is requested without cfactors.
+bool BundleAdjustmentPCGCPU(
+    const BundleAdjustmentPCGOptionsCPU& options,
+    const vector<BundleAdjustmentKeyframeCPU*>& keyframes,
+    PinholeCamera4f* depth_camera,
+    DepthParametersCPU* depth_calibration,
+    u32 surfels_size,
+    Image<float>* surfels,
+    BundleAdjustmentPCGSummaryCPU* summary = nullptr);
+
+// Computes the sum of the robustified depth residuals of all surfels in all
+// keyframes (null keyframes are skipped), i.e., the cost that is minimized by
+// BundleAdjustmentPCGCPU().
+double ComputeBundleAdjustmentCostCPU(
+    const vector<BundleAdjustmentKeyframeCPU*>& keyframes,
+    const PinholeCamera4f& depth_camera,
+    const DepthParametersCPU& depth_calibration,
+    u32 surfels_size,
+    const Image<float>& surfels,
+    int thread_count = 0);
+
+}
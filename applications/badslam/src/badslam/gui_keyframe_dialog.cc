@@ -83,17 +83,21 @@ KeyframeDialog::KeyframeDialog(
   layout->addLayout(pose_layout, row, 0, 1, 2);
   ++ row;
   
+  // Get the keyframe's images. This does not transfer the images back to the
+  // GPU if the keyframe is evicted.
+  KeyframeImageData images;
+  if (!keyframe->DownloadImages(/*stream*/ 0, &images)) {
+    LOG(ERROR) << "Cannot access the image data of keyframe " << keyframe->id();
+  }
+  
   // Color
   ImageDisplayQtWindow* color_display = new ImageDisplayQtWindow(/*display*/ nullptr, /*parent*/ this);
   color_display->SetDisplayAsWidget();
-  Image<uchar4> color_image_raw(keyframe->color_buffer().width(),
-                                keyframe->color_buffer().height());
-  keyframe->color_buffer().DownloadAsync(/*stream*/ 0, &color_image_raw);
-  Image<Vec3u8> color_image(color_image_raw.size());
+  Image<Vec3u8> color_image(images.color.size());
   for (int y = 0; y < color_image.height(); ++ y) {
     for (int x = 0; x < color_image.width(); ++ x) {
-      const uchar4& v = color_image_raw(x, y);
-      color_image(x, y) = Vec3u8(v.x, v.y, v.z);
+      const Vec4u8& v = images.color(x, y);
+      color_image(x, y) = Vec3u8(v.x(), v.y(), v.z());
     }
   }
   color_display->SetImage(color_image);
@@ -101,9 +105,7 @@ KeyframeDialog::KeyframeDialog(
   // Depth
   ImageDisplayQtWindow* depth_display = new ImageDisplayQtWindow(/*display*/ nullptr, /*parent*/ this);
   depth_display->SetDisplayAsWidget();
-  Image<u16> depth_image(keyframe->depth_buffer().width(),
-                         keyframe->depth_buffer().height());
-  keyframe->depth_buffer().DownloadAsync(/*stream*/ 0, &depth_image);
+  const Image<u16>& depth_image = images.depth;
   depth_display->SetImage(depth_image);
   depth_display->SetBlackWhiteValues(
       keyframe->min_depth() / config.raw_to_float_depth + 0.5f,
@@ -114,11 +116,8 @@ KeyframeDialog::KeyframeDialog(
   // Normals
   ImageDisplayQtWindow* normals_display = new ImageDisplayQtWindow(/*display*/ nullptr, /*parent*/ this);
   normals_display->SetDisplayAsWidget();
-  Image<u16> normals_image_raw(keyframe->normals_buffer().width(),
-                               keyframe->normals_buffer().height());
-  keyframe->normals_buffer().DownloadAsync(/*stream*/ 0, &normals_image_raw);
-  Image<Vec3u8> normals_image(keyframe->normals_buffer().width(),
-                              keyframe->normals_buffer().height());
+  const Image<u16>& normals_image_raw = images.normals;
+  Image<Vec3u8> normals_image(normals_image_raw.size());
   for (u32 y = 0; y < normals_image.height(); ++ y) {
     for (u32 x = 0; x < normals_image.width(); ++ x) {
       u16 value = normals_image_raw(x, y);
@@ -140,11 +139,10 @@ KeyframeDialog::KeyframeDialog(
   // Intensities
   ImageDisplayQtWindow* intensities_display = new ImageDisplayQtWindow(/*display*/ nullptr, /*parent*/ this);
   intensities_display->SetDisplayAsWidget();
-  Image<u8> intensities_image(color_image_raw.size());
+  Image<u8> intensities_image(images.color.size());
   for (int y = 0; y < color_image.height(); ++ y) {
     for (int x = 0; x < color_image.width(); ++ x) {
-      const uchar4& v = color_image_raw(x, y);
-      intensities_image(x, y) = v.w;
+      intensities_image(x, y) = images.color(x, y).w();
     }
   }
   intensities_display->SetImage(intensities_image);
@@ -152,9 +150,7 @@ KeyframeDialog::KeyframeDialog(
   // Radius
   ImageDisplayQtWindow* radius_display = new ImageDisplayQtWindow(/*display*/ nullptr, /*parent*/ this);
   radius_display->SetDisplayAsWidget();
-  Image<u16> radius_image(keyframe->radius_buffer().width(),
-                          keyframe->radius_buffer().height());
-  keyframe->radius_buffer().DownloadAsync(/*stream*/ 0, &radius_image);
+  const Image<u16>& radius_image = images.radius;
   Image<float> radius_image_float(radius_image.size());
   for (int y = 0; y < radius_image.height(); ++ y) {
     for (int x = 0; x < radius_image.width(); ++ x) {
@@ -206,6 +202,7 @@ void KeyframeDialog::PoseEdited(const QString& text) {
   
   keyframe_->set_global_T_frame(SE3d(rotation, translation).cast<float>());
   slam_->direct_ba().UpdateKeyframeCoVisibility(keyframe_);
+  slam_->direct_ba().PublishKeyframePoses();
   
   vis::ExtrapolateAndInterpolateKeyframePoseChanges(
       config_.start_frame,
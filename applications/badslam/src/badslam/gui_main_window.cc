@@ -62,6 +62,7 @@
 #include "badslam/gui_settings_window.h"
 #include "badslam/io.h"
 #include "badslam/licenses.h"
+#include "badslam/loop_detector.h"
 #include "badslam/pre_load_thread.h"
 #include "badslam/render_window.h"
 #include "badslam/util.cuh"
@@ -952,6 +953,7 @@ void MainWindow::MoveFrameManuallyButton(int right_left, int top_bottom, int for
     if (keyframe && keyframe->frame_index() == index) {
       keyframe->set_global_T_frame(global_tr_frame);
       bad_slam_->direct_ba().UpdateKeyframeCoVisibility(keyframe);
+      bad_slam_->direct_ba().PublishKeyframePoses();
       
       found_keyframe = true;
       break;
@@ -1521,7 +1523,14 @@ void MainWindow::ClickedKeyframe(int index) {
   }
   
   if (delete_keyframe_act->isChecked()) {
-    bad_slam_->direct_ba().DeleteKeyframe(index, bad_slam_->loop_detector());
+    LoopDetector* loop_detector = bad_slam_->loop_detector();
+    if (loop_detector) {
+      loop_detector->LockDetectorMutex();
+    }
+    bad_slam_->direct_ba().DeleteKeyframe(index, loop_detector);
+    if (loop_detector) {
+      loop_detector->UnlockDetectorMutex();
+    }
     bad_slam_->direct_ba().UpdateBAVisualization(/*stream*/ 0);
     render_window_->RenderFrame();
   } else if (select_keyframe_act->isChecked()) {
@@ -1772,10 +1781,12 @@ void MainWindow::WorkerThreadMain() {
     // Get the current RGB-D frame's RGB and depth images. This may wait for I/O
     // to complete in case it did not complete in the pre-loading thread yet.
     rgbd_video_mutex_.lock();
-    // const Image<Vec3u8>* rgb_image =
-        rgbd_video_.color_frame_mutable(frame_index_)->GetImage().get();
-    // const Image<u16>* depth_image =
-        rgbd_video_.depth_frame_mutable(frame_index_)->GetImage().get();
+    // Holding the references keeps the images from being evicted from the
+    // image cache while the frame is processed.
+    shared_ptr<Image<Vec3u8>> rgb_image =
+        rgbd_video_.color_frame_mutable(frame_index_)->GetImage();
+    shared_ptr<Image<u16>> depth_image =
+        rgbd_video_.depth_frame_mutable(frame_index_)->GetImage();
     
     // Pre-load the next frame.
     if (frame_index_ < rgbd_video_.frame_count() - 1) {
@@ -1988,19 +1999,19 @@ void MainWindow::UpdateCurrentFrameImages(int frame_index, bool images_in_use_el
     return;
   }
   
-  const Image<Vec3u8>* rgb_image;
-  const Image<u16>* depth_image;
+  shared_ptr<Image<Vec3u8>> rgb_image;
+  shared_ptr<Image<u16>> depth_image;
   
   if (images_in_use_elsewhere) {
     // Do not lock rgbd_video_mutex_, and do not unload the images after use.
-    rgb_image = rgbd_video_.color_frame_mutable(frame_index)->GetImage().get();
-    depth_image = rgbd_video_.depth_frame_mutable(frame_index)->GetImage().get();
+    rgb_image = rgbd_video_.color_frame_mutable(frame_index)->GetImage();
+    depth_image = rgbd_video_.depth_frame_mutable(frame_index)->GetImage();
   } else {
     // Lock rgbd_video_mutex_, and unload the images after use.
     rgbd_video_mutex_.lock();
     
-    rgb_image = rgbd_video_.color_frame_mutable(frame_index)->GetImage().get();
-    depth_image = rgbd_video_.depth_frame_mutable(frame_index)->GetImage().get();
+    rgb_image = rgbd_video_.color_frame_mutable(frame_index)->GetImage();
+    depth_image = rgbd_video_.depth_frame_mutable(frame_index)->GetImage();
 
     if (!rgb_image || !depth_image) {
       rgbd_video_mutex_.unlock();
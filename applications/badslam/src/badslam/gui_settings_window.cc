@@ -147,6 +147,11 @@ SettingsDialog::SettingsDialog(QString* dataset_path, BadSlamConfig* config, boo
   odometry_layout->addWidget(use_motion_model_checkbox, row, 0, 1, 2);
   ++ row;
   
+  multi_hypothesis_motion_model_checkbox = new QCheckBox(tr("Use multiple motion hypotheses"));
+  multi_hypothesis_motion_model_checkbox->setChecked(config->multi_hypothesis_motion_model);
+  odometry_layout->addWidget(multi_hypothesis_motion_model_checkbox, row, 0, 1, 2);
+  ++ row;
+  
   odometry_layout->setRowStretch(row, 1);
   odometry_tab->setLayout(odometry_layout);
   
@@ -159,6 +164,23 @@ SettingsDialog::SettingsDialog(QString* dataset_path, BadSlamConfig* config, boo
   keyframe_interval_edit = new QLineEdit(QString::number(config->keyframe_interval));
   add_option(tr("Keyframe interval: "), keyframe_interval_edit, ba_layout, &row);
   
+  adaptive_keyframes_checkbox = new QCheckBox(tr("Adaptive keyframe selection (keyframe interval is the maximum)"));
+  adaptive_keyframes_checkbox->setChecked(config->adaptive_keyframes);
+  ba_layout->addWidget(adaptive_keyframes_checkbox, row, 0, 1, 2);
+  ++ row;
+  
+  keyframe_min_overlap_edit = new QLineEdit(QString::number(config->keyframe_min_overlap));
+  add_option(tr("Adaptive keyframes: min overlap (0 to 1): "), keyframe_min_overlap_edit, ba_layout, &row);
+  
+  keyframe_max_translation_edit = new QLineEdit(QString::number(config->keyframe_max_translation));
+  add_option(tr("Adaptive keyframes: max translation (meters): "), keyframe_max_translation_edit, ba_layout, &row);
+  
+  keyframe_max_rotation_edit = new QLineEdit(QString::number(config->keyframe_max_rotation));
+  add_option(tr("Adaptive keyframes: max rotation (degrees): "), keyframe_max_rotation_edit, ba_layout, &row);
+  
+  keyframe_max_residual_increase_edit = new QLineEdit(QString::number(config->keyframe_max_residual_increase));
+  add_option(tr("Adaptive keyframes: max residual increase factor: "), keyframe_max_residual_increase_edit, ba_layout, &row);
+  
   max_num_ba_iterations_per_keyframe_edit = new QLineEdit(QString::number(config->max_num_ba_iterations_per_keyframe));
   add_option(tr("Max BA iteration count per keyframe: "), max_num_ba_iterations_per_keyframe_edit, ba_layout, &row);
   
@@ -204,6 +226,15 @@ SettingsDialog::SettingsDialog(QString* dataset_path, BadSlamConfig* config, boo
   ba_layout->addWidget(use_pcg_checkbox, row, 0, 1, 2);
   ++ row;
   
+  ba_local_window_size_edit = new QLineEdit(QString::number(config->ba_local_window_size));
+  add_option(tr("Local BA window size in keyframes (0: always optimize all): "), ba_local_window_size_edit, ba_layout, &row);
+  
+  ba_global_iteration_interval_edit = new QLineEdit(QString::number(config->ba_global_iteration_interval));
+  add_option(tr("Interval for global BA iterations (every Xth iteration): "), ba_global_iteration_interval_edit, ba_layout, &row);
+  
+  ba_global_time_interval_edit = new QLineEdit(QString::number(config->ba_global_time_interval));
+  add_option(tr("Interval for global BA iterations (seconds): "), ba_global_time_interval_edit, ba_layout, &row);
+  
   estimate_poses_checkbox = new QCheckBox(tr("Estimate poses"));
   estimate_poses_checkbox->setChecked(config->estimate_poses);
   ba_layout->addWidget(estimate_poses_checkbox, row, 0, 1, 2);
@@ -275,9 +306,18 @@ SettingsDialog::SettingsDialog(QString* dataset_path, BadSlamConfig* config, boo
   loop_closure_layout->addWidget(parallel_loop_detection_checkbox, row, 0, 1, 2);
   ++ row;
   
+  loop_detection_worker_threads_edit = new QLineEdit(QString::number(config->loop_detection_worker_threads));
+  add_option(tr("Parallel loop detection worker threads: "), loop_detection_worker_threads_edit, loop_closure_layout, &row);
+  
   loop_detection_image_frequency_edit = new QLineEdit(QString::number(config->loop_detection_image_frequency));
   add_option(tr("Image frequency: "), loop_detection_image_frequency_edit, loop_closure_layout, &row);
   
+  loop_detection_max_query_words_edit = new QLineEdit(QString::number(config->loop_detection_max_query_words));
+  add_option(tr("Max. scored words per query (0: all): "), loop_detection_max_query_words_edit, loop_closure_layout, &row);
+  
+  loop_detection_max_keyframes_per_word_edit = new QLineEdit(QString::number(config->loop_detection_max_keyframes_per_word));
+  add_option(tr("Max. keyframes per scored word (0: all): "), loop_detection_max_keyframes_per_word_edit, loop_closure_layout, &row);
+  
   loop_closure_layout->setRowStretch(row, 1);
   loop_closure_tab->setLayout(loop_closure_layout);
   
@@ -470,12 +510,27 @@ bool SettingsDialog::ParseSettings() {
   if (!ok) { report_error("num_scales", num_scales_edit->text()); return false; }
   
   config->use_motion_model = use_motion_model_checkbox->isChecked();
+  config->multi_hypothesis_motion_model = multi_hypothesis_motion_model_checkbox->isChecked();
   
   
   // BA settings
   config->keyframe_interval = keyframe_interval_edit->text().toInt(&ok);
   if (!ok) { report_error("keyframe_interval", keyframe_interval_edit->text()); return false; }
   
+  config->adaptive_keyframes = adaptive_keyframes_checkbox->isChecked();
+  
+  config->keyframe_min_overlap = keyframe_min_overlap_edit->text().toDouble(&ok);
+  if (!ok) { report_error("keyframe_min_overlap", keyframe_min_overlap_edit->text()); return false; }
+  
+  config->keyframe_max_translation = keyframe_max_translation_edit->text().toDouble(&ok);
+  if (!ok) { report_error("keyframe_max_translation", keyframe_max_translation_edit->text()); return false; }
+  
+  config->keyframe_max_rotation = keyframe_max_rotation_edit->text().toDouble(&ok);
+  if (!ok) { report_error("keyframe_max_rotation", keyframe_max_rotation_edit->text()); return false; }
+  
+  config->keyframe_max_residual_increase = keyframe_max_residual_increase_edit->text().toDouble(&ok);
+  if (!ok) { report_error("keyframe_max_residual_increase", keyframe_max_residual_increase_edit->text()); return false; }
+  
   config->max_num_ba_iterations_per_keyframe = max_num_ba_iterations_per_keyframe_edit->text().toInt(&ok);
   if (!ok) { report_error("max_num_ba_iterations_per_keyframe", max_num_ba_iterations_per_keyframe_edit->text()); return false; }
   
@@ -496,6 +551,15 @@ bool SettingsDialog::ParseSettings() {
   
   config->use_pcg = use_pcg_checkbox->isChecked();
   
+  config->ba_local_window_size = ba_local_window_size_edit->text().toInt(&ok);
+  if (!ok) { report_error("ba_local_window_size", ba_local_window_size_edit->text()); return false; }
+  
+  config->ba_global_iteration_interval = ba_global_iteration_interval_edit->text().toInt(&ok);
+  if (!ok) { report_error("ba_global_iteration_interval", ba_global_iteration_interval_edit->text()); return false; }
+  
+  config->ba_global_time_interval = ba_global_time_interval_edit->text().toDouble(&ok);
+  if (!ok) { report_error("ba_global_time_interval", ba_global_time_interval_edit->text()); return false; }
+  
   config->estimate_poses = estimate_poses_checkbox->isChecked();
   
   
@@ -529,9 +593,18 @@ bool SettingsDialog::ParseSettings() {
   
   config->parallel_loop_detection = parallel_loop_detection_checkbox->isChecked();
   
+  config->loop_detection_worker_threads = loop_detection_worker_threads_edit->text().toInt(&ok);
+  if (!ok) { report_error("loop_detection_worker_threads", loop_detection_worker_threads_edit->text()); return false; }
+  
   config->loop_detection_image_frequency = loop_detection_image_frequency_edit->text().toInt(&ok);
   if (!ok) { report_error("loop_detection_image_frequency", loop_detection_image_frequency_edit->text()); return false; }
   
+  config->loop_detection_max_query_words = loop_detection_max_query_words_edit->text().toInt(&ok);
+  if (!ok) { report_error("loop_detection_max_query_words", loop_detection_max_query_words_edit->text()); return false; }
+  
+  config->loop_detection_max_keyframes_per_word = loop_detection_max_keyframes_per_word_edit->text().toInt(&ok);
+  if (!ok) { report_error("loop_detection_max_keyframes_per_word", loop_detection_max_keyframes_per_word_edit->text()); return false; }
+  
   
   // Depth preprocessing settings
   config->max_depth = max_depth_edit->text().toDouble(&ok);
@@ -80,9 +80,15 @@ class SettingsDialog : public QDialog {
   // Odometry settings
   QLineEdit* num_scales_edit;
   QCheckBox* use_motion_model_checkbox;
+  QCheckBox* multi_hypothesis_motion_model_checkbox;
   
   // BA settings
   QLineEdit* keyframe_interval_edit;
+  QCheckBox* adaptive_keyframes_checkbox;
+  QLineEdit* keyframe_min_overlap_edit;
+  QLineEdit* keyframe_max_translation_edit;
+  QLineEdit* keyframe_max_rotation_edit;
+  QLineEdit* keyframe_max_residual_increase_edit;
   QLineEdit* max_num_ba_iterations_per_keyframe_edit;
   QCheckBox* enable_deactivation_checkbox;
   QCheckBox* use_geometric_residuals_checkbox;
@@ -92,6 +98,9 @@ class SettingsDialog : public QDialog {
   QCheckBox* do_surfel_updates_checkbox;
   QCheckBox* parallel_ba_checkbox;
   QCheckBox* use_pcg_checkbox;
+  QLineEdit* ba_local_window_size_edit;
+  QLineEdit* ba_global_iteration_interval_edit;
+  QLineEdit* ba_global_time_interval_edit;
   QCheckBox* estimate_poses_checkbox;
   
   // Memory settings
@@ -108,6 +117,9 @@ class SettingsDialog : public QDialog {
   // Loop closure settings
   QCheckBox* loop_closure_checkbox;
   QCheckBox* parallel_loop_detection_checkbox;
+  QLineEdit* loop_detection_worker_threads_edit;
+  QLineEdit* loop_detection_max_query_words_edit;
+  QLineEdit* loop_detection_max_keyframes_per_word_edit;
   QLineEdit* loop_detection_image_frequency_edit;
   
   // Depth preprocessing settings
@@ -0,0 +1,92 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "badslam/image_conversion.h"
+
+#include <algorithm>
+
+#include <libvis/logging.h>
+#include <opencv2/core.hpp>
+
+#include "badslam/brightness.h"
+
+namespace vis {
+
+// The brightness weights with 16 fractional bits. They sum up to exactly 1, so
+// white stays white.
+constexpr u32 kFixedPointWeightR = static_cast<u32>(kBrightnessWeightR * 65536 + 0.5f);
+constexpr u32 kFixedPointWeightG = static_cast<u32>(kBrightnessWeightG * 65536 + 0.5f);
+constexpr u32 kFixedPointWeightB = static_cast<u32>(kBrightnessWeightB * 65536 + 0.5f);
+static_assert(kFixedPointWeightR + kFixedPointWeightG + kFixedPointWeightB == 65536,
+              "The fixed-point brightness weights must sum up to one");
+
+// Returns the brightness of the RGB color at rgb[0], rgb[1], rgb[2] using the
+// fixed-point weights, truncated like ComputeBrightness().
+inline u8 ComputeFixedPointBrightness(const u8* rgb) {
+  return (kFixedPointWeightR * rgb[0] +
+          kFixedPointWeightG * rgb[1] +
+          kFixedPointWeightB * rgb[2]) >> 16;
+}
+
+void ConvertRGBToBrightness(const Image<Vec3u8>& rgb_image, Image<u8>* gray_image) {
+  CHECK_EQ(rgb_image.width(), gray_image->width());
+  CHECK_EQ(rgb_image.height(), gray_image->height());
+  
+  const u32 width = rgb_image.width();
+  for (u32 y = 0; y < rgb_image.height(); ++ y) {
+    const u8* rgb_row = reinterpret_cast<const u8*>(rgb_image.row(y));
+    u8* gray_row = gray_image->row(y);
+    for (u32 x = 0; x < width; ++ x) {
+      gray_row[x] = ComputeFixedPointBrightness(rgb_row + 3 * x);
+    }
+  }
+}
+
+void SampleKeypointDepths(
+    const Image<u16>& depth_image,
+    float raw_to_float_depth,
+    vector<cv::KeyPoint>* keypoints) {
+  // TODO: This (and UnprojectFromPixelCornerConv() used later) assumes that
+  //       the OpenCV keypoints use the "pixel corner"
+  //       origin convention, which I am not sure about.
+  // TODO: This should ideally take the potential difference in the color and
+  //       depth camera intrinsics into account.
+  const float max_x = depth_image.width() - 1;
+  const float max_y = depth_image.height() - 1;
+  
+  for (cv::KeyPoint& key : *keypoints) {
+    // Clamping before the conversion to int gives the same result as the
+    // conversion followed by clamping, but avoids overflows for far-away
+    // positions.
+    const int x = std::max(0.f, std::min(max_x, key.pt.x));
+    const int y = std::max(0.f, std::min(max_y, key.pt.y));
+    key.response = raw_to_float_depth * depth_image.row(y)[x];
+  }
+}
+
+}
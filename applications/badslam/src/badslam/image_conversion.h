@@ -0,0 +1,58 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <vector>
+
+#include <libvis/image.h>
+#include <libvis/libvis.h>
+
+namespace cv {
+class KeyPoint;
+}
+
+namespace vis {
+
+// Converts an RGB image to a grayscale image with the brightness weights from
+// brightness.h, truncating the result like ComputeBrightness(). gray_image
+// must already have the size of rgb_image (it is not resized, such that it can
+// come from an ImagePool). The conversion uses integer arithmetic with 16-bit
+// fixed-point weights instead of float arithmetic. It may thus differ by one
+// from ComputeBrightness() for a few colors.
+void ConvertRGBToBrightness(const Image<Vec3u8>& rgb_image, Image<u8>* gray_image);
+
+// Stores the metric depth at the position of each keypoint in the keypoint's
+// "response" field. The positions are clamped to the image bounds. Pixels
+// without a depth measurement result in a depth of zero.
+void SampleKeypointDepths(
+    const Image<u16>& depth_image,
+    float raw_to_float_depth,
+    vector<cv::KeyPoint>* keypoints);
+
+}
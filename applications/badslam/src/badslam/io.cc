@@ -28,10 +28,15 @@
 
 #include "badslam/io.h"
 
+#include <cstring>
 #include <fstream>
+#include <future>
 #include <iomanip>
 
+#include <libvis/util.h>
+
 #include "badslam/bad_slam.h"
+#include "badslam/util.cuh"
 
 namespace vis {
 
@@ -182,113 +187,336 @@ bool SaveState(
   return true;
 }
 
-bool LoadState(
-    BadSlam* slam,
-    const std::string& path,
-    std::function<bool (int, int)> progress_function) {
-  // TODO: If loading is aborted, this function should ideally not make any changes
-  //       to the SLAM object. So, all possible reasons for aborting should be checked before making changes.
+namespace {
+
+// Reads the primitive values of a SLAM state file (see SaveState()). After the
+// first failed read, further reads do nothing and ok() returns false.
+class StateFileReader {
+ public:
+  explicit StateFileReader(FILE* file)
+      : file_(file) {
+    const long position = ftell(file_);
+    if (position >= 0 && fseek(file_, 0, SEEK_END) == 0) {
+      file_size_ = ftell(file_);
+      fseek(file_, position, SEEK_SET);
+    }
+  }
   
-  FILE* file = fopen(path.c_str(), "rb");
-  if (!file) {
-    return false;
+  // Returns whether at least the given number of bytes remains in the file.
+  // Used to validate sizes read from the file before allocating memory based
+  // on them.
+  bool CanRead(u64 bytes) const {
+    const long position = ftell(file_);
+    return position >= 0 && file_size_ >= position &&
+           bytes <= static_cast<u64>(file_size_ - position);
   }
   
-  auto LoadInt32 = [&]() {
-    i32 int32;
-    if (fread(&int32, sizeof(i32), 1, file) != 1) {
+  bool Skip(u64 bytes) {
+    if (ok_ && (!CanRead(bytes) || fseek(file_, bytes, SEEK_CUR) != 0)) {
       LOG(ERROR) << "Unexpected end of file.";
+      ok_ = false;
     }
-    return int32;
-  };
+    return ok_;
+  }
   
-  auto LoadU32 = [&]() {
-    u32 value;
-    if (fread(&value, sizeof(u32), 1, file) != 1) {
+  bool Read(void* destination, usize bytes) {
+    if (ok_ && fread(destination, 1, bytes, file_) != bytes) {
       LOG(ERROR) << "Unexpected end of file.";
+      ok_ = false;
     }
+    return ok_;
+  }
+  
+  i32 LoadInt32() {
+    i32 value = 0;
+    Read(&value, sizeof(i32));
     return value;
-  };
+  }
   
-  auto LoadFloat = [&]() {
-    float value;
-    if (fread(&value, sizeof(float), 1, file) != 1) {
-      LOG(ERROR) << "Unexpected end of file.";
-    }
+  u32 LoadU32() {
+    u32 value = 0;
+    Read(&value, sizeof(u32));
     return value;
-  };
+  }
   
-  auto LoadBool = [&]() {
-    u8 unsigned8;
-    if (fread(&unsigned8, sizeof(u8), 1, file) != 1) {
-      LOG(ERROR) << "Unexpected end of file.";
-    }
+  float LoadFloat() {
+    float value = 0;
+    Read(&value, sizeof(float));
+    return value;
+  }
+  
+  bool LoadBool() {
+    u8 unsigned8 = 0;
+    Read(&unsigned8, sizeof(u8));
     return unsigned8 != 0;
-  };
+  }
   
-  auto LoadSE3f = [&]() {
+  SE3f LoadSE3f() {
     SE3f value;
-    if (fread(value.data(), sizeof(float), 7, file) != 7) {
-      LOG(ERROR) << "Unexpected end of file.";
-    }
+    Read(value.data(), 7 * sizeof(float));
     return value;
-  };
+  }
   
-  // Header
+  inline FILE* file() const { return file_; }
+  inline bool ok() const { return ok_; }
+  
+ private:
+  FILE* file_;
+  long file_size_ = -1;
+  bool ok_ = true;
+};
+
+// Passed as expected size to the Read...() functions below if the size is not
+// known beforehand. The size is then only validated against the file size.
+constexpr usize kUnknownStateSize = numeric_limits<usize>::max();
+
+// The sections of a SLAM state file, in the order in which they are stored.
+// Each Read...() function below reads one of them and validates it before
+// anything is allocated based on its values. The BadSlamConfig, which follows
+// StateBadSlamSection, is read with BadSlamConfig::Load().
+
+struct StateBadSlamSection {
+  int base_kf_id;
+  vector<SE3f> motion_model_base_kf_tr_frame;
+  vector<int> queued_keyframes_frame_indices;
+  vector<SE3f> queued_keyframes_last_kf_tr_this_kf;
+  int last_frame_index;
+};
+
+struct StateKeyframeEntry {
+  // -1 for deleted keyframes, for which the other attributes are not stored.
+  int id;
+  int frame_index;
+  int activation;
+  int last_active_in_ba_iteration;
+  int last_covis_in_ba_iteration;
+};
+
+struct StateBASettings {
+  int ba_iteration_count;
+  int last_ba_iteration_count;
+  bool use_depth_residuals;
+  bool use_descriptor_residuals;
+  int min_observation_count_while_bootstrapping_1;
+  int min_observation_count_while_bootstrapping_2;
+  int min_observation_count;
+  float surfel_merge_dist_factor;
+};
+
+bool ReadStateHeader(StateFileReader* reader) {
   char identifier[7];
-  if (fread(identifier, 1, 7, file) != 7) {
+  if (!reader->Read(identifier, 7)) {
     LOG(ERROR) << "Encountered the end of file before finishing reading the file identifier.";
-    fclose(file); return false;
+    return false;
   }
-  if (identifier[0] != 'B' ||
-      identifier[1] != 'A' ||
-      identifier[2] != 'D' ||
-      identifier[3] != 'S' ||
-      identifier[4] != 'L' ||
-      identifier[5] != 'A' ||
-      identifier[6] != 'M') {
+  if (strncmp(identifier, "BADSLAM", 7) != 0) {
     LOG(ERROR) << "File identifier does not match.";
-    fclose(file); return false;
+    return false;
   }
   
   u8 version;
-  if (fread(&version, 1, 1, file) != 1) {
-    LOG(ERROR) << "Unexpected end of file.";
-    fclose(file); return false;
+  if (!reader->Read(&version, 1)) {
+    return false;
   }
   if (version != 1) {
     LOG(ERROR) << "Unknown file format version.";
-    fclose(file); return false;
+    return false;
   }
+  return true;
+}
+
+bool ReadStateBadSlamSection(StateFileReader* reader, StateBadSlamSection* section) {
+  section->base_kf_id = reader->LoadInt32();
   
-  
-  // BadSlam
-  int base_kf_id = LoadInt32();
-  
-  u32 size = LoadU32();
+  u32 size = reader->LoadU32();
   if (size > 1000) {
     LOG(ERROR) << "Excessive motion model size, refusing to load.";
-    fclose(file); return false;
+    return false;
   }
-  vector<SE3f> motion_model_base_kf_tr_frame(size);
+  section->motion_model_base_kf_tr_frame.resize(size);
   for (u32 i = 0; i < size; ++ i) {
-    motion_model_base_kf_tr_frame[i] = LoadSE3f();
+    section->motion_model_base_kf_tr_frame[i] = reader->LoadSE3f();
   }
-  slam->SetMotionModelBaseKFTrFrame(motion_model_base_kf_tr_frame);
   
-  size = LoadU32();
+  size = reader->LoadU32();
   if (size > 10000) {
     LOG(ERROR) << "Excessive queued keyframes size, refusing to load.";
-    fclose(file); return false;
+    return false;
+  }
+  section->queued_keyframes_frame_indices.resize(size);
+  section->queued_keyframes_last_kf_tr_this_kf.resize(size);
+  for (u32 i = 0; i < size; ++ i) {
+    section->queued_keyframes_frame_indices[i] = reader->LoadInt32();
+    section->queued_keyframes_last_kf_tr_this_kf[i] = reader->LoadSE3f();
+  }
+  
+  section->last_frame_index = reader->LoadInt32();
+  return reader->ok();
+}
+
+bool ReadStateFramePoses(StateFileReader* reader, usize expected_frame_count, vector<SE3f>* global_T_frame) {
+  u32 size = reader->LoadU32();
+  if (!reader->ok() || !reader->CanRead(static_cast<u64>(size) * 7 * sizeof(float))) {
+    LOG(ERROR) << "Invalid frame count.";
+    return false;
+  }
+  if (expected_frame_count != kUnknownStateSize && size != expected_frame_count) {
+    LOG(ERROR) << "Loaded frame count does not match the existing frame count in the dataset.";
+    return false;
   }
-  vector<int> queued_keyframes_frame_indices(size);
-  vector<SE3f> queued_keyframes_last_kf_tr_this_kf(size);
+  global_T_frame->resize(size);
   for (u32 i = 0; i < size; ++ i) {
-    queued_keyframes_frame_indices[i] = LoadInt32();
-    queued_keyframes_last_kf_tr_this_kf[i] = LoadSE3f();
+    (*global_T_frame)[i] = reader->LoadSE3f();
+  }
+  return reader->ok();
+}
+
+bool ReadStateCamera(StateFileReader* reader, const char* name, PinholeCamera4f* camera) {
+  int type_int = reader->LoadInt32();
+  int width = reader->LoadInt32();
+  int height = reader->LoadInt32();
+  int parameter_count = reader->LoadInt32();
+  if (!reader->ok() ||
+      type_int != static_cast<int>(Camera::Type::kPinholeCamera4f) ||
+      parameter_count != 4) {
+    LOG(ERROR) << "Unexpected " << name << " camera type or parameter count.";
+    return false;
+  }
+  float parameters[4];
+  if (!reader->Read(parameters, 4 * sizeof(float))) {
+    return false;
+  }
+  *camera = PinholeCamera4f(width, height, parameters);
+  return true;
+}
+
+// Reads the cfactor buffer, whose size must be expected_width x
+// expected_height. If cfactor is null, the buffer data is skipped instead, and
+// its size is not checked against the expected size.
+bool ReadStateCFactorBuffer(StateFileReader* reader, int expected_width, int expected_height, Image<float>* cfactor) {
+  int width = reader->LoadInt32();
+  int height = reader->LoadInt32();
+  int stride = reader->LoadInt32();
+  if (!reader->ok() ||
+      width < 0 || height < 0 ||
+      stride < width * static_cast<int>(sizeof(float)) ||
+      !reader->CanRead(static_cast<u64>(height) * stride)) {
+    LOG(ERROR) << "Invalid or excessive cfactor_buffer size, refusing to load.";
+    return false;
+  }
+  if (!cfactor) {
+    return reader->Skip(static_cast<u64>(height) * stride);
+  }
+  if (width != expected_width || height != expected_height) {
+    LOG(ERROR) << "cfactor_buffer size does not match.";
+    return false;
+  }
+  cfactor->SetSize(width, height, stride, 1);
+  return reader->Read(cfactor->data(), height * stride);
+}
+
+bool ReadStateDepthParameters(StateFileReader* reader, DepthParameters* depth_params) {
+  depth_params->a = reader->LoadFloat();
+  depth_params->raw_to_float_depth = reader->LoadFloat();
+  depth_params->baseline_fx = reader->LoadFloat();
+  depth_params->sparse_surfel_cell_size = reader->LoadInt32();
+  return reader->ok();
+}
+
+bool ReadStateKeyframeCount(StateFileReader* reader, usize frame_count, int* keyframe_count) {
+  *keyframe_count = reader->LoadInt32();
+  if (!reader->ok() || *keyframe_count < 0 || static_cast<usize>(*keyframe_count) > frame_count) {
+    LOG(ERROR) << "More keyframes than frames in the video.";
+    return false;
+  }
+  return true;
+}
+
+bool ReadStateKeyframeEntry(StateFileReader* reader, int index, usize frame_count, StateKeyframeEntry* entry) {
+  entry->id = reader->LoadInt32();
+  if (entry->id < 0) {
+    entry->id = -1;
+    return reader->ok();
+  }
+  if (entry->id != index) {
+    LOG(ERROR) << "Unexpected keyframe id.";
+    return false;
+  }
+  
+  entry->frame_index = reader->LoadInt32();
+  entry->activation = reader->LoadInt32();
+  entry->last_active_in_ba_iteration = reader->LoadInt32();
+  entry->last_covis_in_ba_iteration = reader->LoadInt32();
+  if (!reader->ok() || entry->frame_index < 0 || static_cast<usize>(entry->frame_index) >= frame_count) {
+    LOG(ERROR) << "Invalid keyframe frame index.";
+    return false;
+  }
+  return true;
+}
+
+// Reads the surfel count and buffer size. The surfel data follows as
+// kSurfelDataAttributeCount rows of surfels_size floats each.
+bool ReadStateSurfelCount(StateFileReader* reader, int max_surfel_count, int* surfels_size) {
+  int surfel_count = reader->LoadInt32();
+  *surfels_size = reader->LoadInt32();
+  if (!reader->ok()) {
+    return false;
+  }
+  if (surfel_count != *surfels_size) {
+    LOG(ERROR) << "surfel_count != surfels_size";
+    return false;
+  }
+  if (surfel_count > max_surfel_count) {
+    LOG(ERROR) << "surfel_count > max_surfel_count";
+    return false;
+  }
+  if (surfel_count < 0) {
+    LOG(ERROR) << "surfel_count < 0";
+    return false;
+  }
+  return true;
+}
+
+bool ReadStateBASettings(StateFileReader* reader, StateBASettings* settings) {
+  settings->ba_iteration_count = reader->LoadInt32();
+  settings->last_ba_iteration_count = reader->LoadInt32();
+  settings->use_depth_residuals = reader->LoadBool();
+  settings->use_descriptor_residuals = reader->LoadBool();
+  settings->min_observation_count_while_bootstrapping_1 = reader->LoadInt32();
+  settings->min_observation_count_while_bootstrapping_2 = reader->LoadInt32();
+  settings->min_observation_count = reader->LoadInt32();
+  settings->surfel_merge_dist_factor = reader->LoadFloat();
+  return reader->ok();
+}
+
+}
+
+bool LoadState(
+    BadSlam* slam,
+    const std::string& path,
+    std::function<bool (int, int)> progress_function) {
+  // TODO: If loading is aborted, this function should ideally not make any changes
+  //       to the SLAM object. So, all possible reasons for aborting should be checked before making changes.
+  
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+  StateFileReader reader(file);
+  
+  // Header
+  if (!ReadStateHeader(&reader)) {
+    fclose(file); return false;
   }
   
-  slam->SetLastIndexInVideo(LoadInt32());
+  
+  // BadSlam
+  StateBadSlamSection bad_slam_section;
+  if (!ReadStateBadSlamSection(&reader, &bad_slam_section)) {
+    fclose(file); return false;
+  }
+  slam->SetMotionModelBaseKFTrFrame(bad_slam_section.motion_model_base_kf_tr_frame);
+  slam->SetLastIndexInVideo(bad_slam_section.last_frame_index);
   
   // Config
   if (!slam->config().Load(file)) {
@@ -306,85 +534,48 @@ bool LoadState(
   
   
   // RGBDVideo (frame poses)
-  size = LoadU32();
-  if (size != slam->rgbd_video()->frame_count()) {
-    LOG(ERROR) << "Loaded frame count does not match the existing frame count in the dataset.";
+  vector<SE3f> global_T_frame;
+  if (!ReadStateFramePoses(&reader, slam->rgbd_video()->frame_count(), &global_T_frame)) {
     fclose(file); return false;
   }
-  for (u32 i = 0; i < size; ++ i) {
-    SE3f global_T_frame = LoadSE3f();
-    slam->rgbd_video()->color_frame_mutable(i)->SetGlobalTFrame(global_T_frame);
-    slam->rgbd_video()->depth_frame_mutable(i)->SetGlobalTFrame(global_T_frame);
+  for (u32 i = 0; i < global_T_frame.size(); ++ i) {
+    slam->rgbd_video()->color_frame_mutable(i)->SetGlobalTFrame(global_T_frame[i]);
+    slam->rgbd_video()->depth_frame_mutable(i)->SetGlobalTFrame(global_T_frame[i]);
   }
   
   
   // Direct BA
   ba.keyframes_mutable()->clear();
   
-  int color_camera_type_int = LoadInt32();
-  int color_camera_width = LoadInt32();
-  int color_camera_height = LoadInt32();
-  int color_camera_parameter_count = LoadInt32();
-  if (color_camera_type_int != static_cast<int>(Camera::Type::kPinholeCamera4f) ||
-      color_camera_parameter_count != 4) {
-    LOG(ERROR) << "Unexpected color camera type or parameter count.";
-    fclose(file); return false;
-  }
-  float color_camera_parameters[4];
-  if (fread(color_camera_parameters, sizeof(float), color_camera_parameter_count, file) != color_camera_parameter_count) {
-    LOG(ERROR) << "Unexpected end of file.";
+  PinholeCamera4f color_camera;
+  if (!ReadStateCamera(&reader, "color", &color_camera)) {
     fclose(file); return false;
   }
-  ba.SetColorCamera(PinholeCamera4f(color_camera_width, color_camera_height, color_camera_parameters));
+  ba.SetColorCamera(color_camera);
   
-  ba.SetPyramidLevelForColor(LoadInt32());
+  ba.SetPyramidLevelForColor(reader.LoadInt32());
   
-  int depth_camera_type_int = LoadInt32();
-  int depth_camera_width = LoadInt32();
-  int depth_camera_height = LoadInt32();
-  int depth_camera_parameter_count = LoadInt32();
-  if (depth_camera_type_int != static_cast<int>(Camera::Type::kPinholeCamera4f) ||
-      depth_camera_parameter_count != 4) {
-    LOG(ERROR) << "Unexpected depth camera type or parameter count.";
-    fclose(file); return false;
-  }
-  float depth_camera_parameters[4];
-  if (fread(depth_camera_parameters, sizeof(float), depth_camera_parameter_count, file) != depth_camera_parameter_count) {
-    LOG(ERROR) << "Unexpected end of file.";
+  PinholeCamera4f depth_camera;
+  if (!ReadStateCamera(&reader, "depth", &depth_camera)) {
     fclose(file); return false;
   }
-  ba.SetDepthCamera(PinholeCamera4f(depth_camera_width, depth_camera_height, depth_camera_parameters));
+  ba.SetDepthCamera(depth_camera);
   
-  int cfactor_buffer_width = LoadInt32();
-  int cfactor_buffer_height = LoadInt32();
-  if (cfactor_buffer_width != ba.cfactor_buffer()->width() ||
-      cfactor_buffer_height != ba.cfactor_buffer()->height()) {
-    LOG(ERROR) << "cfactor_buffer size does not match.";
-    fclose(file); return false;
-  }
-  int cfactor_buffer_stride = LoadInt32();
-  if (cfactor_buffer_stride > 100000 * sizeof(float)) {
-    LOG(ERROR) << "Excessive cfactor_buffer stride, refusing to load.";
-    fclose(file); return false;
-  }
-  Image<float> cfactor_cpu(cfactor_buffer_width, cfactor_buffer_height, cfactor_buffer_stride, 1);
-  if (fread(cfactor_cpu.data(), 1, cfactor_cpu.height() * cfactor_cpu.stride(), file) != cfactor_cpu.height() * cfactor_cpu.stride()) {
-    LOG(ERROR) << "Unexpected end of file.";
+  Image<float> cfactor_cpu;
+  if (!ReadStateCFactorBuffer(&reader, ba.cfactor_buffer()->width(), ba.cfactor_buffer()->height(), &cfactor_cpu)) {
     fclose(file); return false;
   }
   ba.cfactor_buffer()->UploadAsync(0, cfactor_cpu);
   
   DepthParameters depth_params = ba.depth_params();
-  depth_params.a = LoadFloat();
-  depth_params.raw_to_float_depth = LoadFloat();
-  depth_params.baseline_fx = LoadFloat();
-  depth_params.sparse_surfel_cell_size = LoadInt32();
+  if (!ReadStateDepthParameters(&reader, &depth_params)) {
+    fclose(file); return false;
+  }
   ba.SetDepthParams(depth_params);
   
   // Load keyframes. Relevant parameters must be set beforehand (e.g., RGBDVideo poses).
-  size = LoadInt32();
-  if (size > slam->rgbd_video()->frame_count()) {
-    LOG(ERROR) << "More keyframes than frames in the video.";
+  int keyframe_count;
+  if (!ReadStateKeyframeCount(&reader, slam->rgbd_video()->frame_count(), &keyframe_count)) {
     fclose(file); return false;
   }
   // Force the new keyframes to get processed immediately.
@@ -394,97 +585,85 @@ bool LoadState(
   slam->config().parallel_ba = false;
   slam->config().parallel_loop_detection = false;
   slam->config().estimate_poses = false;
-  for (usize i = 0; i < size; ++ i) {
+  for (int i = 0; i < keyframe_count; ++ i) {
     if (progress_function) {
-      if (!progress_function(i, size)) {
+      if (!progress_function(i, keyframe_count)) {
         // Aborted.
         ba.keyframes_mutable()->clear();
         fclose(file); return false;
       }
     }
     
-    int keyframe_id = LoadInt32();
-    if (keyframe_id < 0) {
+    StateKeyframeEntry entry;
+    if (!ReadStateKeyframeEntry(&reader, i, slam->rgbd_video()->frame_count(), &entry)) {
+      fclose(file); return false;
+    }
+    if (entry.id < 0) {
       ba.keyframes_mutable()->push_back(nullptr);
     } else {
-      if (keyframe_id != i) {
-        LOG(ERROR) << "Unexpected keyframe id.";
-        fclose(file); return false;
-      }
-      
-      int frame_index = LoadInt32();
-      int activation = LoadInt32();
-      int last_active_in_ba_iteration = LoadInt32();
-      int last_covis_in_ba_iteration = LoadInt32();
-      
       // Create a keyframe with the loaded properties
-      const Image<Vec3u8>* rgb_image =
-          slam->rgbd_video()->color_frame_mutable(frame_index)->GetImage().get();
+      shared_ptr<Image<Vec3u8>> rgb_image =
+          slam->rgbd_video()->color_frame_mutable(entry.frame_index)->GetImage();
       
       shared_ptr<Image<u16>> final_cpu_depth_map;
       CUDABuffer<u16>* final_depth_buffer;
       slam->PreprocessFrame(
-          frame_index,
+          entry.frame_index,
           &final_depth_buffer,
           &final_cpu_depth_map);
       
       shared_ptr<Keyframe> new_keyframe = slam->CreateKeyframe(
-          frame_index,
-          rgb_image,
+          entry.frame_index,
+          rgb_image.get(),
           final_cpu_depth_map,
           *final_depth_buffer);
       
-      CHECK_EQ(new_keyframe->id(), keyframe_id);
-      new_keyframe->SetActivation(static_cast<Keyframe::Activation>(activation));
-      new_keyframe->SetLastActiveInBAIteration(last_active_in_ba_iteration);
-      new_keyframe->SetLastCovisInBAIteration(last_covis_in_ba_iteration);
+      CHECK_EQ(new_keyframe->id(), entry.id);
+      new_keyframe->SetActivation(static_cast<Keyframe::Activation>(entry.activation));
+      new_keyframe->SetLastActiveInBAIteration(entry.last_active_in_ba_iteration);
+      new_keyframe->SetLastCovisInBAIteration(entry.last_covis_in_ba_iteration);
       
-      slam->rgbd_video()->color_frame_mutable(frame_index)->ClearImageAndDerivedData();
-      slam->rgbd_video()->depth_frame_mutable(frame_index)->ClearImageAndDerivedData();
+      slam->rgbd_video()->color_frame_mutable(entry.frame_index)->ClearImageAndDerivedData();
+      slam->rgbd_video()->depth_frame_mutable(entry.frame_index)->ClearImageAndDerivedData();
     }
   }
   slam->config().parallel_ba = old_parallel_ba;
   slam->config().parallel_loop_detection = old_parallel_loop_detection;
   slam->config().estimate_poses = old_estimate_poses;
+  ba.PublishKeyframePoses();
   
-  int surfel_count = LoadInt32();
-  int surfels_size = LoadInt32();
-  if (surfel_count != surfels_size) {
-    LOG(ERROR) << "surfel_count != surfels_size";
-    fclose(file); return false;
-  }
-  if (surfel_count > slam->config().max_surfel_count) {
-    LOG(ERROR) << "surfel_count > slam->config().max_surfel_count";
+  int surfels_size;
+  if (!ReadStateSurfelCount(&reader, slam->config().max_surfel_count, &surfels_size)) {
     fclose(file); return false;
   }
-  if (surfel_count < 0) {
-    LOG(ERROR) << "surfel_count < 0";
-    fclose(file); return false;
-  }
-  ba.SetSurfelCount(surfel_count, surfels_size);
+  ba.SetSurfelCount(surfels_size, surfels_size);
   CUDABufferPtr<float> surfels = ba.surfels();
   vector<float> surfel_data(surfels_size);
   for (int i = 0; i < kSurfelDataAttributeCount; ++ i) {
-    if (fread(surfel_data.data(), sizeof(float), ba.surfels_size(), file) != ba.surfels_size()) {
-      LOG(ERROR) << "Unexpected end of file.";
+    if (!reader.Read(surfel_data.data(), surfels_size * sizeof(float))) {
       fclose(file); return false;
     }
-    surfels->UploadPartAsync(i * surfels->ToCUDA().pitch(), ba.surfels_size() * sizeof(float), 0, surfel_data.data());
+    surfels->UploadPartAsync(i * surfels->ToCUDA().pitch(), surfels_size * sizeof(float), 0, surfel_data.data());
   }
   
-  ba.SetBAIterationCount(LoadInt32());
-  ba.SetLastBAIterationCount(LoadInt32());
+  StateBASettings ba_settings;
+  if (!ReadStateBASettings(&reader, &ba_settings)) {
+    fclose(file); return false;
+  }
+  ba.SetBAIterationCount(ba_settings.ba_iteration_count);
+  ba.SetLastBAIterationCount(ba_settings.last_ba_iteration_count);
   
-  ba.SetUseDepthResiduals(LoadBool());
-  ba.SetUseDescriptorResiduals(LoadBool());
+  ba.SetUseDepthResiduals(ba_settings.use_depth_residuals);
+  ba.SetUseDescriptorResiduals(ba_settings.use_descriptor_residuals);
   
-  ba.SetMinObservationCountWhileBootstrapping1(LoadInt32());
-  ba.SetMinObservationCountWhileBootstrapping2(LoadInt32());
-  ba.SetMinObservationCount(LoadInt32());
+  ba.SetMinObservationCountWhileBootstrapping1(ba_settings.min_observation_count_while_bootstrapping_1);
+  ba.SetMinObservationCountWhileBootstrapping2(ba_settings.min_observation_count_while_bootstrapping_2);
+  ba.SetMinObservationCount(ba_settings.min_observation_count);
   
-  ba.SetSurfelMergeDistFactor(LoadFloat());
+  ba.SetSurfelMergeDistFactor(ba_settings.surfel_merge_dist_factor);
   
   // Assign BadSlam::base_kf_.
+  int base_kf_id = bad_slam_section.base_kf_id;
   if (base_kf_id < 0) {
     slam->SetBaseKF(nullptr);
   } else if (base_kf_id < ba.keyframes().size()) {
@@ -495,15 +674,16 @@ bool LoadState(
   }
   
   // Load queued keyframes.
+  const vector<int>& queued_keyframes_frame_indices = bad_slam_section.queued_keyframes_frame_indices;
   usize num_queued_keyframes = queued_keyframes_frame_indices.size();
   vector<shared_ptr<Keyframe>> queued_keyframes(num_queued_keyframes);
-  vector<cv::Mat_<u8>> queued_keyframe_gray_images(num_queued_keyframes);
+  vector<shared_ptr<Image<u8>>> queued_keyframe_gray_images(num_queued_keyframes);
   vector<shared_ptr<Image<u16>>> queued_keyframe_depth_images(num_queued_keyframes);
   for (usize i = 0; i < queued_keyframes_frame_indices.size(); ++ i) {
     int frame_index = queued_keyframes_frame_indices[i];
     
-    const Image<Vec3u8>* rgb_image =
-        slam->rgbd_video()->color_frame_mutable(frame_index)->GetImage().get();
+    shared_ptr<Image<Vec3u8>> rgb_image =
+        slam->rgbd_video()->color_frame_mutable(frame_index)->GetImage();
     
     shared_ptr<Image<u16>> final_cpu_depth_map;
     CUDABuffer<u16>* final_depth_buffer;
@@ -514,7 +694,7 @@ bool LoadState(
     
     queued_keyframes[i] = slam->CreateKeyframe(
         frame_index,
-        rgb_image,
+        rgb_image.get(),
         final_cpu_depth_map,
         *final_depth_buffer);
     
@@ -526,7 +706,7 @@ bool LoadState(
   }
   slam->SetQueuedKeyframes(
       queued_keyframes,
-      queued_keyframes_last_kf_tr_this_kf,
+      bad_slam_section.queued_keyframes_last_kf_tr_this_kf,
       queued_keyframe_gray_images,
       queued_keyframe_depth_images);
   
@@ -534,6 +714,101 @@ bool LoadState(
   return true;
 }
 
+bool LoadSurfelStateData(
+    const std::string& path,
+    SurfelStateData* data) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+  StateFileReader reader(file);
+  
+  // Header
+  if (!ReadStateHeader(&reader)) {
+    fclose(file); return false;
+  }
+  
+  // BadSlam (not required here)
+  StateBadSlamSection bad_slam_section;
+  if (!ReadStateBadSlamSection(&reader, &bad_slam_section)) {
+    fclose(file); return false;
+  }
+  
+  // Config
+  BadSlamConfig config;
+  if (!config.Load(file)) {
+    fclose(file); return false;
+  }
+  data->max_depth = config.max_depth;
+  data->max_surfel_count = config.max_surfel_count;
+  
+  // RGBDVideo (frame poses)
+  vector<SE3f> global_T_frame;
+  if (!ReadStateFramePoses(&reader, kUnknownStateSize, &global_T_frame)) {
+    fclose(file); return false;
+  }
+  
+  // Direct BA. The color camera and the cfactor buffer are not required.
+  PinholeCamera4f color_camera;
+  if (!ReadStateCamera(&reader, "color", &color_camera)) {
+    fclose(file); return false;
+  }
+  reader.LoadInt32();  // pyramid_level_for_color
+  
+  if (!ReadStateCamera(&reader, "depth", &data->depth_camera)) {
+    fclose(file); return false;
+  }
+  
+  if (!ReadStateCFactorBuffer(&reader, 0, 0, /*cfactor*/ nullptr)) {
+    fclose(file); return false;
+  }
+  
+  DepthParameters depth_params;
+  if (!ReadStateDepthParameters(&reader, &depth_params)) {
+    fclose(file); return false;
+  }
+  data->settings.sparse_surfel_cell_size = depth_params.sparse_surfel_cell_size;
+  
+  int keyframe_count;
+  if (!ReadStateKeyframeCount(&reader, global_T_frame.size(), &keyframe_count)) {
+    fclose(file); return false;
+  }
+  data->keyframe_ids.clear();
+  data->keyframe_global_T_frame.clear();
+  for (int i = 0; i < keyframe_count; ++ i) {
+    StateKeyframeEntry entry;
+    if (!ReadStateKeyframeEntry(&reader, i, global_T_frame.size(), &entry)) {
+      fclose(file); return false;
+    }
+    if (entry.id < 0) {
+      continue;
+    }
+    data->keyframe_ids.push_back(entry.id);
+    data->keyframe_global_T_frame.push_back(global_T_frame[entry.frame_index]);
+  }
+  
+  int surfels_size;
+  if (!ReadStateSurfelCount(&reader, config.max_surfel_count, &surfels_size)) {
+    fclose(file); return false;
+  }
+  data->surfels.SetSize(surfels_size, kSurfelDataAttributeCount);
+  for (int i = 0; i < kSurfelDataAttributeCount; ++ i) {
+    if (!reader.Read(data->surfels.row(i), surfels_size * sizeof(float))) {
+      fclose(file); return false;
+    }
+  }
+  
+  StateBASettings ba_settings;
+  if (!ReadStateBASettings(&reader, &ba_settings)) {
+    fclose(file); return false;
+  }
+  data->settings.min_observation_count = ba_settings.min_observation_count;
+  data->settings.surfel_merge_dist_factor = ba_settings.surfel_merge_dist_factor;
+  
+  fclose(file);
+  return true;
+}
+
 bool SavePoses(
     const RGBDVideo<Vec3u8, u16>& rgbd_video,
     bool use_depth_timestamps,
@@ -639,10 +914,10 @@ bool LoadCalibration(
     
     intrinsics[2] += 0.5;
     intrinsics[3] += 0.5;
-    direct_ba->depth_camera() = PinholeCamera4f(
+    direct_ba->SetDepthCamera(PinholeCamera4f(
         direct_ba->depth_camera().width(),
         direct_ba->depth_camera().height(),
-        intrinsics);
+        intrinsics));
   }
   
   {
@@ -658,10 +933,10 @@ bool LoadCalibration(
     
     intrinsics[2] += 0.5;
     intrinsics[3] += 0.5;
-    direct_ba->color_camera() = PinholeCamera4f(
+    direct_ba->SetColorCamera(PinholeCamera4f(
         direct_ba->color_camera().width(),
         direct_ba->color_camera().height(),
-        intrinsics);
+        intrinsics));
   }
   
   std::string deformation_path = import_base_path + ".deformation.txt";
@@ -678,7 +953,9 @@ bool LoadCalibration(
     LOG(ERROR) << "cfactor buffer size mismatch in current configuration vs. imported deformation - need to implement rescaling";
     return false;
   }
-  deformation_file >> direct_ba->a();
+  float a;
+  deformation_file >> a;
+  direct_ba->SetA(a);
   Image<float> cfactor_buffer_cpu(cfactor_buffer->width(), cfactor_buffer->height());
   for (u32 y = 0; y < cfactor_buffer_cpu.height(); ++ y) {
     for (u32 x = 0; x < cfactor_buffer_cpu.width(); ++ x) {
@@ -695,11 +972,184 @@ bool SavePointCloudAsPLY(
     cudaStream_t stream,
     const DirectBA& direct_ba,
     const string& export_path) {
-  Point3fC3u8NfCloud cloud;
-  direct_ba.ExportToPointCloud(stream, &cloud);
-  bool result = cloud.WriteAsPLY(export_path);
+  // Number of surfels which are downloaded and encoded at a time. The surfels
+  // are streamed to the file chunk by chunk instead of first creating the
+  // complete point cloud in CPU memory (as DirectBA::ExportToPointCloud()
+  // does), since the latter may require several GB of memory for large models.
+  constexpr usize kChunkSurfelCount = 1 << 20;
+  
+  // Surfel attributes which are exported, and their indices in chunk_columns.
+  constexpr int kExportedAttributeCount = 5;
+  const int exported_attributes[kExportedAttributeCount] = {
+      kSurfelX, kSurfelY, kSurfelZ, kSurfelColor, kSurfelNormal};
+  enum ColumnIndex { kX = 0, kY, kZ, kColor, kNormal };
+  
+  typedef PointCloudPLYWriter<Point3fC3u8Nf> Writer;
+  Writer writer;
+  if (!writer.Open(export_path.c_str())) {
+    return false;
+  }
+  
+  u32 surfels_size = direct_ba.surfels_size();
+  CUDABufferConstPtr<float> surfels = direct_ba.surfels();
+  const usize pitch = surfels->ToCUDA().pitch();
+  
+  vector<float> chunk_columns[kExportedAttributeCount];
+  for (int a = 0; a < kExportedAttributeCount; ++ a) {
+    chunk_columns[a].resize(std::min<usize>(kChunkSurfelCount, surfels_size));
+  }
+  
+  // The encoded data is double-buffered such that writing one chunk to the
+  // file overlaps with downloading and encoding the next one.
+  vector<u8> encoded[2];
+  std::future<bool> pending_write;
+  bool result = true;
+  
+  const usize block_count = DefaultThreadCount();
+  vector<usize> block_offsets(block_count + 1);
+  
+  for (usize chunk_start = 0, chunk_index = 0; chunk_start < surfels_size; chunk_start += kChunkSurfelCount, ++ chunk_index) {
+    const usize chunk_size = std::min<usize>(kChunkSurfelCount, surfels_size - chunk_start);
+    for (int a = 0; a < kExportedAttributeCount; ++ a) {
+      surfels->DownloadPartAsync(
+          exported_attributes[a] * pitch + chunk_start * sizeof(float),
+          chunk_size * sizeof(float),
+          stream, chunk_columns[a].data());
+    }
+    cudaStreamSynchronize(stream);
+    
+    // Count the valid surfels in each block to determine the output offsets.
+    std::fill(block_offsets.begin(), block_offsets.end(), 0);
+    ParallelForBlocks(0, chunk_size, block_count, [&](usize block_index, usize block_begin, usize block_end) {
+      usize valid_count = 0;
+      for (usize i = block_begin; i < block_end; ++ i) {
+        valid_count += std::isnan(chunk_columns[kX][i]) ? 0 : 1;
+      }
+      block_offsets[block_index + 1] = valid_count;
+    });
+    for (usize b = 0; b < block_count; ++ b) {
+      block_offsets[b + 1] += block_offsets[b];
+    }
+    const usize valid_count = block_offsets[block_count];
+    
+    vector<u8>& chunk_encoded = encoded[chunk_index % 2];
+    chunk_encoded.resize(valid_count * Writer::kEncodedSize);
+    
+    // Convert the valid surfels to points and encode them.
+    ParallelForBlocks(0, chunk_size, block_count, [&](usize block_index, usize block_begin, usize block_end) {
+      u8* ptr = chunk_encoded.data() + block_offsets[block_index] * Writer::kEncodedSize;
+      for (usize i = block_begin; i < block_end; ++ i) {
+        if (std::isnan(chunk_columns[kX][i])) {
+          continue;
+        }
+        
+        const uchar4& color = reinterpret_cast<const uchar4&>(chunk_columns[kColor][i]);
+        u32 normal_value = *reinterpret_cast<const u32*>(&chunk_columns[kNormal][i]);
+        Vec3f normal(
+            TenBitSignedToFloat(normal_value >> 0),
+            TenBitSignedToFloat(normal_value >> 10),
+            TenBitSignedToFloat(normal_value >> 20));
+        
+        ptr = PLYPointEncoding<Point3fC3u8Nf>::Encode(
+            Point3fC3u8Nf(
+                Vec3f(chunk_columns[kX][i], chunk_columns[kY][i], chunk_columns[kZ][i]),
+                Vec3u8(color.x, color.y, color.z),
+                normal.normalized()),
+            ptr);
+      }
+    });
+    
+    if (pending_write.valid()) {
+      result &= pending_write.get();
+    }
+    pending_write = std::async(std::launch::async, [&writer, &chunk_encoded, valid_count]() {
+      return writer.WriteEncoded(chunk_encoded.data(), valid_count);
+    });
+  }
+  if (pending_write.valid()) {
+    result &= pending_write.get();
+  }
+  
+  u32 surfel_count = direct_ba.surfel_count();
+  if (writer.written_vertex_count() != surfel_count) {
+    LOG(ERROR) << "surfel_count (" << surfel_count << ") is not consistent with the actual number of valid surfels (" << writer.written_vertex_count() << ")!";
+  }
+  
+  result &= writer.Close();
   LOG(INFO) << "Wrote point cloud to: " << export_path;
   return result;
 }
 
+bool SaveMultiViewStereoPointCloudAsPLY(
+    cudaStream_t stream,
+    const DirectBA& direct_ba,
+    const MultiViewStereoOptions& options,
+    const string& export_path) {
+  // Download the keyframe images. Deleted keyframes leave nullptr entries.
+  vector<KeyframeImageData> images(direct_ba.keyframes().size());
+  vector<MultiViewStereoKeyframe> keyframes;
+  for (usize i = 0; i < direct_ba.keyframes().size(); ++ i) {
+    const shared_ptr<Keyframe>& keyframe = direct_ba.keyframes()[i];
+    if (!keyframe) {
+      continue;
+    }
+    if (!keyframe->DownloadImages(stream, &images[i])) {
+      LOG(ERROR) << "Cannot access the image data of keyframe " << keyframe->id();
+      return false;
+    }
+    keyframes.push_back({keyframe->id(), keyframe->global_T_frame(), keyframe->co_visibility_list(), &images[i]});
+  }
+  
+  DepthParametersCPU calibration;
+  DepthParameters depth_params = direct_ba.depth_params();
+  calibration.raw_to_float_depth = depth_params.raw_to_float_depth;
+  calibration.a = depth_params.a;
+  calibration.sparse_surfel_cell_size = depth_params.sparse_surfel_cell_size;
+  CUDABufferConstPtr<float> cfactor_buffer = direct_ba.cfactor_buffer();
+  calibration.cfactor.SetSize(cfactor_buffer->width(), cfactor_buffer->height());
+  cfactor_buffer->DownloadAsync(stream, &calibration.cfactor);
+  cudaStreamSynchronize(stream);
+  
+  Point3fC3u8Cloud cloud;
+  MultiViewStereoStatistics statistics;
+  ComputeMultiViewStereoPointCloud(
+      keyframes, direct_ba.depth_camera(), direct_ba.color_camera(),
+      calibration, options, &cloud, &statistics);
+  LOG(INFO) << "Multi-view stereo: processed " << statistics.processed_keyframe_count
+            << " of " << keyframes.size() << " keyframes, "
+            << statistics.consistent_pixel_count << " of "
+            << statistics.estimated_pixel_count << " depth estimates are consistent, "
+            << statistics.fused_point_count << " fused points";
+  
+  if (!cloud.WriteAsPLY(export_path)) {
+    LOG(ERROR) << "Cannot write point cloud to: " << export_path;
+    return false;
+  }
+  LOG(INFO) << "Wrote multi-view stereo point cloud to: " << export_path;
+  return true;
+}
+
+bool SaveSurfelMapCompressed(
+    cudaStream_t stream,
+    const DirectBA& direct_ba,
+    const SurfelMapEncodingOptions& options,
+    const string& export_path) {
+  u32 surfels_size = direct_ba.surfels_size();
+  CUDABufferConstPtr<float> surfels = direct_ba.surfels();
+  
+  SurfelMapData surfel_data;
+  surfel_data.Resize(surfels_size);
+  for (int i = 0; i < kSurfelDataAttributeCount; ++ i) {
+    surfels->DownloadPartAsync(i * surfels->ToCUDA().pitch(), surfels_size * sizeof(float), stream, surfel_data.attributes[i].data());
+  }
+  cudaStreamSynchronize(stream);
+  
+  if (!SaveSurfelMap(surfel_data, options, export_path)) {
+    return false;
+  }
+  LOG(INFO) << "Wrote compressed surfel map to: " << export_path;
+  return true;
+}
+
 }
+
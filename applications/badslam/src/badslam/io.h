@@ -34,6 +34,9 @@
 #include <libvis/rgbd_video.h>
 
 #include "badslam/direct_ba.h"
+#include "badslam/multi_view_stereo.h"
+#include "badslam/surfel_map_codec.h"
+#include "badslam/surfel_statistics.h"
 
 namespace vis {
 
@@ -51,6 +54,13 @@ bool LoadState(
     const std::string& path,
     std::function<bool (int, int)> progress_function = nullptr);
 
+// Reads the surfels, keyframe poses, and surfel-related settings from a SLAM
+// state file (that was saved with SaveState()). Unlike LoadState(), this does
+// not require the dataset or a GPU.
+bool LoadSurfelStateData(
+    const std::string& path,
+    SurfelStateData* data);
+
 // Saves the poses in TUM-RGBD format. Transforms the frame poses such that the
 // start frame is at identity.
 bool SavePoses(
@@ -74,9 +84,30 @@ bool LoadCalibration(
     const string& import_base_path);
 
 // Saves the surfel point cloud in PLY format. Includes colors and normals.
+// The surfels are downloaded, converted and written in chunks, so the complete
+// point cloud is never held in CPU memory.
 bool SavePointCloudAsPLY(
     cudaStream_t stream,
     const DirectBA& dense_ba,
     const string& export_path);
 
+// Densifies the keyframes with multi-view stereo on the CPU (see
+// ComputeMultiViewStereoPointCloud()) and saves the resulting colored point
+// cloud in PLY format.
+bool SaveMultiViewStereoPointCloudAsPLY(
+    cudaStream_t stream,
+    const DirectBA& direct_ba,
+    const MultiViewStereoOptions& options,
+    const string& export_path);
+
+// Saves the surfels in the compact surfel map format (see EncodeSurfelMap()).
+// Unlike SaveState(), this only stores the surfels, and positions are
+// quantized with the tolerance given in the options.
+bool SaveSurfelMapCompressed(
+    cudaStream_t stream,
+    const DirectBA& direct_ba,
+    const SurfelMapEncodingOptions& options,
+    const string& export_path);
+
 }
+
@@ -60,6 +60,10 @@ void AssignColorsCUDA(
     if (!keyframe) {
       continue;
     }
+    KeyframeResidencyPin pin = keyframe->Pin(stream);
+    if (!pin) {
+      continue;
+    }
     
     CallAccumulateColorObservationsCUDAKernel(
         stream,
@@ -100,6 +104,10 @@ void AssignDescriptorColorsCUDA(
     if (!keyframe) {
       continue;
     }
+    KeyframeResidencyPin pin = keyframe->Pin(stream);
+    if (!pin) {
+      continue;
+    }
     
     CallAccumulateDescriptorColorObservationsCUDAKernel(
         stream,
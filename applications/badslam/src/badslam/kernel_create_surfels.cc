@@ -118,6 +118,10 @@ void CreateSurfelsForKeyframeCUDA(
     const shared_ptr<Keyframe>& keyframe = keyframes[keyframe_id];
     for (usize i = 0; i < keyframe->co_visibility_list().size(); ++ i) {
       const shared_ptr<Keyframe>& co_visible_keyframe = keyframes[keyframe->co_visibility_list()[i]];
+      KeyframeResidencyPin pin = co_visible_keyframe->Pin(stream);
+      if (!pin) {
+        continue;
+      }
       
       CallCountObservationsForNewSurfelsCUDAKernel(
           stream,
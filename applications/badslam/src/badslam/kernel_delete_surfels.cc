@@ -71,6 +71,10 @@ void DeleteSurfelsAndUpdateRadiiCUDAImpl(
     if (!keyframe) {
       continue;
     }
+    KeyframeResidencyPin pin = keyframe->Pin(stream);
+    if (!pin) {
+      continue;
+    }
     
     CallCountObservationsAndFreeSpaceViolationsCUDAKernel(
         stream,
@@ -60,6 +60,10 @@ void UpdateSurfelNormalsCUDA(
     if (!keyframe || keyframe->activation() == Keyframe::Activation::kInactive) {
       continue;
     }
+    KeyframeResidencyPin pin = keyframe->Pin(stream);
+    if (!pin) {
+      continue;
+    }
     
     CallAccumulateSurfelNormalOptimizationCoeffsCUDAKernel(
         stream,
@@ -115,6 +119,10 @@ void OptimizeGeometryIterationCUDA(
     if (!keyframe || keyframe->activation() == Keyframe::Activation::kInactive) {
       continue;
     }
+    KeyframeResidencyPin pin = keyframe->Pin(stream);
+    if (!pin) {
+      continue;
+    }
     
     CallAccumulateSurfelNormalOptimizationCoeffsCUDAKernel(
         stream,
@@ -149,6 +157,10 @@ void OptimizeGeometryIterationCUDA(
       if (!keyframe || keyframe->activation() == Keyframe::Activation::kInactive) {
         continue;
       }
+      KeyframeResidencyPin pin = keyframe->Pin(stream);
+      if (!pin) {
+        continue;
+      }
       
       CallAccumulateSurfelPositionOptimizationCoeffsFromDepthResidualCUDAKernel(
           stream,
@@ -180,6 +192,10 @@ void OptimizeGeometryIterationCUDA(
       if (!keyframe || keyframe->activation() == Keyframe::Activation::kInactive) {
         continue;
       }
+      KeyframeResidencyPin pin = keyframe->Pin(stream);
+      if (!pin) {
+        continue;
+      }
       
       AccumulateSurfelPositionAndDescriptorOptimizationCoeffsCUDAKernel(
           stream,
@@ -86,6 +86,10 @@ void OptimizeIntrinsicsCUDA(
     if (!keyframe) {
       continue;
     }
+    KeyframeResidencyPin pin = keyframe->Pin(stream);
+    if (!pin) {
+      continue;
+    }
     
     CallAccumulateIntrinsicsCoefficientsCUDAKernel(
         stream,
@@ -191,7 +191,9 @@ void AccumulatePoseEstimationCoeffsFromImagesCUDA(
   cudaStreamSynchronize(stream);
 }
 
-void ComputeCostAndResidualCountFromImagesCUDA(
+// Queues the kernel which computes the cost and residual count for one pose
+// estimate, accumulating them in the given (1 x 1) buffers.
+static void CallComputeCostAndResidualCountFromImagesKernel(
     cudaStream_t stream,
     bool use_depth_residuals,
     bool use_descriptor_residuals,
@@ -206,16 +208,9 @@ void ComputeCostAndResidualCountFromImagesCUDA(
     const CUDABuffer<float>& surfel_depth,
     const CUDABuffer<u16>& surfel_normals,
     const CUDABuffer<uchar>& surfel_color,
-    u32* residual_count,
-    float* residual_sum,
-    PoseEstimationHelperBuffers* helper_buffers,
+    const CUDABuffer_<u32>& residual_count_buffer,
+    const CUDABuffer_<float>& residual_buffer,
     bool use_gradmag) {
-  CUDA_CHECK();
-  
-  // TODO: Clear in a single kernel call?
-  helper_buffers->residual_count_buffer.Clear(0, stream);
-  helper_buffers->residual_buffer.Clear(0, stream);
-  
   if (use_gradmag) {
     CallComputeCostAndResidualCountFromImagesCUDAKernel_GradMag(
         stream,
@@ -233,8 +228,8 @@ void ComputeCostAndResidualCountFromImagesCUDA(
         downsampled_depth.ToCUDA(),
         downsampled_normals.ToCUDA(),
         downsampled_color,
-        helper_buffers->residual_count_buffer.ToCUDA(),
-        helper_buffers->residual_buffer.ToCUDA());
+        residual_count_buffer,
+        residual_buffer);
   } else {
     ComputeCostAndResidualCountFromImagesCUDAKernel_GradientXY(
         stream,
@@ -252,9 +247,54 @@ void ComputeCostAndResidualCountFromImagesCUDA(
         downsampled_depth.ToCUDA(),
         downsampled_normals.ToCUDA(),
         downsampled_color,
-        helper_buffers->residual_count_buffer.ToCUDA(),
-        helper_buffers->residual_buffer.ToCUDA());
+        residual_count_buffer,
+        residual_buffer);
   }
+}
+
+void ComputeCostAndResidualCountFromImagesCUDA(
+    cudaStream_t stream,
+    bool use_depth_residuals,
+    bool use_descriptor_residuals,
+    const PinholeCamera4f& color_camera,
+    const PinholeCamera4f& depth_camera,
+    float baseline_fx,
+    float threshold_factor,
+    const CUDABuffer<float>& downsampled_depth,
+    const CUDABuffer<u16>& downsampled_normals,
+    cudaTextureObject_t downsampled_color,
+    const CUDAMatrix3x4& estimate_frame_T_surfel_frame,
+    const CUDABuffer<float>& surfel_depth,
+    const CUDABuffer<u16>& surfel_normals,
+    const CUDABuffer<uchar>& surfel_color,
+    u32* residual_count,
+    float* residual_sum,
+    PoseEstimationHelperBuffers* helper_buffers,
+    bool use_gradmag) {
+  CUDA_CHECK();
+  
+  // TODO: Clear in a single kernel call?
+  helper_buffers->residual_count_buffer.Clear(0, stream);
+  helper_buffers->residual_buffer.Clear(0, stream);
+  
+  CallComputeCostAndResidualCountFromImagesKernel(
+      stream,
+      use_depth_residuals,
+      use_descriptor_residuals,
+      color_camera,
+      depth_camera,
+      baseline_fx,
+      threshold_factor,
+      downsampled_depth,
+      downsampled_normals,
+      downsampled_color,
+      estimate_frame_T_surfel_frame,
+      surfel_depth,
+      surfel_normals,
+      surfel_color,
+      helper_buffers->residual_count_buffer.ToCUDA(),
+      helper_buffers->residual_buffer.ToCUDA(),
+      use_gradmag);
   CUDA_CHECK();
   
   helper_buffers->residual_count_buffer.DownloadAsync(stream, residual_count);
@@ -262,4 +302,71 @@ void ComputeCostAndResidualCountFromImagesCUDA(
   cudaStreamSynchronize(stream);
 }
 
+void ComputeCostsAndResidualCountsFromImagesCUDA(
+    cudaStream_t stream,
+    bool use_depth_residuals,
+    bool use_descriptor_residuals,
+    const PinholeCamera4f& color_camera,
+    const PinholeCamera4f& depth_camera,
+    float baseline_fx,
+    float threshold_factor,
+    const CUDABuffer<float>& downsampled_depth,
+    const CUDABuffer<u16>& downsampled_normals,
+    cudaTextureObject_t downsampled_color,
+    const vector<CUDAMatrix3x4>& estimates_frame_T_surfel_frame,
+    const CUDABuffer<float>& surfel_depth,
+    const CUDABuffer<u16>& surfel_normals,
+    const CUDABuffer<uchar>& surfel_color,
+    vector<u32>* residual_counts,
+    vector<float>* residual_sums,
+    PoseEstimationHelperBuffers* helper_buffers,
+    bool use_gradmag) {
+  CUDA_CHECK();
+  
+  int estimate_count = estimates_frame_T_surfel_frame.size();
+  residual_counts->resize(estimate_count);
+  residual_sums->resize(estimate_count);
+  if (estimate_count == 0) {
+    return;
+  }
+  
+  if (!helper_buffers->estimates_residual_count_buffer ||
+      helper_buffers->estimates_residual_count_buffer->width() < estimate_count) {
+    helper_buffers->estimates_residual_count_buffer.reset(new CUDABuffer<u32>(1, estimate_count));
+    helper_buffers->estimates_residual_buffer.reset(new CUDABuffer<float>(1, estimate_count));
+  }
+  CUDABuffer_<u32> residual_count_buffer = helper_buffers->estimates_residual_count_buffer->ToCUDA();
+  CUDABuffer_<float> residual_buffer = helper_buffers->estimates_residual_buffer->ToCUDA();
+  residual_count_buffer.Clear(0, stream);
+  residual_buffer.Clear(0, stream);
+  
+  for (int i = 0; i < estimate_count; ++ i) {
+    CallComputeCostAndResidualCountFromImagesKernel(
+        stream,
+        use_depth_residuals,
+        use_descriptor_residuals,
+        color_camera,
+        depth_camera,
+        baseline_fx,
+        threshold_factor,
+        downsampled_depth,
+        downsampled_normals,
+        downsampled_color,
+        estimates_frame_T_surfel_frame[i],
+        surfel_depth,
+        surfel_normals,
+        surfel_color,
+        CUDABuffer_<u32>(residual_count_buffer.address() + i, 1, 1, residual_count_buffer.pitch()),
+        CUDABuffer_<float>(residual_buffer.address() + i, 1, 1, residual_buffer.pitch()),
+        use_gradmag);
+  }
+  CUDA_CHECK();
+  
+  helper_buffers->estimates_residual_count_buffer->DownloadPartAsync(
+      0, estimate_count * sizeof(u32), stream, residual_counts->data());
+  helper_buffers->estimates_residual_buffer->DownloadPartAsync(
+      0, estimate_count * sizeof(float), stream, residual_sums->data());
+  cudaStreamSynchronize(stream);
+}
+
 }
@@ -37,17 +37,6 @@
 
 namespace vis {
 
-// NOTE: This parameter corresponds to the lambda parameter in Levenberg-Marquardt,
-//       and must be positive to make the matrix to solve positive definite. It
-//       should be as small as possible in general however (unless actually doing
-//       Levenberg-Marquardt) such as not to slow the optimization down.
-constexpr PCGScalar kDiagEpsilon = 1e-8;
-
-
-// TODO: De-duplicate this setting with the alternating optimization; make it configurable?
-constexpr float kAPriorWeight = 10;
-
-
 // Implementation of CUDA's "atomicAdd()" that works for both floats and doubles
 // (i.e., can be used with PCGScalar).
 template<typename T> __forceinline__ __device__ T atomicAddFloatOrDouble(T* address, T value);
@@ -43,7 +43,8 @@ void UpdateSurfelActivationCUDA(
     const vector<shared_ptr<Keyframe>>& keyframes,
     u32 surfels_size,
     CUDABuffer<float>* surfels,
-    CUDABuffer<u8>* active_surfels) {
+    CUDABuffer<u8>* active_surfels,
+    bool include_covisible_keyframes) {
   CUDA_CHECK();
   if (surfels_size == 0) {
     return;
@@ -57,7 +58,13 @@ void UpdateSurfelActivationCUDA(
   
   // Project surfels into all active frames to determine active surfels
   for (const shared_ptr<Keyframe>& keyframe : keyframes) {
-    if (keyframe && keyframe->activation() == Keyframe::Activation::kActive) {
+    if (keyframe &&
+        (keyframe->activation() == Keyframe::Activation::kActive ||
+         (include_covisible_keyframes && keyframe->activation() == Keyframe::Activation::kCovisibleActive))) {
+      KeyframeResidencyPin pin = keyframe->Pin(stream);
+      if (!pin) {
+        continue;
+      }
       CallDetermineActiveSurfelsKernel(
           stream,
           CreateSurfelProjectionParameters(camera, depth_params, surfels_size, *surfels, keyframe.get()),
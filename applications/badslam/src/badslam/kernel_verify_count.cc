@@ -60,4 +60,28 @@ void DebugVerifySurfelCount(
   LOG(INFO) << "DebugVerifySurfelCount: ok";
 }
 
+void DebugVerifyActiveSurfelCount(
+    cudaStream_t stream,
+    u32 max_active_count,
+    u32 surfels_size,
+    const CUDABuffer<u8>& active_surfels) {
+  // NOTE: Repeated allocation of this buffer is probably slow, but this should
+  //       not matter since this is a debug function.
+  CUDABuffer<u32> count_buffer(1, 1);
+  count_buffer.Clear(0, stream);
+  
+  CallCountActiveSurfelsCUDAKernel(
+      stream,
+      surfels_size,
+      active_surfels.ToCUDA(),
+      count_buffer.ToCUDA());
+  
+  u32 count;
+  count_buffer.DownloadAsync(stream, &count);
+  cudaStreamSynchronize(stream);
+  
+  CHECK_LE(count, max_active_count);
+  LOG(INFO) << "DebugVerifyActiveSurfelCount: ok (" << count << " of " << surfels_size << " surfels active)";
+}
+
 }
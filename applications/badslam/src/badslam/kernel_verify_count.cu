@@ -55,6 +55,25 @@ __global__ void CountValidSurfelsCUDAKernel(
   }
 }
 
+template <int block_width>
+__global__ void CountActiveSurfelsCUDAKernel(
+    u32 surfels_size,
+    CUDABuffer_<u8> active_surfels,
+    CUDABuffer_<u32> count_buffer) {
+  const unsigned int surfel_index = blockIdx.x * blockDim.x + threadIdx.x;
+  int is_active = 0;
+  if (surfel_index < surfels_size) {
+    is_active = (active_surfels(0, surfel_index) & kSurfelActiveFlag) ? 1 : 0;
+  }
+  
+  typedef cub::BlockReduce<int, block_width, cub::BLOCK_REDUCE_RAKING_COMMUTATIVE_ONLY> BlockReduceInt;
+  __shared__ typename BlockReduceInt::TempStorage int_storage;
+  u32 count_in_block = BlockReduceInt(int_storage).Sum(is_active);
+  if (threadIdx.x == 0 && count_in_block > 0) {
+    atomicAdd(&count_buffer(0, 0), static_cast<u32>(count_in_block));
+  }
+}
+
 void CallCountValidSurfelsCUDAKernel(
     cudaStream_t stream,
     u32 surfels_size,
@@ -72,4 +91,21 @@ void CallCountValidSurfelsCUDAKernel(
       count_buffer);
 }
 
+void CallCountActiveSurfelsCUDAKernel(
+    cudaStream_t stream,
+    u32 surfels_size,
+    const CUDABuffer_<u8>& active_surfels,
+    const CUDABuffer_<u32>& count_buffer) {
+  CUDA_AUTO_TUNE_1D_TEMPLATED(
+      CountActiveSurfelsCUDAKernel,
+      1024,
+      surfels_size,
+      0, stream,
+      TEMPLATE_ARGUMENTS(block_width),
+      /* kernel parameters */
+      surfels_size,
+      active_surfels,
+      count_buffer);
+}
+
 }
@@ -42,4 +42,10 @@ void CallCountValidSurfelsCUDAKernel(
     const CUDABuffer_<float>& surfels,
     const CUDABuffer_<u32>& count_buffer);
 
+void CallCountActiveSurfelsCUDAKernel(
+    cudaStream_t stream,
+    u32 surfels_size,
+    const CUDABuffer_<u8>& active_surfels,
+    const CUDABuffer_<u32>& count_buffer);
+
 }
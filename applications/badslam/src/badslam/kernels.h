@@ -55,6 +55,11 @@ struct PoseEstimationHelperBuffers {
   CUDABuffer<float> residual_buffer;
   CUDABuffer<float> H_buffer;
   CUDABuffer<float> b_buffer;
+  
+  // Results of ComputeCostsAndResidualCountsFromImagesCUDA(), with one column
+  // per pose estimate. Allocated on demand.
+  CUDABufferPtr<u32> estimates_residual_count_buffer;
+  CUDABufferPtr<float> estimates_residual_buffer;
 };
 
 struct IntrinsicsOptimizationHelperBuffers {
@@ -222,6 +227,29 @@ void ComputeCostAndResidualCountFromImagesCUDA(
     PoseEstimationHelperBuffers* helper_buffers,
     bool use_gradmag);
 
+// Version of ComputeCostAndResidualCountFromImagesCUDA() which evaluates
+// several pose estimates. The kernels for all estimates are queued before
+// waiting for the results, such that there is only a single synchronization.
+void ComputeCostsAndResidualCountsFromImagesCUDA(
+    cudaStream_t stream,
+    bool use_depth_residuals,
+    bool use_descriptor_residuals,
+    const PinholeCamera4f& color_camera,
+    const PinholeCamera4f& depth_camera,
+    float baseline_fx,
+    float threshold_factor,
+    const CUDABuffer<float>& downsampled_depth,
+    const CUDABuffer<u16>& downsampled_normals,
+    cudaTextureObject_t downsampled_color,
+    const vector<CUDAMatrix3x4>& estimates_frame_T_surfel_frame,
+    const CUDABuffer<float>& surfel_depth,
+    const CUDABuffer<u16>& surfel_normals,
+    const CUDABuffer<uchar>& surfel_color,
+    vector<u32>* residual_counts,
+    vector<float>* residual_sums,
+    PoseEstimationHelperBuffers* helper_buffers,
+    bool use_gradmag);
+
 void UpdateSurfelNormalsCUDA(
     cudaStream_t stream,
     const PinholeCamera4f& depth_camera,
@@ -259,6 +287,9 @@ void OptimizeIntrinsicsCUDA(
     CUDABufferPtr<float>* cfactor_buffer,
     IntrinsicsOptimizationHelperBuffers* buffers);
 
+// Sets the surfels which are observed by active keyframes to active, and all
+// other surfels to inactive. If include_covisible_keyframes is true, the
+// surfels observed by co-visible active keyframes are set to active as well.
 void UpdateSurfelActivationCUDA(
     cudaStream_t stream,
     const PinholeCamera4f& camera,
@@ -266,7 +297,8 @@ void UpdateSurfelActivationCUDA(
     const vector<shared_ptr<Keyframe>>& keyframes,
     u32 surfels_size,
     CUDABuffer<float>* surfels,
-    CUDABuffer<u8>* active_surfels);
+    CUDABuffer<u8>* active_surfels,
+    bool include_covisible_keyframes);
 
 void DeleteSurfelsAndUpdateRadiiCUDA(
     cudaStream_t stream,
@@ -393,6 +425,13 @@ void DebugVerifySurfelCount(
     u32 surfels_size,
     const CUDABuffer<float>& surfels);
 
+// Verifies that at most max_active_count of the surfels are active.
+void DebugVerifyActiveSurfelCount(
+    cudaStream_t stream,
+    u32 max_active_count,
+    u32 surfels_size,
+    const CUDABuffer<u8>& active_surfels);
+
 
 void PCGInitCUDA(
     cudaStream_t stream,
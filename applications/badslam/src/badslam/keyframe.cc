@@ -48,29 +48,61 @@ Keyframe::Keyframe(
       last_covis_in_ba_iteration_(-1),
       min_depth_(min_depth),
       max_depth_(max_depth),
-      depth_buffer_(depth_buffer.height(), depth_buffer.width()),
-      normals_buffer_(normals_buffer.height(), normals_buffer.width()),
-      radius_buffer_(radius_buffer.height(), radius_buffer.width()),
-      color_buffer_(color_buffer.height(), color_buffer.width()),
+      depth_buffer_(new CUDABuffer<u16>(depth_buffer.height(), depth_buffer.width())),
+      normals_buffer_(new CUDABuffer<u16>(normals_buffer.height(), normals_buffer.width())),
+      radius_buffer_(new CUDABuffer<u16>(radius_buffer.height(), radius_buffer.width())),
+      color_buffer_(new CUDABuffer<uchar4>(color_buffer.height(), color_buffer.width())),
+      resident_(true),
+      pin_count_(0),
       depth_frame_(depth_frame),
       color_frame_(color_frame) {
   CHECK_GT(min_depth, 0.f)
       << "Keyframe min depth must be larger than 0 since the frustum checks"
           " do not work properly otherwise.";
   
-  // TODO: Avoid these copies by taking buffer ownership instead?
-  depth_buffer_.SetTo(depth_buffer, stream);
-  normals_buffer_.SetTo(normals_buffer, stream);
-  radius_buffer_.SetTo(radius_buffer, stream);
+  // NOTE: Use the constructor which takes buffer ownership to avoid these copies.
+  depth_buffer_->SetTo(depth_buffer, stream);
+  normals_buffer_->SetTo(normals_buffer, stream);
+  radius_buffer_->SetTo(radius_buffer, stream);
   
-  color_buffer_.SetTo(color_buffer, stream);
-  color_buffer_.CreateTextureObject(
-      cudaAddressModeClamp,
-      cudaAddressModeClamp,
-      cudaFilterModeLinear,
-      cudaReadModeNormalizedFloat,
-      /*use_normalized_coordinates*/ false,
-      &color_texture_);
+  color_buffer_->SetTo(color_buffer, stream);
+  CreateColorTexture();
+  
+  activation_ = Activation::kActive;
+  
+  // Make sure that any derived transformations are cached
+  set_frame_T_global(frame_T_global());
+}
+
+Keyframe::Keyframe(
+    cudaStream_t /*stream*/,
+    u32 frame_index,
+    float min_depth,
+    float max_depth,
+    const CUDABufferPtr<u16>& depth_buffer,
+    const CUDABufferPtr<u16>& normals_buffer,
+    const CUDABufferPtr<u16>& radius_buffer,
+    const CUDABufferPtr<uchar4>& color_buffer,
+    cudaTextureObject_t color_texture,
+    const ImageFramePtr<u16, SE3f>& depth_frame,
+    const ImageFramePtr<Vec3u8, SE3f>& color_frame)
+    : frame_index_(frame_index),
+      last_active_in_ba_iteration_(-1),
+      last_covis_in_ba_iteration_(-1),
+      min_depth_(min_depth),
+      max_depth_(max_depth),
+      depth_buffer_(depth_buffer),
+      normals_buffer_(normals_buffer),
+      radius_buffer_(radius_buffer),
+      color_buffer_(color_buffer),
+      color_texture_(color_texture),
+      resident_(true),
+      pin_count_(0),
+      depth_frame_(depth_frame),
+      color_frame_(color_frame) {
+  CHECK_GT(min_depth, 0.f)
+      << "Keyframe min depth must be larger than 0 since the frustum checks"
+          " do not work properly otherwise.";
   
   activation_ = Activation::kActive;
   
@@ -78,7 +110,7 @@ Keyframe::Keyframe(
   set_frame_T_global(frame_T_global());
 }
 
-Keyframe:: Keyframe(
+Keyframe::Keyframe(
     cudaStream_t stream,
     u32 frame_index,
     const DepthParameters& depth_params,
@@ -89,36 +121,32 @@ Keyframe:: Keyframe(
     : frame_index_(frame_index),
       last_active_in_ba_iteration_(-1),
       last_covis_in_ba_iteration_(-1),
-      depth_buffer_(depth_image.height(), depth_image.width()),
-      normals_buffer_(depth_image.height(), depth_image.width()),
-      radius_buffer_(depth_image.height(), depth_image.width()),
-      color_buffer_(color_image.height(), color_image.width()) {
+      depth_buffer_(new CUDABuffer<u16>(depth_image.height(), depth_image.width())),
+      normals_buffer_(new CUDABuffer<u16>(depth_image.height(), depth_image.width())),
+      radius_buffer_(new CUDABuffer<u16>(depth_image.height(), depth_image.width())),
+      color_buffer_(new CUDABuffer<uchar4>(color_image.height(), color_image.width())),
+      resident_(true),
+      pin_count_(0) {
   // Perform color image preprocessing.
   CUDABuffer<uchar3> rgb_buffer(color_image.height(), color_image.width());
   rgb_buffer.UploadAsync(stream, reinterpret_cast<const Image<uchar3>&>(color_image));
   ComputeBrightnessCUDA(
       stream,
       rgb_buffer.ToCUDA(),
-      &color_buffer_.ToCUDA());
-  color_buffer_.CreateTextureObject(
-      cudaAddressModeClamp,
-      cudaAddressModeClamp,
-      cudaFilterModeLinear,
-      cudaReadModeNormalizedFloat,
-      /*use_normalized_coordinates*/ false,
-      &color_texture_);
+      &color_buffer_->ToCUDA());
+  CreateColorTexture();
   
   // Perform depth image preprocessing.
   CUDABuffer<u16> depth_buffer(depth_image.height(), depth_image.width());
-  depth_buffer_.UploadAsync(stream, depth_image);
+  depth_buffer_->UploadAsync(stream, depth_image);
   
   ComputeNormalsCUDA(
       stream,
       CreatePixelCenterUnprojector(depth_camera),
       depth_params,
-      depth_buffer_.ToCUDA(),
+      depth_buffer_->ToCUDA(),
       &depth_buffer.ToCUDA(),
-      &normals_buffer_.ToCUDA());
+      &normals_buffer_->ToCUDA());
   
   CUDABufferPtr<float> min_max_depth_init_buffer_;
   CUDABufferPtr<float> min_max_depth_result_buffer_;
@@ -131,8 +159,8 @@ Keyframe:: Keyframe(
       CreatePixelCenterUnprojector(depth_camera),
       depth_params.raw_to_float_depth,
       depth_buffer.ToCUDA(),
-      &radius_buffer_.ToCUDA(),
-      &depth_buffer_.ToCUDA());
+      &radius_buffer_->ToCUDA(),
+      &depth_buffer_->ToCUDA());
   
   ComputeMinMaxDepthCUDA(
       stream,
@@ -157,4 +185,169 @@ Keyframe:: Keyframe(
   activation_ = Activation::kActive;
 }
 
+Keyframe::~Keyframe() {
+  if (resident_) {
+    cudaDestroyTextureObject(color_texture_);
+  } else {
+    storage_->Erase(id_);
+  }
+}
+
+bool Keyframe::Evict(
+    cudaStream_t stream,
+    const shared_ptr<KeyframeStorage>& storage,
+    const shared_ptr<CUDABufferPool>& buffer_pool) {
+  lock_guard<mutex> lock(residency_mutex_);
+  if (!resident_) {
+    return true;
+  }
+  if (pin_count_ > 0) {
+    return false;
+  }
+  
+  // Work which has been enqueued while the keyframe was pinned may still be
+  // running.
+  cudaDeviceSynchronize();
+  
+  KeyframeImageData images;
+  DownloadImagesInternal(stream, &images);
+  
+  if (!storage->Store(id_, images)) {
+    return false;
+  }
+  
+  storage_ = storage;
+  buffer_pool_ = buffer_pool;
+  cudaDestroyTextureObject(color_texture_);
+  depth_buffer_.reset();
+  normals_buffer_.reset();
+  radius_buffer_.reset();
+  color_buffer_.reset();
+  resident_ = false;
+  return true;
+}
+
+KeyframeResidencyPin Keyframe::Pin(cudaStream_t stream) const {
+  lock_guard<mutex> lock(residency_mutex_);
+  if (!MaterializeInternal(stream)) {
+    LOG(ERROR) << "Failed to restore the evicted data of keyframe " << id_;
+    return KeyframeResidencyPin();
+  }
+  ++ pin_count_;
+  return KeyframeResidencyPin(this);
+}
+
+void KeyframeResidencyPin::Release() {
+  if (keyframe_) {
+    -- keyframe_->pin_count_;
+    keyframe_ = nullptr;
+  }
+}
+
+bool Keyframe::Materialize(cudaStream_t stream) const {
+  lock_guard<mutex> lock(residency_mutex_);
+  return MaterializeInternal(stream);
+}
+
+bool Keyframe::MaterializeInternal(cudaStream_t stream) const {
+  if (resident_) {
+    return true;
+  }
+  
+  KeyframeImageData images;
+  if (!storage_->Load(id_, &images)) {
+    return false;
+  }
+  
+  CUDABufferPtr<u16> depth_buffer = TryAllocateBuffer<u16>(images.depth.height(), images.depth.width(), stream);
+  CUDABufferPtr<u16> normals_buffer = TryAllocateBuffer<u16>(images.normals.height(), images.normals.width(), stream);
+  CUDABufferPtr<u16> radius_buffer = TryAllocateBuffer<u16>(images.radius.height(), images.radius.width(), stream);
+  CUDABufferPtr<uchar4> color_buffer = TryAllocateBuffer<uchar4>(images.color.height(), images.color.width(), stream);
+  if (!depth_buffer || !normals_buffer || !radius_buffer || !color_buffer) {
+    // The data stays in the storage.
+    return false;
+  }
+  depth_buffer_ = depth_buffer;
+  normals_buffer_ = normals_buffer;
+  radius_buffer_ = radius_buffer;
+  color_buffer_ = color_buffer;
+  
+  depth_buffer_->UploadAsync(stream, images.depth);
+  normals_buffer_->UploadAsync(stream, images.normals);
+  radius_buffer_->UploadAsync(stream, images.radius);
+  color_buffer_->UploadAsync(stream, reinterpret_cast<const Image<uchar4>&>(images.color));
+  CreateColorTexture();
+  // The images are freed at the end of this function, so the uploads must
+  // have completed.
+  cudaStreamSynchronize(stream);
+  
+  storage_->Erase(id_);
+  resident_ = true;
+  return true;
+}
+
+bool Keyframe::DownloadImages(cudaStream_t stream, KeyframeImageData* images) const {
+  // Holding the mutex prevents the keyframe from being evicted meanwhile.
+  lock_guard<mutex> lock(residency_mutex_);
+  if (!resident_) {
+    // Read the data from the storage instead of restoring it to the GPU.
+    return storage_->Load(id_, images);
+  }
+  DownloadImagesInternal(stream, images);
+  return true;
 }
+
+bool Keyframe::UploadImages(cudaStream_t stream, const KeyframeImageData& images) {
+  lock_guard<mutex> lock(residency_mutex_);
+  if (!resident_) {
+    // Replace the stored data, the keyframe stays evicted.
+    return storage_->Store(id_, images);
+  }
+  
+  CHECK_EQ(images.depth.width(), depth_buffer_->width());
+  CHECK_EQ(images.depth.height(), depth_buffer_->height());
+  CHECK_EQ(images.color.width(), color_buffer_->width());
+  CHECK_EQ(images.color.height(), color_buffer_->height());
+  
+  depth_buffer_->UploadAsync(stream, images.depth);
+  normals_buffer_->UploadAsync(stream, images.normals);
+  radius_buffer_->UploadAsync(stream, images.radius);
+  color_buffer_->UploadAsync(stream, reinterpret_cast<const Image<uchar4>&>(images.color));
+  // The caller may free the images after this function returns.
+  cudaStreamSynchronize(stream);
+  return true;
+}
+
+void Keyframe::DownloadImagesInternal(cudaStream_t stream, KeyframeImageData* images) const {
+  images->depth.SetSize(depth_buffer_->width(), depth_buffer_->height());
+  images->normals.SetSize(normals_buffer_->width(), normals_buffer_->height());
+  images->radius.SetSize(radius_buffer_->width(), radius_buffer_->height());
+  images->color.SetSize(color_buffer_->width(), color_buffer_->height());
+  depth_buffer_->DownloadAsync(stream, &images->depth);
+  normals_buffer_->DownloadAsync(stream, &images->normals);
+  radius_buffer_->DownloadAsync(stream, &images->radius);
+  color_buffer_->DownloadAsync(stream, reinterpret_cast<Image<uchar4>*>(&images->color));
+  cudaStreamSynchronize(stream);
+}
+
+usize Keyframe::gpu_memory_bytes() const {
+  lock_guard<mutex> lock(residency_mutex_);
+  if (!resident_) {
+    return 0;
+  }
+  return depth_buffer_->Size() + normals_buffer_->Size() +
+         radius_buffer_->Size() + color_buffer_->Size();
+}
+
+void Keyframe::CreateColorTexture() const {
+  color_buffer_->CreateTextureObject(
+      cudaAddressModeClamp,
+      cudaAddressModeClamp,
+      cudaFilterModeLinear,
+      cudaReadModeNormalizedFloat,
+      /*use_normalized_coordinates*/ false,
+      &color_texture_);
+}
+
+}
+
@@ -28,9 +28,13 @@
 
 #pragma once
 
+#include <atomic>
+#include <mutex>
+
 #include <cuda_runtime.h>
 
 #include <libvis/cuda/cuda_buffer.h>
+#include <libvis/cuda/cuda_buffer_pool.h>
 #include <libvis/cuda/cuda_util.h>
 #include <libvis/libvis.h>
 #include <libvis/rgbd_video.h>
@@ -40,9 +44,55 @@
 #include "badslam/cuda_depth_processing.h"
 #include "badslam/cuda_image_processing.cuh"
 #include "badslam/cuda_matrix.cuh"
+#include "badslam/keyframe_storage.h"
 
 namespace vis {
 
+class Keyframe;
+
+// Keeps the image data of a keyframe in GPU memory while it exists, see
+// Keyframe::Pin(). Converts to false if pinning failed.
+class KeyframeResidencyPin {
+ public:
+  inline KeyframeResidencyPin()
+      : keyframe_(nullptr) {}
+  
+  inline KeyframeResidencyPin(KeyframeResidencyPin&& other)
+      : keyframe_(other.keyframe_) {
+    other.keyframe_ = nullptr;
+  }
+  
+  inline KeyframeResidencyPin& operator=(KeyframeResidencyPin&& other) {
+    if (this != &other) {
+      Release();
+      keyframe_ = other.keyframe_;
+      other.keyframe_ = nullptr;
+    }
+    return *this;
+  }
+  
+  KeyframeResidencyPin(const KeyframeResidencyPin&) = delete;
+  KeyframeResidencyPin& operator=(const KeyframeResidencyPin&) = delete;
+  
+  inline ~KeyframeResidencyPin() {
+    Release();
+  }
+  
+  void Release();
+  
+  inline explicit operator bool() const {
+    return keyframe_ != nullptr;
+  }
+  
+ private:
+  friend class Keyframe;
+  
+  inline explicit KeyframeResidencyPin(const Keyframe* keyframe)
+      : keyframe_(keyframe) {}
+  
+  const Keyframe* keyframe_;
+};
+
 // Represents a keyframe which stores the measured (preprocessed) depth image,
 // as well as a normal and radius image derived from it. Furthermore, the
 // measured color image is stored, and the current estimate for the keyframe's
@@ -82,6 +132,24 @@ class Keyframe {
       const ImageFramePtr<u16, SE3f>& depth_frame,
       const ImageFramePtr<Vec3u8, SE3f>& color_frame);
   
+  // Creates a keyframe which takes ownership of the given GPU buffers of depth,
+  // normal, radius, and color data, and of color_texture, which must be a
+  // texture object for color_buffer. This avoids the copies made by the
+  // constructor above; the caller must not modify or destroy the buffers and
+  // the texture afterwards.
+  Keyframe(
+      cudaStream_t stream,
+      u32 frame_index,
+      float min_depth,
+      float max_depth,
+      const CUDABufferPtr<u16>& depth_buffer,
+      const CUDABufferPtr<u16>& normals_buffer,
+      const CUDABufferPtr<u16>& radius_buffer,
+      const CUDABufferPtr<uchar4>& color_buffer,
+      cudaTextureObject_t color_texture,
+      const ImageFramePtr<u16, SE3f>& depth_frame,
+      const ImageFramePtr<Vec3u8, SE3f>& color_frame);
+  
   // Creates a keyframe from depth and color data. Derives the normal and radius
   // data from the depth image. This function is slow (since it involves
   // temporary GPU memory allocations) and thus should not be used for
@@ -99,9 +167,7 @@ class Keyframe {
       const Image<Vec3u8>& color_image,
       const SE3f& global_tr_frame);
   
-  inline ~Keyframe() {
-    cudaDestroyTextureObject(color_texture_);
-  }
+  ~Keyframe();
   
   inline void SetID(int id) {
     id_ = id;
@@ -187,27 +253,112 @@ class Keyframe {
     return global_R_frame_cuda_;
   }
   
+  // The accessors for the GPU image data may only be used while the keyframe
+  // is pinned (see Pin()), since an unpinned keyframe may be evicted by
+  // another thread at any time. The pin must be held until all GPU work which
+  // uses the returned buffers has been enqueued. Accessing an evicted keyframe
+  // is a fatal error; the data is only restored by Pin(), whose callers must
+  // handle a failure to restore it.
   inline const CUDABuffer<u16>& depth_buffer() const {
-    return depth_buffer_;
+    CheckResident();
+    return *depth_buffer_;
   }
   
   inline const CUDABuffer<u16>& normals_buffer() const {
-    return normals_buffer_;
+    CheckResident();
+    return *normals_buffer_;
   }
   
   inline const CUDABuffer<u16>& radius_buffer() const {
-    return radius_buffer_;
+    CheckResident();
+    return *radius_buffer_;
   }
   
   inline const CUDABuffer<uchar4>& color_buffer() const {
-    return color_buffer_;
+    CheckResident();
+    return *color_buffer_;
   }
   
   inline cudaTextureObject_t color_texture() const {
+    CheckResident();
     return color_texture_;
   }
   
+  // Transfers evicted image data back to the GPU (using stream) if necessary,
+  // and keeps it in GPU memory until the returned pin is released. If the data
+  // cannot be restored, for example since GPU memory is exhausted, an error is
+  // logged and the returned pin converts to false; the buffers must not be
+  // accessed in this case.
+  KeyframeResidencyPin Pin(cudaStream_t stream) const;
+  
+  // Returns whether the keyframe is currently pinned.
+  inline bool is_pinned() const {
+    return pin_count_ > 0;
+  }
+  
+  // Moves the image data of this keyframe into the given storage and releases
+  // its GPU memory. Returns false without evicting if the keyframe is pinned.
+  // Waits for all queued GPU work before releasing the memory. The data is
+  // transferred back to the GPU by Pin() or Materialize(), using buffers from
+  // buffer_pool (which may be null).
+  bool Evict(
+      cudaStream_t stream,
+      const shared_ptr<KeyframeStorage>& storage,
+      const shared_ptr<CUDABufferPool>& buffer_pool);
+  
+  // Transfers evicted image data back to the GPU using the given stream. Does
+  // nothing if the keyframe is resident. Returns false if the data cannot be
+  // restored (in this case, the keyframe stays evicted).
+  bool Materialize(cudaStream_t stream) const;
+  
+  // Downloads the keyframe's image data into CPU memory. If the keyframe is
+  // evicted, the data is read from the keyframe storage instead, without
+  // transferring it back to the GPU. Returns false if reading it fails.
+  bool DownloadImages(cudaStream_t stream, KeyframeImageData* images) const;
+  
+  // Replaces the keyframe's image data with the given images, which must have
+  // the same sizes as the keyframe's buffers. If the keyframe is evicted, the
+  // data in the keyframe storage is replaced instead. Returns false if storing
+  // the data fails.
+  bool UploadImages(cudaStream_t stream, const KeyframeImageData& images);
+  
+  // Extends the keyframe's depth range (used for frustum checks) to include
+  // the given range.
+  inline void ExtendDepthRange(float min_depth, float max_depth) {
+    min_depth_ = std::min(min_depth_, min_depth);
+    max_depth_ = std::max(max_depth_, max_depth);
+  }
+  
+  // Returns whether the keyframe's image data is in GPU memory.
+  inline bool is_resident() const {
+    return resident_;
+  }
+  
+  // Returns the approximate GPU memory used by the keyframe's image data (if
+  // resident).
+  usize gpu_memory_bytes() const;
+  
  private:
+  friend class KeyframeResidencyPin;
+  
+  inline void CheckResident() const {
+    CHECK(resident_) << "Access to the image data of evicted keyframe " << id_
+                     << ", the keyframe must be pinned (see Pin())";
+  }
+  
+  bool MaterializeInternal(cudaStream_t stream) const;
+  
+  void DownloadImagesInternal(cudaStream_t stream, KeyframeImageData* images) const;
+  
+  void CreateColorTexture() const;
+  
+  // Returns null if the allocation fails.
+  template <typename T>
+  CUDABufferPtr<T> TryAllocateBuffer(int height, int width, cudaStream_t stream) const {
+    return buffer_pool_ ? buffer_pool_->TryAcquire<T>(height, width, stream) :
+                          TryAllocateCUDABuffer<T>(height, width);
+  }
+  
   int id_;
   u32 frame_index_;
   int last_active_in_ba_iteration_;
@@ -224,11 +375,22 @@ class Keyframe {
   
   Activation activation_;
   
-  CUDABuffer<u16> depth_buffer_;
-  CUDABuffer<u16> normals_buffer_;  // (more or less) derived from the depth. TODO: Re-compute this from the depth buffer, if required, to save memory?
-  CUDABuffer<u16> radius_buffer_;  // (more or less) derived from the depth. TODO: Re-compute this from the depth buffer, if required, to save memory?
-  CUDABuffer<uchar4> color_buffer_;
-  cudaTextureObject_t color_texture_;
+  // GPU image data. These are null while the keyframe is evicted, and are
+  // mutable since they are re-created on demand by the const accessors.
+  mutable CUDABufferPtr<u16> depth_buffer_;
+  mutable CUDABufferPtr<u16> normals_buffer_;  // (more or less) derived from the depth. TODO: Re-compute this from the depth buffer, if required, to save memory?
+  mutable CUDABufferPtr<u16> radius_buffer_;  // (more or less) derived from the depth. TODO: Re-compute this from the depth buffer, if required, to save memory?
+  mutable CUDABufferPtr<uchar4> color_buffer_;
+  mutable cudaTextureObject_t color_texture_;
+  
+  // Residency state (see Pin() and Evict()).
+  mutable std::atomic<bool> resident_;
+  mutable std::atomic<int> pin_count_;
+  mutable std::mutex residency_mutex_;
+  
+  // Storage which holds the image data while the keyframe is evicted.
+  shared_ptr<KeyframeStorage> storage_;
+  shared_ptr<CUDABufferPool> buffer_pool_;
   
   // Reference to depth data on the CPU / disk
   ImageFramePtr<u16, SE3f> depth_frame_;
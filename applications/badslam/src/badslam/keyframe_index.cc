@@ -0,0 +1,204 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "badslam/keyframe_index.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <libvis/logging.h>
+
+namespace vis {
+
+KeyframeIndex::KeyframeIndex(
+    int max_query_words,
+    int max_posting_list_length,
+    float compaction_threshold)
+    : max_query_words_(max_query_words),
+      max_posting_list_length_(max_posting_list_length),
+      compaction_threshold_(compaction_threshold) {
+  CHECK_GE(max_query_words_, 0);
+  CHECK_GE(max_posting_list_length_, 0);
+}
+
+KeyframeIndex::EntryId KeyframeIndex::Add(const BowVector& bow_vector) {
+  EntryId id = entry_word_counts_.size();
+  
+  for (const auto& item : bow_vector) {
+    posting_lists_[item.first].emplace_back(id, item.second);
+  }
+  
+  entry_word_counts_.push_back(bow_vector.size());
+  entry_removed_.push_back(false);
+  posting_count_ += bow_vector.size();
+  return id;
+}
+
+void KeyframeIndex::Remove(EntryId id) {
+  CHECK_LT(id, size());
+  if (entry_removed_[id]) {
+    return;
+  }
+  
+  entry_removed_[id] = true;
+  removed_posting_count_ += entry_word_counts_[id];
+  
+  if (removed_posting_count_ > compaction_threshold_ * posting_count_) {
+    Compact();
+  }
+}
+
+void KeyframeIndex::Compact() {
+  for (auto it = posting_lists_.begin(); it != posting_lists_.end(); ) {
+    vector<Posting>& list = it->second;
+    list.erase(std::remove_if(list.begin(), list.end(),
+                              [&](const Posting& posting) {
+                                return entry_removed_[posting.entry_id];
+                              }),
+               list.end());
+    
+    if (list.empty()) {
+      it = posting_lists_.erase(it);
+    } else {
+      if (list.size() < list.capacity() / 2) {
+        list.shrink_to_fit();
+      }
+      ++ it;
+    }
+  }
+  
+  posting_count_ -= removed_posting_count_;
+  removed_posting_count_ = 0;
+}
+
+void KeyframeIndex::Query(
+    const BowVector& query,
+    int max_results,
+    int max_id,
+    vector<Result>* results) const {
+  results->clear();
+  
+  // Collect the posting lists of the query words, restricted to the entries
+  // with id < max_id (which are at the start of the lists since they are
+  // sorted by id). Skip the stop words whose lists are too long.
+  struct Cursor {
+    const Posting* current;
+    const Posting* end;
+    double query_weight;
+  };
+  vector<Cursor> cursors;
+  cursors.reserve(query.size());
+  
+  for (const auto& item : query) {
+    auto it = posting_lists_.find(item.first);
+    if (it == posting_lists_.end()) {
+      continue;
+    }
+    
+    const Posting* begin = it->second.data();
+    const Posting* end = begin + it->second.size();
+    if (max_id >= 0) {
+      end = std::lower_bound(
+          begin, end, static_cast<EntryId>(max_id),
+          [](const Posting& posting, EntryId id) {
+            return posting.entry_id < id;
+          });
+    }
+    
+    if (max_posting_list_length_ > 0 && end - begin > max_posting_list_length_) {
+      continue;
+    }
+    
+    if (begin != end) {
+      cursors.push_back(Cursor{begin, end, item.second});
+    }
+  }
+  
+  // Only score the words with the highest weight if the number of words is
+  // limited.
+  if (max_query_words_ > 0 && cursors.size() > static_cast<usize>(max_query_words_)) {
+    std::nth_element(
+        cursors.begin(), cursors.begin() + (max_query_words_ - 1), cursors.end(),
+        [](const Cursor& a, const Cursor& b) {
+          return a.query_weight > b.query_weight;
+        });
+    cursors.resize(max_query_words_);
+  }
+  
+  // Merge the sorted posting lists using a min-heap on the current entry id of
+  // each list. All postings of an entry are thus visited consecutively, and
+  // its score is complete once the smallest current id passes it.
+  auto greater_entry_id = [&](int a, int b) {
+    return cursors[a].current->entry_id > cursors[b].current->entry_id;
+  };
+  vector<int> heap(cursors.size());
+  for (usize i = 0; i < cursors.size(); ++ i) {
+    heap[i] = i;
+  }
+  std::make_heap(heap.begin(), heap.end(), greater_entry_id);
+  
+  while (!heap.empty()) {
+    EntryId entry_id = cursors[heap.front()].current->entry_id;
+    
+    // For L1-normalized vectors, |q - d|_1 = 2 + sum over the shared words of
+    // (|q_i - d_i| - |q_i| - |d_i|) (Nister, 2006).
+    double sum = 0;
+    while (!heap.empty() && cursors[heap.front()].current->entry_id == entry_id) {
+      std::pop_heap(heap.begin(), heap.end(), greater_entry_id);
+      Cursor& cursor = cursors[heap.back()];
+      
+      double q = cursor.query_weight;
+      double d = cursor.current->weight;
+      sum += fabs(q - d) - fabs(q) - fabs(d);
+      
+      ++ cursor.current;
+      if (cursor.current == cursor.end) {
+        heap.pop_back();
+      } else {
+        std::push_heap(heap.begin(), heap.end(), greater_entry_id);
+      }
+    }
+    
+    if (!entry_removed_[entry_id]) {
+      results->emplace_back(entry_id, -0.5 * sum);
+    }
+  }
+  
+  // Sort by decreasing score (and by id for equal scores).
+  auto better = [](const Result& a, const Result& b) {
+    return (a.score != b.score) ? (a.score > b.score) : (a.id < b.id);
+  };
+  if (max_results > 0 && results->size() > static_cast<usize>(max_results)) {
+    std::partial_sort(results->begin(), results->begin() + max_results, results->end(), better);
+    results->erase(results->begin() + max_results, results->end());
+  } else {
+    std::sort(results->begin(), results->end(), better);
+  }
+}
+
+}
@@ -0,0 +1,153 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include <libvis/libvis.h>
+
+namespace vis {
+
+// Inverted index over the bag-of-words vectors of keyframes, used to retrieve
+// the keyframes which are most similar to a query image for loop detection.
+// 
+// For each word, the index stores a contiguous posting list of the entries
+// that contain the word, together with the word's weight in them. Entries
+// get increasing ids, so appending keeps the lists sorted by id. A query
+// merges the sorted posting lists of its words, accumulating the score of
+// each entry as it passes.
+// 
+// The bag-of-words vectors are expected to be TF-IDF weighted and
+// L1-normalized (as computed by a DBoW2 vocabulary with these settings), and
+// entries are scored with the same L1 similarity as DBoW2's database uses:
+// 1 - 0.5 * |q - d|_1, ranging from 0 (worst) to 1 (best).
+// 
+// Removing an entry only marks it as removed; its postings are skipped in
+// queries and dropped during the next compaction, which happens once the
+// removed postings exceed the given fraction of all postings.
+// 
+// The cost of a query is the total length of the posting lists of the scored
+// query words. Two settings bound it: max_query_words limits the number of
+// query words that are scored, using only the words with the highest weight
+// in the query, and max_posting_list_length treats words whose posting list
+// is longer than this as stop words which are not scored. With both set, a
+// query visits at most max_query_words * max_posting_list_length postings,
+// independently of the number of entries. In both cases, the score of an entry
+// is a lower bound of its actual score (the omitted words could only have
+// increased it). The memory use of the index still grows linearly with the
+// number of entries, and as more entries are added, more words exceed
+// max_posting_list_length and stop contributing to the scores.
+// 
+// This class is not thread-safe.
+class KeyframeIndex {
+ public:
+  typedef u32 EntryId;
+  typedef u32 WordId;
+  
+  // Word id -> word weight. DBoW2::BowVector derives from this type.
+  typedef std::map<WordId, double> BowVector;
+  
+  struct Result {
+    inline Result(EntryId id, double score)
+        : id(id), score(score) {}
+    
+    EntryId id;
+    double score;
+  };
+  
+  // Creates an empty index. max_query_words == 0 scores all query words, and
+  // max_posting_list_length == 0 scores words regardless of their posting list
+  // length.
+  KeyframeIndex(
+      int max_query_words = 0,
+      int max_posting_list_length = 0,
+      float compaction_threshold = 0.25f);
+  
+  // Adds an entry with the given bag-of-words vector and returns its id.
+  // The ids are assigned in increasing order, starting from zero.
+  EntryId Add(const BowVector& bow_vector);
+  
+  // Marks the entry as removed, such that it is not returned by queries
+  // anymore. Compacts the posting lists if enough postings are removed.
+  void Remove(EntryId id);
+  
+  // Drops the postings of all removed entries from the posting lists.
+  void Compact();
+  
+  // Returns the (at most max_results if max_results > 0) entries with the
+  // highest scores that share at least one scored word with the query, in
+  // order of decreasing score. If max_id >= 0, only entries with id < max_id
+  // are considered.
+  void Query(
+      const BowVector& query,
+      int max_results,
+      int max_id,
+      vector<Result>* results) const;
+  
+  // Number of entries that were added (including removed ones).
+  inline usize size() const { return entry_word_counts_.size(); }
+  
+  // Number of postings in the posting lists, including the ones of removed
+  // entries which were not compacted yet.
+  inline usize posting_count() const { return posting_count_; }
+  
+  inline usize removed_posting_count() const { return removed_posting_count_; }
+  
+  inline bool is_removed(EntryId id) const { return entry_removed_[id]; }
+  
+ private:
+  struct Posting {
+    inline Posting(EntryId entry_id, float weight)
+        : entry_id(entry_id), weight(weight) {}
+    
+    EntryId entry_id;
+    
+    // Stored in single precision to keep the posting lists compact.
+    float weight;
+  };
+  
+  // Posting lists, sorted by entry id.
+  std::unordered_map<WordId, vector<Posting>> posting_lists_;
+  
+  // Per entry, the number of words in its bag-of-words vector and whether it
+  // was removed.
+  vector<u32> entry_word_counts_;
+  vector<bool> entry_removed_;
+  
+  usize posting_count_ = 0;
+  usize removed_posting_count_ = 0;
+  
+  int max_query_words_;
+  int max_posting_list_length_;
+  float compaction_threshold_;
+};
+
+}
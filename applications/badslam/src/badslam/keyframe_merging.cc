@@ -0,0 +1,351 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "badslam/keyframe_merging.h"
+
+#include <cmath>
+#include <limits>
+
+#include <libvis/logging.h>
+
+#include "badslam/brightness.h"
+#include "badslam/constants.h"
+#include "badslam/surfel_projection_cpu.h"
+
+namespace vis {
+
+namespace {
+
+inline bool IsValidDepth(u16 raw_depth) {
+  return raw_depth != 0 && !(raw_depth & kInvalidDepthBit);
+}
+
+// Pinhole projection with the same conventions as PixelCornerProjector and
+// PixelCenterUnprojector.
+struct PinholeParameters {
+  PinholeParameters(const PinholeCamera4f& camera)
+      : width(camera.width()),
+        height(camera.height()) {
+    const float* p = camera.parameters();
+    fx = p[0];
+    fy = p[1];
+    cx = p[2];
+    cy = p[3];
+  }
+  
+  inline Vec3f UnprojectPixelCenter(int x, int y, float depth) const {
+    return Vec3f(depth * (x - cx + 0.5f) / fx,
+                 depth * (y - cy + 0.5f) / fy,
+                 depth);
+  }
+  
+  // Returns false if the point does not project into the image.
+  inline bool ProjectToPixel(const Vec3f& point, int* px, int* py) const {
+    if (point.z() <= 0) {
+      return false;
+    }
+    float x = fx * (point.x() / point.z()) + cx;
+    float y = fy * (point.y() / point.z()) + cy;
+    if (!(x >= 0 && y >= 0 && x < width && y < height)) {
+      return false;
+    }
+    *px = static_cast<int>(x);
+    *py = static_cast<int>(y);
+    return true;
+  }
+  
+  int width;
+  int height;
+  float fx, fy, cx, cy;
+};
+
+// A source measurement which was reprojected into the target keyframe.
+struct MergeSplat {
+  int target_pixel;
+  int target_color_pixel;
+  float depth;
+  float weight;
+  float radius_squared;
+  Vec3f normal;
+  Vec3f color;
+};
+
+}  // namespace
+
+
+KeyframeCoverage ComputeKeyframeCoverage(
+    const KeyframeImageData& images,
+    const SE3f& global_T_frame,
+    const vector<KeyframeMergeNeighbor>& neighbors,
+    const PinholeCamera4f& depth_camera,
+    const DepthParametersCPU& calibration,
+    const KeyframeMergeOptions& options) {
+  const PinholeParameters camera(depth_camera);
+  
+  vector<SE3f> neighbor_T_frame(neighbors.size());
+  for (usize i = 0; i < neighbors.size(); ++ i) {
+    neighbor_T_frame[i] = neighbors[i].global_T_frame.inverse() * global_T_frame;
+  }
+  vector<usize> overlap_count(neighbors.size(), 0);
+  
+  usize valid_count = 0;
+  usize covered_count = 0;
+  const int step = std::max(1, options.coverage_sample_step);
+  for (u32 y = step / 2; y < images.depth.height(); y += step) {
+    for (u32 x = step / 2; x < images.depth.width(); x += step) {
+      const u16 raw_depth = images.depth(x, y);
+      if (!IsValidDepth(raw_depth)) {
+        continue;
+      }
+      ++ valid_count;
+      
+      const Vec3f point = camera.UnprojectPixelCenter(x, y, calibration.RawToDepth(x, y, raw_depth));
+      bool covered = false;
+      for (usize i = 0; i < neighbors.size(); ++ i) {
+        const Vec3f neighbor_point = neighbor_T_frame[i] * point;
+        int nx, ny;
+        if (!camera.ProjectToPixel(neighbor_point, &nx, &ny)) {
+          continue;
+        }
+        const u16 neighbor_raw_depth = neighbors[i].images->depth(nx, ny);
+        if (!IsValidDepth(neighbor_raw_depth)) {
+          continue;
+        }
+        const float neighbor_depth = calibration.RawToDepth(nx, ny, neighbor_raw_depth);
+        if (fabs(neighbor_depth - neighbor_point.z()) <= options.relative_depth_threshold * neighbor_point.z()) {
+          ++ overlap_count[i];
+          covered = true;
+        }
+      }
+      if (covered) {
+        ++ covered_count;
+      }
+    }
+  }
+  
+  KeyframeCoverage result;
+  if (valid_count == 0) {
+    // A keyframe without any depth does not contribute anything.
+    result.coverage = 1;
+    return result;
+  }
+  result.coverage = covered_count / static_cast<float>(valid_count);
+  for (usize i = 0; i < neighbors.size(); ++ i) {
+    if (overlap_count[i] > 0 &&
+        (result.best_neighbor < 0 || overlap_count[i] > overlap_count[result.best_neighbor])) {
+      result.best_neighbor = i;
+    }
+  }
+  if (result.best_neighbor >= 0) {
+    result.best_neighbor_overlap = overlap_count[result.best_neighbor] / static_cast<float>(valid_count);
+  }
+  return result;
+}
+
+
+void MergeKeyframeImages(
+    const KeyframeImageData& source,
+    const SE3f& global_T_source,
+    KeyframeImageData* target,
+    const SE3f& global_T_target,
+    const PinholeCamera4f& depth_camera,
+    const PinholeCamera4f& color_camera,
+    const DepthParametersCPU& calibration,
+    const KeyframeMergeOptions& options,
+    KeyframeMergeStatistics* statistics) {
+  const PinholeParameters depth_params(depth_camera);
+  const PinholeParameters color_params(color_camera);
+  const SE3f target_T_source = global_T_target.inverse() * global_T_source;
+  const Mat3f target_R_source = target_T_source.rotationMatrix();
+  
+  const int width = target->depth.width();
+  const int height = target->depth.height();
+  CHECK_EQ(width, depth_params.width);
+  CHECK_EQ(height, depth_params.height);
+  CHECK_EQ(source.depth.width(), target->depth.width());
+  CHECK_EQ(source.depth.height(), target->depth.height());
+  CHECK_EQ(target->color.width(), color_params.width);
+  CHECK_EQ(target->color.height(), color_params.height);
+  
+  KeyframeMergeStatistics local_statistics;
+  
+  // Reproject all valid source measurements into the target, keeping track of
+  // the front-most reprojected depth for each target pixel. This is used as
+  // the reference depth where the target itself has no valid depth.
+  vector<MergeSplat> splats;
+  splats.reserve(source.depth.pixel_count());
+  vector<float> min_splat_depth(width * height, numeric_limits<float>::infinity());
+  
+  for (u32 y = 0; y < source.depth.height(); ++ y) {
+    for (u32 x = 0; x < source.depth.width(); ++ x) {
+      const u16 raw_depth = source.depth(x, y);
+      if (!IsValidDepth(raw_depth)) {
+        continue;
+      }
+      ++ local_statistics.source_pixel_count;
+      
+      const float source_depth = calibration.RawToDepth(x, y, raw_depth);
+      const Vec3f source_point = depth_params.UnprojectPixelCenter(x, y, source_depth);
+      const Vec3f target_point = target_T_source * source_point;
+      int tx, ty;
+      if (!depth_params.ProjectToPixel(target_point, &tx, &ty)) {
+        continue;
+      }
+      
+      const Vec3f target_normal = target_R_source * U16ToImageSpaceNormalCPU(source.normals(x, y));
+      const float view_cos = -target_normal.dot(target_point.normalized());
+      if (view_cos < options.min_normal_view_cos) {
+        continue;
+      }
+      
+      int source_cx, source_cy, target_cx, target_cy;
+      if (!color_params.ProjectToPixel(source_point, &source_cx, &source_cy) ||
+          !color_params.ProjectToPixel(target_point, &target_cx, &target_cy)) {
+        continue;
+      }
+      
+      MergeSplat splat;
+      splat.target_pixel = tx + ty * width;
+      splat.target_color_pixel = target_cx + target_cy * color_params.width;
+      splat.depth = target_point.z();
+      splat.weight = 1.f / (splat.depth * splat.depth);
+      // The radius is proportional to the depth.
+      const float depth_ratio = target_point.z() / source_depth;
+      splat.radius_squared = depth_ratio * depth_ratio * static_cast<float>(reinterpret_cast<const Eigen::half&>(source.radius(x, y)));
+      splat.normal = target_normal;
+      const Vec4u8& color = source.color(source_cx, source_cy);
+      splat.color = Vec3f(color.x(), color.y(), color.z());
+      splats.push_back(splat);
+      
+      min_splat_depth[splat.target_pixel] = std::min(min_splat_depth[splat.target_pixel], splat.depth);
+    }
+  }
+  
+  // Accumulate the consistent measurements.
+  vector<float> weight_sum(width * height, 0.f);
+  vector<float> depth_sum(width * height, 0.f);
+  vector<float> radius_squared_sum(width * height, 0.f);
+  vector<Vec3f> normal_sum(width * height, Vec3f::Zero());
+  vector<float> target_depth(width * height, 0.f);
+  
+  for (int y = 0; y < height; ++ y) {
+    for (int x = 0; x < width; ++ x) {
+      const u16 raw_depth = target->depth(x, y);
+      if (IsValidDepth(raw_depth)) {
+        target_depth[x + y * width] = calibration.RawToDepth(x, y, raw_depth);
+      }
+    }
+  }
+  
+  const usize color_pixel_count = target->color.pixel_count();
+  vector<float> color_weight_sum(color_pixel_count, 0.f);
+  vector<Vec3f> color_sum(color_pixel_count, Vec3f::Zero());
+  
+  for (const MergeSplat& splat : splats) {
+    const int pixel = splat.target_pixel;
+    const float reference_depth = (target_depth[pixel] > 0) ? target_depth[pixel] : min_splat_depth[pixel];
+    if (fabs(splat.depth - reference_depth) > options.relative_depth_threshold * reference_depth) {
+      continue;
+    }
+    
+    weight_sum[pixel] += splat.weight;
+    depth_sum[pixel] += splat.weight * splat.depth;
+    radius_squared_sum[pixel] += splat.weight * splat.radius_squared;
+    normal_sum[pixel] += splat.weight * splat.normal;
+    
+    const int color_pixel = splat.target_color_pixel;
+    if (color_weight_sum[color_pixel] == 0) {
+      // Start with the target's own color, weighted like a measurement at the
+      // reference depth.
+      const Vec4u8& color = target->color(color_pixel % color_params.width, color_pixel / color_params.width);
+      const float target_weight = 1.f / (reference_depth * reference_depth);
+      color_weight_sum[color_pixel] = target_weight;
+      color_sum[color_pixel] = target_weight * Vec3f(color.x(), color.y(), color.z());
+    }
+    color_weight_sum[color_pixel] += splat.weight;
+    color_sum[color_pixel] += splat.weight * splat.color;
+  }
+  
+  // Write the fused measurements back to the target.
+  for (int y = 0; y < height; ++ y) {
+    for (int x = 0; x < width; ++ x) {
+      const int pixel = x + y * width;
+      if (weight_sum[pixel] == 0) {
+        continue;
+      }
+      
+      const bool target_valid = target_depth[pixel] > 0;
+      if (target_valid) {
+        const float target_weight = 1.f / (target_depth[pixel] * target_depth[pixel]);
+        weight_sum[pixel] += target_weight;
+        depth_sum[pixel] += target_weight * target_depth[pixel];
+        radius_squared_sum[pixel] += target_weight * static_cast<float>(reinterpret_cast<const Eigen::half&>(target->radius(x, y)));
+        normal_sum[pixel] += target_weight * U16ToImageSpaceNormalCPU(target->normals(x, y));
+      }
+      
+      const float depth = depth_sum[pixel] / weight_sum[pixel];
+      const u16 raw_depth = calibration.DepthToRaw(x, y, depth);
+      if (raw_depth == 0) {
+        continue;
+      }
+      target->depth(x, y) = raw_depth;
+      reinterpret_cast<Eigen::half&>(target->radius(x, y)) = Eigen::half(radius_squared_sum[pixel] / weight_sum[pixel]);
+      const float normal_norm = normal_sum[pixel].norm();
+      if (normal_norm > 0) {
+        target->normals(x, y) = ImageSpaceNormalToU16CPU(normal_sum[pixel] / normal_norm);
+      }
+      
+      local_statistics.min_depth = std::min(local_statistics.min_depth, depth);
+      local_statistics.max_depth = std::max(local_statistics.max_depth, depth);
+      if (target_valid) {
+        ++ local_statistics.fused_pixel_count;
+      } else {
+        ++ local_statistics.filled_pixel_count;
+      }
+    }
+  }
+  
+  for (usize color_pixel = 0; color_pixel < color_pixel_count; ++ color_pixel) {
+    if (color_weight_sum[color_pixel] == 0) {
+      continue;
+    }
+    const Vec3f color = color_sum[color_pixel] / color_weight_sum[color_pixel];
+    Vec4u8& result = target->color(color_pixel % color_params.width, color_pixel / color_params.width);
+    result.x() = static_cast<u8>(color.x() + 0.5f);
+    result.y() = static_cast<u8>(color.y() + 0.5f);
+    result.z() = static_cast<u8>(color.z() + 0.5f);
+    // Same as in ComputeBrightnessKernel().
+    result.w() = ComputeRoundedBrightness(result.x(), result.y(), result.z());
+  }
+  
+  if (statistics) {
+    *statistics = local_statistics;
+  }
+}
+
+}
@@ -0,0 +1,130 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <limits>
+
+#include <libvis/camera.h>
+#include <libvis/eigen.h>
+#include <libvis/image.h>
+#include <libvis/libvis.h>
+#include <libvis/sophus.h>
+
+#include "badslam/depth_parameters_cpu.h"
+#include "badslam/keyframe_storage.h"
+
+namespace vis {
+
+struct KeyframeMergeOptions {
+  // Maximum relative depth difference for which two measurements are
+  // considered to observe the same surface.
+  float relative_depth_threshold = 0.05f;
+  
+  // Minimum cosine of the angle between the surface normal and the viewing
+  // direction of the target keyframe for reprojected measurements. Surfaces
+  // which are seen at more grazing angles are not transferred.
+  float min_normal_view_cos = 0.2f;
+  
+  // Pixel step of the sparse sampling grid which is used to compute coverage.
+  int coverage_sample_step = 4;
+};
+
+// Another keyframe against which coverage is tested.
+struct KeyframeMergeNeighbor {
+  const KeyframeImageData* images;
+  SE3f global_T_frame;
+};
+
+struct KeyframeCoverage {
+  // Fraction of the (sampled) valid depth pixels of the keyframe that are
+  // observed with consistent depth by at least one of the neighbors. A
+  // keyframe with coverage 1 does not contribute any geometry that is not
+  // also present in the neighbors.
+  float coverage = 0;
+  
+  // Index of the neighbor which individually observes most of the keyframe,
+  // or -1 if no neighbor observes any of it.
+  int best_neighbor = -1;
+  
+  // Fraction of the keyframe's sampled valid pixels observed by the best
+  // neighbor.
+  float best_neighbor_overlap = 0;
+};
+
+// Computes how well the keyframe with the given images is covered by the
+// neighbor keyframes. All keyframes share the same depth camera.
+KeyframeCoverage ComputeKeyframeCoverage(
+    const KeyframeImageData& images,
+    const SE3f& global_T_frame,
+    const vector<KeyframeMergeNeighbor>& neighbors,
+    const PinholeCamera4f& depth_camera,
+    const DepthParametersCPU& calibration,
+    const KeyframeMergeOptions& options);
+
+struct KeyframeMergeStatistics {
+  // Number of valid source depth pixels.
+  usize source_pixel_count = 0;
+  
+  // Number of target pixels whose measurement was fused with source
+  // measurements.
+  usize fused_pixel_count = 0;
+  
+  // Number of target pixels without valid depth that were filled in from the
+  // source.
+  usize filled_pixel_count = 0;
+  
+  // Range of the depth values which were written to the target. Only valid if
+  // fused_pixel_count + filled_pixel_count > 0.
+  float min_depth = numeric_limits<float>::infinity();
+  float max_depth = 0;
+};
+
+// Merges the depth, normal, radius and color measurements of a source keyframe
+// into a target keyframe. Valid source depth pixels are reprojected into the
+// target. Where the target has a consistent measurement, the measurements are
+// averaged, weighting each by its inverse squared depth (since depth noise
+// grows with the depth). Where the target has no valid depth, the reprojected
+// source measurement is filled in. Inconsistent measurements (for example,
+// occluded ones) are dropped.
+// 
+// This is the CPU implementation of keyframe merging; it is used by
+// DirectBA::MergeKeyframes() on downloaded keyframe images, which is fine
+// since merging only happens rarely when running out of GPU memory.
+void MergeKeyframeImages(
+    const KeyframeImageData& source,
+    const SE3f& global_T_source,
+    KeyframeImageData* target,
+    const SE3f& global_T_target,
+    const PinholeCamera4f& depth_camera,
+    const PinholeCamera4f& color_camera,
+    const DepthParametersCPU& calibration,
+    const KeyframeMergeOptions& options,
+    KeyframeMergeStatistics* statistics = nullptr);
+
+}
@@ -0,0 +1,107 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "badslam/keyframe_selector.h"
+
+#include <libvis/logging.h>
+
+namespace vis {
+
+KeyframeSelector::KeyframeSelector(
+    int max_interval,
+    float min_overlap,
+    float max_translation,
+    float max_rotation_degrees,
+    float max_residual_increase)
+    : max_interval_(max_interval),
+      min_overlap_(min_overlap),
+      max_translation_(max_translation),
+      max_rotation_degrees_(max_rotation_degrees),
+      max_residual_increase_(max_residual_increase) {
+  CHECK_GE(max_interval_, 1);
+  CHECK_GE(min_overlap_, 0);
+  CHECK_GE(max_translation_, 0);
+  CHECK_GE(max_rotation_degrees_, 0);
+  CHECK_GE(max_residual_increase_, 0);
+}
+
+KeyframeSelector::Decision KeyframeSelector::Decide(
+    const SE3f& base_kf_T_frame,
+    u32 residual_count,
+    float residual_sum) {
+  ++ frames_since_keyframe_;
+  
+  float mean_residual = (residual_count > 0) ? (residual_sum / residual_count) : 0;
+  if (reference_residual_count_ == 0) {
+    reference_residual_count_ = residual_count;
+    reference_mean_residual_ = mean_residual;
+  }
+  
+  Decision decision = Decision::kNoKeyframe;
+  if (frames_since_keyframe_ >= max_interval_) {
+    decision = Decision::kMaxInterval;
+  } else if (min_overlap_ > 0 &&
+             reference_residual_count_ > 0 &&
+             residual_count < min_overlap_ * reference_residual_count_) {
+    decision = Decision::kLowOverlap;
+  } else if (max_translation_ > 0 &&
+             base_kf_T_frame.translation().squaredNorm() > max_translation_ * max_translation_) {
+    decision = Decision::kTranslation;
+  } else if (max_rotation_degrees_ > 0 &&
+             base_kf_T_frame.so3().log().norm() > max_rotation_degrees_ * (M_PI / 180.f)) {
+    decision = Decision::kRotation;
+  } else if (max_residual_increase_ > 0 &&
+             reference_mean_residual_ > 0 &&
+             mean_residual > max_residual_increase_ * reference_mean_residual_) {
+    decision = Decision::kResidualIncrease;
+  }
+  
+  ++ decision_counts_[static_cast<int>(decision)];
+  return decision;
+}
+
+void KeyframeSelector::NotifyKeyframeCreated() {
+  frames_since_keyframe_ = 0;
+  reference_residual_count_ = 0;
+  reference_mean_residual_ = 0;
+}
+
+const char* KeyframeSelector::DecisionToString(Decision decision) {
+  switch (decision) {
+  case Decision::kNoKeyframe:        return "no keyframe";
+  case Decision::kMaxInterval:       return "maximum interval";
+  case Decision::kLowOverlap:        return "low overlap";
+  case Decision::kTranslation:       return "translation";
+  case Decision::kRotation:          return "rotation";
+  case Decision::kResidualIncrease:  return "residual increase";
+  case Decision::kNumDecisions:      break;
+  }
+  return "invalid";
+}
+
+}
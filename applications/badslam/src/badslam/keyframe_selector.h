@@ -0,0 +1,110 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <libvis/libvis.h>
+#include <libvis/sophus.h>
+
+namespace vis {
+
+// Decides for each tracked frame whether it should become a keyframe, based
+// on the result of tracking it against the current base keyframe with
+// odometry. A keyframe is created if any of the following holds:
+// - max_interval frames have passed since the last keyframe,
+// - the overlap with the base keyframe dropped below min_overlap,
+// - the camera moved more than max_translation (in meters) or rotated more
+//   than max_rotation_degrees since the base keyframe,
+// - the mean tracking residual grew by more than a factor of
+//   max_residual_increase.
+// Setting a threshold to 0 disables the corresponding criterion.
+// 
+// Since odometry does not count the pixels which are visible in both frames
+// directly, the overlap is estimated as the number of valid tracking
+// residuals relative to that number for the first frame tracked against the
+// base keyframe (which is the frame that is closest to it). Likewise, the
+// mean residual is compared to that of the first tracked frame.
+// 
+// This class is not thread-safe.
+class KeyframeSelector {
+ public:
+  enum class Decision {
+    kNoKeyframe = 0,
+    kMaxInterval,
+    kLowOverlap,
+    kTranslation,
+    kRotation,
+    kResidualIncrease,
+    kNumDecisions
+  };
+  
+  KeyframeSelector(
+      int max_interval,
+      float min_overlap,
+      float max_translation,
+      float max_rotation_degrees,
+      float max_residual_increase);
+  
+  // Decides whether the frame which was tracked against the base keyframe
+  // with the given result should become a keyframe. If it does, the caller
+  // must create the keyframe and call NotifyKeyframeCreated().
+  Decision Decide(
+      const SE3f& base_kf_T_frame,
+      u32 residual_count,
+      float residual_sum);
+  
+  // Must be called whenever a keyframe was created (including keyframes which
+  // were created independently of Decide(), for example forced ones).
+  void NotifyKeyframeCreated();
+  
+  // Returns how often Decide() returned the given decision.
+  inline int decision_count(Decision decision) const {
+    return decision_counts_[static_cast<int>(decision)];
+  }
+  
+  // Returns a short human-readable description of the decision.
+  static const char* DecisionToString(Decision decision);
+  
+ private:
+  // Settings.
+  int max_interval_;
+  float min_overlap_;
+  float max_translation_;
+  float max_rotation_degrees_;
+  float max_residual_increase_;
+  
+  // State (relative to the current base keyframe).
+  int frames_since_keyframe_ = 0;
+  u32 reference_residual_count_ = 0;
+  float reference_mean_residual_ = 0;
+  
+  // Statistics.
+  int decision_counts_[static_cast<int>(Decision::kNumDecisions)] = {};
+};
+
+}
@@ -0,0 +1,352 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "badslam/keyframe_storage.h"
+
+#include <cstdio>
+
+#include <boost/filesystem.hpp>
+#include <libvis/logging.h>
+#include <zlib.h>
+
+namespace vis {
+
+namespace {
+
+constexpr u8 kKeyframeDataVersion = 1;
+
+// Size of the header: version, uncompressed payload size, and width and height
+// of the four images.
+constexpr usize kHeaderSize = 1 + 4 + 4 * 2 * 4;
+
+// Refuse to decode images larger than this (in each dimension).
+constexpr u32 kMaxImageDimension = 1 << 15;
+
+// Appends the pixels of the image as byte planes (the first byte of each
+// pixel, then the second byte of each pixel, etc.), which compresses better
+// than the interleaved bytes.
+template <typename T>
+void AppendBytePlanes(const Image<T>& image, u8* dest) {
+  const usize pixel_count = image.pixel_count();
+  for (u32 y = 0; y < image.height(); ++ y) {
+    const u8* row = reinterpret_cast<const u8*>(image.row(y));
+    usize pixel_offset = y * image.width();
+    for (u32 x = 0; x < image.width(); ++ x) {
+      for (usize b = 0; b < sizeof(T); ++ b) {
+        dest[b * pixel_count + pixel_offset + x] = row[x * sizeof(T) + b];
+      }
+    }
+  }
+}
+
+template <typename T>
+void ReadBytePlanes(const u8* src, Image<T>* image) {
+  const usize pixel_count = image->pixel_count();
+  for (u32 y = 0; y < image->height(); ++ y) {
+    u8* row = reinterpret_cast<u8*>(image->row(y));
+    usize pixel_offset = y * image->width();
+    for (u32 x = 0; x < image->width(); ++ x) {
+      for (usize b = 0; b < sizeof(T); ++ b) {
+        row[x * sizeof(T) + b] = src[b * pixel_count + pixel_offset + x];
+      }
+    }
+  }
+}
+
+template <typename T>
+void AppendSize(const Image<T>& image, u8** cursor) {
+  u32 size[2] = {image.width(), image.height()};
+  memcpy(*cursor, size, sizeof(size));
+  *cursor += sizeof(size);
+}
+
+}  // namespace
+
+bool EncodeKeyframeImages(
+    const KeyframeImageData& images,
+    int compression_level,
+    vector<u8>* data) {
+  const usize payload_size =
+      images.depth.pixel_count() * sizeof(u16) +
+      images.normals.pixel_count() * sizeof(u16) +
+      images.radius.pixel_count() * sizeof(u16) +
+      images.color.pixel_count() * sizeof(Vec4u8);
+  
+  vector<u8> payload(payload_size);
+  u8* cursor = payload.data();
+  AppendBytePlanes(images.depth, cursor);
+  cursor += images.depth.pixel_count() * sizeof(u16);
+  AppendBytePlanes(images.normals, cursor);
+  cursor += images.normals.pixel_count() * sizeof(u16);
+  AppendBytePlanes(images.radius, cursor);
+  cursor += images.radius.pixel_count() * sizeof(u16);
+  AppendBytePlanes(images.color, cursor);
+  
+  uLongf compressed_size = compressBound(payload_size);
+  data->resize(kHeaderSize + compressed_size);
+  
+  u8* header = data->data();
+  *header = kKeyframeDataVersion;
+  ++ header;
+  u32 payload_size_u32 = payload_size;
+  memcpy(header, &payload_size_u32, sizeof(u32));
+  header += sizeof(u32);
+  AppendSize(images.depth, &header);
+  AppendSize(images.normals, &header);
+  AppendSize(images.radius, &header);
+  AppendSize(images.color, &header);
+  
+  if (compress2(data->data() + kHeaderSize, &compressed_size,
+                payload.data(), payload_size, compression_level) != Z_OK) {
+    LOG(ERROR) << "Failed to compress keyframe data";
+    return false;
+  }
+  data->resize(kHeaderSize + compressed_size);
+  return true;
+}
+
+bool DecodeKeyframeImages(
+    const u8* data,
+    usize size,
+    KeyframeImageData* images) {
+  if (size < kHeaderSize) {
+    LOG(ERROR) << "Keyframe data is too small";
+    return false;
+  }
+  if (data[0] != kKeyframeDataVersion) {
+    LOG(ERROR) << "Unsupported keyframe data version: " << static_cast<int>(data[0]);
+    return false;
+  }
+  
+  u32 header[1 + 4 * 2];
+  memcpy(header, data + 1, sizeof(header));
+  u32 payload_size = header[0];
+  usize expected_payload_size = 0;
+  for (int i = 0; i < 4; ++ i) {
+    if (header[1 + 2 * i] > kMaxImageDimension || header[2 + 2 * i] > kMaxImageDimension) {
+      LOG(ERROR) << "Invalid image size in keyframe data";
+      return false;
+    }
+    expected_payload_size += static_cast<usize>(header[1 + 2 * i]) * header[2 + 2 * i] *
+                             ((i == 3) ? sizeof(Vec4u8) : sizeof(u16));
+  }
+  if (payload_size != expected_payload_size) {
+    LOG(ERROR) << "Inconsistent payload size in keyframe data";
+    return false;
+  }
+  
+  vector<u8> payload(payload_size);
+  uLongf uncompressed_size = payload_size;
+  if (uncompress(payload.data(), &uncompressed_size,
+                 data + kHeaderSize, size - kHeaderSize) != Z_OK ||
+      uncompressed_size != payload_size) {
+    LOG(ERROR) << "Failed to decompress keyframe data";
+    return false;
+  }
+  
+  images->depth.SetSize(header[1], header[2]);
+  images->normals.SetSize(header[3], header[4]);
+  images->radius.SetSize(header[5], header[6]);
+  images->color.SetSize(header[7], header[8]);
+  
+  const u8* cursor = payload.data();
+  ReadBytePlanes(cursor, &images->depth);
+  cursor += images->depth.pixel_count() * sizeof(u16);
+  ReadBytePlanes(cursor, &images->normals);
+  cursor += images->normals.pixel_count() * sizeof(u16);
+  ReadBytePlanes(cursor, &images->radius);
+  cursor += images->radius.pixel_count() * sizeof(u16);
+  ReadBytePlanes(cursor, &images->color);
+  return true;
+}
+
+
+bool KeyframeStorage::Store(int keyframe_id, const KeyframeImageData& images) {
+  vector<u8> data;
+  if (!EncodeKeyframeImages(images, compression_level_, &data) ||
+      !StoreEncoded(keyframe_id, &data)) {
+    return false;
+  }
+  ++ store_count_;
+  return true;
+}
+
+bool KeyframeStorage::Load(int keyframe_id, KeyframeImageData* images) {
+  vector<u8> data;
+  if (!LoadEncoded(keyframe_id, &data) ||
+      !DecodeKeyframeImages(data.data(), data.size(), images)) {
+    return false;
+  }
+  ++ load_count_;
+  return true;
+}
+
+
+HostKeyframeStorage::HostKeyframeStorage(int compression_level)
+    : KeyframeStorage(compression_level),
+      stored_bytes_(0) {}
+
+void HostKeyframeStorage::Erase(int keyframe_id) {
+  lock_guard<mutex> lock(mutex_);
+  auto it = data_.find(keyframe_id);
+  if (it != data_.end()) {
+    stored_bytes_ -= it->second.size();
+    data_.erase(it);
+  }
+}
+
+bool HostKeyframeStorage::Contains(int keyframe_id) {
+  lock_guard<mutex> lock(mutex_);
+  return data_.count(keyframe_id) > 0;
+}
+
+usize HostKeyframeStorage::stored_keyframe_count() {
+  lock_guard<mutex> lock(mutex_);
+  return data_.size();
+}
+
+usize HostKeyframeStorage::stored_bytes() {
+  lock_guard<mutex> lock(mutex_);
+  return stored_bytes_;
+}
+
+bool HostKeyframeStorage::StoreEncoded(int keyframe_id, vector<u8>* data) {
+  data->shrink_to_fit();
+  
+  lock_guard<mutex> lock(mutex_);
+  vector<u8>& entry = data_[keyframe_id];
+  stored_bytes_ -= entry.size();
+  stored_bytes_ += data->size();
+  entry.swap(*data);
+  return true;
+}
+
+bool HostKeyframeStorage::LoadEncoded(int keyframe_id, vector<u8>* data) {
+  lock_guard<mutex> lock(mutex_);
+  auto it = data_.find(keyframe_id);
+  if (it == data_.end()) {
+    return false;
+  }
+  *data = it->second;
+  return true;
+}
+
+
+DiskKeyframeStorage::DiskKeyframeStorage(const string& directory, int compression_level)
+    : KeyframeStorage(compression_level),
+      directory_(directory),
+      stored_bytes_(0) {
+  boost::filesystem::create_directories(directory_);
+}
+
+DiskKeyframeStorage::~DiskKeyframeStorage() {
+  for (const auto& item : file_sizes_) {
+    boost::filesystem::remove(GetPath(item.first));
+  }
+}
+
+void DiskKeyframeStorage::Erase(int keyframe_id) {
+  lock_guard<mutex> lock(mutex_);
+  auto it = file_sizes_.find(keyframe_id);
+  if (it != file_sizes_.end()) {
+    boost::filesystem::remove(GetPath(keyframe_id));
+    stored_bytes_ -= it->second;
+    file_sizes_.erase(it);
+  }
+}
+
+bool DiskKeyframeStorage::Contains(int keyframe_id) {
+  lock_guard<mutex> lock(mutex_);
+  return file_sizes_.count(keyframe_id) > 0;
+}
+
+usize DiskKeyframeStorage::stored_keyframe_count() {
+  lock_guard<mutex> lock(mutex_);
+  return file_sizes_.size();
+}
+
+usize DiskKeyframeStorage::stored_bytes() {
+  lock_guard<mutex> lock(mutex_);
+  return stored_bytes_;
+}
+
+bool DiskKeyframeStorage::StoreEncoded(int keyframe_id, vector<u8>* data) {
+  string path = GetPath(keyframe_id);
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file) {
+    LOG(ERROR) << "Cannot write file: " << path;
+    return false;
+  }
+  bool success = fwrite(data->data(), 1, data->size(), file) == data->size();
+  fclose(file);
+  if (!success) {
+    LOG(ERROR) << "Failed to write keyframe data to: " << path;
+    boost::filesystem::remove(path);
+    return false;
+  }
+  
+  lock_guard<mutex> lock(mutex_);
+  usize& file_size = file_sizes_[keyframe_id];
+  stored_bytes_ -= file_size;
+  stored_bytes_ += data->size();
+  file_size = data->size();
+  return true;
+}
+
+bool DiskKeyframeStorage::LoadEncoded(int keyframe_id, vector<u8>* data) {
+  usize file_size;
+  {
+    lock_guard<mutex> lock(mutex_);
+    auto it = file_sizes_.find(keyframe_id);
+    if (it == file_sizes_.end()) {
+      return false;
+    }
+    file_size = it->second;
+  }
+  
+  string path = GetPath(keyframe_id);
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file) {
+    LOG(ERROR) << "Cannot read file: " << path;
+    return false;
+  }
+  data->resize(file_size);
+  bool success = fread(data->data(), 1, file_size, file) == file_size;
+  fclose(file);
+  if (!success) {
+    LOG(ERROR) << "Failed to read keyframe data from: " << path;
+  }
+  return success;
+}
+
+string DiskKeyframeStorage::GetPath(int keyframe_id) const {
+  return (boost::filesystem::path(directory_) /
+          ("keyframe_" + std::to_string(keyframe_id) + ".bin")).string();
+}
+
+}
@@ -0,0 +1,158 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+#include <libvis/eigen.h>
+#include <libvis/image.h>
+#include <libvis/libvis.h>
+
+namespace vis {
+
+// CPU copy of the image data of a keyframe, which is used to keep keyframes
+// outside of GPU memory. The color image holds the uchar4 values of the
+// keyframe's color buffer.
+struct KeyframeImageData {
+  Image<u16> depth;
+  Image<u16> normals;
+  Image<u16> radius;
+  Image<Vec4u8> color;
+};
+
+// Serializes the given keyframe images into a compressed byte buffer.
+// compression_level is passed to zlib (0: no compression, 9: maximum
+// compression).
+bool EncodeKeyframeImages(
+    const KeyframeImageData& images,
+    int compression_level,
+    vector<u8>* data);
+
+// Deserializes keyframe images from a buffer written by EncodeKeyframeImages().
+// Returns false if the data is invalid.
+bool DecodeKeyframeImages(
+    const u8* data,
+    usize size,
+    KeyframeImageData* images);
+
+
+// Storage for keyframe image data that has been evicted from GPU memory. The
+// data is addressed by keyframe ID. Implementations must be thread-safe.
+class KeyframeStorage {
+ public:
+  inline KeyframeStorage(int compression_level)
+      : compression_level_(compression_level),
+        store_count_(0),
+        load_count_(0) {}
+  
+  virtual inline ~KeyframeStorage() {}
+  
+  // Stores the images of the keyframe with the given ID, replacing any data
+  // which might have been stored for this ID before.
+  bool Store(int keyframe_id, const KeyframeImageData& images);
+  
+  // Loads the images of the keyframe with the given ID. Returns false if there
+  // is no (valid) data for this ID.
+  bool Load(int keyframe_id, KeyframeImageData* images);
+  
+  // Removes the data for the keyframe with the given ID (if any).
+  virtual void Erase(int keyframe_id) = 0;
+  
+  // Returns whether data is stored for the given keyframe ID.
+  virtual bool Contains(int keyframe_id) = 0;
+  
+  // Returns the number of keyframes and bytes which are currently stored.
+  virtual usize stored_keyframe_count() = 0;
+  virtual usize stored_bytes() = 0;
+  
+  // Returns the total number of Store() and successful Load() calls.
+  inline usize store_count() const { return store_count_; }
+  inline usize load_count() const { return load_count_; }
+  
+ protected:
+  virtual bool StoreEncoded(int keyframe_id, vector<u8>* data) = 0;
+  virtual bool LoadEncoded(int keyframe_id, vector<u8>* data) = 0;
+  
+ private:
+  int compression_level_;
+  std::atomic<usize> store_count_;
+  std::atomic<usize> load_count_;
+};
+
+// Keeps the (compressed) keyframe data in host memory.
+class HostKeyframeStorage : public KeyframeStorage {
+ public:
+  HostKeyframeStorage(int compression_level = 1);
+  
+  virtual void Erase(int keyframe_id) override;
+  virtual bool Contains(int keyframe_id) override;
+  virtual usize stored_keyframe_count() override;
+  virtual usize stored_bytes() override;
+  
+ protected:
+  virtual bool StoreEncoded(int keyframe_id, vector<u8>* data) override;
+  virtual bool LoadEncoded(int keyframe_id, vector<u8>* data) override;
+  
+ private:
+  std::mutex mutex_;
+  std::unordered_map<int, vector<u8>> data_;
+  usize stored_bytes_;
+};
+
+// Keeps the (compressed) keyframe data in files within a directory, using one
+// file per keyframe. Loading does not remove a file. The files are deleted
+// when they are erased (Keyframe erases its data once it has been transferred
+// back to the GPU), and on destruction.
+class DiskKeyframeStorage : public KeyframeStorage {
+ public:
+  DiskKeyframeStorage(const string& directory, int compression_level = 1);
+  
+  ~DiskKeyframeStorage();
+  
+  virtual void Erase(int keyframe_id) override;
+  virtual bool Contains(int keyframe_id) override;
+  virtual usize stored_keyframe_count() override;
+  virtual usize stored_bytes() override;
+  
+ protected:
+  virtual bool StoreEncoded(int keyframe_id, vector<u8>* data) override;
+  virtual bool LoadEncoded(int keyframe_id, vector<u8>* data) override;
+  
+ private:
+  string GetPath(int keyframe_id) const;
+  
+  string directory_;
+  std::mutex mutex_;
+  std::unordered_map<int, usize> file_sizes_;
+  usize stored_bytes_;
+};
+
+}
@@ -85,6 +85,7 @@
 #include <opengv/sac_problems/point_cloud/PointCloudSacProblem.hpp>
 
 #include "badslam/cuda_image_processing.cuh"
+#include "badslam/image_conversion.h"
 #include "badslam/pairwise_frame_tracking.h"
 #include "badslam/pose_graph_optimizer.h"
 #include "badslam/surfel_projection.h"
@@ -131,6 +132,50 @@ void BriefExtractor::operator() (
 // -----------------------------------------------------------------------------
 
 
+IndexedBriefLoopDetector::IndexedBriefLoopDetector(
+    const BriefVocabulary& vocabulary,
+    const Parameters& params,
+    int max_query_words,
+    int max_keyframes_per_word)
+    : BriefLoopDetector(vocabulary, params),
+      index_(max_query_words, max_keyframes_per_word) {
+  CHECK_EQ(static_cast<int>(vocabulary.getScoringType()), static_cast<int>(DBoW2::L1_NORM));
+  CHECK_NE(static_cast<int>(params.geom_check), static_cast<int>(DLoopDetector::GEOM_DI));
+}
+
+unsigned int IndexedBriefLoopDetector::databaseSize() const {
+  return index_.size();
+}
+
+void IndexedBriefLoopDetector::addToDatabase(
+    const DBoW2::BowVector& bowvec,
+    const DBoW2::FeatureVector& /*featvec*/) {
+  index_.Add(bowvec);
+}
+
+void IndexedBriefLoopDetector::queryDatabase(
+    const DBoW2::BowVector& bowvec,
+    DBoW2::QueryResults& ret,
+    int max_results,
+    int max_id) const {
+  vector<KeyframeIndex::Result> results;
+  index_.Query(bowvec, max_results, max_id, &results);
+  
+  ret.clear();
+  ret.reserve(results.size());
+  for (const KeyframeIndex::Result& result : results) {
+    ret.emplace_back(result.id, result.score);
+  }
+}
+
+void IndexedBriefLoopDetector::removeFromDatabase(DBoW2::EntryId entry_id) {
+  index_.Remove(entry_id);
+}
+
+
+// -----------------------------------------------------------------------------
+
+
 LoopDetector:: LoopDetector(
     const string& vocabulary_path,
     const string& pattern_path,
@@ -141,10 +186,17 @@ LoopDetector:: LoopDetector(
     int depth_image_height,
     int num_scales,
     float image_frequency,
-    bool parallel_loop_detection)
+    bool parallel_loop_detection,
+    int num_worker_threads,
+    int max_query_words,
+    int max_keyframes_per_word)
     : pairwise_tracking_buffers_(depth_image_width,
                                  depth_image_height,
-                                 num_scales) {
+                                 num_scales),
+      extraction_queue_("Loop detection extraction"),
+      query_queue_("Loop detection query"),
+      verification_queue_("Loop detection verification"),
+      result_queue_("Loop detection result") {
   raw_to_float_depth_ = raw_to_float_depth;
   
   // Set loop detector parameters
@@ -170,8 +222,14 @@ LoopDetector:: LoopDetector(
   LOG(INFO) << "Loop detector: Loading vocabulary (from " << vocabulary_path << ") ...";
   TVocabulary voc(vocabulary_path);  // throws exception if file not found
   
-  // Initiate loop detector with the vocabulary 
-  detector_.reset(new TDetector(voc, params));
+  // Initiate loop detector with the vocabulary. Retrieve images with a
+  // KeyframeIndex if the vocabulary's scoring is supported by it.
+  if (voc.getScoringType() == DBoW2::L1_NORM) {
+    detector_.reset(new IndexedBriefLoopDetector(voc, params, max_query_words, max_keyframes_per_word));
+  } else {
+    LOG(WARNING) << "Loop detector: The vocabulary does not use L1 scoring, falling back to the (slower) DBoW2 database.";
+    detector_.reset(new TDetector(voc, params));
+  }
   
   // Optionally allocate memory for the expected number of images
   detector_->allocate(2500);
@@ -179,29 +237,33 @@ LoopDetector:: LoopDetector(
   extractor_.reset(new TExtractor(pattern_path));
   
   if (parallel_loop_detection) {
-    // Start a separate thread for loop detection.
-    quit_requested_ = false;
-    quit_done_ = false;
-    detection_thread_.reset(new thread(std::bind(&LoopDetector::DetectionThreadMain, this)));
+    // Start the threads for loop detection.
+    query_thread_.reset(new thread(std::bind(&LoopDetector::QueryThreadMain, this)));
+    for (int i = 0; i < std::max(1, num_worker_threads); ++ i) {
+      worker_threads_.emplace_back(new thread(std::bind(&LoopDetector::WorkerThreadMain, this)));
+    }
   }
 }
 
 LoopDetector::~LoopDetector() {
-  if (detection_thread_) {
-    // Signal to the loop detection thread that it should exit
-    unique_lock<mutex> lock(detection_thread_mutex_);
+  if (query_thread_) {
+    // Signal to the loop detection threads that they should exit
+    unique_lock<mutex> lock(pipeline_mutex_);
     quit_requested_ = true;
     lock.unlock();
-    zero_images_condition_.notify_all();
+    work_condition_.notify_all();
+    query_condition_.notify_all();
     
-    // Wait for the thread to exit
-    unique_lock<mutex> quit_lock(quit_mutex_);
-    while (!quit_done_) {
-      quit_condition_.wait(quit_lock);
+    // Wait for the threads to exit
+    query_thread_->join();
+    for (unique_ptr<thread>& worker_thread : worker_threads_) {
+      worker_thread->join();
     }
-    quit_lock.unlock();
     
-    detection_thread_->join();
+    extraction_queue_.LogStatistics();
+    query_queue_.LogStatistics();
+    verification_queue_.LogStatistics();
+    result_queue_.LogStatistics();
   }
 }
 
@@ -214,7 +276,7 @@ bool LoopDetector::AddImage(
     const PinholeCamera4f& depth_camera,
     const DepthParameters& depth_params,
     const PinholeCamera4f& gray_camera,
-    const cv::Mat_<u8>& gray_image,
+    const shared_ptr<Image<u8>>& gray_image,
     const shared_ptr<Image<u16>>& depth_image,
     const shared_ptr<BadSlamRenderWindow>& render_window,
     const Keyframe& current_keyframe,
@@ -228,9 +290,9 @@ bool LoopDetector::AddImage(
   constexpr bool use_gradmag = false;
   
   // Verify assumptions on image sizes
-  if (!gray_image.empty() && depth_image) {
-    CHECK_EQ(gray_image.cols, depth_image->width());
-    CHECK_EQ(gray_image.rows, depth_image->height());
+  if (gray_image && depth_image) {
+    CHECK_EQ(gray_image->width(), depth_image->width());
+    CHECK_EQ(gray_image->height(), depth_image->height());
   }
   
   if (depth_image) {
@@ -240,37 +302,45 @@ bool LoopDetector::AddImage(
   
   // Detect loops (or wait for / use the stored result in case of doing loop
   // detection in parallel)
-  DLoopDetector::DetectionResult result;
-  vector<cv::KeyPoint> keys;
-  vector<cv::KeyPoint> old_keypoints;
-  vector<cv::KeyPoint> cur_keypoints;
-  if (detection_thread_) {
-    unique_lock<mutex> lock(detection_result_mutex_);
-    while (detection_results_.empty()) {
-      detection_result_condition_.wait(lock);
+  Detection detection;
+  if (query_thread_) {
+    unique_lock<mutex> lock(pipeline_mutex_);
+    while (result_queue_.empty() || !result_queue_.front()->done) {
+      result_condition_.wait(lock);
     }
     
-    result = detection_results_.front();
-    keys = std::move(detected_keys_.front());
-    old_keypoints = std::move(detected_old_keypoints_.front());
-    cur_keypoints = std::move(detected_cur_keypoints_.front());
-    
-    detection_results_.erase(detection_results_.begin());
-    detected_keys_.erase(detected_keys_.begin());
-    detected_old_keypoints_.erase(detected_old_keypoints_.begin());
-    detected_cur_keypoints_.erase(detected_cur_keypoints_.begin());
-    
+    shared_ptr<PipelineItem> item = result_queue_.Pop();
     lock.unlock();
     
-    if (!result.detection()) {
-      return false;
-    }
+    detection = std::move(item->detection);
   } else {
-    if (!DetectLoop(gray_image, depth_image, &result, &keys, &old_keypoints, &cur_keypoints)) {
-      return false;
+    DetectLoop(gray_image, depth_image, &detection);
+  }
+  
+  if (kDebug) {
+    string loop_status;
+    switch (detection.result.status) {
+    case DLoopDetector::LOOP_DETECTED:              loop_status = "LOOP_DETECTED: A loop was detected";                                   break;
+    case DLoopDetector::CLOSE_MATCHES_ONLY:         loop_status = "CLOSE_MATCHES_ONLY: All the matches are very recent";                  break;
+    case DLoopDetector::NO_DB_RESULTS:              loop_status = "NO_DB_RESULTS: No matches against the database";                       break;
+    case DLoopDetector::LOW_NSS_FACTOR:             loop_status = "LOW_NSS_FACTOR: Score of current image against previous one too low";  break;
+    case DLoopDetector::LOW_SCORES:                 loop_status = "LOW_SCORES: Scores (or NS Scores) were below the alpha threshold";     break;
+    case DLoopDetector::NO_GROUPS:                  loop_status = "NO_GROUPS: Not enough matches to create groups";                       break;
+    case DLoopDetector::NO_TEMPORAL_CONSISTENCY:    loop_status = "NO_TEMPORAL_CONSISTENCY: Not enough temporary consistent matches (k)"; break;
+    case DLoopDetector::NO_GEOMETRICAL_CONSISTENCY: loop_status = "NO_GEOMETRICAL_CONSISTENCY: The geometrical consistency failed";       break;
+    case DLoopDetector::LOOP_CANDIDATE:             loop_status = "LOOP_CANDIDATE: The geometrical consistency was not checked";          break;
     }
+    LOG(INFO) << "Loop status: " << loop_status;
+  }
+  
+  if (!detection.result.detection()) {
+    return false;
   }
   
+  const DLoopDetector::DetectionResult& result = detection.result;
+  const vector<cv::KeyPoint>& old_keypoints = detection.old_keypoints;
+  const vector<cv::KeyPoint>& cur_keypoints = detection.cur_keypoints;
+  
   usize num_matches = old_keypoints.size();
   
   static int loop_count = 0;
@@ -397,6 +467,10 @@ bool LoopDetector::AddImage(
   // depths and transform the color image to depth intrinsics (and image size)
   // such that the code from the multi-res odometry tracking can be re-used
   // which expects these inputs.
+  KeyframeResidencyPin current_keyframe_pin = current_keyframe.Pin(stream);
+  if (!current_keyframe_pin) {
+    return false;
+  }
   if (!calibrated_depth_) {
     CreatePairwiseTrackingInputBuffersAndTextures(
         current_keyframe.depth_buffer().width(),
@@ -495,9 +569,30 @@ bool LoopDetector::AddImage(
     }
   }
   
+  // Read the calibration and the old keyframes' poses from consistent
+  // snapshots, since the BA thread may update them concurrently.
+  shared_ptr<const Snapshot<DirectBA::Calibration>> calibration = direct_ba->calibration_snapshot();
+  shared_ptr<const Snapshot<DirectBA::KeyframePoses>> keyframe_poses = direct_ba->keyframe_poses_snapshot();
+  auto global_T_old_keyframe = [&](int i) {
+    const vector<SE3f>& global_T_keyframe = keyframe_poses->value.global_T_keyframe;
+    usize id = old_keyframes[i]->id();
+    return (id < global_T_keyframe.size() && keyframe_poses->value.keyframe_exists[id]) ?
+           global_T_keyframe[id] :
+           old_keyframes[i]->global_T_frame();
+  };
+  
+  KeyframeResidencyPin old_keyframe_pins[3];
+  for (int i = 0; i < 3; ++ i) {
+    old_keyframe_pins[i] = old_keyframes[i]->Pin(stream);
+    if (!old_keyframe_pins[i]) {
+      LOG(INFO) << "--> Rejecting loop closure since the data of keyframe " << old_keyframes[i]->id() << " is not available.";
+      return false;
+    }
+  }
+  
   SE3f cur_T_tracked[3];
   for (int i = 0; i < 3; ++ i) {
-    SE3f matched_T_this = (i == 0) ? SE3f() : (old_keyframes[0]->frame_T_global() * old_keyframes[i]->global_T_frame());
+    SE3f matched_T_this = (i == 0) ? SE3f() : (global_T_old_keyframe(0).inverse() * global_T_old_keyframe(i));
     
     if (use_gradmag) {
       ComputeSobelGradientMagnitudeCUDA(
@@ -516,9 +611,9 @@ bool LoopDetector::AddImage(
     TrackFramePairwise(
         &pairwise_tracking_buffers_,
         stream,
-        direct_ba->color_camera(),
-        direct_ba->depth_camera(),
-        direct_ba->depth_params(),
+        calibration->value.color_camera,
+        calibration->value.depth_camera,
+        calibration->value.depth_params,
         *direct_ba->cfactor_buffer(),
         &pose_estimation_helper_buffers_,
         render_window,
@@ -694,6 +789,7 @@ bool LoopDetector::AddImage(
     
     keyframe->set_global_T_frame(optimizer.GetGlobalTFrame(keyframe->id()));
   }
+  direct_ba->PublishKeyframePoses();
   
   ExtrapolateAndInterpolateKeyframePoseChanges(
       start_frame,
@@ -711,124 +807,160 @@ bool LoopDetector::AddImage(
 }
 
 void LoopDetector::RemoveImage(int id) {
+  // This function does not lock the detector mutex itself, since callers
+  // usually remove several images at once.
+  if (query_thread_) {
+    CHECK(detector_mutex_.is_locked_exclusively())
+        << "The detector mutex must be locked with LockDetectorMutex() when calling RemoveImage()";
+  }
   detector_->removeImage(id);
 }
 
 void LoopDetector::QueueForLoopDetection(
-    const cv::Mat_<u8>& image,
+    const shared_ptr<Image<u8>>& image,
     const shared_ptr<Image<u16>>& depth_image) {
-  detection_thread_mutex_.lock();
-  
-  parallel_image_queue_.push_back(image);
-  parallel_depth_image_queue_.push_back(depth_image);
-  
-  detection_thread_mutex_.unlock();
-  zero_images_condition_.notify_all();
+  shared_ptr<PipelineItem> item(new PipelineItem());
+  item->image = image;
+  item->depth_image = depth_image;
+  
+  pipeline_mutex_.lock();
+  extraction_queue_.Push(item);
+  query_queue_.Push(item);
+  result_queue_.Push(item);
+  pipeline_mutex_.unlock();
+  work_condition_.notify_one();
 }
 
 bool LoopDetector::DetectLoop(
-    const cv::Mat_<u8>& image,
+    const shared_ptr<Image<u8>>& image,
     const shared_ptr<Image<u16>>& depth_image,
-    DLoopDetector::DetectionResult* result,
-    vector<cv::KeyPoint>* keys,
-    vector<cv::KeyPoint>* old_keypoints,
-    vector<cv::KeyPoint>* cur_keypoints) {
-  // Enable to get debug output
-  constexpr bool kDebug = false;
-  
-  vector<TDescriptor> descriptors;
+    Detection* detection) {
+  PipelineItem item;
+  item.image = image;
+  item.depth_image = depth_image;
+  
+  ExtractFeatures(&item);
+  if (QueryDatabase(&item)) {
+    VerifyCandidate(&item);
+  }
   
-  // Extract features
-  (*extractor_)(image, *keys, descriptors);
+  *detection = std::move(item.detection);
+  return detection->result.detection();
+}
+
+void LoopDetector::ExtractFeatures(PipelineItem* item) const {
+  // Extract features. The OpenCV matrix only references the image data.
+  const Image<u8>& image = *item->image;
+  const cv::Mat_<u8> image_mat(
+      image.height(), image.width(),
+      const_cast<u8*>(image.data()), image.stride());
+  (*extractor_)(image_mat, item->keys, item->descriptors);
   
   // Amend the extracted features with their depth.
   // HACK: Storing the depth in the "response" field of cv::KeyPoint.
-  for (usize i = 0, size = keys->size(); i < size; ++ i) {
-    // TODO: This (and UnprojectFromPixelCornerConv() used later) assumes that
-    //       the OpenCV keypoints use the "pixel corner"
-    //       origin convention, which I am not sure about.
-    // TODO: This should ideally take the potential difference in the color and
-    //       depth camera intrinsics into account.
-    int x = std::max<int>(0, std::min<int>(depth_image->width() - 1, (*keys)[i].pt.x));
-    int y = std::max<int>(0, std::min<int>(depth_image->height() - 1, (*keys)[i].pt.y));
-    
-    float depth = raw_to_float_depth_ * (*depth_image)(x, y);
-    (*keys)[i].response = depth;
-  }
+  SampleKeypointDepths(*item->depth_image, raw_to_float_depth_, &item->keys);
+  
+  // Compute the bag-of-words representation. This only reads the vocabulary.
+  detector_->transform(item->descriptors, item->bowvec, item->featvec);
+  
+  // The images are not needed anymore.
+  item->image.reset();
+  item->depth_image.reset();
+}
+
+bool LoopDetector::QueryDatabase(PipelineItem* item) {
+  // Add the image to the collection and check if there is a loop candidate.
+  lock_guard<ReadWriteMutex> lock(detector_mutex_);
+  return detector_->detectLoopCandidate(
+      item->keys, item->descriptors, item->bowvec, item->featvec,
+      item->detection.result);
+}
+
+void LoopDetector::VerifyCandidate(PipelineItem* item) {
+  Detection* detection = &item->detection;
   
-  // Add the image to the collection and check if a loop is detected.
   // DLoopDetector was modified to return the potentially matching keypoints in
   // old_keypoints and cur_keypoints for the case of params.geom_check ==
   // DLoopDetector::GEOM_DI || params.geom_check == DLoopDetector::GEOM_EXHAUSTIVE.
-  LockDetectorMutex();
-  detector_->detectLoop(*keys, descriptors, *result, old_keypoints, cur_keypoints);
-  UnlockDetectorMutex();
-  
-  if (kDebug) {
-    // LOG(INFO) << "Loop detection: " << (result->detection() ? "true" : "false");
-    
-    string loop_status;
-    switch (result->status) {
-    case DLoopDetector::LOOP_DETECTED:              loop_status = "LOOP_DETECTED: A loop was detected";                                   break;
-    case DLoopDetector::CLOSE_MATCHES_ONLY:         loop_status = "CLOSE_MATCHES_ONLY: All the matches are very recent";                  break;
-    case DLoopDetector::NO_DB_RESULTS:              loop_status = "NO_DB_RESULTS: No matches against the database";                       break;
-    case DLoopDetector::LOW_NSS_FACTOR:             loop_status = "LOW_NSS_FACTOR: Score of current image against previous one too low";  break;
-    case DLoopDetector::LOW_SCORES:                 loop_status = "LOW_SCORES: Scores (or NS Scores) were below the alpha threshold";     break;
-    case DLoopDetector::NO_GROUPS:                  loop_status = "NO_GROUPS: Not enough matches to create groups";                       break;
-    case DLoopDetector::NO_TEMPORAL_CONSISTENCY:    loop_status = "NO_TEMPORAL_CONSISTENCY: Not enough temporary consistent matches (k)"; break;
-    case DLoopDetector::NO_GEOMETRICAL_CONSISTENCY: loop_status = "NO_GEOMETRICAL_CONSISTENCY: The geometrical consistency failed";       break;
-    }
-    LOG(INFO) << "Loop status: " << loop_status;
+  bool consistent;
+  {
+    SharedLock lock(detector_mutex_);
+    consistent = detector_->isGeometricallyConsistent(
+        detection->result.match, item->keys, item->descriptors, item->featvec,
+        &detection->old_keypoints, &detection->cur_keypoints);
   }
   
-  if (!result->detection()) {
-    return false;
+  if (!consistent) {
+    detection->result.status = DLoopDetector::NO_GEOMETRICAL_CONSISTENCY;
+    return;
   }
   
-  CHECK_GT(old_keypoints->size(), 0u);
-  CHECK_EQ(old_keypoints->size(), cur_keypoints->size());
-  return true;
+  detection->result.status = DLoopDetector::LOOP_DETECTED;
+  CHECK_GT(detection->old_keypoints.size(), 0u);
+  CHECK_EQ(detection->old_keypoints.size(), detection->cur_keypoints.size());
 }
 
-void LoopDetector::DetectionThreadMain() {
+void LoopDetector::WorkerThreadMain() {
+  unique_lock<mutex> lock(pipeline_mutex_);
   while (true) {
-    unique_lock<mutex> lock(detection_thread_mutex_);
-    
-    while (parallel_image_queue_.empty() && !quit_requested_) {
-      zero_images_condition_.wait(lock);
+    while (extraction_queue_.empty() && verification_queue_.empty() && !quit_requested_) {
+      work_condition_.wait(lock);
     }
     if (quit_requested_) {
       break;
     }
     
-    // Pop item from parallel_image_queue_ and parallel_depth_image_queue_
-    cv::Mat_<u8> image = parallel_image_queue_.front();
-    parallel_image_queue_.erase(parallel_image_queue_.begin());
-    shared_ptr<Image<u16>> depth_image = parallel_depth_image_queue_.front();
-    parallel_depth_image_queue_.erase(parallel_depth_image_queue_.begin());
+    // Prefer verification work, since it finishes images whose results are
+    // needed first.
+    if (!verification_queue_.empty()) {
+      shared_ptr<PipelineItem> item = verification_queue_.Pop();
+      lock.unlock();
+      
+      VerifyCandidate(item.get());
+      
+      lock.lock();
+      item->done = true;
+      result_condition_.notify_all();
+    } else {
+      shared_ptr<PipelineItem> item = extraction_queue_.Pop();
+      lock.unlock();
+      
+      ExtractFeatures(item.get());
+      
+      lock.lock();
+      item->features_extracted = true;
+      query_condition_.notify_all();
+    }
+  }
+}
+
+void LoopDetector::QueryThreadMain() {
+  unique_lock<mutex> lock(pipeline_mutex_);
+  while (true) {
+    // The images must be added to the database in order, so wait until the
+    // features of the next image are available.
+    while ((query_queue_.empty() || !query_queue_.front()->features_extracted) &&
+           !quit_requested_) {
+      query_condition_.wait(lock);
+    }
+    if (quit_requested_) {
+      break;
+    }
     
+    shared_ptr<PipelineItem> item = query_queue_.Pop();
     lock.unlock();
     
-    // Detect loops
-    DLoopDetector::DetectionResult result;
-    vector<cv::KeyPoint> keys;
-    vector<cv::KeyPoint> old_keypoints;
-    vector<cv::KeyPoint> cur_keypoints;
-    DetectLoop(image, depth_image, &result, &keys, &old_keypoints, &cur_keypoints);
+    bool is_candidate = QueryDatabase(item.get());
     
-    detection_result_mutex_.lock();
-    detection_results_.push_back(result);
-    detected_keys_.push_back(keys);
-    detected_old_keypoints_.push_back(old_keypoints);
-    detected_cur_keypoints_.push_back(cur_keypoints);
-    detection_result_mutex_.unlock();
-    detection_result_condition_.notify_all();
-  }
-  
-  unique_lock<mutex> quit_lock(quit_mutex_);
-  quit_done_ = true;
-  quit_lock.unlock();
-  quit_condition_.notify_all();
+    lock.lock();
+    if (is_candidate) {
+      verification_queue_.Push(item);
+      work_condition_.notify_one();
+    } else {
+      item->done = true;
+      result_condition_.notify_all();
+    }
+  }
 }
 
 }
@@ -79,6 +79,10 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #include <cuda_runtime.h>
 
 #include <DBoW2/DBoW2.h>
@@ -95,6 +99,9 @@
 #include "badslam/pairwise_frame_tracking.h"
 #include "badslam/render_window.h"
 #include "badslam/keyframe.h"
+#include "badslam/keyframe_index.h"
+#include "badslam/read_write_mutex.h"
+#include "badslam/work_queue.h"
 
 namespace vis {
 
@@ -147,6 +154,36 @@ private:
   DVision::BRIEF m_brief;
 };
 
+// Loop detector which retrieves the images with a KeyframeIndex instead of the
+// DBoW2 database, whose query cost grows with the number of images and whose
+// removal of images is slow. Requires L1 scoring in the vocabulary, and does
+// not support the direct index for geometric checks (GEOM_DI).
+class IndexedBriefLoopDetector : public BriefLoopDetector {
+ public:
+  // See KeyframeIndex for max_query_words and max_keyframes_per_word (which is
+  // its max_posting_list_length).
+  IndexedBriefLoopDetector(
+      const BriefVocabulary& vocabulary,
+      const Parameters& params,
+      int max_query_words,
+      int max_keyframes_per_word);
+  
+ protected:
+  unsigned int databaseSize() const override;
+  void addToDatabase(
+      const DBoW2::BowVector& bowvec,
+      const DBoW2::FeatureVector& featvec) override;
+  void queryDatabase(
+      const DBoW2::BowVector& bowvec,
+      DBoW2::QueryResults& ret,
+      int max_results,
+      int max_id) const override;
+  void removeFromDatabase(DBoW2::EntryId entry_id) override;
+  
+ private:
+  KeyframeIndex index_;
+};
+
 // Detects loops using DLoopDetector. If a loop is detected, verifies it using
 // direct pose estimation and distorts the estimated trajectory to close the
 // loop.
@@ -159,11 +196,17 @@ class LoopDetector {
   
   // Constructor. The paths to the vocabulary .voc and pattern .yml file must be
   // given, as well as the dimensions of the images that will be used for loop
-  // closure detection. If parallel_loop_detection is true, a separate thread
-  // will be used for loop detection (but not loop closing). In this case, new
-  // images have to be queued with QueueForLoopDetection() first before calling
-  // AddImage(). Otherwise (i.e., in the sequential case), only AddImage() must
-  // be called.
+  // closure detection. If parallel_loop_detection is true, loop detection (but
+  // not loop closing) runs in parallel in a pipeline of threads: feature
+  // extraction and geometric verification run on num_worker_threads worker
+  // threads, while a separate thread queries and updates the image database in
+  // the order in which the images were queued. In this case, new images have to
+  // be queued with QueueForLoopDetection() first before calling AddImage().
+  // Otherwise (i.e., in the sequential case), only AddImage() must be called.
+  // max_query_words limits the number of words that are scored when querying
+  // the image database, and words which occur in more than
+  // max_keyframes_per_word keyframes are not scored (0 for no limit in both
+  // cases), see KeyframeIndex.
   LoopDetector(
       const string& vocabulary_path,
       const string& pattern_path,
@@ -174,18 +217,20 @@ class LoopDetector {
       int depth_image_height,
       int num_scales,
       float image_frequency,
-      bool parallel_loop_detection);
+      bool parallel_loop_detection,
+      int num_worker_threads,
+      int max_query_words,
+      int max_keyframes_per_word);
   
-  // If parallel loop detection is enabled, waits for the loop detection thread
-  // to exit.
+  // If parallel loop detection is enabled, waits for the loop detection
+  // threads to exit.
   ~LoopDetector();
   
   // Adds an image to the loop detector. Detects loops (or retrieves the
   // detection result in the parallel-detection case), verifies the loop, and
   // closes the loop if verification was successful. Returns true if a loop
-  // closure was performed, false otherwise. depth_image can be null and
-  // gray_image can be invalid if the image was added before with
-  // QueueForLoopDetection().
+  // closure was performed, false otherwise. depth_image and gray_image can be
+  // null if the image was added before with QueueForLoopDetection().
   bool AddImage(
       cudaStream_t stream,
       u32 start_frame,
@@ -195,7 +240,7 @@ class LoopDetector {
       const PinholeCamera4f& depth_camera,
       const DepthParameters& depth_params,
       const PinholeCamera4f& gray_camera,
-      const cv::Mat_<u8>& gray_image,
+      const shared_ptr<Image<u8>>& gray_image,
       const shared_ptr<Image<u16>>& depth_image,
       const shared_ptr<BadSlamRenderWindow>& render_window, // TODO: for debugging only
       const Keyframe& current_keyframe,
@@ -205,6 +250,9 @@ class LoopDetector {
   // Removes an image from the loop detector (such that further loop detection
   // requests will not consider it anymore). If loop detection runs in parallel,
   // then the detector mutex must be locked when RemoveImage() is called.
+  // LockDetectorMutex() acquires exclusive access to the image database, which
+  // otherwise is only written to when adding an image and may be read by
+  // several geometric verifications concurrently.
   void RemoveImage(int id);
   
   // Queues an image for loop detection in the case of running loop detection in
@@ -213,26 +261,72 @@ class LoopDetector {
   // must be the same (it is used to associate loop detection results with added
   // images).
   void QueueForLoopDetection(
-      const cv::Mat_<u8>& image,
+      const shared_ptr<Image<u8>>& image,
       const shared_ptr<Image<u16>>& depth_image);
   
   inline void LockDetectorMutex() { detector_mutex_.lock(); }
   inline void UnlockDetectorMutex() { detector_mutex_.unlock(); }
   
  private:
+  struct Detection {
+    DLoopDetector::DetectionResult result;
+    vector<cv::KeyPoint> old_keypoints;
+    vector<cv::KeyPoint> cur_keypoints;
+  };
+  
+  // An image which passes through the loop detection stages.
+  struct PipelineItem {
+    // Input. Released after feature extraction (which returns pooled images to
+    // their pool).
+    shared_ptr<Image<u8>> image;
+    shared_ptr<Image<u16>> depth_image;
+    
+    // Results of feature extraction. The keypoints store their depth in their
+    // "response" field.
+    vector<cv::KeyPoint> keys;
+    vector<TDescriptor> descriptors;
+    DBoW2::BowVector bowvec;
+    DBoW2::FeatureVector featvec;
+    
+    Detection detection;
+    
+    // Pipeline state, protected by pipeline_mutex_.
+    bool features_extracted = false;
+    bool done = false;
+  };
+  
+  // Runs all loop detection stages for the given image. This is only used if
+  // loop detection runs sequentially.
   // TODO: This function is misnamed (just as in the underlying library) since
   //       it also adds the image to the collection.
   bool DetectLoop(
-      const cv::Mat_<u8>& image,
+      const shared_ptr<Image<u8>>& image,
       const shared_ptr<Image<u16>>& depth_image,
-      DLoopDetector::DetectionResult* result,
-      vector<cv::KeyPoint>* keys,
-      vector<cv::KeyPoint>* old_keypoints,
-      vector<cv::KeyPoint>* cur_keypoints);
+      Detection* detection);
+  
+  // Stage 1: Extracts the features of item->image, determines their depth, and
+  // computes the bag-of-words vectors. Does not access the image database and
+  // may thus run for several images concurrently.
+  void ExtractFeatures(PipelineItem* item) const;
+  
+  // Stage 2: Queries the image database for loop candidates and adds the image
+  // to it. Must be called for the images in the order of their addition.
+  // Returns true if there is a candidate which must be checked with
+  // VerifyCandidate(). Otherwise, the detection result is final.
+  bool QueryDatabase(PipelineItem* item);
+  
+  // Stage 3: Checks the geometric consistency of a loop candidate. Only reads
+  // the image database and may thus run for several candidates concurrently.
+  void VerifyCandidate(PipelineItem* item);
+  
+  // Main function of the threads which run feature extraction and candidate
+  // verification in parallel. This is only used if loop detection is
+  // configured to run in parallel.
+  void WorkerThreadMain();
   
-  // Main function of the thread which runs loop detection in parallel. This
-  // is only used if loop detection is configured to run in parallel.
-  void DetectionThreadMain();
+  // Main function of the thread which runs the database queries in parallel.
+  // This is only used if loop detection is configured to run in parallel.
+  void QueryThreadMain();
   
   
   CUDABufferPtr<float> calibrated_depth_;
@@ -246,31 +340,32 @@ class LoopDetector {
   PairwiseFrameTrackingBuffers pairwise_tracking_buffers_;
   PoseEstimationHelperBuffers pose_estimation_helper_buffers_;
   
-  std::mutex detector_mutex_;
+  // Exclusively locked for modifications of the image database, and shared by
+  // concurrent geometric verifications.
+  ReadWriteMutex detector_mutex_;
   unique_ptr<TDetector> detector_;
   unique_ptr<TExtractor> extractor_;
   
-  // Parallel loop detection.
-  std::atomic<bool> quit_requested_;
-  std::atomic<bool> quit_done_;
-  std::mutex quit_mutex_;
-  condition_variable quit_condition_;
-  unique_ptr<thread> detection_thread_;
-  std::mutex detection_thread_mutex_;
-  condition_variable zero_images_condition_;
+  // Parallel loop detection. Each queued image is in all of the queues below
+  // until it passes the corresponding stage. query_queue_ and result_queue_
+  // keep the images in the order in which they were queued.
+  vector<unique_ptr<thread>> worker_threads_;
+  unique_ptr<thread> query_thread_;
   
-  vector<cv::Mat_<u8>> parallel_image_queue_;
-  vector<shared_ptr<Image<u16>>> parallel_depth_image_queue_;
+  std::mutex pipeline_mutex_;
+  // Signaled when work for the worker threads becomes available.
+  condition_variable work_condition_;
+  // Signaled when the features of an image have been extracted.
+  condition_variable query_condition_;
+  // Signaled when the detection result of an image is final.
+  condition_variable result_condition_;
   
-  std::mutex detection_result_mutex_;
-  std::condition_variable detection_result_condition_;
-  vector<DLoopDetector::DetectionResult> detection_results_;
-  // NOTE on the three members below: Vectors of vectors with dynamic allocation
-  //      of the outer vectors are not a good idea performance-wise. I don't
-  //      think it matters here, but in principle they should be avoided.
-  vector<vector<cv::KeyPoint>> detected_keys_;
-  vector<vector<cv::KeyPoint>> detected_old_keypoints_;
-  vector<vector<cv::KeyPoint>> detected_cur_keypoints_;
+  // Protected by pipeline_mutex_.
+  bool quit_requested_ = false;
+  WorkQueue<shared_ptr<PipelineItem>> extraction_queue_;
+  WorkQueue<shared_ptr<PipelineItem>> query_queue_;
+  WorkQueue<shared_ptr<PipelineItem>> verification_queue_;
+  WorkQueue<shared_ptr<PipelineItem>> result_queue_;
   
   float raw_to_float_depth_;
 };
@@ -57,12 +57,82 @@
 #include "badslam/io.h"
 #include "badslam/pre_load_thread.h"
 #include "badslam/render_window.h"
+#include "badslam/surfel_statistics.h"
 #include "badslam/util.cuh"
 #include "badslam/util.h"
 
 using namespace vis;
 
 
+// Parses a comma-separated list of values. Returns false on parse errors.
+template <typename T>
+static bool ParseValueList(const string& text, vector<T>* values) {
+  std::istringstream stream(text);
+  string item;
+  while (std::getline(stream, item, ',')) {
+    std::istringstream item_stream(item);
+    T value;
+    if (!(item_stream >> value)) {
+      LOG(ERROR) << "Cannot parse value list: " << text;
+      return false;
+    }
+    values->push_back(value);
+  }
+  return true;
+}
+
+// Prints the surfel statistics of a saved SLAM state together with predictions
+// for all combinations of the given candidate settings. Empty candidate lists
+// are filled with values around the saved settings.
+static bool AnalyzeSurfels(
+    const string& state_path,
+    const SurfelStatisticsOptions& options,
+    vector<int> cell_sizes,
+    vector<float> merge_dist_factors,
+    vector<int> min_observation_counts) {
+  SurfelStateData data;
+  if (!LoadSurfelStateData(state_path, &data)) {
+    LOG(ERROR) << "Cannot load the SLAM state: " << state_path;
+    return false;
+  }
+  
+  SurfelStatistics statistics;
+  ComputeSurfelStatistics(data, options, &statistics);
+  
+  if (cell_sizes.empty()) {
+    const int saved = data.settings.sparse_surfel_cell_size;
+    if (saved > 1) {
+      cell_sizes.push_back(saved / 2);
+    }
+    cell_sizes.push_back(saved);
+    cell_sizes.push_back(2 * saved);
+  }
+  if (merge_dist_factors.empty()) {
+    merge_dist_factors.push_back(data.settings.surfel_merge_dist_factor);
+  }
+  if (min_observation_counts.empty()) {
+    min_observation_counts.push_back(data.settings.min_observation_count);
+    min_observation_counts.push_back(data.settings.min_observation_count + 1);
+  }
+  
+  vector<SurfelSettingsPrediction> predictions;
+  for (int cell_size : cell_sizes) {
+    for (float merge_dist_factor : merge_dist_factors) {
+      for (int min_observation_count : min_observation_counts) {
+        SurfelSettings settings;
+        settings.sparse_surfel_cell_size = cell_size;
+        settings.surfel_merge_dist_factor = merge_dist_factor;
+        settings.min_observation_count = min_observation_count;
+        predictions.push_back(PredictSurfelSettings(data, statistics, settings));
+      }
+    }
+  }
+  
+  PrintSurfelStatistics(data, statistics, predictions, std::cout);
+  return true;
+}
+
+
 int LIBVIS_QT_MAIN(int argc, char** argv) {
   // Initialize libvis
 #ifdef WIN32
@@ -129,12 +199,34 @@ int LIBVIS_QT_MAIN(int argc, char** argv) {
   bad_slam_config.use_motion_model =
       !cmd_parser.Flag("--no_motion_model", "Disables the constant motion model that is used to predict the next frame's pose.");
   
+  bad_slam_config.multi_hypothesis_motion_model =
+      cmd_parser.Flag("--multi_hypothesis_motion_model", bad_slam_config.multi_hypothesis_motion_model_help);
+  
   
   // Bundle adjustment parameters.
   cmd_parser.NamedParameter(
       "--keyframe_interval", &bad_slam_config.keyframe_interval,
       /*required*/ false, bad_slam_config.keyframe_interval_help);
   
+  bad_slam_config.adaptive_keyframes =
+      cmd_parser.Flag("--adaptive_keyframes", bad_slam_config.adaptive_keyframes_help);
+  
+  cmd_parser.NamedParameter(
+      "--keyframe_min_overlap", &bad_slam_config.keyframe_min_overlap,
+      /*required*/ false, bad_slam_config.keyframe_min_overlap_help);
+  
+  cmd_parser.NamedParameter(
+      "--keyframe_max_translation", &bad_slam_config.keyframe_max_translation,
+      /*required*/ false, bad_slam_config.keyframe_max_translation_help);
+  
+  cmd_parser.NamedParameter(
+      "--keyframe_max_rotation", &bad_slam_config.keyframe_max_rotation,
+      /*required*/ false, bad_slam_config.keyframe_max_rotation_help);
+  
+  cmd_parser.NamedParameter(
+      "--keyframe_max_residual_increase", &bad_slam_config.keyframe_max_residual_increase,
+      /*required*/ false, bad_slam_config.keyframe_max_residual_increase_help);
+  
   cmd_parser.NamedParameter(
       "--max_num_ba_iterations_per_keyframe",
       &bad_slam_config.max_num_ba_iterations_per_keyframe, /*required*/ false,
@@ -184,6 +276,19 @@ int LIBVIS_QT_MAIN(int argc, char** argv) {
           " Gauss-Newton update equation, instead of the default alternating"
           " optimization.");
   
+  cmd_parser.NamedParameter(
+      "--ba_local_window_size", &bad_slam_config.ba_local_window_size,
+      /*required*/ false, bad_slam_config.ba_local_window_size_help);
+  
+  cmd_parser.NamedParameter(
+      "--ba_global_iteration_interval",
+      &bad_slam_config.ba_global_iteration_interval, /*required*/ false,
+      bad_slam_config.ba_global_iteration_interval_help);
+  
+  cmd_parser.NamedParameter(
+      "--ba_global_time_interval", &bad_slam_config.ba_global_time_interval,
+      /*required*/ false, bad_slam_config.ba_global_time_interval_help);
+  
   
   // Memory parameters.
   cmd_parser.NamedParameter(
@@ -191,6 +296,30 @@ int LIBVIS_QT_MAIN(int argc, char** argv) {
       /*required*/ false, bad_slam_config.min_free_gpu_memory_mb_help);
   
   
+  bool spill_keyframes_to_host = cmd_parser.Flag(
+      "--spill_keyframes_to_host",
+      "If the GPU memory becomes low, move the image data of inactive keyframes"
+      " to compressed host memory instead of merging keyframes. The data is"
+      " transferred back to the GPU once it is required again. Only has an"
+      " effect if keyframe deactivation is enabled. Applies to the command line"
+      " mode only, not to the GUI.");
+  
+  std::string keyframe_spill_directory;
+  cmd_parser.NamedParameter(
+      "--keyframe_spill_directory", &keyframe_spill_directory, /*required*/ false,
+      "Like --spill_keyframes_to_host, but stores the keyframe image data in"
+      " files within the given directory.");
+  
+  
+  int image_cache_budget_mb = 0;
+  cmd_parser.NamedParameter(
+      "--image_cache_budget_mb", &image_cache_budget_mb, /*required*/ false,
+      "Maximum amount of host memory (in MB) for the cached input images and"
+      " data derived from them. If exceeded, the least recently used images"
+      " are freed (and re-loaded from disk if required again). 0 means"
+      " unlimited. Applies to the command line mode only, not to the GUI.");
+  
+  
   // Surfel reconstruction parameters.
   cmd_parser.NamedParameter(
       "--max_surfel_count", &bad_slam_config.max_surfel_count,
@@ -234,6 +363,21 @@ int LIBVIS_QT_MAIN(int argc, char** argv) {
       "--sequential_loop_detection",
       "Runs loop detection sequentially instead of in parallel.");
   
+  cmd_parser.NamedParameter(
+      "--loop_detection_worker_threads",
+      &bad_slam_config.loop_detection_worker_threads, /*required*/ false,
+      bad_slam_config.loop_detection_worker_threads_help);
+  
+  cmd_parser.NamedParameter(
+      "--loop_detection_max_query_words",
+      &bad_slam_config.loop_detection_max_query_words, /*required*/ false,
+      bad_slam_config.loop_detection_max_query_words_help);
+  
+  cmd_parser.NamedParameter(
+      "--loop_detection_max_keyframes_per_word",
+      &bad_slam_config.loop_detection_max_keyframes_per_word, /*required*/ false,
+      bad_slam_config.loop_detection_max_keyframes_per_word_help);
+  
   cmd_parser.NamedParameter(
       "--loop_detection_image_frequency",
       &bad_slam_config.loop_detection_image_frequency, /*required*/ false,
@@ -316,6 +460,42 @@ int LIBVIS_QT_MAIN(int argc, char** argv) {
       "--export_point_cloud", &export_point_cloud_path, /*required*/ false,
       "Save the final surfel point cloud to the given path (as a PLY file). Applies to the command line mode only, not to the GUI.");
   
+  std::string export_surfel_map_path;
+  cmd_parser.NamedParameter(
+      "--export_surfel_map", &export_surfel_map_path, /*required*/ false,
+      "Save the final surfels to the given path in the compact surfel map"
+      " format (with quantized positions and compressed spatial blocks)."
+      " Applies to the command line mode only, not to the GUI.");
+  
+  SurfelMapEncodingOptions surfel_map_options;
+  cmd_parser.NamedParameter(
+      "--surfel_map_position_tolerance", &surfel_map_options.position_tolerance, /*required*/ false,
+      "Maximum error of the surfel position coordinates (in meters) for"
+      " --export_surfel_map.");
+  
+  std::string export_mvs_point_cloud_path;
+  cmd_parser.NamedParameter(
+      "--export_mvs_point_cloud", &export_mvs_point_cloud_path, /*required*/ false,
+      "Densify the keyframes with multi-view PatchMatch stereo on the CPU and"
+      " save the fused point cloud to the given path (as a PLY file). Applies"
+      " to the command line mode only, not to the GUI.");
+  
+  MultiViewStereoOptions mvs_options;
+  cmd_parser.NamedParameter(
+      "--mvs_max_stereo_views", &mvs_options.max_stereo_view_count, /*required*/ false,
+      "Maximum number of co-visible keyframes which are used as stereo views"
+      " for each keyframe with --export_mvs_point_cloud.");
+  
+  cmd_parser.NamedParameter(
+      "--mvs_min_consistent_views", &mvs_options.min_consistent_view_count, /*required*/ false,
+      "Minimum number of stereo views which must confirm a depth estimate for"
+      " --export_mvs_point_cloud.");
+  
+  mvs_options.only_fill_missing_depth =
+      !cmd_parser.Flag("--mvs_all_pixels", "With --export_mvs_point_cloud,"
+      " also densify the pixels which have valid depth measurements (by"
+      " default, only the pixels without depth are densified).");
+  
   std::string export_reconstruction_path;
   cmd_parser.NamedParameter(
       "--export_reconstruction", &export_reconstruction_path, /*required*/ false,
@@ -356,6 +536,40 @@ int LIBVIS_QT_MAIN(int argc, char** argv) {
       " .deformation.txt). Applies to the command line mode only, not to the GUI.");
   
   
+  // Surfel analysis.
+  std::string analyze_surfels_path;
+  cmd_parser.NamedParameter(
+      "--analyze_surfels", &analyze_surfels_path, /*required*/ false,
+      "Print statistics on the surfels of the given SLAM state file (surfel"
+      " density, radii, and surfels contributed per keyframe), predict the"
+      " surfel count, GPU memory, and BA cost for the --analysis_* candidate"
+      " settings, and exit. Does not require the dataset or a GPU.");
+  
+  std::string analysis_cell_sizes;
+  cmd_parser.NamedParameter(
+      "--analysis_cell_sizes", &analysis_cell_sizes, /*required*/ false,
+      "Comma-separated candidate values of sparse_surfel_cell_size for"
+      " --analyze_surfels. Defaults to half, one, and two times the saved value.");
+  
+  std::string analysis_merge_dist_factors;
+  cmd_parser.NamedParameter(
+      "--analysis_merge_dist_factors", &analysis_merge_dist_factors, /*required*/ false,
+      "Comma-separated candidate values of surfel_merge_dist_factor for"
+      " --analyze_surfels. Defaults to the saved value.");
+  
+  std::string analysis_min_observation_counts;
+  cmd_parser.NamedParameter(
+      "--analysis_min_observation_counts", &analysis_min_observation_counts, /*required*/ false,
+      "Comma-separated candidate values of min_observation_count for"
+      " --analyze_surfels. Defaults to the saved value and the next larger one.");
+  
+  SurfelStatisticsOptions surfel_statistics_options;
+  cmd_parser.NamedParameter(
+      "--analysis_voxel_size", &surfel_statistics_options.voxel_size, /*required*/ false,
+      "Voxel size (in meters) for the surfel density histogram of"
+      " --analyze_surfels.");
+  
+  
   // These sequential parameters must be specified last (in code).
   string dataset_folder_path;
   cmd_parser.SequentialParameter(
@@ -372,6 +586,20 @@ int LIBVIS_QT_MAIN(int argc, char** argv) {
     return EXIT_FAILURE;
   }
   
+  if (!analyze_surfels_path.empty()) {
+    vector<int> cell_sizes;
+    vector<float> merge_dist_factors;
+    vector<int> min_observation_counts;
+    if (!ParseValueList(analysis_cell_sizes, &cell_sizes) ||
+        !ParseValueList(analysis_merge_dist_factors, &merge_dist_factors) ||
+        !ParseValueList(analysis_min_observation_counts, &min_observation_counts)) {
+      return EXIT_FAILURE;
+    }
+    return AnalyzeSurfels(analyze_surfels_path, surfel_statistics_options,
+                          cell_sizes, merge_dist_factors, min_observation_counts) ?
+           EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  
   // Derive some parameters from program arguments.
   float depth_camera_scaling =
       1.0f / powf(2, bad_slam_config.pyramid_level_for_depth);
@@ -503,6 +731,15 @@ int LIBVIS_QT_MAIN(int argc, char** argv) {
     rgbd_video.depth_frames_mutable()->resize(bad_slam_config.end_frame);
   }
   
+  // Account the memory of all input images in a common budget. This must be
+  // set up before the images are accessed from multiple threads.
+  shared_ptr<ImageCacheBudget> image_cache_budget(
+      new ImageCacheBudget(static_cast<usize>(image_cache_budget_mb) * 1024 * 1024));
+  for (usize frame_index = 0; frame_index < rgbd_video.frame_count(); ++ frame_index) {
+    rgbd_video.color_frame_mutable(frame_index)->SetBudget(image_cache_budget);
+    rgbd_video.depth_frame_mutable(frame_index)->SetBudget(image_cache_budget);
+  }
+  
   // Initialize image pre-loading thread.
   PreLoadThread pre_load_thread(&rgbd_video);
   
@@ -537,6 +774,12 @@ int LIBVIS_QT_MAIN(int argc, char** argv) {
     bad_slam->direct_ba().SetSaveTimings(&save_timings_stream);
   }
   
+  if (!keyframe_spill_directory.empty()) {
+    bad_slam->direct_ba().SetKeyframeStorage(make_shared<DiskKeyframeStorage>(keyframe_spill_directory));
+  } else if (spill_keyframes_to_host) {
+    bad_slam->direct_ba().SetKeyframeStorage(make_shared<HostKeyframeStorage>());
+  }
+  
   // Print GPU memory usage after initialization. This can be used to see how
   // much free GPU memory remains for keyframes.
   // TODO: Some buffers are lazily allocated however, currently one should
@@ -561,10 +804,14 @@ int LIBVIS_QT_MAIN(int argc, char** argv) {
     
     // Get the current RGB-D frame's RGB and depth images. This may wait for I/O
     // to complete in case it did not complete in the pre-loading thread yet.
-    const Image<Vec3u8>* rgb_image =
-        rgbd_video.color_frame_mutable(frame_index)->GetImage().get();
-    const Image<u16>* depth_image =
-        rgbd_video.depth_frame_mutable(frame_index)->GetImage().get();
+    // Holding the shared pointers keeps the images from being evicted from the
+    // image cache while they are used.
+    shared_ptr<Image<Vec3u8>> rgb_image_ptr =
+        rgbd_video.color_frame_mutable(frame_index)->GetImage();
+    shared_ptr<Image<u16>> depth_image_ptr =
+        rgbd_video.depth_frame_mutable(frame_index)->GetImage();
+    const Image<Vec3u8>* rgb_image = rgb_image_ptr.get();
+    const Image<u16>* depth_image = depth_image_ptr.get();
     
     // Pre-load the next frame.
     if (frame_index < rgbd_video.frame_count() - 1) {
@@ -711,6 +958,16 @@ int LIBVIS_QT_MAIN(int argc, char** argv) {
       SavePointCloudAsPLY(/*stream*/ 0, bad_slam->direct_ba(), export_point_cloud_path);
     }
     
+    // Save the resulting surfels in compact form?
+    if (!export_surfel_map_path.empty()) {
+      SaveSurfelMapCompressed(/*stream*/ 0, bad_slam->direct_ba(), surfel_map_options, export_surfel_map_path);
+    }
+    
+    // Densify the keyframes with multi-view stereo?
+    if (!export_mvs_point_cloud_path.empty()) {
+      SaveMultiViewStereoPointCloudAsPLY(/*stream*/ 0, bad_slam->direct_ba(), mvs_options, export_mvs_point_cloud_path);
+    }
+    
     // Save the resulting poses?
     if (!export_poses_path.empty()) {
       SavePoses(rgbd_video, bad_slam_config.use_geometric_residuals,
@@ -722,6 +979,9 @@ int LIBVIS_QT_MAIN(int argc, char** argv) {
       SaveCalibration(/*stream*/ 0, bad_slam->direct_ba(), export_calibration_path);
     }
     
+    LOG(INFO) << "Keyframe buffer pool: " << bad_slam->direct_ba().keyframe_buffer_pool()->metrics();
+    LOG(INFO) << "Image cache: " << image_cache_budget->statistics();
+    
     // Save the final timings?
     if (!export_final_timings_path.empty()) {
       std::ofstream timings_file(export_final_timings_path, std::ios::out);
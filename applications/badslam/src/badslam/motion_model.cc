@@ -0,0 +1,130 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "badslam/motion_model.h"
+
+#include <libvis/eigen.h>
+#include <libvis/logging.h>
+
+namespace vis {
+
+bool ZeroMotionHypothesis::Predict(const vector<SE3f>& history, SE3f* base_kf_T_next) const {
+  *base_kf_T_next = history.back();
+  return true;
+}
+
+bool ConstantVelocityHypothesis::Predict(const vector<SE3f>& history, SE3f* base_kf_T_next) const {
+  usize size = history.size();
+  if (skip_last_frame_) {
+    if (size < 3) {
+      return false;
+    }
+    SE3f prev_frame_T_last_frame = history[size - 3].inverse() * history[size - 2];
+    *base_kf_T_next = history[size - 2] * prev_frame_T_last_frame * prev_frame_T_last_frame;
+  } else {
+    if (size < 2) {
+      return false;
+    }
+    *base_kf_T_next = history[size - 1] * history[size - 2].inverse() * history[size - 1];
+  }
+  return true;
+}
+
+bool ConstantAccelerationHypothesis::Predict(const vector<SE3f>& history, SE3f* base_kf_T_next) const {
+  usize size = history.size();
+  if (size < 3) {
+    return false;
+  }
+  SE3f::Tangent first_motion = (history[size - 3].inverse() * history[size - 2]).log();
+  SE3f::Tangent second_motion = (history[size - 2].inverse() * history[size - 1]).log();
+  *base_kf_T_next = history[size - 1] * SE3f::exp(2 * second_motion - first_motion);
+  return true;
+}
+
+bool RotationOnlyHypothesis::Predict(const vector<SE3f>& history, SE3f* base_kf_T_next) const {
+  usize size = history.size();
+  if (size < 2) {
+    return false;
+  }
+  SE3f last_motion = history[size - 2].inverse() * history[size - 1];
+  *base_kf_T_next = history[size - 1] * SE3f(last_motion.so3(), Vec3f::Zero());
+  return true;
+}
+
+
+unique_ptr<MotionPredictor> MotionPredictor::Create(bool use_motion_model, bool multi_hypothesis) {
+  unique_ptr<MotionPredictor> predictor(new MotionPredictor());
+  if (!use_motion_model) {
+    predictor->AddHypothesis(unique_ptr<MotionHypothesis>(new ZeroMotionHypothesis()));
+    return predictor;
+  }
+  
+  predictor->AddHypothesis(unique_ptr<MotionHypothesis>(new ConstantVelocityHypothesis(/*skip_last_frame*/ false)));
+  predictor->AddHypothesis(unique_ptr<MotionHypothesis>(new ConstantVelocityHypothesis(/*skip_last_frame*/ true)));
+  if (multi_hypothesis) {
+    predictor->AddHypothesis(unique_ptr<MotionHypothesis>(new ConstantAccelerationHypothesis()));
+    predictor->AddHypothesis(unique_ptr<MotionHypothesis>(new ZeroMotionHypothesis()));
+    predictor->AddHypothesis(unique_ptr<MotionHypothesis>(new RotationOnlyHypothesis()));
+  }
+  return predictor;
+}
+
+void MotionPredictor::AddHypothesis(unique_ptr<MotionHypothesis>&& hypothesis) {
+  hypotheses_.push_back(std::move(hypothesis));
+}
+
+void MotionPredictor::Predict(const vector<SE3f>& history, vector<SE3f>* predictions) const {
+  CHECK(!history.empty());
+  
+  predictions->clear();
+  for (const unique_ptr<MotionHypothesis>& hypothesis : hypotheses_) {
+    SE3f prediction;
+    if (!hypothesis->Predict(history, &prediction)) {
+      continue;
+    }
+    
+    // Skip duplicates (e.g., zero motion and rotation only if the camera did
+    // not rotate), since evaluating them would be wasted work.
+    bool is_duplicate = false;
+    for (const SE3f& other : *predictions) {
+      if ((other.matrix3x4() - prediction.matrix3x4()).cwiseAbs().maxCoeff() < 1e-6f) {
+        is_duplicate = true;
+        break;
+      }
+    }
+    if (!is_duplicate) {
+      predictions->push_back(prediction);
+    }
+  }
+  
+  if (predictions->empty()) {
+    predictions->push_back(history.back());
+  }
+}
+
+}
@@ -0,0 +1,127 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <memory>
+
+#include <libvis/libvis.h>
+#include <libvis/sophus.h>
+
+namespace vis {
+
+// A motion hypothesis predicts the pose of the next frame from the poses of
+// the last tracked frames. All poses are given relative to the base keyframe
+// (base_kf_T_frame), ordered from the oldest to the newest frame.
+class MotionHypothesis {
+ public:
+  virtual ~MotionHypothesis() = default;
+  
+  // Returns a short name for the hypothesis, for debug output.
+  virtual const char* name() const = 0;
+  
+  // Predicts the pose of the next frame. Returns false if the history is too
+  // short for this hypothesis. history is never empty.
+  virtual bool Predict(const vector<SE3f>& history, SE3f* base_kf_T_next) const = 0;
+};
+
+// Predicts that the camera does not move.
+class ZeroMotionHypothesis : public MotionHypothesis {
+ public:
+  const char* name() const override { return "zero motion"; }
+  bool Predict(const vector<SE3f>& history, SE3f* base_kf_T_next) const override;
+};
+
+// Predicts that the camera continues with the motion between the last two
+// frames. If skip_last_frame is true, the last frame is ignored (the motion
+// between the two frames before it is applied twice to the second-to-last
+// frame), which makes the prediction robust against an outlier last frame.
+class ConstantVelocityHypothesis : public MotionHypothesis {
+ public:
+  explicit ConstantVelocityHypothesis(bool skip_last_frame = false)
+      : skip_last_frame_(skip_last_frame) {}
+  
+  const char* name() const override {
+    return skip_last_frame_ ? "constant velocity (skipping last frame)" : "constant velocity";
+  }
+  bool Predict(const vector<SE3f>& history, SE3f* base_kf_T_next) const override;
+  
+ private:
+  bool skip_last_frame_;
+};
+
+// Predicts that the change in motion between the last three frames continues
+// (extrapolating linearly in the tangent space of SE(3)).
+class ConstantAccelerationHypothesis : public MotionHypothesis {
+ public:
+  const char* name() const override { return "constant acceleration"; }
+  bool Predict(const vector<SE3f>& history, SE3f* base_kf_T_next) const override;
+};
+
+// Predicts that the camera continues the rotation between the last two frames
+// while its position stays fixed. This handles fast rotations which stop
+// translating, for example when the camera is panned.
+class RotationOnlyHypothesis : public MotionHypothesis {
+ public:
+  const char* name() const override { return "rotation only"; }
+  bool Predict(const vector<SE3f>& history, SE3f* base_kf_T_next) const override;
+};
+
+// Combines several motion hypotheses. Their predictions are used as initial
+// estimates for odometry, which chooses the best one on the coarsest pyramid
+// level (see TrackFramePairwise()).
+class MotionPredictor {
+ public:
+  // Creates a predictor without hypotheses.
+  MotionPredictor() = default;
+  
+  // Creates a predictor with the hypotheses that correspond to the given
+  // settings:
+  // - !use_motion_model: zero motion only.
+  // - use_motion_model && !multi_hypothesis: constant velocity, and constant
+  //   velocity while skipping the last frame.
+  // - use_motion_model && multi_hypothesis: additionally constant
+  //   acceleration, zero motion, and rotation only.
+  static unique_ptr<MotionPredictor> Create(bool use_motion_model, bool multi_hypothesis);
+  
+  void AddHypothesis(unique_ptr<MotionHypothesis>&& hypothesis);
+  
+  // Sets *predictions to the predictions of all hypotheses which are
+  // applicable to the given history (which must not be empty), without
+  // duplicates and in the order in which the hypotheses were added. If no
+  // hypothesis is applicable, the last pose in the history is predicted.
+  void Predict(const vector<SE3f>& history, vector<SE3f>* predictions) const;
+  
+  inline usize hypothesis_count() const { return hypotheses_.size(); }
+  inline const MotionHypothesis& hypothesis(usize index) const { return *hypotheses_[index]; }
+  
+ private:
+  vector<unique_ptr<MotionHypothesis>> hypotheses_;
+};
+
+}
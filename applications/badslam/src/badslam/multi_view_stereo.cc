@@ -0,0 +1,382 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "badslam/multi_view_stereo.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#include <libvis/logging.h>
+#include <libvis/patch_match_stereo.h>
+#include <libvis/util.h>
+
+#include "badslam/constants.h"
+
+namespace vis {
+
+namespace {
+
+inline bool IsValidSensorDepth(u16 raw_depth) {
+  return raw_depth != 0 && !(raw_depth & kInvalidDepthBit);
+}
+
+// Returns the integer pixel at which the given point (in camera coordinates)
+// is observed, or false if it is not in the image.
+inline bool ProjectToPixel(const PinholeCamera4f& camera, const Vec3f& point, int* px, int* py) {
+  if (point.z() <= 0) {
+    return false;
+  }
+  const Vec2f pixel = camera.ProjectToPixelCenterConv(point);
+  // NOTE: Written to catch NaNs
+  if (!(pixel.x() >= -0.5f && pixel.y() >= -0.5f &&
+        pixel.x() < camera.width() - 0.5f && pixel.y() < camera.height() - 0.5f)) {
+    return false;
+  }
+  *px = static_cast<int>(pixel.x() + 0.5f);
+  *py = static_cast<int>(pixel.y() + 0.5f);
+  return true;
+}
+
+// Marks the pixels of the color image which are observed by valid sensor
+// depth measurements.
+void ComputeSensorDepthMask(
+    const KeyframeImageData& images,
+    const PinholeCamera4f& depth_camera,
+    const PinholeCamera4f& color_camera,
+    const DepthParametersCPU& calibration,
+    Image<u8>* mask) {
+  mask->SetSize(color_camera.width(), color_camera.height());
+  mask->SetTo(static_cast<u8>(0));
+  
+  // Process the depth image row-wise with the batched camera functions.
+  const u32 width = images.depth.width();
+  vector<float> pixel_x(width);
+  vector<float> pixel_y(width);
+  vector<float> point_x(width);
+  vector<float> point_y(width);
+  vector<float> point_z(width);
+  for (u32 x = 0; x < width; ++ x) {
+    pixel_x[x] = x;
+  }
+  
+  for (u32 y = 0; y < images.depth.height(); ++ y) {
+    const u16* depth_row = images.depth.row(y);
+    std::fill(pixel_y.begin(), pixel_y.end(), static_cast<float>(y));
+    depth_camera.UnprojectPointsFromPixelCenterConv(width, pixel_x.data(), pixel_y.data(), point_x.data(), point_y.data());
+    for (u32 x = 0; x < width; ++ x) {
+      const float depth = IsValidSensorDepth(depth_row[x]) ? calibration.RawToDepth(x, y, depth_row[x]) : 0.f;
+      point_x[x] *= depth;
+      point_y[x] *= depth;
+      point_z[x] = depth;
+    }
+    
+    // Project in-place, the pixel coordinates replace the point's x and y.
+    color_camera.ProjectPointsToPixelCenterConv(width, point_x.data(), point_y.data(), point_z.data(), point_x.data(), point_y.data());
+    for (u32 x = 0; x < width; ++ x) {
+      // NOTE: Written to catch NaNs
+      if (!(point_z[x] > 0 &&
+            point_x[x] >= -0.5f && point_y[x] >= -0.5f &&
+            point_x[x] < color_camera.width() - 0.5f && point_y[x] < color_camera.height() - 0.5f)) {
+        continue;
+      }
+      (*mask)(static_cast<int>(point_x[x] + 0.5f), static_cast<int>(point_y[x] + 0.5f)) = 1;
+    }
+  }
+}
+
+}  // namespace
+
+
+vector<int> SelectMultiViewStereoViews(
+    const vector<MultiViewStereoKeyframe>& keyframes,
+    int keyframe_index,
+    const MultiViewStereoOptions& options) {
+  const MultiViewStereoKeyframe& keyframe = keyframes[keyframe_index];
+  const Vec3f view_direction = keyframe.global_T_frame.rotationMatrix().col(2);
+  const float min_view_cos = cosf(options.max_view_angle);
+  
+  // The co-visibility lists contain keyframe IDs, which may differ from the
+  // indices in keyframes.
+  struct Candidate {
+    bool operator< (const Candidate& other) const {
+      return (view_cos != other.view_cos) ? (view_cos > other.view_cos) : (index < other.index);
+    }
+    
+    float view_cos;
+    int index;
+  };
+  vector<Candidate> candidates;
+  for (int id : keyframe.co_visible_keyframe_ids) {
+    for (usize i = 0; i < keyframes.size(); ++ i) {
+      if (keyframes[i].id != id || static_cast<int>(i) == keyframe_index) {
+        continue;
+      }
+      const float baseline = (keyframes[i].global_T_frame.translation() - keyframe.global_T_frame.translation()).norm();
+      if (baseline < options.min_baseline || baseline > options.max_baseline) {
+        break;
+      }
+      const float view_cos = view_direction.dot(keyframes[i].global_T_frame.rotationMatrix().col(2));
+      if (view_cos < min_view_cos) {
+        break;
+      }
+      candidates.push_back({view_cos, static_cast<int>(i)});
+      break;
+    }
+  }
+  
+  std::sort(candidates.begin(), candidates.end());
+  vector<int> result;
+  for (usize i = 0; i < candidates.size() && static_cast<int>(i) < options.max_stereo_view_count; ++ i) {
+    result.push_back(candidates[i].index);
+  }
+  return result;
+}
+
+void ComputeMultiViewStereoPointCloud(
+    const vector<MultiViewStereoKeyframe>& keyframes,
+    const PinholeCamera4f& depth_camera,
+    const PinholeCamera4f& color_camera,
+    const DepthParametersCPU& calibration,
+    const MultiViewStereoOptions& options,
+    Point3fC3u8Cloud* cloud,
+    MultiViewStereoStatistics* statistics) {
+  const usize keyframe_count = keyframes.size();
+  const int width = color_camera.width();
+  const int height = color_camera.height();
+  const usize thread_count = (options.thread_count > 0) ? options.thread_count : DefaultThreadCount();
+  
+  // Prepare the matching images, sensor depth masks, and stereo views.
+  vector<Image<u8>> gray_images(keyframe_count);
+  vector<Image<u8>> sensor_depth_masks(keyframe_count);
+  vector<vector<int>> stereo_view_indices(keyframe_count);
+  ParallelForBlocks(0, keyframe_count, thread_count, [&](usize /*block_index*/, usize block_begin, usize block_end) {
+    for (usize i = block_begin; i < block_end; ++ i) {
+      const Image<Vec4u8>& color = keyframes[i].images->color;
+      CHECK_EQ(color.width(), width);
+      CHECK_EQ(color.height(), height);
+      gray_images[i].SetSize(width, height);
+      for (int y = 0; y < height; ++ y) {
+        const Vec4u8* color_row = color.row(y);
+        u8* gray_row = gray_images[i].row(y);
+        for (int x = 0; x < width; ++ x) {
+          gray_row[x] = color_row[x].w();
+        }
+      }
+      
+      if (options.only_fill_missing_depth) {
+        ComputeSensorDepthMask(*keyframes[i].images, depth_camera, color_camera,
+                               calibration, &sensor_depth_masks[i]);
+      }
+      
+      stereo_view_indices[i] = SelectMultiViewStereoViews(keyframes, i, options);
+    }
+  });
+  
+  aligned_vector<SE3f> frame_T_global(keyframe_count);
+  for (usize i = 0; i < keyframe_count; ++ i) {
+    frame_T_global[i] = keyframes[i].global_T_frame.inverse();
+  }
+  
+  // Compute the depth maps (with 0 for invalid pixels). The keyframes are
+  // handed out to the threads one by one, since the time per keyframe depends
+  // on its number of stereo views.
+  vector<Image<float>> depth_maps(keyframe_count);
+  std::atomic<usize> next_keyframe_index(0);
+  ParallelForBlocks(0, thread_count, thread_count, [&](usize /*block_index*/, usize /*block_begin*/, usize /*block_end*/) {
+    PatchMatchStereoCPU patch_match(width, height);
+    patch_match.SetThreadCount(1);
+    patch_match.SetContextRadius(options.context_radius);
+    patch_match.SetIterationCount(options.iteration_count);
+    patch_match.SetBestViewCount(options.best_view_count);
+    patch_match.SetMinInitialDepth(options.min_depth);
+    patch_match.SetMaxInitialDepth(options.max_depth);
+    
+    Image<float> inv_depth_map;
+    aligned_vector<PatchMatchStereoCPU::StereoView> stereo_views;
+    while (true) {
+      const usize i = next_keyframe_index.fetch_add(1);
+      if (i >= keyframe_count) {
+        break;
+      }
+      Image<float>* depth_map = &depth_maps[i];
+      depth_map->SetSize(width, height);
+      depth_map->SetTo(0.f);
+      if (stereo_view_indices[i].empty()) {
+        continue;
+      }
+      
+      stereo_views.clear();
+      for (int stereo_index : stereo_view_indices[i]) {
+        stereo_views.emplace_back(&color_camera, &gray_images[stereo_index],
+                                  frame_T_global[stereo_index]);
+      }
+      // Seed with the keyframe ID such that the result does not depend on the
+      // order in which the keyframes are processed.
+      patch_match.SetRandomSeed(keyframes[i].id);
+      patch_match.ComputeDepthMap(color_camera, gray_images[i], frame_T_global[i],
+                                  stereo_views, &inv_depth_map);
+      
+      for (int y = 0; y < height; ++ y) {
+        for (int x = 0; x < width; ++ x) {
+          const float inv_depth = inv_depth_map(x, y);
+          if (inv_depth > 0 && inv_depth >= 1.f / options.max_depth) {
+            (*depth_map)(x, y) = 1.f / inv_depth;
+          }
+        }
+      }
+    }
+  });
+  
+  // Discards the depth estimates which are not confirmed by enough stereo
+  // views. If only missing depth shall be filled, also discards the estimates
+  // which have sensor depth in this keyframe or in one of the consistent
+  // stereo views, since the surfel reconstruction already contains them.
+  vector<Image<float>> filtered_depth_maps(keyframe_count);
+  vector<usize> estimated_pixel_counts(keyframe_count, 0);
+  vector<usize> consistent_pixel_counts(keyframe_count, 0);
+  
+  // Returns the depth of the global point in the given depth map if it is
+  // consistent with the point's depth in this keyframe, or 0 otherwise.
+  auto consistent_depth = [&](const vector<Image<float>>& maps, int index, const Vec3f& global_point, int* px, int* py) {
+    const Vec3f local_point = frame_T_global[index] * global_point;
+    if (!ProjectToPixel(color_camera, local_point, px, py)) {
+      return 0.f;
+    }
+    const float depth = maps[index](*px, *py);
+    if (depth <= 0 || fabs(depth - local_point.z()) > options.relative_depth_threshold * local_point.z()) {
+      return 0.f;
+    }
+    return depth;
+  };
+  
+  ParallelFor(0, keyframe_count, [&](usize i) {
+    const SE3f& global_T_frame = keyframes[i].global_T_frame;
+    filtered_depth_maps[i].SetSize(width, height);
+    filtered_depth_maps[i].SetTo(0.f);
+    for (int y = 0; y < height; ++ y) {
+      for (int x = 0; x < width; ++ x) {
+        const float depth = depth_maps[i](x, y);
+        if (depth <= 0) {
+          continue;
+        }
+        ++ estimated_pixel_counts[i];
+        
+        const Vec3f global_point = global_T_frame * (depth * color_camera.UnprojectFromPixelCenterConv(Vec2i(x, y)));
+        int consistent_view_count = 0;
+        bool has_sensor_depth = options.only_fill_missing_depth && sensor_depth_masks[i](x, y);
+        for (int stereo_index : stereo_view_indices[i]) {
+          int px, py;
+          if (consistent_depth(depth_maps, stereo_index, global_point, &px, &py) > 0) {
+            ++ consistent_view_count;
+            has_sensor_depth |= options.only_fill_missing_depth && sensor_depth_masks[stereo_index](px, py);
+          }
+        }
+        if (consistent_view_count < options.min_consistent_view_count) {
+          continue;
+        }
+        ++ consistent_pixel_counts[i];
+        
+        if (has_sensor_depth) {
+          continue;
+        }
+        filtered_depth_maps[i](x, y) = depth;
+      }
+    }
+  });
+  
+  // Fuse the remaining estimates. A point which is consistently observed by a
+  // stereo view with lower index is left to that keyframe, such that surfaces
+  // seen by several keyframes are not output multiple times.
+  vector<vector<Point3fC3u8>> keyframe_points(keyframe_count);
+  ParallelFor(0, keyframe_count, [&](usize i) {
+    const SE3f& global_T_frame = keyframes[i].global_T_frame;
+    const Image<Vec4u8>& color = keyframes[i].images->color;
+    for (int y = 0; y < height; ++ y) {
+      for (int x = 0; x < width; ++ x) {
+        const float depth = filtered_depth_maps[i](x, y);
+        if (depth <= 0) {
+          continue;
+        }
+        
+        const Vec3f global_point = global_T_frame * (depth * color_camera.UnprojectFromPixelCenterConv(Vec2i(x, y)));
+        Vec3f point_sum = global_point;
+        Vec3f color_sum = color(x, y).topRows<3>().cast<float>();
+        int observation_count = 1;
+        bool observed_by_previous_keyframe = false;
+        for (int stereo_index : stereo_view_indices[i]) {
+          int px, py;
+          const float stereo_depth = consistent_depth(filtered_depth_maps, stereo_index, global_point, &px, &py);
+          if (stereo_depth <= 0) {
+            continue;
+          }
+          if (stereo_index < static_cast<int>(i)) {
+            observed_by_previous_keyframe = true;
+            break;
+          }
+          point_sum += keyframes[stereo_index].global_T_frame * (stereo_depth * color_camera.UnprojectFromPixelCenterConv(Vec2i(px, py)));
+          color_sum += keyframes[stereo_index].images->color(px, py).topRows<3>().cast<float>();
+          ++ observation_count;
+        }
+        if (observed_by_previous_keyframe) {
+          continue;
+        }
+        
+        const float factor = 1.f / observation_count;
+        keyframe_points[i].emplace_back(
+            factor * point_sum,
+            (factor * color_sum + Vec3f::Constant(0.5f)).cast<u8>());
+      }
+    }
+  });
+  
+  usize point_count = 0;
+  for (const vector<Point3fC3u8>& points : keyframe_points) {
+    point_count += points.size();
+  }
+  cloud->Resize(point_count);
+  usize point_index = 0;
+  for (const vector<Point3fC3u8>& points : keyframe_points) {
+    for (const Point3fC3u8& point : points) {
+      cloud->at(point_index) = point;
+      ++ point_index;
+    }
+  }
+  
+  if (statistics) {
+    *statistics = MultiViewStereoStatistics();
+    for (usize i = 0; i < keyframe_count; ++ i) {
+      statistics->processed_keyframe_count += stereo_view_indices[i].empty() ? 0 : 1;
+      statistics->estimated_pixel_count += estimated_pixel_counts[i];
+      statistics->consistent_pixel_count += consistent_pixel_counts[i];
+    }
+    statistics->fused_point_count = point_count;
+  }
+}
+
+}
@@ -0,0 +1,145 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <libvis/camera.h>
+#include <libvis/eigen.h>
+#include <libvis/image.h>
+#include <libvis/libvis.h>
+#include <libvis/point_cloud.h>
+#include <libvis/sophus.h>
+
+#include "badslam/keyframe_merging.h"
+#include "badslam/keyframe_storage.h"
+
+namespace vis {
+
+// A keyframe which takes part in multi-view stereo densification. The images
+// are the host copies of the keyframe buffers (see Keyframe::DownloadImages()),
+// where the gray values for matching are taken from the intensity (w) channel
+// of the color image.
+struct MultiViewStereoKeyframe {
+  int id;
+  SE3f global_T_frame;
+  
+  // IDs of the co-visible keyframes (see Keyframe::co_visibility_list()).
+  vector<int> co_visible_keyframe_ids;
+  
+  const KeyframeImageData* images;
+};
+
+struct MultiViewStereoOptions {
+  // Maximum number of co-visible keyframes which are used as stereo views for
+  // each keyframe.
+  int max_stereo_view_count = 4;
+  
+  // Range of the distances between the keyframe and the stereo view centers.
+  // Too short baselines give imprecise depth, too long ones make matching
+  // fail.
+  float min_baseline = 0.05f;
+  float max_baseline = 1.0f;
+  
+  // Maximum angle (in radians) between the viewing directions of the keyframe
+  // and a stereo view.
+  float max_view_angle = 0.5f * M_PI_2;
+  
+  // PatchMatch settings (see PatchMatchStereoCPU).
+  int context_radius = 3;
+  int iteration_count = 8;
+  int best_view_count = 2;
+  float min_depth = 0.3f;
+  float max_depth = 8.0f;
+  
+  // Minimum number of stereo views whose depth maps must agree with a depth
+  // estimate for it to be kept.
+  int min_consistent_view_count = 1;
+  
+  // Maximum relative depth difference for depth estimates of different
+  // keyframes to be considered consistent.
+  float relative_depth_threshold = 0.02f;
+  
+  // If true, only the surfaces which do not have valid sensor depth in any of
+  // the keyframes that consistently observe them are densified, so the result
+  // complements the surfel reconstruction in regions which were only observed
+  // by the color camera.
+  bool only_fill_missing_depth = true;
+  
+  // Number of keyframes which are processed in parallel. 0 uses
+  // DefaultThreadCount().
+  int thread_count = 0;
+};
+
+struct MultiViewStereoStatistics {
+  // Number of keyframes with at least one stereo view.
+  usize processed_keyframe_count = 0;
+  
+  // Number of pixels with a PatchMatch depth estimate.
+  usize estimated_pixel_count = 0;
+  
+  // Number of estimated pixels which passed the consistency check.
+  usize consistent_pixel_count = 0;
+  
+  // Number of points in the fused point cloud.
+  usize fused_point_count = 0;
+};
+
+// Selects up to options.max_stereo_view_count stereo views for the keyframe
+// with the given index among its co-visible keyframes, preferring the views
+// with the most similar viewing direction. Returns indices into keyframes.
+vector<int> SelectMultiViewStereoViews(
+    const vector<MultiViewStereoKeyframe>& keyframes,
+    int keyframe_index,
+    const MultiViewStereoOptions& options);
+
+// Densifies the keyframes with multi-view PatchMatch stereo on the CPU and
+// fuses the results into a colored point cloud (in global coordinates):
+// 1. The stereo views of all keyframes are selected with
+//    SelectMultiViewStereoViews().
+// 2. A depth map is computed for each keyframe with PatchMatchStereoCPU. The
+//    keyframes are processed in parallel, with one single-threaded
+//    PatchMatchStereoCPU per thread, since this scales better than
+//    parallelizing within a depth map.
+// 3. Depth estimates which are not confirmed by the depth maps of enough
+//    stereo views are discarded.
+// 4. The remaining estimates are fused: each point is averaged with its
+//    consistent observations in the stereo views and is only output by the
+//    first keyframe that observes it.
+// The depth maps are computed in the color camera, which must be a pinhole
+// camera like the depth camera. The depth camera and the calibration are
+// used to determine which pixels have valid sensor depth.
+void ComputeMultiViewStereoPointCloud(
+    const vector<MultiViewStereoKeyframe>& keyframes,
+    const PinholeCamera4f& depth_camera,
+    const PinholeCamera4f& color_camera,
+    const DepthParametersCPU& calibration,
+    const MultiViewStereoOptions& options,
+    Point3fC3u8Cloud* cloud,
+    MultiViewStereoStatistics* statistics = nullptr);
+
+}
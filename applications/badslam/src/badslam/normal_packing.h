@@ -0,0 +1,53 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <libvis/libvis.h>
+
+#include "badslam/constants.h"
+
+// Packing of the surfel normals into a single 32-bit attribute (see
+// kSurfelNormal), shared between the CUDA kernels and the host code.
+
+namespace vis {
+
+// Converts a float (that must be in [-1, 1]) to a 10-bit value. Allows packing
+// three floats into a 32-bit value. Also see TenBitSignedToFloat().
+BADSLAM_HOST_DEVICE u32 SmallFloatToTenBitSigned(float value) {
+  return 0x03ff & static_cast<u16>(static_cast<i16>(value * ((1 << 9) - 1) + ((value > 0) ? 0.5f : -0.5f)));
+}
+
+// Converts a 10-bit value to a float (allows unpacking three floats from a
+// 32-bit value). Also see SmallFloatToTenBitSigned().
+BADSLAM_HOST_DEVICE float TenBitSignedToFloat(u32 value) {
+  u16 temp = ((0x0200 & value) ? 0xfc00 : 0) | (0x03ff & value);
+  return static_cast<i16>(temp) * (1.0f / ((1 << 9) - 1));
+}
+
+}
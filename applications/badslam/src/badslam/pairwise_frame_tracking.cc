@@ -179,10 +179,12 @@ void TrackFramePairwise(
     const cudaTextureObject_t base_color_texture,
     /* input / output poses */
     const SE3f& global_T_base,  // for debugging only!
-    bool test_different_initial_estimates,
-    const SE3f& base_T_frame_initial_estimate_1,
-    const SE3f& base_T_frame_initial_estimate_2,
-    SE3f* out_base_T_frame_estimate) {
+    const vector<SE3f>& base_T_frame_initial_estimates,
+    SE3f* out_base_T_frame_estimate,
+    u32* out_residual_count,
+    float* out_residual_sum) {
+  CHECK(!base_T_frame_initial_estimates.empty());
+  
   static int call_counter = 0;
   ++ call_counter;
   
@@ -242,11 +244,11 @@ repeat_pose_estimation:;
     }
     
     if (render_window) {
-      render_window->SetCurrentFramePose((global_T_base * base_T_frame_initial_estimate_1).matrix());  // TODO: Display this using a different frustum than that used to show the current frame?
+      render_window->SetCurrentFramePose((global_T_base * base_T_frame_initial_estimates.front()).matrix());  // TODO: Display this using a different frustum than that used to show the current frame?
       
       render_window->SetFramePointCloud(
           debug_frame_cloud,
-          global_T_base * base_T_frame_initial_estimate_1);
+          global_T_base * base_T_frame_initial_estimates.front());
       
       render_window->RenderFrame();
     }
@@ -355,15 +357,13 @@ repeat_pose_estimation:;
   Eigen::Matrix<float, 6, 6> H;
   Eigen::Matrix<float, 6, 1> b;
   
-  SE3f base_T_frame_estimate;
-  SE3f base_T_frame_chosen_initial_estimate;
-  if (!test_different_initial_estimates) {
-    base_T_frame_estimate = base_T_frame_initial_estimate_1;
-    base_T_frame_chosen_initial_estimate = base_T_frame_initial_estimate_1;
-  }
+  SE3f base_T_frame_estimate = base_T_frame_initial_estimates.front();
+  SE3f base_T_frame_chosen_initial_estimate = base_T_frame_estimate;
   
   // Iterate over scales
 //   bool converged;
+  u32 last_residual_count = 0;
+  float last_residual_sum = 0;
   for (int scale = num_scales - 1; scale >= (use_pyramid_level_0 ? 0 : 1); -- scale) {
     if (kDebug) {
       LOG(INFO) << "Debug: scale " << scale;
@@ -419,43 +419,29 @@ repeat_pose_estimation:;
     
     float threshold_factor = scaling_factor;
     
-    // If this is not the first scale, test whether the costs are better at the
-    // last scale's result or at the initial estimate, and continue with the
-    // better pose. This hopefully avoids problems with divergence on small
-    // scales. If this is the first scale, do an analogous choice between the
-    // two provided initial estimates (TODO: in that case, the variable naming
-    // is off).
-    if (scale != num_scales - 1 || test_different_initial_estimates) {
-  //     static int times_last_scale_chosen = 0;
-  //     static int times_initial_estimate_chosen = 0;
-      
-      u32 residual_count_last_scale;
-      float cost_last_scale;
-      SE3f base_T_frame_last_scale = (scale != num_scales - 1) ? base_T_frame_estimate : base_T_frame_initial_estimate_1;
-      ComputeCostAndResidualCountFromImagesCUDA(
-          stream,
-          use_depth_residuals,
-          use_descriptor_residuals,
-          *tracked_color_camera,
-          *tracked_depth_camera,
-          depth_params.baseline_fx,
-          threshold_factor,
-          *tracked_depth[scale],
-          *tracked_normals[scale],
-          *tracked_color_textures[scale],
-          CUDAMatrix3x4(base_T_frame_last_scale.inverse().matrix3x4()),
-          *base_depth[scale],
-          *base_normals[scale],
-          *base_color[scale],
-          &residual_count_last_scale,
-          &cost_last_scale,
-          helper_buffers,
-          use_gradmag);
+    // If this is the first scale, choose the best of the initial estimates.
+    // Otherwise, test whether the costs are better at the last scale's result
+    // or at the chosen initial estimate, and continue with the better pose.
+    // This hopefully avoids problems with divergence on small scales.
+    vector<SE3f> candidates;
+    if (scale == num_scales - 1) {
+      if (base_T_frame_initial_estimates.size() > 1) {
+        candidates = base_T_frame_initial_estimates;
+      }
+    } else {
+      candidates.push_back(base_T_frame_estimate);
+      candidates.push_back(base_T_frame_chosen_initial_estimate);
+    }
+    
+    if (!candidates.empty()) {
+      vector<CUDAMatrix3x4> candidates_frame_T_base(candidates.size());
+      for (usize i = 0; i < candidates.size(); ++ i) {
+        candidates_frame_T_base[i] = CUDAMatrix3x4(candidates[i].inverse().matrix3x4());
+      }
       
-      u32 residual_count_initial_estimate;
-      float cost_initial_estimate;
-      SE3f base_T_frame_initial_estimate = (scale != num_scales - 1) ? base_T_frame_chosen_initial_estimate : base_T_frame_initial_estimate_2;
-      ComputeCostAndResidualCountFromImagesCUDA(
+      vector<u32> residual_counts;
+      vector<float> costs;
+      ComputeCostsAndResidualCountsFromImagesCUDA(
           stream,
           use_depth_residuals,
           use_descriptor_residuals,
@@ -466,48 +452,19 @@ repeat_pose_estimation:;
           *tracked_depth[scale],
           *tracked_normals[scale],
           *tracked_color_textures[scale],
-          CUDAMatrix3x4(base_T_frame_initial_estimate.inverse().matrix3x4()),
+          candidates_frame_T_base,
           *base_depth[scale],
           *base_normals[scale],
           *base_color[scale],
-          &residual_count_initial_estimate,
-          &cost_initial_estimate,
+          &residual_counts,
+          &costs,
           helper_buffers,
           use_gradmag);
       
-      // Selection heuristic based on residual count and cost:
-      if (residual_count_last_scale > 2 * residual_count_initial_estimate) {
-  //       if (scale != num_scales - 1) {
-  //         ++ times_last_scale_chosen;
-  //       }
-        base_T_frame_estimate = base_T_frame_last_scale;
-      } else if (residual_count_initial_estimate > 2 * residual_count_last_scale) {
-  //       if (scale != num_scales - 1) {
-  //         ++ times_initial_estimate_chosen;
-  //       }
-        base_T_frame_estimate = base_T_frame_initial_estimate;
-      } else if (cost_last_scale < cost_initial_estimate) {
-  //       if (scale != num_scales - 1) {
-  //         ++ times_last_scale_chosen;
-  //       }
-        base_T_frame_estimate = base_T_frame_last_scale;
-      } else {
-  //       if (scale != num_scales - 1) {
-  //         ++ times_initial_estimate_chosen;
-  //       }
-        base_T_frame_estimate = base_T_frame_initial_estimate;
-      }
-      
+      base_T_frame_estimate = candidates[SelectBestPoseEstimate(residual_counts, costs)];
       if (scale == num_scales - 1) {
         base_T_frame_chosen_initial_estimate = base_T_frame_estimate;
       }
-      
-  //     static int counter = 0;
-  //     ++ counter;
-  //     if (counter % 50 == 0) {
-  //       LOG(INFO) << "DEBUG: times_last_scale_chosen = " << times_last_scale_chosen;
-  //       LOG(INFO) << "DEBUG: times_initial_estimate_chosen = " << times_initial_estimate_chosen;
-  //     }
     }
     
 //     converged = false;
@@ -547,6 +504,8 @@ repeat_pose_estimation:;
           debug_residual_image.get(),
           helper_buffers,
           use_gradmag);
+      last_residual_count = residual_count;
+      last_residual_sum = residual_sum;
       
       int index = 0;
       for (int row = 0; row < 6; ++ row) {
@@ -673,6 +632,74 @@ repeat_pose_estimation:;
   }
   
   *out_base_T_frame_estimate = base_T_frame_estimate;
+  if (out_residual_count) {
+    *out_residual_count = last_residual_count;
+  }
+  if (out_residual_sum) {
+    *out_residual_sum = last_residual_sum;
+  }
+}
+
+void TrackFramePairwise(
+    PairwiseFrameTrackingBuffers* buffers,
+    cudaStream_t stream,
+    const PinholeCamera4f& color_camera,
+    const PinholeCamera4f& depth_camera,
+    const DepthParameters& depth_params,
+    const CUDABuffer<float>& cfactor_buffer,
+    PoseEstimationHelperBuffers* helper_buffers,
+    const shared_ptr<BadSlamRenderWindow>& render_window,
+    std::ofstream* convergence_samples_file,
+    bool use_depth_residuals,
+    bool use_descriptor_residuals,
+    bool use_pyramid_level_0,
+    bool use_gradmag,
+    const CUDABuffer<u16>& tracked_depth_buffer,
+    const CUDABuffer<u16>& tracked_normals_buffer,
+    const cudaTextureObject_t tracked_color_texture,
+    const CUDABuffer<float>& base_depth_buffer,
+    const CUDABuffer<u16>& base_normals_buffer,
+    const CUDABuffer<uchar>& base_color_buffer,
+    const cudaTextureObject_t base_color_texture,
+    const SE3f& global_T_base,
+    bool test_different_initial_estimates,
+    const SE3f& base_T_frame_initial_estimate_1,
+    const SE3f& base_T_frame_initial_estimate_2,
+    SE3f* out_base_T_frame_estimate,
+    u32* out_residual_count,
+    float* out_residual_sum) {
+  vector<SE3f> base_T_frame_initial_estimates;
+  base_T_frame_initial_estimates.push_back(base_T_frame_initial_estimate_1);
+  if (test_different_initial_estimates) {
+    base_T_frame_initial_estimates.push_back(base_T_frame_initial_estimate_2);
+  }
+  
+  TrackFramePairwise(
+      buffers,
+      stream,
+      color_camera,
+      depth_camera,
+      depth_params,
+      cfactor_buffer,
+      helper_buffers,
+      render_window,
+      convergence_samples_file,
+      use_depth_residuals,
+      use_descriptor_residuals,
+      use_pyramid_level_0,
+      use_gradmag,
+      tracked_depth_buffer,
+      tracked_normals_buffer,
+      tracked_color_texture,
+      base_depth_buffer,
+      base_normals_buffer,
+      base_color_buffer,
+      base_color_texture,
+      global_T_base,
+      base_T_frame_initial_estimates,
+      out_base_T_frame_estimate,
+      out_residual_count,
+      out_residual_sum);
 }
 
 }
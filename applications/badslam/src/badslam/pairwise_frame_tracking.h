@@ -75,8 +75,47 @@ void CreatePairwiseTrackingInputBuffersAndTextures(
     cudaTextureObject_t* tracked_gradmag_texture);
 
 // Tracks the pose of an RGB-D frame relative to another RGB-D frame.
+// If several initial estimates are given (for example, the predictions of
+// different motion hypotheses, see MotionPredictor), they are all evaluated on
+// the coarsest pyramid level, and only the best one is refined further.
+// If out_residual_count and / or out_residual_sum are given, they are set to
+// the number of valid residuals and the sum of their costs in the last
+// iteration on the finest scale. The residual count can serve as a measure of
+// the overlap between the two frames.
 // TODO: If possible, simplify the function signature?
 //       Maybe create a "PairwiseFrameTracker" class which contains the helper buffers?
+void TrackFramePairwise(
+    PairwiseFrameTrackingBuffers* buffers,
+    cudaStream_t stream,
+    const PinholeCamera4f& color_camera,
+    const PinholeCamera4f& depth_camera,
+    const DepthParameters& depth_params,
+    const CUDABuffer<float>& cfactor_buffer,
+    PoseEstimationHelperBuffers* helper_buffers,
+    const shared_ptr<BadSlamRenderWindow>& render_window,
+    std::ofstream* convergence_samples_file,
+    bool use_depth_residuals,
+    bool use_descriptor_residuals,
+    bool use_pyramid_level_0,
+    bool use_gradmag,
+    /* tracked frame */
+    const CUDABuffer<u16>& tracked_depth_buffer,
+    const CUDABuffer<u16>& tracked_normals_buffer,
+    const cudaTextureObject_t tracked_color_texture,
+    /* base frame */
+    const CUDABuffer<float>& base_depth_buffer,
+    const CUDABuffer<u16>& base_normals_buffer,
+    const CUDABuffer<uchar>& base_color_buffer,
+    const cudaTextureObject_t base_color_texture,
+    /* input / output poses */
+    const SE3f& global_T_base,  // for debugging only!
+    const vector<SE3f>& base_T_frame_initial_estimates,
+    SE3f* out_base_T_frame_estimate,
+    u32* out_residual_count = nullptr,
+    float* out_residual_sum = nullptr);
+
+// Version of TrackFramePairwise() with one or two initial estimates. If
+// test_different_initial_estimates is false, only the first one is used.
 void TrackFramePairwise(
     PairwiseFrameTrackingBuffers* buffers,
     cudaStream_t stream,
@@ -105,6 +144,8 @@ void TrackFramePairwise(
     bool test_different_initial_estimates,
     const SE3f& base_T_frame_initial_estimate_1,
     const SE3f& base_T_frame_initial_estimate_2,
-    SE3f* out_base_T_frame_estimate);
+    SE3f* out_base_T_frame_estimate,
+    u32* out_residual_count = nullptr,
+    float* out_residual_sum = nullptr);
 
 }
@@ -0,0 +1,953 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "badslam/pairwise_frame_tracking_cpu.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <libvis/logging.h>
+#include <libvis/util.h>
+
+#include "badslam/constants.h"
+#include "badslam/convergence_analysis.h"
+#include "badslam/surfel_projection_cpu.h"
+
+namespace vis {
+
+namespace {
+
+// Emulates tex2D<float>() on a u8 texture with linear filtering, clamped
+// addressing, normalized read mode, and unnormalized (pixel corner)
+// coordinates. In contrast to the texture hardware, the interpolation weights
+// are not quantized.
+inline float SampleLinearNormalizedCPU(const Image<u8>& image, float x, float y) {
+  const float fx = x - 0.5f;
+  const float fy = y - 0.5f;
+  const float floor_x = floorf(fx);
+  const float floor_y = floorf(fy);
+  const float tx = fx - floor_x;
+  const float ty = fy - floor_y;
+  
+  const int max_x = static_cast<int>(image.width()) - 1;
+  const int max_y = static_cast<int>(image.height()) - 1;
+  const int ix = static_cast<int>(std::max(-1.f, std::min<float>(max_x, floor_x)));
+  const int iy = static_cast<int>(std::max(-1.f, std::min<float>(max_y, floor_y)));
+  const int x0 = std::max(0, ix);
+  const int y0 = std::max(0, iy);
+  const int x1 = std::min(max_x, ix + 1);
+  const int y1 = std::min(max_y, iy + 1);
+  
+  const u8* row0 = image.row(y0);
+  const u8* row1 = image.row(y1);
+  return (1 / 255.f) *
+         ((1 - ty) * ((1 - tx) * row0[x0] + tx * row0[x1]) +
+               ty  * ((1 - tx) * row1[x0] + tx * row1[x1]));
+}
+
+// Host version of the finite-difference image gradient which is used in
+// ColorJacobianWrtProjectedPosition() and
+// DescriptorJacobianWrtProjectedPositionWithFloatTexture() (see
+// cost_function.cuh). The result is in normalized intensity units.
+inline void SampleGradientCPU(const Image<u8>& image, const Vec2f& pxy, float* dx, float* dy) {
+  const int ix = static_cast<int>(std::max(0.f, pxy.x() - 0.5f));
+  const int iy = static_cast<int>(std::max(0.f, pxy.y() - 0.5f));
+  const float tx = std::max(0.f, std::min(1.f, pxy.x() - 0.5f - ix));
+  const float ty = std::max(0.f, std::min(1.f, pxy.y() - 0.5f - iy));
+  
+  const int max_x = static_cast<int>(image.width()) - 1;
+  const int max_y = static_cast<int>(image.height()) - 1;
+  const int x0 = std::min(max_x, ix);
+  const int y0 = std::min(max_y, iy);
+  const int x1 = std::min(max_x, ix + 1);
+  const int y1 = std::min(max_y, iy + 1);
+  
+  const float top_left = (1 / 255.f) * image(x0, y0);
+  const float top_right = (1 / 255.f) * image(x1, y0);
+  const float bottom_left = (1 / 255.f) * image(x0, y1);
+  const float bottom_right = (1 / 255.f) * image(x1, y1);
+  
+  *dx = (bottom_right - bottom_left) * ty + (top_right - top_left) * (1 - ty);
+  *dy = (bottom_right - top_right) * tx + (bottom_left - top_left) * (1 - tx);
+}
+
+// Jacobian of a photometric residual with regard to the pose update, given
+// the image gradient at the projected position of the point ls (already
+// multiplied by the focal lengths). See ComputeRawColorResidualAndJacobian()
+// in kernel_opt_pose.cu.
+inline void PhotometricJacobianCPU(const Vec3f& ls, float grad_x_fx, float grad_y_fy, float* jacobian) {
+  const float inv_ls_z = 1.f / ls.z();
+  const float ls_z_sq = ls.z() * ls.z();
+  const float inv_ls_z_sq = inv_ls_z * inv_ls_z;
+  const float ls_x_y = ls.x() * ls.y();
+  
+  jacobian[0] = -grad_x_fx * inv_ls_z;
+  jacobian[1] = -grad_y_fy * inv_ls_z;
+  jacobian[2] = (ls.x() * grad_x_fx + ls.y() * grad_y_fy) * inv_ls_z_sq;
+  jacobian[3] =  ((ls.y() * ls.y() + ls_z_sq) * grad_y_fy + ls_x_y * grad_x_fx) * inv_ls_z_sq;
+  jacobian[4] = -((ls.x() * ls.x() + ls_z_sq) * grad_x_fx + ls_x_y * grad_y_fy) * inv_ls_z_sq;
+  jacobian[5] = -(ls.x() * grad_y_fy - ls.y() * grad_x_fx) * inv_ls_z;
+}
+
+// Images and camera parameters for tracking on one pyramid scale. The
+// parameters correspond to the PixelCornerProjector, PixelCenterUnprojector
+// and DepthToColorPixelCorner objects used by the CUDA kernels.
+struct TrackingScaleCPU {
+  TrackingScaleCPU(
+      const PinholeCamera4f& color_camera,
+      const PinholeCamera4f& depth_camera,
+      float baseline_fx,
+      float threshold_factor,
+      bool use_depth_residuals,
+      bool use_descriptor_residuals,
+      bool use_gradmag,
+      const Image<float>* tracked_depth,
+      const Image<u16>* tracked_normals,
+      const Image<u8>* tracked_color,
+      const Image<float>* base_depth,
+      const Image<u16>* base_normals,
+      const Image<u8>* base_color)
+      : baseline_fx(baseline_fx),
+        threshold_factor(threshold_factor),
+        use_depth_residuals(use_depth_residuals),
+        use_descriptor_residuals(use_descriptor_residuals),
+        use_gradmag(use_gradmag),
+        tracked_depth(tracked_depth),
+        tracked_normals(tracked_normals),
+        tracked_color(tracked_color),
+        base_depth(base_depth),
+        base_normals(base_normals),
+        base_color(base_color) {
+    const float* depth_parameters = depth_camera.parameters();
+    const float* color_parameters = color_camera.parameters();
+    
+    depth_fx = depth_parameters[0];
+    depth_fy = depth_parameters[1];
+    depth_cx = depth_parameters[2];
+    depth_cy = depth_parameters[3];
+    
+    fx_inv = 1.0f / depth_fx;
+    fy_inv = 1.0f / depth_fy;
+    cx_pixel_center_unproj = -(depth_cx - 0.5f) * fx_inv;
+    cy_pixel_center_unproj = -(depth_cy - 0.5f) * fy_inv;
+    
+    color_fx = color_parameters[0];
+    color_fy = color_parameters[1];
+    
+    depth_to_color_fx = color_parameters[0] / depth_parameters[0];
+    depth_to_color_cx = -1 * color_parameters[0] * depth_parameters[2] / depth_parameters[0] + color_parameters[2];
+    depth_to_color_fy = color_parameters[1] / depth_parameters[1];
+    depth_to_color_cy = -1 * color_parameters[1] * depth_parameters[3] / depth_parameters[1] + color_parameters[3];
+    color_width = color_camera.width();
+    color_height = color_camera.height();
+  }
+  
+  inline float nx(int x) const { return fx_inv * x + cx_pixel_center_unproj; }
+  inline float ny(int y) const { return fy_inv * y + cy_pixel_center_unproj; }
+  
+  // Corresponds to ProjectSurfelToImage() (see util.cuh) for a point with
+  // positive z. The bounds are tested before converting to int, since the
+  // conversion of out-of-range values is undefined on the CPU.
+  inline bool ProjectToTrackedImage(const Vec3f& local_position, Vec2f* pxy, int* px, int* py) const {
+    *pxy = Vec2f(depth_fx * (local_position.x() / local_position.z()) + depth_cx,
+                 depth_fy * (local_position.y() / local_position.z()) + depth_cy);
+    if (!(pxy->x() >= 0 && pxy->y() >= 0 &&
+          pxy->x() < tracked_depth->width() && pxy->y() < tracked_depth->height())) {
+      return false;
+    }
+    *px = static_cast<int>(pxy->x());
+    *py = static_cast<int>(pxy->y());
+    return true;
+  }
+  
+  // Corresponds to TransformDepthToColorPixelCorner() (see
+  // surfel_projection.cuh).
+  inline bool TransformDepthToColor(const Vec2f& pxy, Vec2f* color_pxy) const {
+    *color_pxy = Vec2f(depth_to_color_fx * pxy.x() + depth_to_color_cx,
+                       depth_to_color_fy * pxy.y() + depth_to_color_cy);
+    return color_pxy->x() >= 0 &&
+           color_pxy->y() >= 0 &&
+           color_pxy->x() < color_width &&
+           color_pxy->y() < color_height;
+  }
+  
+  float depth_fx, depth_fy, depth_cx, depth_cy;
+  float fx_inv, fy_inv, cx_pixel_center_unproj, cy_pixel_center_unproj;
+  float color_fx, color_fy;
+  float depth_to_color_fx, depth_to_color_fy, depth_to_color_cx, depth_to_color_cy;
+  int color_width, color_height;
+  
+  float baseline_fx;
+  float threshold_factor;
+  bool use_depth_residuals;
+  bool use_descriptor_residuals;
+  bool use_gradmag;
+  
+  const Image<float>* tracked_depth;
+  const Image<u16>* tracked_normals;
+  const Image<u8>* tracked_color;
+  const Image<float>* base_depth;
+  const Image<u16>* base_normals;
+  const Image<u8>* base_color;
+};
+
+// Residuals and Jacobians of one base image pixel.
+struct PixelResidualsCPU {
+  float depth_residual;
+  float depth_jacobian[6];
+  
+  // 1 for gradient magnitude residuals, 2 for gradient x / y residuals.
+  int descriptor_residual_count;
+  float descriptor_residuals[2];
+  float descriptor_jacobians[2][6];
+};
+
+// Computes the residuals of the base image pixel (x, y), treating it like a
+// surfel. Returns false if the pixel does not contribute any residuals. This
+// mirrors the per-thread part of the *FromImagesCUDAKernel_GradMag() and
+// *FromImagesCUDAKernel_GradientXY() kernels in kernel_opt_pose.cu.
+bool ComputePixelResidualsCPU(
+    const TrackingScaleCPU& s,
+    int x,
+    int y,
+    const Mat3f& frame_R_base,
+    const Vec3f& frame_t_base,
+    bool compute_jacobians,
+    PixelResidualsCPU* out) {
+  const float surfel_calibrated_depth = (*s.base_depth)(x, y);
+  if (!(surfel_calibrated_depth > 0)) {
+    return false;
+  }
+  
+  const Vec3f surfel_local_position =
+      frame_R_base * (surfel_calibrated_depth * Vec3f(s.nx(x), s.ny(y), 1)) + frame_t_base;
+  if (!(surfel_local_position.z() > 0)) {
+    return false;
+  }
+  
+  Vec2f pxy;
+  int px, py;
+  if (!s.ProjectToTrackedImage(surfel_local_position, &pxy, &px, &py)) {
+    return false;
+  }
+  
+  const float pixel_calibrated_depth = (*s.tracked_depth)(px, py);
+  if (!(pixel_calibrated_depth > 0)) {
+    return false;
+  }
+  
+  // Association test, see IsAssociatedWithPixel() in
+  // surfel_projection_nvcc_only.cuh.
+  const Vec3f surfel_local_normal = frame_R_base * U16ToImageSpaceNormalCPU((*s.base_normals)(x, y));
+  const float pixel_nx = s.nx(px);
+  const float pixel_ny = s.ny(py);
+  const float abs_normal_dot_ray = fabs(surfel_local_normal.x() * pixel_nx + surfel_local_normal.y() * pixel_ny + surfel_local_normal.z());
+  const float depth_residual_stddev_estimate =
+      (kDepthUncertaintyEmpiricalFactor * abs_normal_dot_ray * (pixel_calibrated_depth * pixel_calibrated_depth)) / s.baseline_fx;
+  if (fabs(surfel_local_position.z() - pixel_calibrated_depth) >
+      s.threshold_factor * kDepthResidualDefaultTukeyParam * depth_residual_stddev_estimate) {
+    return false;
+  }
+  if ((1.0f / surfel_local_position.norm()) * surfel_local_position.dot(surfel_local_normal) > 0) {
+    return false;
+  }
+  if (surfel_local_normal.dot(U16ToImageSpaceNormalCPU((*s.tracked_normals)(px, py))) < cos_normal_compatibility_threshold) {
+    return false;
+  }
+  
+  if (s.use_depth_residuals) {
+    const float depth_residual_inv_stddev =
+        s.baseline_fx / (kDepthUncertaintyEmpiricalFactor * abs_normal_dot_ray * (pixel_calibrated_depth * pixel_calibrated_depth));
+    const Vec3f local_unproj = pixel_calibrated_depth * Vec3f(pixel_nx, pixel_ny, 1);
+    out->depth_residual = depth_residual_inv_stddev * surfel_local_normal.dot(local_unproj - surfel_local_position);
+    
+    if (compute_jacobians) {
+      const Vec3f& n = surfel_local_normal;
+      out->depth_jacobian[0] = depth_residual_inv_stddev * n.x();
+      out->depth_jacobian[1] = depth_residual_inv_stddev * n.y();
+      out->depth_jacobian[2] = depth_residual_inv_stddev * n.z();
+      out->depth_jacobian[3] = depth_residual_inv_stddev * (-n.y() * local_unproj.z() + n.z() * local_unproj.y());
+      out->depth_jacobian[4] = depth_residual_inv_stddev * ( n.x() * local_unproj.z() - n.z() * local_unproj.x());
+      out->depth_jacobian[5] = depth_residual_inv_stddev * (-n.x() * local_unproj.y() + n.y() * local_unproj.x());
+    }
+  }
+  
+  if (!s.use_descriptor_residuals) {
+    out->descriptor_residual_count = 0;
+    return true;
+  }
+  
+  if (s.use_gradmag) {
+    out->descriptor_residual_count = 1;
+    
+    Vec2f color_pxy;
+    if (!s.TransformDepthToColor(pxy, &color_pxy)) {
+      return false;
+    }
+    out->descriptor_residuals[0] =
+        255.f * SampleLinearNormalizedCPU(*s.tracked_color, color_pxy.x(), color_pxy.y()) - (*s.base_color)(x, y);
+    
+    if (compute_jacobians) {
+      float grad_x, grad_y;
+      SampleGradientCPU(*s.tracked_color, color_pxy, &grad_x, &grad_y);
+      PhotometricJacobianCPU(
+          surfel_local_position,
+          255.f * grad_x * s.color_fx,
+          255.f * grad_y * s.color_fy,
+          out->descriptor_jacobians[0]);
+    }
+    return true;
+  }
+  
+  out->descriptor_residual_count = 2;
+  
+  // The descriptors are computed in the base image by always going right /
+  // down, so the last column and row do not have descriptors.
+  if (x >= static_cast<int>(s.base_depth->width()) - 1 ||
+      y >= static_cast<int>(s.base_depth->height()) - 1) {
+    return false;
+  }
+  
+  const Image<u8>& base_color = *s.base_color;
+  const float intensity = 1 / 255.f * base_color(x, y);
+  const float t1_intensity = 1 / 255.f * base_color(x + 1, y);
+  const float t2_intensity = 1 / 255.f * base_color(x, y + 1);
+  const float surfel_descriptor_1 = (180.f * (t1_intensity - intensity));
+  const float surfel_descriptor_2 = (180.f * (t2_intensity - intensity));
+  
+  // Transform the two offset points to the tracked frame, estimating their
+  // depth using the center pixel's normal.
+  const Vec3f surfel_normal = U16ToImageSpaceNormalCPU((*s.base_normals)(x, y));
+  const float plane_d =
+      (s.nx(x) * surfel_calibrated_depth) * surfel_normal.x() +
+      (s.ny(y) * surfel_calibrated_depth) * surfel_normal.y() + surfel_calibrated_depth * surfel_normal.z();
+  
+  const float x_plus_1_depth = plane_d / (s.nx(x + 1) * surfel_normal.x() + s.ny(y) * surfel_normal.y() + surfel_normal.z());
+  const Vec3f x_plus_1_local_position =
+      frame_R_base * (x_plus_1_depth * Vec3f(s.nx(x + 1), s.ny(y), 1)) + frame_t_base;
+  
+  const float y_plus_1_depth = plane_d / (s.nx(x) * surfel_normal.x() + s.ny(y + 1) * surfel_normal.y() + surfel_normal.z());
+  const Vec3f y_plus_1_local_position =
+      frame_R_base * (y_plus_1_depth * Vec3f(s.nx(x), s.ny(y + 1), 1)) + frame_t_base;
+  
+  Vec2f pxy_t1, pxy_t2;
+  int t_px, t_py;
+  Vec2f color_pxy, color_pxy_t1, color_pxy_t2;
+  if (!(x_plus_1_local_position.z() > 0) ||
+      !(y_plus_1_local_position.z() > 0) ||
+      !s.ProjectToTrackedImage(x_plus_1_local_position, &pxy_t1, &t_px, &t_py) ||
+      !s.ProjectToTrackedImage(y_plus_1_local_position, &pxy_t2, &t_px, &t_py) ||
+      !s.TransformDepthToColor(pxy, &color_pxy) ||
+      !s.TransformDepthToColor(pxy_t1, &color_pxy_t1) ||
+      !s.TransformDepthToColor(pxy_t2, &color_pxy_t2)) {
+    return false;
+  }
+  
+  const Image<u8>& tracked_color = *s.tracked_color;
+  const float frame_intensity = SampleLinearNormalizedCPU(tracked_color, color_pxy.x(), color_pxy.y());
+  const float frame_t1_intensity = SampleLinearNormalizedCPU(tracked_color, color_pxy_t1.x(), color_pxy_t1.y());
+  const float frame_t2_intensity = SampleLinearNormalizedCPU(tracked_color, color_pxy_t2.x(), color_pxy_t2.y());
+  out->descriptor_residuals[0] = (180.f * (frame_t1_intensity - frame_intensity)) - surfel_descriptor_1;
+  out->descriptor_residuals[1] = (180.f * (frame_t2_intensity - frame_intensity)) - surfel_descriptor_2;
+  
+  if (compute_jacobians) {
+    float center_dx, center_dy, t1_dx, t1_dy, t2_dx, t2_dy;
+    SampleGradientCPU(tracked_color, color_pxy, &center_dx, &center_dy);
+    SampleGradientCPU(tracked_color, color_pxy_t1, &t1_dx, &t1_dy);
+    SampleGradientCPU(tracked_color, color_pxy_t2, &t2_dx, &t2_dy);
+    
+    PhotometricJacobianCPU(
+        surfel_local_position,
+        180.f * (t1_dx - center_dx) * s.color_fx,
+        180.f * (t1_dy - center_dy) * s.color_fy,
+        out->descriptor_jacobians[0]);
+    PhotometricJacobianCPU(
+        surfel_local_position,
+        180.f * (t2_dx - center_dx) * s.color_fx,
+        180.f * (t2_dy - center_dy) * s.color_fy,
+        out->descriptor_jacobians[1]);
+  }
+  return true;
+}
+
+// Partial sums of the Gauss-Newton normal equations H * x = b (with only the
+// upper triangle of H stored, in row-major order) and of the cost.
+struct PoseEstimationSumsCPU {
+  void SetZero() {
+    for (int i = 0; i < 6 * (6 + 1) / 2; ++ i) {
+      H[i] = 0;
+    }
+    for (int i = 0; i < 6; ++ i) {
+      b[i] = 0;
+    }
+    cost = 0;
+    residual_count = 0;
+  }
+  
+  inline void AddNormalEquations(float raw_residual, float residual_weight, const float* jacobian) {
+    int index = 0;
+    for (int row = 0; row < 6; ++ row) {
+      for (int col = row; col < 6; ++ col) {
+        H[index] += residual_weight * jacobian[row] * jacobian[col];
+        ++ index;
+      }
+    }
+    const float weighted_raw_residual = residual_weight * raw_residual;
+    for (int i = 0; i < 6; ++ i) {
+      b[i] += weighted_raw_residual * jacobian[i];
+    }
+  }
+  
+  void Add(const PoseEstimationSumsCPU& other) {
+    for (int i = 0; i < 6 * (6 + 1) / 2; ++ i) {
+      H[i] += other.H[i];
+    }
+    for (int i = 0; i < 6; ++ i) {
+      b[i] += other.b[i];
+    }
+    cost += other.cost;
+    residual_count += other.residual_count;
+  }
+  
+  double H[6 * (6 + 1) / 2];
+  double b[6];
+  double cost;
+  u32 residual_count;
+};
+
+// CPU version of AccumulatePoseEstimationCoeffsFromImagesCUDA() (if
+// accumulate_normal_equations is true) and of
+// ComputeCostAndResidualCountFromImagesCUDA(). The cost and residual count are
+// always computed. As in the CUDA version, each gradient x / y descriptor
+// residual is counted separately.
+void AccumulatePoseEstimationSumsCPU(
+    const TrackingScaleCPU& scale,
+    const SE3f& frame_T_base,
+    bool accumulate_normal_equations,
+    usize thread_count,
+    PoseEstimationSumsCPU* sums) {
+  const Mat3f frame_R_base = frame_T_base.rotationMatrix();
+  const Vec3f frame_t_base = frame_T_base.translation();
+  const int width = scale.base_depth->width();
+  const int height = scale.base_depth->height();
+  
+  // Each thread accumulates into its own partial sums, which are added up in
+  // a fixed order afterwards.
+  vector<PoseEstimationSumsCPU> partial_sums(std::max<usize>(1, std::min<usize>(thread_count, height)));
+  ParallelForBlocks(0, height, partial_sums.size(), [&](usize block_index, usize block_begin, usize block_end) {
+    PoseEstimationSumsCPU& block_sums = partial_sums[block_index];
+    block_sums.SetZero();
+    
+    PixelResidualsCPU residuals;
+    for (int y = block_begin; y < static_cast<int>(block_end); ++ y) {
+      for (int x = 0; x < width; ++ x) {
+        if (!ComputePixelResidualsCPU(scale, x, y, frame_R_base, frame_t_base, accumulate_normal_equations, &residuals)) {
+          continue;
+        }
+        
+        if (scale.use_depth_residuals) {
+          if (accumulate_normal_equations) {
+            block_sums.AddNormalEquations(
+                residuals.depth_residual,
+                kDepthResidualWeight * TukeyWeight(residuals.depth_residual, scale.threshold_factor * kDepthResidualDefaultTukeyParam),
+                residuals.depth_jacobian);
+          }
+          block_sums.cost += kDepthResidualWeight * TukeyResidual(residuals.depth_residual, scale.threshold_factor * kDepthResidualDefaultTukeyParam);
+          block_sums.residual_count += 1;
+        }
+        
+        for (int i = 0; i < residuals.descriptor_residual_count; ++ i) {
+          const float raw_residual = residuals.descriptor_residuals[i];
+          if (accumulate_normal_equations) {
+            block_sums.AddNormalEquations(
+                raw_residual,
+                scale.threshold_factor * kDescriptorResidualWeight * HuberWeight(raw_residual, kDescriptorResidualHuberParameter),
+                residuals.descriptor_jacobians[i]);
+          }
+          block_sums.cost += scale.threshold_factor * kDescriptorResidualWeight * HuberResidual(raw_residual, kDescriptorResidualHuberParameter);
+          block_sums.residual_count += 1;
+        }
+      }
+    }
+  });
+  
+  sums->SetZero();
+  for (const PoseEstimationSumsCPU& block_sums : partial_sums) {
+    sums->Add(block_sums);
+  }
+}
+
+// CPU version of CalibrateDepthCUDA().
+void CalibrateDepthCPU(
+    const DepthParametersCPU& depth_params,
+    const Image<u16>& depth,
+    usize thread_count,
+    Image<float>* out_depth) {
+  ParallelForBlocks(0, out_depth->height(), thread_count, [&](usize /*block_index*/, usize block_begin, usize block_end) {
+    for (u32 y = block_begin; y < block_end; ++ y) {
+      for (u32 x = 0; x < out_depth->width(); ++ x) {
+        const u16 raw_depth = depth(x, y);
+        (*out_depth)(x, y) = (raw_depth & kInvalidDepthBit) ? 0 : depth_params.RawToDepth(x, y, raw_depth);
+      }
+    }
+  });
+}
+
+// Selects the depth of the 2x2 input pixels whose depth is closest to their
+// average (ignoring invalid depths) and returns its index, or -1 if all
+// depths are invalid. See DownsampleImagesCUDAKernel().
+inline int SelectDownsampledDepth(const float depths[4]) {
+  float depth_sum = 0;
+  int depth_count = 0;
+  for (int i = 0; i < 4; ++ i) {
+    if (depths[i] != numeric_limits<float>::infinity()) {
+      depth_sum += depths[i];
+      depth_count += 1;
+    }
+  }
+  if (depth_count == 0) {
+    return -1;
+  }
+  
+  const float average_depth = depth_sum / depth_count;
+  int closest_index = -1;
+  float closest_distance = numeric_limits<float>::infinity();
+  for (int i = 0; i < 4; ++ i) {
+    const float distance = fabs(depths[i] - average_depth);
+    if (distance < closest_distance) {
+      closest_index = i;
+      closest_distance = distance;
+    }
+  }
+  return closest_index;
+}
+
+constexpr int kDownsampleOffsets[4][2] = {{0, 0}, {0, 1}, {1, 0}, {1, 1}};
+
+// CPU version of CalibrateAndDownsampleImagesCUDA().
+void CalibrateAndDownsampleImagesCPU(
+    bool downsample_color,
+    const DepthParametersCPU& depth_params,
+    const Image<u16>& depth,
+    const Image<u16>& normals,
+    const Image<u8>& color,
+    usize thread_count,
+    Image<float>* downsampled_depth,
+    Image<u16>* downsampled_normals,
+    Image<u8>* downsampled_color) {
+  ParallelForBlocks(0, downsampled_depth->height(), thread_count, [&](usize /*block_index*/, usize block_begin, usize block_end) {
+    for (u32 y = block_begin; y < block_end; ++ y) {
+      for (u32 x = 0; x < downsampled_depth->width(); ++ x) {
+        float depths[4];
+        for (int i = 0; i < 4; ++ i) {
+          const u16 raw_depth = depth(2 * x + kDownsampleOffsets[i][1], 2 * y + kDownsampleOffsets[i][0]);
+          // NOTE: Like the CUDA version, this looks up the cfactor at the
+          //       downsampled pixel coordinates.
+          depths[i] = (raw_depth & kInvalidDepthBit) ?
+                      numeric_limits<float>::infinity() :
+                      depth_params.RawToDepth(x, y, raw_depth);
+        }
+        
+        const int closest_index = SelectDownsampledDepth(depths);
+        if (closest_index < 0) {
+          // The normal does not need to be set here, as the pixel is invalid.
+          (*downsampled_depth)(x, y) = 0;
+        } else {
+          (*downsampled_depth)(x, y) = depths[closest_index];
+          (*downsampled_normals)(x, y) = normals(2 * x + kDownsampleOffsets[closest_index][1], 2 * y + kDownsampleOffsets[closest_index][0]);
+        }
+        
+        if (downsample_color) {
+          // Bilinearly interpolate in the middle of the original 4 pixels to get their average.
+          (*downsampled_color)(x, y) = 255.f * SampleLinearNormalizedCPU(color, 2 * x + 1.0f, 2 * y + 1.0f) + 0.5f;
+        } else {
+          (*downsampled_color)(x, y) = 255.f * SampleLinearNormalizedCPU(color, x + 0.5f, y + 0.5f) + 0.5f;
+        }
+      }
+    }
+  });
+}
+
+// CPU version of DownsampleImagesCUDA().
+void DownsampleImagesCPU(
+    const Image<float>& depth,
+    const Image<u16>& normals,
+    const Image<u8>& color,
+    usize thread_count,
+    Image<float>* downsampled_depth,
+    Image<u16>* downsampled_normals,
+    Image<u8>* downsampled_color) {
+  ParallelForBlocks(0, downsampled_depth->height(), thread_count, [&](usize /*block_index*/, usize block_begin, usize block_end) {
+    for (u32 y = block_begin; y < block_end; ++ y) {
+      for (u32 x = 0; x < downsampled_depth->width(); ++ x) {
+        float depths[4];
+        for (int i = 0; i < 4; ++ i) {
+          depths[i] = depth(2 * x + kDownsampleOffsets[i][1], 2 * y + kDownsampleOffsets[i][0]);
+          if (!(depths[i] > 0)) {
+            depths[i] = numeric_limits<float>::infinity();
+          }
+        }
+        
+        const int closest_index = SelectDownsampledDepth(depths);
+        if (closest_index < 0) {
+          // The normal does not need to be set here, as the pixel is invalid.
+          // However, the color must be set, as it might become relevant again
+          // for further downsampling.
+          (*downsampled_depth)(x, y) = 0;
+        } else {
+          (*downsampled_depth)(x, y) = depths[closest_index];
+          (*downsampled_normals)(x, y) = normals(2 * x + kDownsampleOffsets[closest_index][1], 2 * y + kDownsampleOffsets[closest_index][0]);
+        }
+        
+        // Bilinearly interpolate in the middle of the original 4 pixels to get their average.
+        (*downsampled_color)(x, y) = 255.f * SampleLinearNormalizedCPU(color, 2 * x + 1.0f, 2 * y + 1.0f) + 0.5f;
+      }
+    }
+  });
+}
+
+}  // namespace
+
+
+PairwiseFrameTrackingBuffersCPU::PairwiseFrameTrackingBuffersCPU(
+    int depth_width, int depth_height, int num_scales) {
+  base_depth.resize(num_scales);
+  base_normals.resize(num_scales);
+  base_color.resize(num_scales);
+  
+  tracked_depth.resize(num_scales);
+  tracked_normals.resize(num_scales);
+  tracked_color.resize(num_scales);
+  
+  for (int scale = 0; scale < num_scales; ++ scale) {
+    int scale_width = depth_width / pow(2, scale);
+    int scale_height = depth_height / pow(2, scale);
+    
+    tracked_depth[scale].SetSize(scale_width, scale_height);
+    if (scale >= 1) {
+      base_depth[scale].SetSize(scale_width, scale_height);
+      base_normals[scale].SetSize(scale_width, scale_height);
+      base_color[scale].SetSize(scale_width, scale_height);
+      
+      tracked_normals[scale].SetSize(scale_width, scale_height);
+      tracked_color[scale].SetSize(scale_width, scale_height);
+    }
+  }
+}
+
+void ComputeSobelGradientMagnitudeCPU(
+    const Image<u8>& intensity,
+    Image<u8>* gradmag,
+    int thread_count) {
+  const int width = intensity.width();
+  const int height = intensity.height();
+  gradmag->SetSize(width, height);
+  
+  // gx and gy are in [-4 * 255, 4 * 255].
+  constexpr float kNormalizer = 255.99f / (1.41421356f * 4 * 255.f);
+  
+  ParallelForBlocks(0, height, (thread_count > 0) ? thread_count : DefaultThreadCount(),
+                    [&](usize /*block_index*/, usize block_begin, usize block_end) {
+    for (int y = block_begin; y < static_cast<int>(block_end); ++ y) {
+      const u8* row_above = intensity.row(std::max(0, y - 1));
+      const u8* row = intensity.row(y);
+      const u8* row_below = intensity.row(std::min(height - 1, y + 1));
+      u8* out_row = gradmag->row(y);
+      
+      for (int x = 0; x < width; ++ x) {
+        const int left = std::max(0, x - 1);
+        const int right = std::min(width - 1, x + 1);
+        const float gx =
+            1 * row_above[right] - 1 * row_above[left] +
+            2 * row[right] - 2 * row[left] +
+            1 * row_below[right] - 1 * row_below[left];
+        const float gy =
+            1 * row_below[left] - 1 * row_above[left] +
+            2 * row_below[x] - 2 * row_above[x] +
+            1 * row_below[right] - 1 * row_above[right];
+        out_row[x] = kNormalizer * sqrtf(gx * gx + gy * gy);
+      }
+    }
+  });
+}
+
+void TrackFramePairwiseCPU(
+    PairwiseFrameTrackingBuffersCPU* buffers,
+    int thread_count,
+    const PinholeCamera4f& color_camera,
+    const PinholeCamera4f& depth_camera,
+    const DepthParametersCPU& depth_params,
+    bool use_depth_residuals,
+    bool use_descriptor_residuals,
+    bool use_pyramid_level_0,
+    bool use_gradmag,
+    /* tracked frame */
+    const Image<u16>& tracked_depth_input,
+    const Image<u16>& tracked_normals_input,
+    const Image<u8>& tracked_color_input,
+    /* base frame */
+    const Image<float>& base_depth_input,
+    const Image<u16>& base_normals_input,
+    const Image<u8>& base_color_input,
+    /* input / output poses */
+    const vector<SE3f>& base_T_frame_initial_estimates,
+    SE3f* out_base_T_frame_estimate,
+    u32* out_residual_count,
+    float* out_residual_sum) {
+  CHECK(!base_T_frame_initial_estimates.empty());
+  const usize worker_count = (thread_count > 0) ? thread_count : DefaultThreadCount();
+  const int num_scales = buffers->tracked_depth.size();
+  constexpr int kMaxIterationsPerScale = 30;
+  
+  // Specify which images to use. Scale 0 of the base frame and the tracked
+  // normals and color of scale 0 are the inputs.
+  vector<const Image<float>*> base_depth(num_scales);
+  vector<const Image<u16>*> base_normals(num_scales);
+  vector<const Image<u8>*> base_color(num_scales);
+  
+  vector<const Image<float>*> tracked_depth(num_scales);
+  vector<const Image<u16>*> tracked_normals(num_scales);
+  vector<const Image<u8>*> tracked_color(num_scales);
+  
+  for (int scale = 0; scale < num_scales; ++ scale) {
+    base_depth[scale] = (scale == 0) ? &base_depth_input : &buffers->base_depth[scale];
+    base_normals[scale] = (scale == 0) ? &base_normals_input : &buffers->base_normals[scale];
+    base_color[scale] = (scale == 0) ? &base_color_input : &buffers->base_color[scale];
+    
+    tracked_depth[scale] = &buffers->tracked_depth[scale];
+    tracked_normals[scale] = (scale == 0) ? &tracked_normals_input : &buffers->tracked_normals[scale];
+    tracked_color[scale] = (scale == 0) ? &tracked_color_input : &buffers->tracked_color[scale];
+  }
+  
+  if (use_pyramid_level_0) {
+    // Convert tracked frame input to the expected format to use it on scale 0.
+    CalibrateDepthCPU(
+        depth_params,
+        tracked_depth_input,
+        worker_count,
+        &buffers->tracked_depth[0]);
+  } else {
+    // Downsample input images
+    if (depth_camera.width() != color_camera.width() &&
+        depth_camera.width() != 2 * color_camera.width()) {
+      LOG(FATAL) << "The chosen depth / color pyramid level combination is not supported here.";
+    }
+    
+    CalibrateAndDownsampleImagesCPU(
+        depth_camera.width() == color_camera.width(),
+        depth_params,
+        tracked_depth_input,
+        tracked_normals_input,
+        tracked_color_input,
+        worker_count,
+        &buffers->tracked_depth[1],
+        &buffers->tracked_normals[1],
+        &buffers->tracked_color[1]);
+  }
+  
+  for (int scale = 1; scale < num_scales; ++ scale) {
+    if (scale >= 2 || use_pyramid_level_0) {
+      DownsampleImagesCPU(
+          *tracked_depth[scale - 1],
+          *tracked_normals[scale - 1],
+          *tracked_color[scale - 1],
+          worker_count,
+          &buffers->tracked_depth[scale],
+          &buffers->tracked_normals[scale],
+          &buffers->tracked_color[scale]);
+    }
+    
+    DownsampleImagesCPU(
+        *base_depth[scale - 1],
+        *base_normals[scale - 1],
+        *base_color[scale - 1],
+        worker_count,
+        &buffers->base_depth[scale],
+        &buffers->base_normals[scale],
+        &buffers->base_color[scale]);
+  }
+  
+  SE3f base_T_frame_estimate = base_T_frame_initial_estimates.front();
+  SE3f base_T_frame_chosen_initial_estimate = base_T_frame_estimate;
+  
+  PoseEstimationSumsCPU sums;
+  
+  // Iterate over scales
+  u32 last_residual_count = 0;
+  float last_residual_sum = 0;
+  for (int scale = num_scales - 1; scale >= (use_pyramid_level_0 ? 0 : 1); -- scale) {
+    float scaling_factor = pow(2, scale);
+    // NOTE: As in the CUDA version, only a color pyramid level that is higher
+    //       than the depth pyramid level by one is supported if they differ.
+    shared_ptr<PinholeCamera4f> tracked_color_camera(color_camera.Scaled(
+        (depth_camera.width() == color_camera.width()) ? (1.f / scaling_factor) : (2.f / scaling_factor)));
+    shared_ptr<PinholeCamera4f> tracked_depth_camera(depth_camera.Scaled(1.f / scaling_factor));
+    
+    const TrackingScaleCPU tracking_scale(
+        *tracked_color_camera,
+        *tracked_depth_camera,
+        depth_params.baseline_fx,
+        /*threshold_factor*/ scaling_factor,
+        use_depth_residuals,
+        use_descriptor_residuals,
+        use_gradmag,
+        tracked_depth[scale],
+        tracked_normals[scale],
+        tracked_color[scale],
+        base_depth[scale],
+        base_normals[scale],
+        base_color[scale]);
+    
+    // If this is the first scale, choose the best of the initial estimates.
+    // Otherwise, test whether the costs are better at the last scale's result
+    // or at the chosen initial estimate, and continue with the better pose.
+    vector<SE3f> candidates;
+    if (scale == num_scales - 1) {
+      if (base_T_frame_initial_estimates.size() > 1) {
+        candidates = base_T_frame_initial_estimates;
+      }
+    } else {
+      candidates.push_back(base_T_frame_estimate);
+      candidates.push_back(base_T_frame_chosen_initial_estimate);
+    }
+    
+    if (!candidates.empty()) {
+      vector<u32> residual_counts(candidates.size());
+      vector<float> costs(candidates.size());
+      for (usize i = 0; i < candidates.size(); ++ i) {
+        AccumulatePoseEstimationSumsCPU(tracking_scale, candidates[i].inverse(), /*accumulate_normal_equations*/ false, worker_count, &sums);
+        residual_counts[i] = sums.residual_count;
+        costs[i] = sums.cost;
+      }
+      
+      base_T_frame_estimate = candidates[SelectBestPoseEstimate(residual_counts, costs)];
+      if (scale == num_scales - 1) {
+        base_T_frame_chosen_initial_estimate = base_T_frame_estimate;
+      }
+    }
+    
+    for (int iteration = 0; iteration < kMaxIterationsPerScale; ++ iteration) {
+      AccumulatePoseEstimationSumsCPU(tracking_scale, base_T_frame_estimate.inverse(), /*accumulate_normal_equations*/ true, worker_count, &sums);
+      last_residual_count = sums.residual_count;
+      last_residual_sum = sums.cost;
+      
+      Eigen::Matrix<double, 6, 6> H;
+      Eigen::Matrix<double, 6, 1> b;
+      int index = 0;
+      for (int row = 0; row < 6; ++ row) {
+        for (int col = row; col < 6; ++ col) {
+          H(row, col) = sums.H[index];
+          ++ index;
+        }
+        b(row) = sums.b[row];
+      }
+      
+      // Solve for the update x
+      Eigen::Matrix<float, 6, 1> x = H.selfadjointView<Eigen::Upper>().ldlt().solve(b).cast<float>();
+      
+      float damping = 1.f;
+      if (scale == num_scales - 2) {
+        damping = 0.5f;
+      } else if (scale == num_scales - 1) {
+        damping = 0.25f;
+      }
+      
+      // Apply the (negative) update -x.
+      base_T_frame_estimate = base_T_frame_estimate * SE3f::exp(-damping * x);
+      
+      // Check for convergence
+      if (IsScaleNPoseEstimationConverged(x, scaling_factor)) {
+        break;
+      }
+    }
+  }
+  
+  *out_base_T_frame_estimate = base_T_frame_estimate;
+  if (out_residual_count) {
+    *out_residual_count = last_residual_count;
+  }
+  if (out_residual_sum) {
+    *out_residual_sum = last_residual_sum;
+  }
+}
+
+void TrackFramePairwiseCPU(
+    PairwiseFrameTrackingBuffersCPU* buffers,
+    int thread_count,
+    const PinholeCamera4f& color_camera,
+    const PinholeCamera4f& depth_camera,
+    const DepthParametersCPU& depth_params,
+    bool use_depth_residuals,
+    bool use_descriptor_residuals,
+    bool use_pyramid_level_0,
+    bool use_gradmag,
+    /* tracked frame */
+    const Image<u16>& tracked_depth,
+    const Image<u16>& tracked_normals,
+    const Image<u8>& tracked_color,
+    /* base frame */
+    const Image<float>& base_depth,
+    const Image<u16>& base_normals,
+    const Image<u8>& base_color,
+    /* input / output poses */
+    bool test_different_initial_estimates,
+    const SE3f& base_T_frame_initial_estimate_1,
+    const SE3f& base_T_frame_initial_estimate_2,
+    SE3f* out_base_T_frame_estimate,
+    u32* out_residual_count,
+    float* out_residual_sum) {
+  vector<SE3f> base_T_frame_initial_estimates;
+  base_T_frame_initial_estimates.push_back(base_T_frame_initial_estimate_1);
+  if (test_different_initial_estimates) {
+    base_T_frame_initial_estimates.push_back(base_T_frame_initial_estimate_2);
+  }
+  
+  TrackFramePairwiseCPU(
+      buffers,
+      thread_count,
+      color_camera,
+      depth_camera,
+      depth_params,
+      use_depth_residuals,
+      use_descriptor_residuals,
+      use_pyramid_level_0,
+      use_gradmag,
+      tracked_depth,
+      tracked_normals,
+      tracked_color,
+      base_depth,
+      base_normals,
+      base_color,
+      base_T_frame_initial_estimates,
+      out_base_T_frame_estimate,
+      out_residual_count,
+      out_residual_sum);
+}
+
+}
@@ -0,0 +1,129 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <libvis/camera.h>
+#include <libvis/eigen.h>
+#include <libvis/image.h>
+#include <libvis/libvis.h>
+#include <libvis/sophus.h>
+
+#include "badslam/depth_parameters_cpu.h"
+
+namespace vis {
+
+// CPU counterpart of PairwiseFrameTrackingBuffers: image pyramids used by
+// TrackFramePairwiseCPU() that should stay allocated over subsequent calls.
+// Scale 0 of the base images and the tracked normals are not used, since the
+// inputs are used directly for these.
+struct PairwiseFrameTrackingBuffersCPU {
+  PairwiseFrameTrackingBuffersCPU(int depth_width, int depth_height, int num_scales);
+  
+  vector<Image<float>> tracked_depth;
+  vector<Image<u16>> tracked_normals;
+  vector<Image<u8>> tracked_color;
+  
+  vector<Image<float>> base_depth;
+  vector<Image<u16>> base_normals;
+  vector<Image<u8>> base_color;
+};
+
+// CPU version of ComputeSobelGradientMagnitudeCUDA() for a single-channel
+// intensity image: computes the Sobel gradient magnitude of each pixel,
+// normalized to [0, 255]. Image borders are clamped.
+void ComputeSobelGradientMagnitudeCPU(
+    const Image<u8>& intensity,
+    Image<u8>* gradmag,
+    int thread_count = 0);
+
+// CPU version of TrackFramePairwise(), for running odometry on systems
+// without a GPU. Uses the same image pyramid, residuals, robust weighting,
+// initial estimate selection and coarse-to-fine Gauss-Newton scheme as the
+// CUDA implementation, and has the same parameters, except that thread_count
+// takes the place of the CUDA stream. The normal equations are accumulated in
+// parallel over image rows with one partial sum per thread. If thread_count
+// is 0, DefaultThreadCount() is used.
+// 
+// The tracked color image must be in the color camera intrinsics, while the
+// base color image must have been transformed to the depth camera intrinsics.
+// Depending on use_gradmag, the color images contain gradient magnitudes or
+// intensities.
+void TrackFramePairwiseCPU(
+    PairwiseFrameTrackingBuffersCPU* buffers,
+    int thread_count,
+    const PinholeCamera4f& color_camera,
+    const PinholeCamera4f& depth_camera,
+    const DepthParametersCPU& depth_params,
+    bool use_depth_residuals,
+    bool use_descriptor_residuals,
+    bool use_pyramid_level_0,
+    bool use_gradmag,
+    /* tracked frame */
+    const Image<u16>& tracked_depth,
+    const Image<u16>& tracked_normals,
+    const Image<u8>& tracked_color,
+    /* base frame */
+    const Image<float>& base_depth,
+    const Image<u16>& base_normals,
+    const Image<u8>& base_color,
+    /* input / output poses */
+    const vector<SE3f>& base_T_frame_initial_estimates,
+    SE3f* out_base_T_frame_estimate,
+    u32* out_residual_count = nullptr,
+    float* out_residual_sum = nullptr);
+
+// Version of TrackFramePairwiseCPU() with one or two initial estimates. If
+// test_different_initial_estimates is false, only the first one is used.
+void TrackFramePairwiseCPU(
+    PairwiseFrameTrackingBuffersCPU* buffers,
+    int thread_count,
+    const PinholeCamera4f& color_camera,
+    const PinholeCamera4f& depth_camera,
+    const DepthParametersCPU& depth_params,
+    bool use_depth_residuals,
+    bool use_descriptor_residuals,
+    bool use_pyramid_level_0,
+    bool use_gradmag,
+    /* tracked frame */
+    const Image<u16>& tracked_depth,
+    const Image<u16>& tracked_normals,
+    const Image<u8>& tracked_color,
+    /* base frame */
+    const Image<float>& base_depth,
+    const Image<u16>& base_normals,
+    const Image<u8>& base_color,
+    /* input / output poses */
+    bool test_different_initial_estimates,
+    const SE3f& base_T_frame_initial_estimate_1,
+    const SE3f& base_T_frame_initial_estimate_2,
+    SE3f* out_base_T_frame_estimate,
+    u32* out_residual_count = nullptr,
+    float* out_residual_sum = nullptr);
+
+}
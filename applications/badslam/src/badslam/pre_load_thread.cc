@@ -73,8 +73,10 @@ void PreLoadThread::ThreadMain() {
     input_lock.unlock();
     // ### Input data lock end ###
     
-    rgbd_video_->color_frame_mutable(preload_frame_index)->GetImage().get();
-    rgbd_video_->depth_frame_mutable(preload_frame_index)->GetImage().get();
+    // Keep references to the images until the next pre-load request such that
+    // the image cache cannot evict them before they are used.
+    preloaded_color_image_ = rgbd_video_->color_frame_mutable(preload_frame_index)->GetImage();
+    preloaded_depth_image_ = rgbd_video_->depth_frame_mutable(preload_frame_index)->GetImage();
   }
 }
 
@@ -69,6 +69,11 @@ class PreLoadThread {
   condition_variable all_work_done_condition_;
   atomic<int> preload_frame_index_;
   
+  // References to the images of the last pre-loaded frame. Only accessed by
+  // the thread.
+  shared_ptr<Image<Vec3u8>> preloaded_color_image_;
+  shared_ptr<Image<u16>> preloaded_depth_image_;
+  
   atomic<bool> thread_exit_requested_;
   unique_ptr<thread> thread_;
 };
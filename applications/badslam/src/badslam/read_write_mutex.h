@@ -0,0 +1,129 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+
+#include <libvis/libvis.h>
+
+namespace vis {
+
+// A reader-writer mutex: any number of readers may hold it at the same time,
+// while a writer holds it exclusively. Waiting writers take precedence over
+// new readers, such that a steady stream of readers cannot starve a writer.
+// 
+// lock() / unlock() acquire and release exclusive (write) access, which makes
+// the mutex usable with lock_guard and unique_lock. Shared (read) access is
+// acquired with lock_shared() / unlock_shared(), or with a SharedLock.
+class ReadWriteMutex {
+ public:
+  ReadWriteMutex() = default;
+  
+  ReadWriteMutex(const ReadWriteMutex& other) = delete;
+  ReadWriteMutex& operator= (const ReadWriteMutex& other) = delete;
+  
+  void lock() {
+    unique_lock<mutex> lock(mutex_);
+    ++ waiting_writers_;
+    while (writer_active_ || active_readers_ > 0) {
+      writer_condition_.wait(lock);
+    }
+    -- waiting_writers_;
+    writer_active_ = true;
+  }
+  
+  void unlock() {
+    unique_lock<mutex> lock(mutex_);
+    writer_active_ = false;
+    bool notify_writer = waiting_writers_ > 0;
+    lock.unlock();
+    if (notify_writer) {
+      writer_condition_.notify_one();
+    }
+    reader_condition_.notify_all();
+  }
+  
+  void lock_shared() {
+    unique_lock<mutex> lock(mutex_);
+    while (writer_active_ || waiting_writers_ > 0) {
+      reader_condition_.wait(lock);
+    }
+    ++ active_readers_;
+  }
+  
+  void unlock_shared() {
+    unique_lock<mutex> lock(mutex_);
+    -- active_readers_;
+    bool notify_writer = active_readers_ == 0 && waiting_writers_ > 0;
+    lock.unlock();
+    if (notify_writer) {
+      writer_condition_.notify_one();
+    }
+  }
+  
+  // Returns whether some thread currently holds exclusive access. This is
+  // meant for checking that a caller has locked the mutex.
+  bool is_locked_exclusively() {
+    lock_guard<mutex> lock(mutex_);
+    return writer_active_;
+  }
+  
+ private:
+  mutex mutex_;
+  condition_variable reader_condition_;
+  condition_variable writer_condition_;
+  
+  // Protected by mutex_.
+  int active_readers_ = 0;
+  int waiting_writers_ = 0;
+  bool writer_active_ = false;
+};
+
+// Holds shared (read) access to a ReadWriteMutex for the lifetime of the
+// object.
+class SharedLock {
+ public:
+  explicit SharedLock(ReadWriteMutex& mutex)
+      : mutex_(mutex) {
+    mutex_.lock_shared();
+  }
+  
+  ~SharedLock() {
+    mutex_.unlock_shared();
+  }
+  
+  SharedLock(const SharedLock& other) = delete;
+  SharedLock& operator= (const SharedLock& other) = delete;
+  
+ private:
+  ReadWriteMutex& mutex_;
+};
+
+}
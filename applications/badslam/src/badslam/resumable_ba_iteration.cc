@@ -0,0 +1,99 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "badslam/resumable_ba_iteration.h"
+
+#include <algorithm>
+
+#include <libvis/logging.h>
+
+namespace vis {
+
+BADeadline::BADeadline()
+    : time_limit_(0) {}
+
+BADeadline::BADeadline(const std::function<double ()>& clock, double time_limit)
+    : clock_(clock),
+      time_limit_(time_limit) {}
+
+bool BADeadline::Expired() const {
+  return clock_ && clock_() > time_limit_;
+}
+
+bool ResumableBAIteration::Run(const vector<BAPhase>& phases, const BADeadline& deadline) {
+  if (!in_progress_) {
+    if (deadline.Expired()) {
+      return false;
+    }
+    in_progress_ = true;
+    phase_index_ = 0;
+    phase_begun_ = false;
+  } else if (phase_begun_ && phases[phase_index_].resume) {
+    item_count_ = std::max(item_index_, phases[phase_index_].resume());
+  }
+  
+  while (phase_index_ < phases.size()) {
+    const BAPhase& phase = phases[phase_index_];
+    
+    if (!phase_begun_) {
+      if (deadline.Expired()) {
+        return false;
+      }
+      item_count_ = phase.begin();
+      item_index_ = 0;
+      phase_begun_ = true;
+    }
+    
+    while (item_index_ < item_count_) {
+      if (phase.preemptible && deadline.Expired()) {
+        return false;
+      }
+      phase.process_item(item_index_);
+      ++ item_index_;
+    }
+    
+    if (phase.end) {
+      phase.end();
+    }
+    ++ phase_index_;
+    phase_begun_ = false;
+  }
+  
+  Reset();
+  return true;
+}
+
+void ResumableBAIteration::Reset() {
+  in_progress_ = false;
+  phase_index_ = 0;
+  phase_begun_ = false;
+  item_count_ = 0;
+  item_index_ = 0;
+}
+
+}
@@ -0,0 +1,127 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <functional>
+#include <vector>
+
+#include <libvis/libvis.h>
+
+namespace vis {
+
+// A point in time after which preemptible bundle adjustment work should not
+// start any further work items. The time is obtained from a clock function,
+// which allows to use a fake clock in tests.
+class BADeadline {
+ public:
+  // Creates a deadline which never expires.
+  BADeadline();
+  
+  // Creates a deadline which expires once clock() returns a value larger than
+  // time_limit.
+  BADeadline(const std::function<double ()>& clock, double time_limit);
+  
+  // Returns whether the deadline has passed.
+  bool Expired() const;
+  
+ private:
+  std::function<double ()> clock_;
+  double time_limit_;
+};
+
+// One phase of a bundle adjustment iteration, for example pose optimization.
+// A phase consists of work items (for example, one per keyframe) which are
+// processed in order.
+struct BAPhase {
+  // Called when the phase is entered. Returns the number of work items of the
+  // phase, which may be zero (for example, if the phase is disabled).
+  std::function<usize ()> begin;
+  
+  // Processes the work item with the given index.
+  std::function<void (usize item_index)> process_item;
+  
+  // Called instead of begin() when an interrupted iteration is continued
+  // within this phase. Returns the current number of work items, which may
+  // have grown since the phase was entered (for example, if keyframes were
+  // added in the meantime). Only the items which have not been processed yet
+  // are processed. May be null, in which case the number of work items
+  // returned by begin() is kept.
+  std::function<usize ()> resume;
+  
+  // Called after the last work item of the phase has been processed. May be
+  // null.
+  std::function<void ()> end;
+  
+  // If false, the iteration cannot be interrupted between the work items of
+  // this phase: once the phase has begun, it runs to completion. This is for
+  // phases whose work items leave shared state inconsistent until end() has
+  // been called.
+  bool preemptible = true;
+};
+
+// Tracks the progress of a bundle adjustment iteration which is split into
+// phases and work items, such that the iteration can be interrupted between
+// two work items (of a preemptible phase) when a deadline passes, and resumed
+// in a later call.
+// The deadline is only checked cooperatively, i.e., a work item that has
+// been started always runs to completion. Any state that the phases share
+// across work items must be stored outside of the phase functions, since
+// these are generally re-created for each call to Run().
+class ResumableBAIteration {
+ public:
+  // Runs the iteration given by phases, or continues it if it was interrupted
+  // in a previous call. Before beginning a phase and before each work item of
+  // a preemptible phase, checks whether the deadline has passed and if yes,
+  // returns false. Returns
+  // true once all phases have been completed, after which the next call will
+  // start a new iteration. If the deadline has already passed when the
+  // function is called, no new iteration is started.
+  bool Run(const vector<BAPhase>& phases, const BADeadline& deadline);
+  
+  // Discards the progress of an interrupted iteration, such that the next
+  // call to Run() starts a new iteration.
+  void Reset();
+  
+  // Returns whether an iteration has been started, but not completed yet.
+  inline bool in_progress() const { return in_progress_; }
+  
+  // Returns the index of the phase and work item at which an interrupted
+  // iteration will be continued.
+  inline usize phase_index() const { return phase_index_; }
+  inline usize item_index() const { return item_index_; }
+  
+ private:
+  bool in_progress_ = false;
+  usize phase_index_ = 0;
+  bool phase_begun_ = false;
+  usize item_count_ = 0;
+  usize item_index_ = 0;
+};
+
+}
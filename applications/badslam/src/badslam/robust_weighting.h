@@ -29,14 +29,17 @@
 
 #pragma once
 
-#include <cuda_runtime.h>
+#include <cmath>
+
 #include <libvis/libvis.h>
 
+#include "badslam/constants.h"
+
 namespace vis {
 
   // Calculates the value of the robust weight function for a residual, to be
   // used in residual calculation.
-__forceinline__ __device__ float TukeyResidual(
+BADSLAM_HOST_DEVICE float TukeyResidual(
     float raw_residual,
     float tukey_parameter) {
   if (fabs(raw_residual) < tukey_parameter) {
@@ -50,7 +53,7 @@ __forceinline__ __device__ float TukeyResidual(
 
 // Computes the weight used in the weighted least squares update equation.
 // Is equal to (1 / residual) * (d TukeyResidual(residual)) / (d residual) .
-__forceinline__ __device__ float TukeyWeight(
+BADSLAM_HOST_DEVICE float TukeyWeight(
     float raw_residual,
     float tukey_parameter) {
   if (fabs(raw_residual) < tukey_parameter) {
@@ -65,7 +68,7 @@ __forceinline__ __device__ float TukeyWeight(
 
   // Calculates the value of the robust weight function for a residual, to be
   // used in residual calculation.
-__forceinline__ __device__ float HuberResidual(
+BADSLAM_HOST_DEVICE float HuberResidual(
     float raw_residual,
     float huber_parameter) {
   const float abs_residual = fabs(raw_residual);
@@ -78,7 +81,7 @@ __forceinline__ __device__ float HuberResidual(
 
 // Computes the weight used in the weighted least squares update equation.
 // Is equal to (1 / residual) * (d HuberResidual(residual)) / (d residual) .
-__forceinline__ __device__ float HuberWeight(
+BADSLAM_HOST_DEVICE float HuberWeight(
     float raw_residual,
     float huber_parameter) {
   const float abs_residual = fabs(raw_residual);
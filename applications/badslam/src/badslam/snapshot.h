@@ -0,0 +1,111 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+#include <libvis/libvis.h>
+
+namespace vis {
+
+// An immutable, versioned value published by a SnapshotPublisher.
+template <typename T>
+struct Snapshot {
+  Snapshot(u64 version, const T& value)
+      : version(version),
+        value(value) {}
+  
+  // Starts at 0 for the first published value and increases by one with each
+  // subsequent publication.
+  const u64 version;
+  
+  const T value;
+};
+
+// Publishes immutable snapshots of a value for read-copy-update (RCU) style
+// sharing between threads. A writer creates a new snapshot and swaps it in
+// with an atomic pointer store. Readers atomically load the pointer to the
+// current snapshot; they never wait for a writer that is preparing a new
+// snapshot, and the snapshot they obtained stays valid and unchanged for as
+// long as they hold on to it. Writers are serialized with a separate mutex
+// which is only held while publishing.
+template <typename T>
+class SnapshotPublisher {
+ public:
+  // Creates a publisher without a snapshot. Read() returns null until the
+  // first value is published.
+  SnapshotPublisher() = default;
+  
+  // Creates a publisher and publishes initial_value with version 0.
+  explicit SnapshotPublisher(const T& initial_value) {
+    Publish(initial_value);
+  }
+  
+  SnapshotPublisher(const SnapshotPublisher& other) = delete;
+  SnapshotPublisher& operator= (const SnapshotPublisher& other) = delete;
+  
+  // Returns the most recently published snapshot, or null if no value has
+  // been published yet.
+  inline shared_ptr<const Snapshot<T>> Read() const {
+    return std::atomic_load(&current_);
+  }
+  
+  // Publishes a new snapshot of value.
+  void Publish(const T& value) {
+    lock_guard<mutex> lock(writer_mutex_);
+    PublishLocked(value);
+  }
+  
+  // Copies the value of the current snapshot (or a default-constructed value
+  // if there is none), lets update_function(T* value) modify the copy, and
+  // publishes the result. Concurrent updates are serialized, so no update is
+  // lost.
+  template <typename Func>
+  void Update(const Func& update_function) {
+    lock_guard<mutex> lock(writer_mutex_);
+    shared_ptr<const Snapshot<T>> current = std::atomic_load(&current_);
+    T value = current ? current->value : T();
+    update_function(&value);
+    PublishLocked(value);
+  }
+  
+ private:
+  void PublishLocked(const T& value) {
+    shared_ptr<const Snapshot<T>> current = std::atomic_load(&current_);
+    u64 version = current ? (current->version + 1) : 0;
+    std::atomic_store(&current_, shared_ptr<const Snapshot<T>>(new Snapshot<T>(version, value)));
+  }
+  
+  shared_ptr<const Snapshot<T>> current_;
+  mutex writer_mutex_;
+};
+
+}
@@ -0,0 +1,541 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "badslam/surfel_map_codec.h"
+
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <tuple>
+#include <type_traits>
+
+#include <libvis/logging.h>
+#include <libvis/util.h>
+#include <zlib.h>
+
+namespace vis {
+
+namespace {
+
+constexpr char kSurfelMapIdentifier[7] = {'B', 'A', 'D', 'S', 'M', 'A', 'P'};
+constexpr u8 kSurfelMapVersion = 1;
+
+// Size of the file header: identifier, version, block_size, position_step,
+// coordinate_bytes, block_count, surfel_count.
+constexpr usize kHeaderSize = 7 + 1 + 4 + 4 + 4 + 4 + 8;
+
+// Size of an entry in the block index: block coordinates, surfel count,
+// offset and size of the compressed data.
+constexpr usize kIndexEntrySize = 3 * 4 + 4 + 8 + 4;
+
+// Refuse to load files claiming more blocks than this.
+constexpr u32 kMaxBlockCount = 1 << 26;
+
+// Upper bound on the compression ratio achievable with deflate. Blocks
+// claiming a larger ratio are rejected as corrupt before allocating memory for
+// their decompressed data.
+constexpr u64 kMaxDeflateRatio = 1032;
+
+// Number of surfel attributes which are stored bit-exactly (all data
+// attributes except for the position).
+constexpr int kRawAttributeCount = kSurfelDataAttributeCount - 3;
+static_assert(kSurfelX == 0 && kSurfelY == 1 && kSurfelZ == 2,
+              "The position attributes are expected to be the first ones");
+
+struct BlockIndexEntry {
+  i32 block[3];
+  u32 surfel_count;
+  u64 offset;
+  u32 compressed_size;
+};
+
+typedef std::function<bool (u64 offset, usize size, u8* dest)> ReadFunction;
+
+// Unsigned integer type with the same size as T, used to access the bytes of
+// header values independently of the host byte order.
+template <int size> struct UnsignedOfSize {};
+template <> struct UnsignedOfSize<1> { typedef u8 Type; };
+template <> struct UnsignedOfSize<2> { typedef u16 Type; };
+template <> struct UnsignedOfSize<4> { typedef u32 Type; };
+template <> struct UnsignedOfSize<8> { typedef u64 Type; };
+
+// Appends the value in little-endian byte order.
+template <typename T>
+void Append(const T& value, vector<u8>* out) {
+  typedef typename UnsignedOfSize<sizeof(T)>::Type UnsignedT;
+  UnsignedT bits;
+  memcpy(&bits, &value, sizeof(T));
+  for (usize b = 0; b < sizeof(T); ++ b) {
+    out->push_back(static_cast<u8>(bits >> (8 * b)));
+  }
+}
+
+// Reads a little-endian value and advances ptr behind it.
+template <typename T>
+T Extract(const u8** ptr) {
+  typedef typename UnsignedOfSize<sizeof(T)>::Type UnsignedT;
+  UnsignedT bits = 0;
+  for (usize b = 0; b < sizeof(T); ++ b) {
+    bits |= static_cast<UnsignedT>((*ptr)[b]) << (8 * b);
+  }
+  *ptr += sizeof(T);
+  T value;
+  memcpy(&value, &bits, sizeof(T));
+  return value;
+}
+
+inline usize RawBlockSize(usize surfel_count, u32 coordinate_bytes) {
+  return surfel_count * (3 * coordinate_bytes + kRawAttributeCount * sizeof(float));
+}
+
+// Stores the difference to the previous value (modulo the range of CoordT) in
+// zig-zag encoding, such that small differences of either sign result in
+// small values, whose high byte planes compress well.
+template <typename CoordT>
+inline CoordT ZigZagDelta(CoordT value, CoordT previous) {
+  typedef typename std::make_signed<CoordT>::type SignedT;
+  SignedT delta = static_cast<SignedT>(static_cast<CoordT>(value - previous));
+  return static_cast<CoordT>(
+      (static_cast<CoordT>(delta) << 1) ^
+      static_cast<CoordT>(delta >> (8 * sizeof(CoordT) - 1)));
+}
+
+// Inverse of ZigZagDelta().
+template <typename CoordT>
+inline CoordT UndoZigZagDelta(CoordT encoded, CoordT previous) {
+  CoordT delta = static_cast<CoordT>((encoded >> 1) ^ static_cast<CoordT>(-static_cast<CoordT>(encoded & 1)));
+  return static_cast<CoordT>(previous + delta);
+}
+
+// Writes the given value to the byte planes starting at plane_start, where
+// each plane has size plane_size. Plane b holds byte b of the little-endian
+// representation.
+template <typename T>
+inline void WriteToBytePlanes(T value, usize index, usize plane_size, u8* plane_start) {
+  for (usize b = 0; b < sizeof(T); ++ b) {
+    plane_start[b * plane_size + index] = static_cast<u8>(value >> (8 * b));
+  }
+}
+
+template <typename T>
+inline T ReadFromBytePlanes(usize index, usize plane_size, const u8* plane_start) {
+  T value = 0;
+  for (usize b = 0; b < sizeof(T); ++ b) {
+    value |= static_cast<T>(plane_start[b * plane_size + index]) << (8 * b);
+  }
+  return value;
+}
+
+inline Vec3d BlockOrigin(const i32* block, float block_size) {
+  return Vec3d(block[0], block[1], block[2]) * static_cast<double>(block_size);
+}
+
+template <typename CoordT>
+void EncodeBlock(
+    const SurfelMapData& surfels,
+    const vector<u32>& surfel_indices,
+    const i32* block,
+    float block_size,
+    float position_step,
+    u8* raw) {
+  const usize n = surfel_indices.size();
+  const Vec3d origin = BlockOrigin(block, block_size);
+  const double max_quantized = numeric_limits<CoordT>::max();
+  
+  for (int c = 0; c < 3; ++ c) {
+    u8* planes = raw + c * sizeof(CoordT) * n;
+    CoordT previous = 0;
+    for (usize i = 0; i < n; ++ i) {
+      double quantized = std::round((surfels.attributes[kSurfelX + c][surfel_indices[i]] - origin(c)) / position_step);
+      CoordT value = static_cast<CoordT>(std::max(0., std::min(max_quantized, quantized)));
+      WriteToBytePlanes(ZigZagDelta(value, previous), i, n, planes);
+      previous = value;
+    }
+  }
+  
+  u8* raw_attributes = raw + 3 * sizeof(CoordT) * n;
+  for (int a = 0; a < kRawAttributeCount; ++ a) {
+    const vector<float>& attribute = surfels.attributes[3 + a];
+    u8* planes = raw_attributes + a * sizeof(u32) * n;
+    for (usize i = 0; i < n; ++ i) {
+      u32 value;
+      memcpy(&value, &attribute[surfel_indices[i]], sizeof(u32));
+      WriteToBytePlanes(value, i, n, planes);
+    }
+  }
+}
+
+template <typename CoordT>
+void DecodeBlock(
+    const u8* raw,
+    usize n,
+    const i32* block,
+    float block_size,
+    float position_step,
+    usize output_offset,
+    SurfelMapData* surfels) {
+  const Vec3d origin = BlockOrigin(block, block_size);
+  
+  for (int c = 0; c < 3; ++ c) {
+    const u8* planes = raw + c * sizeof(CoordT) * n;
+    float* output = surfels->attributes[kSurfelX + c].data() + output_offset;
+    CoordT previous = 0;
+    for (usize i = 0; i < n; ++ i) {
+      CoordT value = UndoZigZagDelta(ReadFromBytePlanes<CoordT>(i, n, planes), previous);
+      output[i] = origin(c) + static_cast<double>(position_step) * value;
+      previous = value;
+    }
+  }
+  
+  const u8* raw_attributes = raw + 3 * sizeof(CoordT) * n;
+  for (int a = 0; a < kRawAttributeCount; ++ a) {
+    const u8* planes = raw_attributes + a * sizeof(u32) * n;
+    float* output = surfels->attributes[3 + a].data() + output_offset;
+    for (usize i = 0; i < n; ++ i) {
+      u32 value = ReadFromBytePlanes<u32>(i, n, planes);
+      memcpy(&output[i], &value, sizeof(u32));
+    }
+  }
+}
+
+// Decodes a surfel map which is accessed with the given read function.
+// data_size is the total size of the encoded data. All sizes and offsets in
+// the header and block index are validated against it before memory is
+// allocated based on them.
+bool DecodeSurfelMapImpl(
+    const ReadFunction& read,
+    u64 data_size,
+    const Eigen::AlignedBox3f* region,
+    SurfelMapData* surfels) {
+  // Header
+  u8 header[kHeaderSize];
+  if (data_size < kHeaderSize || !read(0, kHeaderSize, header)) {
+    LOG(ERROR) << "Unexpected end of data while reading the surfel map header.";
+    return false;
+  }
+  if (memcmp(header, kSurfelMapIdentifier, sizeof(kSurfelMapIdentifier)) != 0) {
+    LOG(ERROR) << "Surfel map identifier does not match.";
+    return false;
+  }
+  const u8* ptr = header + sizeof(kSurfelMapIdentifier);
+  if (Extract<u8>(&ptr) != kSurfelMapVersion) {
+    LOG(ERROR) << "Unknown surfel map format version.";
+    return false;
+  }
+  float block_size = Extract<float>(&ptr);
+  float position_step = Extract<float>(&ptr);
+  u32 coordinate_bytes = Extract<u32>(&ptr);
+  u32 block_count = Extract<u32>(&ptr);
+  u64 surfel_count = Extract<u64>(&ptr);
+  if (!(block_size > 0) || !(position_step > 0) ||
+      (coordinate_bytes != sizeof(u16) && coordinate_bytes != sizeof(u32))) {
+    LOG(ERROR) << "Invalid surfel map encoding parameters.";
+    return false;
+  }
+  if (block_count > kMaxBlockCount) {
+    LOG(ERROR) << "Excessive surfel map block count, refusing to load.";
+    return false;
+  }
+  
+  // Block index
+  if (static_cast<u64>(block_count) * kIndexEntrySize > data_size - kHeaderSize) {
+    LOG(ERROR) << "The surfel map block index exceeds the data size.";
+    return false;
+  }
+  vector<u8> index_data(block_count * kIndexEntrySize);
+  if (!read(kHeaderSize, index_data.size(), index_data.data())) {
+    LOG(ERROR) << "Unexpected end of data while reading the surfel map block index.";
+    return false;
+  }
+  vector<BlockIndexEntry> selected_blocks;
+  u64 indexed_surfel_count = 0;
+  ptr = index_data.data();
+  for (u32 b = 0; b < block_count; ++ b) {
+    BlockIndexEntry entry;
+    for (int c = 0; c < 3; ++ c) {
+      entry.block[c] = Extract<i32>(&ptr);
+    }
+    entry.surfel_count = Extract<u32>(&ptr);
+    entry.offset = Extract<u64>(&ptr);
+    entry.compressed_size = Extract<u32>(&ptr);
+    
+    // Validate the block before anything is allocated based on its values.
+    u64 raw_size = RawBlockSize(entry.surfel_count, coordinate_bytes);
+    if (entry.surfel_count > surfel_count ||
+        entry.offset > data_size ||
+        entry.compressed_size > data_size - entry.offset ||
+        raw_size > kMaxDeflateRatio * entry.compressed_size ||
+        entry.compressed_size > compressBound(raw_size)) {
+      LOG(ERROR) << "Invalid surfel map block index entry.";
+      return false;
+    }
+    indexed_surfel_count += entry.surfel_count;
+    
+    if (region) {
+      // Extend the block bounds by the quantization error to be safe.
+      Vec3f block_min = BlockOrigin(entry.block, block_size).cast<float>() - Vec3f::Constant(position_step);
+      Eigen::AlignedBox3f block_box(block_min, block_min + Vec3f::Constant(block_size + 2 * position_step));
+      if (!block_box.intersects(*region)) {
+        continue;
+      }
+    }
+    selected_blocks.push_back(entry);
+  }
+  if (indexed_surfel_count != surfel_count) {
+    LOG(ERROR) << "The surfel counts in the surfel map block index do not match the header.";
+    return false;
+  }
+  
+  // Read the compressed data of the selected blocks.
+  vector<usize> output_offsets(selected_blocks.size() + 1, 0);
+  vector<vector<u8>> compressed(selected_blocks.size());
+  for (usize b = 0; b < selected_blocks.size(); ++ b) {
+    const BlockIndexEntry& entry = selected_blocks[b];
+    compressed[b].resize(entry.compressed_size);
+    if (!read(entry.offset, entry.compressed_size, compressed[b].data())) {
+      LOG(ERROR) << "Unexpected end of data while reading a surfel map block.";
+      return false;
+    }
+    output_offsets[b + 1] = output_offsets[b] + entry.surfel_count;
+  }
+  
+  // Decompress and decode the blocks in parallel.
+  surfels->Resize(output_offsets.back());
+  std::atomic<bool> success(true);
+  ParallelFor(0, selected_blocks.size(), [&](usize b) {
+    const BlockIndexEntry& entry = selected_blocks[b];
+    vector<u8> raw(RawBlockSize(entry.surfel_count, coordinate_bytes));
+    uLongf raw_size = raw.size();
+    if (uncompress(raw.data(), &raw_size, compressed[b].data(), compressed[b].size()) != Z_OK ||
+        raw_size != raw.size()) {
+      LOG(ERROR) << "Failed to decompress a surfel map block.";
+      success = false;
+      return;
+    }
+    vector<u8>().swap(compressed[b]);
+    
+    if (coordinate_bytes == sizeof(u16)) {
+      DecodeBlock<u16>(raw.data(), entry.surfel_count, entry.block, block_size, position_step, output_offsets[b], surfels);
+    } else {
+      DecodeBlock<u32>(raw.data(), entry.surfel_count, entry.block, block_size, position_step, output_offsets[b], surfels);
+    }
+  });
+  if (!success) {
+    surfels->Resize(0);
+    return false;
+  }
+  
+  // Remove the surfels outside of the region from the blocks at its border.
+  if (region) {
+    usize output_index = 0;
+    for (usize i = 0; i < surfels->size(); ++ i) {
+      Vec3f position(
+          surfels->attributes[kSurfelX][i],
+          surfels->attributes[kSurfelY][i],
+          surfels->attributes[kSurfelZ][i]);
+      if (!region->contains(position)) {
+        continue;
+      }
+      for (int a = 0; a < kSurfelDataAttributeCount; ++ a) {
+        surfels->attributes[a][output_index] = surfels->attributes[a][i];
+      }
+      ++ output_index;
+    }
+    surfels->Resize(output_index);
+  }
+  
+  return true;
+}
+
+}  // namespace
+
+
+bool EncodeSurfelMap(
+    const SurfelMapData& surfels,
+    const SurfelMapEncodingOptions& options,
+    vector<u8>* encoded) {
+  const float position_step = 2 * options.position_tolerance;
+  if (!(position_step > 0) || !(options.block_size > 0)) {
+    LOG(ERROR) << "position_tolerance and block_size must be positive.";
+    return false;
+  }
+  const double max_quantized = std::ceil(options.block_size / position_step);
+  if (max_quantized > numeric_limits<u32>::max()) {
+    LOG(ERROR) << "The ratio of block_size to position_tolerance is too large.";
+    return false;
+  }
+  const u32 coordinate_bytes = (max_quantized <= numeric_limits<u16>::max()) ? sizeof(u16) : sizeof(u32);
+  
+  // Sort the valid surfels into blocks.
+  std::map<std::tuple<i32, i32, i32>, vector<u32>> block_map;
+  for (usize i = 0; i < surfels.size(); ++ i) {
+    float x = surfels.attributes[kSurfelX][i];
+    if (std::isnan(x)) {
+      continue;
+    }
+    auto key = std::make_tuple(
+        static_cast<i32>(std::floor(x / options.block_size)),
+        static_cast<i32>(std::floor(surfels.attributes[kSurfelY][i] / options.block_size)),
+        static_cast<i32>(std::floor(surfels.attributes[kSurfelZ][i] / options.block_size)));
+    block_map[key].push_back(i);
+  }
+  
+  vector<BlockIndexEntry> blocks;
+  vector<const vector<u32>*> block_surfels;
+  blocks.reserve(block_map.size());
+  block_surfels.reserve(block_map.size());
+  u64 surfel_count = 0;
+  for (const auto& item : block_map) {
+    BlockIndexEntry entry;
+    entry.block[0] = std::get<0>(item.first);
+    entry.block[1] = std::get<1>(item.first);
+    entry.block[2] = std::get<2>(item.first);
+    entry.surfel_count = item.second.size();
+    blocks.push_back(entry);
+    block_surfels.push_back(&item.second);
+    surfel_count += entry.surfel_count;
+  }
+  
+  // Encode and compress the blocks in parallel.
+  vector<vector<u8>> compressed(blocks.size());
+  std::atomic<bool> success(true);
+  ParallelFor(0, blocks.size(), [&](usize b) {
+    vector<u8> raw(RawBlockSize(blocks[b].surfel_count, coordinate_bytes));
+    if (coordinate_bytes == sizeof(u16)) {
+      EncodeBlock<u16>(surfels, *block_surfels[b], blocks[b].block, options.block_size, position_step, raw.data());
+    } else {
+      EncodeBlock<u32>(surfels, *block_surfels[b], blocks[b].block, options.block_size, position_step, raw.data());
+    }
+    
+    uLongf compressed_size = compressBound(raw.size());
+    compressed[b].resize(compressed_size);
+    if (compress2(compressed[b].data(), &compressed_size, raw.data(), raw.size(), options.compression_level) != Z_OK) {
+      LOG(ERROR) << "Failed to compress a surfel map block.";
+      success = false;
+      return;
+    }
+    compressed[b].resize(compressed_size);
+    blocks[b].compressed_size = compressed_size;
+  });
+  if (!success) {
+    return false;
+  }
+  
+  // Assemble the output.
+  encoded->clear();
+  encoded->reserve(kHeaderSize + blocks.size() * kIndexEntrySize);
+  encoded->insert(encoded->end(), kSurfelMapIdentifier, kSurfelMapIdentifier + sizeof(kSurfelMapIdentifier));
+  Append(kSurfelMapVersion, encoded);
+  Append(options.block_size, encoded);
+  Append(position_step, encoded);
+  Append(coordinate_bytes, encoded);
+  Append(static_cast<u32>(blocks.size()), encoded);
+  Append(surfel_count, encoded);
+  
+  u64 offset = kHeaderSize + blocks.size() * kIndexEntrySize;
+  for (BlockIndexEntry& entry : blocks) {
+    entry.offset = offset;
+    offset += entry.compressed_size;
+    
+    for (int c = 0; c < 3; ++ c) {
+      Append(entry.block[c], encoded);
+    }
+    Append(entry.surfel_count, encoded);
+    Append(entry.offset, encoded);
+    Append(entry.compressed_size, encoded);
+  }
+  
+  encoded->reserve(offset);
+  for (const vector<u8>& block_data : compressed) {
+    encoded->insert(encoded->end(), block_data.begin(), block_data.end());
+  }
+  return true;
+}
+
+bool DecodeSurfelMap(
+    const u8* encoded,
+    usize encoded_size,
+    const Eigen::AlignedBox3f* region,
+    SurfelMapData* surfels) {
+  return DecodeSurfelMapImpl([&](u64 offset, usize size, u8* dest) {
+    if (offset > encoded_size || size > encoded_size - offset) {
+      return false;
+    }
+    memcpy(dest, encoded + offset, size);
+    return true;
+  }, encoded_size, region, surfels);
+}
+
+bool SaveSurfelMap(
+    const SurfelMapData& surfels,
+    const SurfelMapEncodingOptions& options,
+    const string& path) {
+  vector<u8> encoded;
+  if (!EncodeSurfelMap(surfels, options, &encoded)) {
+    return false;
+  }
+  
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file) {
+    return false;
+  }
+  bool result = fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size();
+  result &= fclose(file) == 0;
+  return result;
+}
+
+bool LoadSurfelMap(
+    const string& path,
+    const Eigen::AlignedBox3f* region,
+    SurfelMapData* surfels) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+  if (fseek(file, 0, SEEK_END) != 0) {
+    fclose(file);
+    return false;
+  }
+  const long file_size = ftell(file);
+  if (file_size < 0) {
+    fclose(file);
+    return false;
+  }
+  
+  bool result = DecodeSurfelMapImpl([&](u64 offset, usize size, u8* dest) {
+    if (fseek(file, offset, SEEK_SET) != 0) {
+      return false;
+    }
+    return fread(dest, 1, size, file) == size;
+  }, file_size, region, surfels);
+  
+  fclose(file);
+  return result;
+}
+
+}
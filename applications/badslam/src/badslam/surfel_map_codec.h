@@ -0,0 +1,111 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <functional>
+
+#include <libvis/eigen.h>
+#include <libvis/libvis.h>
+
+#include "badslam/constants.h"
+
+namespace vis {
+
+// Options for the compact surfel map encoding (see EncodeSurfelMap()).
+struct SurfelMapEncodingOptions {
+  // Maximum absolute error of each stored surfel position coordinate (in
+  // meters). The positions are quantized with a step of twice this value.
+  float position_tolerance = 0.0005f;
+  
+  // Side length of the cubic spatial blocks which the surfels are sorted into
+  // (in meters). Each block is compressed separately and can be loaded on its
+  // own.
+  float block_size = 2.0f;
+  
+  // zlib compression level for the blocks, from 1 (fastest) to 9 (smallest).
+  int compression_level = 6;
+};
+
+// Host-side copy of the surfel data attributes, i.e., of the first
+// kSurfelDataAttributeCount attribute rows of the surfel buffer in DirectBA.
+// attributes[kSurfelX][i] is the x coordinate of surfel i, etc. Invalid
+// surfels (having NaN as x coordinate) may be present, they are skipped when
+// encoding.
+struct SurfelMapData {
+  inline usize size() const { return attributes[0].size(); }
+  
+  inline void Resize(usize size) {
+    for (int a = 0; a < kSurfelDataAttributeCount; ++ a) {
+      attributes[a].resize(size);
+    }
+  }
+  
+  vector<float> attributes[kSurfelDataAttributeCount];
+};
+
+// Encodes the valid surfels into a compact map format:
+// - The surfels are sorted into cubic spatial blocks. For each block, the
+//   surfel positions are quantized relative to the block origin, and all
+//   attributes are stored as byte planes which are compressed with zlib.
+// - A block index (block coordinates, surfel count, and byte range of each
+//   block) at the start allows to decode only the blocks in a region.
+// Positions are reproduced within options.position_tolerance (up to float
+// rounding of the decoded values), all other
+// attributes (including the packed normals and colors) losslessly. The order of
+// the surfels is only preserved within each block. All values are stored in
+// little-endian byte order, so the files are portable between hosts.
+bool EncodeSurfelMap(
+    const SurfelMapData& surfels,
+    const SurfelMapEncodingOptions& options,
+    vector<u8>* encoded);
+
+// Decodes a surfel map that was encoded with EncodeSurfelMap(). If region is
+// non-null, only the blocks intersecting the region are decompressed, and only
+// the surfels within the region are returned.
+bool DecodeSurfelMap(
+    const u8* encoded,
+    usize encoded_size,
+    const Eigen::AlignedBox3f* region,
+    SurfelMapData* surfels);
+
+// Encodes the surfels with EncodeSurfelMap() and saves the result to a file.
+bool SaveSurfelMap(
+    const SurfelMapData& surfels,
+    const SurfelMapEncodingOptions& options,
+    const string& path);
+
+// Loads surfels from a file that was saved with SaveSurfelMap(). If region is
+// non-null, only the index and the blocks intersecting the region are read
+// from the file, and only the surfels within the region are returned.
+bool LoadSurfelMap(
+    const string& path,
+    const Eigen::AlignedBox3f* region,
+    SurfelMapData* surfels);
+
+}
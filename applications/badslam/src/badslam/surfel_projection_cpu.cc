@@ -0,0 +1,245 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "badslam/surfel_projection_cpu.h"
+
+#include <cmath>
+
+#include <libvis/logging.h>
+#include <libvis/util.h>
+
+namespace vis {
+
+bool SurfelProjectsToAssociatedPixelCPU(
+    u32 surfel_index,
+    const SurfelProjectionParametersCPU& surfel_projection,
+    SurfelProjectionResultCPU* result) {
+  result->is_free_space_violation = false;
+  if (surfel_index >= surfel_projection.surfels_size) {
+    return false;
+  }
+  const Image<float>& surfels = *surfel_projection.surfels;
+  
+  // Project the surfel onto the depth buffer to find the corresponding pixel.
+  // The comparison is written such that NaN positions of deleted surfels fail.
+  result->surfel_local_position = surfel_projection.frame_T_global * SurfelGetPositionCPU(surfels, surfel_index);
+  if (!(result->surfel_local_position.z() > 0)) {
+    return false;
+  }
+  
+  const float* camera_parameters = surfel_projection.camera->parameters();
+  const float fx = camera_parameters[0];
+  const float fy = camera_parameters[1];
+  const float cx = camera_parameters[2];
+  const float cy = camera_parameters[3];
+  const Vec3f& local_position = result->surfel_local_position;
+  result->pxy = Vec2f(fx * (local_position.x() / local_position.z()) + cx,
+                      fy * (local_position.y() / local_position.z()) + cy);
+  result->px = static_cast<int>(result->pxy.x());
+  result->py = static_cast<int>(result->pxy.y());
+  const Image<u16>& depth_buffer = *surfel_projection.depth_buffer;
+  if (result->pxy.x() < 0 || result->pxy.y() < 0 ||
+      result->px >= static_cast<int>(depth_buffer.width()) ||
+      result->py >= static_cast<int>(depth_buffer.height())) {
+    return false;
+  }
+  
+  // Check whether the surfel gets associated with the pixel (see
+  // IsAssociatedWithPixel() in surfel_projection_nvcc_only.cuh).
+  const u16 measured_depth = depth_buffer(result->px, result->py);
+  if (measured_depth & kInvalidDepthBit) {
+    return false;
+  }
+  result->pixel_calibrated_depth = surfel_projection.calibration->RawToDepth(result->px, result->py, measured_depth);
+  
+  result->surfel_normal = SurfelGetNormalCPU(surfels, surfel_index);
+  const Vec3f surfel_local_normal = surfel_projection.frame_T_global.rotationMatrix() * result->surfel_normal;
+  
+  // Compute the association depth difference threshold.
+  const float nx = (result->px - (cx - 0.5f)) / fx;
+  const float ny = (result->py - (cy - 0.5f)) / fy;
+  const float depth_residual_stddev_estimate =
+      (kDepthUncertaintyEmpiricalFactor *
+       fabs(surfel_local_normal.x() * nx + surfel_local_normal.y() * ny + surfel_local_normal.z()) *
+       (result->pixel_calibrated_depth * result->pixel_calibrated_depth)) / surfel_projection.calibration->baseline_fx;
+  const float depth_difference_threshold = kDepthResidualDefaultTukeyParam * depth_residual_stddev_estimate;
+  
+  // Check whether the depth is similar enough to consider the measurement to
+  // belong to the surfel.
+  const float depth_difference = result->pixel_calibrated_depth - local_position.z();
+  if (depth_difference > depth_difference_threshold) {
+    result->is_free_space_violation = true;
+    return false;
+  } else if (depth_difference < -depth_difference_threshold) {
+    return false;
+  }
+  
+  // Check whether the surfel normal looks towards the camera (instead of away
+  // from it).
+  if (local_position.dot(surfel_local_normal) > 0) {
+    return false;
+  }
+  
+  // Check whether the surfel normal is compatible with the measurement normal.
+  const Vec3f measurement_normal = U16ToImageSpaceNormalCPU((*surfel_projection.normals_buffer)(result->px, result->py));
+  return surfel_local_normal.dot(measurement_normal) >= cos_normal_compatibility_threshold;
+}
+
+void ComputeSurfelAssociationsCPU(
+    const SurfelProjectionParametersCPU& surfel_projection,
+    vector<u32>* associated_pixels,
+    int thread_count) {
+  associated_pixels->resize(surfel_projection.surfels_size);
+  const u32 width = surfel_projection.depth_buffer->width();
+  
+  // Use more tiles than threads and interleave them, since the cost per
+  // surfel varies a lot (surfels outside of the view are rejected early) and
+  // neighboring surfels tend to be in the same part of the map.
+  const usize worker_count = (thread_count > 0) ? thread_count : DefaultThreadCount();
+  const usize tile_count = 4 * worker_count;
+  ParallelForBlocks(0, worker_count, worker_count, [&](usize worker_index, usize /*block_begin*/, usize /*block_end*/) {
+    for (usize tile = worker_index; tile < tile_count; tile += worker_count) {
+      const u32 tile_begin = (static_cast<u64>(surfel_projection.surfels_size) * tile) / tile_count;
+      const u32 tile_end = (static_cast<u64>(surfel_projection.surfels_size) * (tile + 1)) / tile_count;
+      SurfelProjectionResultCPU result;
+      for (u32 surfel_index = tile_begin; surfel_index < tile_end; ++ surfel_index) {
+        (*associated_pixels)[surfel_index] =
+            SurfelProjectsToAssociatedPixelCPU(surfel_index, surfel_projection, &result) ?
+            (result.py * width + result.px) :
+            kInvalidIndex;
+      }
+    }
+  });
+}
+
+namespace {
+
+void DetermineSupportingSurfelsCPUImpl(
+    bool merge_surfels,
+    float merge_dist_factor,
+    const SurfelProjectionParametersCPU& surfel_projection,
+    Image<u32>* supporting_surfels,
+    u32* surfel_count,
+    int thread_count) {
+  const Image<u16>& depth_buffer = *surfel_projection.depth_buffer;
+  for (int i = 0; i < kMergeBufferCount; ++ i) {
+    supporting_surfels[i].SetSize(depth_buffer.width(), depth_buffer.height());
+    supporting_surfels[i].SetTo(kInvalidIndex);
+  }
+  
+  if (surfel_projection.surfels_size == 0) {
+    return;
+  }
+  
+  vector<u32> associated_pixels;
+  ComputeSurfelAssociationsCPU(surfel_projection, &associated_pixels, thread_count);
+  
+  const int cell_size = surfel_projection.calibration->sparse_surfel_cell_size;
+  const float cell_merge_dist_squared =
+      cell_size * cell_size * merge_dist_factor * merge_dist_factor;
+  // This is set to: cosf(M_PI / 180.f * kSurfelMergeNormalThreshold);
+  const float cos_surfel_merge_normal_threshold = cos_normal_compatibility_threshold;
+  
+  Image<float>& surfels = *surfel_projection.surfels;
+  const u32 width = depth_buffer.width();
+  u32 deleted_count = 0;
+  
+  for (u32 surfel_index = 0; surfel_index < surfel_projection.surfels_size; ++ surfel_index) {
+    const u32 pixel = associated_pixels[surfel_index];
+    if (pixel == kInvalidIndex) {
+      continue;
+    }
+    const u32 cell_x = (pixel % width) / cell_size;
+    const u32 cell_y = (pixel / width) / cell_size;
+    
+    // Set the supporting surfel entry only if it was previously empty. Like in
+    // the CUDA kernel, a surfel which is merged into the surfel of one buffer
+    // may still be entered into a subsequent buffer.
+    bool deleted = false;
+    for (int i = 0; i < kMergeBufferCount; ++ i) {
+      u32& entry = supporting_surfels[i](cell_x, cell_y);
+      if (entry == kInvalidIndex) {
+        entry = surfel_index;
+        break;
+      } else if (merge_surfels) {
+        // Another surfel was entered at this cell previously. Test whether the
+        // two surfels should be merged.
+        const u32 sup_index = entry;
+        if (SurfelGetNormalCPU(surfels, sup_index).dot(SurfelGetNormalCPU(surfels, surfel_index)) >
+                cos_surfel_merge_normal_threshold) {
+          const float min_radius_sq = std::min(SurfelGetRadiusSquaredCPU(surfels, sup_index),
+                                               SurfelGetRadiusSquaredCPU(surfels, surfel_index));
+          if ((SurfelGetPositionCPU(surfels, sup_index) - SurfelGetPositionCPU(surfels, surfel_index)).squaredNorm() <
+                  min_radius_sq * cell_merge_dist_squared) {
+            surfels(surfel_index, kSurfelX) = numeric_limits<float>::quiet_NaN();
+            deleted = true;
+          }
+        }
+      }
+    }
+    if (deleted) {
+      ++ deleted_count;
+    }
+  }
+  
+  if (merge_surfels) {
+    *surfel_count -= deleted_count;
+  }
+}
+
+}  // namespace
+
+void DetermineSupportingSurfelsCPU(
+    const SurfelProjectionParametersCPU& surfel_projection,
+    Image<u32>* supporting_surfels,
+    int thread_count) {
+  DetermineSupportingSurfelsCPUImpl(
+      /*merge_surfels*/ false,
+      /*merge_dist_factor*/ 0,
+      surfel_projection,
+      supporting_surfels,
+      nullptr,
+      thread_count);
+}
+
+void DetermineSupportingSurfelsAndMergeSurfelsCPU(
+    const SurfelProjectionParametersCPU& surfel_projection,
+    float merge_dist_factor,
+    Image<u32>* supporting_surfels,
+    u32* surfel_count,
+    int thread_count) {
+  DetermineSupportingSurfelsCPUImpl(
+      /*merge_surfels*/ true,
+      merge_dist_factor,
+      surfel_projection,
+      supporting_surfels,
+      surfel_count,
+      thread_count);
+}
+
+}
@@ -0,0 +1,188 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <cmath>
+#include <cstring>
+
+#include <libvis/camera.h>
+#include <libvis/eigen.h>
+#include <libvis/image.h>
+#include <libvis/libvis.h>
+#include <libvis/sophus.h>
+
+#include "badslam/constants.h"
+#include "badslam/depth_parameters_cpu.h"
+#include "badslam/normal_packing.h"
+#include "badslam/robust_weighting.h"
+
+namespace vis {
+
+// Host version of SmallFloatToEightBitSigned() (see util.cuh).
+inline u8 SmallFloatToEightBitSignedCPU(float value) {
+  return static_cast<u8>(static_cast<i8>(value * ((1 << 7) - 1) + ((value > 0) ? 0.5f : -0.5f)));
+}
+
+// Host version of ImageSpaceNormalToU16() (see util.cuh).
+inline u16 ImageSpaceNormalToU16CPU(const Vec3f& normal) {
+  return (static_cast<u16>(SmallFloatToEightBitSignedCPU(normal.x())) << 0) |
+         (static_cast<u16>(SmallFloatToEightBitSignedCPU(normal.y())) << 8);
+}
+
+// Host version of U16ToImageSpaceNormal() (see util.cuh).
+inline Vec3f U16ToImageSpaceNormalCPU(u16 value) {
+  Vec3f result;
+  result.x() = static_cast<i8>(value & 0x00ff) * (1.0f / ((1 << 7) - 1));
+  result.y() = static_cast<i8>((value & 0xff00) >> 8) * (1.0f / ((1 << 7) - 1));
+  float z_squared = 1 - result.x() * result.x() - result.y() * result.y();
+  result.z() = -sqrtf((z_squared > 0.f) ? z_squared : 0.f);
+  return result;
+}
+
+// Host versions of the surfel attribute accessors in util_nvcc_only.cuh. The
+// surfels are given as a host copy of DirectBA's surfel buffer, i.e., an image
+// with one column per surfel and kSurfelAttributeCount rows.
+inline Vec3f SurfelGetPositionCPU(const Image<float>& surfels, u32 surfel_index) {
+  return Vec3f(surfels(surfel_index, kSurfelX),
+               surfels(surfel_index, kSurfelY),
+               surfels(surfel_index, kSurfelZ));
+}
+
+inline void SurfelSetNormalCPU(Image<float>* surfels, u32 surfel_index, const Vec3f& normal) {
+  const u32 value = (SmallFloatToTenBitSigned(normal.x()) << 0) |
+                    (SmallFloatToTenBitSigned(normal.y()) << 10) |
+                    (SmallFloatToTenBitSigned(normal.z()) << 20);
+  memcpy(&(*surfels)(surfel_index, kSurfelNormal), &value, sizeof(value));
+}
+
+inline Vec3f SurfelGetNormalCPU(const Image<float>& surfels, u32 surfel_index) {
+  u32 value;
+  memcpy(&value, &surfels(surfel_index, kSurfelNormal), sizeof(value));
+  return Vec3f(TenBitSignedToFloat(value >> 0),
+               TenBitSignedToFloat(value >> 10),
+               TenBitSignedToFloat(value >> 20)).normalized();
+}
+
+inline float SurfelGetRadiusSquaredCPU(const Image<float>& surfels, u32 surfel_index) {
+  return surfels(surfel_index, kSurfelRadiusSquared);
+}
+
+// Host-side counterpart of SurfelProjectionParameters: the surfels and the
+// keyframe which they are projected into.
+struct SurfelProjectionParametersCPU {
+  // Host copy of the surfel buffer (see SurfelGetPositionCPU()). Only the
+  // first surfels_size columns are used. This is only modified by surfel
+  // merging.
+  Image<float>* surfels;
+  u32 surfels_size;
+  
+  // Host copies of the keyframe's depth and normals buffers.
+  const Image<u16>* depth_buffer;
+  const Image<u16>* normals_buffer;
+  
+  // The depth camera.
+  const PinholeCamera4f* camera;
+  SE3f frame_T_global;
+  
+  // Depth deformation parameters and stereo baseline.
+  const DepthParametersCPU* calibration;
+};
+
+// Result of projecting a surfel into a keyframe.
+struct SurfelProjectionResultCPU {
+  // Local position of the surfel in the keyframe coordinate system.
+  Vec3f surfel_local_position;
+  
+  // Global normal vector of the surfel.
+  Vec3f surfel_normal;
+  
+  // Calibrated depth value of the pixel the surfel projects to.
+  float pixel_calibrated_depth;
+  
+  // Integer coordinates of the pixel the surfel projects to.
+  int px;
+  int py;
+  
+  // Float coordinates of the pixel the surfel projects to ("pixel corner" convention).
+  Vec2f pxy;
+  
+  // Set to true if the surfel is not associated because it lies in front of
+  // the measured depth, i.e., in space that is observed to be free.
+  bool is_free_space_violation;
+};
+
+// Host version of SurfelProjectsToAssociatedPixel() (see
+// surfel_projection_nvcc_only.cuh). Returns true if the surfel projects to a
+// pixel within the image whose measurement it gets associated with, using the
+// same visibility, depth tolerance and normal compatibility
+// (cos_normal_compatibility_threshold) rules as the CUDA code. The result
+// fields are valid up to the check which failed.
+bool SurfelProjectsToAssociatedPixelCPU(
+    u32 surfel_index,
+    const SurfelProjectionParametersCPU& surfel_projection,
+    SurfelProjectionResultCPU* result);
+
+// Projects all surfels into the keyframe. For each surfel, outputs the index
+// (py * width + px) of the pixel it is associated with, or kInvalidIndex if it
+// is not associated with any. The surfels are split into 4 * thread_count
+// contiguous tiles which are assigned to the threads in an interleaved way.
+// thread_count 0 uses DefaultThreadCount().
+void ComputeSurfelAssociationsCPU(
+    const SurfelProjectionParametersCPU& surfel_projection,
+    vector<u32>* associated_pixels,
+    int thread_count = 0);
+
+// Host versions of DetermineSupportingSurfelsCUDA() and
+// DetermineSupportingSurfelsAndMergeSurfelsCUDA(): fills the
+// kMergeBufferCount supporting surfel buffers (one entry per
+// sparse_surfel_cell_size^2 pixel cell; the buffers are resized to the depth
+// image size like the CUDA buffers) with the indices of the surfels associated
+// with each cell, or kInvalidIndex.
+// 
+// The associations are computed in parallel. In contrast to the CUDA kernel,
+// where the order in which surfels are entered depends on the thread
+// scheduling, the buffers are then filled in order of increasing surfel index,
+// which makes the result deterministic.
+void DetermineSupportingSurfelsCPU(
+    const SurfelProjectionParametersCPU& surfel_projection,
+    Image<u32>* supporting_surfels,
+    int thread_count = 0);
+
+// Like DetermineSupportingSurfelsCPU(), but additionally merges surfels that
+// fall into the same cell and have similar normals and positions by setting
+// the x coordinate of the later surfel to NaN. Decreases *surfel_count by the
+// number of merged surfels.
+void DetermineSupportingSurfelsAndMergeSurfelsCPU(
+    const SurfelProjectionParametersCPU& surfel_projection,
+    float merge_dist_factor,
+    Image<u32>* supporting_surfels,
+    u32* surfel_count,
+    int thread_count = 0);
+
+}
@@ -0,0 +1,475 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "badslam/surfel_statistics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <unordered_map>
+
+#include <libvis/logging.h>
+#include <libvis/util.h>
+
+#include "badslam/constants.h"
+#include "badslam/surfel_projection_cpu.h"
+
+namespace vis {
+
+namespace {
+
+// New surfels are only created in the sparse_surfel_cell_size cells of a
+// keyframe which do not observe any existing surfel. This keeps them at least
+// roughly half a cell apart, even without merging.
+constexpr float kCreationSpacingFactor = 0.5f;
+
+// Returns the minimum distance between two compatible surfels, relative to the
+// smaller of their radii, which results from the given settings.
+float SurfelSpacing(const SurfelSettings& settings) {
+  return settings.sparse_surfel_cell_size *
+         std::max(kCreationSpacingFactor, settings.surfel_merge_dist_factor);
+}
+
+inline bool IsValidSurfel(const Image<float>& surfels, u32 surfel_index) {
+  return !std::isnan(surfels(surfel_index, kSurfelX));
+}
+
+inline Vec3i VoxelCoordinates(const Vec3f& position, float voxel_size) {
+  return Vec3i(static_cast<int>(std::floor(position.x() / voxel_size)),
+               static_cast<int>(std::floor(position.y() / voxel_size)),
+               static_cast<int>(std::floor(position.z() / voxel_size)));
+}
+
+// Packs voxel coordinates (in [-2^20, 2^20)) into a hash key.
+inline u64 VoxelKey(const Vec3i& voxel) {
+  constexpr int kOffset = 1 << 20;
+  constexpr u64 kMask = (1 << 21) - 1;
+  return ((static_cast<u64>(voxel.x() + kOffset) & kMask) << 42) |
+         ((static_cast<u64>(voxel.y() + kOffset) & kMask) << 21) |
+         ((static_cast<u64>(voxel.z() + kOffset) & kMask) << 0);
+}
+
+// Returns the index of the power-of-two bin for the given value (>= 1).
+inline usize Log2Bin(usize value) {
+  usize bin = 0;
+  while (value >>= 1) {
+    ++ bin;
+  }
+  return bin;
+}
+
+// Axis-aligned box which contains the frustum of a keyframe's depth camera up
+// to max_depth.
+struct FrustumBounds {
+  Vec3f min;
+  Vec3f max;
+};
+
+FrustumBounds ComputeFrustumBounds(
+    const PinholeCamera4f& camera,
+    const SE3f& global_T_frame,
+    float max_depth) {
+  FrustumBounds bounds;
+  bounds.min = global_T_frame.translation();
+  bounds.max = bounds.min;
+  for (int corner = 0; corner < 4; ++ corner) {
+    const Vec2f pixel((corner & 1) ? camera.width() : 0,
+                      (corner & 2) ? camera.height() : 0);
+    const Vec3f point = global_T_frame * (max_depth * camera.UnprojectFromPixelCornerConv(pixel));
+    bounds.min = bounds.min.cwiseMin(point);
+    bounds.max = bounds.max.cwiseMax(point);
+  }
+  return bounds;
+}
+
+// Greedily thins out the given surfels in the given order, dropping each
+// surfel which has a normal-compatible surfel that was kept before within
+// spacing times the smaller radius of both. Returns the kept surfels.
+vector<u32> ThinOutSurfels(
+    const Image<float>& surfels,
+    const vector<u32>& surfel_indices,
+    float spacing) {
+  if (surfel_indices.empty()) {
+    return vector<u32>();
+  }
+  
+  // Since the distance threshold uses the smaller radius, a surfel only needs
+  // to be compared to the kept surfels within spacing times its own radius.
+  // The grid cell size is chosen such that this usually covers few cells.
+  vector<float> radii(surfel_indices.size());
+  for (usize i = 0; i < surfel_indices.size(); ++ i) {
+    radii[i] = sqrtf(SurfelGetRadiusSquaredCPU(surfels, surfel_indices[i]));
+  }
+  vector<float> sorted_radii = radii;
+  auto radius_90 = sorted_radii.begin() + (9 * sorted_radii.size()) / 10;
+  std::nth_element(sorted_radii.begin(), radius_90, sorted_radii.end());
+  const float cell_size = std::max(1e-4f, spacing * *radius_90);
+  
+  const float spacing_squared = spacing * spacing;
+  unordered_map<u64, vector<u32>> grid;
+  vector<u32> kept;
+  
+  for (usize i = 0; i < surfel_indices.size(); ++ i) {
+    const u32 surfel_index = surfel_indices[i];
+    const Vec3f position = SurfelGetPositionCPU(surfels, surfel_index);
+    const Vec3f normal = SurfelGetNormalCPU(surfels, surfel_index);
+    const float radius_squared = SurfelGetRadiusSquaredCPU(surfels, surfel_index);
+    
+    const float search_radius = spacing * radii[i];
+    const Vec3i min_cell = VoxelCoordinates(position - Vec3f::Constant(search_radius), cell_size);
+    const Vec3i max_cell = VoxelCoordinates(position + Vec3f::Constant(search_radius), cell_size);
+    
+    bool suppressed = false;
+    for (int z = min_cell.z(); z <= max_cell.z() && !suppressed; ++ z) {
+      for (int y = min_cell.y(); y <= max_cell.y() && !suppressed; ++ y) {
+        for (int x = min_cell.x(); x <= max_cell.x() && !suppressed; ++ x) {
+          auto it = grid.find(VoxelKey(Vec3i(x, y, z)));
+          if (it == grid.end()) {
+            continue;
+          }
+          for (u32 other_index : it->second) {
+            const float min_radius_squared =
+                std::min(radius_squared, SurfelGetRadiusSquaredCPU(surfels, other_index));
+            if ((SurfelGetPositionCPU(surfels, other_index) - position).squaredNorm() <
+                    spacing_squared * min_radius_squared &&
+                SurfelGetNormalCPU(surfels, other_index).dot(normal) > cos_normal_compatibility_threshold) {
+              suppressed = true;
+              break;
+            }
+          }
+        }
+      }
+    }
+    
+    if (!suppressed) {
+      grid[VoxelKey(VoxelCoordinates(position, cell_size))].push_back(surfel_index);
+      kept.push_back(surfel_index);
+    }
+  }
+  
+  return kept;
+}
+
+}  // namespace
+
+void ComputeSurfelStatistics(
+    const SurfelStateData& data,
+    const SurfelStatisticsOptions& options,
+    SurfelStatistics* statistics) {
+  const Image<float>& surfels = data.surfels;
+  const u32 surfels_size = surfels.width();
+  const usize keyframe_count = data.keyframe_ids.size();
+  CHECK_EQ(keyframe_count, data.keyframe_global_T_frame.size());
+  const usize thread_count = (options.thread_count > 0) ? options.thread_count : DefaultThreadCount();
+  
+  // Sort the valid surfels by voxel.
+  vector<pair<u64, u32>> voxel_surfels;
+  voxel_surfels.reserve(surfels_size);
+  for (u32 surfel_index = 0; surfel_index < surfels_size; ++ surfel_index) {
+    if (IsValidSurfel(surfels, surfel_index)) {
+      voxel_surfels.emplace_back(
+          VoxelKey(VoxelCoordinates(SurfelGetPositionCPU(surfels, surfel_index), options.voxel_size)),
+          surfel_index);
+    }
+  }
+  std::sort(voxel_surfels.begin(), voxel_surfels.end());
+  statistics->surfel_count = voxel_surfels.size();
+  
+  // Density histogram. voxel_begin contains the start of each voxel's range in
+  // voxel_surfels, followed by the end of the last range.
+  vector<usize> voxel_begin;
+  for (usize i = 0; i < voxel_surfels.size(); ++ i) {
+    if (i == 0 || voxel_surfels[i].first != voxel_surfels[i - 1].first) {
+      voxel_begin.push_back(i);
+    }
+  }
+  const usize voxel_count = voxel_begin.size();
+  voxel_begin.push_back(voxel_surfels.size());
+  
+  statistics->voxel_size = options.voxel_size;
+  statistics->occupied_voxel_count = voxel_count;
+  statistics->voxel_density_histogram.clear();
+  for (usize voxel = 0; voxel < voxel_count; ++ voxel) {
+    const usize bin = Log2Bin(voxel_begin[voxel + 1] - voxel_begin[voxel]);
+    if (bin >= statistics->voxel_density_histogram.size()) {
+      statistics->voxel_density_histogram.resize(bin + 1, 0);
+    }
+    ++ statistics->voxel_density_histogram[bin];
+  }
+  
+  // Radius distribution.
+  constexpr int kRadiusHistogramBinCount = 10;
+  vector<float> radii(voxel_surfels.size());
+  for (usize i = 0; i < voxel_surfels.size(); ++ i) {
+    radii[i] = sqrtf(SurfelGetRadiusSquaredCPU(surfels, voxel_surfels[i].second));
+  }
+  std::sort(radii.begin(), radii.end());
+  statistics->radius_quantiles.assign(kSurfelRadiusQuantileCount, 0);
+  statistics->radius_histogram.assign(kRadiusHistogramBinCount + 1, 0);
+  if (!radii.empty()) {
+    for (int q = 0; q < kSurfelRadiusQuantileCount; ++ q) {
+      statistics->radius_quantiles[q] =
+          radii[static_cast<usize>(kSurfelRadiusQuantiles[q] * (radii.size() - 1) + 0.5f)];
+    }
+    const float radius_99 = statistics->radius_quantiles[4];
+    statistics->radius_histogram_bin_width =
+        (radius_99 > 0) ? (radius_99 / kRadiusHistogramBinCount) : 1;
+    for (float radius : radii) {
+      const int bin = (radius > radius_99) ?
+          kRadiusHistogramBinCount :
+          std::min<int>(kRadiusHistogramBinCount - 1, radius / statistics->radius_histogram_bin_width);
+      ++ statistics->radius_histogram[bin];
+    }
+  }
+  
+  // Observations. The voxels are distributed over the threads, so each thread
+  // writes to distinct surfels. The keyframes are visited in order of their
+  // ids, so the first observing keyframe is also the one with the smallest id.
+  vector<FrustumBounds> frustum_bounds(keyframe_count);
+  vector<SE3f> frame_T_global(keyframe_count);
+  for (usize k = 0; k < keyframe_count; ++ k) {
+    frustum_bounds[k] = ComputeFrustumBounds(data.depth_camera, data.keyframe_global_T_frame[k], data.max_depth);
+    frame_T_global[k] = data.keyframe_global_T_frame[k].inverse();
+  }
+  
+  statistics->observation_counts.assign(surfels_size, 0);
+  vector<vector<usize>> block_observed_counts(thread_count, vector<usize>(keyframe_count, 0));
+  vector<vector<usize>> block_contributed_counts(thread_count, vector<usize>(keyframe_count, 0));
+  ParallelForBlocks(0, voxel_count, thread_count, [&](usize block_index, usize block_begin, usize block_end) {
+    vector<usize>& observed_counts = block_observed_counts[block_index];
+    vector<usize>& contributed_counts = block_contributed_counts[block_index];
+    vector<int> first_observer;
+    
+    for (usize voxel = block_begin; voxel < block_end; ++ voxel) {
+      const usize begin = voxel_begin[voxel];
+      const usize end = voxel_begin[voxel + 1];
+      const Vec3f voxel_min = options.voxel_size * VoxelCoordinates(
+          SurfelGetPositionCPU(surfels, voxel_surfels[begin].second), options.voxel_size).cast<float>();
+      const Vec3f voxel_max = voxel_min + Vec3f::Constant(options.voxel_size);
+      
+      first_observer.assign(end - begin, -1);
+      for (usize k = 0; k < keyframe_count; ++ k) {
+        const FrustumBounds& bounds = frustum_bounds[k];
+        if ((voxel_max.array() < bounds.min.array()).any() ||
+            (voxel_min.array() > bounds.max.array()).any()) {
+          continue;
+        }
+        
+        const Vec3f camera_center = data.keyframe_global_T_frame[k].translation();
+        for (usize i = begin; i < end; ++ i) {
+          const u32 surfel_index = voxel_surfels[i].second;
+          const Vec3f position = SurfelGetPositionCPU(surfels, surfel_index);
+          const Vec3f local_position = frame_T_global[k] * position;
+          if (local_position.z() <= 0 || local_position.z() > data.max_depth) {
+            continue;
+          }
+          Vec2f pixel;
+          if (!data.depth_camera.ProjectToPixelCornerConvIfVisible(local_position, 0, &pixel)) {
+            continue;
+          }
+          if (SurfelGetNormalCPU(surfels, surfel_index).dot(camera_center - position) <= 0) {
+            continue;
+          }
+          
+          u16& observation_count = statistics->observation_counts[surfel_index];
+          if (observation_count < numeric_limits<u16>::max()) {
+            ++ observation_count;
+          }
+          ++ observed_counts[k];
+          if (first_observer[i - begin] < 0) {
+            first_observer[i - begin] = static_cast<int>(k);
+          }
+        }
+      }
+      
+      for (int observer : first_observer) {
+        if (observer >= 0) {
+          ++ contributed_counts[observer];
+        }
+      }
+    }
+  });
+  
+  statistics->keyframe_observed_counts.assign(keyframe_count, 0);
+  statistics->keyframe_contributed_counts.assign(keyframe_count, 0);
+  for (usize block = 0; block < thread_count; ++ block) {
+    for (usize k = 0; k < keyframe_count; ++ k) {
+      statistics->keyframe_observed_counts[k] += block_observed_counts[block][k];
+      statistics->keyframe_contributed_counts[k] += block_contributed_counts[block][k];
+    }
+  }
+  
+  statistics->observation_count = 0;
+  for (u16 count : statistics->observation_counts) {
+    statistics->observation_count += count;
+  }
+}
+
+usize SurfelMemoryBytes(usize surfel_count) {
+  // DirectBA::surfels_ and DirectBA::active_surfels_.
+  return surfel_count * (kSurfelAttributeCount * sizeof(float) + sizeof(u8));
+}
+
+SurfelSettingsPrediction PredictSurfelSettings(
+    const SurfelStateData& data,
+    const SurfelStatistics& statistics,
+    const SurfelSettings& settings) {
+  const Image<float>& surfels = data.surfels;
+  CHECK_EQ(statistics.observation_counts.size(), surfels.width());
+  
+  SurfelSettingsPrediction prediction;
+  prediction.settings = settings;
+  
+  // Surfels with fewer observations than the saved min_observation_count were
+  // deleted already, so a lower count cannot be simulated.
+  const bool filter_observations =
+      settings.min_observation_count > data.settings.min_observation_count;
+  if (settings.min_observation_count < data.settings.min_observation_count) {
+    prediction.extrapolated = true;
+  }
+  
+  // The surfel indices are in creation order (up to compaction).
+  vector<u32> surfel_indices;
+  surfel_indices.reserve(statistics.surfel_count);
+  for (u32 surfel_index = 0; surfel_index < surfels.width(); ++ surfel_index) {
+    if (IsValidSurfel(surfels, surfel_index) &&
+        (!filter_observations ||
+         statistics.observation_counts[surfel_index] >= settings.min_observation_count)) {
+      surfel_indices.push_back(surfel_index);
+    }
+  }
+  
+  const float saved_spacing = SurfelSpacing(data.settings);
+  const float spacing = SurfelSpacing(settings);
+  double scaling = 1;
+  if (spacing > saved_spacing) {
+    surfel_indices = ThinOutSurfels(surfels, surfel_indices, spacing);
+  } else if (spacing < saved_spacing) {
+    // The surfel density per area scales inversely with the squared spacing.
+    scaling = (saved_spacing / spacing) * (saved_spacing / spacing);
+    prediction.extrapolated = true;
+  }
+  
+  usize observation_count = 0;
+  for (u32 surfel_index : surfel_indices) {
+    observation_count += statistics.observation_counts[surfel_index];
+  }
+  
+  prediction.surfel_count = static_cast<usize>(scaling * surfel_indices.size() + 0.5);
+  prediction.observation_count = static_cast<usize>(scaling * observation_count + 0.5);
+  prediction.surfel_memory_bytes = SurfelMemoryBytes(prediction.surfel_count);
+  return prediction;
+}
+
+void PrintSurfelStatistics(
+    const SurfelStateData& data,
+    const SurfelStatistics& statistics,
+    const vector<SurfelSettingsPrediction>& predictions,
+    std::ostream& stream) {
+  constexpr double kMegabyte = 1024 * 1024;
+  const std::ios::fmtflags old_flags = stream.flags();
+  stream << std::fixed << std::setprecision(2);
+  
+  stream << "Surfels: " << statistics.surfel_count << " (max_surfel_count: "
+         << data.max_surfel_count << ", allocating "
+         << (SurfelMemoryBytes(data.max_surfel_count) / kMegabyte) << " MB)" << std::endl;
+  stream << "Saved settings: sparse_surfel_cell_size " << data.settings.sparse_surfel_cell_size
+         << ", surfel_merge_dist_factor " << data.settings.surfel_merge_dist_factor
+         << ", min_observation_count " << data.settings.min_observation_count << std::endl;
+  stream << "Keyframes: " << data.keyframe_ids.size() << std::endl << std::endl;
+  
+  stream << "Surfels per occupied " << statistics.voxel_size << " m voxel ("
+         << statistics.occupied_voxel_count << " voxels):" << std::endl;
+  for (usize bin = 0; bin < statistics.voxel_density_histogram.size(); ++ bin) {
+    stream << "  [" << (1ull << bin) << ", " << (2ull << bin) << "): "
+           << statistics.voxel_density_histogram[bin] << std::endl;
+  }
+  stream << std::endl;
+  
+  if (!statistics.radius_quantiles.empty()) {
+    stream << "Surfel radius (mm): ";
+    for (int q = 0; q < kSurfelRadiusQuantileCount; ++ q) {
+      stream << ((q > 0) ? ", " : "") << static_cast<int>(100 * kSurfelRadiusQuantiles[q] + 0.5f)
+             << "%: " << (1000 * statistics.radius_quantiles[q]);
+    }
+    stream << std::endl;
+    for (usize bin = 0; bin < statistics.radius_histogram.size(); ++ bin) {
+      if (bin + 1 == statistics.radius_histogram.size()) {
+        stream << "  > " << (1000 * statistics.radius_quantiles[4]) << ": ";
+      } else {
+        stream << "  [" << (1000 * bin * statistics.radius_histogram_bin_width) << ", "
+               << (1000 * (bin + 1) * statistics.radius_histogram_bin_width) << "): ";
+      }
+      stream << statistics.radius_histogram[bin] << std::endl;
+    }
+    stream << std::endl;
+  }
+  
+  stream << "Observations per surfel (without occlusion): "
+         << (statistics.observation_count / std::max<double>(1, statistics.surfel_count))
+         << " on average" << std::endl;
+  
+  if (!data.keyframe_ids.empty()) {
+    vector<usize> order(data.keyframe_ids.size());
+    for (usize k = 0; k < order.size(); ++ k) {
+      order[k] = k;
+    }
+    std::sort(order.begin(), order.end(), [&](usize a, usize b) {
+      return statistics.keyframe_contributed_counts[a] > statistics.keyframe_contributed_counts[b];
+    });
+    stream << "Surfels contributed per keyframe: max "
+           << statistics.keyframe_contributed_counts[order.front()] << ", median "
+           << statistics.keyframe_contributed_counts[order[order.size() / 2]] << ", min "
+           << statistics.keyframe_contributed_counts[order.back()] << std::endl;
+    constexpr usize kListedKeyframeCount = 10;
+    for (usize i = 0; i < std::min(kListedKeyframeCount, order.size()); ++ i) {
+      const usize k = order[i];
+      stream << "  keyframe " << data.keyframe_ids[k] << ": contributed "
+             << statistics.keyframe_contributed_counts[k] << ", observes "
+             << statistics.keyframe_observed_counts[k] << std::endl;
+    }
+  }
+  stream << std::endl;
+  
+  if (!predictions.empty()) {
+    stream << "Predictions (cell size, merge factor, min observations: surfels, GPU memory, BA cost relative to the saved state):" << std::endl;
+    for (const SurfelSettingsPrediction& prediction : predictions) {
+      stream << "  " << prediction.settings.sparse_surfel_cell_size << ", "
+             << prediction.settings.surfel_merge_dist_factor << ", "
+             << prediction.settings.min_observation_count << ": "
+             << prediction.surfel_count << ", "
+             << (prediction.surfel_memory_bytes / kMegabyte) << " MB, "
+             << (prediction.observation_count / std::max<double>(1, statistics.observation_count)) << "x"
+             << (prediction.extrapolated ? " (extrapolated)" : "") << std::endl;
+    }
+  }
+  
+  stream.flags(old_flags);
+}
+
+}
@@ -0,0 +1,167 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <ostream>
+#include <vector>
+
+#include <libvis/camera.h>
+#include <libvis/image.h>
+#include <libvis/libvis.h>
+#include <libvis/sophus.h>
+
+namespace vis {
+
+// The settings which determine how many surfels are created and kept (see the
+// corresponding members of BadSlamConfig).
+struct SurfelSettings {
+  int sparse_surfel_cell_size = 4;
+  float surfel_merge_dist_factor = 0.8f;
+  int min_observation_count = 3;
+};
+
+// The surfels of a saved SLAM state together with the keyframe poses and the
+// settings that they were created with. See LoadSurfelStateData() for reading
+// this from a state file without a GPU or the dataset.
+struct SurfelStateData {
+  // Host copy of the surfel buffer (see SurfelGetPositionCPU()) with at least
+  // the rows up to kSurfelRadiusSquared.
+  Image<float> surfels;
+  
+  // Depth camera at the resolution used in BA.
+  PinholeCamera4f depth_camera;
+  
+  // Ids and global_T_frame poses of the keyframes (excluding deleted ones),
+  // sorted by id.
+  vector<int> keyframe_ids;
+  vector<SE3f> keyframe_global_T_frame;
+  
+  SurfelSettings settings;
+  float max_depth = 3.0f;
+  int max_surfel_count = 25 * 1000 * 1000;
+};
+
+struct SurfelStatisticsOptions {
+  // Side length of the voxels (in meters) for the density histogram, which
+  // are also used to find the surfels within the keyframe frusta.
+  float voxel_size = 0.1f;
+  
+  // Number of threads. 0 uses DefaultThreadCount().
+  int thread_count = 0;
+};
+
+struct SurfelStatistics {
+  // Number of valid surfels.
+  usize surfel_count = 0;
+  
+  // Number of voxels (with side length voxel_size) which contain at least one
+  // surfel, and a histogram of the number of surfels per occupied voxel: bin i
+  // counts the voxels with [2^i, 2^(i+1)) surfels.
+  float voxel_size = 0;
+  usize occupied_voxel_count = 0;
+  vector<usize> voxel_density_histogram;
+  
+  // Surfel radius (in meters) at the quantiles in kSurfelRadiusQuantiles, and
+  // a histogram with bins of width radius_histogram_bin_width. The last bin
+  // counts the radii beyond the 99% quantile.
+  vector<float> radius_quantiles;
+  float radius_histogram_bin_width = 0;
+  vector<usize> radius_histogram;
+  
+  // For each surfel: the number of keyframes in whose depth camera frustum it
+  // lies while facing the camera (capped at 65535). Occlusions are not taken
+  // into account, so this is an upper bound on the surfel's observations. Set
+  // to 0 for invalid surfels.
+  vector<u16> observation_counts;
+  
+  // Sum of observation_counts. The GPU work of a BA iteration is roughly
+  // proportional to this.
+  usize observation_count = 0;
+  
+  // For each keyframe in SurfelStateData::keyframe_ids: the number of surfels
+  // it observes, and the number of surfels which it contributed, i.e., whose
+  // first observation it is (since surfels are created for the parts of a new
+  // keyframe which are not observed by any existing surfel).
+  vector<usize> keyframe_observed_counts;
+  vector<usize> keyframe_contributed_counts;
+};
+
+// Quantiles for SurfelStatistics::radius_quantiles.
+constexpr int kSurfelRadiusQuantileCount = 6;
+constexpr float kSurfelRadiusQuantiles[kSurfelRadiusQuantileCount] = {0.f, 0.1f, 0.5f, 0.9f, 0.99f, 1.f};
+
+// Computes the surfel statistics on the CPU.
+void ComputeSurfelStatistics(
+    const SurfelStateData& data,
+    const SurfelStatisticsOptions& options,
+    SurfelStatistics* statistics);
+
+struct SurfelSettingsPrediction {
+  SurfelSettings settings;
+  
+  // Predicted number of surfels, and of the surfel observations (see
+  // SurfelStatistics::observation_count).
+  usize surfel_count = 0;
+  usize observation_count = 0;
+  
+  // GPU memory of the surfel buffers for this many surfels. Note that
+  // DirectBA allocates these buffers for max_surfel_count surfels up front.
+  usize surfel_memory_bytes = 0;
+  
+  // True if the settings create denser or more surfels than the saved ones.
+  // The prediction then scales the statistics of the saved surfels instead of
+  // simulating the settings on them, which is less reliable.
+  bool extrapolated = false;
+};
+
+// Returns the GPU memory of the surfel buffers for the given surfel count.
+usize SurfelMemoryBytes(usize surfel_count);
+
+// Predicts the outcome of reconstructing the saved state with different
+// settings, without running BA:
+// - A larger sparse_surfel_cell_size or surfel_merge_dist_factor is simulated
+//   by greedily thinning out the saved surfels (in creation order) with the
+//   correspondingly larger minimum distance between compatible surfels.
+// - A larger min_observation_count drops the surfels with fewer observations
+//   (see SurfelStatistics::observation_counts).
+// - Denser settings scale the counts with the squared ratio of the surfel
+//   spacings.
+SurfelSettingsPrediction PredictSurfelSettings(
+    const SurfelStateData& data,
+    const SurfelStatistics& statistics,
+    const SurfelSettings& settings);
+
+// Prints the statistics and predictions in human-readable form.
+void PrintSurfelStatistics(
+    const SurfelStateData& data,
+    const SurfelStatistics& statistics,
+    const vector<SurfelSettingsPrediction>& predictions,
+    std::ostream& stream);
+
+}
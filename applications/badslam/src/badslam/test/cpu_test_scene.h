@@ -0,0 +1,141 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <cmath>
+
+#include <libvis/camera.h>
+#include <libvis/eigen.h>
+#include <libvis/image.h>
+#include <libvis/libvis.h>
+#include <libvis/sophus.h>
+
+#include "badslam/keyframe_merging.h"
+
+// Synthetic test scene shared by the tests of the CPU implementations, which
+// replaces the OpenGL-rendered meshes of the CUDA tests such that the tests
+// run without a GPU.
+
+namespace vis {
+
+constexpr float kRawToFloatDepth = 1.f / 1000.f;
+constexpr float kBaselineFx = 40.f;
+
+// Creates a pinhole camera with the given focal length, with the principal
+// point in the image center.
+inline PinholeCamera4f CreateCamera(int width, int height, float focal_length) {
+  const float camera_parameters[4] = {
+      focal_length, focal_length,
+      0.5f * width - 0.5f, 0.5f * height - 0.5f};
+  return PinholeCamera4f(width, height, camera_parameters);
+}
+
+// Converts a depth value to the raw depth format used in the tests.
+inline u16 DepthToRawTestDepth(float depth) {
+  return (depth > 0) ? static_cast<u16>(depth / kRawToFloatDepth + 0.5f) : 0;
+}
+
+// Creates keyframe images of the given size which observe a fronto-parallel
+// plane with the given raw depth and the normal (0, 0, -1). The radius image
+// is set to the given squared radius in half float format, and the color image
+// to a uniform gray value.
+inline void CreatePlaneKeyframeImages(
+    int width, int height, u16 raw_depth, u16 radius_squared_half, u8 gray,
+    KeyframeImageData* images) {
+  images->depth.SetSize(width, height);
+  images->normals.SetSize(width, height);
+  images->radius.SetSize(width, height);
+  images->color.SetSize(width, height);
+  images->depth.SetTo(raw_depth);
+  images->normals.SetTo(static_cast<u16>(0));  // normal (0, 0, -1)
+  images->radius.SetTo(radius_squared_half);
+  images->color.SetTo(Vec4u8(gray, gray, gray, gray));
+}
+
+// A smooth heightmap z = Height(x, y) in global coordinates, textured with
+// Intensity(x, y). The relief determines how strongly the surface varies
+// around base_height; with enough relief, depth residuals alone constrain all
+// pose degrees of freedom of cameras looking along +z.
+struct HeightmapScene {
+  HeightmapScene(float base_height, float relief)
+      : base_height(base_height),
+        relief(relief) {}
+  
+  float Height(float x, float y) const {
+    return base_height + relief * (sinf(3.f * x + 0.5f) * cosf(2.5f * y) + (2.f / 3.f) * sinf(4.f * y - 0.3f) + (1.f / 3.f) * x);
+  }
+  
+  // Returns the surface normal, pointing towards the cameras.
+  Vec3f Normal(float x, float y) const {
+    const float d_dx = relief * (3.f * cosf(3.f * x + 0.5f) * cosf(2.5f * y) + (1.f / 3.f));
+    const float d_dy = relief * (-2.5f * sinf(3.f * x + 0.5f) * sinf(2.5f * y) + (8.f / 3.f) * cosf(4.f * y - 0.3f));
+    return Vec3f(d_dx, d_dy, -1).normalized();
+  }
+  
+  float Intensity(float x, float y) const {
+    return 127.f +
+           50.f * sinf(13.f * x + 1.f) * cosf(11.f * y) +
+           40.f * sinf(17.f * (x + y)) +
+           30.f * cosf(23.f * x - 9.f * y);
+  }
+  
+  // Ray-casts the scene into a camera with the given pose. Returns the depth
+  // and the global surface point for each pixel.
+  void RayCast(
+      const PinholeCamera4f& camera,
+      const SE3f& global_T_image,
+      Image<float>* depth,
+      Image<Vec3f>* points) const {
+    depth->SetSize(camera.width(), camera.height());
+    points->SetSize(camera.width(), camera.height());
+    
+    const Vec3f origin = global_T_image.translation();
+    for (u32 y = 0; y < camera.height(); ++ y) {
+      for (u32 x = 0; x < camera.width(); ++ x) {
+        const Vec3f direction = global_T_image.rotationMatrix() * camera.UnprojectFromPixelCenterConv(Vec2f(x, y));
+        
+        // Fixed-point iteration for the ray parameter, which equals the depth
+        // since the direction has z = 1 in image space.
+        float t = (base_height - origin.z()) / direction.z();
+        for (int i = 0; i < 40; ++ i) {
+          const Vec3f point = origin + t * direction;
+          t = (Height(point.x(), point.y()) - origin.z()) / direction.z();
+        }
+        
+        (*depth)(x, y) = t;
+        (*points)(x, y) = origin + t * direction;
+      }
+    }
+  }
+  
+  float base_height;
+  float relief;
+};
+
+}
@@ -0,0 +1,116 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <gtest/gtest.h>
+#include <libvis/libvis.h>
+
+#include "badslam/ba_window_scheduler.h"
+
+using namespace vis;
+
+namespace {
+
+auto kAllKeyframesExist = [](int /*keyframe_index*/) { return true; };
+
+}
+
+// With a window size of 0, every iteration uses all keyframes (this is the
+// original behavior of the parallel BA thread).
+TEST(BAWindowScheduler, DisabledSchedulesGlobalIterations) {
+  BAWindowScheduler scheduler(0, 0, 0);
+  for (int i = 0; i < 5; ++ i) {
+    BAWindowScheduler::Window window = scheduler.ScheduleIteration(20, kAllKeyframesExist, i);
+    EXPECT_TRUE(window.global);
+    EXPECT_EQ(0, window.active_keyframe_window_start);
+    EXPECT_EQ(19, window.active_keyframe_window_end);
+  }
+  EXPECT_EQ(0, scheduler.local_iteration_count());
+  EXPECT_EQ(5, scheduler.global_iteration_count());
+}
+
+// As long as the map is not larger than the window, all iterations are global.
+TEST(BAWindowScheduler, SmallMapIsGlobal) {
+  BAWindowScheduler scheduler(5, 0, 0);
+  for (int keyframe_count = 1; keyframe_count <= 5; ++ keyframe_count) {
+    BAWindowScheduler::Window window = scheduler.ScheduleIteration(keyframe_count, kAllKeyframesExist, 0);
+    EXPECT_TRUE(window.global);
+    EXPECT_EQ(0, window.active_keyframe_window_start);
+    EXPECT_EQ(keyframe_count - 1, window.active_keyframe_window_end);
+  }
+  
+  BAWindowScheduler::Window window = scheduler.ScheduleIteration(6, kAllKeyframesExist, 0);
+  EXPECT_FALSE(window.global);
+  EXPECT_EQ(1, window.active_keyframe_window_start);
+  EXPECT_EQ(5, window.active_keyframe_window_end);
+}
+
+// Deleted keyframes must not count towards the window size.
+TEST(BAWindowScheduler, WindowSkipsDeletedKeyframes) {
+  BAWindowScheduler scheduler(3, 0, 0);
+  auto keyframe_exists = [](int keyframe_index) {
+    return keyframe_index != 8 && keyframe_index != 7;
+  };
+  BAWindowScheduler::Window window = scheduler.ScheduleIteration(10, keyframe_exists, 0);
+  EXPECT_FALSE(window.global);
+  EXPECT_EQ(5, window.active_keyframe_window_start);
+  EXPECT_EQ(9, window.active_keyframe_window_end);
+}
+
+TEST(BAWindowScheduler, GlobalIterationInterval) {
+  BAWindowScheduler scheduler(4, 3, 0);
+  vector<bool> expected_global = {false, false, true, false, false, true, false};
+  for (usize i = 0; i < expected_global.size(); ++ i) {
+    BAWindowScheduler::Window window = scheduler.ScheduleIteration(100, kAllKeyframesExist, 0);
+    EXPECT_EQ(expected_global[i], window.global) << "iteration " << i;
+    if (!window.global) {
+      EXPECT_EQ(96, window.active_keyframe_window_start);
+      EXPECT_EQ(99, window.active_keyframe_window_end);
+    }
+  }
+  EXPECT_EQ(5, scheduler.local_iteration_count());
+  EXPECT_EQ(2, scheduler.global_iteration_count());
+}
+
+TEST(BAWindowScheduler, GlobalTimeInterval) {
+  BAWindowScheduler scheduler(4, 0, 2.f);
+  // The time origin is set by the first call.
+  EXPECT_FALSE(scheduler.ScheduleIteration(100, kAllKeyframesExist, 10.0).global);
+  EXPECT_FALSE(scheduler.ScheduleIteration(100, kAllKeyframesExist, 11.0).global);
+  EXPECT_FALSE(scheduler.ScheduleIteration(100, kAllKeyframesExist, 11.9).global);
+  EXPECT_TRUE(scheduler.ScheduleIteration(100, kAllKeyframesExist, 12.0).global);
+  EXPECT_FALSE(scheduler.ScheduleIteration(100, kAllKeyframesExist, 13.0).global);
+  EXPECT_TRUE(scheduler.ScheduleIteration(100, kAllKeyframesExist, 14.5).global);
+}
+
+TEST(BAWindowScheduler, LoopClosureTriggersOneGlobalIteration) {
+  BAWindowScheduler scheduler(4, 0, 0);
+  EXPECT_FALSE(scheduler.ScheduleIteration(100, kAllKeyframesExist, 0).global);
+  scheduler.NotifyLoopClosure();
+  EXPECT_TRUE(scheduler.ScheduleIteration(100, kAllKeyframesExist, 0).global);
+  EXPECT_FALSE(scheduler.ScheduleIteration(100, kAllKeyframesExist, 0).global);
+}
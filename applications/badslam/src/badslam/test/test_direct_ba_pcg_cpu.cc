@@ -0,0 +1,344 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <cmath>
+
+#include <gtest/gtest.h>
+#include <libvis/libvis.h>
+#include <libvis/sophus.h>
+
+#include "badslam/constants.h"
+#include "badslam/direct_ba_pcg_cpu.h"
+#include "badslam/surfel_projection_cpu.h"
+#include "badslam/test/cpu_test_scene.h"
+
+using namespace vis;
+
+namespace {
+
+constexpr int kWidth = 96;
+constexpr int kHeight = 72;
+constexpr int kKeyframeCount = 4;
+
+// With enough relief to constrain all pose degrees of freedom with depth
+// residuals only.
+const HeightmapScene kScene(/*base_height*/ 2.f, /*relief*/ 0.15f);
+
+// Ray-casts the scene into the depth and normals buffers of a keyframe.
+void RenderKeyframe(
+    const PinholeCamera4f& camera,
+    const SE3f& global_T_frame,
+    Image<u16>* depth,
+    Image<u16>* normals) {
+  Image<float> float_depth;
+  Image<Vec3f> points;
+  kScene.RayCast(camera, global_T_frame, &float_depth, &points);
+  
+  depth->SetSize(camera.width(), camera.height());
+  normals->SetSize(camera.width(), camera.height());
+  const Mat3f frame_R_global = global_T_frame.rotationMatrix().transpose();
+  for (u32 y = 0; y < camera.height(); ++ y) {
+    for (u32 x = 0; x < camera.width(); ++ x) {
+      const Vec3f& point = points(x, y);
+      (*depth)(x, y) = DepthToRawTestDepth(float_depth(x, y));
+      (*normals)(x, y) = ImageSpaceNormalToU16CPU(frame_R_global * kScene.Normal(point.x(), point.y()));
+    }
+  }
+}
+
+struct TestScene {
+  TestScene()
+      : camera(CreateCamera(kWidth, kHeight, /*focal_length*/ 70)) {
+    calibration.raw_to_float_depth = kRawToFloatDepth;
+    calibration.baseline_fx = kBaselineFx;
+    
+    for (int i = 0; i < kKeyframeCount; ++ i) {
+      const float f = i - 0.5f * (kKeyframeCount - 1);
+      ground_truth_global_T_frame.push_back(
+          SE3f(SO3f::exp(Vec3f(0.03f * f, -0.04f * f, 0.02f * f)),
+               Vec3f(0.06f * f, 0.03f * f * f, 0.02f * f)));
+    }
+    
+    depth.resize(kKeyframeCount);
+    normals.resize(kKeyframeCount);
+    keyframes.resize(kKeyframeCount);
+    for (int i = 0; i < kKeyframeCount; ++ i) {
+      RenderKeyframe(camera, ground_truth_global_T_frame[i], &depth[i], &normals[i]);
+      keyframes[i].global_T_frame = ground_truth_global_T_frame[i];
+      keyframes[i].depth_buffer = &depth[i];
+      keyframes[i].normals_buffer = &normals[i];
+    }
+    
+    // Surfels on a regular grid on the scene surface.
+    constexpr int kGridWidth = 36;
+    constexpr int kGridHeight = 28;
+    surfels.SetSize(kGridWidth * kGridHeight, kSurfelAttributeCount);
+    surfels.SetTo(0.f);
+    surfels_size = 0;
+    for (int gy = 0; gy < kGridHeight; ++ gy) {
+      for (int gx = 0; gx < kGridWidth; ++ gx) {
+        const float x = 0.025f * (gx - 0.5f * (kGridWidth - 1));
+        const float y = 0.025f * (gy - 0.5f * (kGridHeight - 1));
+        const u32 index = surfels_size ++;
+        surfels(index, kSurfelX) = x;
+        surfels(index, kSurfelY) = y;
+        surfels(index, kSurfelZ) = kScene.Height(x, y);
+        SurfelSetNormalCPU(&surfels, index, kScene.Normal(x, y));
+        surfels(index, kSurfelRadiusSquared) = 0.01f * 0.01f;
+      }
+    }
+  }
+  
+  // Perturbs all keyframe poses except for the first one, and moves the
+  // surfels along their normals.
+  void Perturb() {
+    srand(0);
+    for (int i = 1; i < kKeyframeCount; ++ i) {
+      const Vec3f rotation = 0.01f * Vec3f::Random();
+      const Vec3f translation = 0.015f * Vec3f::Random();
+      keyframes[i].global_T_frame = SE3f(SO3f::exp(rotation), translation) * ground_truth_global_T_frame[i];
+    }
+    for (u32 i = 0; i < surfels_size; ++ i) {
+      const float offset = 0.01f * (static_cast<int>((i * 7919) % 101) - 50) / 50.f;
+      const Vec3f position = SurfelGetPositionCPU(surfels, i) + offset * SurfelGetNormalCPU(surfels, i);
+      surfels(i, kSurfelX) = position.x();
+      surfels(i, kSurfelY) = position.y();
+      surfels(i, kSurfelZ) = position.z();
+    }
+  }
+  
+  vector<BundleAdjustmentKeyframeCPU*> KeyframePointers() {
+    vector<BundleAdjustmentKeyframeCPU*> result;
+    for (BundleAdjustmentKeyframeCPU& keyframe : keyframes) {
+      result.push_back(&keyframe);
+    }
+    return result;
+  }
+  
+  double Cost() {
+    vector<BundleAdjustmentKeyframeCPU*> pointers = KeyframePointers();
+    return ComputeBundleAdjustmentCostCPU(pointers, camera, calibration, surfels_size, surfels, /*thread_count*/ 1);
+  }
+  
+  float MaxPoseError(int keyframe_index) const {
+    const SE3f error = ground_truth_global_T_frame[keyframe_index].inverse() * keyframes[keyframe_index].global_T_frame;
+    return std::max(error.translation().norm(), error.so3().log().norm());
+  }
+  
+  // Mean distance of the surfels to the scene surface, measured along z.
+  float MeanSurfelError() const {
+    double sum = 0;
+    for (u32 i = 0; i < surfels_size; ++ i) {
+      const Vec3f position = SurfelGetPositionCPU(surfels, i);
+      sum += fabs(position.z() - kScene.Height(position.x(), position.y()));
+    }
+    return sum / surfels_size;
+  }
+  
+  PinholeCamera4f camera;
+  DepthParametersCPU calibration;
+  vector<SE3f> ground_truth_global_T_frame;
+  vector<Image<u16>> depth;
+  vector<Image<u16>> normals;
+  vector<BundleAdjustmentKeyframeCPU> keyframes;
+  Image<float> surfels;
+  u32 surfels_size;
+};
+
+}  // namespace
+
+TEST(DirectBAPCGCPU, JointOptimizationConverges) {
+  TestScene scene;
+  const double ground_truth_cost = scene.Cost();
+  scene.Perturb();
+  const double initial_cost = scene.Cost();
+  EXPECT_GT(initial_cost, ground_truth_cost);
+  
+  BundleAdjustmentPCGOptionsCPU options;
+  options.max_iterations = 15;
+  options.max_inner_iterations = 50;
+  options.thread_count = 3;
+  BundleAdjustmentPCGSummaryCPU summary;
+  vector<BundleAdjustmentKeyframeCPU*> keyframes = scene.KeyframePointers();
+  ASSERT_TRUE(BundleAdjustmentPCGCPU(
+      options, keyframes, &scene.camera, &scene.calibration,
+      scene.surfels_size, &scene.surfels, &summary));
+  
+  EXPECT_EQ(kKeyframeCount, summary.keyframe_count);
+  EXPECT_EQ(6 * (kKeyframeCount - 1) + scene.surfels_size, summary.unknown_count);
+  EXPECT_LT(scene.Cost(), 0.1 * initial_cost);
+  EXPECT_EQ(0.f, scene.MaxPoseError(0));
+  for (int i = 1; i < kKeyframeCount; ++ i) {
+    EXPECT_LT(scene.MaxPoseError(i), 2e-3f) << i;
+  }
+  EXPECT_LT(scene.MeanSurfelError(), 1e-3f);
+}
+
+TEST(DirectBAPCGCPU, DeletedKeyframesAreSkipped) {
+  TestScene scene;
+  scene.Perturb();
+  
+  // Delete the first keyframe (such that the gauge is fixed with the next
+  // one) and insert deleted keyframes in between the others.
+  vector<BundleAdjustmentKeyframeCPU*> keyframes = scene.KeyframePointers();
+  keyframes[0] = nullptr;
+  keyframes.insert(keyframes.begin() + 2, nullptr);
+  keyframes.push_back(nullptr);
+  const SE3f gauge_pose = scene.keyframes[1].global_T_frame;
+  
+  BundleAdjustmentPCGOptionsCPU options;
+  options.max_iterations = 15;
+  options.max_inner_iterations = 50;
+  options.thread_count = 2;
+  BundleAdjustmentPCGSummaryCPU summary;
+  ASSERT_TRUE(BundleAdjustmentPCGCPU(
+      options, keyframes, &scene.camera, &scene.calibration,
+      scene.surfels_size, &scene.surfels, &summary));
+  
+  EXPECT_EQ(kKeyframeCount - 1, summary.keyframe_count);
+  EXPECT_EQ(6 * (kKeyframeCount - 2) + scene.surfels_size, summary.unknown_count);
+  EXPECT_TRUE(gauge_pose.matrix() == scene.keyframes[1].global_T_frame.matrix());
+  
+  // The remaining keyframes get consistent relative poses.
+  for (int i = 2; i < kKeyframeCount; ++ i) {
+    const SE3f error =
+        (scene.ground_truth_global_T_frame[1].inverse() * scene.ground_truth_global_T_frame[i]).inverse() *
+        (scene.keyframes[1].global_T_frame.inverse() * scene.keyframes[i].global_T_frame);
+    EXPECT_LT(error.translation().norm(), 2e-3f) << i;
+    EXPECT_LT(error.so3().log().norm(), 2e-3f) << i;
+  }
+  
+  // Only deleted keyframes.
+  vector<BundleAdjustmentKeyframeCPU*> no_keyframes(3, nullptr);
+  EXPECT_FALSE(BundleAdjustmentPCGCPU(
+      options, no_keyframes, &scene.camera, &scene.calibration,
+      scene.surfels_size, &scene.surfels, &summary));
+}
+
+// Compares the joint optimization with an alternating optimization of the
+// poses and the geometry (as in DirectBA::BundleAdjustmentAlternating()),
+// which is run with the same solver by toggling the optimized unknowns.
+TEST(DirectBAPCGCPU, AgreesWithAlternatingOptimization) {
+  TestScene joint_scene;
+  joint_scene.Perturb();
+  TestScene alternating_scene;
+  alternating_scene.Perturb();
+  
+  BundleAdjustmentPCGOptionsCPU options;
+  options.max_iterations = 15;
+  options.max_inner_iterations = 50;
+  options.thread_count = 1;
+  vector<BundleAdjustmentKeyframeCPU*> joint_keyframes = joint_scene.KeyframePointers();
+  ASSERT_TRUE(BundleAdjustmentPCGCPU(
+      options, joint_keyframes, &joint_scene.camera, &joint_scene.calibration,
+      joint_scene.surfels_size, &joint_scene.surfels));
+  
+  vector<BundleAdjustmentKeyframeCPU*> alternating_keyframes = alternating_scene.KeyframePointers();
+  for (int iteration = 0; iteration < 30; ++ iteration) {
+    options.max_iterations = 1;
+    options.optimize_poses = false;
+    options.optimize_geometry = true;
+    ASSERT_TRUE(BundleAdjustmentPCGCPU(
+        options, alternating_keyframes, &alternating_scene.camera, &alternating_scene.calibration,
+        alternating_scene.surfels_size, &alternating_scene.surfels));
+    options.optimize_poses = true;
+    options.optimize_geometry = false;
+    ASSERT_TRUE(BundleAdjustmentPCGCPU(
+        options, alternating_keyframes, &alternating_scene.camera, &alternating_scene.calibration,
+        alternating_scene.surfels_size, &alternating_scene.surfels));
+  }
+  
+  const double joint_cost = joint_scene.Cost();
+  const double alternating_cost = alternating_scene.Cost();
+  EXPECT_LT(joint_cost, 1.05 * alternating_cost);
+  for (int i = 1; i < kKeyframeCount; ++ i) {
+    const SE3f difference = joint_scene.keyframes[i].global_T_frame.inverse() * alternating_scene.keyframes[i].global_T_frame;
+    EXPECT_LT(difference.translation().norm(), 2e-3f) << i;
+    EXPECT_LT(difference.so3().log().norm(), 2e-3f) << i;
+  }
+}
+
+TEST(DirectBAPCGCPU, ResultIndependentOfThreadCount) {
+  TestScene scenes[2];
+  const int thread_counts[2] = {1, 5};
+  for (int run = 0; run < 2; ++ run) {
+    scenes[run].Perturb();
+    BundleAdjustmentPCGOptionsCPU options;
+    options.max_iterations = 3;
+    options.max_inner_iterations = 20;
+    options.thread_count = thread_counts[run];
+    vector<BundleAdjustmentKeyframeCPU*> keyframes = scenes[run].KeyframePointers();
+    ASSERT_TRUE(BundleAdjustmentPCGCPU(
+        options, keyframes, &scenes[run].camera, &scenes[run].calibration,
+        scenes[run].surfels_size, &scenes[run].surfels));
+  }
+  
+  for (int i = 0; i < kKeyframeCount; ++ i) {
+    const SE3f difference = scenes[0].keyframes[i].global_T_frame.inverse() * scenes[1].keyframes[i].global_T_frame;
+    EXPECT_LT(difference.log().norm(), 1e-5f) << i;
+  }
+  for (u32 i = 0; i < scenes[0].surfels_size; ++ i) {
+    EXPECT_NEAR(scenes[0].surfels(i, kSurfelZ), scenes[1].surfels(i, kSurfelZ), 1e-5f) << i;
+  }
+}
+
+TEST(DirectBAPCGCPU, DepthIntrinsics) {
+  TestScene scene;
+  scene.calibration.sparse_surfel_cell_size = 24;
+  scene.calibration.cfactor.SetSize(kWidth / 24, kHeight / 24);
+  scene.calibration.cfactor.SetTo(0.f);
+  
+  // Start with a wrong focal length.
+  const float ground_truth_fx = scene.camera.parameters()[0];
+  const float wrong_parameters[4] = {
+      1.03f * ground_truth_fx, scene.camera.parameters()[1],
+      scene.camera.parameters()[2], scene.camera.parameters()[3]};
+  scene.camera = PinholeCamera4f(kWidth, kHeight, wrong_parameters);
+  const double initial_cost = scene.Cost();
+  
+  BundleAdjustmentPCGOptionsCPU options;
+  options.optimize_poses = false;
+  options.optimize_geometry = false;
+  options.optimize_depth_intrinsics = true;
+  options.max_iterations = 10;
+  options.max_inner_iterations = 50;
+  options.thread_count = 2;
+  vector<BundleAdjustmentKeyframeCPU*> keyframes = scene.KeyframePointers();
+  ASSERT_TRUE(BundleAdjustmentPCGCPU(
+      options, keyframes, &scene.camera, &scene.calibration,
+      scene.surfels_size, &scene.surfels));
+  
+  EXPECT_LT(scene.Cost(), initial_cost);
+  EXPECT_LT(fabs(scene.camera.parameters()[0] - ground_truth_fx), 0.01f * ground_truth_fx);
+  
+  // Optimizing the depth intrinsics requires cfactors.
+  scene.calibration.cfactor = Image<float>();
+  EXPECT_FALSE(BundleAdjustmentPCGCPU(
+      options, keyframes, &scene.camera, &scene.calibration,
+      scene.surfels_size, &scene.surfels));
+}
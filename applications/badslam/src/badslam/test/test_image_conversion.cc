@@ -0,0 +1,98 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <gtest/gtest.h>
+#include <libvis/image.h>
+#include <libvis/libvis.h>
+#include <opencv2/core.hpp>
+
+#include "badslam/brightness.h"
+#include "badslam/image_conversion.h"
+
+using namespace vis;
+
+TEST(ImageConversion, RGBToBrightness) {
+  // Use a width which is not divisible by the block size of the conversion to
+  // also test the handling of the remaining pixels.
+  constexpr int kWidth = 37;
+  constexpr int kHeight = 29;
+  
+  srand(0);
+  Image<Vec3u8> rgb_image(kWidth, kHeight);
+  for (int y = 0; y < kHeight; ++ y) {
+    for (int x = 0; x < kWidth; ++ x) {
+      rgb_image(x, y) = Vec3u8(rand() % 256, rand() % 256, rand() % 256);
+    }
+  }
+  rgb_image(0, 0) = Vec3u8(0, 0, 0);
+  rgb_image(1, 0) = Vec3u8(255, 255, 255);
+  rgb_image(2, 0) = Vec3u8(0, 255, 0);
+  rgb_image(kWidth - 1, 0) = Vec3u8(255, 0, 0);
+  
+  Image<u8> gray_image(kWidth, kHeight);
+  ConvertRGBToBrightness(rgb_image, &gray_image);
+  
+  // The fixed-point conversion may differ by one from the floating-point one.
+  for (int y = 0; y < kHeight; ++ y) {
+    for (int x = 0; x < kWidth; ++ x) {
+      const Vec3u8& color = rgb_image(x, y);
+      EXPECT_NEAR(ComputeBrightness(color.x(), color.y(), color.z()), gray_image(x, y), 1)
+          << "at (" << x << ", " << y << ")";
+    }
+  }
+  EXPECT_EQ(0, gray_image(0, 0));
+  EXPECT_EQ(255, gray_image(1, 0));
+  // The brightness of 149.685 must be truncated, not rounded.
+  EXPECT_EQ(149, gray_image(2, 0));
+  EXPECT_EQ(76, gray_image(kWidth - 1, 0));
+}
+
+TEST(ImageConversion, SampleKeypointDepths) {
+  Image<u16> depth_image(4, 3);
+  for (int y = 0; y < 3; ++ y) {
+    for (int x = 0; x < 4; ++ x) {
+      depth_image(x, y) = 1000 + 10 * y + x;
+    }
+  }
+  depth_image(2, 1) = 0;
+  
+  vector<cv::KeyPoint> keypoints(5);
+  keypoints[0].pt = cv::Point2f(1.7f, 0.2f);
+  keypoints[1].pt = cv::Point2f(2.5f, 1.9f);  // no depth measurement
+  keypoints[2].pt = cv::Point2f(-3.f, 2.5f);  // clamped to x = 0
+  keypoints[3].pt = cv::Point2f(10.f, 1.f);  // clamped to x = 3
+  keypoints[4].pt = cv::Point2f(1e10f, -1e10f);  // clamped to (3, 0)
+  
+  SampleKeypointDepths(depth_image, 0.001f, &keypoints);
+  
+  EXPECT_FLOAT_EQ(1.001f, keypoints[0].response);
+  EXPECT_FLOAT_EQ(0.f, keypoints[1].response);
+  EXPECT_FLOAT_EQ(1.020f, keypoints[2].response);
+  EXPECT_FLOAT_EQ(1.013f, keypoints[3].response);
+  EXPECT_FLOAT_EQ(1.003f, keypoints[4].response);
+}
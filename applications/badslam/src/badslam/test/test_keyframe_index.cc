@@ -0,0 +1,176 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <cmath>
+
+#include <gtest/gtest.h>
+#include <libvis/libvis.h>
+
+#include "badslam/keyframe_index.h"
+
+using namespace vis;
+
+namespace {
+// Computes the L1 score of two L1-normalized vectors directly.
+double L1Score(const KeyframeIndex::BowVector& a, const KeyframeIndex::BowVector& b) {
+  double distance = 0;
+  for (const auto& item : a) {
+    auto it = b.find(item.first);
+    distance += fabs(item.second - ((it == b.end()) ? 0 : it->second));
+  }
+  for (const auto& item : b) {
+    if (a.count(item.first) == 0) {
+      distance += fabs(item.second);
+    }
+  }
+  return 1 - 0.5 * distance;
+}
+
+KeyframeIndex::BowVector RandomBowVector(int num_words, int vocabulary_size) {
+  KeyframeIndex::BowVector vector;
+  double sum = 0;
+  while (vector.size() < static_cast<usize>(num_words)) {
+    double weight = 0.1 + (rand() % 100) / 100.0;
+    if (vector.emplace(rand() % vocabulary_size, weight).second) {
+      sum += weight;
+    }
+  }
+  for (auto& item : vector) {
+    item.second /= sum;
+  }
+  return vector;
+}
+}
+
+TEST(KeyframeIndex, MatchesDirectScoring) {
+  srand(0);
+  constexpr int kEntryCount = 200;
+  
+  KeyframeIndex index;
+  vector<KeyframeIndex::BowVector> entries;
+  for (int i = 0; i < kEntryCount; ++ i) {
+    entries.push_back(RandomBowVector(30, 500));
+    EXPECT_EQ(static_cast<KeyframeIndex::EntryId>(i), index.Add(entries.back()));
+  }
+  
+  KeyframeIndex::BowVector query = RandomBowVector(30, 500);
+  vector<KeyframeIndex::Result> results;
+  index.Query(query, /*max_results*/ 0, /*max_id*/ -1, &results);
+  ASSERT_FALSE(results.empty());
+  
+  for (usize i = 0; i < results.size(); ++ i) {
+    EXPECT_NEAR(L1Score(query, entries[results[i].id]), results[i].score, 1e-6);
+    if (i > 0) {
+      EXPECT_GE(results[i - 1].score, results[i].score);
+    }
+  }
+  
+  // Querying with an entry's own vector must return that entry first.
+  index.Query(entries[42], /*max_results*/ 5, /*max_id*/ -1, &results);
+  ASSERT_EQ(5u, results.size());
+  EXPECT_EQ(42u, results[0].id);
+  EXPECT_NEAR(1.0, results[0].score, 1e-6);
+  
+  // max_id excludes the entry and all later ones.
+  index.Query(entries[42], /*max_results*/ 0, /*max_id*/ 42, &results);
+  for (const KeyframeIndex::Result& result : results) {
+    EXPECT_LT(result.id, 42u);
+  }
+}
+
+TEST(KeyframeIndex, RemovalAndCompaction) {
+  KeyframeIndex index(/*max_query_words*/ 0, /*max_posting_list_length*/ 0, /*compaction_threshold*/ 0.5f);
+  
+  KeyframeIndex::BowVector a = {{1, 0.5}, {2, 0.5}};
+  KeyframeIndex::BowVector b = {{1, 0.25}, {3, 0.75}};
+  KeyframeIndex::BowVector c = {{1, 0.5}, {4, 0.5}};
+  index.Add(a);
+  index.Add(b);
+  index.Add(c);
+  EXPECT_EQ(6u, index.posting_count());
+  
+  vector<KeyframeIndex::Result> results;
+  index.Query(a, 0, -1, &results);
+  EXPECT_EQ(3u, results.size());
+  
+  // Lazy deletion: the postings stay until compaction.
+  index.Remove(0);
+  EXPECT_TRUE(index.is_removed(0));
+  EXPECT_EQ(6u, index.posting_count());
+  EXPECT_EQ(2u, index.removed_posting_count());
+  index.Query(a, 0, -1, &results);
+  ASSERT_EQ(2u, results.size());
+  EXPECT_EQ(2u, results[0].id);
+  EXPECT_EQ(1u, results[1].id);
+  
+  // Removing more than half of the postings triggers compaction.
+  index.Remove(2);
+  EXPECT_EQ(2u, index.posting_count());
+  EXPECT_EQ(0u, index.removed_posting_count());
+  index.Query(a, 0, -1, &results);
+  ASSERT_EQ(1u, results.size());
+  EXPECT_EQ(1u, results[0].id);
+  
+  // Ids continue after removals.
+  EXPECT_EQ(3u, index.Add(a));
+}
+
+TEST(KeyframeIndex, MaxQueryWords) {
+  KeyframeIndex index(/*max_query_words*/ 1);
+  index.Add({{1, 0.5}, {2, 0.5}});
+  index.Add({{2, 0.2}, {3, 0.8}});
+  
+  // Only the word with the highest query weight (3) is scored.
+  vector<KeyframeIndex::Result> results;
+  index.Query({{2, 0.4}, {3, 0.6}}, 0, -1, &results);
+  ASSERT_EQ(1u, results.size());
+  EXPECT_EQ(1u, results[0].id);
+  EXPECT_NEAR(0.6, results[0].score, 1e-6);
+}
+
+TEST(KeyframeIndex, StopWords) {
+  KeyframeIndex index(/*max_query_words*/ 0, /*max_posting_list_length*/ 2);
+  index.Add({{1, 0.5}, {2, 0.5}});
+  index.Add({{1, 0.5}, {3, 0.5}});
+  index.Add({{1, 0.5}, {4, 0.5}});
+  
+  // Word 1 occurs in all three entries and is not scored.
+  vector<KeyframeIndex::Result> results;
+  index.Query({{1, 0.5}, {3, 0.5}}, 0, -1, &results);
+  ASSERT_EQ(1u, results.size());
+  EXPECT_EQ(1u, results[0].id);
+  EXPECT_NEAR(0.5, results[0].score, 1e-6);
+  
+  // Restricted to the first two entries, the word is scored again.
+  index.Query({{1, 0.5}, {3, 0.5}}, 0, /*max_id*/ 2, &results);
+  ASSERT_EQ(2u, results.size());
+  EXPECT_EQ(1u, results[0].id);
+  EXPECT_NEAR(1.0, results[0].score, 1e-6);
+  EXPECT_EQ(0u, results[1].id);
+  EXPECT_NEAR(0.5, results[1].score, 1e-6);
+}
@@ -0,0 +1,189 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <gtest/gtest.h>
+#include <libvis/libvis.h>
+
+#include "badslam/constants.h"
+#include "badslam/keyframe_merging.h"
+#include "badslam/test/cpu_test_scene.h"
+
+using namespace vis;
+
+namespace {
+
+constexpr int kWidth = 64;
+constexpr int kHeight = 48;
+
+PinholeCamera4f CreateTestCamera() {
+  const float camera_parameters[4] = {50, 50, 32, 24};
+  return PinholeCamera4f(kWidth, kHeight, camera_parameters);
+}
+
+// Squared radius of the keyframe images, 1 / 64, which is exactly representable
+// as a half float.
+constexpr u16 kRadiusSquaredHalf = 0x2400;
+
+}  // namespace
+
+TEST(KeyframeMerging, DepthCalibrationRoundTrip) {
+  DepthParametersCPU calibration;
+  calibration.raw_to_float_depth = 1 / 1000.f;
+  calibration.a = 0.5f;
+  calibration.sparse_surfel_cell_size = 2;
+  calibration.cfactor.SetSize(kWidth / 2, kHeight / 2);
+  calibration.cfactor.SetTo(0.01f);
+  
+  for (u16 raw_depth = 500; raw_depth < 8000; raw_depth += 250) {
+    const float depth = calibration.RawToDepth(5, 7, raw_depth);
+    EXPECT_NE(raw_depth * calibration.raw_to_float_depth, depth);
+    EXPECT_EQ(raw_depth, calibration.DepthToRaw(5, 7, depth));
+  }
+}
+
+TEST(KeyframeMerging, Coverage) {
+  const PinholeCamera4f camera = CreateTestCamera();
+  DepthParametersCPU calibration;
+  KeyframeMergeOptions options;
+  options.coverage_sample_step = 1;
+  
+  KeyframeImageData images;
+  CreatePlaneKeyframeImages(kWidth, kHeight, 2000, kRadiusSquaredHalf, 128, &images);
+  
+  // A neighbor at the same pose which observes the same plane covers the
+  // keyframe completely.
+  KeyframeImageData same_images;
+  CreatePlaneKeyframeImages(kWidth, kHeight, 2000, kRadiusSquaredHalf, 128, &same_images);
+  // A neighbor which observes a different surface does not cover it.
+  KeyframeImageData other_surface_images;
+  CreatePlaneKeyframeImages(kWidth, kHeight, 3000, kRadiusSquaredHalf, 128, &other_surface_images);
+  
+  vector<KeyframeMergeNeighbor> neighbors = {{&other_surface_images, SE3f()}};
+  KeyframeCoverage coverage = ComputeKeyframeCoverage(
+      images, SE3f(), neighbors, camera, calibration, options);
+  EXPECT_EQ(0, coverage.coverage);
+  EXPECT_EQ(-1, coverage.best_neighbor);
+  
+  neighbors.push_back({&same_images, SE3f()});
+  coverage = ComputeKeyframeCoverage(
+      images, SE3f(), neighbors, camera, calibration, options);
+  EXPECT_EQ(1, coverage.coverage);
+  EXPECT_EQ(1, coverage.best_neighbor);
+  EXPECT_EQ(1, coverage.best_neighbor_overlap);
+  
+  // A neighbor which is shifted sideways by half of the plane's visible width
+  // (at a depth of 2, the image is 2 * 64 / 50 = 2.56 wide) only covers about
+  // half of the keyframe.
+  neighbors = {{&same_images, SE3f(Mat3f::Identity(), Vec3f(1.28f, 0, 0))}};
+  coverage = ComputeKeyframeCoverage(
+      images, SE3f(), neighbors, camera, calibration, options);
+  EXPECT_NEAR(0.5f, coverage.coverage, 0.05f);
+  EXPECT_EQ(0, coverage.best_neighbor);
+}
+
+TEST(KeyframeMerging, FuseConsistentMeasurements) {
+  const PinholeCamera4f camera = CreateTestCamera();
+  DepthParametersCPU calibration;
+  KeyframeMergeOptions options;
+  
+  KeyframeImageData source;
+  CreatePlaneKeyframeImages(kWidth, kHeight, 2000, kRadiusSquaredHalf, 100, &source);
+  KeyframeImageData target;
+  CreatePlaneKeyframeImages(kWidth, kHeight, 2040, kRadiusSquaredHalf, 200, &target);
+  
+  KeyframeMergeStatistics statistics;
+  MergeKeyframeImages(source, SE3f(), &target, SE3f(), camera, camera,
+                      calibration, options, &statistics);
+  EXPECT_EQ(static_cast<usize>(kWidth * kHeight), statistics.source_pixel_count);
+  EXPECT_EQ(static_cast<usize>(kWidth * kHeight), statistics.fused_pixel_count);
+  EXPECT_EQ(0u, statistics.filled_pixel_count);
+  EXPECT_NEAR(2.02f, statistics.min_depth, 0.001f);
+  EXPECT_NEAR(2.02f, statistics.max_depth, 0.001f);
+  
+  // Inverse squared depth weighting.
+  const float source_weight = 1 / (2.f * 2.f);
+  const float target_weight = 1 / (2.04f * 2.04f);
+  const float expected_depth = (source_weight * 2.f + target_weight * 2.04f) / (source_weight + target_weight);
+  const float expected_gray = (source_weight * 100 + target_weight * 200) / (source_weight + target_weight);
+  for (int y = 0; y < kHeight; ++ y) {
+    for (int x = 0; x < kWidth; ++ x) {
+      ASSERT_NEAR(1000 * expected_depth, target.depth(x, y), 1);
+      ASSERT_EQ(0, target.normals(x, y));
+      ASSERT_NEAR(expected_gray, target.color(x, y).x(), 1);
+      ASSERT_EQ(target.color(x, y).x(), target.color(x, y).w());
+    }
+  }
+}
+
+TEST(KeyframeMerging, FillHolesAndDropInconsistentMeasurements) {
+  const PinholeCamera4f camera = CreateTestCamera();
+  DepthParametersCPU calibration;
+  KeyframeMergeOptions options;
+  
+  KeyframeImageData source;
+  CreatePlaneKeyframeImages(kWidth, kHeight, 2000, kRadiusSquaredHalf, 100, &source);
+  // The target is moved 10 cm away from the plane (such that each target
+  // pixel receives at least one source measurement), and has a hole in its
+  // center. Its left border observes an occluding object in front of the
+  // plane.
+  KeyframeImageData target;
+  CreatePlaneKeyframeImages(kWidth, kHeight, 2100, kRadiusSquaredHalf, 200, &target);
+  for (int y = 16; y < 32; ++ y) {
+    for (int x = 24; x < 40; ++ x) {
+      target.depth(x, y) = kUnknownDepth;
+    }
+  }
+  for (int y = 0; y < kHeight; ++ y) {
+    for (int x = 0; x < 4; ++ x) {
+      target.depth(x, y) = 1000;
+    }
+  }
+  const SE3f global_T_target(Mat3f::Identity(), Vec3f(0, 0, -0.1f));
+  
+  KeyframeMergeStatistics statistics;
+  MergeKeyframeImages(source, SE3f(), &target, global_T_target, camera, camera,
+                      calibration, options, &statistics);
+  EXPECT_EQ(16u * 16u, statistics.filled_pixel_count);
+  EXPECT_GT(statistics.fused_pixel_count, 0u);
+  
+  for (int y = 16; y < 32; ++ y) {
+    for (int x = 24; x < 40; ++ x) {
+      ASSERT_NEAR(2100, target.depth(x, y), 1);
+      ASSERT_EQ(0, target.normals(x, y));
+      // The source radius is scaled to the target depth: 1.05^2 / 64 is
+      // 0x2469 as half float.
+      ASSERT_NEAR(0x2469, target.radius(x, y), 1);
+    }
+  }
+  for (int y = 0; y < kHeight; ++ y) {
+    for (int x = 0; x < 4; ++ x) {
+      ASSERT_EQ(1000, target.depth(x, y));
+      ASSERT_EQ(200, target.color(x, y).x());
+    }
+  }
+}
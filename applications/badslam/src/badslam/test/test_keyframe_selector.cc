@@ -0,0 +1,99 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <gtest/gtest.h>
+#include <libvis/eigen.h>
+#include <libvis/libvis.h>
+#include <libvis/sophus.h>
+
+#include "badslam/keyframe_selector.h"
+
+using namespace vis;
+
+namespace {
+typedef KeyframeSelector::Decision Decision;
+}
+
+TEST(KeyframeSelector, StaticCameraUsesMaxInterval) {
+  KeyframeSelector selector(10, 0.7f, 0.1f, 10.f, 2.f);
+  
+  for (int keyframe = 0; keyframe < 3; ++ keyframe) {
+    for (int frame = 1; frame < 10; ++ frame) {
+      EXPECT_EQ(Decision::kNoKeyframe, selector.Decide(SE3f(), 1000, 1000));
+    }
+    EXPECT_EQ(Decision::kMaxInterval, selector.Decide(SE3f(), 1000, 1000));
+    selector.NotifyKeyframeCreated();
+  }
+  
+  EXPECT_EQ(27, selector.decision_count(Decision::kNoKeyframe));
+  EXPECT_EQ(3, selector.decision_count(Decision::kMaxInterval));
+}
+
+TEST(KeyframeSelector, LowOverlap) {
+  KeyframeSelector selector(100, 0.7f, 0, 0, 0);
+  
+  // The first tracked frame defines the reference residual count.
+  EXPECT_EQ(Decision::kNoKeyframe, selector.Decide(SE3f(), 1000, 0));
+  EXPECT_EQ(Decision::kNoKeyframe, selector.Decide(SE3f(), 800, 0));
+  EXPECT_EQ(Decision::kLowOverlap, selector.Decide(SE3f(), 600, 0));
+  
+  // After creating a keyframe, the reference is reset.
+  selector.NotifyKeyframeCreated();
+  EXPECT_EQ(Decision::kNoKeyframe, selector.Decide(SE3f(), 600, 0));
+  EXPECT_EQ(Decision::kNoKeyframe, selector.Decide(SE3f(), 500, 0));
+}
+
+TEST(KeyframeSelector, Motion) {
+  KeyframeSelector selector(100, 0, 0.1f, 10.f, 0);
+  
+  EXPECT_EQ(Decision::kNoKeyframe, selector.Decide(SE3f(SO3f(), Vec3f(0.05f, 0, 0)), 1000, 0));
+  EXPECT_EQ(Decision::kTranslation, selector.Decide(SE3f(SO3f(), Vec3f(0.08f, 0.08f, 0)), 1000, 0));
+  
+  constexpr float kNineDegrees = 9 * M_PI / 180;
+  constexpr float kElevenDegrees = 11 * M_PI / 180;
+  EXPECT_EQ(Decision::kNoKeyframe, selector.Decide(SE3f(SO3f::exp(Vec3f(0, kNineDegrees, 0)), Vec3f::Zero()), 1000, 0));
+  EXPECT_EQ(Decision::kRotation, selector.Decide(SE3f(SO3f::exp(Vec3f(0, kElevenDegrees, 0)), Vec3f::Zero()), 1000, 0));
+}
+
+TEST(KeyframeSelector, ResidualIncrease) {
+  KeyframeSelector selector(100, 0, 0, 0, 2.f);
+  
+  // Reference mean residual: 1.
+  EXPECT_EQ(Decision::kNoKeyframe, selector.Decide(SE3f(), 1000, 1000));
+  EXPECT_EQ(Decision::kNoKeyframe, selector.Decide(SE3f(), 500, 900));
+  EXPECT_EQ(Decision::kResidualIncrease, selector.Decide(SE3f(), 500, 1100));
+}
+
+TEST(KeyframeSelector, DisabledCriteria) {
+  KeyframeSelector selector(5, 0, 0, 0, 0);
+  
+  for (int frame = 1; frame < 5; ++ frame) {
+    EXPECT_EQ(Decision::kNoKeyframe, selector.Decide(SE3f(SO3f(), Vec3f(10, 0, 0)), frame, 1000));
+  }
+  EXPECT_EQ(Decision::kMaxInterval, selector.Decide(SE3f(), 1, 1000));
+}
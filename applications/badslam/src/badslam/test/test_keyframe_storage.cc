@@ -0,0 +1,137 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+#include <libvis/libvis.h>
+
+#include "badslam/keyframe_storage.h"
+
+using namespace vis;
+
+namespace {
+
+void CreateRandomKeyframeImages(KeyframeImageData* images) {
+  srand(0);
+  images->depth.SetSize(64, 48);
+  images->normals.SetSize(64, 48);
+  images->radius.SetSize(64, 48);
+  images->color.SetSize(80, 60);
+  for (u32 y = 0; y < images->depth.height(); ++ y) {
+    for (u32 x = 0; x < images->depth.width(); ++ x) {
+      images->depth(x, y) = 1000 + x + 3 * y;
+      images->normals(x, y) = rand() % 65536;
+      images->radius(x, y) = rand() % 200;
+    }
+  }
+  for (u32 y = 0; y < images->color.height(); ++ y) {
+    for (u32 x = 0; x < images->color.width(); ++ x) {
+      images->color(x, y) = Vec4u8(rand() % 256, rand() % 256, rand() % 256, rand() % 256);
+    }
+  }
+}
+
+template <typename T>
+void ExpectEqualImages(const Image<T>& a, const Image<T>& b) {
+  ASSERT_EQ(a.width(), b.width());
+  ASSERT_EQ(a.height(), b.height());
+  for (u32 y = 0; y < a.height(); ++ y) {
+    for (u32 x = 0; x < a.width(); ++ x) {
+      ASSERT_TRUE(a(x, y) == b(x, y)) << "at (" << x << ", " << y << ")";
+    }
+  }
+}
+
+void ExpectEqualKeyframeImages(const KeyframeImageData& a, const KeyframeImageData& b) {
+  ExpectEqualImages(a.depth, b.depth);
+  ExpectEqualImages(a.normals, b.normals);
+  ExpectEqualImages(a.radius, b.radius);
+  ExpectEqualImages(a.color, b.color);
+}
+
+void TestStorage(KeyframeStorage* storage) {
+  KeyframeImageData images;
+  CreateRandomKeyframeImages(&images);
+  
+  EXPECT_FALSE(storage->Contains(3));
+  ASSERT_TRUE(storage->Store(3, images));
+  ASSERT_TRUE(storage->Store(5, images));
+  EXPECT_TRUE(storage->Contains(3));
+  EXPECT_EQ(2, storage->stored_keyframe_count());
+  EXPECT_GT(storage->stored_bytes(), 0);
+  
+  KeyframeImageData loaded_images;
+  ASSERT_TRUE(storage->Load(3, &loaded_images));
+  ExpectEqualKeyframeImages(images, loaded_images);
+  EXPECT_EQ(1, storage->load_count());
+  
+  storage->Erase(3);
+  EXPECT_FALSE(storage->Contains(3));
+  EXPECT_EQ(1, storage->stored_keyframe_count());
+  EXPECT_FALSE(storage->Load(3, &loaded_images));
+  
+  storage->Erase(5);
+  EXPECT_EQ(0, storage->stored_keyframe_count());
+  EXPECT_EQ(0, storage->stored_bytes());
+  EXPECT_EQ(2, storage->store_count());
+}
+
+}
+
+// Tests that keyframe images are restored exactly and that the depth-like data
+// gets compressed.
+TEST(KeyframeStorage, EncodeDecode) {
+  KeyframeImageData images;
+  CreateRandomKeyframeImages(&images);
+  
+  vector<u8> data;
+  ASSERT_TRUE(EncodeKeyframeImages(images, /*compression_level*/ 6, &data));
+  
+  KeyframeImageData decoded_images;
+  ASSERT_TRUE(DecodeKeyframeImages(data.data(), data.size(), &decoded_images));
+  ExpectEqualKeyframeImages(images, decoded_images);
+  
+  // Corrupted or truncated data must be rejected.
+  EXPECT_FALSE(DecodeKeyframeImages(data.data(), data.size() / 2, &decoded_images));
+  data[0] = 255;
+  EXPECT_FALSE(DecodeKeyframeImages(data.data(), data.size(), &decoded_images));
+}
+
+TEST(KeyframeStorage, HostStorage) {
+  HostKeyframeStorage storage;
+  TestStorage(&storage);
+}
+
+TEST(KeyframeStorage, DiskStorage) {
+  string directory = (boost::filesystem::temp_directory_path() / "__badslam_keyframe_storage_test").string();
+  {
+    DiskKeyframeStorage storage(directory);
+    TestStorage(&storage);
+  }
+  boost::filesystem::remove_all(directory);
+}
@@ -0,0 +1,134 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <gtest/gtest.h>
+#include <libvis/eigen.h>
+#include <libvis/libvis.h>
+#include <libvis/sophus.h>
+
+#include "badslam/motion_model.h"
+
+using namespace vis;
+
+namespace {
+void ExpectPosesNear(const SE3f& expected, const SE3f& actual) {
+  EXPECT_LT((expected.matrix3x4() - actual.matrix3x4()).cwiseAbs().maxCoeff(), 1e-4f)
+      << "expected:" << std::endl << expected.matrix3x4() << std::endl
+      << "actual:" << std::endl << actual.matrix3x4();
+}
+
+// Returns the poses of a camera that moves with constant velocity.
+vector<SE3f> ConstantVelocityHistory(const SE3f& motion, int count) {
+  vector<SE3f> history;
+  SE3f pose = SE3f(SO3f::exp(Vec3f(0.1f, 0.2f, 0.3f)), Vec3f(1, 2, 3));
+  for (int i = 0; i < count; ++ i) {
+    history.push_back(pose);
+    pose = pose * motion;
+  }
+  return history;
+}
+}
+
+TEST(MotionModel, ConstantVelocity) {
+  SE3f motion(SO3f::exp(Vec3f(0.01f, 0.02f, 0.03f)), Vec3f(0.01f, 0, 0.02f));
+  vector<SE3f> history = ConstantVelocityHistory(motion, 3);
+  SE3f expected = history.back() * motion;
+  
+  SE3f prediction;
+  ASSERT_TRUE(ConstantVelocityHypothesis(false).Predict(history, &prediction));
+  ExpectPosesNear(expected, prediction);
+  
+  ASSERT_TRUE(ConstantVelocityHypothesis(true).Predict(history, &prediction));
+  ExpectPosesNear(expected, prediction);
+  
+  // With constant velocity, the acceleration is zero.
+  ASSERT_TRUE(ConstantAccelerationHypothesis().Predict(history, &prediction));
+  ExpectPosesNear(expected, prediction);
+  
+  // Too short histories.
+  EXPECT_FALSE(ConstantVelocityHypothesis(false).Predict(vector<SE3f>(history.begin(), history.begin() + 1), &prediction));
+  EXPECT_FALSE(ConstantVelocityHypothesis(true).Predict(vector<SE3f>(history.begin(), history.begin() + 2), &prediction));
+  EXPECT_FALSE(ConstantAccelerationHypothesis().Predict(vector<SE3f>(history.begin(), history.begin() + 2), &prediction));
+}
+
+TEST(MotionModel, ConstantAcceleration) {
+  // Pure translation with increasing speed: 1, 2, 3 cm per frame.
+  vector<SE3f> history;
+  history.push_back(SE3f(SO3f(), Vec3f(0.00f, 0, 0)));
+  history.push_back(SE3f(SO3f(), Vec3f(0.01f, 0, 0)));
+  history.push_back(SE3f(SO3f(), Vec3f(0.03f, 0, 0)));
+  
+  SE3f prediction;
+  ASSERT_TRUE(ConstantAccelerationHypothesis().Predict(history, &prediction));
+  ExpectPosesNear(SE3f(SO3f(), Vec3f(0.06f, 0, 0)), prediction);
+}
+
+TEST(MotionModel, ZeroMotionAndRotationOnly) {
+  SE3f motion(SO3f::exp(Vec3f(0, 0.1f, 0)), Vec3f(0.05f, 0, 0));
+  vector<SE3f> history = ConstantVelocityHistory(motion, 2);
+  
+  SE3f prediction;
+  ASSERT_TRUE(ZeroMotionHypothesis().Predict(history, &prediction));
+  ExpectPosesNear(history.back(), prediction);
+  
+  ASSERT_TRUE(RotationOnlyHypothesis().Predict(history, &prediction));
+  ExpectPosesNear(history.back() * SE3f(motion.so3(), Vec3f::Zero()), prediction);
+  EXPECT_LT((prediction.translation() - history.back().translation()).norm(), 1e-5f);
+}
+
+TEST(MotionModel, Predictor) {
+  SE3f motion(SO3f::exp(Vec3f(0, 0.1f, 0)), Vec3f(0.05f, 0, 0));
+  vector<SE3f> history = ConstantVelocityHistory(motion, 3);
+  vector<SE3f> predictions;
+  
+  // Without motion model, the last pose is predicted.
+  MotionPredictor::Create(false, false)->Predict(history, &predictions);
+  ASSERT_EQ(1u, predictions.size());
+  ExpectPosesNear(history.back(), predictions[0]);
+  
+  // The default motion model. Both constant velocity hypotheses agree here,
+  // so the duplicate is removed.
+  MotionPredictor::Create(true, false)->Predict(history, &predictions);
+  ASSERT_EQ(1u, predictions.size());
+  ExpectPosesNear(history.back() * motion, predictions[0]);
+  
+  // Multiple hypotheses: constant velocity, zero motion, and rotation only
+  // remain after removing duplicates.
+  unique_ptr<MotionPredictor> predictor = MotionPredictor::Create(true, true);
+  EXPECT_EQ(5u, predictor->hypothesis_count());
+  predictor->Predict(history, &predictions);
+  ASSERT_EQ(3u, predictions.size());
+  ExpectPosesNear(history.back() * motion, predictions[0]);
+  ExpectPosesNear(history.back(), predictions[1]);
+  ExpectPosesNear(history.back() * SE3f(motion.so3(), Vec3f::Zero()), predictions[2]);
+  
+  // With a single frame, no motion-based hypothesis applies.
+  MotionPredictor::Create(true, false)->Predict(vector<SE3f>(history.begin(), history.begin() + 1), &predictions);
+  ASSERT_EQ(1u, predictions.size());
+  ExpectPosesNear(history[0], predictions[0]);
+}
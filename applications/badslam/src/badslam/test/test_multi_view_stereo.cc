@@ -0,0 +1,187 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <gtest/gtest.h>
+#include <libvis/libvis.h>
+#include <libvis/test/synthetic_texture.h>
+
+#include "badslam/constants.h"
+#include "badslam/multi_view_stereo.h"
+#include "badslam/test/cpu_test_scene.h"
+
+using namespace vis;
+
+namespace {
+
+constexpr int kWidth = 64;
+constexpr int kHeight = 48;
+constexpr float kPlaneDepth = 2.f;
+
+PinholeCamera4f CreateTestCamera() {
+  const float camera_parameters[4] = {50, 50, 32, 24};
+  return PinholeCamera4f(kWidth, kHeight, camera_parameters);
+}
+
+// Creates keyframe images which observe a textured fronto-parallel plane at
+// z = kPlaneDepth in the global frame. The depth image is either invalid
+// everywhere or contains the plane depth.
+void CreateTexturedPlaneKeyframeImages(const PinholeCamera4f& camera, const SE3f& global_T_frame, u16 raw_depth, KeyframeImageData* images) {
+  CreatePlaneKeyframeImages(kWidth, kHeight, raw_depth, /*radius_squared_half*/ 0, /*gray*/ 0, images);
+  for (int y = 0; y < kHeight; ++ y) {
+    for (int x = 0; x < kWidth; ++ x) {
+      Vec3f direction = global_T_frame.so3() * camera.UnprojectFromPixelCenterConv(Vec2i(x, y));
+      Vec3f point = global_T_frame.translation() +
+                    ((kPlaneDepth - global_T_frame.translation().z()) / direction.z()) * direction;
+      const u8 gray = TextureValue(point.x(), point.y()) + 0.5f;
+      images->color(x, y) = Vec4u8(gray, gray, gray, gray);
+    }
+  }
+}
+
+// Creates three keyframes with sideways offsets which are all co-visible.
+void CreateKeyframes(
+    const PinholeCamera4f& camera,
+    u16 center_raw_depth,
+    vector<KeyframeImageData>* images,
+    vector<MultiViewStereoKeyframe>* keyframes) {
+  constexpr int kKeyframeCount = 3;
+  images->resize(kKeyframeCount);
+  keyframes->resize(kKeyframeCount);
+  for (int i = 0; i < kKeyframeCount; ++ i) {
+    MultiViewStereoKeyframe& keyframe = keyframes->at(i);
+    keyframe.id = 10 + i;
+    keyframe.global_T_frame = SE3f(Matrix3f::Identity(), Vec3f(0.2f * (i - 1), 0, 0));
+    for (int k = 0; k < kKeyframeCount; ++ k) {
+      if (k != i) {
+        keyframe.co_visible_keyframe_ids.push_back(10 + k);
+      }
+    }
+    CreateTexturedPlaneKeyframeImages(camera, keyframe.global_T_frame,
+                                      (i == 1) ? center_raw_depth : 0, &images->at(i));
+    keyframe.images = &images->at(i);
+  }
+}
+
+}  // namespace
+
+TEST(MultiViewStereo, SelectStereoViews) {
+  const PinholeCamera4f camera = CreateTestCamera();
+  vector<KeyframeImageData> images;
+  vector<MultiViewStereoKeyframe> keyframes;
+  CreateKeyframes(camera, 0, &images, &keyframes);
+  
+  // A co-visible keyframe that looks into a different direction is not used.
+  keyframes[2].global_T_frame.so3() = SO3f::exp(Vec3f(0, 1, 0));
+  
+  MultiViewStereoOptions options;
+  vector<int> views = SelectMultiViewStereoViews(keyframes, 1, options);
+  ASSERT_EQ(1u, views.size());
+  EXPECT_EQ(0, views[0]);
+  
+  // Too short baselines are not used.
+  keyframes[2].global_T_frame.so3() = SO3f();
+  options.min_baseline = 0.3f;
+  EXPECT_TRUE(SelectMultiViewStereoViews(keyframes, 1, options).empty());
+  views = SelectMultiViewStereoViews(keyframes, 0, options);
+  ASSERT_EQ(1u, views.size());
+  EXPECT_EQ(2, views[0]);
+}
+
+TEST(MultiViewStereo, TexturedPlane) {
+  const PinholeCamera4f camera = CreateTestCamera();
+  vector<KeyframeImageData> images;
+  vector<MultiViewStereoKeyframe> keyframes;
+  CreateKeyframes(camera, 0, &images, &keyframes);
+  
+  DepthParametersCPU calibration;
+  MultiViewStereoOptions options;
+  options.thread_count = 2;
+  Point3fC3u8Cloud cloud;
+  MultiViewStereoStatistics statistics;
+  ComputeMultiViewStereoPointCloud(keyframes, camera, camera, calibration,
+                                   options, &cloud, &statistics);
+  
+  EXPECT_EQ(3u, statistics.processed_keyframe_count);
+  EXPECT_GT(statistics.consistent_pixel_count, statistics.estimated_pixel_count / 2);
+  EXPECT_EQ(cloud.size(), statistics.fused_point_count);
+  
+  // The points lie on the plane, and the parts of the plane which are
+  // observed by several keyframes are only output once (so there are fewer
+  // points than consistent pixels).
+  EXPECT_GT(cloud.size(), kWidth * kHeight / 2);
+  EXPECT_LT(cloud.size(), statistics.consistent_pixel_count * 2 / 3);
+  usize on_plane_count = 0;
+  for (usize i = 0; i < cloud.size(); ++ i) {
+    if (fabs(cloud.at(i).position().z() - kPlaneDepth) < 0.05f) {
+      ++ on_plane_count;
+    }
+  }
+  EXPECT_GT(on_plane_count, 0.95f * cloud.size());
+  
+  // The result does not depend on the number of threads.
+  options.thread_count = 1;
+  Point3fC3u8Cloud cloud_2;
+  ComputeMultiViewStereoPointCloud(keyframes, camera, camera, calibration,
+                                   options, &cloud_2);
+  ASSERT_EQ(cloud.size(), cloud_2.size());
+  for (usize i = 0; i < cloud.size(); ++ i) {
+    EXPECT_EQ(cloud.at(i).position(), cloud_2.at(i).position());
+  }
+}
+
+TEST(MultiViewStereo, OnlyFillMissingDepth) {
+  const PinholeCamera4f camera = CreateTestCamera();
+  DepthParametersCPU calibration;
+  calibration.raw_to_float_depth = 1 / 1000.f;
+  MultiViewStereoOptions options;
+  
+  // Without sensor depth, the center keyframe contributes points.
+  vector<KeyframeImageData> images;
+  vector<MultiViewStereoKeyframe> keyframes;
+  CreateKeyframes(camera, 0, &images, &keyframes);
+  Point3fC3u8Cloud cloud;
+  ComputeMultiViewStereoPointCloud(keyframes, camera, camera, calibration,
+                                   options, &cloud);
+  
+  // With valid sensor depth everywhere in the center keyframe, its pixels are
+  // not densified.
+  vector<KeyframeImageData> images_with_depth;
+  vector<MultiViewStereoKeyframe> keyframes_with_depth;
+  CreateKeyframes(camera, kPlaneDepth * 1000, &images_with_depth, &keyframes_with_depth);
+  Point3fC3u8Cloud cloud_with_depth;
+  ComputeMultiViewStereoPointCloud(keyframes_with_depth, camera, camera, calibration,
+                                   options, &cloud_with_depth);
+  EXPECT_LT(cloud_with_depth.size(), cloud.size());
+  
+  // Unless all pixels are requested.
+  options.only_fill_missing_depth = false;
+  Point3fC3u8Cloud cloud_all_pixels;
+  ComputeMultiViewStereoPointCloud(keyframes_with_depth, camera, camera, calibration,
+                                   options, &cloud_all_pixels);
+  EXPECT_EQ(cloud.size(), cloud_all_pixels.size());
+}
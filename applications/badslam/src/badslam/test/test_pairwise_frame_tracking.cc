@@ -43,6 +43,7 @@
 #include "badslam/direct_ba.h"
 #include "badslam/kernels.h"
 #include "badslam/pairwise_frame_tracking.h"
+#include "badslam/pairwise_frame_tracking_cpu.h"
 #include "badslam/util.cuh"
 #include "badslam/render_window.h"
 
@@ -278,32 +279,19 @@ static void RenderImages(
   }
 }
 
-TEST(Optimization, PairwiseFrameTracking) {
-  srand(0);
-  
-  std::mt19937 generator(/*seed*/ 0);
-  
-  // The QApplication is required if using libvis' Qt implementation for OpenGL contexts.
-  int argc = 0;
-  char** argv = nullptr;
-  QApplication qapp(argc, argv);
-  
-  // Initialize and switch to an OpenGL context.
-  OpenGLContext opengl_context;
-  OpenGLContext no_opengl_context;
-  
-  opengl_context.InitializeWindowless();
-  SwitchOpenGLContext(opengl_context, &no_opengl_context);
-  
-  // Create a synthetic scene using a heightmap. First generate vertices.
-  constexpr int kHeightmapVerticesX = 61;
-  constexpr int kHeightmapVerticesY = 61;
-  constexpr float kHeightmapWidth = 5.f;
-  constexpr float kHeightmapHeight = 5.f;
-  constexpr float kHeightmapZDistance = 1.f;
-  // Low variation to avoid occlusions.
-  constexpr float kHeightmapZVariation = 0.05f;
-  
+// Parameters of the synthetic heightmap scene.
+constexpr int kHeightmapVerticesX = 61;
+constexpr int kHeightmapVerticesY = 61;
+constexpr float kHeightmapWidth = 5.f;
+constexpr float kHeightmapHeight = 5.f;
+constexpr float kHeightmapZDistance = 1.f;
+// Low variation to avoid occlusions.
+constexpr float kHeightmapZVariation = 0.05f;
+
+// Creates a synthetic scene using a heightmap and transfers it to GPU memory.
+// Requires a current OpenGL context.
+static shared_ptr<Mesh3fC3u8OpenGL> CreateHeightmapMesh(std::mt19937* generator) {
+  // First generate vertices.
   std::uniform_real_distribution<> z_distribution(-kHeightmapZVariation,
                                                   kHeightmapZVariation);
   std::uniform_int_distribution<> color_distribution(0, 255);
@@ -317,16 +305,16 @@ TEST(Optimization, PairwiseFrameTracking) {
       Vec3f position;
       position.x() = ((x / (1.f * kHeightmapVerticesX - 1.f)) - 0.5f) * kHeightmapWidth;
       position.y() = ((y / (1.f * kHeightmapVerticesY - 1.f)) - 0.5f) * kHeightmapHeight;
-      position.z() = kHeightmapZDistance + z_distribution(generator);
+      position.z() = kHeightmapZDistance + z_distribution(*generator);
       // Make surface without occlusions by pulling back the surface at the
       // borders.
       position.z() -= 6 * sqrt(pow((x / (1.f * kHeightmapVerticesX - 1.f)) - 0.5f, 2) +
                                pow((y / (1.f * kHeightmapVerticesY - 1.f)) - 0.5f, 2));
       
       Vec3u8 color;
-      color.x() = color_distribution(generator);
-      color.y() = color_distribution(generator);
-      color.z() = color_distribution(generator);
+      color.x() = color_distribution(*generator);
+      color.y() = color_distribution(*generator);
+      color.z() = color_distribution(*generator);
       
       mesh_vertex_cloud->at(index) = Point3fC3u8(position, color);
       ++ index;
@@ -359,7 +347,28 @@ TEST(Optimization, PairwiseFrameTracking) {
   }
   
   // Transfer mesh to GPU memory.
-  shared_ptr<Mesh3fC3u8OpenGL> mesh_opengl(new Mesh3fC3u8OpenGL(mesh));
+  return shared_ptr<Mesh3fC3u8OpenGL>(new Mesh3fC3u8OpenGL(mesh));
+}
+
+TEST(Optimization, PairwiseFrameTracking) {
+  srand(0);
+  
+  std::mt19937 generator(/*seed*/ 0);
+  
+  // The QApplication is required if using libvis' Qt implementation for OpenGL contexts.
+  int argc = 0;
+  char** argv = nullptr;
+  QApplication qapp(argc, argv);
+  
+  // Initialize and switch to an OpenGL context.
+  OpenGLContext opengl_context;
+  OpenGLContext no_opengl_context;
+  
+  opengl_context.InitializeWindowless();
+  SwitchOpenGLContext(opengl_context, &no_opengl_context);
+  
+  // Create a synthetic scene using a heightmap.
+  shared_ptr<Mesh3fC3u8OpenGL> mesh_opengl = CreateHeightmapMesh(&generator);
   
   // Create camera.
   constexpr int kCameraWidth = 256;
@@ -560,3 +569,224 @@ TEST(Optimization, PairwiseFrameTracking) {
   SwitchOpenGLContext(no_opengl_context);
   opengl_context.Deinitialize();
 }
+
+// Runs the CPU and the CUDA implementation of the pairwise frame tracking on
+// the same inputs and verifies that they arrive at the same results.
+TEST(Optimization, PairwiseFrameTrackingCPUConsistency) {
+  srand(0);
+  
+  std::mt19937 generator(/*seed*/ 0);
+  
+  // The QApplication is required if using libvis' Qt implementation for OpenGL contexts.
+  int argc = 0;
+  char** argv = nullptr;
+  QApplication qapp(argc, argv);
+  
+  // Initialize and switch to an OpenGL context.
+  OpenGLContext opengl_context;
+  OpenGLContext no_opengl_context;
+  
+  opengl_context.InitializeWindowless();
+  SwitchOpenGLContext(opengl_context, &no_opengl_context);
+  
+  shared_ptr<Mesh3fC3u8OpenGL> mesh_opengl = CreateHeightmapMesh(&generator);
+  
+  // Create camera.
+  constexpr int kCameraWidth = 256;
+  constexpr int kCameraHeight = 256;
+  constexpr float kCameraFX = 0.5f * kCameraWidth;
+  constexpr float kCameraFY = 0.5f * kCameraHeight;
+  constexpr float kCameraCX = 0.5f * kCameraWidth - 0.5f;
+  constexpr float kCameraCY = 0.5f * kCameraHeight - 0.5f;
+  const float camera_parameters[4] = {kCameraFX, kCameraFY, kCameraCX, kCameraCY};
+  PinholeCamera4f camera(kCameraWidth, kCameraHeight, camera_parameters);
+  
+  // Create RGB & depth renderer.
+  RendererProgramStoragePtr renderer_program_storage(new RendererProgramStorage());
+  shared_ptr<Renderer> renderer(new Renderer(
+      /*render_color*/ true,
+      /*render_depth*/ true,
+      kCameraWidth, kCameraHeight,
+      renderer_program_storage));
+  
+  // Initialize pairwise tracking for both implementations.
+  constexpr int kNumScales = 3;
+  PairwiseFrameTrackingBuffers pairwise_tracking_buffers(kCameraWidth, kCameraHeight, kNumScales);
+  PairwiseFrameTrackingBuffersCPU pairwise_tracking_buffers_cpu(kCameraWidth, kCameraHeight, kNumScales);
+  PoseEstimationHelperBuffers pose_estimation_helper_buffers;
+  
+  int sparse_surfel_cell_size = 4;
+  
+  CUDABufferPtr<float> cfactor_buffer;
+  cfactor_buffer.reset(new CUDABuffer<float>(
+      (camera.height() - 1) / sparse_surfel_cell_size + 1,
+      (camera.width() - 1) / sparse_surfel_cell_size + 1));
+  cfactor_buffer->Clear(0, /*stream*/ 0);
+  cudaDeviceSynchronize();
+  
+  DepthParameters depth_params;
+  depth_params.a = 0;
+  depth_params.cfactor_buffer = cfactor_buffer->ToCUDA();
+  depth_params.raw_to_float_depth = 1. / 1000.;
+  depth_params.baseline_fx = 40.f;
+  depth_params.sparse_surfel_cell_size = sparse_surfel_cell_size;
+  
+  DepthParametersCPU depth_params_cpu;
+  depth_params_cpu.cfactor.SetSize(cfactor_buffer->width(), cfactor_buffer->height());
+  depth_params_cpu.cfactor.SetTo(0.f);
+  depth_params_cpu.a = depth_params.a;
+  depth_params_cpu.raw_to_float_depth = depth_params.raw_to_float_depth;
+  depth_params_cpu.baseline_fx = depth_params.baseline_fx;
+  depth_params_cpu.sparse_surfel_cell_size = depth_params.sparse_surfel_cell_size;
+  
+  CUDABuffer<u16> tracked_depth_buffer(kCameraHeight, kCameraWidth);
+  CUDABuffer<u16> tracked_normals_buffer(kCameraHeight, kCameraWidth);
+  CUDABufferPtr<uchar> tracked_color_buffer;
+  cudaTextureObject_t tracked_color_texture;
+  
+  CUDABuffer<u16> base_normals_buffer(kCameraHeight, kCameraWidth);
+  CUDABufferPtr<uchar> base_color_buffer;
+  cudaTextureObject_t base_color_texture;
+  
+  CUDABufferPtr<float> base_depth_buffer;
+  CUDABufferPtr<uchar> base_calibrated_color_buffer;
+  cudaTextureObject_t base_calibrated_color_texture;
+  
+  CreatePairwiseTrackingInputBuffersAndTextures(
+      /*depth_width*/ kCameraWidth,
+      /*depth_height*/ kCameraHeight,
+      /*color_width*/ kCameraWidth,
+      /*color_height*/ kCameraHeight,
+      &base_depth_buffer,
+      &base_calibrated_color_buffer,
+      &base_color_buffer,
+      &tracked_color_buffer,
+      &base_calibrated_color_texture,
+      &base_color_texture,
+      &tracked_color_texture);
+  
+  Image<u16> tracked_depth(kCameraWidth, kCameraHeight);
+  Image<u16> tracked_normals(kCameraWidth, kCameraHeight);
+  Image<u8> tracked_color(kCameraWidth, kCameraHeight);
+  Image<float> base_depth(kCameraWidth, kCameraHeight);
+  Image<u16> base_normals(kCameraWidth, kCameraHeight);
+  Image<u8> base_color(kCameraWidth, kCameraHeight);
+  
+  // Test both residual types and both color representations, starting from
+  // the converging range of initial estimates of the test above.
+  vector<bool> use_depth_residuals_values = {false, true};
+  vector<bool> use_gradmag_values = {false, true};
+  for (bool use_depth_residuals : use_depth_residuals_values) {
+    for (bool use_gradmag : use_gradmag_values) {
+      constexpr int kNumTests = 5;
+      for (int test = 0; test < kNumTests; ++ test) {
+        SE3f images_T_global[2];
+        for (int i = 0; i < 2; ++ i) {
+          images_T_global[i] = SE3f::exp(0.1f * SE3f::Tangent::Random());
+        }
+        
+        RenderImages(
+            camera,
+            /*min_render_depth*/ 0.1f,
+            /*max_render_depth*/ 2.0f * (kHeightmapZDistance + kHeightmapZVariation),
+            renderer, mesh_opengl, use_gradmag,
+            images_T_global, depth_params.raw_to_float_depth,
+            &tracked_depth_buffer, &tracked_normals_buffer, tracked_color_buffer,
+            &base_normals_buffer, base_depth_buffer, base_color_buffer);
+        
+        tracked_depth_buffer.DownloadAsync(/*stream*/ 0, &tracked_depth);
+        tracked_normals_buffer.DownloadAsync(/*stream*/ 0, &tracked_normals);
+        tracked_color_buffer->DownloadAsync(/*stream*/ 0, &tracked_color);
+        base_depth_buffer->DownloadAsync(/*stream*/ 0, &base_depth);
+        base_normals_buffer.DownloadAsync(/*stream*/ 0, &base_normals);
+        base_color_buffer->DownloadAsync(/*stream*/ 0, &base_color);
+        cudaDeviceSynchronize();
+        
+        SE3f base_T_tracked_ground_truth = images_T_global[1] * images_T_global[0].inverse();
+        vector<SE3f> base_T_tracked_initial_estimates;
+        for (int i = 0; i < 2; ++ i) {
+          base_T_tracked_initial_estimates.push_back(
+              base_T_tracked_ground_truth * SE3f::exp(0.05f * SE3f::Tangent::Random()));
+        }
+        
+        SE3f base_T_tracked_estimate;
+        u32 residual_count;
+        float residual_sum;
+        TrackFramePairwise(
+            &pairwise_tracking_buffers,
+            /*stream*/ 0,
+            /*color_camera*/ camera,
+            /*depth_camera*/ camera,
+            depth_params,
+            *cfactor_buffer,
+            &pose_estimation_helper_buffers,
+            /*render_window*/ nullptr,
+            /*convergence_samples_file*/ nullptr,
+            use_depth_residuals,
+            /*use_descriptor_residuals*/ true,
+            /*use_pyramid_level_0*/ true,
+            use_gradmag,
+            /* tracked frame */
+            tracked_depth_buffer,
+            tracked_normals_buffer,
+            tracked_color_texture,
+            /* base frame */
+            *base_depth_buffer,
+            base_normals_buffer,
+            *base_color_buffer,
+            base_color_texture,
+            /* input / output poses */
+            images_T_global[1].inverse(),
+            base_T_tracked_initial_estimates,
+            &base_T_tracked_estimate,
+            &residual_count,
+            &residual_sum);
+        
+        SE3f base_T_tracked_estimate_cpu;
+        u32 residual_count_cpu;
+        float residual_sum_cpu;
+        TrackFramePairwiseCPU(
+            &pairwise_tracking_buffers_cpu,
+            /*thread_count*/ 0,
+            /*color_camera*/ camera,
+            /*depth_camera*/ camera,
+            depth_params_cpu,
+            use_depth_residuals,
+            /*use_descriptor_residuals*/ true,
+            /*use_pyramid_level_0*/ true,
+            use_gradmag,
+            /* tracked frame */
+            tracked_depth,
+            tracked_normals,
+            tracked_color,
+            /* base frame */
+            base_depth,
+            base_normals,
+            base_color,
+            /* input / output poses */
+            base_T_tracked_initial_estimates,
+            &base_T_tracked_estimate_cpu,
+            &residual_count_cpu,
+            &residual_sum_cpu);
+        
+        // The implementations differ in floating-point summation order and in
+        // the texture interpolation precision, so only require agreement up to
+        // the accuracy that the tracking reaches on these scenes.
+        Matrix<float, 6, 1> error = (base_T_tracked_estimate.inverse() * base_T_tracked_estimate_cpu).log();
+        EXPECT_LT(error.norm(), 2e-3f)
+            << "use_depth_residuals: " << use_depth_residuals
+            << ", use_gradmag: " << use_gradmag << ", test: " << test;
+        EXPECT_NEAR(residual_count, residual_count_cpu, 0.01f * residual_count);
+        EXPECT_NEAR(residual_sum, residual_sum_cpu, 0.05f * residual_sum);
+      }  // loop over tests
+    }  // loop over use_gradmag_values
+  }  // loop over use_depth_residuals_values
+  
+  // Delete OpenGL objects before losing the OpenGL context
+  renderer.reset();
+  renderer_program_storage.reset();
+  mesh_opengl.reset();
+  
+  SwitchOpenGLContext(no_opengl_context);
+  opengl_context.Deinitialize();
+}
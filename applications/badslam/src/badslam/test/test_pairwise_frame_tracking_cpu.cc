@@ -0,0 +1,262 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <cmath>
+
+#include <gtest/gtest.h>
+#include <libvis/libvis.h>
+#include <libvis/sophus.h>
+
+#include "badslam/pairwise_frame_tracking_cpu.h"
+#include "badslam/surfel_projection_cpu.h"
+#include "badslam/test/cpu_test_scene.h"
+
+using namespace vis;
+
+namespace {
+
+constexpr int kCameraWidth = 256;
+constexpr int kCameraHeight = 256;
+
+// Low relief to avoid occlusions, like the heightmap mesh in
+// test_pairwise_frame_tracking.cc.
+const HeightmapScene kScene(/*base_height*/ 1.f, /*relief*/ 0.04f);
+
+// Version of EstimateNormals() from test_pairwise_frame_tracking.cc.
+void EstimateNormals(
+    const PinholeCamera4f& camera,
+    Image<float>* depth,
+    Image<u16>* normals) {
+  normals->SetSize(depth->size());
+  normals->SetTo(static_cast<u16>(0));
+  Image<float> input_depth = *depth;
+  
+  for (u32 y = 0; y < depth->height(); ++ y) {
+    for (u32 x = 0; x < depth->width(); ++ x) {
+      if (x < 1 || y < 1 || x >= depth->width() - 1 || y >= depth->height() - 1) {
+        (*depth)(x, y) = 0;
+        continue;
+      }
+      
+      float center_depth = input_depth(x, y);
+      float right_depth = input_depth(x + 1, y);
+      float down_depth = input_depth(x, y + 1);
+      if (!(center_depth > 0) || !(right_depth > 0) || !(down_depth > 0)) {
+        (*depth)(x, y) = 0;
+        continue;
+      }
+      
+      Vec3f center_point = center_depth * camera.UnprojectFromPixelCenterConv(Vec2f(x, y));
+      Vec3f right_point = right_depth * camera.UnprojectFromPixelCenterConv(Vec2f(x + 1, y));
+      Vec3f down_point = down_depth * camera.UnprojectFromPixelCenterConv(Vec2f(x, y + 1));
+      
+      Vec3f normal = (down_point - center_point).cross(right_point - center_point).normalized();
+      (*normals)(x, y) = ImageSpaceNormalToU16CPU(normal);
+    }
+  }
+}
+
+// Renders the depth and intensity of the scene for a camera with the given
+// pose.
+void RenderScene(
+    const PinholeCamera4f& camera,
+    const SE3f& image_T_global,
+    Image<float>* depth,
+    Image<u8>* intensity) {
+  Image<Vec3f> points;
+  kScene.RayCast(camera, image_T_global.inverse(), depth, &points);
+  
+  intensity->SetSize(camera.width(), camera.height());
+  for (u32 y = 0; y < camera.height(); ++ y) {
+    for (u32 x = 0; x < camera.width(); ++ x) {
+      const Vec3f& point = points(x, y);
+      (*intensity)(x, y) = std::max(0.f, std::min(255.f, kScene.Intensity(point.x(), point.y()) + 0.5f));
+    }
+  }
+}
+
+struct TrackingInput {
+  Image<u16> tracked_depth;
+  Image<u16> tracked_normals;
+  Image<u8> tracked_color;
+  
+  Image<float> base_depth;
+  Image<u16> base_normals;
+  Image<u8> base_color;
+};
+
+// Corresponds to RenderImages() in test_pairwise_frame_tracking.cc, with
+// images[0] == tracked and images[1] == base.
+void RenderTrackingInput(
+    const PinholeCamera4f& camera,
+    bool use_gradmag,
+    const SE3f images_T_global[2],
+    TrackingInput* input) {
+  Image<float> depth_images[2];
+  Image<u8> intensity_images[2];
+  for (int i = 0; i < 2; ++ i) {
+    RenderScene(camera, images_T_global[i], &depth_images[i], &intensity_images[i]);
+  }
+  
+  EstimateNormals(camera, &depth_images[0], &input->tracked_normals);
+  input->tracked_depth.SetSize(camera.width(), camera.height());
+  for (u32 y = 0; y < camera.height(); ++ y) {
+    for (u32 x = 0; x < camera.width(); ++ x) {
+      input->tracked_depth(x, y) = DepthToRawTestDepth(depth_images[0](x, y));
+    }
+  }
+  
+  EstimateNormals(camera, &depth_images[1], &input->base_normals);
+  input->base_depth = depth_images[1];
+  
+  if (use_gradmag) {
+    ComputeSobelGradientMagnitudeCPU(intensity_images[0], &input->tracked_color);
+    ComputeSobelGradientMagnitudeCPU(intensity_images[1], &input->base_color);
+  } else {
+    input->tracked_color = intensity_images[0];
+    input->base_color = intensity_images[1];
+  }
+}
+
+void Track(
+    const PinholeCamera4f& camera,
+    const TrackingInput& input,
+    bool use_depth_residuals,
+    bool use_descriptor_residuals,
+    bool use_gradmag,
+    const SE3f& base_T_tracked_initial_estimate,
+    int thread_count,
+    SE3f* base_T_tracked_estimate) {
+  PairwiseFrameTrackingBuffersCPU buffers(kCameraWidth, kCameraHeight, /*num_scales*/ 3);
+  DepthParametersCPU depth_params;
+  depth_params.raw_to_float_depth = kRawToFloatDepth;
+  depth_params.baseline_fx = kBaselineFx;
+  
+  TrackFramePairwiseCPU(
+      &buffers,
+      thread_count,
+      /*color_camera*/ camera,
+      /*depth_camera*/ camera,
+      depth_params,
+      use_depth_residuals,
+      use_descriptor_residuals,
+      /*use_pyramid_level_0*/ true,
+      use_gradmag,
+      input.tracked_depth,
+      input.tracked_normals,
+      input.tracked_color,
+      input.base_depth,
+      input.base_normals,
+      input.base_color,
+      vector<SE3f>(1, base_T_tracked_initial_estimate),
+      base_T_tracked_estimate);
+}
+
+}  // namespace
+
+TEST(PairwiseFrameTrackingCPU, ConvergenceAndAccuracy) {
+  srand(0);
+  
+  const PinholeCamera4f camera = CreateCamera(kCameraWidth, kCameraHeight, /*focal_length*/ 0.5f * kCameraWidth);
+  TrackingInput input;
+  
+  // Same test structure as in test_pairwise_frame_tracking.cc, with fewer
+  // repetitions. The photometric residuals are tested on their own, as in
+  // the GPU test, and the geometric residuals additionally on their own.
+  for (int mode = 0; mode < 3; ++ mode) {
+    const bool use_depth_residuals = (mode == 0);
+    const bool use_descriptor_residuals = (mode != 0);
+    const bool use_gradmag = (mode == 2);
+    
+    for (float distortion_strength : {0.025f, 0.01f}) {
+      float convergence_error_norm_sum = 0;
+      float accuracy_error_norm_sum = 0;
+      constexpr int kNumTests = 3;
+      for (int test = 0; test < kNumTests; ++ test) {
+        // 1. Convergence test: distort the initial estimate, try to obtain the correct transformation.
+        SE3f images_T_global[2];
+        for (int i = 0; i < 2; ++ i) {
+          images_T_global[i] = SE3f::exp(0.1f * SE3f::Tangent::Random());
+        }
+        RenderTrackingInput(camera, use_gradmag, images_T_global, &input);
+        
+        SE3f base_T_tracked_ground_truth = images_T_global[1] * images_T_global[0].inverse();
+        SE3f base_T_tracked_initial_estimate = base_T_tracked_ground_truth * SE3f::exp(distortion_strength * SE3f::Tangent::Random());
+        SE3f base_T_tracked_estimate;
+        Track(camera, input, use_depth_residuals, use_descriptor_residuals, use_gradmag,
+              base_T_tracked_initial_estimate, /*thread_count*/ 0, &base_T_tracked_estimate);
+        
+        convergence_error_norm_sum += (base_T_tracked_estimate.inverse() * base_T_tracked_ground_truth).log().norm();
+        
+        // 2. Accuracy test: give the ground truth as initial estimate, verify that the tracking stays there.
+        for (int i = 0; i < 2; ++ i) {
+          images_T_global[i] = SE3f::exp(distortion_strength * SE3f::Tangent::Random());
+        }
+        RenderTrackingInput(camera, use_gradmag, images_T_global, &input);
+        
+        base_T_tracked_ground_truth = images_T_global[1] * images_T_global[0].inverse();
+        Track(camera, input, use_depth_residuals, use_descriptor_residuals, use_gradmag,
+              base_T_tracked_ground_truth, /*thread_count*/ 0, &base_T_tracked_estimate);
+        
+        accuracy_error_norm_sum += (base_T_tracked_estimate.inverse() * base_T_tracked_ground_truth).log().norm();
+      }
+      
+      LOG(INFO) << "Mode: " << mode << ", distortion strength: " << distortion_strength
+                << " --> average error norm (convergence): " << (convergence_error_norm_sum / kNumTests)
+                << " --> average error norm (accuracy): " << (accuracy_error_norm_sum / kNumTests);
+      EXPECT_LT(convergence_error_norm_sum / kNumTests, 5e-3f) << "mode: " << mode;
+      EXPECT_LT(accuracy_error_norm_sum / kNumTests, 5e-3f) << "mode: " << mode;
+    }
+  }
+}
+
+TEST(PairwiseFrameTrackingCPU, ResultIndependentOfThreadCount) {
+  srand(0);
+  
+  const PinholeCamera4f camera = CreateCamera(kCameraWidth, kCameraHeight, /*focal_length*/ 0.5f * kCameraWidth);
+  for (bool use_gradmag : {false, true}) {
+    SE3f images_T_global[2];
+    for (int i = 0; i < 2; ++ i) {
+      images_T_global[i] = SE3f::exp(0.1f * SE3f::Tangent::Random());
+    }
+    TrackingInput input;
+    RenderTrackingInput(camera, use_gradmag, images_T_global, &input);
+    
+    SE3f base_T_tracked_initial_estimate =
+        images_T_global[1] * images_T_global[0].inverse() * SE3f::exp(0.05f * SE3f::Tangent::Random());
+    
+    SE3f single_thread_estimate;
+    Track(camera, input, /*use_depth_residuals*/ true, /*use_descriptor_residuals*/ true, use_gradmag,
+          base_T_tracked_initial_estimate, /*thread_count*/ 1, &single_thread_estimate);
+    SE3f multi_thread_estimate;
+    Track(camera, input, /*use_depth_residuals*/ true, /*use_descriptor_residuals*/ true, use_gradmag,
+          base_T_tracked_initial_estimate, /*thread_count*/ 5, &multi_thread_estimate);
+    
+    EXPECT_LT((single_thread_estimate.inverse() * multi_thread_estimate).log().norm(), 1e-5f);
+  }
+}
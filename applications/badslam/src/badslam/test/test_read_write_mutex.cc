@@ -0,0 +1,112 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include <gtest/gtest.h>
+#include <libvis/libvis.h>
+
+#include "badslam/read_write_mutex.h"
+
+using namespace vis;
+
+TEST(ReadWriteMutex, ReadersShareAccess) {
+  ReadWriteMutex rw_mutex;
+  std::atomic<int> concurrent_readers(0);
+  std::atomic<int> max_concurrent_readers(0);
+  
+  auto reader = [&]() {
+    SharedLock lock(rw_mutex);
+    int count = ++ concurrent_readers;
+    int max_count = max_concurrent_readers;
+    while (count > max_count &&
+           !max_concurrent_readers.compare_exchange_weak(max_count, count)) {}
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    -- concurrent_readers;
+  };
+  
+  thread reader_1(reader);
+  thread reader_2(reader);
+  reader_1.join();
+  reader_2.join();
+  
+  EXPECT_EQ(2, max_concurrent_readers);
+}
+
+TEST(ReadWriteMutex, WriterIsExclusive) {
+  ReadWriteMutex rw_mutex;
+  int value = 0;
+  std::atomic<bool> violation(false);
+  
+  auto writer = [&]() {
+    for (int i = 0; i < 1000; ++ i) {
+      lock_guard<ReadWriteMutex> lock(rw_mutex);
+      ++ value;
+      if (value % 2 != 1) {
+        violation = true;
+      }
+      ++ value;
+    }
+  };
+  auto reader = [&]() {
+    for (int i = 0; i < 1000; ++ i) {
+      SharedLock lock(rw_mutex);
+      if (value % 2 != 0) {
+        violation = true;
+      }
+    }
+  };
+  
+  thread writer_1(writer);
+  thread writer_2(writer);
+  thread reader_1(reader);
+  thread reader_2(reader);
+  writer_1.join();
+  writer_2.join();
+  reader_1.join();
+  reader_2.join();
+  
+  EXPECT_FALSE(violation);
+  EXPECT_EQ(4000, value);
+}
+
+TEST(ReadWriteMutex, ReportsExclusiveLocking) {
+  ReadWriteMutex rw_mutex;
+  EXPECT_FALSE(rw_mutex.is_locked_exclusively());
+  {
+    SharedLock lock(rw_mutex);
+    EXPECT_FALSE(rw_mutex.is_locked_exclusively());
+  }
+  rw_mutex.lock();
+  EXPECT_TRUE(rw_mutex.is_locked_exclusively());
+  rw_mutex.unlock();
+  EXPECT_FALSE(rw_mutex.is_locked_exclusively());
+}
@@ -0,0 +1,247 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <string>
+
+#include <gtest/gtest.h>
+#include <libvis/libvis.h>
+
+#include "badslam/resumable_ba_iteration.h"
+
+using namespace vis;
+
+namespace {
+
+// Deterministic clock for the tests: each processed work item takes
+// item_duration seconds.
+struct FakeClock {
+  double Now() const { return time; }
+  
+  double time = 0;
+  double item_duration = 1;
+};
+
+// Creates phases with the given numbers of work items, which append a record
+// of each call to log and advance the fake clock for each work item.
+vector<BAPhase> CreatePhases(
+    const vector<usize>& item_counts,
+    FakeClock* clock,
+    vector<string>* log) {
+  vector<BAPhase> phases(item_counts.size());
+  for (usize phase_index = 0; phase_index < item_counts.size(); ++ phase_index) {
+    usize item_count = item_counts[phase_index];
+    string phase_name = std::to_string(phase_index);
+    phases[phase_index].begin = [=]() {
+      log->push_back("begin " + phase_name);
+      return item_count;
+    };
+    phases[phase_index].process_item = [=](usize item_index) {
+      log->push_back("item " + phase_name + "." + std::to_string(item_index));
+      clock->time += clock->item_duration;
+    };
+    phases[phase_index].end = [=]() {
+      log->push_back("end " + phase_name);
+    };
+  }
+  return phases;
+}
+
+BADeadline CreateDeadline(const FakeClock* clock, double time_limit) {
+  return BADeadline([clock]() { return clock->Now(); }, time_limit);
+}
+
+}
+
+TEST(ResumableBAIteration, RunsAllPhasesWithoutDeadline) {
+  FakeClock clock;
+  vector<string> log;
+  vector<BAPhase> phases = CreatePhases({2, 0, 1}, &clock, &log);
+  
+  ResumableBAIteration iteration;
+  EXPECT_TRUE(iteration.Run(phases, BADeadline()));
+  EXPECT_FALSE(iteration.in_progress());
+  
+  vector<string> expected_log = {
+      "begin 0", "item 0.0", "item 0.1", "end 0",
+      "begin 1", "end 1",
+      "begin 2", "item 2.0", "end 2"};
+  EXPECT_EQ(expected_log, log);
+  EXPECT_EQ(3, clock.time);
+}
+
+// Interrupting the iteration at every possible point and resuming it must
+// process every work item exactly once and in the original order.
+TEST(ResumableBAIteration, ResumesAfterPreemption) {
+  FakeClock reference_clock;
+  vector<string> reference_log;
+  ResumableBAIteration reference_iteration;
+  EXPECT_TRUE(reference_iteration.Run(CreatePhases({3, 1, 0, 4}, &reference_clock, &reference_log), BADeadline()));
+  
+  for (int items_per_call = 1; items_per_call <= 4; ++ items_per_call) {
+    FakeClock clock;
+    vector<string> log;
+    ResumableBAIteration iteration;
+    
+    int call_count = 0;
+    bool finished = false;
+    while (!finished) {
+      ASSERT_LT(call_count, 100);
+      ++ call_count;
+      
+      // Each call may start items_per_call work items.
+      double time_limit = clock.time + items_per_call - 0.5;
+      finished = iteration.Run(CreatePhases({3, 1, 0, 4}, &clock, &log), CreateDeadline(&clock, time_limit));
+      EXPECT_LE(clock.time, time_limit + clock.item_duration);
+      EXPECT_EQ(!finished, iteration.in_progress());
+    }
+    
+    EXPECT_EQ(reference_log, log) << "items_per_call: " << items_per_call;
+    EXPECT_EQ((8 + items_per_call - 1) / items_per_call, call_count);
+  }
+}
+
+TEST(ResumableBAIteration, ExpiredDeadlineStartsNoWork) {
+  FakeClock clock;
+  clock.time = 10;
+  vector<string> log;
+  
+  ResumableBAIteration iteration;
+  EXPECT_FALSE(iteration.Run(CreatePhases({2, 2}, &clock, &log), CreateDeadline(&clock, 5)));
+  EXPECT_FALSE(iteration.in_progress());
+  EXPECT_TRUE(log.empty());
+}
+
+TEST(ResumableBAIteration, ResetDiscardsProgress) {
+  FakeClock clock;
+  vector<string> log;
+  
+  ResumableBAIteration iteration;
+  EXPECT_FALSE(iteration.Run(CreatePhases({2, 2}, &clock, &log), CreateDeadline(&clock, 2.5)));
+  EXPECT_TRUE(iteration.in_progress());
+  EXPECT_EQ(1, iteration.phase_index());
+  EXPECT_EQ(1, iteration.item_index());
+  
+  iteration.Reset();
+  EXPECT_FALSE(iteration.in_progress());
+  
+  log.clear();
+  EXPECT_TRUE(iteration.Run(CreatePhases({2, 2}, &clock, &log), BADeadline()));
+  ASSERT_FALSE(log.empty());
+  EXPECT_EQ("begin 0", log.front());
+  EXPECT_EQ(8, log.size());  // 4 items, plus 2 begin and 2 end records
+}
+
+// Work items which are appended while a phase is interrupted are processed
+// when it is resumed, without repeating the processed items.
+TEST(ResumableBAIteration, ResumeExtendsItemCount) {
+  FakeClock clock;
+  vector<string> log;
+  usize item_count = 3;
+  vector<BAPhase> phases = CreatePhases({3}, &clock, &log);
+  phases[0].resume = [&]() {
+    log.push_back("resume 0");
+    return item_count;
+  };
+  
+  ResumableBAIteration iteration;
+  EXPECT_FALSE(iteration.Run(phases, CreateDeadline(&clock, 1.5)));
+  EXPECT_EQ(2, iteration.item_index());
+  
+  item_count = 5;
+  log.clear();
+  EXPECT_TRUE(iteration.Run(phases, BADeadline()));
+  vector<string> expected_log = {"resume 0", "item 0.2", "item 0.3", "item 0.4", "end 0"};
+  EXPECT_EQ(expected_log, log);
+}
+
+// A non-preemptible phase runs to completion once it has begun, and the
+// iteration is only interrupted at the next phase boundary.
+TEST(ResumableBAIteration, NonPreemptiblePhaseRunsToCompletion) {
+  FakeClock clock;
+  vector<string> log;
+  vector<BAPhase> phases = CreatePhases({1, 3, 1}, &clock, &log);
+  phases[1].preemptible = false;
+  
+  ResumableBAIteration iteration;
+  EXPECT_FALSE(iteration.Run(phases, CreateDeadline(&clock, 1.5)));
+  EXPECT_TRUE(iteration.in_progress());
+  EXPECT_EQ(2, iteration.phase_index());
+  EXPECT_EQ(4, clock.time);
+  ASSERT_FALSE(log.empty());
+  EXPECT_EQ("end 1", log.back());
+  
+  EXPECT_TRUE(iteration.Run(phases, BADeadline()));
+  EXPECT_EQ("end 2", log.back());
+}
+
+// Simulates a real-time loop in which each frame has a fixed time budget for
+// bundle adjustment work. No work item may start after its frame's deadline,
+// and the work must still complete over the following frames.
+TEST(ResumableBAIteration, RespectsFrameDeadlines) {
+  FakeClock clock;
+  clock.item_duration = 0.004;
+  const double kFramePeriod = 1 / 30.;
+  const double kBABudgetPerFrame = 0.01;
+  
+  vector<string> log;
+  vector<double> item_start_times;
+  vector<double> item_deadlines;
+  
+  ResumableBAIteration iteration;
+  int completed_iterations = 0;
+  for (int frame = 0; frame < 30; ++ frame) {
+    clock.time = frame * kFramePeriod;
+    double deadline = clock.time + kBABudgetPerFrame;
+    
+    vector<BAPhase> phases = CreatePhases({5, 1, 5}, &clock, &log);
+    for (BAPhase& phase : phases) {
+      auto process_item = phase.process_item;
+      phase.process_item = [&, process_item, deadline](usize item_index) {
+        item_start_times.push_back(clock.time);
+        item_deadlines.push_back(deadline);
+        process_item(item_index);
+      };
+    }
+    
+    if (iteration.Run(phases, CreateDeadline(&clock, deadline))) {
+      ++ completed_iterations;
+    }
+    
+    // The frame must end before the next one starts.
+    EXPECT_LT(clock.time, (frame + 1) * kFramePeriod);
+  }
+  
+  ASSERT_EQ(item_start_times.size(), item_deadlines.size());
+  for (usize i = 0; i < item_start_times.size(); ++ i) {
+    EXPECT_LE(item_start_times[i], item_deadlines[i]);
+  }
+  
+  // Three items fit into each frame's budget, so each iteration of 11 items
+  // takes four frames.
+  EXPECT_EQ(7, completed_iterations);
+}
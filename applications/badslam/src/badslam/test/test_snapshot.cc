@@ -0,0 +1,125 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <thread>
+
+#include <gtest/gtest.h>
+#include <libvis/libvis.h>
+
+#include "badslam/snapshot.h"
+
+using namespace vis;
+
+namespace {
+
+// Two values which writers always keep consistent with each other, such that
+// readers can detect torn reads.
+struct ConsistentPair {
+  int value = 0;
+  int twice_value = 0;
+};
+
+}
+
+TEST(Snapshot, VersionsIncrease) {
+  SnapshotPublisher<int> publisher;
+  EXPECT_TRUE(publisher.Read() == nullptr);
+  
+  publisher.Publish(5);
+  ASSERT_TRUE(publisher.Read() != nullptr);
+  EXPECT_EQ(0, publisher.Read()->version);
+  EXPECT_EQ(5, publisher.Read()->value);
+  
+  publisher.Update([](int* value) { *value += 2; });
+  EXPECT_EQ(1, publisher.Read()->version);
+  EXPECT_EQ(7, publisher.Read()->value);
+}
+
+TEST(Snapshot, ReadersKeepTheirSnapshot) {
+  SnapshotPublisher<int> publisher(1);
+  shared_ptr<const Snapshot<int>> old_snapshot = publisher.Read();
+  
+  publisher.Publish(2);
+  EXPECT_EQ(1, old_snapshot->value);
+  EXPECT_EQ(0, old_snapshot->version);
+  EXPECT_EQ(2, publisher.Read()->value);
+  EXPECT_EQ(1, publisher.Read()->version);
+}
+
+// Readers must always see a consistent value and monotonically increasing
+// versions, and concurrent updates must not get lost.
+TEST(Snapshot, ConcurrentReadersAndWriters) {
+  constexpr int kWriterCount = 2;
+  constexpr int kUpdatesPerWriter = 2000;
+  constexpr int kReaderCount = 2;
+  
+  SnapshotPublisher<ConsistentPair> publisher{ConsistentPair()};
+  std::atomic<bool> writers_done(false);
+  
+  vector<std::thread> readers;
+  vector<int> reader_failures(kReaderCount, 0);
+  for (int reader_index = 0; reader_index < kReaderCount; ++ reader_index) {
+    readers.emplace_back([&, reader_index]() {
+      u64 last_version = 0;
+      while (!writers_done) {
+        shared_ptr<const Snapshot<ConsistentPair>> snapshot = publisher.Read();
+        if (snapshot->value.twice_value != 2 * snapshot->value.value ||
+            snapshot->version < last_version) {
+          ++ reader_failures[reader_index];
+        }
+        last_version = snapshot->version;
+      }
+    });
+  }
+  
+  vector<std::thread> writers;
+  for (int writer_index = 0; writer_index < kWriterCount; ++ writer_index) {
+    writers.emplace_back([&]() {
+      for (int i = 0; i < kUpdatesPerWriter; ++ i) {
+        publisher.Update([](ConsistentPair* pair) {
+          ++ pair->value;
+          pair->twice_value = 2 * pair->value;
+        });
+      }
+    });
+  }
+  
+  for (std::thread& writer : writers) {
+    writer.join();
+  }
+  writers_done = true;
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+  
+  for (int reader_index = 0; reader_index < kReaderCount; ++ reader_index) {
+    EXPECT_EQ(0, reader_failures[reader_index]);
+  }
+  EXPECT_EQ(kWriterCount * kUpdatesPerWriter, publisher.Read()->value.value);
+  EXPECT_EQ(kWriterCount * kUpdatesPerWriter, publisher.Read()->version);
+}
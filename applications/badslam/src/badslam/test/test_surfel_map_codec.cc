@@ -0,0 +1,210 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <map>
+
+#include <gtest/gtest.h>
+#include <libvis/libvis.h>
+
+#include "badslam/surfel_map_codec.h"
+
+using namespace vis;
+
+namespace {
+
+// Creates random surfels in a 10 m cube, with some invalid entries in between.
+void CreateRandomSurfels(usize count, SurfelMapData* surfels) {
+  srand(0);
+  surfels->Resize(count);
+  for (usize i = 0; i < count; ++ i) {
+    for (int c = 0; c < 3; ++ c) {
+      surfels->attributes[kSurfelX + c][i] = 10.f * (rand() / static_cast<float>(RAND_MAX)) - 5.f;
+    }
+    for (int a = 3; a < kSurfelDataAttributeCount; ++ a) {
+      u32 bits = (static_cast<u32>(rand()) << 16) ^ static_cast<u32>(rand());
+      memcpy(&surfels->attributes[a][i], &bits, sizeof(u32));
+    }
+    if (i % 7 == 3) {
+      surfels->attributes[kSurfelX][i] = numeric_limits<float>::quiet_NaN();
+    }
+  }
+}
+
+// Checks that each decoded surfel matches exactly one original surfel: the
+// non-position attributes must be bit-identical, the position must be within
+// the tolerance (up to float precision).
+void ExpectSurfelsMatch(
+    const SurfelMapData& original,
+    const SurfelMapData& decoded,
+    float tolerance) {
+  // The descriptor bits are random, so they identify the surfel.
+  std::map<u32, usize> original_index;
+  for (usize i = 0; i < original.size(); ++ i) {
+    if (std::isnan(original.attributes[kSurfelX][i])) {
+      continue;
+    }
+    u32 key;
+    memcpy(&key, &original.attributes[kSurfelDescriptor1][i], sizeof(u32));
+    original_index[key] = i;
+  }
+  
+  for (usize i = 0; i < decoded.size(); ++ i) {
+    u32 key;
+    memcpy(&key, &decoded.attributes[kSurfelDescriptor1][i], sizeof(u32));
+    auto it = original_index.find(key);
+    ASSERT_TRUE(it != original_index.end());
+    usize o = it->second;
+    
+    for (int c = 0; c < 3; ++ c) {
+      // Allow for the rounding of the decoded value to float.
+      float value = original.attributes[kSurfelX + c][o];
+      EXPECT_NEAR(value, decoded.attributes[kSurfelX + c][i], tolerance + 2 * numeric_limits<float>::epsilon() * fabs(value));
+    }
+    for (int a = 3; a < kSurfelDataAttributeCount; ++ a) {
+      EXPECT_EQ(0, memcmp(&original.attributes[a][o], &decoded.attributes[a][i], sizeof(float)));
+    }
+  }
+}
+
+}
+
+TEST(SurfelMapCodec, RoundTrip) {
+  SurfelMapData original;
+  CreateRandomSurfels(20000, &original);
+  usize valid_count = 0;
+  for (usize i = 0; i < original.size(); ++ i) {
+    valid_count += std::isnan(original.attributes[kSurfelX][i]) ? 0 : 1;
+  }
+  
+  for (float tolerance : {0.001f, 0.00001f}) {
+    SurfelMapEncodingOptions options;
+    options.position_tolerance = tolerance;
+    
+    vector<u8> encoded;
+    ASSERT_TRUE(EncodeSurfelMap(original, options, &encoded));
+    
+    SurfelMapData decoded;
+    ASSERT_TRUE(DecodeSurfelMap(encoded.data(), encoded.size(), nullptr, &decoded));
+    EXPECT_EQ(valid_count, decoded.size());
+    ExpectSurfelsMatch(original, decoded, tolerance);
+  }
+}
+
+TEST(SurfelMapCodec, RegionLoading) {
+  SurfelMapData original;
+  CreateRandomSurfels(20000, &original);
+  
+  SurfelMapEncodingOptions options;
+  options.block_size = 1.5f;
+  const char* path = "/tmp/__surfel_map_codec_test.bin";  // TODO: use random temporary filename
+  ASSERT_TRUE(SaveSurfelMap(original, options, path));
+  
+  Eigen::AlignedBox3f region(Vec3f(-1.f, 0.5f, -3.f), Vec3f(2.f, 2.5f, 0.f));
+  SurfelMapData decoded;
+  ASSERT_TRUE(LoadSurfelMap(path, &region, &decoded));
+  ExpectSurfelsMatch(original, decoded, options.position_tolerance);
+  
+  // All surfels which are clearly inside the region must have been loaded.
+  usize expected_min_count = 0;
+  Eigen::AlignedBox3f inner_region(
+      region.min() + Vec3f::Constant(options.position_tolerance),
+      region.max() - Vec3f::Constant(options.position_tolerance));
+  for (usize i = 0; i < original.size(); ++ i) {
+    Vec3f position(original.attributes[kSurfelX][i], original.attributes[kSurfelY][i], original.attributes[kSurfelZ][i]);
+    expected_min_count += inner_region.contains(position) ? 1 : 0;
+  }
+  EXPECT_GE(decoded.size(), expected_min_count);
+  EXPECT_GT(expected_min_count, 0u);
+  for (usize i = 0; i < decoded.size(); ++ i) {
+    EXPECT_TRUE(region.contains(Vec3f(decoded.attributes[kSurfelX][i], decoded.attributes[kSurfelY][i], decoded.attributes[kSurfelZ][i])));
+  }
+}
+
+TEST(SurfelMapCodec, RejectsCorruptData) {
+  SurfelMapData original;
+  CreateRandomSurfels(1000, &original);
+  vector<u8> encoded;
+  ASSERT_TRUE(EncodeSurfelMap(original, SurfelMapEncodingOptions(), &encoded));
+  
+  SurfelMapData decoded;
+  EXPECT_FALSE(DecodeSurfelMap(encoded.data(), encoded.size() / 2, nullptr, &decoded));
+  
+  // Excessive surfel count in the first block index entry, which follows the
+  // 32-byte header and the block coordinates.
+  vector<u8> corrupt_count = encoded;
+  for (int b = 0; b < 4; ++ b) {
+    corrupt_count[32 + 12 + b] = 0xff;
+  }
+  EXPECT_FALSE(DecodeSurfelMap(corrupt_count.data(), corrupt_count.size(), nullptr, &decoded));
+  
+  // Block index which is larger than the data. The block count follows the
+  // identifier, the version byte and three 4-byte values.
+  vector<u8> corrupt_block_count = encoded;
+  corrupt_block_count[20] = 0x00;
+  corrupt_block_count[21] = 0x00;
+  corrupt_block_count[22] = 0x01;
+  corrupt_block_count[23] = 0x00;
+  EXPECT_FALSE(DecodeSurfelMap(corrupt_block_count.data(), corrupt_block_count.size(), nullptr, &decoded));
+  
+  // Compressed block data beyond the end of the data.
+  vector<u8> corrupt_offset = encoded;
+  for (int b = 0; b < 8; ++ b) {
+    corrupt_offset[32 + 16 + b] = (b < 4) ? 0xff : 0x00;
+  }
+  EXPECT_FALSE(DecodeSurfelMap(corrupt_offset.data(), corrupt_offset.size(), nullptr, &decoded));
+  
+  encoded[0] = 'X';
+  EXPECT_FALSE(DecodeSurfelMap(encoded.data(), encoded.size(), nullptr, &decoded));
+}
+
+TEST(SurfelMapCodec, LittleEndianHeader) {
+  SurfelMapData original;
+  CreateRandomSurfels(1000, &original);
+  SurfelMapEncodingOptions options;
+  options.block_size = 2.0f;  // 0x40000000
+  vector<u8> encoded;
+  ASSERT_TRUE(EncodeSurfelMap(original, options, &encoded));
+  
+  // The block size follows the 7-byte identifier and the version byte.
+  ASSERT_GE(encoded.size(), 12u);
+  EXPECT_EQ(0x00, encoded[8]);
+  EXPECT_EQ(0x00, encoded[9]);
+  EXPECT_EQ(0x00, encoded[10]);
+  EXPECT_EQ(0x40, encoded[11]);
+  
+  // The surfel count is stored as 64-bit value after the other header fields.
+  u64 surfel_count = 0;
+  for (int b = 0; b < 8; ++ b) {
+    surfel_count |= static_cast<u64>(encoded[24 + b]) << (8 * b);
+  }
+  usize valid_count = 0;
+  for (usize i = 0; i < original.size(); ++ i) {
+    valid_count += std::isnan(original.attributes[kSurfelX][i]) ? 0 : 1;
+  }
+  EXPECT_EQ(valid_count, surfel_count);
+}
@@ -0,0 +1,226 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <cmath>
+
+#include <gtest/gtest.h>
+#include <libvis/libvis.h>
+
+#include "badslam/constants.h"
+#include "badslam/surfel_projection_cpu.h"
+
+using namespace vis;
+
+namespace {
+
+constexpr int kWidth = 64;
+constexpr int kHeight = 48;
+
+// Fronto-parallel plane at 2 meters with normals facing the camera, and
+// associated depth uncertainty.
+constexpr u16 kPlaneRawDepth = 2000;
+constexpr float kBaselineFx = 40;
+
+void AddSurfel(const Vec3f& position, const Vec3f& normal, float radius, Image<float>* surfels, u32* surfels_size) {
+  const u32 index = (*surfels_size) ++;
+  (*surfels)(index, kSurfelX) = position.x();
+  (*surfels)(index, kSurfelY) = position.y();
+  (*surfels)(index, kSurfelZ) = position.z();
+  SurfelSetNormalCPU(surfels, index, normal);
+  (*surfels)(index, kSurfelRadiusSquared) = radius * radius;
+}
+
+struct TestScene {
+  TestScene()
+      : camera(CreateCamera()) {
+    depth.SetSize(kWidth, kHeight);
+    depth.SetTo(kPlaneRawDepth);
+    normals.SetSize(kWidth, kHeight);
+    normals.SetTo(static_cast<u16>(0));  // normal (0, 0, -1)
+    surfels.SetSize(1000, kSurfelAttributeCount);
+    surfels.SetTo(0.f);
+    surfels_size = 0;
+    calibration.baseline_fx = kBaselineFx;
+  }
+  
+  static PinholeCamera4f CreateCamera() {
+    const float camera_parameters[4] = {50, 50, 32, 24};
+    return PinholeCamera4f(kWidth, kHeight, camera_parameters);
+  }
+  
+  // Returns the point on the plane which projects to the center of the given
+  // pixel.
+  Vec3f PlanePoint(int x, int y, float depth = 2) const {
+    return depth * camera.UnprojectFromPixelCenterConv(Vec2f(x, y));
+  }
+  
+  SurfelProjectionParametersCPU Parameters() {
+    SurfelProjectionParametersCPU parameters;
+    parameters.surfels = &surfels;
+    parameters.surfels_size = surfels_size;
+    parameters.depth_buffer = &depth;
+    parameters.normals_buffer = &normals;
+    parameters.camera = &camera;
+    parameters.frame_T_global = SE3f();
+    parameters.calibration = &calibration;
+    return parameters;
+  }
+  
+  PinholeCamera4f camera;
+  Image<u16> depth;
+  Image<u16> normals;
+  DepthParametersCPU calibration;
+  Image<float> surfels;
+  u32 surfels_size;
+};
+
+}  // namespace
+
+TEST(SurfelProjectionCPU, Association) {
+  TestScene scene;
+  const Vec3f facing_normal(0, 0, -1);
+  
+  // 0: on the plane.
+  AddSurfel(scene.PlanePoint(10, 20), facing_normal, 0.01f, &scene.surfels, &scene.surfels_size);
+  // 1: in front of the plane, i.e., in observed free space.
+  AddSurfel(scene.PlanePoint(10, 20, 1.5f), facing_normal, 0.01f, &scene.surfels, &scene.surfels_size);
+  // 2: behind the plane (occluded).
+  AddSurfel(scene.PlanePoint(10, 20, 2.5f), facing_normal, 0.01f, &scene.surfels, &scene.surfels_size);
+  // 3: on the plane, but facing away from the camera.
+  AddSurfel(scene.PlanePoint(11, 20), -facing_normal, 0.01f, &scene.surfels, &scene.surfels_size);
+  // 4: on the plane, but with a normal that is incompatible with the measured one.
+  AddSurfel(scene.PlanePoint(12, 20), Vec3f(1, 0, -0.5f).normalized(), 0.01f, &scene.surfels, &scene.surfels_size);
+  // 5: behind the camera.
+  AddSurfel(Vec3f(0, 0, -2), facing_normal, 0.01f, &scene.surfels, &scene.surfels_size);
+  // 6: outside of the image.
+  AddSurfel(Vec3f(5, 0, 2), facing_normal, 0.01f, &scene.surfels, &scene.surfels_size);
+  // 7: deleted.
+  AddSurfel(Vec3f(numeric_limits<float>::quiet_NaN(), 0, 2), facing_normal, 0.01f, &scene.surfels, &scene.surfels_size);
+  // 8: on the plane, but the pixel has invalid depth.
+  AddSurfel(scene.PlanePoint(13, 20), facing_normal, 0.01f, &scene.surfels, &scene.surfels_size);
+  scene.depth(13, 20) |= kInvalidDepthBit;
+  
+  SurfelProjectionParametersCPU parameters = scene.Parameters();
+  SurfelProjectionResultCPU result;
+  EXPECT_TRUE(SurfelProjectsToAssociatedPixelCPU(0, parameters, &result));
+  EXPECT_EQ(10, result.px);
+  EXPECT_EQ(20, result.py);
+  EXPECT_NEAR(10.5f, result.pxy.x(), 1e-4f);
+  EXPECT_NEAR(20.5f, result.pxy.y(), 1e-4f);
+  EXPECT_NEAR(2.f, result.pixel_calibrated_depth, 1e-5f);
+  EXPECT_FALSE(result.is_free_space_violation);
+  
+  EXPECT_FALSE(SurfelProjectsToAssociatedPixelCPU(1, parameters, &result));
+  EXPECT_TRUE(result.is_free_space_violation);
+  EXPECT_FALSE(SurfelProjectsToAssociatedPixelCPU(2, parameters, &result));
+  EXPECT_FALSE(result.is_free_space_violation);
+  for (u32 surfel_index = 3; surfel_index < scene.surfels_size; ++ surfel_index) {
+    EXPECT_FALSE(SurfelProjectsToAssociatedPixelCPU(surfel_index, parameters, &result)) << surfel_index;
+  }
+  EXPECT_FALSE(SurfelProjectsToAssociatedPixelCPU(scene.surfels_size, parameters, &result));
+  
+  vector<u32> associated_pixels;
+  ComputeSurfelAssociationsCPU(parameters, &associated_pixels, /*thread_count*/ 3);
+  ASSERT_EQ(scene.surfels_size, associated_pixels.size());
+  EXPECT_EQ(20u * kWidth + 10u, associated_pixels[0]);
+  for (u32 surfel_index = 1; surfel_index < scene.surfels_size; ++ surfel_index) {
+    EXPECT_EQ(kInvalidIndex, associated_pixels[surfel_index]);
+  }
+}
+
+TEST(SurfelProjectionCPU, SupportingSurfelsAndMerging) {
+  TestScene scene;
+  scene.calibration.sparse_surfel_cell_size = 2;
+  // Both normals are compatible with the measured normal (0, 0, -1), but
+  // differ by 45 degrees, so surfels with different normals do not get merged.
+  const Vec3f facing_normal(-sinf(10 * M_PI / 180), 0, -cosf(10 * M_PI / 180));
+  const Vec3f other_normal(sinf(35 * M_PI / 180), 0, -cosf(35 * M_PI / 180));
+  
+  // One surfel per cell, plus a near-duplicate in every third cell (which gets
+  // merged) and a surfel with a different normal in every fifth cell (which
+  // does not get merged and is entered into the next buffer). The cell size
+  // at 2 meters is 2 * 2 / 50 = 0.08 meters.
+  u32 expected_merged = 0;
+  for (int cy = 0; cy < 10; ++ cy) {
+    for (int cx = 0; cx < 20; ++ cx) {
+      const int cell = cy * 20 + cx;
+      AddSurfel(scene.PlanePoint(2 * cx, 2 * cy), facing_normal, 0.04f, &scene.surfels, &scene.surfels_size);
+      if (cell % 3 == 0) {
+        AddSurfel(scene.PlanePoint(2 * cx + 1, 2 * cy), facing_normal, 0.04f, &scene.surfels, &scene.surfels_size);
+        ++ expected_merged;
+      }
+      if (cell % 5 == 0) {
+        AddSurfel(scene.PlanePoint(2 * cx, 2 * cy + 1), other_normal, 0.04f, &scene.surfels, &scene.surfels_size);
+      }
+    }
+  }
+  ASSERT_LE(scene.surfels_size, scene.surfels.width());
+  
+  // Without merging, the surfels are distributed over the buffers in index
+  // order.
+  Image<u32> supporting_surfels[kMergeBufferCount];
+  DetermineSupportingSurfelsCPU(scene.Parameters(), supporting_surfels, /*thread_count*/ 1);
+  EXPECT_EQ(static_cast<u32>(kWidth), supporting_surfels[0].width());
+  EXPECT_EQ(static_cast<u32>(kHeight), supporting_surfels[0].height());
+  EXPECT_EQ(0u, supporting_surfels[0](0, 0));
+  EXPECT_EQ(1u, supporting_surfels[1](0, 0));
+  EXPECT_EQ(2u, supporting_surfels[2](0, 0));
+  EXPECT_EQ(3u, supporting_surfels[0](1, 0));
+  EXPECT_EQ(kInvalidIndex, supporting_surfels[1](1, 0));
+  EXPECT_EQ(kInvalidIndex, supporting_surfels[0](25, 0));
+  
+  // Merging gives the same result independently of the thread count.
+  Image<float> original_surfels(scene.surfels);
+  Image<float> merged_surfels[2];
+  Image<u32> merged_supporting_surfels[2][kMergeBufferCount];
+  const int thread_counts[2] = {1, 4};
+  for (int run = 0; run < 2; ++ run) {
+    scene.surfels = original_surfels;
+    u32 surfel_count = scene.surfels_size;
+    DetermineSupportingSurfelsAndMergeSurfelsCPU(
+        scene.Parameters(), /*merge_dist_factor*/ 1.f, merged_supporting_surfels[run], &surfel_count, thread_counts[run]);
+    EXPECT_EQ(scene.surfels_size - expected_merged, surfel_count);
+    merged_surfels[run] = scene.surfels;
+  }
+  
+  // The near-duplicate of cell 0 (index 1) got merged, the surfel with the
+  // different normal (index 2) did not.
+  EXPECT_TRUE(std::isnan(merged_surfels[0](1, kSurfelX)));
+  EXPECT_FALSE(std::isnan(merged_surfels[0](2, kSurfelX)));
+  
+  for (u32 i = 0; i < scene.surfels_size; ++ i) {
+    EXPECT_EQ(std::isnan(merged_surfels[0](i, kSurfelX)), std::isnan(merged_surfels[1](i, kSurfelX)));
+  }
+  for (int b = 0; b < kMergeBufferCount; ++ b) {
+    for (int y = 0; y < kHeight; ++ y) {
+      for (int x = 0; x < kWidth; ++ x) {
+        EXPECT_EQ(merged_supporting_surfels[0][b](x, y), merged_supporting_surfels[1][b](x, y));
+      }
+    }
+  }
+}
@@ -0,0 +1,158 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <cmath>
+
+#include <gtest/gtest.h>
+#include <libvis/libvis.h>
+
+#include "badslam/constants.h"
+#include "badslam/surfel_projection_cpu.h"
+#include "badslam/surfel_statistics.h"
+
+using namespace vis;
+
+namespace {
+
+// Grid of surfels on a fronto-parallel plane at 2 meters with normals facing
+// the camera. The grid spacing corresponds to a sparse_surfel_cell_size of 4
+// for the surfel radius.
+constexpr int kGridSize = 50;
+constexpr float kSurfelRadius = 0.005f;
+constexpr float kGridSpacing = 4 * kSurfelRadius;
+
+// Creates the surfel grid (followed by one deleted surfel) and three
+// keyframes: two which observe the whole grid, and one which looks away from
+// it.
+void CreateTestData(SurfelStateData* data) {
+  const int surfel_count = kGridSize * kGridSize + 1;
+  data->surfels.SetSize(surfel_count, kSurfelDataAttributeCount);
+  data->surfels.SetTo(0.f);
+  for (int y = 0; y < kGridSize; ++ y) {
+    for (int x = 0; x < kGridSize; ++ x) {
+      const u32 index = x + kGridSize * y;
+      data->surfels(index, kSurfelX) = (x - kGridSize / 2) * kGridSpacing;
+      data->surfels(index, kSurfelY) = (y - kGridSize / 2) * kGridSpacing;
+      data->surfels(index, kSurfelZ) = 2.f;
+      SurfelSetNormalCPU(&data->surfels, index, Vec3f(0, 0, -1));
+      data->surfels(index, kSurfelRadiusSquared) = kSurfelRadius * kSurfelRadius;
+    }
+  }
+  data->surfels(surfel_count - 1, kSurfelX) = numeric_limits<float>::quiet_NaN();
+  
+  float camera_parameters[4] = {500, 500, 320, 240};
+  data->depth_camera = PinholeCamera4f(640, 480, camera_parameters);
+  
+  data->keyframe_ids = {0, 1, 3};
+  data->keyframe_global_T_frame.push_back(SE3f());
+  data->keyframe_global_T_frame.push_back(SE3f(SO3f(), Vec3f(0.1f, 0, 0)));
+  data->keyframe_global_T_frame.push_back(SE3f(SO3f::exp(Vec3f(0, M_PI, 0)), Vec3f::Zero()));
+  
+  data->settings.sparse_surfel_cell_size = 4;
+  data->settings.surfel_merge_dist_factor = 0.8f;
+  data->settings.min_observation_count = 1;
+  data->max_depth = 3.f;
+}
+
+}
+
+TEST(SurfelStatistics, Statistics) {
+  SurfelStateData data;
+  CreateTestData(&data);
+  
+  SurfelStatisticsOptions options;
+  options.voxel_size = 0.1f;
+  SurfelStatistics statistics;
+  ComputeSurfelStatistics(data, options, &statistics);
+  
+  constexpr usize kSurfelCount = kGridSize * kGridSize;
+  EXPECT_EQ(kSurfelCount, statistics.surfel_count);
+  
+  // The grid spans [-0.5, 0.48] in x and y, which touches 10 x 10 voxels.
+  EXPECT_EQ(10 * 10, statistics.occupied_voxel_count);
+  usize histogram_voxel_count = 0;
+  for (usize count : statistics.voxel_density_histogram) {
+    histogram_voxel_count += count;
+  }
+  EXPECT_EQ(statistics.occupied_voxel_count, histogram_voxel_count);
+  
+  for (float radius : statistics.radius_quantiles) {
+    EXPECT_FLOAT_EQ(kSurfelRadius, radius);
+  }
+  
+  EXPECT_EQ(2 * kSurfelCount, statistics.observation_count);
+  EXPECT_EQ(2, statistics.observation_counts[0]);
+  EXPECT_EQ(0, statistics.observation_counts[kSurfelCount]);
+  
+  ASSERT_EQ(3, statistics.keyframe_observed_counts.size());
+  EXPECT_EQ(kSurfelCount, statistics.keyframe_observed_counts[0]);
+  EXPECT_EQ(kSurfelCount, statistics.keyframe_observed_counts[1]);
+  EXPECT_EQ(0, statistics.keyframe_observed_counts[2]);
+  EXPECT_EQ(kSurfelCount, statistics.keyframe_contributed_counts[0]);
+  EXPECT_EQ(0, statistics.keyframe_contributed_counts[1]);
+  EXPECT_EQ(0, statistics.keyframe_contributed_counts[2]);
+}
+
+TEST(SurfelStatistics, Predictions) {
+  SurfelStateData data;
+  CreateTestData(&data);
+  SurfelStatistics statistics;
+  ComputeSurfelStatistics(data, SurfelStatisticsOptions(), &statistics);
+  
+  constexpr usize kSurfelCount = kGridSize * kGridSize;
+  
+  // The saved settings reproduce the saved state.
+  SurfelSettingsPrediction prediction = PredictSurfelSettings(data, statistics, data.settings);
+  EXPECT_EQ(kSurfelCount, prediction.surfel_count);
+  EXPECT_EQ(statistics.observation_count, prediction.observation_count);
+  EXPECT_EQ(SurfelMemoryBytes(kSurfelCount), prediction.surfel_memory_bytes);
+  EXPECT_FALSE(prediction.extrapolated);
+  
+  // Doubling the cell size keeps every second surfel in both directions.
+  SurfelSettings settings = data.settings;
+  settings.sparse_surfel_cell_size = 8;
+  prediction = PredictSurfelSettings(data, statistics, settings);
+  EXPECT_EQ(kSurfelCount / 4, prediction.surfel_count);
+  EXPECT_EQ(statistics.observation_count / 4, prediction.observation_count);
+  EXPECT_FALSE(prediction.extrapolated);
+  
+  // Halving it is extrapolated.
+  settings.sparse_surfel_cell_size = 2;
+  prediction = PredictSurfelSettings(data, statistics, settings);
+  EXPECT_EQ(4 * kSurfelCount, prediction.surfel_count);
+  EXPECT_TRUE(prediction.extrapolated);
+  
+  // All surfels have two observations.
+  settings = data.settings;
+  settings.min_observation_count = 2;
+  prediction = PredictSurfelSettings(data, statistics, settings);
+  EXPECT_EQ(kSurfelCount, prediction.surfel_count);
+  settings.min_observation_count = 3;
+  prediction = PredictSurfelSettings(data, statistics, settings);
+  EXPECT_EQ(0, prediction.surfel_count);
+}
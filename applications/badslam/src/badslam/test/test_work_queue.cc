@@ -0,0 +1,116 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <gtest/gtest.h>
+#include <libvis/libvis.h>
+
+#include "badslam/work_queue.h"
+
+using namespace vis;
+
+TEST(WorkQueue, FirstInFirstOut) {
+  WorkQueue<int> queue;
+  EXPECT_TRUE(queue.empty());
+  
+  for (int i = 0; i < 5; ++ i) {
+    queue.Push(i);
+  }
+  ASSERT_EQ(5u, queue.size());
+  EXPECT_EQ(0, queue.front());
+  EXPECT_EQ(3, queue[3]);
+  
+  int expected = 0;
+  for (int item : queue) {
+    EXPECT_EQ(expected, item);
+    ++ expected;
+  }
+  
+  EXPECT_EQ(0, queue.Pop());
+  EXPECT_EQ(1, queue.Pop());
+  queue.Push(5);
+  for (int i = 2; i <= 5; ++ i) {
+    EXPECT_EQ(i, queue.Pop());
+  }
+  EXPECT_TRUE(queue.empty());
+}
+
+TEST(WorkQueue, Metrics) {
+  WorkQueue<int> queue("Test");
+  queue.Push(0);
+  queue.Push(1);
+  queue.Push(2);
+  queue.Pop();
+  queue.Push(3);
+  
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  queue.Pop();
+  queue.Clear();
+  
+  EXPECT_TRUE(queue.empty());
+  EXPECT_EQ(3u, queue.peak_size());
+  EXPECT_EQ(4u, queue.pushed_count());
+  EXPECT_EQ(2u, queue.popped_count());
+  EXPECT_GE(queue.max_wait_seconds(), 0.015);
+  EXPECT_GT(queue.mean_wait_seconds(), 0);
+  EXPECT_LE(queue.mean_wait_seconds(), queue.max_wait_seconds());
+  EXPECT_EQ(2u, Timing::getNumSamples("Test queue wait"));
+}
+
+TEST(WorkQueue, ProducerConsumer) {
+  constexpr int kItemCount = 10000;
+  
+  WorkQueue<int> queue;
+  mutex queue_mutex;
+  condition_variable queue_condition;
+  
+  std::thread producer([&]() {
+    for (int i = 0; i < kItemCount; ++ i) {
+      unique_lock<mutex> lock(queue_mutex);
+      queue.Push(i);
+      lock.unlock();
+      queue_condition.notify_all();
+    }
+  });
+  
+  for (int i = 0; i < kItemCount; ++ i) {
+    unique_lock<mutex> lock(queue_mutex);
+    while (queue.empty()) {
+      queue_condition.wait(lock);
+    }
+    EXPECT_EQ(i, queue.Pop());
+  }
+  
+  producer.join();
+  EXPECT_TRUE(queue.empty());
+  EXPECT_EQ(static_cast<usize>(kItemCount), queue.popped_count());
+}
@@ -37,6 +37,7 @@
 
 #include "badslam/cuda_matrix.cuh"
 #include "badslam/cuda_util.cuh"
+#include "badslam/normal_packing.h"
 #include "badslam/surfel_projection.cuh"
 
 namespace vis {
@@ -129,11 +130,4 @@ __forceinline__ __device__ float3 U16ToImageSpaceNormal(u16 value) {
   return result;
 }
 
-// Converts a 10-bit value to a float (allows unpacking three floats from a
-// 32-bit value).
-__forceinline__ float TenBitSignedToFloat(u32 value) {
-  u16 temp = ((0x0200 & value) ? 0xfc00 : 0) | (0x03ff & value);
-  return reinterpret_cast<i16&>(temp) * (1.0f / ((1 << 9) - 1));
-}
-
 }
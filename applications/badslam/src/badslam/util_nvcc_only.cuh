@@ -62,19 +62,6 @@ __forceinline__ __device__ float3 SurfelGetPosition(const CUDABuffer_<float>& su
       surfels(kSurfelZ, surfel_index));
 }
 
-// Converts a float (that must be in [-1, 1]) to a 10-bit value. Allows packing
-// three floats into a 32-bit value. Also see TenBitSignedToSmallFloat().
-__forceinline__ __device__ u32 SmallFloatToTenBitSigned(float value) {
-  return 0x03ff & static_cast<u16>(static_cast<i16>(value * ((1 << 9) - 1) + ((value > 0) ? 0.5f : -0.5f)));
-}
-
-// Converts a 10-bit value to a float. Allows unpacking three floats from a
-// 32-bit value. Also see SmallFloatToTenBitSigned().
-__forceinline__ __device__ float TenBitSignedToSmallFloat(u32 value) {
-  u16 temp = ((0x0200 & value) ? 0xfc00 : 0) | (0x03ff & value);
-  return reinterpret_cast<i16&>(temp) * (1.0f / ((1 << 9) - 1));
-}
-
 // Sets the normal vector of a surfel.
 __forceinline__ __device__ void SurfelSetNormal(CUDABuffer_<float>* surfels, u32 surfel_index, float3 normal) {
   *reinterpret_cast<u32*>(&((*surfels)(kSurfelNormal, surfel_index))) =
@@ -87,9 +74,9 @@ __forceinline__ __device__ void SurfelSetNormal(CUDABuffer_<float>* surfels, u32
 __forceinline__ __device__ float3 SurfelGetNormal(const CUDABuffer_<float>& surfels, u32 surfel_index) {
   u32 value = *reinterpret_cast<const u32*>(&(surfels(kSurfelNormal, surfel_index)));
   float3 normal = make_float3(
-      TenBitSignedToSmallFloat(value >> 0),
-      TenBitSignedToSmallFloat(value >> 10),
-      TenBitSignedToSmallFloat(value >> 20));
+      TenBitSignedToFloat(value >> 0),
+      TenBitSignedToFloat(value >> 10),
+      TenBitSignedToFloat(value >> 20));
   float factor = 1.0f / Norm(normal);
   return factor * normal;
 }
@@ -0,0 +1,160 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+
+#include <libvis/libvis.h>
+#include <libvis/logging.h>
+#include <libvis/timing.h>
+
+namespace vis {
+
+// A FIFO queue for handing work items from a producer thread to a consumer
+// thread (e.g., keyframes from odometry to BA, or images to loop detection).
+// Pushing and popping are O(1).
+// 
+// The queue is not synchronized by itself. All accesses must be protected by
+// the mutex which the producer and consumer share anyway for the condition
+// variable that the consumer waits on.
+// 
+// The queue keeps metrics about its depth and about how long items wait in
+// it. If a name is given, the wait times are also added to the global timing
+// statistics (see libvis/timing.h) as "<name> queue wait".
+template <typename T>
+class WorkQueue {
+ public:
+  typedef typename std::deque<T>::const_iterator const_iterator;
+  
+  WorkQueue()
+      : WorkQueue(string()) {}
+  
+  explicit WorkQueue(const string& name)
+      : name_(name) {
+    if (!name_.empty()) {
+      timing_handle_ = Timing::getHandle(name_ + " queue wait");
+    }
+  }
+  
+  WorkQueue(const WorkQueue& other) = delete;
+  WorkQueue& operator= (const WorkQueue& other) = delete;
+  
+  // Appends an item to the back of the queue.
+  void Push(const T& item) {
+    items_.push_back(item);
+    OnPushed();
+  }
+  
+  void Push(T&& item) {
+    items_.push_back(std::move(item));
+    OnPushed();
+  }
+  
+  // Removes the item at the front of the queue and returns it. The queue must
+  // not be empty.
+  T Pop() {
+    CHECK(!items_.empty());
+    
+    double wait_seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - push_times_.front()).count();
+    ++ popped_count_;
+    total_wait_seconds_ += wait_seconds;
+    max_wait_seconds_ = std::max(max_wait_seconds_, wait_seconds);
+    if (!name_.empty()) {
+      Timing::addTime(timing_handle_, wait_seconds);
+    }
+    
+    T item = std::move(items_.front());
+    items_.pop_front();
+    push_times_.pop_front();
+    return item;
+  }
+  
+  // Removes all items without counting them as popped.
+  void Clear() {
+    items_.clear();
+    push_times_.clear();
+  }
+  
+  inline const T& front() const { return items_.front(); }
+  inline const T& operator[](usize index) const { return items_[index]; }
+  inline const_iterator begin() const { return items_.begin(); }
+  inline const_iterator end() const { return items_.end(); }
+  
+  inline bool empty() const { return items_.empty(); }
+  inline usize size() const { return items_.size(); }
+  
+  
+  // --- Metrics ---
+  
+  // Returns the maximum number of items that were in the queue at the same
+  // time.
+  inline usize peak_size() const { return peak_size_; }
+  
+  inline usize pushed_count() const { return pushed_count_; }
+  inline usize popped_count() const { return popped_count_; }
+  
+  // Returns the mean / maximum time that the popped items spent in the queue.
+  inline double mean_wait_seconds() const {
+    return (popped_count_ == 0) ? 0 : (total_wait_seconds_ / popped_count_);
+  }
+  inline double max_wait_seconds() const { return max_wait_seconds_; }
+  
+  // Logs a one-line summary of the metrics.
+  void LogStatistics() const {
+    LOG(INFO) << (name_.empty() ? string("Work") : name_) << " queue: "
+              << pushed_count_ << " items pushed, " << popped_count_
+              << " popped, peak depth " << peak_size_ << ", mean wait "
+              << (1000 * mean_wait_seconds()) << " ms, max wait "
+              << (1000 * max_wait_seconds_) << " ms";
+  }
+  
+ private:
+  void OnPushed() {
+    push_times_.push_back(std::chrono::steady_clock::now());
+    ++ pushed_count_;
+    peak_size_ = std::max(peak_size_, items_.size());
+  }
+  
+  std::deque<T> items_;
+  std::deque<std::chrono::steady_clock::time_point> push_times_;
+  
+  string name_;
+  usize timing_handle_ = 0;
+  
+  usize peak_size_ = 0;
+  usize pushed_count_ = 0;
+  usize popped_count_ = 0;
+  double total_wait_seconds_ = 0;
+  double max_wait_seconds_ = 0;
+};
+
+}
@@ -65,7 +65,10 @@ enum DetectionStatus
   /// Not enough temporary consistent matches (k)
   NO_TEMPORAL_CONSISTENCY,
   /// The geometrical consistency failed
-  NO_GEOMETRICAL_CONSISTENCY
+  NO_GEOMETRICAL_CONSISTENCY,
+  /// The match passed all checks except for the geometrical one, which has
+  /// not been performed yet (see detectLoopCandidate())
+  LOOP_CANDIDATE
 };
 
 /// Result of a detection
@@ -267,6 +270,55 @@ public:
     vector<cv::KeyPoint>* out_old_keys,
     vector<cv::KeyPoint>* out_cur_keys);
   
+  /**
+   * Computes the bag-of-words vector and feature vector of an image as
+   * required by detectLoopCandidate(). This only reads the vocabulary and
+   * may be called concurrently with any other function.
+   * @param descriptors descriptors of the image
+   * @param bowvec (out) bag-of-words vector
+   * @param featvec (out) feature vector (only filled for GEOM_DI)
+   */
+  void transform(const std::vector<TDescriptor> &descriptors,
+    BowVector &bowvec, FeatureVector &featvec) const;
+  
+  /**
+   * Like detectLoop(), but takes the vectors computed by transform() and does
+   * not perform the geometrical check. If the best match passes all other
+   * checks, match.status is set to LOOP_CANDIDATE, and the caller must call
+   * isGeometricallyConsistent() for match.match to complete the detection.
+   * Splitting detectLoop() like this allows to verify candidates without
+   * blocking further calls to this function.
+   * @param keys keypoints of the image
+   * @param descriptors descriptors associated to the given keypoints
+   * @param bowvec bag-of-words vector of the image
+   * @param featvec feature vector of the image
+   * @param match (out) match or failing information
+   * @return true iff there is a loop candidate
+   */
+  bool detectLoopCandidate(const std::vector<cv::KeyPoint> &keys,
+    const std::vector<TDescriptor> &descriptors,
+    const BowVector &bowvec,
+    const FeatureVector &featvec,
+    DetectionResult &match);
+  
+  /**
+   * Performs the geometrical check that is configured in the parameters
+   * between a stored entry and the given image. This only reads the state of
+   * the detector: it may run concurrently with other calls to this function,
+   * but not concurrently with functions that modify the database.
+   * @param old_entry entry id of the stored image to check
+   * @param keys current keypoints
+   * @param descriptors current descriptors associated to the given keypoints
+   * @param featvec feature vector of the current image
+   * @return true iff the entry is geometrically consistent with the image
+   */
+  bool isGeometricallyConsistent(EntryId old_entry,
+    const std::vector<cv::KeyPoint> &keys,
+    const std::vector<TDescriptor> &descriptors,
+    const FeatureVector &featvec,
+    vector<cv::KeyPoint>* out_old_keys,
+    vector<cv::KeyPoint>* out_cur_keys) const;
+  
   void removeImage(int entry_id);
   
   /**
@@ -277,6 +329,26 @@ public:
 
 protected:
   
+  /**
+   * Database access. These functions can be overridden to retrieve the
+   * images with a different index than the DBoW2 database. Overriding them is
+   * not supported for GEOM_DI, which needs the direct index of the database.
+   */
+  
+  /// Returns the number of entries in the database (i.e., the next entry id)
+  virtual unsigned int databaseSize() const;
+  
+  /// Adds an entry to the database
+  virtual void addToDatabase(const BowVector &bowvec,
+    const FeatureVector &featvec);
+  
+  /// Queries the database, see TemplatedDatabase::query()
+  virtual void queryDatabase(const BowVector &bowvec, QueryResults &ret,
+    int max_results, int max_id) const;
+  
+  /// Removes an entry from the database
+  virtual void removeFromDatabase(EntryId entry_id);
+  
   /// Matching island
   struct tIsland
   {
@@ -709,22 +781,57 @@ bool TemplatedLoopDetector<TDescriptor, F>::detectLoop(
   vector<cv::KeyPoint>* out_old_keys,
   vector<cv::KeyPoint>* out_cur_keys)
 {
-  EntryId entry_id = m_database->size();
-  match.query = entry_id;
-  
   BowVector bowvec;
   FeatureVector featvec;
+  transform(descriptors, bowvec, featvec);
   
+  if(detectLoopCandidate(keys, descriptors, bowvec, featvec, match))
+  {
+    if(isGeometricallyConsistent(match.match, keys, descriptors, featvec,
+      out_old_keys, out_cur_keys))
+    {
+      match.status = LOOP_DETECTED;
+    }
+    else
+    {
+      match.status = NO_GEOMETRICAL_CONSISTENCY;
+    }
+  }
+  
+  return match.detection();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedLoopDetector<TDescriptor, F>::transform(
+  const std::vector<TDescriptor> &descriptors,
+  BowVector &bowvec, FeatureVector &featvec) const
+{
   if(m_params.geom_check == GEOM_DI)
     m_database->getVocabulary()->transform(descriptors, bowvec, featvec,
       m_params.di_levels);
   else
     m_database->getVocabulary()->transform(descriptors, bowvec);
+}
+
+// --------------------------------------------------------------------------
 
+template<class TDescriptor, class F>
+bool TemplatedLoopDetector<TDescriptor, F>::detectLoopCandidate(
+  const std::vector<cv::KeyPoint> &keys,
+  const std::vector<TDescriptor> &descriptors,
+  const BowVector &bowvec,
+  const FeatureVector &featvec,
+  DetectionResult &match)
+{
+  EntryId entry_id = databaseSize();
+  match.query = entry_id;
+  
   if((int)entry_id <= m_params.dislocal)
   {
     // only add the entry to the database and finish
-    m_database->add(bowvec, featvec);
+    addToDatabase(bowvec, featvec);
     match.status = CLOSE_MATCHES_ONLY;
   }
   else
@@ -732,10 +839,10 @@ bool TemplatedLoopDetector<TDescriptor, F>::detectLoop(
     int max_id = (int)entry_id - m_params.dislocal;
     
     QueryResults qret;
-    m_database->query(bowvec, qret, m_params.max_db_results, max_id);
+    queryDatabase(bowvec, qret, m_params.max_db_results, max_id);
 
     // update database
-    m_database->add(bowvec, featvec); // returns entry_id
+    addToDatabase(bowvec, featvec);
     
     if(!qret.empty())
     {
@@ -781,44 +888,9 @@ bool TemplatedLoopDetector<TDescriptor, F>::detectLoop(
             
             if(getConsistentEntries() > m_params.k)
             {
-              // candidate loop detected
-              // check geometry
-              bool detection;
-
-              if(m_params.geom_check == GEOM_DI)
-              {
-                // all the DI stuff is implicit in the database
-                detection = isGeometricallyConsistent_DI(island.best_entry, 
-                  keys, descriptors, featvec, out_old_keys, out_cur_keys);
-              }
-              else if(m_params.geom_check == GEOM_FLANN)
-              {
-                cv::FlannBasedMatcher flann_structure;
-                getFlannStructure(descriptors, flann_structure);
-                            
-                detection = isGeometricallyConsistent_Flann(island.best_entry, 
-                  keys, descriptors, flann_structure);
-              }
-              else if(m_params.geom_check == GEOM_EXHAUSTIVE)
-              { 
-                detection = isGeometricallyConsistent_Exhaustive(
-                  m_image_keys[island.best_entry], 
-                  m_image_descriptors[island.best_entry],
-                  keys, descriptors, out_old_keys, out_cur_keys);            
-              }
-              else // GEOM_NONE, accept the match
-              {
-                detection = true;
-              }
-              
-              if(detection)
-              {
-                match.status = LOOP_DETECTED;
-              }
-              else
-              {
-                match.status = NO_GEOMETRICAL_CONSISTENCY;
-              }
+              // candidate loop detected, the geometry is checked
+              // separately
+              match.status = LOOP_CANDIDATE;
               
             } // if enough temporal matches
             else
@@ -867,26 +939,95 @@ bool TemplatedLoopDetector<TDescriptor, F>::detectLoop(
     m_last_bowvec = bowvec;
   }
 
-  return match.detection();
+  return match.status == LOOP_CANDIDATE;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+bool TemplatedLoopDetector<TDescriptor, F>::isGeometricallyConsistent(
+  EntryId old_entry,
+  const std::vector<cv::KeyPoint> &keys,
+  const std::vector<TDescriptor> &descriptors,
+  const FeatureVector &featvec,
+  vector<cv::KeyPoint>* out_old_keys,
+  vector<cv::KeyPoint>* out_cur_keys) const
+{
+  if(m_params.geom_check == GEOM_DI)
+  {
+    // all the DI stuff is implicit in the database
+    return isGeometricallyConsistent_DI(old_entry, 
+      keys, descriptors, featvec, out_old_keys, out_cur_keys);
+  }
+  else if(m_params.geom_check == GEOM_FLANN)
+  {
+    cv::FlannBasedMatcher flann_structure;
+    getFlannStructure(descriptors, flann_structure);
+                
+    return isGeometricallyConsistent_Flann(old_entry, 
+      keys, descriptors, flann_structure);
+  }
+  else if(m_params.geom_check == GEOM_EXHAUSTIVE)
+  { 
+    return isGeometricallyConsistent_Exhaustive(
+      m_image_keys[old_entry], 
+      m_image_descriptors[old_entry],
+      keys, descriptors, out_old_keys, out_cur_keys);            
+  }
+  else // GEOM_NONE, accept the match
+  {
+    return true;
+  }
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
 void TemplatedLoopDetector<TDescriptor, F>::removeImage(int entry_id) {
+  removeFromDatabase(entry_id);
+  
+  m_image_keys[entry_id] = vector<cv::KeyPoint>();
+  m_image_descriptors[entry_id] = vector<TDescriptor>();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+unsigned int TemplatedLoopDetector<TDescriptor, F>::databaseSize() const
+{
+  return m_database->size();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedLoopDetector<TDescriptor, F>::addToDatabase(
+  const BowVector &bowvec, const FeatureVector &featvec)
+{
+  m_database->add(bowvec, featvec);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedLoopDetector<TDescriptor, F>::queryDatabase(
+  const BowVector &bowvec, QueryResults &ret,
+  int max_results, int max_id) const
+{
+  m_database->query(bowvec, ret, max_results, max_id);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedLoopDetector<TDescriptor, F>::removeFromDatabase(
+  EntryId entry_id)
+{
   BowVector bowvec;
   FeatureVector featvec;
-  
-  if(m_params.geom_check == GEOM_DI)
-    m_database->getVocabulary()->transform(m_image_descriptors[entry_id], bowvec, featvec,
-      m_params.di_levels);
-  else
-    m_database->getVocabulary()->transform(m_image_descriptors[entry_id], bowvec);
+  transform(m_image_descriptors[entry_id], bowvec, featvec);
   
   m_database->remove(entry_id, bowvec);
-  
-  m_image_keys[entry_id] = vector<cv::KeyPoint>();
-  m_image_descriptors[entry_id] = vector<TDescriptor>();
 }
 
 // --------------------------------------------------------------------------
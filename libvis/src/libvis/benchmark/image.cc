@@ -0,0 +1,143 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+#include "libvis/image.h"
+#include "libvis/logging.h"
+#include "libvis/timing.h"
+
+using namespace vis;
+
+// Measures the run time of the CPU image filtering and resampling functions
+// for typical camera image sizes. Run it in a release build with:
+//   libvis_benchmark [iteration_count]
+
+namespace {
+template <typename T>
+void SetToRandomValues(int max_value, Image<T>* image) {
+  std::mt19937 generator(42);
+  std::uniform_int_distribution<int> distribution(0, max_value);
+  for (u32 y = 0; y < image->height(); ++ y) {
+    for (u32 x = 0; x < image->width(); ++ x) {
+      (*image)(x, y) = distribution(generator);
+    }
+  }
+}
+
+// Runs func iteration_count times and prints the minimum and average run time.
+template <typename Func>
+void Benchmark(const char* name, const Image<u8>& size_image, int iteration_count, const Func& func) {
+  double min_seconds = numeric_limits<double>::infinity();
+  double sum_seconds = 0;
+  for (int iteration = 0; iteration < iteration_count; ++ iteration) {
+    Timer timer;
+    func();
+    double seconds = timer.Stop(/*add_to_statistics*/ false);
+    min_seconds = std::min(min_seconds, seconds);
+    sum_seconds += seconds;
+  }
+  std::cout << std::left << std::setw(44) << name
+            << size_image.width() << " x " << std::setw(8) << size_image.height()
+            << std::right << std::fixed << std::setprecision(3)
+            << "min: " << std::setw(9) << (1000 * min_seconds) << " ms   "
+            << "avg: " << std::setw(9) << (1000 * sum_seconds / iteration_count) << " ms" << std::endl;
+}
+}
+
+int main(int argc, char** argv) {
+  int iteration_count = (argc > 1) ? atoi(argv[1]) : 20;
+  if (iteration_count <= 0) {
+    LOG(ERROR) << "Usage: " << argv[0] << " [iteration_count]";
+    return EXIT_FAILURE;
+  }
+  std::cout << "Threads: " << DefaultThreadCount() << ", iterations: " << iteration_count << std::endl;
+  
+  for (const ImageSize& size : {ImageSize(640, 480), ImageSize(1920, 1080)}) {
+    Image<u8> image_u8(size.x(), size.y());
+    SetToRandomValues(255, &image_u8);
+    Image<u16> image_u16(size.x(), size.y());
+    SetToRandomValues(5000, &image_u16);
+    Image<float> image_float(size.x(), size.y());
+    SetToRandomValues(5000, &image_float);
+    Image<Vec3u8> image_Vec3u8(size.x(), size.y());
+    for (u32 y = 0; y < size.y(); ++ y) {
+      for (u32 x = 0; x < size.x(); ++ x) {
+        image_Vec3u8(x, y) = Vec3u8(image_u8(x, y), image_u16(x, y) & 0xff, 255 - image_u8(x, y));
+      }
+    }
+    
+    Image<u8> result_u8;
+    Image<u16> result_u16;
+    Image<float> result_float;
+    Image<Vec3u8> result_Vec3u8;
+    Image<u32> result_u32;
+    
+    Benchmark("DownscaleToHalfSize<u8>", image_u8, iteration_count, [&]() {
+      image_u8.DownscaleToHalfSize(&result_u8);
+    });
+    Benchmark("DownscaleToHalfSize<u16>", image_u8, iteration_count, [&]() {
+      image_u16.DownscaleToHalfSize(&result_u16);
+    });
+    Benchmark("DownscaleToHalfSize<float>", image_u8, iteration_count, [&]() {
+      image_float.DownscaleToHalfSize(&result_float);
+    });
+    Benchmark("DownscaleToHalfSize<Vec3u8>", image_u8, iteration_count, [&]() {
+      image_Vec3u8.DownscaleToHalfSize(&result_Vec3u8);
+    });
+    Benchmark("DownscaleUsingMedian<u16> (to 1/2)", image_u8, iteration_count, [&]() {
+      image_u16.DownscaleUsingMedian(size.x() / 2, size.y() / 2, &result_u16);
+    });
+    Benchmark("DownscaleUsingMedianWhileExcluding<u16> (to 1/3)", image_u8, iteration_count, [&]() {
+      image_u16.DownscaleUsingMedianWhileExcluding(0, size.x() / 3, size.y() / 3, &result_u16);
+    });
+    Benchmark("BilateralFilter<u8>", image_u8, iteration_count, [&]() {
+      image_u8.BilateralFilter(2.f, 10, 0, 2.f, &result_u8);
+    });
+    Benchmark("BilateralFilter<u16>", image_u8, iteration_count, [&]() {
+      image_u16.BilateralFilter(2.f, 100, 0, 2.f, &result_u16);
+    });
+    Benchmark("BilateralFilter<float>", image_u8, iteration_count, [&]() {
+      image_float.BilateralFilter(2.f, 100.f, 0.f, 2.f, &result_float);
+    });
+    Benchmark("ConvertToGrayscale<Vec3u8 -> u8>", image_u8, iteration_count, [&]() {
+      image_Vec3u8.ConvertToGrayscale(&result_u8);
+    });
+    Benchmark("ConvertToGrayscale<Vec3u8 -> float>", image_u8, iteration_count, [&]() {
+      image_Vec3u8.ConvertToGrayscale(&result_float);
+    });
+    Benchmark("ComputeIntegralImage<u8 -> u32>", image_u8, iteration_count, [&]() {
+      image_u8.ComputeIntegralImage(&result_u32);
+    });
+  }
+  
+  return EXIT_SUCCESS;
+}
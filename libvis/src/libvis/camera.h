@@ -72,6 +72,11 @@
 #include "libvis/eigen.h"
 #include "libvis/libvis.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+  #define LIBVIS_HAVE_SSE2
+#endif
+
 namespace vis {
 
 // Different image coordinate system conventions, which describe how coordinates
@@ -368,6 +373,38 @@ class Camera {
   template <typename Derived>
   inline Matrix<double, 3, 1> UnprojectFromRatioConv(const MatrixBase<Derived>& pixel_coordinates) const;
   
+  // Batch versions of the projection and unprojection functions above, working
+  // on structure-of-arrays input with count points. The camera type is
+  // identified only once per call. Unprojection returns the x and y components
+  // of directions with z = 1. The output arrays may be identical to the input
+  // arrays. See the corresponding functions in CameraImpl for details.
+  template <typename T>
+  inline void ProjectPointsToPixelCornerConv(usize count, const T* x, const T* y, const T* z, T* px, T* py) const;
+  
+  template <typename T>
+  inline void ProjectPointsToPixelCenterConv(usize count, const T* x, const T* y, const T* z, T* px, T* py) const;
+  
+  template <typename T>
+  inline void ProjectPointsToRatioConv(usize count, const T* x, const T* y, const T* z, T* px, T* py) const;
+  
+  template <typename T>
+  inline void ProjectPointsToPixelCornerConvIfVisible(usize count, const T* x, const T* y, const T* z, float pixel_border, T* px, T* py, u8* visible) const;
+  
+  template <typename T>
+  inline void ProjectPointsToPixelCenterConvIfVisible(usize count, const T* x, const T* y, const T* z, float pixel_border, T* px, T* py, u8* visible) const;
+  
+  template <typename T>
+  inline void ProjectPointsToRatioConvIfVisible(usize count, const T* x, const T* y, const T* z, float pixel_border, T* px, T* py, u8* visible) const;
+  
+  template <typename T>
+  inline void UnprojectPointsFromPixelCornerConv(usize count, const T* px, const T* py, T* nx, T* ny) const;
+  
+  template <typename T>
+  inline void UnprojectPointsFromPixelCenterConv(usize count, const T* px, const T* py, T* nx, T* ny) const;
+  
+  template <typename T>
+  inline void UnprojectPointsFromRatioConv(usize count, const T* px, const T* py, T* nx, T* ny) const;
+  
   // Creates a scaled version of this camera, suitable for an image size which
   // is scaled by the same amount. The returned object has to be deleted using
   // delete.
@@ -889,66 +926,108 @@ class PixelMapping4 {
                                u32 height,
                                const Scalar* parameters,
                                MatrixBase<DerivedB>* pixel_coordinates) const {
+    *pixel_coordinates = Project<convention>(normalized_image_coordinates, parameters);
+    float min_x, min_y, max_x, max_y;
+    GetVisibleRange<convention>(pixel_border, width, height, &min_x, &min_y, &max_x, &max_y);
+    return pixel_coordinates->coeff(0) >= min_x &&
+           pixel_coordinates->coeff(1) >= min_y &&
+           pixel_coordinates->coeff(0) < max_x &&
+           pixel_coordinates->coeff(1) < max_y;
+  }
+  
+  template<ImageCoordinateConvention convention, typename Derived>
+  inline OutputType Project(const MatrixBase<Derived>& normalized_image_coordinates,
+                            const Scalar* parameters) const {
+    Scalar scale_x, scale_y, offset_x, offset_y;
+    GetProjectionCoefficients<convention>(parameters, &scale_x, &scale_y, &offset_x, &offset_y);
+    return OutputType(scale_x * normalized_image_coordinates.coeff(0) + offset_x,
+                      scale_y * normalized_image_coordinates.coeff(1) + offset_y);
+  }
+  
+  template<ImageCoordinateConvention convention, typename Derived>
+  inline InputType Unproject(const MatrixBase<Derived>& projected_point, const Scalar* parameters) const {
+    Scalar scale_x, scale_y, offset_x, offset_y;
+    GetUnprojectionCoefficients<convention>(parameters, &scale_x, &scale_y, &offset_x, &offset_y);
+    return InputType(scale_x * projected_point.coeff(0) + offset_x,
+                     scale_y * projected_point.coeff(1) + offset_y);
+  }
+  
+  // Returns the coefficients of the mapping applied by Project(), which maps
+  // normalized image coordinates (nx, ny) to the pixel coordinates
+  // (scale_x * nx + offset_x, scale_y * ny + offset_y).
+  template<ImageCoordinateConvention convention>
+  inline void GetProjectionCoefficients(const Scalar* parameters,
+                                        Scalar* scale_x, Scalar* scale_y,
+                                        Scalar* offset_x, Scalar* offset_y) const {
     if (convention == ImageCoordinateConvention::kPixelCorner) {
-      *pixel_coordinates = Project<convention>(normalized_image_coordinates, parameters);
-      return pixel_coordinates->coeff(0) >= pixel_border &&
-             pixel_coordinates->coeff(1) >= pixel_border &&
-             pixel_coordinates->coeff(0) < width - pixel_border &&
-             pixel_coordinates->coeff(1) < height - pixel_border;
+      *scale_x = parameters[0];
+      *scale_y = parameters[1];
+      *offset_x = parameters[2];
+      *offset_y = parameters[3];
     } else if (convention == ImageCoordinateConvention::kPixelCenter) {
-      *pixel_coordinates = Project<convention>(normalized_image_coordinates, parameters);
-      return pixel_coordinates->coeff(0) >= -0.5f + pixel_border &&
-             pixel_coordinates->coeff(1) >= -0.5f + pixel_border &&
-             pixel_coordinates->coeff(0) < width - 0.5f - pixel_border &&
-             pixel_coordinates->coeff(1) < height - 0.5f - pixel_border;
+      *scale_x = parameters[0];
+      *scale_y = parameters[1];
+      *offset_x = cx_pixel_center_;
+      *offset_y = cy_pixel_center_;
     } else if (convention == ImageCoordinateConvention::kRatio) {
-      *pixel_coordinates = Project<convention>(normalized_image_coordinates, parameters);
-      return pixel_coordinates->coeff(0) >= 0 &&
-             pixel_coordinates->coeff(1) >= 0 &&
-             pixel_coordinates->coeff(0) < 1 &&
-             pixel_coordinates->coeff(1) < 1;
+      *scale_x = fx_ratio_;
+      *scale_y = fy_ratio_;
+      *offset_x = cx_ratio_;
+      *offset_y = cy_ratio_;
+    } else {
+      LOG(FATAL) << "convention not supported";
     }
-    LOG(FATAL) << "convention not supported";
-    return false;
   }
   
-  template<ImageCoordinateConvention convention, typename Derived>
-  inline OutputType Project(const MatrixBase<Derived>& normalized_image_coordinates,
-                            const Scalar* parameters) const {
+  // Returns the coefficients of the inverse mapping, applied by Unproject().
+  template<ImageCoordinateConvention convention>
+  inline void GetUnprojectionCoefficients(const Scalar* /*parameters*/,
+                                          Scalar* scale_x, Scalar* scale_y,
+                                          Scalar* offset_x, Scalar* offset_y) const {
     if (convention == ImageCoordinateConvention::kPixelCorner) {
-      const Scalar& fx = parameters[0];
-      const Scalar& fy = parameters[1];
-      const Scalar& cx = parameters[2];
-      const Scalar& cy = parameters[3];
-      return OutputType(fx * normalized_image_coordinates.coeff(0) + cx,
-                        fy * normalized_image_coordinates.coeff(1) + cy);
+      *scale_x = fx_inv_;
+      *scale_y = fy_inv_;
+      *offset_x = cx_inv_;
+      *offset_y = cy_inv_;
     } else if (convention == ImageCoordinateConvention::kPixelCenter) {
-      const Scalar& fx = parameters[0];
-      const Scalar& fy = parameters[1];
-      return OutputType(fx * normalized_image_coordinates.coeff(0) + cx_pixel_center_,
-                        fy * normalized_image_coordinates.coeff(1) + cy_pixel_center_);
+      *scale_x = fx_inv_;
+      *scale_y = fy_inv_;
+      *offset_x = cx_inv_pixel_center_;
+      *offset_y = cy_inv_pixel_center_;
     } else if (convention == ImageCoordinateConvention::kRatio) {
-      return OutputType(fx_ratio_ * normalized_image_coordinates.coeff(0) + cx_ratio_,
-                        fy_ratio_ * normalized_image_coordinates.coeff(1) + cy_ratio_);
+      *scale_x = fx_inv_ratio_;
+      *scale_y = fy_inv_ratio_;
+      *offset_x = cx_inv_ratio_;
+      *offset_y = cy_inv_ratio_;
+    } else {
+      LOG(FATAL) << "convention not supported";
     }
-    LOG(FATAL) << "convention not supported";
-    return OutputType();
   }
   
-  template<ImageCoordinateConvention convention, typename Derived>
-  inline InputType Unproject(const MatrixBase<Derived>& projected_point, const Scalar* /*parameters*/) const {
+  // Returns the range of pixel coordinates in which ProjectIfVisible()
+  // considers a point to be visible: [min_x, max_x[ x [min_y, max_y[.
+  template<ImageCoordinateConvention convention>
+  static inline void GetVisibleRange(float pixel_border, u32 width, u32 height,
+                                     float* min_x, float* min_y,
+                                     float* max_x, float* max_y) {
     if (convention == ImageCoordinateConvention::kPixelCorner) {
-      return InputType(fx_inv_ * projected_point.coeff(0) + cx_inv_,
-                       fy_inv_ * projected_point.coeff(1) + cy_inv_);
+      *min_x = pixel_border;
+      *min_y = pixel_border;
+      *max_x = width - pixel_border;
+      *max_y = height - pixel_border;
     } else if (convention == ImageCoordinateConvention::kPixelCenter) {
-      return InputType(fx_inv_ * projected_point.coeff(0) + cx_inv_pixel_center_,
-                       fy_inv_ * projected_point.coeff(1) + cy_inv_pixel_center_);
+      *min_x = -0.5f + pixel_border;
+      *min_y = -0.5f + pixel_border;
+      *max_x = width - 0.5f - pixel_border;
+      *max_y = height - 0.5f - pixel_border;
     } else if (convention == ImageCoordinateConvention::kRatio) {
-      return InputType(fx_inv_ratio_ * projected_point.coeff(0) + cx_inv_ratio_,
-                       fy_inv_ratio_ * projected_point.coeff(1) + cy_inv_ratio_);
+      *min_x = 0;
+      *min_y = 0;
+      *max_x = 1;
+      *max_y = 1;
+    } else {
+      LOG(FATAL) << "convention not supported";
     }
-    LOG(FATAL) << "convention not supported";
-    return InputType();
   }
   
   inline void ScaleParameters(Scalar factor, Scalar* parameters) const {
@@ -1491,6 +1570,245 @@ template<class Step, class... Steps>
 struct GetCameraParameterCount<Step, Steps...>
     : integral_constant<usize, Step::kParameterCount + GetCameraParameterCount<Steps...>::value > {};
 
+// Tag type which lists the algorithm steps of a camera model. It is used to
+// select specialized implementations of the batch functions of CameraImpl for
+// some camera models.
+template<class... Steps>
+struct CameraStepList {};
+
+// SIMD kernels for the batch functions of CameraImpl. Each kernel processes
+// the points in blocks and returns the number of points it processed; the
+// remaining points are processed by the caller. The generic versions process
+// no points and are used for the types for which no SIMD version exists (and
+// if SSE2 is not available). The SIMD versions perform the same operations in
+// the same order as the single-point functions.
+
+// Pinhole projection followed by a pixel mapping with the given coefficients
+// (see PixelMapping4::GetProjectionCoefficients()).
+template <typename Scalar, typename T>
+inline usize ProjectPinholePointsSIMD(
+    usize /*count*/, const T* /*x*/, const T* /*y*/, const T* /*z*/,
+    Scalar /*scale_x*/, Scalar /*scale_y*/, Scalar /*offset_x*/, Scalar /*offset_y*/,
+    T* /*px*/, T* /*py*/) {
+  return 0;
+}
+
+// Like ProjectPinholePointsSIMD(), but additionally determines visibility
+// like PinholeProjection::ProjectIfVisible() and
+// PixelMapping4::ProjectIfVisible() with the given visible range. The pixel
+// coordinates of invisible points are set to NaN.
+template <typename Scalar, typename T>
+inline usize ProjectPinholePointsIfVisibleSIMD(
+    usize /*count*/, const T* /*x*/, const T* /*y*/, const T* /*z*/,
+    Scalar /*scale_x*/, Scalar /*scale_y*/, Scalar /*offset_x*/, Scalar /*offset_y*/,
+    float /*min_x*/, float /*min_y*/, float /*max_x*/, float /*max_y*/,
+    T* /*px*/, T* /*py*/, u8* /*visible*/) {
+  return 0;
+}
+
+// Pixel unmapping with the given coefficients (see
+// PixelMapping4::GetUnprojectionCoefficients()), which is all that pinhole
+// unprojection does for the x and y components.
+template <typename Scalar, typename T>
+inline usize UnprojectPinholePointsSIMD(
+    usize /*count*/, const T* /*px*/, const T* /*py*/,
+    Scalar /*scale_x*/, Scalar /*scale_y*/, Scalar /*offset_x*/, Scalar /*offset_y*/,
+    T* /*nx*/, T* /*ny*/) {
+  return 0;
+}
+
+// Pinhole projection, followed by RadtanDistortion4 with the given
+// distortion parameters (k1, k2, r1, r2) and the pixel mapping.
+template <typename Scalar, typename T>
+inline usize ProjectRadtanPointsSIMD(
+    usize /*count*/, const T* /*x*/, const T* /*y*/, const T* /*z*/,
+    const Scalar* /*distortion_parameters*/,
+    Scalar /*scale_x*/, Scalar /*scale_y*/, Scalar /*offset_x*/, Scalar /*offset_y*/,
+    T* /*px*/, T* /*py*/) {
+  return 0;
+}
+
+template <typename Scalar, typename T>
+inline usize ProjectRadtanPointsIfVisibleSIMD(
+    usize /*count*/, const T* /*x*/, const T* /*y*/, const T* /*z*/,
+    const Scalar* /*distortion_parameters*/,
+    Scalar /*scale_x*/, Scalar /*scale_y*/, Scalar /*offset_x*/, Scalar /*offset_y*/,
+    float /*min_x*/, float /*min_y*/, float /*max_x*/, float /*max_y*/,
+    T* /*px*/, T* /*py*/, u8* /*visible*/) {
+  return 0;
+}
+
+#ifdef LIBVIS_HAVE_SSE2
+inline usize ProjectPinholePointsSIMD(
+    usize count, const float* x, const float* y, const float* z,
+    float scale_x, float scale_y, float offset_x, float offset_y,
+    float* px, float* py) {
+  const __m128 scale_x_4 = _mm_set1_ps(scale_x);
+  const __m128 scale_y_4 = _mm_set1_ps(scale_y);
+  const __m128 offset_x_4 = _mm_set1_ps(offset_x);
+  const __m128 offset_y_4 = _mm_set1_ps(offset_y);
+  usize i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 z_4 = _mm_loadu_ps(z + i);
+    __m128 nx = _mm_div_ps(_mm_loadu_ps(x + i), z_4);
+    __m128 ny = _mm_div_ps(_mm_loadu_ps(y + i), z_4);
+    _mm_storeu_ps(px + i, _mm_add_ps(_mm_mul_ps(scale_x_4, nx), offset_x_4));
+    _mm_storeu_ps(py + i, _mm_add_ps(_mm_mul_ps(scale_y_4, ny), offset_y_4));
+  }
+  return i;
+}
+
+inline usize ProjectPinholePointsIfVisibleSIMD(
+    usize count, const float* x, const float* y, const float* z,
+    float scale_x, float scale_y, float offset_x, float offset_y,
+    float min_x, float min_y, float max_x, float max_y,
+    float* px, float* py, u8* visible) {
+  const __m128 scale_x_4 = _mm_set1_ps(scale_x);
+  const __m128 scale_y_4 = _mm_set1_ps(scale_y);
+  const __m128 offset_x_4 = _mm_set1_ps(offset_x);
+  const __m128 offset_y_4 = _mm_set1_ps(offset_y);
+  const __m128 min_x_4 = _mm_set1_ps(min_x);
+  const __m128 min_y_4 = _mm_set1_ps(min_y);
+  const __m128 max_x_4 = _mm_set1_ps(max_x);
+  const __m128 max_y_4 = _mm_set1_ps(max_y);
+  const __m128 nan = _mm_set1_ps(numeric_limits<float>::quiet_NaN());
+  usize i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 z_4 = _mm_loadu_ps(z + i);
+    __m128 pixel_x = _mm_add_ps(_mm_mul_ps(scale_x_4, _mm_div_ps(_mm_loadu_ps(x + i), z_4)), offset_x_4);
+    __m128 pixel_y = _mm_add_ps(_mm_mul_ps(scale_y_4, _mm_div_ps(_mm_loadu_ps(y + i), z_4)), offset_y_4);
+    __m128 mask = _mm_and_ps(
+        _mm_cmpgt_ps(z_4, _mm_setzero_ps()),
+        _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(pixel_x, min_x_4), _mm_cmpge_ps(pixel_y, min_y_4)),
+                   _mm_and_ps(_mm_cmplt_ps(pixel_x, max_x_4), _mm_cmplt_ps(pixel_y, max_y_4))));
+    _mm_storeu_ps(px + i, _mm_or_ps(_mm_and_ps(mask, pixel_x), _mm_andnot_ps(mask, nan)));
+    _mm_storeu_ps(py + i, _mm_or_ps(_mm_and_ps(mask, pixel_y), _mm_andnot_ps(mask, nan)));
+    int mask_bits = _mm_movemask_ps(mask);
+    for (int k = 0; k < 4; ++ k) {
+      visible[i + k] = (mask_bits >> k) & 1;
+    }
+  }
+  return i;
+}
+
+inline usize UnprojectPinholePointsSIMD(
+    usize count, const float* px, const float* py,
+    float scale_x, float scale_y, float offset_x, float offset_y,
+    float* nx, float* ny) {
+  const __m128 scale_x_4 = _mm_set1_ps(scale_x);
+  const __m128 scale_y_4 = _mm_set1_ps(scale_y);
+  const __m128 offset_x_4 = _mm_set1_ps(offset_x);
+  const __m128 offset_y_4 = _mm_set1_ps(offset_y);
+  usize i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 pixel_x = _mm_loadu_ps(px + i);
+    __m128 pixel_y = _mm_loadu_ps(py + i);
+    _mm_storeu_ps(nx + i, _mm_add_ps(_mm_mul_ps(scale_x_4, pixel_x), offset_x_4));
+    _mm_storeu_ps(ny + i, _mm_add_ps(_mm_mul_ps(scale_y_4, pixel_y), offset_y_4));
+  }
+  return i;
+}
+
+// Loads two values as doubles, respectively stores two doubles. The radtan
+// kernels compute in double precision (like the double-typed camera) for
+// both float and double input and output.
+inline __m128d LoadTwoAsDoubleSSE2(const double* values) {
+  return _mm_loadu_pd(values);
+}
+
+inline __m128d LoadTwoAsDoubleSSE2(const float* values) {
+  return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(values))));
+}
+
+inline void StoreTwoSSE2(__m128d values, double* output) {
+  _mm_storeu_pd(output, values);
+}
+
+inline void StoreTwoSSE2(__m128d values, float* output) {
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(output), _mm_castps_si128(_mm_cvtpd_ps(values)));
+}
+
+// Computes the distorted pixel coordinates of two points with the same
+// operations as RadtanDistortion4::Project() and PixelMapping4::Project().
+inline void ProjectRadtanSSE2(
+    __m128d x, __m128d y, __m128d z,
+    const double* distortion_parameters,
+    double scale_x, double scale_y, double offset_x, double offset_y,
+    __m128d* pixel_x, __m128d* pixel_y) {
+  const __m128d k1 = _mm_set1_pd(distortion_parameters[0]);
+  const __m128d k2 = _mm_set1_pd(distortion_parameters[1]);
+  const __m128d r1 = _mm_set1_pd(distortion_parameters[2]);
+  const __m128d r2 = _mm_set1_pd(distortion_parameters[3]);
+  const __m128d two = _mm_set1_pd(2);
+  
+  __m128d nx = _mm_div_pd(x, z);
+  __m128d ny = _mm_div_pd(y, z);
+  __m128d mx2_u = _mm_mul_pd(nx, nx);
+  __m128d my2_u = _mm_mul_pd(ny, ny);
+  __m128d mxy_u = _mm_mul_pd(nx, ny);
+  __m128d rho2_u = _mm_add_pd(mx2_u, my2_u);
+  __m128d rad_dist_u = _mm_add_pd(_mm_mul_pd(k1, rho2_u), _mm_mul_pd(_mm_mul_pd(k2, rho2_u), rho2_u));
+  __m128d distorted_x = _mm_add_pd(
+      _mm_add_pd(_mm_add_pd(nx, _mm_mul_pd(nx, rad_dist_u)), _mm_mul_pd(_mm_mul_pd(two, r1), mxy_u)),
+      _mm_mul_pd(r2, _mm_add_pd(rho2_u, _mm_mul_pd(two, mx2_u))));
+  __m128d distorted_y = _mm_add_pd(
+      _mm_add_pd(_mm_add_pd(ny, _mm_mul_pd(ny, rad_dist_u)), _mm_mul_pd(_mm_mul_pd(two, r2), mxy_u)),
+      _mm_mul_pd(r1, _mm_add_pd(rho2_u, _mm_mul_pd(two, my2_u))));
+  *pixel_x = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(scale_x), distorted_x), _mm_set1_pd(offset_x));
+  *pixel_y = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(scale_y), distorted_y), _mm_set1_pd(offset_y));
+}
+
+template <typename T>
+inline usize ProjectRadtanPointsSIMD(
+    usize count, const T* x, const T* y, const T* z,
+    const double* distortion_parameters,
+    double scale_x, double scale_y, double offset_x, double offset_y,
+    T* px, T* py) {
+  usize i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128d pixel_x, pixel_y;
+    ProjectRadtanSSE2(LoadTwoAsDoubleSSE2(x + i), LoadTwoAsDoubleSSE2(y + i), LoadTwoAsDoubleSSE2(z + i),
+                      distortion_parameters, scale_x, scale_y, offset_x, offset_y,
+                      &pixel_x, &pixel_y);
+    StoreTwoSSE2(pixel_x, px + i);
+    StoreTwoSSE2(pixel_y, py + i);
+  }
+  return i;
+}
+
+template <typename T>
+inline usize ProjectRadtanPointsIfVisibleSIMD(
+    usize count, const T* x, const T* y, const T* z,
+    const double* distortion_parameters,
+    double scale_x, double scale_y, double offset_x, double offset_y,
+    float min_x, float min_y, float max_x, float max_y,
+    T* px, T* py, u8* visible) {
+  const __m128d min_x_2 = _mm_set1_pd(min_x);
+  const __m128d min_y_2 = _mm_set1_pd(min_y);
+  const __m128d max_x_2 = _mm_set1_pd(max_x);
+  const __m128d max_y_2 = _mm_set1_pd(max_y);
+  const __m128d nan = _mm_set1_pd(numeric_limits<double>::quiet_NaN());
+  usize i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128d z_2 = LoadTwoAsDoubleSSE2(z + i);
+    __m128d pixel_x, pixel_y;
+    ProjectRadtanSSE2(LoadTwoAsDoubleSSE2(x + i), LoadTwoAsDoubleSSE2(y + i), z_2,
+                      distortion_parameters, scale_x, scale_y, offset_x, offset_y,
+                      &pixel_x, &pixel_y);
+    __m128d mask = _mm_and_pd(
+        _mm_cmpgt_pd(z_2, _mm_setzero_pd()),
+        _mm_and_pd(_mm_and_pd(_mm_cmpge_pd(pixel_x, min_x_2), _mm_cmpge_pd(pixel_y, min_y_2)),
+                   _mm_and_pd(_mm_cmplt_pd(pixel_x, max_x_2), _mm_cmplt_pd(pixel_y, max_y_2))));
+    StoreTwoSSE2(_mm_or_pd(_mm_and_pd(mask, pixel_x), _mm_andnot_pd(mask, nan)), px + i);
+    StoreTwoSSE2(_mm_or_pd(_mm_and_pd(mask, pixel_y), _mm_andnot_pd(mask, nan)), py + i);
+    int mask_bits = _mm_movemask_pd(mask);
+    visible[i + 0] = (mask_bits >> 0) & 1;
+    visible[i + 1] = (mask_bits >> 1) & 1;
+  }
+  return i;
+}
+#endif
+
 
 // Bottommost type for camera implementations, starting the recursion and having
 // access to all parts of the algorithm.
@@ -1561,6 +1879,66 @@ class CameraImpl : public CameraImplVariadic<Scalar, Steps...> {
     return Base::template UnprojectImpl<ImageCoordinateConvention::kRatio>(pixel_coordinates, parameters_.data());
   }
   
+  // Batch versions of the functions above working on structure-of-arrays
+  // input. Each array must have (at least) count elements. The output arrays
+  // may be identical to the input arrays (for in-place operation), but must
+  // not partially overlap with them. Since the camera model is known at
+  // compile time here, the camera type is identified only once per batch
+  // instead of once per point. For PinholeCamera4f (with float arrays) and
+  // RadtanCamera8d, projection and pinhole unprojection process multiple
+  // points at once with SSE2 if available, using the same operations as the
+  // single-point functions. The other cases (including the iterative radtan
+  // unprojection) process the points one at a time.
+  template <typename T>
+  inline void ProjectPointsToPixelCornerConv(usize count, const T* x, const T* y, const T* z, T* px, T* py) const {
+    ProjectPointsImpl<ImageCoordinateConvention::kPixelCorner>(CameraStepList<Steps...>(), count, x, y, z, px, py);
+  }
+  
+  template <typename T>
+  inline void ProjectPointsToPixelCenterConv(usize count, const T* x, const T* y, const T* z, T* px, T* py) const {
+    ProjectPointsImpl<ImageCoordinateConvention::kPixelCenter>(CameraStepList<Steps...>(), count, x, y, z, px, py);
+  }
+  
+  template <typename T>
+  inline void ProjectPointsToRatioConv(usize count, const T* x, const T* y, const T* z, T* px, T* py) const {
+    ProjectPointsImpl<ImageCoordinateConvention::kRatio>(CameraStepList<Steps...>(), count, x, y, z, px, py);
+  }
+  
+  // Like ProjectPoints...(), but additionally sets visible[i] to 1 if point i
+  // is visible in the image and to 0 otherwise. The pixel coordinates of
+  // invisible points are set to NaN.
+  template <typename T>
+  inline void ProjectPointsToPixelCornerConvIfVisible(usize count, const T* x, const T* y, const T* z, float pixel_border, T* px, T* py, u8* visible) const {
+    ProjectPointsIfVisibleImpl<ImageCoordinateConvention::kPixelCorner>(CameraStepList<Steps...>(), count, x, y, z, pixel_border, px, py, visible);
+  }
+  
+  template <typename T>
+  inline void ProjectPointsToPixelCenterConvIfVisible(usize count, const T* x, const T* y, const T* z, float pixel_border, T* px, T* py, u8* visible) const {
+    ProjectPointsIfVisibleImpl<ImageCoordinateConvention::kPixelCenter>(CameraStepList<Steps...>(), count, x, y, z, pixel_border, px, py, visible);
+  }
+  
+  template <typename T>
+  inline void ProjectPointsToRatioConvIfVisible(usize count, const T* x, const T* y, const T* z, float pixel_border, T* px, T* py, u8* visible) const {
+    ProjectPointsIfVisibleImpl<ImageCoordinateConvention::kRatio>(CameraStepList<Steps...>(), count, x, y, z, pixel_border, px, py, visible);
+  }
+  
+  // Unprojects count image points to directions with z = 1. The x and y
+  // components of the directions are written to nx and ny.
+  template <typename T>
+  inline void UnprojectPointsFromPixelCornerConv(usize count, const T* px, const T* py, T* nx, T* ny) const {
+    UnprojectPointsImpl<ImageCoordinateConvention::kPixelCorner>(CameraStepList<Steps...>(), count, px, py, nx, ny);
+  }
+  
+  template <typename T>
+  inline void UnprojectPointsFromPixelCenterConv(usize count, const T* px, const T* py, T* nx, T* ny) const {
+    UnprojectPointsImpl<ImageCoordinateConvention::kPixelCenter>(CameraStepList<Steps...>(), count, px, py, nx, ny);
+  }
+  
+  template <typename T>
+  inline void UnprojectPointsFromRatioConv(usize count, const T* px, const T* py, T* nx, T* ny) const {
+    UnprojectPointsImpl<ImageCoordinateConvention::kRatio>(CameraStepList<Steps...>(), count, px, py, nx, ny);
+  }
+  
   inline virtual CameraImpl<TypeID, Scalar, Steps...>* Scaled(double factor) const override {
     vector<Scalar> scaled_parameters_vec(parameters_.size());
     Scalar* scaled_parameters = scaled_parameters_vec.data();
@@ -1599,6 +1977,119 @@ class CameraImpl : public CameraImplVariadic<Scalar, Steps...> {
   inline usize parameter_count() const { return parameters_.size(); }
   
  private:
+  // Generic batch implementations, which process the points one at a time.
+  template <ImageCoordinateConvention convention, typename T, class... S>
+  inline void ProjectPointsImpl(CameraStepList<S...>, usize count, const T* x, const T* y, const T* z, T* px, T* py) const {
+    ProjectPointsOneByOne<convention>(0, count, x, y, z, px, py);
+  }
+  
+  template <ImageCoordinateConvention convention, typename T, class... S>
+  inline void ProjectPointsIfVisibleImpl(CameraStepList<S...>, usize count, const T* x, const T* y, const T* z, float pixel_border, T* px, T* py, u8* visible) const {
+    ProjectPointsIfVisibleOneByOne<convention>(0, count, x, y, z, pixel_border, px, py, visible);
+  }
+  
+  template <ImageCoordinateConvention convention, typename T, class... S>
+  inline void UnprojectPointsImpl(CameraStepList<S...>, usize count, const T* px, const T* py, T* nx, T* ny) const {
+    UnprojectPointsOneByOne<convention>(0, count, px, py, nx, ny);
+  }
+  
+  // Batch implementations for pinhole cameras.
+  template <ImageCoordinateConvention convention, typename T>
+  inline void ProjectPointsImpl(CameraStepList<PinholeProjection<Scalar>, PixelMapping4<Scalar>>, usize count, const T* x, const T* y, const T* z, T* px, T* py) const {
+    Scalar scale_x, scale_y, offset_x, offset_y;
+    pixel_mapping().template GetProjectionCoefficients<convention>(parameters_.data(), &scale_x, &scale_y, &offset_x, &offset_y);
+    usize i = ProjectPinholePointsSIMD(count, x, y, z, scale_x, scale_y, offset_x, offset_y, px, py);
+    ProjectPointsOneByOne<convention>(i, count, x, y, z, px, py);
+  }
+  
+  template <ImageCoordinateConvention convention, typename T>
+  inline void ProjectPointsIfVisibleImpl(CameraStepList<PinholeProjection<Scalar>, PixelMapping4<Scalar>>, usize count, const T* x, const T* y, const T* z, float pixel_border, T* px, T* py, u8* visible) const {
+    Scalar scale_x, scale_y, offset_x, offset_y;
+    pixel_mapping().template GetProjectionCoefficients<convention>(parameters_.data(), &scale_x, &scale_y, &offset_x, &offset_y);
+    float min_x, min_y, max_x, max_y;
+    PixelMapping4<Scalar>::template GetVisibleRange<convention>(pixel_border, Camera::width(), Camera::height(), &min_x, &min_y, &max_x, &max_y);
+    usize i = ProjectPinholePointsIfVisibleSIMD(count, x, y, z, scale_x, scale_y, offset_x, offset_y, min_x, min_y, max_x, max_y, px, py, visible);
+    ProjectPointsIfVisibleOneByOne<convention>(i, count, x, y, z, pixel_border, px, py, visible);
+  }
+  
+  template <ImageCoordinateConvention convention, typename T>
+  inline void UnprojectPointsImpl(CameraStepList<PinholeProjection<Scalar>, PixelMapping4<Scalar>>, usize count, const T* px, const T* py, T* nx, T* ny) const {
+    Scalar scale_x, scale_y, offset_x, offset_y;
+    pixel_mapping().template GetUnprojectionCoefficients<convention>(parameters_.data(), &scale_x, &scale_y, &offset_x, &offset_y);
+    usize i = UnprojectPinholePointsSIMD(count, px, py, scale_x, scale_y, offset_x, offset_y, nx, ny);
+    UnprojectPointsOneByOne<convention>(i, count, px, py, nx, ny);
+  }
+  
+  // Batch implementations for radtan cameras. Unprojection is iterative, so
+  // it uses the generic implementation.
+  template <ImageCoordinateConvention convention, typename T>
+  inline void ProjectPointsImpl(CameraStepList<PinholeProjection<Scalar>, RadtanDistortion4<Scalar>, PixelMapping4<Scalar>>, usize count, const T* x, const T* y, const T* z, T* px, T* py) const {
+    const Scalar* distortion_parameters = parameters_.data();
+    Scalar scale_x, scale_y, offset_x, offset_y;
+    pixel_mapping().template GetProjectionCoefficients<convention>(
+        distortion_parameters + RadtanDistortion4<Scalar>::GetParameterCount(distortion_parameters),
+        &scale_x, &scale_y, &offset_x, &offset_y);
+    usize i = ProjectRadtanPointsSIMD(count, x, y, z, distortion_parameters, scale_x, scale_y, offset_x, offset_y, px, py);
+    ProjectPointsOneByOne<convention>(i, count, x, y, z, px, py);
+  }
+  
+  template <ImageCoordinateConvention convention, typename T>
+  inline void ProjectPointsIfVisibleImpl(CameraStepList<PinholeProjection<Scalar>, RadtanDistortion4<Scalar>, PixelMapping4<Scalar>>, usize count, const T* x, const T* y, const T* z, float pixel_border, T* px, T* py, u8* visible) const {
+    const Scalar* distortion_parameters = parameters_.data();
+    Scalar scale_x, scale_y, offset_x, offset_y;
+    pixel_mapping().template GetProjectionCoefficients<convention>(
+        distortion_parameters + RadtanDistortion4<Scalar>::GetParameterCount(distortion_parameters),
+        &scale_x, &scale_y, &offset_x, &offset_y);
+    float min_x, min_y, max_x, max_y;
+    PixelMapping4<Scalar>::template GetVisibleRange<convention>(pixel_border, Camera::width(), Camera::height(), &min_x, &min_y, &max_x, &max_y);
+    usize i = ProjectRadtanPointsIfVisibleSIMD(count, x, y, z, distortion_parameters, scale_x, scale_y, offset_x, offset_y, min_x, min_y, max_x, max_y, px, py, visible);
+    ProjectPointsIfVisibleOneByOne<convention>(i, count, x, y, z, pixel_border, px, py, visible);
+  }
+  
+  // Processes the points with indices [begin, count[ with the single-point
+  // functions.
+  template <ImageCoordinateConvention convention, typename T>
+  inline void ProjectPointsOneByOne(usize begin, usize count, const T* x, const T* y, const T* z, T* px, T* py) const {
+    const Scalar* parameters = parameters_.data();
+    for (usize i = begin; i < count; ++ i) {
+      Matrix<Scalar, 2, 1> pixel = Base::template ProjectImpl<convention>(
+          Matrix<Scalar, 3, 1>(x[i], y[i], z[i]), parameters);
+      px[i] = pixel.x();
+      py[i] = pixel.y();
+    }
+  }
+  
+  template <ImageCoordinateConvention convention, typename T>
+  inline void ProjectPointsIfVisibleOneByOne(usize begin, usize count, const T* x, const T* y, const T* z, float pixel_border, T* px, T* py, u8* visible) const {
+    const Scalar* parameters = parameters_.data();
+    for (usize i = begin; i < count; ++ i) {
+      Matrix<Scalar, 2, 1> pixel = Matrix<Scalar, 2, 1>::Constant(numeric_limits<Scalar>::quiet_NaN());
+      visible[i] = Base::template ProjectIfVisibleImpl<convention>(
+          Matrix<Scalar, 3, 1>(x[i], y[i], z[i]), pixel_border, parameters, &pixel) ? 1 : 0;
+      px[i] = pixel.x();
+      py[i] = pixel.y();
+    }
+  }
+  
+  template <ImageCoordinateConvention convention, typename T>
+  inline void UnprojectPointsOneByOne(usize begin, usize count, const T* px, const T* py, T* nx, T* ny) const {
+    const Scalar* parameters = parameters_.data();
+    for (usize i = begin; i < count; ++ i) {
+      // All camera models start with PinholeProjection, thus the unprojected
+      // direction always has z = 1.
+      Matrix<Scalar, 3, 1> direction = Base::template UnprojectImpl<convention>(
+          Matrix<Scalar, 2, 1>(px[i], py[i]), parameters);
+      nx[i] = direction.x();
+      ny[i] = direction.y();
+    }
+  }
+  
+  // Returns the pixel mapping step of the camera models for which the batch
+  // functions are specialized above, which all end with this step.
+  inline const PixelMapping4<Scalar>& pixel_mapping() const {
+    return this->CameraImplVariadic<Scalar, PixelMapping4<Scalar>>::step_;
+  }
+  
   vector<Scalar> parameters_;
 };
 
@@ -1795,6 +2286,60 @@ inline Matrix<double, 3, 1> Camera::UnprojectFromRatioConv(const MatrixBase<Deri
   return Matrix<double, 3, 1>();
 }
 
+template <typename T>
+inline void Camera::ProjectPointsToPixelCornerConv(usize count, const T* x, const T* y, const T* z, T* px, T* py) const {
+  const Camera& this_camera = *this;
+  IDENTIFY_CAMERA(this_camera, _this_camera.ProjectPointsToPixelCornerConv(count, x, y, z, px, py));
+}
+
+template <typename T>
+inline void Camera::ProjectPointsToPixelCenterConv(usize count, const T* x, const T* y, const T* z, T* px, T* py) const {
+  const Camera& this_camera = *this;
+  IDENTIFY_CAMERA(this_camera, _this_camera.ProjectPointsToPixelCenterConv(count, x, y, z, px, py));
+}
+
+template <typename T>
+inline void Camera::ProjectPointsToRatioConv(usize count, const T* x, const T* y, const T* z, T* px, T* py) const {
+  const Camera& this_camera = *this;
+  IDENTIFY_CAMERA(this_camera, _this_camera.ProjectPointsToRatioConv(count, x, y, z, px, py));
+}
+
+template <typename T>
+inline void Camera::ProjectPointsToPixelCornerConvIfVisible(usize count, const T* x, const T* y, const T* z, float pixel_border, T* px, T* py, u8* visible) const {
+  const Camera& this_camera = *this;
+  IDENTIFY_CAMERA(this_camera, _this_camera.ProjectPointsToPixelCornerConvIfVisible(count, x, y, z, pixel_border, px, py, visible));
+}
+
+template <typename T>
+inline void Camera::ProjectPointsToPixelCenterConvIfVisible(usize count, const T* x, const T* y, const T* z, float pixel_border, T* px, T* py, u8* visible) const {
+  const Camera& this_camera = *this;
+  IDENTIFY_CAMERA(this_camera, _this_camera.ProjectPointsToPixelCenterConvIfVisible(count, x, y, z, pixel_border, px, py, visible));
+}
+
+template <typename T>
+inline void Camera::ProjectPointsToRatioConvIfVisible(usize count, const T* x, const T* y, const T* z, float pixel_border, T* px, T* py, u8* visible) const {
+  const Camera& this_camera = *this;
+  IDENTIFY_CAMERA(this_camera, _this_camera.ProjectPointsToRatioConvIfVisible(count, x, y, z, pixel_border, px, py, visible));
+}
+
+template <typename T>
+inline void Camera::UnprojectPointsFromPixelCornerConv(usize count, const T* px, const T* py, T* nx, T* ny) const {
+  const Camera& this_camera = *this;
+  IDENTIFY_CAMERA(this_camera, _this_camera.UnprojectPointsFromPixelCornerConv(count, px, py, nx, ny));
+}
+
+template <typename T>
+inline void Camera::UnprojectPointsFromPixelCenterConv(usize count, const T* px, const T* py, T* nx, T* ny) const {
+  const Camera& this_camera = *this;
+  IDENTIFY_CAMERA(this_camera, _this_camera.UnprojectPointsFromPixelCenterConv(count, px, py, nx, ny));
+}
+
+template <typename T>
+inline void Camera::UnprojectPointsFromRatioConv(usize count, const T* px, const T* py, T* nx, T* ny) const {
+  const Camera& this_camera = *this;
+  IDENTIFY_CAMERA(this_camera, _this_camera.UnprojectPointsFromRatioConv(count, px, py, nx, ny));
+}
+
 inline u32 Camera::parameter_count() const {
   const Camera& this_camera = *this;
   IDENTIFY_CAMERA(this_camera, return _this_camera.parameter_count());
@@ -51,10 +51,14 @@ class CUDABuffer {
   // Allocates a new CUDA buffer with the given size and undefined content.
   CUDABuffer(int height, int width);
   
+  // Wraps existing pitched device memory (for example, from a
+  // CUDABufferPool). The memory is not freed by this object.
+  CUDABuffer(int height, int width, T* address, size_t pitch);
+  
   // Disallow copying.
   CUDABuffer(const CUDABuffer<T>&) = delete;
 
-  // Frees the device buffer.
+  // Frees the device buffer (if owned).
   ~CUDABuffer();
 
   // Uploads the (non-pitched) data to the device buffer.
@@ -118,6 +122,8 @@ class CUDABuffer {
   inline int height() const { return data_.height_; }
   // Returns the entire buffer size in bytes.
   inline int Size() const { return data_.pitch_ * data_.height_; }
+  // Returns whether the buffer frees its memory on destruction.
+  inline bool owns_memory() const { return owns_memory_; }
 
   // Returns the object that can be passed to CUDA code.
   __host__ __device__ inline const CUDABuffer_<T>& ToCUDA() const { return data_; }
@@ -126,6 +132,8 @@ class CUDABuffer {
  private:
   // Data that will be passed to CUDA code.
   CUDABuffer_<T> data_;
+  
+  bool owns_memory_;
 };
 
 template <typename T>
@@ -35,7 +35,8 @@ namespace vis {
 
 template <typename T>
 CUDABuffer<T>::CUDABuffer(int height, int width)
-    : data_(0, height, width, 0) {
+    : data_(0, height, width, 0),
+      owns_memory_(true) {
   CUDA_CHECKED_CALL(cudaMallocPitch(&data_.address_, &data_.pitch_,
                                     data_.width_ * sizeof(T), data_.height_));
   // if (data_.pitch_ != data_.width_ * sizeof(T)) {
@@ -47,9 +48,16 @@ CUDABuffer<T>::CUDABuffer(int height, int width)
   // }
 }
 
+template <typename T>
+CUDABuffer<T>::CUDABuffer(int height, int width, T* address, size_t pitch)
+    : data_(address, height, width, pitch),
+      owns_memory_(false) {}
+
 template <typename T>
 CUDABuffer<T>::~CUDABuffer() {
-  CUDA_CHECKED_CALL(cudaFree(reinterpret_cast<void*>(data_.address_)));
+  if (owns_memory_) {
+    CUDA_CHECKED_CALL(cudaFree(reinterpret_cast<void*>(data_.address_)));
+  }
 }
 
 template <typename T>
@@ -0,0 +1,222 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#include <cuda_runtime.h>
+
+#include "libvis/cuda/cuda_buffer.h"
+#include "libvis/cuda/cuda_util.h"
+#include "libvis/image_pool.h"
+#include "libvis/libvis.h"
+
+namespace vis {
+
+// Allocates a buffer like the CUDABuffer(height, width) constructor, but returns
+// null instead of aborting if the allocation fails.
+template <typename T>
+CUDABufferPtr<T> TryAllocateCUDABuffer(int height, int width) {
+  void* address;
+  size_t pitch;
+  if (cudaMallocPitch(&address, &pitch, width * sizeof(T), height) != cudaSuccess) {
+    // Reset the error state.
+    cudaGetLastError();
+    return CUDABufferPtr<T>();
+  }
+  return CUDABufferPtr<T>(
+      new CUDABuffer<T>(height, width, static_cast<T*>(address), pitch),
+      [address](CUDABuffer<T>* buffer) {
+        delete buffer;
+        CUDA_CHECKED_CALL(cudaFree(address));
+      });
+}
+
+// Pool of pitched 2D CUDA device memory blocks, which avoids the (slow) CUDA
+// memory allocations for buffers that are repeatedly created and destroyed.
+// Acquire() returns CUDABuffers whose memory is returned to the pool once the
+// last reference to them goes away. Memory blocks are bucketed by their row
+// size in bytes and their height, so blocks can be shared among buffers of
+// different element types. The returned buffers may outlive the pool, their
+// memory is freed normally in this case. Thread-safe.
+//
+// GPU work which uses a buffer may still be running when its last reference
+// goes away. The pool therefore records an event when a block is returned
+// and makes the stream passed to Acquire() wait for it before the block is
+// re-used. Since the pool does not know which streams used the buffer, the
+// event is recorded on the legacy default stream, which orders it after all
+// work enqueued before on blocking streams (i.e., streams which are not
+// created with cudaStreamNonBlocking).
+class CUDABufferPool {
+ public:
+  // Creates a pool which keeps at most max_pooled_bytes of unused device
+  // memory. Memory which is returned while the pool is full is freed.
+  inline CUDABufferPool(usize max_pooled_bytes = numeric_limits<usize>::max())
+      : state_(new State()) {
+    state_->max_pooled_bytes = max_pooled_bytes;
+  }
+  
+  inline ~CUDABufferPool() {
+    {
+      lock_guard<mutex> lock(state_->access_mutex);
+      state_->closed = true;
+    }
+    Trim();
+  }
+  
+  // Returns a buffer of the given size with undefined content. The buffer may
+  // be used on the given stream right away; work on other streams must wait
+  // for the work which is enqueued on this stream at this point.
+  template <typename T>
+  CUDABufferPtr<T> Acquire(int height, int width, cudaStream_t stream) {
+    CUDABufferPtr<T> buffer = TryAcquire<T>(height, width, stream);
+    CHECK(buffer) << "Failed to allocate a CUDA buffer of size " << width << " x " << height;
+    return buffer;
+  }
+  
+  // Like Acquire(), but returns null if new memory needs to be allocated and
+  // the allocation fails.
+  template <typename T>
+  CUDABufferPtr<T> TryAcquire(int height, int width, cudaStream_t stream) {
+    const BucketKey key = std::make_tuple(width * sizeof(T), height);
+    Block block;
+    bool reused = false;
+    {
+      lock_guard<mutex> lock(state_->access_mutex);
+      ++ state_->metrics.acquire_count;
+      vector<Block>& bucket = state_->buckets[key];
+      if (!bucket.empty()) {
+        block = bucket.back();
+        bucket.pop_back();
+        reused = true;
+        ++ state_->metrics.reuse_count;
+        state_->metrics.pooled_bytes -= block.pitch * height;
+      }
+    }
+    
+    if (reused) {
+      // Wait for the work which used the block before it was returned.
+      cudaStreamWaitEvent(stream, block.release_event, 0);
+      cudaEventDestroy(block.release_event);
+      block.release_event = nullptr;
+    } else {
+      if (cudaMallocPitch(&block.address, &block.pitch,
+                          width * sizeof(T), height) != cudaSuccess) {
+        // Reset the error state.
+        cudaGetLastError();
+        return CUDABufferPtr<T>();
+      }
+    }
+    
+    {
+      lock_guard<mutex> lock(state_->access_mutex);
+      if (!reused) {
+        ++ state_->metrics.allocation_count;
+      }
+      state_->metrics.in_use_bytes += block.pitch * height;
+    }
+    
+    shared_ptr<State> state = state_;
+    return CUDABufferPtr<T>(
+        new CUDABuffer<T>(height, width, static_cast<T*>(block.address), block.pitch),
+        [state, key, block](CUDABuffer<T>* buffer) {
+          delete buffer;
+          state->Release(key, block);
+        });
+  }
+  
+  // Frees all memory blocks which are currently pooled.
+  void Trim() {
+    vector<Block> blocks;
+    {
+      lock_guard<mutex> lock(state_->access_mutex);
+      for (auto& item : state_->buckets) {
+        blocks.insert(blocks.end(), item.second.begin(), item.second.end());
+        item.second.clear();
+      }
+      state_->metrics.free_count += blocks.size();
+      state_->metrics.pooled_bytes = 0;
+    }
+    for (const Block& block : blocks) {
+      // cudaFree() waits for all pending work, so the event is not needed.
+      cudaEventDestroy(block.release_event);
+      CUDA_CHECKED_CALL(cudaFree(block.address));
+    }
+  }
+  
+  inline PoolMetrics metrics() const {
+    lock_guard<mutex> lock(state_->access_mutex);
+    return state_->metrics;
+  }
+  
+ private:
+  // Row size in bytes, height.
+  typedef std::tuple<usize, int> BucketKey;
+  
+  struct Block {
+    void* address = nullptr;
+    size_t pitch = 0;
+    
+    // Recorded when the block is returned to the pool.
+    cudaEvent_t release_event = nullptr;
+  };
+  
+  // The state is shared with the deleters of the returned buffers.
+  struct State {
+    void Release(const BucketKey& key, Block block) {
+      const usize bytes = block.pitch * std::get<1>(key);
+      {
+        lock_guard<mutex> lock(access_mutex);
+        metrics.in_use_bytes -= bytes;
+        if (!closed && metrics.pooled_bytes + bytes <= max_pooled_bytes) {
+          CUDA_CHECKED_CALL(cudaEventCreateWithFlags(&block.release_event, cudaEventDisableTiming));
+          CUDA_CHECKED_CALL(cudaEventRecord(block.release_event, /*stream*/ 0));
+          buckets[key].push_back(block);
+          metrics.pooled_bytes += bytes;
+          return;
+        }
+        ++ metrics.free_count;
+      }
+      // cudaFree() implicitly waits for all pending work.
+      CUDA_CHECKED_CALL(cudaFree(block.address));
+    }
+    
+    std::mutex access_mutex;
+    map<BucketKey, vector<Block>> buckets;
+    usize max_pooled_bytes;
+    bool closed = false;
+    PoolMetrics metrics;
+  };
+  
+  shared_ptr<State> state_;
+};
+
+}
@@ -35,6 +35,7 @@
 #include "libvis/cuda/cuda_buffer.h"
 #include "libvis/eigen.h"
 #include "libvis/libvis.h"
+#include "libvis/unprojection_lookup.h"
 
 namespace vis {
 
@@ -42,11 +43,20 @@ class CUDAUnprojectionLookup2D_;
 
 // Creates a lookup texture for 2D unprojection of image pixels to directions,
 // i.e., assuming that the z component of the unprojected vectors is always 1.
+// The texture is uploaded from the (shared) CPU table of UnprojectionLookup2D.
 class CUDAUnprojectionLookup2D {
  public:
   inline CUDAUnprojectionLookup2D(const Camera& camera, cudaStream_t stream)
       : lookup_buffer_(camera.height(), camera.width()) {
-    IDENTIFY_CAMERA(camera, Initialize(_camera, stream));
+    shared_ptr<const UnprojectionLookup2D> lookup = UnprojectionLookup2D::Get(camera);
+    
+    // Vec2f has the same memory layout as float2.
+    lookup_buffer_.UploadAsync(stream, reinterpret_cast<const Image<float2>&>(lookup->lookup()));
+    lookup_buffer_.CreateTextureObject(
+        cudaAddressModeClamp, cudaAddressModeClamp,
+        cudaFilterModeLinear, cudaReadModeElementType,
+        false, &lookup_texture_);
+    cudaStreamSynchronize(stream);
   }
   
   inline ~CUDAUnprojectionLookup2D() {
@@ -58,24 +68,6 @@ class CUDAUnprojectionLookup2D {
   }
   
  private:
-  template <typename CameraT>
-  void Initialize(const CameraT& camera, cudaStream_t stream) {
-    Image<float2> lookup_buffer_cpu(camera.width(), camera.height());
-    for (int y = 0; y < camera.height(); ++ y) {
-      for (int x = 0; x < camera.width(); ++ x) {
-        Vec2f dir = camera.UnprojectFromPixelCenterConv(Vec2d(x, y).cast<typename CameraT::ScalarT>()).template cast<float>().template topRows<2>();
-        lookup_buffer_cpu(x, y) = make_float2(dir.x(), dir.y());
-      }
-    }
-    
-    lookup_buffer_.UploadAsync(stream, lookup_buffer_cpu);
-    lookup_buffer_.CreateTextureObject(
-        cudaAddressModeClamp, cudaAddressModeClamp,
-        cudaFilterModeLinear, cudaReadModeElementType,
-        false, &lookup_texture_);
-    cudaStreamSynchronize(stream);
-  }
-  
   CUDABuffer<float2> lookup_buffer_;
   cudaTextureObject_t lookup_texture_;
 };
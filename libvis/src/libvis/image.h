@@ -29,7 +29,10 @@
 
 #pragma once
 
+#include <algorithm>
+#include <limits>
 #include <memory>
+#include <type_traits>
 
 #ifdef LIBVIS_HAVE_OPENCV
   #include <opencv2/core/core.hpp>
@@ -44,6 +47,7 @@
 #include "libvis/image_io_qt.h"
 #include "libvis/libvis.h"
 #include "libvis/qt_thread.h"
+#include "libvis/util.h"
 
 namespace vis {
 
@@ -124,6 +128,112 @@ inline void SetImageTo(Image<Matrix<_Scalar, _Rows, _Cols, _Options, _MaxRows, _
   }
 }
 
+// Implementation helpers for Image::DownscaleToHalfSize(), which returns the
+// average of four values. Integer averages are rounded to nearest (with ties
+// rounded up), and the average of Eigen::Matrix types is computed per element.
+template <typename T>
+inline T AverageOfFour(const T a, const T b, const T c, const T d, std::true_type /*is_integral*/) {
+  return static_cast<T>((static_cast<i64>(a) + b + c + d + 2) >> 2);
+}
+
+template <typename T>
+inline T AverageOfFour(const T a, const T b, const T c, const T d, std::false_type /*is_integral*/) {
+  return static_cast<T>(0.25f * (a + b + c + d));
+}
+
+template <typename T>
+inline T AverageOfFour(const T a, const T b, const T c, const T d) {
+  return AverageOfFour(a, b, c, d, std::is_integral<T>());
+}
+
+template<typename _Scalar, int _Rows, int _Cols, int _Options, int _MaxRows, int _MaxCols>
+inline Matrix<_Scalar, _Rows, _Cols, _Options, _MaxRows, _MaxCols> AverageOfFour(
+    const Matrix<_Scalar, _Rows, _Cols, _Options, _MaxRows, _MaxCols>& a,
+    const Matrix<_Scalar, _Rows, _Cols, _Options, _MaxRows, _MaxCols>& b,
+    const Matrix<_Scalar, _Rows, _Cols, _Options, _MaxRows, _MaxCols>& c,
+    const Matrix<_Scalar, _Rows, _Cols, _Options, _MaxRows, _MaxCols>& d) {
+  Matrix<_Scalar, _Rows, _Cols, _Options, _MaxRows, _MaxCols> result;
+  for (int i = 0; i < _Rows * _Cols; ++ i) {
+    result.coeffRef(i) = AverageOfFour(a.coeff(i), b.coeff(i), c.coeff(i), d.coeff(i));
+  }
+  return result;
+}
+
+// Implementation helper which calls func(min_y, end_y) for blocks of rows
+// which together cover the rows [0, row_count[. pixel_count is the number of
+// pixels processed for all rows. The blocks are processed in parallel if each
+// thread gets at least min_pixels_per_thread pixels, such that small images are
+// not slowed down by the thread startup cost.
+template <typename Func>
+inline void ForEachImageRowBlock(u32 row_count, usize pixel_count, usize min_pixels_per_thread, const Func& func) {
+  usize block_count = std::min<usize>(
+      DefaultThreadCount(),
+      pixel_count / std::max<usize>(1, min_pixels_per_thread));
+  if (block_count <= 1) {
+    func(0u, row_count);
+    return;
+  }
+  ParallelForBlocks(0, row_count, block_count, [&](usize /*block_index*/, usize block_begin, usize block_end) {
+    func(static_cast<u32>(block_begin), static_cast<u32>(block_end));
+  });
+}
+
+// Implementation helper for Image::BilateralFilter() which returns the weight
+// factor exp(-difference^2 / denom_value) for value differences.
+template <typename T>
+class BilateralValueWeights {
+ public:
+  inline BilateralValueWeights(const T denom_value)
+      : denom_value_(denom_value) {}
+  
+  inline float operator()(const T center_value, const T sample) const {
+    float value_distance_squared = center_value - sample;  // NOTE: Cannot use T here as it might be an unsigned type.
+    value_distance_squared *= value_distance_squared;
+    return exp(-value_distance_squared / denom_value_);
+  }
+  
+ private:
+  T denom_value_;
+};
+
+// Version of BilateralValueWeights for small unsigned integer types, which
+// looks up the factors in a table for all possible differences instead of
+// evaluating exp() per sample. The table values are computed in the same way
+// as in the generic version, so the results are identical.
+template <typename T>
+class BilateralValueWeightTable {
+ public:
+  inline BilateralValueWeightTable(const T denom_value)
+      : weights_(static_cast<usize>(numeric_limits<T>::max()) + 1) {
+    for (usize difference = 0; difference < weights_.size(); ++ difference) {
+      float value_distance_squared = difference;
+      value_distance_squared *= value_distance_squared;
+      weights_[difference] = exp(-value_distance_squared / denom_value);
+    }
+  }
+  
+  inline float operator()(const T center_value, const T sample) const {
+    return weights_[std::abs(static_cast<int>(center_value) - static_cast<int>(sample))];
+  }
+  
+ private:
+  std::vector<float> weights_;
+};
+
+template <>
+class BilateralValueWeights<u8> : public BilateralValueWeightTable<u8> {
+ public:
+  inline BilateralValueWeights(const u8 denom_value)
+      : BilateralValueWeightTable<u8>(denom_value) {}
+};
+
+template <>
+class BilateralValueWeights<u16> : public BilateralValueWeightTable<u16> {
+ public:
+  inline BilateralValueWeights(const u16 denom_value)
+      : BilateralValueWeightTable<u16>(denom_value) {}
+};
+
 // Implementation helpers for Image::InterpolateBilinear(), which requires a different
 // implementation for Eigen::Matrix types and scalar types.
 template <typename InterpolatedT, typename T, typename Derived>
@@ -925,131 +1035,104 @@ class Image {
   
   // Downscales the image to half of its size and writes the result to output.
   // The image width and height must be divisible by two. Each output pixel is
-  // assigned the average of its corresponding four input pixels.
+  // assigned the average of its corresponding four input pixels. For integer
+  // types, the average is rounded to nearest (with ties rounded up). There are
+  // SIMD specializations for u8, u16, float and Vec3u8 in image_filtering.cc.
   void DownscaleToHalfSize(Image<T>* output) const {
     CHECK_EQ(width() % 2, 0);
     CHECK_EQ(height() % 2, 0);
     
     output->SetSize(width() / 2, height() / 2);
-    for (u32 y = 0; y < output->height(); ++ y) {
-      T* write_ptr = output->row(y);
-      T* write_ptr_end = write_ptr + output->width();
-      const T* upper_read_ptr = row(2 * y + 0);
-      const T* lower_read_ptr = row(2 * y + 1);
-      while (write_ptr != write_ptr_end) {
-        // TODO: This formulation was required to hande Vec3u8 (but does not round the results correctly).
-        //       Consider a template specialization for these, and for correct rounding in general.
-        *write_ptr = upper_read_ptr[0] / 4 + upper_read_ptr[1] / 4 + lower_read_ptr[0] / 4 + lower_read_ptr[1] / 4;
-        ++ write_ptr;
-        upper_read_ptr += 2;
-        lower_read_ptr += 2;
+    ForEachImageRowBlock(output->height(), pixel_count(), 256 * 1024, [&](u32 min_y, u32 end_y) {
+      for (u32 y = min_y; y < end_y; ++ y) {
+        T* write_ptr = output->row(y);
+        T* write_ptr_end = write_ptr + output->width();
+        const T* upper_read_ptr = row(2 * y + 0);
+        const T* lower_read_ptr = row(2 * y + 1);
+        while (write_ptr != write_ptr_end) {
+          *write_ptr = AverageOfFour(upper_read_ptr[0], upper_read_ptr[1], lower_read_ptr[0], lower_read_ptr[1]);
+          ++ write_ptr;
+          upper_read_ptr += 2;
+          lower_read_ptr += 2;
+        }
       }
-    }
+    });
   }
   
   // Downscales the image to the given size. Each result pixel's intensity is
   // computed as the median of its corresponding pixels in the original image.
+  // If there is an even number of corresponding pixels, the one of the two
+  // middle values which is closer to their average is used.
   // Requires the image to have a scalar type.
-  // TODO: Slow implementation. Average is not needed if the number of original
-  //       pixels per output pixel is uneven.
   void DownscaleUsingMedian(int output_width, int output_height, Image<T>* output) const {
     output->SetSize(output_width, output_height);
-    std::vector<T> values;
-    for (u32 y = 0; y < output->height(); ++ y) {
-      T* write_ptr = output->row(y);
-      T* write_ptr_end = write_ptr + output->width();
-      u32 x = 0;
-      while (write_ptr != write_ptr_end) {
-        u32 start_x = (width() * x) / output->width();
-        u32 end_x = (width() * (x + 1)) / output->width();
+    ForEachImageRowBlock(output->height(), pixel_count(), 128 * 1024, [&](u32 min_y, u32 end_y) {
+      std::vector<T> values;
+      for (u32 y = min_y; y < end_y; ++ y) {
+        T* write_ptr = output->row(y);
+        T* write_ptr_end = write_ptr + output->width();
         u32 start_y = (height() * y) / output->height();
-        u32 end_y = (height() * (y + 1)) / output->height();
-        
-        values.clear();
-        float value_sum = 0;
-        for (u32 original_y = start_y; original_y < end_y; ++ original_y) {
-          for (u32 original_x = start_x; original_x < end_x; ++ original_x) {
-            values.push_back(operator()(original_x, original_y));
-            value_sum += values.back();
-          }
-        }
-        int value_count = ((end_x - start_x) * (end_y - start_y));
-        float average = value_sum / value_count;
-        
-        // TODO: Only the median is required, not sorting the whole vector.
-        std::sort(values.begin(), values.end());
-        if (value_count % 2 == 1) {
-          *write_ptr = values[values.size() / 2];
-        } else {
-          const T& low_value = values[values.size() / 2 - 1];
-          const T& high_value = values[values.size() / 2];
-          if (fabs(average - low_value) < fabs(average - high_value)) {
-            *write_ptr = low_value;
-          } else {
-            *write_ptr = high_value;
+        u32 end_original_y = (height() * (y + 1)) / output->height();
+        u32 x = 0;
+        while (write_ptr != write_ptr_end) {
+          u32 start_x = (width() * x) / output->width();
+          u32 end_x = (width() * (x + 1)) / output->width();
+          
+          values.clear();
+          float value_sum = 0;
+          for (u32 original_y = start_y; original_y < end_original_y; ++ original_y) {
+            const T* read_ptr = row(original_y);
+            for (u32 original_x = start_x; original_x < end_x; ++ original_x) {
+              values.push_back(read_ptr[original_x]);
+              value_sum += values.back();
+            }
           }
+          
+          *write_ptr = MedianOfValues(&values, value_sum);
+          ++ write_ptr;
+          ++ x;
         }
-        ++ write_ptr;
-        ++ x;
       }
-    }
+    });
   }
   
-  // Downscales the image to the given size. Each result pixel's intensity is
-  // computed as the median of its corresponding pixels in the original image.
+  // Version of DownscaleUsingMedian() which ignores pixels having the value
+  // value_to_ignore. Output pixels without any valid corresponding pixel are
+  // set to value_to_ignore.
   // Requires the image to have a scalar type.
-  // TODO: Slow implementation. Average is not needed if the number of original
-  //       pixels per output pixel is uneven.
   void DownscaleUsingMedianWhileExcluding(const T value_to_ignore, int output_width, int output_height, Image<T>* output) const {
     output->SetSize(output_width, output_height);
-    std::vector<T> values;
-    for (u32 y = 0; y < output->height(); ++ y) {
-      T* write_ptr = output->row(y);
-      T* write_ptr_end = write_ptr + output->width();
-      u32 x = 0;
-      while (write_ptr != write_ptr_end) {
-        u32 start_x = (width() * x) / output->width();
-        u32 end_x = (width() * (x + 1)) / output->width();
+    ForEachImageRowBlock(output->height(), pixel_count(), 128 * 1024, [&](u32 min_y, u32 end_y) {
+      std::vector<T> values;
+      for (u32 y = min_y; y < end_y; ++ y) {
+        T* write_ptr = output->row(y);
+        T* write_ptr_end = write_ptr + output->width();
         u32 start_y = (height() * y) / output->height();
-        u32 end_y = (height() * (y + 1)) / output->height();
-        
-        values.clear();
-        float value_sum = 0;
-        u32 value_count = 0;
-        for (u32 original_y = start_y; original_y < end_y; ++ original_y) {
-          for (u32 original_x = start_x; original_x < end_x; ++ original_x) {
-            T value = operator()(original_x, original_y);
-            if (value != value_to_ignore) {
-              values.push_back(value);
-              value_sum += values.back();
-              ++ value_count;
-            }
-          }
-        }
-        
-        if (value_count == 0) {
-          *write_ptr = value_to_ignore;
-        } else {
-          float average = value_sum / value_count;
+        u32 end_original_y = (height() * (y + 1)) / output->height();
+        u32 x = 0;
+        while (write_ptr != write_ptr_end) {
+          u32 start_x = (width() * x) / output->width();
+          u32 end_x = (width() * (x + 1)) / output->width();
           
-          // TODO: Only the median is required, not sorting the whole vector.
-          std::sort(values.begin(), values.end());
-          if (value_count % 2 == 1) {
-            *write_ptr = values[values.size() / 2];
-          } else {
-            const T& low_value = values[values.size() / 2 - 1];
-            const T& high_value = values[values.size() / 2];
-            if (fabs(average - low_value) < fabs(average - high_value)) {
-              *write_ptr = low_value;
-            } else {
-              *write_ptr = high_value;
+          values.clear();
+          float value_sum = 0;
+          for (u32 original_y = start_y; original_y < end_original_y; ++ original_y) {
+            const T* read_ptr = row(original_y);
+            for (u32 original_x = start_x; original_x < end_x; ++ original_x) {
+              T value = read_ptr[original_x];
+              if (value != value_to_ignore) {
+                values.push_back(value);
+                value_sum += values.back();
+              }
             }
           }
+          
+          *write_ptr = values.empty() ? value_to_ignore : MedianOfValues(&values, value_sum);
+          ++ write_ptr;
+          ++ x;
         }
-        ++ write_ptr;
-        ++ x;
       }
-    }
+    });
   }
   
   
@@ -1297,64 +1380,77 @@ class Image {
     float denom_xy = 2.0f * sigma_xy * sigma_xy;
     T denom_value = 2.0f * sigma_value * sigma_value;
     
-    for (u32 y = 0; y < height(); ++ y) {
-      const T* read_ptr = row(y);
-      const T* read_end = read_ptr + width();
-      T* write_ptr = result->row(y);
-      int x = 0;
-      while (read_ptr < read_end) {
-        T center_value = *read_ptr;
-        if (center_value == value_to_ignore) {
-          *write_ptr = value_to_ignore;
-          ++ read_ptr;
-          ++ write_ptr;
-          ++ x;
-          continue;
-        }
-        
-        float sum = 0;
-        float weight = 0;
-        
-        u32 min_y = max<int>(0, y - radius);
-        u32 max_y = min<int>(height() - 1, y + radius);
-        for (u32 sample_y = min_y; sample_y <= max_y; ++ sample_y) {
-          int dy = sample_y - y;
+    // Pre-compute the spatial weight factors, which only depend on the offset
+    // to the center pixel, for one quadrant of the filter window.
+    const int table_stride = radius + 1;
+    std::vector<float> spatial_weights(table_stride * table_stride);
+    for (int dy = 0; dy <= radius; ++ dy) {
+      for (int dx = 0; dx <= radius; ++ dx) {
+        int grid_distance_squared = dx * dx + dy * dy;
+        spatial_weights[dx + dy * table_stride] = exp(-grid_distance_squared / denom_xy);
+      }
+    }
+    const BilateralValueWeights<T> value_weights(denom_value);
+    
+    ForEachImageRowBlock(height(), pixel_count(), 16 * 1024, [&](u32 min_y, u32 end_y) {
+      for (u32 y = min_y; y < end_y; ++ y) {
+        const T* read_ptr = row(y);
+        const T* read_end = read_ptr + width();
+        T* write_ptr = result->row(y);
+        int x = 0;
+        while (read_ptr < read_end) {
+          T center_value = *read_ptr;
+          if (center_value == value_to_ignore) {
+            *write_ptr = value_to_ignore;
+            ++ read_ptr;
+            ++ write_ptr;
+            ++ x;
+            continue;
+          }
           
-          u32 min_x = max<int>(0, x - radius);
-          u32 max_x = min<int>(width() - 1, x + radius);
-          for (u32 sample_x = min_x; sample_x <= max_x; ++ sample_x) {
-            int dx = sample_x - x;
+          float sum = 0;
+          float weight = 0;
+          
+          u32 min_sample_y = max<int>(0, y - radius);
+          u32 max_sample_y = min<int>(height() - 1, y + radius);
+          for (u32 sample_y = min_sample_y; sample_y <= max_sample_y; ++ sample_y) {
+            int dy = sample_y - y;
+            const T* sample_row = row(sample_y);
+            const float* spatial_weights_row = spatial_weights.data() + std::abs(dy) * table_stride;
             
-            int grid_distance_squared = dx * dx + dy * dy;
-            if (grid_distance_squared > radius_squared) {
-              continue;
+            // Restrict the x range to the circle with the filter radius.
+            int max_dx = radius;
+            while (max_dx * max_dx + dy * dy > radius_squared) {
+              -- max_dx;
             }
             
-            T sample = operator()(sample_x, sample_y);
-            if (sample == value_to_ignore) {
-              continue;
+            u32 min_x = max<int>(0, x - max_dx);
+            u32 max_x = min<int>(width() - 1, x + max_dx);
+            for (u32 sample_x = min_x; sample_x <= max_x; ++ sample_x) {
+              T sample = sample_row[sample_x];
+              if (sample == value_to_ignore) {
+                continue;
+              }
+              
+              float w = spatial_weights_row[std::abs(static_cast<int>(sample_x) - x)] *
+                        value_weights(center_value, sample);
+              sum += w * sample;
+              weight += w;
             }
-            
-            float value_distance_squared = center_value - sample;  // NOTE: Cannot use T here as it might be an unsigned type.
-            value_distance_squared *= value_distance_squared;
-            float w = exp(-grid_distance_squared / denom_xy) *
-                      exp(-value_distance_squared / denom_value);
-            sum += w * sample;
-            weight += w;
           }
+          
+          if (weight == 0) {
+            *write_ptr = value_to_ignore;
+          } else {
+            *write_ptr = sum / weight;
+          }
+          
+          ++ read_ptr;
+          ++ write_ptr;
+          ++ x;
         }
-        
-        if (weight == 0) {
-          *write_ptr = value_to_ignore;
-        } else {
-          *write_ptr = sum / weight;
-        }
-        
-        ++ read_ptr;
-        ++ write_ptr;
-        ++ x;
       }
-    }
+    });
   }
   
   // TODO: Maybe separate this out into its own header connected_components.h?
@@ -1466,42 +1562,35 @@ class Image {
     }
   }
   
+  // Computes the integral image, in which each pixel contains the sum of all
+  // pixels of this image above and to the left of it, including itself.
   template <typename OutputT>
   void ComputeIntegralImage(Image<OutputT>* output) const {
     output->SetSize(width(), height());
     
-    OutputT row_sum = 0;
-    
-    // First row
-    const T* read_ptr = row(0);
-    const T* read_end = read_ptr + width();
-    OutputT* write_ptr = output->row(0);
-    while (read_ptr != read_end) {
-      row_sum += *read_ptr;
-      
-      *write_ptr = row_sum;
-      
-      ++ read_ptr;
-      ++ write_ptr;
-    }
+    // Compute the row-wise prefix sums in parallel.
+    ForEachImageRowBlock(height(), pixel_count(), 256 * 1024, [&](u32 min_y, u32 end_y) {
+      for (u32 y = min_y; y < end_y; ++ y) {
+        OutputT row_sum = 0;
+        const T* read_ptr = row(y);
+        const T* read_end = read_ptr + width();
+        OutputT* write_ptr = output->row(y);
+        while (read_ptr != read_end) {
+          row_sum += *read_ptr;
+          *write_ptr = row_sum;
+          ++ read_ptr;
+          ++ write_ptr;
+        }
+      }
+    });
     
-    // Remaining rows
+    // Accumulate the rows. The inner loop has no dependencies between the
+    // columns, which allows the compiler to vectorize it.
     for (u32 y = 1; y < height(); ++ y) {
-      row_sum = 0;
-      
-      read_ptr = row(y);
-      read_end = read_ptr + width();
       const OutputT* prev_write_ptr = output->row(y - 1);
-      write_ptr = output->row(y);
-      
-      while (read_ptr != read_end) {
-        row_sum += *read_ptr;
-        
-        *write_ptr = row_sum + *prev_write_ptr;
-        
-        ++ read_ptr;
-        ++ write_ptr;
-        ++ prev_write_ptr;
+      OutputT* write_ptr = output->row(y);
+      for (u32 x = 0; x < width(); ++ x) {
+        write_ptr[x] = write_ptr[x] + prev_write_ptr[x];
       }
     }
   }
@@ -1734,6 +1823,29 @@ class Image {
     }
   }
   
+  // Helper function for the median downscaling functions. Returns the median
+  // of the (non-empty) values, which are reordered. If there is an even number
+  // of values, returns the one of the two middle values which is closer to the
+  // average, given the sum of the values. Only partially sorts the values.
+  static T MedianOfValues(std::vector<T>* values, float value_sum) {
+    usize middle = values->size() / 2;
+    std::nth_element(values->begin(), values->begin() + middle, values->end());
+    const T& high_value = values->at(middle);
+    if (values->size() % 2 == 1) {
+      return high_value;
+    }
+    
+    // After nth_element(), all values before the middle are not larger than
+    // high_value, so the lower middle value is their maximum.
+    const T& low_value = *std::max_element(values->begin(), values->begin() + middle);
+    float average = value_sum / values->size();
+    if (fabs(average - low_value) < fabs(average - high_value)) {
+      return low_value;
+    } else {
+      return high_value;
+    }
+  }
+  
   // Helper function for bicubic interpolation.
   // Computes a Catmull–Rom spline (TODO: change the name to reflect this?)
   // TODO: Can factor out the 0.5f's
@@ -1777,6 +1889,16 @@ bool Image<Vec3u8>::Read(const string& image_file_name);
 template<>
 bool Image<Vec4u8>::Read(const string& image_file_name);
 
+// DownscaleToHalfSize() template specializations (see image_filtering.cc).
+template<>
+void Image<u8>::DownscaleToHalfSize(Image<u8>* output) const;
+template<>
+void Image<u16>::DownscaleToHalfSize(Image<u16>* output) const;
+template<>
+void Image<float>::DownscaleToHalfSize(Image<float>* output) const;
+template<>
+void Image<Vec3u8>::DownscaleToHalfSize(Image<Vec3u8>* output) const;
+
 // WrapInQImage() template specializations for the supported types.
 #ifdef LIBVIS_HAVE_QT
 template<>
@@ -1820,19 +1942,17 @@ QImage Image<Vec4u8>::WrapInQImage() const;
 template<> template<typename TargetT> void Image<Vec3u8>::ConvertToGrayscale(Image<TargetT>* target) const {
   target->SetSize(this->width(), this->height());
   
-  for (u32 y = 0; y < height(); ++ y) {
-    const Vec3u8* this_ptr = row(y);
-    TargetT* target_ptr = target->row(y);
-    const Vec3u8* end = this_ptr + width();
-    while (this_ptr < end) {
-      *target_ptr = 0.299f * this_ptr->coeffRef(0) +
-                    0.587f * this_ptr->coeffRef(1) +
-                    0.114f * this_ptr->coeffRef(2);
-      
-      ++ this_ptr;
-      ++ target_ptr;
+  ForEachImageRowBlock(height(), pixel_count(), 256 * 1024, [&](u32 min_y, u32 end_y) {
+    for (u32 y = min_y; y < end_y; ++ y) {
+      const u8* this_ptr = reinterpret_cast<const u8*>(row(y));
+      TargetT* target_ptr = target->row(y);
+      for (u32 x = 0; x < width(); ++ x) {
+        target_ptr[x] = 0.299f * this_ptr[3 * x + 0] +
+                        0.587f * this_ptr[3 * x + 1] +
+                        0.114f * this_ptr[3 * x + 2];
+      }
     }
-  }
+  });
 }
 
 #ifdef WIN32
@@ -0,0 +1,139 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "libvis/image_cache.h"
+
+namespace vis {
+
+std::ostream& operator<<(std::ostream& stream, const ImageCacheStatistics& statistics) {
+  stream << statistics.hit_count << " hits, "
+         << statistics.miss_count << " misses, "
+         << statistics.eviction_count << " evictions, "
+         << (statistics.used_bytes / (1024 * 1024)) << " MB used";
+  if (statistics.max_bytes > 0) {
+    stream << " of " << (statistics.max_bytes / (1024 * 1024)) << " MB";
+  }
+  return stream;
+}
+
+
+ImageCacheBudget::ImageCacheBudget(usize max_bytes)
+    : used_bytes_(0),
+      max_bytes_(max_bytes),
+      hit_count_(0),
+      miss_count_(0),
+      eviction_count_(0) {}
+
+void ImageCacheBudget::SetMaxBytes(usize max_bytes) {
+  lock_guard<mutex> lock(mutex_);
+  max_bytes_ = max_bytes;
+  EnforceLimit(nullptr);
+}
+
+void ImageCacheBudget::Update(ImageCacheBudgetEntry* entry, usize bytes) {
+  lock_guard<mutex> lock(mutex_);
+  
+  auto it = entries_.find(entry);
+  if (bytes == 0) {
+    if (it != entries_.end()) {
+      used_bytes_ -= it->second.bytes;
+      lru_list_.erase(it->second.lru_position);
+      entries_.erase(it);
+    }
+    return;
+  }
+  
+  if (it == entries_.end()) {
+    lru_list_.push_front(entry);
+    EntryInfo& info = entries_[entry];
+    info.lru_position = lru_list_.begin();
+    info.bytes = bytes;
+    used_bytes_ += bytes;
+  } else {
+    used_bytes_ = used_bytes_ - it->second.bytes + bytes;
+    it->second.bytes = bytes;
+    lru_list_.splice(lru_list_.begin(), lru_list_, it->second.lru_position);
+  }
+  
+  EnforceLimit(entry);
+}
+
+void ImageCacheBudget::Touch(ImageCacheBudgetEntry* entry) {
+  lock_guard<mutex> lock(mutex_);
+  auto it = entries_.find(entry);
+  if (it != entries_.end()) {
+    lru_list_.splice(lru_list_.begin(), lru_list_, it->second.lru_position);
+  }
+}
+
+void ImageCacheBudget::Remove(ImageCacheBudgetEntry* entry) {
+  Update(entry, 0);
+}
+
+ImageCacheStatistics ImageCacheBudget::statistics() {
+  lock_guard<mutex> lock(mutex_);
+  ImageCacheStatistics result;
+  result.hit_count = hit_count_;
+  result.miss_count = miss_count_;
+  result.eviction_count = eviction_count_;
+  result.used_bytes = used_bytes_;
+  result.max_bytes = max_bytes_;
+  return result;
+}
+
+void ImageCacheBudget::EnforceLimit(ImageCacheBudgetEntry* except) {
+  if (max_bytes_ == 0) {
+    return;
+  }
+  
+  // Walk from the least recently used entry towards the most recently used
+  // one. Entries which are in use cannot be (fully) evicted and are skipped.
+  auto it = lru_list_.end();
+  while (used_bytes_ > max_bytes_ && it != lru_list_.begin()) {
+    -- it;
+    ImageCacheBudgetEntry* entry = *it;
+    if (entry == except) {
+      continue;
+    }
+    
+    EntryInfo& info = entries_.at(entry);
+    usize remaining_bytes = entry->TryEvict();
+    if (remaining_bytes < info.bytes) {
+      ++ eviction_count_;
+    }
+    // Also updates the size if the entry has grown in the meantime.
+    used_bytes_ = used_bytes_ - info.bytes + remaining_bytes;
+    info.bytes = remaining_bytes;
+    if (remaining_bytes == 0) {
+      entries_.erase(entry);
+      it = lru_list_.erase(it);
+    }
+  }
+}
+
+}
@@ -29,7 +29,14 @@
 
 #pragma once
 
-#include <map>
+#include <array>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <type_traits>
+#include <unordered_map>
 
 #include "libvis/image.h"
 #include "libvis/libvis.h"
@@ -39,148 +46,400 @@ namespace vis {
 template<typename T>
 class ImageCache;
 
-// Base class for operations stored in an ImageCache's operation tree.
-template<typename T>
-class ImageCacheElement {
+// Interface of caches whose memory is managed by an ImageCacheBudget.
+class ImageCacheBudgetEntry {
  public:
-  virtual ~ImageCacheElement() {}
+  virtual ~ImageCacheBudgetEntry() {}
   
-  inline shared_ptr<ImageCacheElement<T>>* GetOrAllocateElement(const string& key) {
-    return &element_map_[key];
-  }
+  // Frees as much of the cached data as possible without blocking. Data which
+  // is in use (referenced outside of the cache, or currently being computed)
+  // and data which cannot be restored (images which have no file path) is
+  // kept. Returns the number of bytes which remain cached.
+  virtual usize TryEvict() = 0;
+};
+
+// Access statistics of an ImageCacheBudget.
+struct ImageCacheStatistics {
+  // Number of accesses to loaded images or computed derived data, and number
+  // of accesses which had to load or compute the data.
+  usize hit_count = 0;
+  usize miss_count = 0;
+  
+  // Number of times cached data was freed to stay within the budget.
+  usize eviction_count = 0;
+  
+  // Memory used by the cached data, and the maximum (in bytes, 0 if
+  // unlimited).
+  usize used_bytes = 0;
+  usize max_bytes = 0;
+};
+
+std::ostream& operator<<(std::ostream& stream, const ImageCacheStatistics& statistics);
+
+// Global memory budget for a set of ImageCaches. Tracks the memory used by the
+// images and derived data of all caches which use the budget, and evicts the
+// data of the least recently used caches if the budget is exceeded. This
+// allows random access over many frames (which keeps them all cached) within a
+// fixed memory limit. Thread-safe.
+class ImageCacheBudget {
+ public:
+  // Creates a budget with the given maximum number of bytes. 0 means that the
+  // memory is unlimited, so only the statistics are tracked.
+  ImageCacheBudget(usize max_bytes = 0);
+  
+  void SetMaxBytes(usize max_bytes);
+  
+  // Sets the number of bytes cached by the entry and marks it as most
+  // recently used. An entry with zero bytes is removed. If the budget is
+  // exceeded afterwards, other entries are evicted (starting from the least
+  // recently used one). The entry itself is never evicted by this call, since
+  // the caller is using it.
+  void Update(ImageCacheBudgetEntry* entry, usize bytes);
   
-  virtual void* GetOrComputeResultVoid() = 0;
+  // Marks the entry as most recently used.
+  void Touch(ImageCacheBudgetEntry* entry);
+  
+  // Removes the entry from the budget. Must be called before the entry is
+  // destroyed.
+  void Remove(ImageCacheBudgetEntry* entry);
+  
+  inline void RecordHit() { ++ hit_count_; }
+  inline void RecordMiss() { ++ miss_count_; }
+  
+  ImageCacheStatistics statistics();
   
  private:
-  // Next level of the operation tree.
-  map<string, shared_ptr<ImageCacheElement<T>>> element_map_;
+  struct EntryInfo {
+    list<ImageCacheBudgetEntry*>::iterator lru_position;
+    usize bytes;
+  };
+  
+  // Evicts least recently used entries except the given one until the budget
+  // is met (or no further entry can be evicted). Must be called with mutex_
+  // locked.
+  void EnforceLimit(ImageCacheBudgetEntry* except);
+  
+  std::mutex mutex_;
+  
+  // Entries ordered from most recently used (front) to least recently used
+  // (back).
+  list<ImageCacheBudgetEntry*> lru_list_;
+  unordered_map<ImageCacheBudgetEntry*, EntryInfo> entries_;
+  
+  usize used_bytes_;
+  usize max_bytes_;
+  
+  std::atomic<usize> hit_count_;
+  std::atomic<usize> miss_count_;
+  usize eviction_count_;
 };
 
-// Return value of operation functions for ImageCache.
-template<typename T, typename ParentCacheElementType>
-struct ImageCacheElementData {
-  ImageCacheElementData(ImageCache<T>* image_cache)
-      : image_cache(image_cache) {}
+
+// Returns the number of bytes used by a cached image (0 for a null pointer).
+template<typename T>
+inline usize CachedImageBytes(const shared_ptr<Image<T>>& image) {
+  return image ? (image->stride() * image->height()) : 0;
+}
+
+// Releases a cached image, unless only_unused is true and the image is
+// referenced outside of the cache (in which case releasing it would not free
+// any memory). Returns the number of released bytes.
+template<typename T>
+inline usize ReleaseCachedImage(shared_ptr<Image<T>>* image, bool only_unused) {
+  if (!*image || (only_unused && image->use_count() > 1)) {
+    return 0;
+  }
+  usize bytes = CachedImageBytes(*image);
+  image->reset();
+  return bytes;
+}
+
+// Index of the original image in an ImageCache, as opposed to the indices of
+// the derived images.
+constexpr int kImageCacheOriginalImage = -1;
+
+// Index of a derived image which is not stored in an ImageCache, since its
+// table of derived images is full.
+constexpr int kImageCacheUncachedImage = -2;
+
+// Maximum number of different derived images per ImageCache.
+constexpr int kImageCacheMaxDerivedImages = 8;
+
+// Maximum size of the parameters of an image operation (in bytes).
+constexpr usize kImageCacheMaxOperationSize = 32;
+
+// Reference to an image in an ImageCache, which may not have been computed
+// yet. This is the return value of the operation functions for ImageCache
+// (such as ImagePyramid()), and can be passed to further operation functions
+// to chain operations.
+template<typename T>
+struct ImageCacheResult {
+  inline ImageCacheResult(ImageCache<T>* image_cache, int index)
+      : image_cache(image_cache), index(index) {}
   
-  ImageCacheElementData(ImageCache<T>* image_cache, ParentCacheElementType* parent_cache_element)
-      : image_cache(image_cache), parent_cache_element(parent_cache_element) {}
+  // Creates a reference to an image which is not stored in the cache.
+  inline ImageCacheResult(ImageCache<T>* image_cache, const shared_ptr<Image<T>>& uncached_result)
+      : image_cache(image_cache), index(kImageCacheUncachedImage), uncached_result(uncached_result) {}
   
-  inline typename ParentCacheElementType::ReturnType GetOrComputeResult() {
-    return *reinterpret_cast<typename ParentCacheElementType::ReturnType*>(
-        parent_cache_element->GetOrComputeResultVoid());
-  }
+  // Returns the image, computing it (and the images it is derived from) if
+  // necessary.
+  inline shared_ptr<Image<T>> GetOrComputeResult() const;
   
   ImageCache<T>* image_cache;
-  ParentCacheElementType* parent_cache_element;
+  int index;
+  
+  // The image if index is kImageCacheUncachedImage.
+  shared_ptr<Image<T>> uncached_result;
 };
 
-// Stores an image and data derived from it such as gradient images and image
-// pyramids. Has the ability to derive those on-demand when they are first
-// accessed, such that data which is never accessed will not be computed. Can
-// even read the original image from disk on demand. Is extensible regarding the
-// type of derived data that can be stored.
+// Stores an image and data derived from it such as image pyramids. Has the
+// ability to derive those on-demand when they are first accessed, such that
+// data which is never accessed will not be computed. Can even read the
+// original image from disk on demand. Is extensible regarding the type of
+// derived data that can be stored.
 // 
-// Design alternatives for accessing derived data for an example:
+// Derived images are defined by operation types, whose objects hold the
+// operation's parameters (for example, BilateralFilterOperation). The derived
+// images are stored in a flat table in the cache, identified by the operation
+// type, the operation parameters, and the index of the input image. Operations
+// thus need to provide:
+//   bool operator==(const OperationT& other) const;
+//   void Compute(const Image<T>& input, Image<T>* output) const;
+// and must not be larger than kImageCacheMaxOperationSize. Looking up a
+// derived image thus does not involve any allocation, string handling, or
+// hashing. Chains of operations (such as multiple image pyramid levels) are
+// evaluated in a single pass, starting from the last image in the chain which
+// is available.
 // 
-// GradientImageX(ImagePyramid(&image_cache, level)).result();
-// - ImagePyramid() returns a pair of its name, result, and image_cache pointer.
-// - Functions are overloaded such that they can be called with both the initial
-//   image_cache, and the intermediate result.
-// - result() needs to be called at the end to get the result object (image).
-//   The return object can be templated to give the desired return type.
-// - Operations allocate worker objects and cache them in the ImageCache, so
-//   they are only created once (but this means they should be small). They
-//   store the operation (via their virtual function table), a pointer to the
-//   previous operation (or root), and their result. The result() call evaluates
-//   all operations which don't have a result yet from top to bottom. Worker
-//   classes can be templated to know the output type of their predecessor step
-//   and be able to call the predecessor operation.
+// All functions are thread-safe. Concurrent requests for the image or for
+// derived data only load or compute it once. If an ImageCacheBudget is set,
+// the memory of the cached data is accounted for in the budget, and the data
+// may be evicted by the budget while it is not in use. Evicted data is loaded
+// or computed again on the next access. Notice that this only applies to the
+// image itself if it can be re-read from its image path.
 // 
-// result = image_cache.Get(ImagePyramid<T>(level), GradientImageX<T>());
-// - Get<>() as variadic template, steps have a name (at runtime only so the
-//   pyramid can include the level) and a compute operator.
-// - Can return different types by returning RightmostArg::ResultType.
+// Example:
+// shared_ptr<Image<T>> result =
+//     BilateralFiltered(ImagePyramid(&image_cache, 2), ...).GetOrComputeResult();
 template<typename T>
-class ImageCache : public ImageCacheElement<T> {
+class ImageCache : public ImageCacheBudgetEntry {
  public:
   typedef shared_ptr<Image<T>> ReturnType;
   
   // Creates an empty image cache. The path and / or image need to be set later.
-  inline ImageCache() {}
+  inline ImageCache()
+      : cached_bytes_(0) {}
   
   // Creates an image cache with the given image path. The image is only loaded
   // from disk if it is accessed (or the loading is triggered directly with
   // EnsureImageIsLoaded()).
   inline ImageCache(const string& image_path)
-      : image_path_(image_path) {}
+      : image_path_(image_path),
+        cached_bytes_(0) {}
   
   // Creates an image cache based on an existing image.
   inline ImageCache(const shared_ptr<Image<T>>& image)
-      : image_(image) {}
+      : image_(image),
+        cached_bytes_(CachedImageBytes(image)) {}
   
   // Creates an image cache based on an existing image with an image file.
   inline ImageCache(const string& image_path, const shared_ptr<Image<T>>& image)
-      : image_path_(image_path), image_(image) {}
+      : image_path_(image_path),
+        image_(image),
+        cached_bytes_(CachedImageBytes(image)) {}
+  
+  ~ImageCache() {
+    if (budget_) {
+      budget_->Remove(this);
+    }
+  }
+  
+  // Sets the memory budget which this cache's data is accounted in. This must
+  // be done before the cache is accessed by multiple threads.
+  inline void SetBudget(const shared_ptr<ImageCacheBudget>& budget) {
+    if (budget_) {
+      budget_->Remove(this);
+    }
+    budget_ = budget;
+    UpdateBudget();
+  }
+  
+  inline const shared_ptr<ImageCacheBudget>& budget() const {
+    return budget_;
+  }
   
   inline void SetPath(const string& image_path) {
+    lock_guard<mutex> lock(mutex_);
     image_path_ = image_path;
   }
   
   inline void SetImage(const shared_ptr<Image<T>>& image) {
-    image_ = image;
+    {
+      lock_guard<mutex> lock(mutex_);
+      cached_bytes_ -= CachedImageBytes(image_);
+      image_ = image;
+      cached_bytes_ += CachedImageBytes(image_);
+    }
+    UpdateBudget();
   }
   
   // Tries to read the image from disk if it is not loaded. Returns true if the
   // image is loaded after the function executed, false otherwise.
-  bool EnsureImageIsLoaded() {
-    if (image_) {
-      return true;
-    }
-    if (image_path_.empty()) {
-      return false;
-    }
-    image_.reset(new Image<T>());
-    if (image_->Read(image_path_)) {
-      return true;
-    }
-    image_.reset();
-    return false;
+  inline bool EnsureImageIsLoaded() {
+    return GetOrComputeResult() ? true : false;
   }
   
   // Tries to read the image from disk if it is not loaded. Returns the image
-  // shared_ptr or a null shared_ptr if the image could not be loaded.
-  inline const shared_ptr<Image<T>>& GetImage() {
-    if (!EnsureImageIsLoaded()) {
-      // Make sure that image_ is not a valid pointer.
-      image_.reset();
-    }
-    return image_;
+  // shared_ptr or a null shared_ptr if the image could not be loaded. Holding
+  // on to the returned pointer prevents the image from being evicted.
+  inline shared_ptr<Image<T>> GetImage() {
+    return GetOrComputeResult();
+  }
+  
+  // Alias for GetImage().
+  inline ReturnType GetOrComputeResult() {
+    return GetOrComputeDerivedImage(kImageCacheOriginalImage);
   }
   
   // Frees all derived data, but not the original image.
   inline void ClearDerivedData() {
-    element_map_.clear();
+    {
+      lock_guard<mutex> lock(mutex_);
+      cached_bytes_ -= ReleaseDerivedImages(/*only_unused*/ false);
+    }
+    UpdateBudget();
   }
   
   // Frees the image and all derived data. Only do this if there is a copy of
   // the image on disk given as image path.
   inline void ClearImageAndDerivedData() {
-    ClearDerivedData();
-    image_.reset();
+    {
+      lock_guard<mutex> lock(mutex_);
+      cached_bytes_ -= ReleaseDerivedImages(/*only_unused*/ false) +
+                       ReleaseCachedImage(&image_, /*only_unused*/ false);
+    }
+    UpdateBudget();
   }
   
-  // Alias for GetImage() which allows the ImageCache to be used as the first
-  // operation in a chain.
-  inline ReturnType* GetOrComputeResult() {
-    EnsureImageIsLoaded();
-    return &image_;
+  // Returns the index of the image which results from applying the operation
+  // to the image with the given index (kImageCacheOriginalImage for the
+  // original image). The result is only computed once it is accessed with
+  // GetOrComputeDerivedImage(). Returns kImageCacheUncachedImage if the input
+  // is not cached or if the table of derived images is full; the result must
+  // then be computed by the caller (see ApplyImageOperation()).
+  template<typename OperationT>
+  int GetOrAddDerivedImage(int input_index, const OperationT& operation) {
+    static_assert(sizeof(OperationT) <= kImageCacheMaxOperationSize,
+                  "The operation is too large, increase kImageCacheMaxOperationSize.");
+    
+    if (input_index == kImageCacheUncachedImage) {
+      return kImageCacheUncachedImage;
+    }
+    
+    lock_guard<mutex> lock(mutex_);
+    if (!derived_images_) {
+      derived_images_.reset(new DerivedImageTable());
+    }
+    DerivedImageTable& table = *derived_images_;
+    
+    for (int i = 0; i < table.count; ++ i) {
+      const DerivedImage& derived = table.images[i];
+      if (derived.compute == &ComputeOperation<OperationT> &&
+          derived.input_index == input_index &&
+          *reinterpret_cast<const OperationT*>(&derived.operation) == operation) {
+        return i;
+      }
+    }
+    
+    if (table.count >= kImageCacheMaxDerivedImages) {
+      static std::atomic<bool> warned(false);
+      if (!warned.exchange(true)) {
+        LOG(WARNING) << "Too many different derived images in one ImageCache, further ones are not cached. Increase kImageCacheMaxDerivedImages to avoid re-computations.";
+      }
+      return kImageCacheUncachedImage;
+    }
+    DerivedImage& derived = table.images[table.count];
+    new(&derived.operation) OperationT(operation);
+    derived.compute = &ComputeOperation<OperationT>;
+    derived.destroy = &DestroyOperation<OperationT>;
+    derived.input_index = input_index;
+    return table.count ++;
   }
-  inline virtual void* GetOrComputeResultVoid() override {
-    return GetOrComputeResult();
+  
+  // Returns the image with the given index (kImageCacheOriginalImage or an
+  // index returned by GetOrAddDerivedImage()). Computes it if necessary,
+  // together with all images in the chain of operations it is derived from
+  // which are not available. Returns null if the original image is not
+  // available.
+  ReturnType GetOrComputeDerivedImage(int index) {
+    ReturnType result;
+    bool loaded_or_computed = false;
+    {
+      lock_guard<mutex> lock(mutex_);
+      
+      // Walk up the chain of operations until an available image is found.
+      // Since derived images are only added after their input, the chain
+      // length is bounded by the table size.
+      int chain[kImageCacheMaxDerivedImages];
+      int chain_length = 0;
+      int available_index = index;
+      while (available_index != kImageCacheOriginalImage &&
+             !derived_images_->images[available_index].result) {
+        chain[chain_length ++] = available_index;
+        available_index = derived_images_->images[available_index].input_index;
+      }
+      
+      if (available_index == kImageCacheOriginalImage) {
+        if (!image_ && !image_path_.empty()) {
+          shared_ptr<Image<T>> image(new Image<T>());
+          if (image->Read(image_path_)) {
+            image_ = image;
+            cached_bytes_ += CachedImageBytes(image_);
+            loaded_or_computed = true;
+          }
+        }
+        result = image_;
+      } else {
+        result = derived_images_->images[available_index].result;
+      }
+      
+      // Compute the missing images down the chain.
+      for (int i = chain_length - 1; i >= 0 && result; -- i) {
+        DerivedImage& derived = derived_images_->images[chain[i]];
+        derived.result.reset(new Image<T>());
+        derived.compute(&derived.operation, *result, derived.result.get());
+        cached_bytes_ += CachedImageBytes(derived.result);
+        loaded_or_computed = true;
+        result = derived.result;
+      }
+    }
+    
+    if (result) {
+      RecordAccess(loaded_or_computed);
+    }
+    return result;
+  }
+  
+  // Frees the cached data which is not in use. Called by the budget.
+  virtual usize TryEvict() override {
+    unique_lock<mutex> lock(mutex_, std::try_to_lock);
+    if (!lock.owns_lock()) {
+      return cached_bytes_;
+    }
+    usize released_bytes = ReleaseDerivedImages(/*only_unused*/ true);
+    if (!image_path_.empty()) {
+      // Only release the image if it can be restored.
+      released_bytes += ReleaseCachedImage(&image_, /*only_unused*/ true);
+    }
+    return cached_bytes_ -= released_bytes;
   }
   
+  inline usize cached_bytes() const {
+    return cached_bytes_;
+  }
   
-  inline bool IsImageLoaded() const {
+  inline bool IsImageLoaded() {
+    lock_guard<mutex> lock(mutex_);
     return image_ ? true : false;
   }
   
@@ -189,274 +448,227 @@ class ImageCache : public ImageCacheElement<T> {
   }
   
  private:
-  // First level of the operation tree.
-  map<string, shared_ptr<ImageCacheElement<T>>> element_map_;
+  // A derived image and the operation which computes it.
+  struct DerivedImage {
+    typedef void (*ComputeFunction)(const void* operation, const Image<T>& input, Image<T>* output);
+    typedef void (*DestroyFunction)(void* operation);
+    
+    // Computes the image. Also identifies the operation type.
+    ComputeFunction compute;
+    
+    // Destroys the operation object.
+    DestroyFunction destroy;
+    
+    // Index of the input image.
+    int input_index;
+    
+    // Storage for the operation object.
+    typename std::aligned_storage<kImageCacheMaxOperationSize, 16>::type operation;
+    
+    shared_ptr<Image<T>> result;
+  };
+  
+  struct DerivedImageTable {
+    inline DerivedImageTable()
+        : count(0) {}
+    
+    inline ~DerivedImageTable() {
+      for (int i = 0; i < count; ++ i) {
+        images[i].destroy(&images[i].operation);
+      }
+    }
+    
+    std::array<DerivedImage, kImageCacheMaxDerivedImages> images;
+    int count;
+  };
+  
+  template<typename OperationT>
+  static void ComputeOperation(const void* operation, const Image<T>& input, Image<T>* output) {
+    reinterpret_cast<const OperationT*>(operation)->Compute(input, output);
+  }
+  
+  template<typename OperationT>
+  static void DestroyOperation(void* operation) {
+    reinterpret_cast<OperationT*>(operation)->~OperationT();
+  }
+  
+  // Releases the derived images (see ReleaseCachedImage()). Must be called
+  // with mutex_ locked. Returns the number of released bytes.
+  usize ReleaseDerivedImages(bool only_unused) {
+    usize released_bytes = 0;
+    if (derived_images_) {
+      for (int i = 0; i < derived_images_->count; ++ i) {
+        released_bytes += ReleaseCachedImage(&derived_images_->images[i].result, only_unused);
+      }
+    }
+    return released_bytes;
+  }
+  
+  inline void RecordAccess(bool loaded_or_computed) {
+    if (!budget_) {
+      return;
+    }
+    if (loaded_or_computed) {
+      budget_->RecordMiss();
+      budget_->Update(this, cached_bytes_);
+    } else {
+      budget_->RecordHit();
+      budget_->Touch(this);
+    }
+  }
+  
+  inline void UpdateBudget() {
+    if (budget_) {
+      budget_->Update(this, cached_bytes_);
+    }
+  }
+  
+  // Protects all data below. It is kept locked while loading or computing
+  // images, such that concurrent requests wait for a single computation.
+  std::mutex mutex_;
   
   string image_path_;
   shared_ptr<Image<T>> image_;
+  
+  // Allocated on first use, since most caches only hold the original image.
+  unique_ptr<DerivedImageTable> derived_images_;
+  
+  // Memory used by the image and the derived data.
+  std::atomic<usize> cached_bytes_;
+  
+  shared_ptr<ImageCacheBudget> budget_;
 };
 
+template<typename T>
+inline shared_ptr<Image<T>> ImageCacheResult<T>::GetOrComputeResult() const {
+  if (index == kImageCacheUncachedImage) {
+    return uncached_result;
+  }
+  return image_cache->GetOrComputeDerivedImage(index);
+}
+
+// Applies the operation to the given image in the cache. If the result cannot
+// be stored in the cache, it is computed immediately instead.
+template<typename T, typename OperationT>
+inline ImageCacheResult<T> ApplyImageOperation(const ImageCacheResult<T>& input, const OperationT& operation) {
+  int index = input.image_cache->GetOrAddDerivedImage(input.index, operation);
+  if (index != kImageCacheUncachedImage) {
+    return ImageCacheResult<T>(input.image_cache, index);
+  }
+  
+  shared_ptr<Image<T>> result;
+  shared_ptr<Image<T>> input_image = input.GetOrComputeResult();
+  if (input_image) {
+    result.reset(new Image<T>());
+    operation.Compute(*input_image, result.get());
+  }
+  return ImageCacheResult<T>(input.image_cache, result);
+}
+
 
 
 // ### Image pyramid. ###
 
-// Image pyramid cache element.
+// Downscales the image to half its size (see Image::DownscaleToHalfSize()).
 template<typename T>
-class ImagePyramidCacheElement : public ImageCacheElement<T> {
- public:
-  typedef shared_ptr<Image<T>> ReturnType;  // TODO: Should this be an ImageCache itself such that additional operations can be applied to the result of the image pyramid downsampling?
-  
-  ImagePyramidCacheElement(ImageCacheElement<T>* parent_cache_element)
-      : parent_cache_element_(parent_cache_element) {}
-  
-  ReturnType* GetOrComputeResult() {
-    // Compute the result only if necessary.
-    if (pyramid_image_) {
-      return &pyramid_image_;
-    }
-    
-    // We expect a shared_ptr<Image<T>> from the parent. This is unfortunately
-    // retrieved in a non-type-safe way since we don't know the type of the
-    // parent here, and we want to allow arbitrary result types, so virtual
-    // functions do not work.
-    shared_ptr<Image<T>>* input =
-        reinterpret_cast<shared_ptr<Image<T>>*>(
-            parent_cache_element_->GetOrComputeResultVoid());
-    
-    // Compute the result of this step.
-    pyramid_image_.reset(new Image<T>());
-    (*input)->DownscaleToHalfSize(pyramid_image_.get());
-    
-    return &pyramid_image_;
-  }
-  virtual void* GetOrComputeResultVoid() override {
-    return GetOrComputeResult();
+struct HalfSizeOperation {
+  inline bool operator==(const HalfSizeOperation<T>& /*other*/) const {
+    return true;
   }
   
- private:
-  // Previous element in the operation tree.
-  ImageCacheElement<T>* parent_cache_element_;
-  
-  // The result of this operation.
-  ReturnType pyramid_image_;
+  inline void Compute(const Image<T>& input, Image<T>* output) const {
+    input.DownscaleToHalfSize(output);
+  }
 };
 
-// Image pyramid tree constructor function.
-template<typename T, typename ParentCacheElementType>
-ImageCacheElementData<T, ImagePyramidCacheElement<T>> ImagePyramid(
-    const ImageCacheElementData<T, ParentCacheElementType>& parent_cache_element_data,
-    u32 pyramid_level) {
-  // Get or allocate the next element named "ImagePyramid". Fill in the cache
-  // data struct to be used by the next step.
-  constexpr const char* name = "ImagePyramid";
-  ImageCacheElement<T>* parent_cache_element =
-      parent_cache_element_data.parent_cache_element;
-  shared_ptr<ImageCacheElement<T>>* element =
-      parent_cache_element->GetOrAllocateElement(name);
-  
-  ImageCacheElementData<T, ImagePyramidCacheElement<T>> cache_data(parent_cache_element_data.image_cache);
-  if (*element) {
-    // The cache element for this level already exists, convert the pointer to
-    // it to the derived type.
-    cache_data.parent_cache_element =
-        reinterpret_cast<ImagePyramidCacheElement<T>*>(element->get());
-  } else {
-    // Allocate the cache element for this level.
-    cache_data.parent_cache_element = new ImagePyramidCacheElement<T>(parent_cache_element);
-    element->reset(cache_data.parent_cache_element);
-  }
-  
-  if (pyramid_level == 1) {
-    // End the recursion.
-    return cache_data;
-  } else {
-    return ImagePyramid(cache_data, pyramid_level - 1);
+// Returns the given pyramid level of the input, where level 0 is the input
+// itself. The levels are chained HalfSizeOperations, so all intermediate
+// levels are computed in the same pass and cached as well.
+template<typename T>
+ImageCacheResult<T> ImagePyramid(const ImageCacheResult<T>& input, u32 pyramid_level) {
+  ImageCacheResult<T> result = input;
+  for (u32 level = 0; level < pyramid_level; ++ level) {
+    result = ApplyImageOperation(result, HalfSizeOperation<T>());
   }
+  return result;
 }
 
-// Image pyramid tree root constructor function.
 template<typename T>
-ImageCacheElementData<T, ImagePyramidCacheElement<T>> ImagePyramid(ImageCache<T>* image_cache, u32 pyramid_level) {
-  ImageCacheElementData<T, ImageCache<T>> root_cache_data(image_cache, image_cache);
-  return ImagePyramid(root_cache_data, pyramid_level);
+ImageCacheResult<T> ImagePyramid(ImageCache<T>* image_cache, u32 pyramid_level) {
+  return ImagePyramid(ImageCacheResult<T>(image_cache, kImageCacheOriginalImage), pyramid_level);
 }
 
 
 
 // ### BilateralFiltered ###
 
-// Cache element.
+// See Image::BilateralFilter().
 template<typename T>
-class BilateralFilteredCacheElement : public ImageCacheElement<T> {
- public:
-  typedef shared_ptr<Image<T>> ReturnType;
-  
-  BilateralFilteredCacheElement(ImageCacheElement<T>* parent_cache_element, float sigma_xy, const T sigma_value, const T value_to_ignore, float radius_factor)
-      : parent_cache_element_(parent_cache_element),
-        sigma_xy_(sigma_xy),
-        sigma_value_(sigma_value),
-        value_to_ignore_(value_to_ignore),
-        radius_factor_(radius_factor) {}
-  
-  ReturnType* GetOrComputeResult() {
-    // Compute the result only if necessary.
-    if (filtered_image_) {
-      return &filtered_image_;
-    }
-    
-    // We expect a shared_ptr<Image<T>> from the parent. This is unfortunately
-    // retrieved in a non-type-safe way since we don't know the type of the
-    // parent here, and we want to allow arbitrary result types, so virtual
-    // functions do not work.
-    shared_ptr<Image<T>>* input =
-        reinterpret_cast<shared_ptr<Image<T>>*>(
-            parent_cache_element_->GetOrComputeResultVoid());
-    
-    // Compute the result of this step.
-    filtered_image_.reset(new Image<T>());
-    (*input)->BilateralFilter(sigma_xy_, sigma_value_, value_to_ignore_, radius_factor_, filtered_image_.get());
-    
-    return &filtered_image_;
+struct BilateralFilterOperation {
+  inline bool operator==(const BilateralFilterOperation<T>& other) const {
+    return sigma_xy == other.sigma_xy &&
+           sigma_value == other.sigma_value &&
+           value_to_ignore == other.value_to_ignore &&
+           radius_factor == other.radius_factor;
   }
-  virtual void* GetOrComputeResultVoid() override {
-    return GetOrComputeResult();
-  }
-  
- private:
-  // Previous element in the operation tree.
-  ImageCacheElement<T>* parent_cache_element_;
   
-  // The parameters of this operation.
-  float sigma_xy_;
-  const T sigma_value_;
-  const T value_to_ignore_;
-  float radius_factor_;
+  inline void Compute(const Image<T>& input, Image<T>* output) const {
+    input.BilateralFilter(sigma_xy, sigma_value, value_to_ignore, radius_factor, output);
+  }
   
-  // The result of this operation.
-  ReturnType filtered_image_;
+  float sigma_xy;
+  T sigma_value;
+  T value_to_ignore;
+  float radius_factor;
 };
 
-// Operator function.
 template<typename T>
-ImageCacheElementData<T, BilateralFilteredCacheElement<T>> BilateralFiltered(ImageCache<T>* image_cache, float sigma_xy, const T sigma_value, const T value_to_ignore, float radius_factor) {
-  ImageCacheElementData<T, BilateralFilteredCacheElement<T>> cache_data(image_cache);
-  
-  ostringstream name;
-  name << "BilateralFiltered_" << sigma_xy << "_" << sigma_value << "_" << value_to_ignore << " " << radius_factor;
-  shared_ptr<ImageCacheElement<T>>* element =
-      image_cache->GetOrAllocateElement(name.str());
-  if (*element) {
-    // The cache element for this level already exists, convert the pointer to
-    // it to the derived type.
-    cache_data.parent_cache_element =
-        reinterpret_cast<BilateralFilteredCacheElement<T>*>(element->get());
-  } else {
-    // Allocate the cache element for this level.
-    cache_data.parent_cache_element = new BilateralFilteredCacheElement<T>(image_cache, sigma_xy, sigma_value, value_to_ignore, radius_factor);
-    element->reset(cache_data.parent_cache_element);
-  }
-  
-  return cache_data;
+ImageCacheResult<T> BilateralFiltered(const ImageCacheResult<T>& input, float sigma_xy, const T sigma_value, const T value_to_ignore, float radius_factor) {
+  BilateralFilterOperation<T> operation;
+  operation.sigma_xy = sigma_xy;
+  operation.sigma_value = sigma_value;
+  operation.value_to_ignore = value_to_ignore;
+  operation.radius_factor = radius_factor;
+  return ApplyImageOperation(input, operation);
 }
 
-// Operator function for concatenation.
-// TODO: Unify this with the function above as far as possible.
-template<typename T, typename ParentCacheElementType>
-ImageCacheElementData<T, BilateralFilteredCacheElement<T>> BilateralFiltered(
-    const ImageCacheElementData<T, ParentCacheElementType>& parent_cache_element_data,
-    float sigma_xy, const T sigma_value, const T value_to_ignore, float radius_factor) {
-  ImageCacheElementData<T, BilateralFilteredCacheElement<T>> cache_data(parent_cache_element_data.image_cache);
-  
-  ostringstream name;
-  name << "BilateralFiltered_" << sigma_xy << "_" << sigma_value << "_" << value_to_ignore << " " << radius_factor;
-  shared_ptr<ImageCacheElement<T>>* element =
-      parent_cache_element_data.parent_cache_element->GetOrAllocateElement(name.str());
-  if (*element) {
-    // The cache element for this level already exists, convert the pointer to
-    // it to the derived type.
-    cache_data.parent_cache_element =
-        reinterpret_cast<BilateralFilteredCacheElement<T>*>(element->get());
-  } else {
-    // Allocate the cache element for this level.
-    cache_data.parent_cache_element = new BilateralFilteredCacheElement<T>(parent_cache_element_data.parent_cache_element, sigma_xy, sigma_value, value_to_ignore, radius_factor);
-    element->reset(cache_data.parent_cache_element);
-  }
-  
-  return cache_data;
+template<typename T>
+ImageCacheResult<T> BilateralFiltered(ImageCache<T>* image_cache, float sigma_xy, const T sigma_value, const T value_to_ignore, float radius_factor) {
+  return BilateralFiltered(ImageCacheResult<T>(image_cache, kImageCacheOriginalImage), sigma_xy, sigma_value, value_to_ignore, radius_factor);
 }
 
 
 
 // ### MaxCutoff ###
 
-// Cache element.
+// Replaces all values larger than max_value with replacement_value (see
+// Image::MaxCutoff()).
 template<typename T>
-class MaxCutoffCacheElement : public ImageCacheElement<T> {
- public:
-  typedef shared_ptr<Image<T>> ReturnType;
-  
-  MaxCutoffCacheElement(ImageCacheElement<T>* parent_cache_element, const T max_value, const T replacement_value)
-      : parent_cache_element_(parent_cache_element),
-        max_value_(max_value),
-        replacement_value_(replacement_value) {}
-  
-  ReturnType* GetOrComputeResult() {
-    // Compute the result only if necessary.
-    if (filtered_image_) {
-      return &filtered_image_;
-    }
-    
-    // We expect a shared_ptr<Image<T>> from the parent. This is unfortunately
-    // retrieved in a non-type-safe way since we don't know the type of the
-    // parent here, and we want to allow arbitrary result types, so virtual
-    // functions do not work.
-    shared_ptr<Image<T>>* input =
-        reinterpret_cast<shared_ptr<Image<T>>*>(
-            parent_cache_element_->GetOrComputeResultVoid());
-    
-    // Compute the result of this step.
-    filtered_image_.reset(new Image<T>());
-    (*input)->MaxCutoff(max_value_, replacement_value_, filtered_image_.get());
-    
-    return &filtered_image_;
-  }
-  virtual void* GetOrComputeResultVoid() override {
-    return GetOrComputeResult();
+struct MaxCutoffOperation {
+  inline bool operator==(const MaxCutoffOperation<T>& other) const {
+    return max_value == other.max_value &&
+           replacement_value == other.replacement_value;
   }
   
- private:
-  // Previous element in the operation tree.
-  ImageCacheElement<T>* parent_cache_element_;
-  
-  // The parameters of this operation.
-  const T max_value_;
-  const T replacement_value_;
+  inline void Compute(const Image<T>& input, Image<T>* output) const {
+    input.MaxCutoff(max_value, replacement_value, output);
+  }
   
-  // The result of this operation.
-  ReturnType filtered_image_;
+  T max_value;
+  T replacement_value;
 };
 
-// Operator function. Replaces all values larger than max_value with replacement_value.
 template<typename T>
-ImageCacheElementData<T, MaxCutoffCacheElement<T>> MaxCutoff(ImageCache<T>* image_cache, const T max_value, const T replacement_value) {
-  ImageCacheElementData<T, MaxCutoffCacheElement<T>> cache_data(image_cache);
-  
-  ostringstream name;
-  name << "MaxCutoff_" << max_value << "_" << replacement_value;
-  shared_ptr<ImageCacheElement<T>>* element =
-      image_cache->GetOrAllocateElement(name.str());
-  if (*element) {
-    // The cache element for this level already exists, convert the pointer to
-    // it to the derived type.
-    cache_data.parent_cache_element =
-        reinterpret_cast<MaxCutoffCacheElement<T>*>(element->get());
-  } else {
-    // Allocate the cache element for this level.
-    cache_data.parent_cache_element = new MaxCutoffCacheElement<T>(image_cache, max_value, replacement_value);
-    element->reset(cache_data.parent_cache_element);
-  }
-  
-  return cache_data;
+ImageCacheResult<T> MaxCutoff(const ImageCacheResult<T>& input, const T max_value, const T replacement_value) {
+  MaxCutoffOperation<T> operation;
+  operation.max_value = max_value;
+  operation.replacement_value = replacement_value;
+  return ApplyImageOperation(input, operation);
+}
+
+template<typename T>
+ImageCacheResult<T> MaxCutoff(ImageCache<T>* image_cache, const T max_value, const T replacement_value) {
+  return MaxCutoff(ImageCacheResult<T>(image_cache, kImageCacheOriginalImage), max_value, replacement_value);
 }
 
 }
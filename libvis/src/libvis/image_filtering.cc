@@ -0,0 +1,193 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "libvis/image.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+  #define LIBVIS_HAVE_SSE2
+#endif
+
+namespace vis {
+
+// The SIMD loops below process blocks of output pixels. The remaining pixels
+// of each row (and all pixels if SSE2 is not available) are processed by
+// scalar loops with the same (correctly rounded) results, which compilers can
+// auto-vectorize for other instruction sets as well.
+
+template<>
+void Image<u8>::DownscaleToHalfSize(Image<u8>* output) const {
+  CHECK_EQ(width() % 2, 0);
+  CHECK_EQ(height() % 2, 0);
+  
+  output->SetSize(width() / 2, height() / 2);
+  ForEachImageRowBlock(output->height(), pixel_count(), 256 * 1024, [&](u32 min_y, u32 end_y) {
+    for (u32 y = min_y; y < end_y; ++ y) {
+      u8* write_ptr = output->row(y);
+      const u8* upper_read_ptr = row(2 * y + 0);
+      const u8* lower_read_ptr = row(2 * y + 1);
+      u32 x = 0;
+      
+#ifdef LIBVIS_HAVE_SSE2
+      // Process 16 output pixels per iteration: sum up the horizontal pixel
+      // pairs as 16-bit values, add the vertical pairs, and round.
+      const __m128i low_byte_mask = _mm_set1_epi16(0x00ff);
+      const __m128i rounding = _mm_set1_epi16(2);
+      for (; x + 16 <= output->width(); x += 16) {
+        __m128i sums[2];
+        for (int half = 0; half < 2; ++ half) {
+          __m128i upper = _mm_loadu_si128(reinterpret_cast<const __m128i*>(upper_read_ptr + 2 * x + 16 * half));
+          __m128i lower = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lower_read_ptr + 2 * x + 16 * half));
+          __m128i sum = _mm_add_epi16(
+              _mm_add_epi16(_mm_and_si128(upper, low_byte_mask), _mm_srli_epi16(upper, 8)),
+              _mm_add_epi16(_mm_and_si128(lower, low_byte_mask), _mm_srli_epi16(lower, 8)));
+          sums[half] = _mm_srli_epi16(_mm_add_epi16(sum, rounding), 2);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(write_ptr + x), _mm_packus_epi16(sums[0], sums[1]));
+      }
+#endif
+      
+      for (; x < output->width(); ++ x) {
+        write_ptr[x] = (upper_read_ptr[2 * x] + upper_read_ptr[2 * x + 1] +
+                        lower_read_ptr[2 * x] + lower_read_ptr[2 * x + 1] + 2) >> 2;
+      }
+    }
+  });
+}
+
+template<>
+void Image<u16>::DownscaleToHalfSize(Image<u16>* output) const {
+  CHECK_EQ(width() % 2, 0);
+  CHECK_EQ(height() % 2, 0);
+  
+  output->SetSize(width() / 2, height() / 2);
+  ForEachImageRowBlock(output->height(), pixel_count(), 256 * 1024, [&](u32 min_y, u32 end_y) {
+    for (u32 y = min_y; y < end_y; ++ y) {
+      u16* write_ptr = output->row(y);
+      const u16* upper_read_ptr = row(2 * y + 0);
+      const u16* lower_read_ptr = row(2 * y + 1);
+      u32 x = 0;
+      
+#ifdef LIBVIS_HAVE_SSE2
+      // Process 8 output pixels per iteration. The sums can exceed 16 bits, so
+      // they are computed as 32-bit values. Since SSE2 has no unsigned
+      // saturating 32-to-16-bit pack, the results are shifted into the signed
+      // range for packing and shifted back afterwards.
+      const __m128i low_word_mask = _mm_set1_epi32(0x0000ffff);
+      const __m128i rounding = _mm_set1_epi32(2);
+      const __m128i signed_offset_32 = _mm_set1_epi32(0x8000);
+      const __m128i signed_offset_16 = _mm_set1_epi16(static_cast<short>(0x8000));
+      for (; x + 8 <= output->width(); x += 8) {
+        __m128i results[2];
+        for (int half = 0; half < 2; ++ half) {
+          __m128i upper = _mm_loadu_si128(reinterpret_cast<const __m128i*>(upper_read_ptr + 2 * x + 8 * half));
+          __m128i lower = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lower_read_ptr + 2 * x + 8 * half));
+          __m128i sum = _mm_add_epi32(
+              _mm_add_epi32(_mm_and_si128(upper, low_word_mask), _mm_srli_epi32(upper, 16)),
+              _mm_add_epi32(_mm_and_si128(lower, low_word_mask), _mm_srli_epi32(lower, 16)));
+          results[half] = _mm_sub_epi32(_mm_srli_epi32(_mm_add_epi32(sum, rounding), 2), signed_offset_32);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(write_ptr + x),
+                         _mm_xor_si128(_mm_packs_epi32(results[0], results[1]), signed_offset_16));
+      }
+#endif
+      
+      for (; x < output->width(); ++ x) {
+        write_ptr[x] = (static_cast<u32>(upper_read_ptr[2 * x]) + upper_read_ptr[2 * x + 1] +
+                        lower_read_ptr[2 * x] + lower_read_ptr[2 * x + 1] + 2) >> 2;
+      }
+    }
+  });
+}
+
+template<>
+void Image<float>::DownscaleToHalfSize(Image<float>* output) const {
+  CHECK_EQ(width() % 2, 0);
+  CHECK_EQ(height() % 2, 0);
+  
+  output->SetSize(width() / 2, height() / 2);
+  ForEachImageRowBlock(output->height(), pixel_count(), 256 * 1024, [&](u32 min_y, u32 end_y) {
+    for (u32 y = min_y; y < end_y; ++ y) {
+      float* write_ptr = output->row(y);
+      const float* upper_read_ptr = row(2 * y + 0);
+      const float* lower_read_ptr = row(2 * y + 1);
+      u32 x = 0;
+      
+#ifdef LIBVIS_HAVE_SSE2
+      // Process 4 output pixels per iteration. The additions are done in the
+      // same order as in the scalar loop to get identical results.
+      const __m128 quarter = _mm_set1_ps(0.25f);
+      for (; x + 4 <= output->width(); x += 4) {
+        __m128 upper_0 = _mm_loadu_ps(upper_read_ptr + 2 * x);
+        __m128 upper_1 = _mm_loadu_ps(upper_read_ptr + 2 * x + 4);
+        __m128 lower_0 = _mm_loadu_ps(lower_read_ptr + 2 * x);
+        __m128 lower_1 = _mm_loadu_ps(lower_read_ptr + 2 * x + 4);
+        __m128 sum = _mm_add_ps(
+            _mm_add_ps(
+                _mm_add_ps(_mm_shuffle_ps(upper_0, upper_1, _MM_SHUFFLE(2, 0, 2, 0)),
+                           _mm_shuffle_ps(upper_0, upper_1, _MM_SHUFFLE(3, 1, 3, 1))),
+                _mm_shuffle_ps(lower_0, lower_1, _MM_SHUFFLE(2, 0, 2, 0))),
+            _mm_shuffle_ps(lower_0, lower_1, _MM_SHUFFLE(3, 1, 3, 1)));
+        _mm_storeu_ps(write_ptr + x, _mm_mul_ps(quarter, sum));
+      }
+#endif
+      
+      for (; x < output->width(); ++ x) {
+        write_ptr[x] = 0.25f * (upper_read_ptr[2 * x] + upper_read_ptr[2 * x + 1] +
+                                lower_read_ptr[2 * x] + lower_read_ptr[2 * x + 1]);
+      }
+    }
+  });
+}
+
+template<>
+void Image<Vec3u8>::DownscaleToHalfSize(Image<Vec3u8>* output) const {
+  CHECK_EQ(width() % 2, 0);
+  CHECK_EQ(height() % 2, 0);
+  
+  output->SetSize(width() / 2, height() / 2);
+  ForEachImageRowBlock(output->height(), pixel_count(), 256 * 1024, [&](u32 min_y, u32 end_y) {
+    for (u32 y = min_y; y < end_y; ++ y) {
+      u8* write_ptr = reinterpret_cast<u8*>(output->row(y));
+      const u8* upper_read_ptr = reinterpret_cast<const u8*>(row(2 * y + 0));
+      const u8* lower_read_ptr = reinterpret_cast<const u8*>(row(2 * y + 1));
+      // Without byte shuffles (which SSE2 does not have), de-interleaving the
+      // channels costs more than it saves, so this relies on auto-vectorization
+      // of the per-channel loop.
+      for (u32 x = 0; x < output->width(); ++ x) {
+        for (int c = 0; c < 3; ++ c) {
+          write_ptr[3 * x + c] = (upper_read_ptr[6 * x + c] + upper_read_ptr[6 * x + c + 3] +
+                                  lower_read_ptr[6 * x + c] + lower_read_ptr[6 * x + c + 3] + 2) >> 2;
+        }
+      }
+    }
+  });
+}
+
+}
@@ -0,0 +1,173 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <tuple>
+
+#include "libvis/image.h"
+#include "libvis/libvis.h"
+
+namespace vis {
+
+// Allocation statistics of a buffer pool.
+struct PoolMetrics {
+  // Number of actual memory allocations and frees.
+  usize allocation_count = 0;
+  usize free_count = 0;
+  
+  // Number of Acquire() calls, and how many of them re-used pooled memory.
+  usize acquire_count = 0;
+  usize reuse_count = 0;
+  
+  // Memory which is currently held by the pool without being in use, and
+  // memory which is currently handed out by the pool (in bytes).
+  usize pooled_bytes = 0;
+  usize in_use_bytes = 0;
+};
+
+inline std::ostream& operator<<(std::ostream& stream, const PoolMetrics& metrics) {
+  stream << metrics.allocation_count << " allocations, "
+         << metrics.free_count << " frees, "
+         << metrics.reuse_count << " of " << metrics.acquire_count << " acquisitions re-used, "
+         << (metrics.pooled_bytes / (1024 * 1024)) << " MB pooled, "
+         << (metrics.in_use_bytes / (1024 * 1024)) << " MB in use";
+  return stream;
+}
+
+// Pool of host images which avoids re-allocating images of the same size.
+// Acquire() returns images whose shared_ptr returns them to the pool instead of
+// freeing them once the last reference goes away. Images are bucketed by their
+// size. The returned images may outlive the pool, they are freed normally in
+// this case. Thread-safe.
+template <typename T>
+class ImagePool {
+ public:
+  // Creates a pool which keeps at most max_pooled_bytes of unused images.
+  // Images which are returned while the pool is full are freed.
+  inline ImagePool(usize max_pooled_bytes = numeric_limits<usize>::max())
+      : state_(new State()) {
+    state_->max_pooled_bytes = max_pooled_bytes;
+  }
+  
+  inline ~ImagePool() {
+    {
+      lock_guard<mutex> lock(state_->access_mutex);
+      state_->closed = true;
+    }
+    Trim();
+  }
+  
+  // Returns an image of the given size with undefined content. The image must
+  // not be resized by the caller.
+  shared_ptr<Image<T>> Acquire(u32 width, u32 height) {
+    const usize bytes = ImageBytes(width, height);
+    Image<T>* image = nullptr;
+    {
+      lock_guard<mutex> lock(state_->access_mutex);
+      ++ state_->metrics.acquire_count;
+      state_->metrics.in_use_bytes += bytes;
+      vector<Image<T>*>& bucket = state_->buckets[std::make_tuple(width, height)];
+      if (!bucket.empty()) {
+        image = bucket.back();
+        bucket.pop_back();
+        ++ state_->metrics.reuse_count;
+        state_->metrics.pooled_bytes -= bytes;
+      } else {
+        ++ state_->metrics.allocation_count;
+      }
+    }
+    
+    if (!image) {
+      image = new Image<T>(width, height);
+    }
+    
+    shared_ptr<State> state = state_;
+    return shared_ptr<Image<T>>(image, [state](Image<T>* image) {
+      state->Release(image);
+    });
+  }
+  
+  // Frees all images which are currently pooled.
+  void Trim() {
+    vector<Image<T>*> images;
+    {
+      lock_guard<mutex> lock(state_->access_mutex);
+      for (auto& item : state_->buckets) {
+        images.insert(images.end(), item.second.begin(), item.second.end());
+        item.second.clear();
+      }
+      state_->metrics.free_count += images.size();
+      state_->metrics.pooled_bytes = 0;
+    }
+    for (Image<T>* image : images) {
+      delete image;
+    }
+  }
+  
+  inline PoolMetrics metrics() const {
+    lock_guard<mutex> lock(state_->access_mutex);
+    return state_->metrics;
+  }
+  
+ private:
+  static inline usize ImageBytes(u32 width, u32 height) {
+    return static_cast<usize>(width) * height * sizeof(T);
+  }
+  
+  // The state is shared with the deleters of the returned images.
+  struct State {
+    void Release(Image<T>* image) {
+      const usize bytes = ImageBytes(image->width(), image->height());
+      {
+        lock_guard<mutex> lock(access_mutex);
+        metrics.in_use_bytes -= bytes;
+        if (!closed && metrics.pooled_bytes + bytes <= max_pooled_bytes) {
+          buckets[std::make_tuple(image->width(), image->height())].push_back(image);
+          metrics.pooled_bytes += bytes;
+          return;
+        }
+        ++ metrics.free_count;
+      }
+      delete image;
+    }
+    
+    std::mutex access_mutex;
+    map<std::tuple<u32, u32>, vector<Image<T>*>> buckets;
+    usize max_pooled_bytes;
+    bool closed = false;
+    PoolMetrics metrics;
+  };
+  
+  shared_ptr<State> state_;
+};
+
+}
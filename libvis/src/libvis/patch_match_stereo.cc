@@ -36,6 +36,43 @@ namespace vis {
 
 constexpr float kMinInvDepth = 1e-5f;  // TODO: Make parameter
 
+// Small and fast random number generator (SplitMix64). PatchMatch uses one
+// generator per image row and pass, seeded from the pass and the row index, so
+// the results do not depend on the number of threads. Rows are expected to be
+// fewer than 2^16.
+class PatchMatchRandom {
+ public:
+  inline PatchMatchRandom(u64 seed)
+      : state_(seed) {}
+  
+  // Creates the generator for the given row in the given step, where step 0
+  // is the initialization and the following steps are the PatchMatch passes.
+  inline PatchMatchRandom(u32 seed, int step, int row)
+      : state_((static_cast<u64>(seed) << 32) ^
+               (static_cast<u64>(step) << 16) ^
+               static_cast<u64>(row)) {
+    Next();
+  }
+  
+  inline u64 Next() {
+    u64 z = (state_ += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+  
+  // Returns a uniformly distributed random number in [0, 1[.
+  inline float Uniform01() {
+    return (Next() >> 40) * (1.0f / (1 << 24));
+  }
+  
+ private:
+  u64 state_;
+};
+
+// Projects the given point (in reference camera coordinates) into the stereo
+// image and returns the bilinearly interpolated intensity there, or NaN if
+// the point does not project into the image.
 template <class CameraT>
 inline float SampleAtProjectedPosition(
     const float x, const float y, const float z,
@@ -76,55 +113,75 @@ inline float CalculatePlaneInvDepth2(
 }
 
 
-template <class CameraT1, class CameraT2>
-inline float ComputeCostsSSD(
+// Samples the stereo image for all pixels of the patch around (x, y) in the
+// reference image, assuming that the patch lies on the plane given by
+// normal_xy and inv_depth. The samples are written to stereo_values in
+// row-major order, with NaN for samples which do not project into the stereo
+// image. unprojection contains the normalized image coordinates of all
+// reference image pixels. Returns false if the plane is invalid.
+template <class CameraT>
+inline bool SamplePatch(
     int x, int y,
     const Vec2f& normal_xy,
     const float inv_depth,
-    const CameraT1& reference_camera,
-    const Image<u8>& reference_image,
+    const Image<Vec2f>& unprojection,
     const Matrix<float, 3, 4>& stereo_tr_reference,
-    const CameraT2& stereo_camera,
+    const CameraT& stereo_camera,
     const Image<u8>& stereo_image,
-    const int stereo_width,
-    const int stereo_height,
-    int context_radius) {
+    int context_radius,
+    float* stereo_values) {
   if (inv_depth < kMinInvDepth) {
-    return numeric_limits<float>::quiet_NaN();
+    return false;
   }
   
   const float normal_z =
       -sqrtf(1.f - normal_xy.x() * normal_xy.x() - normal_xy.y() * normal_xy.y());
   const float depth = 1.f / inv_depth;
-  const Vec2f center_nxy =
-      reference_camera.UnprojectFromPixelCenterConv(Vec2i(x, y)).template cast<float>().template topRows<2>();
+  const Vec2f& center_nxy = unprojection(x, y);
   const float plane_d =
       (center_nxy.x() * depth) * normal_xy.x() +
       (center_nxy.y() * depth) * normal_xy.y() + depth * normal_z;
   
-  float cost = 0;
-  
+  const int stereo_width = stereo_image.width();
+  const int stereo_height = stereo_image.height();
   for (int dy = -context_radius; dy <= context_radius; ++ dy) {
+    const Vec2f* nxy_row = unprojection.row(y + dy) + x;
     for (int dx = -context_radius; dx <= context_radius; ++ dx) {
-      Vec2f nxy = reference_camera.UnprojectFromPixelCenterConv(Vec2i(x + dx, y + dy)).template cast<float>().template topRows<2>();
+      const Vec2f& nxy = nxy_row[dx];
       float plane_depth = CalculatePlaneDepth2(plane_d, normal_xy, normal_z, nxy.x(), nxy.y());
-      nxy.x() *= plane_depth;
-      nxy.y() *= plane_depth;
-      
-      float sample =
-            SampleAtProjectedPosition(nxy.x(), nxy.y(), plane_depth,
-                                      stereo_width,
-                                      stereo_height,
-                                      stereo_camera,
-                                      stereo_tr_reference,
-                                      stereo_image);
-      
-      const float diff = sample - reference_image(x + dx, y + dy);
-      cost += diff * diff;
+      *stereo_values =
+          SampleAtProjectedPosition(nxy.x() * plane_depth, nxy.y() * plane_depth, plane_depth,
+                                    stereo_width,
+                                    stereo_height,
+                                    stereo_camera,
+                                    stereo_tr_reference,
+                                    stereo_image);
+      ++ stereo_values;
     }
   }
-  
-  return cost;
+  return true;
+}
+
+// Returns the sum of squared differences between the patch values and the
+// reference image patch around (x, y). The sums are accumulated in four
+// independent partial sums such that the loop can be vectorized. NaN values
+// propagate into the result.
+inline float ComputeCostsSSD(
+    int x, int y,
+    const Image<u8>& reference_image,
+    int context_radius,
+    const float* stereo_values) {
+  const int patch_size = 2 * context_radius + 1;
+  float partial_costs[4] = {0, 0, 0, 0};
+  for (int dy = -context_radius; dy <= context_radius; ++ dy) {
+    const u8* reference_row = reference_image.row(y + dy) + x - context_radius;
+    for (int i = 0; i < patch_size; ++ i) {
+      const float diff = stereo_values[i] - reference_row[i];
+      partial_costs[i & 3] += diff * diff;
+    }
+    stereo_values += patch_size;
+  }
+  return (partial_costs[0] + partial_costs[1]) + (partial_costs[2] + partial_costs[3]);
 }
 
 // Computes 0.5f * (1 - ZNCC), so that the result can be used
@@ -155,99 +212,119 @@ inline float ComputeZNCCBasedCost(
   }
 }
 
-template <class CameraT1, class CameraT2>
+// Computes the ZNCC-based cost (see ComputeZNCCBasedCost()) between the patch
+// values and the reference image patch around (x, y). Like ComputeCostsSSD(),
+// uses four independent partial sums per sum to allow vectorization.
 inline float ComputeCostsZNCC(
     int x, int y,
-    const Vec2f& normal_xy,
-    const float inv_depth,
-    const CameraT1& reference_camera,
     const Image<u8>& reference_image,
-    const Matrix<float, 3, 4>& stereo_tr_reference,
-    const CameraT2& stereo_camera,
-    const Image<u8>& stereo_image,
-    const int stereo_width,
-    const int stereo_height,
-    int context_radius) {
-  if (inv_depth < kMinInvDepth) {
-    return numeric_limits<float>::quiet_NaN();
-  }
-  
-  const float normal_z =
-      -sqrtf(1.f - normal_xy.x() * normal_xy.x() - normal_xy.y() * normal_xy.y());
-  const float depth = 1.f / inv_depth;
-  const Vec2f center_nxy =
-      reference_camera.UnprojectFromPixelCenterConv(Vec2i(x, y)).template cast<float>().template topRows<2>();
-  const float plane_d =
-      (center_nxy.x() * depth) * normal_xy.x() +
-      (center_nxy.y() * depth) * normal_xy.y() + depth * normal_z;
-  
-  float sum_a = 0;
-  float squared_sum_a = 0;
-  float sum_b = 0;
-  float squared_sum_b = 0;
-  float product_sum = 0;
+    int context_radius,
+    const float* stereo_values) {
+  const int patch_size = 2 * context_radius + 1;
+  float sum_a[4] = {0, 0, 0, 0};
+  float squared_sum_a[4] = {0, 0, 0, 0};
+  float sum_b[4] = {0, 0, 0, 0};
+  float squared_sum_b[4] = {0, 0, 0, 0};
+  float product_sum[4] = {0, 0, 0, 0};
   
   for (int dy = -context_radius; dy <= context_radius; ++ dy) {
-    for (int dx = -context_radius; dx <= context_radius; ++ dx) {
-      Vec2f nxy = reference_camera.UnprojectFromPixelCenterConv(Vec2i(x + dx, y + dy)).template cast<float>().template topRows<2>();
-      float plane_depth = CalculatePlaneDepth2(plane_d, normal_xy, normal_z, nxy.x(), nxy.y());
-      nxy.x() *= plane_depth;
-      nxy.y() *= plane_depth;
-      
-      float stereo_value =
-            SampleAtProjectedPosition(nxy.x(), nxy.y(), plane_depth,
-                                      stereo_width,
-                                      stereo_height,
-                                      stereo_camera,
-                                      stereo_tr_reference,
-                                      stereo_image);
-      
-      sum_a += stereo_value;
-      squared_sum_a += stereo_value * stereo_value;
-      
-      float reference_value = reference_image(x + dx, y + dy);
-      
-      sum_b += reference_value;
-      squared_sum_b += reference_value * reference_value;
-      
-      product_sum += stereo_value * reference_value;
+    const u8* reference_row = reference_image.row(y + dy) + x - context_radius;
+    for (int i = 0; i < patch_size; ++ i) {
+      const float stereo_value = stereo_values[i];
+      const float reference_value = reference_row[i];
+      sum_a[i & 3] += stereo_value;
+      squared_sum_a[i & 3] += stereo_value * stereo_value;
+      sum_b[i & 3] += reference_value;
+      squared_sum_b[i & 3] += reference_value * reference_value;
+      product_sum[i & 3] += stereo_value * reference_value;
     }
+    stereo_values += patch_size;
   }
   
+  auto reduce = [](const float* sums) {
+    return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+  };
   return ComputeZNCCBasedCost(
-      context_radius, sum_a, squared_sum_a, sum_b, squared_sum_b, product_sum);
+      context_radius, reduce(sum_a), reduce(squared_sum_a), reduce(sum_b),
+      reduce(squared_sum_b), reduce(product_sum));
 }
 
-template <class CameraT1, class CameraT2>
+template <class CameraT>
 inline float ComputeCosts(
     int x, int y,
     const Vec2f& normal_xy,
     const float inv_depth,
-    const CameraT1& reference_camera,
+    const Image<Vec2f>& unprojection,
     const Image<u8>& reference_image,
     const Matrix<float, 3, 4>& stereo_tr_reference,
-    const CameraT2& stereo_camera,
+    const CameraT& stereo_camera,
     const Image<u8>& stereo_image,
-    const int stereo_width,
-    const int stereo_height,
     int context_radius,
-    PatchMatchStereoCPU::MatchMetric match_metric) {
+    PatchMatchStereoCPU::MatchMetric match_metric,
+    float* stereo_values) {
+  if (!SamplePatch(x, y, normal_xy, inv_depth, unprojection, stereo_tr_reference,
+                   stereo_camera, stereo_image, context_radius, stereo_values)) {
+    return numeric_limits<float>::quiet_NaN();
+  }
+  
   if (match_metric == PatchMatchStereoCPU::MatchMetric::kSSD) {
-    return ComputeCostsSSD(
-        x, y, normal_xy, inv_depth, reference_camera, reference_image,
-        stereo_tr_reference, stereo_camera, stereo_image, stereo_width,
-        stereo_height, context_radius);
+    return ComputeCostsSSD(x, y, reference_image, context_radius, stereo_values);
   } else if (match_metric == PatchMatchStereoCPU::MatchMetric::kZNCC) {
-    return ComputeCostsZNCC(
-        x, y, normal_xy, inv_depth, reference_camera, reference_image,
-        stereo_tr_reference, stereo_camera, stereo_image, stereo_width,
-        stereo_height, context_radius);
+    return ComputeCostsZNCC(x, y, reference_image, context_radius, stereo_values);
   }
   
   // This should never be reached since all metrics should be handled above.
   return 0;
 }
 
+// Computes the multi-view matching cost as the mean of the best_view_count
+// lowest costs among the stereo views which observe the patch, or NaN if no
+// view observes it. view_costs must have space for one cost per stereo view.
+template <class CameraT>
+inline float ComputeMultiViewCosts(
+    int x, int y,
+    const Vec2f& normal_xy,
+    const float inv_depth,
+    const Image<Vec2f>& unprojection,
+    const Image<u8>& reference_image,
+    const aligned_vector<Matrix<float, 3, 4>>& stereo_tr_reference,
+    const vector<const CameraT*>& stereo_cameras,
+    const vector<const Image<u8>*>& stereo_images,
+    int context_radius,
+    PatchMatchStereoCPU::MatchMetric match_metric,
+    int best_view_count,
+    float* stereo_values,
+    float* view_costs) {
+  if (stereo_images.size() == 1) {
+    return ComputeCosts(x, y, normal_xy, inv_depth, unprojection, reference_image,
+                        stereo_tr_reference[0], *stereo_cameras[0], *stereo_images[0],
+                        context_radius, match_metric, stereo_values);
+  }
+  
+  int valid_count = 0;
+  for (usize i = 0; i < stereo_images.size(); ++ i) {
+    const float cost = ComputeCosts(
+        x, y, normal_xy, inv_depth, unprojection, reference_image,
+        stereo_tr_reference[i], *stereo_cameras[i], *stereo_images[i],
+        context_radius, match_metric, stereo_values);
+    if (!std::isnan(cost)) {
+      view_costs[valid_count] = cost;
+      ++ valid_count;
+    }
+  }
+  if (valid_count == 0) {
+    return numeric_limits<float>::quiet_NaN();
+  }
+  
+  const int used_count = std::min(std::max(1, best_view_count), valid_count);
+  std::partial_sort(view_costs, view_costs + used_count, view_costs + valid_count);
+  float cost_sum = 0;
+  for (int i = 0; i < used_count; ++ i) {
+    cost_sum += view_costs[i];
+  }
+  return cost_sum / used_count;
+}
+
 
 struct ConnectedComponent {
   ConnectedComponent(int _parent, int _pixel_count)
@@ -365,7 +442,9 @@ void PatchMatchStereoCPU::RemoveSmallConnectedComponentsInInvDepthMap(
 }
 
 
-PatchMatchStereoCPU::PatchMatchStereoCPU(int /*width*/, int /*height*/) {}
+PatchMatchStereoCPU::PatchMatchStereoCPU(int width, int height)
+    : normals_(width, height),
+      costs_(width, height) {}
 
 // // (Mostly) auto-generated function.
 // typedef float Scalar;
@@ -481,16 +560,38 @@ void PatchMatchStereoCPU::ComputeDepthMap(
     const Image<u8>& stereo_image,
     const SE3f& stereo_image_tr_global,
     Image<float>* inv_depth_map) {
+  aligned_vector<StereoView> stereo_views(
+      1, StereoView(&stereo_camera, &stereo_image, stereo_image_tr_global));
+  ComputeDepthMap(
+      reference_camera,
+      reference_image,
+      reference_image_tr_global,
+      stereo_views,
+      inv_depth_map);
+}
+
+void PatchMatchStereoCPU::ComputeDepthMap(
+    const Camera& reference_camera,
+    const Image<u8>& reference_image,
+    const SE3f& reference_image_tr_global,
+    const aligned_vector<StereoView>& stereo_views,
+    Image<float>* inv_depth_map) {
+  CHECK(!stereo_views.empty());
+  const Camera& first_stereo_camera = *stereo_views.front().camera;
+  for (const StereoView& view : stereo_views) {
+    CHECK(view.camera->type() == first_stereo_camera.type())
+        << "All stereo views must use the same camera type.";
+  }
+  
   IDENTIFY_CAMERA2(
       reference_camera,
-      stereo_camera,
+      first_stereo_camera,
       ComputeDepthMap_(
           _reference_camera,
           reference_image,
           reference_image_tr_global,
-          _stereo_camera,
-          stereo_image,
-          stereo_image_tr_global,
+          _first_stereo_camera,
+          stereo_views,
           inv_depth_map));
 }
 
@@ -499,296 +600,290 @@ void PatchMatchStereoCPU::ComputeDepthMap_(
     const CameraT1& reference_camera,
     const Image<u8>& reference_image,
     const SE3f& reference_image_tr_global,
-    const CameraT2& stereo_camera,
-    const Image<u8>& stereo_image,
-    const SE3f& stereo_image_tr_global,
+    const CameraT2& /*first_stereo_camera*/,
+    const aligned_vector<StereoView>& stereo_views,
     Image<float>* inv_depth_map) {
-  // NOTE: Allocating buffers each time this is called is slow. Cache them for speedup.
-//   Image<float> inv_depth_map(reference_camera.width(), reference_camera.height());
-//   Image<float> inv_depth_map_2(reference_camera.width(), reference_camera.height());
-  
-  Image<Vec2f> normals(reference_camera.width(), reference_camera.height());
-  Image<float> costs(reference_camera.width(), reference_camera.height());
-  Image<float> lambda(reference_camera.width(), reference_camera.height());
+  const int width = reference_camera.width();
+  const int height = reference_camera.height();
+  const usize thread_count = (thread_count_ > 0) ? thread_count_ : DefaultThreadCount();
+  const int patch_pixel_count = (2 * context_radius_ + 1) * (2 * context_radius_ + 1);
   
+  // The buffers are kept between calls to avoid re-allocating them.
+  normals_.SetSize(width, height);
+  costs_.SetSize(width, height);
   inv_depth_map->SetSize(reference_image.width(), reference_image.height());
   
-  Matrix<float, 3, 4> stereo_tr_reference = (stereo_image_tr_global * reference_image_tr_global.inverse()).matrix3x4();
+  // The pixels within context_radius_ of the image borders are not estimated,
+  // but read by the propagation. Mark them as invalid.
+  normals_.SetTo(Vec2f::Zero());
+  inv_depth_map->SetTo(0.f);
+  
+  // The unprojected reference pixels are needed for every patch cost
+  // evaluation. The table is kept as a member such that it is re-used for
+  // following calls with the same camera.
+  reference_unprojection_ = UnprojectionLookup2D::Get(reference_camera);
+  const Image<Vec2f>& unprojection = reference_unprojection_->lookup();
+  
+  const SE3f global_tr_reference = reference_image_tr_global.inverse();
+  aligned_vector<Matrix<float, 3, 4>> stereo_tr_reference(stereo_views.size());
+  vector<const CameraT2*> stereo_cameras(stereo_views.size());
+  vector<const Image<u8>*> stereo_images(stereo_views.size());
+  for (usize i = 0; i < stereo_views.size(); ++ i) {
+    stereo_tr_reference[i] = (stereo_views[i].image_tr_global * global_tr_reference).matrix3x4();
+    stereo_cameras[i] = static_cast<const CameraT2*>(stereo_views[i].camera);
+    stereo_images[i] = stereo_views[i].image;
+  }
+  
+  auto compute_costs = [&](int x, int y, const Vec2f& normal_xy, float inv_depth, float* stereo_values, float* view_costs) {
+    return ComputeMultiViewCosts(
+        x, y,
+        normal_xy,
+        inv_depth,
+        unprojection,
+        reference_image,
+        stereo_tr_reference,
+        stereo_cameras,
+        stereo_images,
+        context_radius_,
+        match_metric_,
+        best_view_count_,
+        stereo_values,
+        view_costs);
+  };
   
   // Initialize the depth and normals randomly, and compute initial matching costs.
-  for (u32 y = context_radius_; y < reference_camera.height() - context_radius_; ++ y) {
-    for (u32 x = context_radius_; x < reference_camera.width() - context_radius_; ++ x) {
-      // Initialize random initial normals
-      constexpr float kNormalRange = 0.5f;
-      Vec2f normal_xy;
-      normal_xy.x() = kNormalRange * ((0.0001f * (rand() % 10001)) - 0.5f);
-      normal_xy.y() = kNormalRange * ((0.0001f * (rand() % 10001)) - 0.5f);
-      float length = normal_xy.norm();
-      if (length > max_normal_2d_length_) {
-        normal_xy *= max_normal_2d_length_ / length;
+  ParallelForBlocks(context_radius_, height - context_radius_, thread_count, [&](usize /*block_index*/, usize block_begin, usize block_end) {
+    vector<float> stereo_values(patch_pixel_count);
+    vector<float> view_costs(stereo_views.size());
+    for (int y = block_begin; y < static_cast<int>(block_end); ++ y) {
+      PatchMatchRandom random(random_seed_, /*step*/ 0, y);
+      for (int x = context_radius_; x < width - context_radius_; ++ x) {
+        // Initialize random initial normals
+        constexpr float kNormalRange = 0.5f;
+        Vec2f normal_xy;
+        normal_xy.x() = kNormalRange * (random.Uniform01() - 0.5f);
+        normal_xy.y() = kNormalRange * (random.Uniform01() - 0.5f);
+        float length = normal_xy.norm();
+        if (length > max_normal_2d_length_) {
+          normal_xy *= max_normal_2d_length_ / length;
+        }
+        normals_(x, y) = normal_xy;
+        
+        // Initialize random initial depths
+        float inv_min_depth = 1.0f / min_initial_depth_;
+        float inv_max_depth = 1.0f / max_initial_depth_;
+        
+        const float inv_depth = inv_max_depth + (inv_min_depth - inv_max_depth) * random.Uniform01();
+        (*inv_depth_map)(x, y) = inv_depth;
+        
+        // Compute initial costs
+        costs_(x, y) = compute_costs(x, y, normal_xy, inv_depth, stereo_values.data(), view_costs.data());
       }
-      normals(x, y) = normal_xy;
-      
-      // Initialize random initial depths
-      float inv_min_depth = 1.0f / min_initial_depth_;
-      float inv_max_depth = 1.0f / max_initial_depth_;
-      
-      const float inv_depth = inv_max_depth + (inv_min_depth - inv_max_depth) * ((0.0001f * (rand() % 10001)));
-      (*inv_depth_map)(x, y) = inv_depth;
-      
-      // Initialize lambda
-      lambda(x, y) = 1.02f;  // TODO: tune
-      
-      // Compute initial costs
-      costs(x, y) = ComputeCosts(
-          x, y,
-          normal_xy,
-          inv_depth,
-          reference_camera,
-          reference_image,
-          stereo_tr_reference,
-          stereo_camera,
-          stereo_image,
-          inv_depth_map->width(),
-          inv_depth_map->height(),
-          context_radius_,
-          match_metric_);
     }
-  }
+  });
   
   // Perform PatchMatch iterations
   for (int iteration = 0; iteration < iteration_count_; ++ iteration) {
     float step_range = std::pow(0.5f, std::min(iteration + 1, 6 /*TODO: Make parameter*/)) * (1.0f / min_initial_depth_ - 1.0f / max_initial_depth_);
     
-//     // An imaginary diagonal with the dimensions (height x height) is shifted through the image.
-//     for (u32 row = 0; row < reference_camera.width() + reference_camera.height() - 1; ++ row) {
-//       int rowstart = std::max(0, static_cast<int>(reference_camera.height()) - 1 - static_cast<int>(row));
-//       int rowend = (row < reference_camera.width()) ? reference_camera.height() : (2 * reference_camera.width() - row - 1);
-//       for (int i = rowstart; i < rowend; ++ i) {
-//         int x = row + i - (static_cast<int>(reference_camera.height()) - 1);
-//         int y = reference_camera.height() - 1 - i;
-//         
-//         CHECK_GE(x, 0);
-//         CHECK_GE(y, 0);
-//         CHECK_LT(x, reference_camera.width());
-//         CHECK_LT(y, reference_camera.height());
+    VLOG(1) << "PatchMatch iteration " << iteration;
     
-//             if (x >= context_radius_ && y >= context_radius_ &&
-//             x < reference_camera.width() - context_radius_ && y < reference_camera.height() - context_radius_) {
-    
-    LOG(INFO) << "iteration " << iteration;
-    
-    bool even_iteration = iteration % 2 == 0;
-    for (int y = even_iteration ? context_radius_ : (reference_camera.height() - context_radius_ - 1);
-         y >= context_radius_ && y < static_cast<int>(reference_camera.height()) - context_radius_;
-         y += even_iteration ? 1 : -1) {
-      for (int x = even_iteration ? context_radius_ : (reference_camera.width() - context_radius_ - 1);
-           x >= context_radius_ && x < static_cast<int>(reference_camera.width()) - context_radius_;
-           x += even_iteration ? 1 : -1) {
-        // Attempt mutation.
-        float proposed_inv_depth = (*inv_depth_map)(x, y);
-        proposed_inv_depth =
-            max(kMinInvDepth,
-                fabs(proposed_inv_depth + step_range *
-                    ((0.0001f * (rand() % 10001)) - 0.5f)));
-        
-        constexpr float kRandomNormalRange = 0.5f;
-        Vec2f proposed_normal = normals(x, y);
-        proposed_normal.x() += kRandomNormalRange * ((0.0001f * (rand() % 10001)) - 0.5f);
-        proposed_normal.y() += kRandomNormalRange * ((0.0001f * (rand() % 10001)) - 0.5f);
-        float length = proposed_normal.norm();
-        if (length > max_normal_2d_length_) {
-          proposed_normal.x() *= max_normal_2d_length_ / length;
-          proposed_normal.y() *= max_normal_2d_length_ / length;
-        }
-        
-        // Test whether to accept the proposal
-        float proposal_costs = ComputeCosts(
-            x, y,
-            proposed_normal,
-            proposed_inv_depth,
-            reference_camera,
-            reference_image,
-            stereo_tr_reference,
-            stereo_camera,
-            stereo_image,
-            inv_depth_map->width(),
-            inv_depth_map->height(),
-            context_radius_,
-            match_metric_);
-        
-        if (!std::isnan(proposal_costs) && !(proposal_costs >= costs(x, y))) {
-          costs(x, y) = proposal_costs;
-          normals(x, y) = proposed_normal;
-          (*inv_depth_map)(x, y) = proposed_inv_depth;
-        }
-        
-        
-//         // Optimize locally.
-//         float inv_depth = (*inv_depth_map)(x, y);
-//         Vec2f normal_xy = normals(x, y);
-//         Vec2f nxy = reference_camera.UnprojectFromPixelCenterConv(Vec2i(x, y)).template cast<float>().template topRows<2>();
-//         
-//         // Gauss-Newton update equation coefficients.
-//         float H[3 + 2 + 1] = {0, 0, 0, 0, 0, 0};
-//         float b[3] = {0, 0, 0};
-//         
-//         #pragma unroll
-//         for (int dy = -context_radius_; dy <= context_radius_; ++ dy) {
-//           #pragma unroll
-//           for (int dx = -context_radius_; dx <= context_radius_; ++ dx) {
-//             float raw_residual;
-//             float jacobian[3];
+    // Checkerboard (red-black) scheme: the pixels are updated in two passes,
+    // each of which only updates the pixels with (x + y) % 2 == pass. Since
+    // propagation only reads the four direct neighbors of a pixel, which all
+    // have the other color, the pixels within a pass are independent and can
+    // be processed in parallel.
+    for (int pass = 0; pass < 2; ++ pass) {
+      ParallelForBlocks(context_radius_, height - context_radius_, thread_count, [&](usize /*block_index*/, usize block_begin, usize block_end) {
+        vector<float> stereo_values(patch_pixel_count);
+        vector<float> view_costs(stereo_views.size());
+        for (int y = block_begin; y < static_cast<int>(block_end); ++ y) {
+          PatchMatchRandom random(random_seed_, /*step*/ 1 + 2 * iteration + pass, y);
+          for (int x = context_radius_ + ((context_radius_ + y + pass) % 2); x < width - context_radius_; x += 2) {
+            // Attempt mutation.
+            float proposed_inv_depth = (*inv_depth_map)(x, y);
+            proposed_inv_depth =
+                max(kMinInvDepth,
+                    fabs(proposed_inv_depth + step_range *
+                        (random.Uniform01() - 0.5f)));
+            
+            constexpr float kRandomNormalRange = 0.5f;
+            Vec2f proposed_normal = normals_(x, y);
+            proposed_normal.x() += kRandomNormalRange * (random.Uniform01() - 0.5f);
+            proposed_normal.y() += kRandomNormalRange * (random.Uniform01() - 0.5f);
+            float length = proposed_normal.norm();
+            if (length > max_normal_2d_length_) {
+              proposed_normal.x() *= max_normal_2d_length_ / length;
+              proposed_normal.y() *= max_normal_2d_length_ / length;
+            }
+            
+            // Test whether to accept the proposal
+            float proposal_costs = compute_costs(
+                x, y, proposed_normal, proposed_inv_depth, stereo_values.data(), view_costs.data());
+            
+            if (!std::isnan(proposal_costs) && !(proposal_costs >= costs_(x, y))) {
+              costs_(x, y) = proposal_costs;
+              normals_(x, y) = proposed_normal;
+              (*inv_depth_map)(x, y) = proposed_inv_depth;
+            }
+            
+            
+//             // Optimize locally.
+//             float inv_depth = (*inv_depth_map)(x, y);
+//             Vec2f normal_xy = normals(x, y);
+//             Vec2f nxy = reference_camera.UnprojectFromPixelCenterConv(Vec2i(x, y)).template cast<float>().template topRows<2>();
 //             
-//             Vec2f other_nxy = reference_camera.UnprojectFromPixelCenterConv(Vec2i(x + dx, y + dy)).template cast<float>().template topRows<2>();
+//             // Gauss-Newton update equation coefficients.
+//             float H[3 + 2 + 1] = {0, 0, 0, 0, 0, 0};
+//             float b[3] = {0, 0, 0};
 //             
-//             ComputeResidualAndJacobian(
-//                 projector.cx - 0.5f, projector.cy - 0.5f, projector.fx, projector.fy,
-//                 inv_depth, normal_xy.x, normal_xy.y,
-//                 nxy.x, nxy.y,
-//                 other_nxy.x, other_nxy.y,
-//                 reference_image(y + dy, x + dx),
-//                 stereo_tr_reference.row0.x, stereo_tr_reference.row0.y, stereo_tr_reference.row0.z, stereo_tr_reference.row0.w,
-//                 stereo_tr_reference.row1.x, stereo_tr_reference.row1.y, stereo_tr_reference.row1.z, stereo_tr_reference.row1.w,
-//                 stereo_tr_reference.row2.x, stereo_tr_reference.row2.y, stereo_tr_reference.row2.z, stereo_tr_reference.row2.w,
-//                 stereo_image,
-//                 &raw_residual, jacobian);
+//             #pragma unroll
+//             for (int dy = -context_radius_; dy <= context_radius_; ++ dy) {
+//               #pragma unroll
+//               for (int dx = -context_radius_; dx <= context_radius_; ++ dx) {
+//                 float raw_residual;
+//                 float jacobian[3];
+//                 
+//                 Vec2f other_nxy = reference_camera.UnprojectFromPixelCenterConv(Vec2i(x + dx, y + dy)).template cast<float>().template topRows<2>();
+//                 
+//                 ComputeResidualAndJacobian(
+//                     projector.cx - 0.5f, projector.cy - 0.5f, projector.fx, projector.fy,
+//                     inv_depth, normal_xy.x, normal_xy.y,
+//                     nxy.x, nxy.y,
+//                     other_nxy.x, other_nxy.y,
+//                     reference_image(y + dy, x + dx),
+//                     stereo_tr_reference.row0.x, stereo_tr_reference.row0.y, stereo_tr_reference.row0.z, stereo_tr_reference.row0.w,
+//                     stereo_tr_reference.row1.x, stereo_tr_reference.row1.y, stereo_tr_reference.row1.z, stereo_tr_reference.row1.w,
+//                     stereo_tr_reference.row2.x, stereo_tr_reference.row2.y, stereo_tr_reference.row2.z, stereo_tr_reference.row2.w,
+//                     stereo_image,
+//                     &raw_residual, jacobian);
+//                 
+//                 // Accumulate
+//                 b[0] += raw_residual * jacobian[0];
+//                 b[1] += raw_residual * jacobian[1];
+//                 b[2] += raw_residual * jacobian[2];
+//                 
+//                 H[0] += jacobian[0] * jacobian[0];
+//                 H[1] += jacobian[0] * jacobian[1];
+//                 H[2] += jacobian[0] * jacobian[2];
+//                 
+//                 H[3] += jacobian[1] * jacobian[1];
+//                 H[4] += jacobian[1] * jacobian[2];
+//                 
+//                 H[5] += jacobian[2] * jacobian[2];
+//               }
+//             }
 //             
-//             // Accumulate
-//             b[0] += raw_residual * jacobian[0];
-//             b[1] += raw_residual * jacobian[1];
-//             b[2] += raw_residual * jacobian[2];
+//             /*// TEST: Optimize inv_depth only
+//             b[0] = b[0] / H[0];
+//             inv_depth -= b[0];*/
 //             
-//             H[0] += jacobian[0] * jacobian[0];
-//             H[1] += jacobian[0] * jacobian[1];
-//             H[2] += jacobian[0] * jacobian[2];
+//             // Levenberg-Marquardt
+//             const float kDiagLambda = lambda(x, y);
+//             H[0] *= kDiagLambda;
+//             H[3] *= kDiagLambda;
+//             H[5] *= kDiagLambda;
 //             
-//             H[3] += jacobian[1] * jacobian[1];
-//             H[4] += jacobian[1] * jacobian[2];
+//             // Solve for the update using Cholesky decomposition
+//             // (H[0]          )   (H[0] H[1] H[2])   (x[0])   (b[0])
+//             // (H[1] H[3]     ) * (     H[3] H[4]) * (x[1]) = (b[1])
+//             // (H[2] H[4] H[5])   (          H[5])   (x[2])   (b[2])
+//             H[0] = sqrtf(H[0]);
 //             
-//             H[5] += jacobian[2] * jacobian[2];
-//           }
-//         }
-//         
-//         /*// TEST: Optimize inv_depth only
-//         b[0] = b[0] / H[0];
-//         inv_depth -= b[0];*/
-//         
-//         // Levenberg-Marquardt
-//         const float kDiagLambda = lambda(x, y);
-//         H[0] *= kDiagLambda;
-//         H[3] *= kDiagLambda;
-//         H[5] *= kDiagLambda;
-//         
-//         // Solve for the update using Cholesky decomposition
-//         // (H[0]          )   (H[0] H[1] H[2])   (x[0])   (b[0])
-//         // (H[1] H[3]     ) * (     H[3] H[4]) * (x[1]) = (b[1])
-//         // (H[2] H[4] H[5])   (          H[5])   (x[2])   (b[2])
-//         H[0] = sqrtf(H[0]);
-//         
-//         H[1] = 1.f / H[0] * H[1];
-//         H[3] = sqrtf(H[3] - H[1] * H[1]);
-//         
-//         H[2] = 1.f / H[0] * H[2];
-//         H[4] = 1.f / H[3] * (H[4] - H[1] * H[2]);
-//         H[5] = sqrtf(H[5] - H[2] * H[2] - H[4] * H[4]);
-//         
-//         // Re-use b for the intermediate vector
-//         b[0] = (b[0] / H[0]);
-//         b[1] = (b[1] - H[1] * b[0]) / H[3];
-//         b[2] = (b[2] - H[2] * b[0] - H[4] * b[1]) / H[5];
-//         
-//         // Re-use b for the delta vector
-//         b[2] = (b[2] / H[5]);
-//         b[1] = (b[1] - H[4] * b[2]) / H[3];
-//         b[0] = (b[0] - H[1] * b[1] - H[2] * b[2]) / H[0];
-//         
-//         // Apply the update, sanitize normal if necessary
-//         inv_depth -= b[0];
-//         normal_xy.x -= b[1];
-//         normal_xy.y -= b[2];
-//         
-//         float length = sqrtf(normal_xy.x * normal_xy.x + normal_xy.y * normal_xy.y);
-//         if (length > max_normal_2d_length) {
-//           normal_xy.x *= max_normal_2d_length / length;
-//           normal_xy.y *= max_normal_2d_length / length;
-//         }
-//         
-//         // Test whether the update lowers the cost
-//         float proposal_costs = ComputeCosts<context_radius_>(
-//             x, y,
-//             normal_xy,
-//             inv_depth,
-//             unprojector,
-//             reference_image,
-//             stereo_tr_reference,
-//             projector,
-//             stereo_image,
-//             inv_depth_map.width(),
-//             inv_depth_map.height(),
-//             match_metric);
-//         
-//         if (!::isnan(proposal_costs) && !(proposal_costs >= costs(x, y))) {
-//           costs(x, y) = proposal_costs;
-//           normals(x, y) = make_char2(normal_xy.x * 127.f, normal_xy.y * 127.f);  // TODO: in this and similar places: rounding?
-//           inv_depth_map(x, y) = inv_depth;
-//           
-//           lambda(x, y) *= 0.5f;
-//         } else {
-//           lambda(x, y) *= 2.f;
-//         }
-        
-        // Attempt propagations ("pulling" the values inwards).
-        Vec2f nxy = reference_camera.UnprojectFromPixelCenterConv(Vec2i(x, y)).template cast<float>().template topRows<2>();
-        
-        for (int dy = -1; dy <= 1; ++ dy) {
-          for (int dx = -1; dx <= 1; ++ dx) {
-            if ((dx == 0 && dy == 0) ||
-                (dx != 0 && dy != 0)) {
-              continue;
-            }
+//             H[1] = 1.f / H[0] * H[1];
+//             H[3] = sqrtf(H[3] - H[1] * H[1]);
+//             
+//             H[2] = 1.f / H[0] * H[2];
+//             H[4] = 1.f / H[3] * (H[4] - H[1] * H[2]);
+//             H[5] = sqrtf(H[5] - H[2] * H[2] - H[4] * H[4]);
+//             
+//             // Re-use b for the intermediate vector
+//             b[0] = (b[0] / H[0]);
+//             b[1] = (b[1] - H[1] * b[0]) / H[3];
+//             b[2] = (b[2] - H[2] * b[0] - H[4] * b[1]) / H[5];
+//             
+//             // Re-use b for the delta vector
+//             b[2] = (b[2] / H[5]);
+//             b[1] = (b[1] - H[4] * b[2]) / H[3];
+//             b[0] = (b[0] - H[1] * b[1] - H[2] * b[2]) / H[0];
+//             
+//             // Apply the update, sanitize normal if necessary
+//             inv_depth -= b[0];
+//             normal_xy.x -= b[1];
+//             normal_xy.y -= b[2];
+//             
+//             float length = sqrtf(normal_xy.x * normal_xy.x + normal_xy.y * normal_xy.y);
+//             if (length > max_normal_2d_length) {
+//               normal_xy.x *= max_normal_2d_length / length;
+//               normal_xy.y *= max_normal_2d_length / length;
+//             }
+//             
+//             // Test whether the update lowers the cost
+//             float proposal_costs = ComputeCosts<context_radius_>(
+//                 x, y,
+//                 normal_xy,
+//                 inv_depth,
+//                 unprojector,
+//                 reference_image,
+//                 stereo_tr_reference,
+//                 projector,
+//                 stereo_image,
+//                 inv_depth_map.width(),
+//                 inv_depth_map.height(),
+//                 match_metric);
+//             
+//             if (!::isnan(proposal_costs) && !(proposal_costs >= costs(x, y))) {
+//               costs(x, y) = proposal_costs;
+//               normals(x, y) = make_char2(normal_xy.x * 127.f, normal_xy.y * 127.f);  // TODO: in this and similar places: rounding?
+//               inv_depth_map(x, y) = inv_depth;
+//               
+//               lambda(x, y) *= 0.5f;
+//             } else {
+//               lambda(x, y) *= 2.f;
+//             }
             
-            // Compute inv_depth for propagating the pixel at (x + dx, y + dy) to the center pixel.
-            Vec2f other_nxy = reference_camera.UnprojectFromPixelCenterConv(Vec2i(x + dx, y + dy)).template cast<float>().template topRows<2>();
+            // Attempt propagations ("pulling" the values inwards).
+            const Vec2f& nxy = unprojection(x, y);
             
-            float other_inv_depth = (*inv_depth_map)(x + dx, y + dy);
-            if (std::isnan(other_inv_depth)) {
-              continue;
+            for (int dy = -1; dy <= 1; ++ dy) {
+              for (int dx = -1; dx <= 1; ++ dx) {
+                if ((dx == 0 && dy == 0) ||
+                    (dx != 0 && dy != 0)) {
+                  continue;
+                }
+                
+                // Compute inv_depth for propagating the pixel at (x + dx, y + dy) to the center pixel.
+                const Vec2f& other_nxy = unprojection(x + dx, y + dy);
+                
+                float other_inv_depth = (*inv_depth_map)(x + dx, y + dy);
+                if (std::isnan(other_inv_depth)) {
+                  continue;
+                }
+                float other_depth = 1.f / other_inv_depth;
+                
+                Vec2f other_normal_xy = normals_(x + dx, y + dy);
+                float other_normal_z = -sqrtf(1.f - other_normal_xy.x() * other_normal_xy.x() - other_normal_xy.y() * other_normal_xy.y());
+                
+                float plane_d = (other_nxy.x() * other_depth) * other_normal_xy.x() + (other_nxy.y() * other_depth) * other_normal_xy.y() + other_depth * other_normal_z;
+                
+                float inv_depth = CalculatePlaneInvDepth2(plane_d, other_normal_xy, other_normal_z, nxy.x(), nxy.y());
+                
+                // Test whether to propagate
+                float proposal_costs = compute_costs(
+                    x, y, other_normal_xy, inv_depth, stereo_values.data(), view_costs.data());
+                
+                if (!std::isnan(proposal_costs) && !(proposal_costs >= costs_(x, y))) {
+                  costs_(x, y) = proposal_costs;
+                  normals_(x, y) = other_normal_xy;
+                  (*inv_depth_map)(x, y) = inv_depth;
+                }
+              }
             }
-            float other_depth = 1.f / other_inv_depth;
-            
-            Vec2f other_normal_xy = normals(x + dx, y + dy);
-            float other_normal_z = -sqrtf(1.f - other_normal_xy.x() * other_normal_xy.x() - other_normal_xy.y() * other_normal_xy.y());
-            
-            float plane_d = (other_nxy.x() * other_depth) * other_normal_xy.x() + (other_nxy.y() * other_depth) * other_normal_xy.y() + other_depth * other_normal_z;
-            
-            float inv_depth = CalculatePlaneInvDepth2(plane_d, other_normal_xy, other_normal_z, nxy.x(), nxy.y());
             
-            // Test whether to propagate
-            float proposal_costs = ComputeCosts(
-                x, y,
-                other_normal_xy,
-                inv_depth,
-                reference_camera,
-                reference_image,
-                stereo_tr_reference,
-                stereo_camera,
-                stereo_image,
-                inv_depth_map->width(),
-                inv_depth_map->height(),
-                context_radius_,
-                match_metric_);
-            
-            if (!std::isnan(proposal_costs) && !(proposal_costs >= costs(x, y))) {
-              costs(x, y) = proposal_costs;
-              normals(x, y) = other_normal_xy;
-              (*inv_depth_map)(x, y) = inv_depth;
-            }
+            // end of loop over all pixels
           }
         }
-        
-        // end of loop over all pixels
-      }
+      });
     }
     
 //     // DEBUG
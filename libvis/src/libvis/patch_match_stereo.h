@@ -34,10 +34,14 @@
 #include "libvis/image.h"
 #include "libvis/libvis.h"
 #include "libvis/sophus.h"
+#include "libvis/unprojection_lookup.h"
 
 namespace vis {
 
-// PatchMatch Stereo implementation for the CPU.
+// PatchMatch Stereo implementation for the CPU. The pixels are updated in a
+// checkerboard pattern, which allows to process them with multiple threads.
+// The random numbers are drawn from per-row streams derived from the random
+// seed, so the result only depends on the seed and not on the thread count.
 class PatchMatchStereoCPU {
  public:
   enum class MatchMetric {
@@ -50,6 +54,20 @@ class PatchMatchStereoCPU {
     kZNCC = 1
   };
   
+  // A stereo image for multi-view depth estimation.
+  struct StereoView {
+    StereoView() = default;
+    
+    inline StereoView(const Camera* camera, const Image<u8>* image, const SE3f& image_tr_global)
+        : camera(camera), image(image), image_tr_global(image_tr_global) {}
+    
+    const Camera* camera;
+    const Image<u8>* image;
+    SE3f image_tr_global;
+    
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+  
   PatchMatchStereoCPU(int width, int height);
   
   void ComputeDepthMap(
@@ -61,6 +79,19 @@ class PatchMatchStereoCPU {
       const SE3f& stereo_image_tr_global,
       Image<float>* inv_depth_map);
   
+  // Multi-view variant of ComputeDepthMap(). The matching cost of a plane
+  // hypothesis is the mean of the best_view_count() lowest costs among the
+  // stereo views which observe the whole patch, which makes the estimate
+  // robust against occlusions in individual views. All stereo views must use
+  // the same camera type. With a single stereo view, the result is the same as
+  // for the two-view variant.
+  void ComputeDepthMap(
+      const Camera& reference_camera,
+      const Image<u8>& reference_image,
+      const SE3f& reference_image_tr_global,
+      const aligned_vector<StereoView>& stereo_views,
+      Image<float>* inv_depth_map);
+  
   // PatchMatch stereo settings accessors
   inline MatchMetric match_metric() const { return match_metric_; }
   inline void SetMatchMetric(MatchMetric metric) { match_metric_ = metric; }
@@ -80,6 +111,9 @@ class PatchMatchStereoCPU {
   inline float max_normal_2d_length() const { return max_normal_2d_length_; }
   inline void SetMaxNormal2DLength(float length) { max_normal_2d_length_ = length; }
   
+  inline int best_view_count() const { return best_view_count_; }
+  inline void SetBestViewCount(int count) { best_view_count_ = count; }
+  
   // Outlier filtering settings accessors
   inline float min_patch_variance() const { return min_patch_variance_; }
   inline void SetMinPatchVariance(float threshold) { min_patch_variance_ = threshold; }
@@ -99,15 +133,22 @@ class PatchMatchStereoCPU {
   inline float required_range_max_depth() const { return required_range_max_depth_; }
   inline void SetRequiredRangeMaxDepth(float depth) { required_range_max_depth_ = depth; }
   
+  // Parallelization settings accessors. A thread count of 0 uses
+  // DefaultThreadCount().
+  inline int thread_count() const { return thread_count_; }
+  inline void SetThreadCount(int count) { thread_count_ = count; }
+  
+  inline u32 random_seed() const { return random_seed_; }
+  inline void SetRandomSeed(u32 seed) { random_seed_ = seed; }
+  
  private:
   template <class CameraT1, class CameraT2>
   void ComputeDepthMap_(
       const CameraT1& reference_camera,
       const Image<u8>& reference_image,
       const SE3f& reference_image_tr_global,
-      const CameraT2& stereo_camera,
-      const Image<u8>& stereo_image,
-      const SE3f& stereo_image_tr_global,
+      const CameraT2& first_stereo_camera,
+      const aligned_vector<StereoView>& stereo_views,
       Image<float>* inv_depth_map);
   
   inline bool DepthIsSimilar(float inv_depth_1, float inv_depth_2) {
@@ -138,6 +179,7 @@ class PatchMatchStereoCPU {
   float max_initial_depth_ = 20.0f;
   int iteration_count_ = 20;
   float max_normal_2d_length_ = 0.8f;
+  int best_view_count_ = 2;
   
   // Outlier filtering settings
   float min_patch_variance_ = 5 * 5;
@@ -146,6 +188,15 @@ class PatchMatchStereoCPU {
   float similar_depth_ratio_ = 1.025f;
   float required_range_min_depth_ = 1.5f;
   float required_range_max_depth_ = 3.0f;
+  
+  // Parallelization settings
+  int thread_count_ = 0;
+  u32 random_seed_ = 0;
+  
+  // Buffers which are kept between calls to ComputeDepthMap().
+  Image<Vec2f> normals_;
+  Image<float> costs_;
+  shared_ptr<const UnprojectionLookup2D> reference_unprojection_;
 };
 
 }
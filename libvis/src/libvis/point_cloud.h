@@ -29,7 +29,10 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstring>
 #include <fstream>
+#include <sstream>
 
 #include "libvis/logging.h"
 
@@ -157,6 +160,202 @@ struct CastEigenOrScalar<Eigen::Matrix<_Scalar, _Rows, _Cols, _Options, _MaxRows
 };
 
 
+/// Encoding of the point types into the binary .ply vertex format. Must have a
+/// specialization for each point type that is written as .ply.
+/// TODO: Make also work with other types than float positions and normals and
+///       uchar colors (the header written by PointCloudPLYWriter assumes these).
+template <typename PointT>
+struct PLYPointEncoding {};
+
+template<typename PositionT>
+struct PLYPointEncoding<Point<PositionT>> {
+  static constexpr usize kEncodedSize = 3 * sizeof(typename PositionT::Scalar);
+  
+  /// Writes the encoded point to dest and returns the pointer after it.
+  static inline u8* Encode(const Point<PositionT>& point, u8* dest) {
+    return EncodeVector3(point.position(), dest);
+  }
+  
+  template <typename VectorT>
+  static inline u8* EncodeVector3(const VectorT& vector, u8* dest) {
+    constexpr usize kScalarSize = sizeof(typename VectorT::Scalar);
+    memcpy(dest + 0 * kScalarSize, &vector.x(), kScalarSize);
+    memcpy(dest + 1 * kScalarSize, &vector.y(), kScalarSize);
+    memcpy(dest + 2 * kScalarSize, &vector.z(), kScalarSize);
+    return dest + 3 * kScalarSize;
+  }
+};
+
+template<typename PositionT, typename ColorT>
+struct PLYPointEncoding<PointC<PositionT, ColorT>> {
+  static constexpr usize kEncodedSize =
+      3 * sizeof(typename PositionT::Scalar) +
+      3 * sizeof(typename ColorT::Scalar);
+  
+  /// Writes the encoded point to dest and returns the pointer after it.
+  static inline u8* Encode(const PointC<PositionT, ColorT>& point, u8* dest) {
+    dest = PLYPointEncoding<Point<PositionT>>::EncodeVector3(point.position(), dest);
+    return PLYPointEncoding<Point<PositionT>>::EncodeVector3(point.color(), dest);
+  }
+};
+
+template<typename PositionT, typename ColorT, typename NormalT>
+struct PLYPointEncoding<PointCN<PositionT, ColorT, NormalT>> {
+  static constexpr usize kEncodedSize =
+      3 * sizeof(typename PositionT::Scalar) +
+      3 * sizeof(typename ColorT::Scalar) +
+      3 * sizeof(typename NormalT::Scalar);
+  
+  /// Writes the encoded point to dest and returns the pointer after it.
+  static inline u8* Encode(const PointCN<PositionT, ColorT, NormalT>& point, u8* dest) {
+    dest = PLYPointEncoding<Point<PositionT>>::EncodeVector3(point.position(), dest);
+    dest = PLYPointEncoding<Point<PositionT>>::EncodeVector3(point.color(), dest);
+    return PLYPointEncoding<Point<PositionT>>::EncodeVector3(point.normal(), dest);
+  }
+};
+
+
+/// Writes a point cloud in binary .ply format incrementally, without requiring
+/// the whole cloud to be present in memory. Points are encoded into a buffer
+/// and written in large blocks. Callers which produce the points themselves
+/// can also encode them directly (possibly in parallel) with
+/// PLYPointEncoding<PointT>::Encode() and pass the bytes to WriteEncoded().
+/// 
+/// If the point count is not known when opening the file, a placeholder is
+/// written into the header and patched in Close().
+/// 
+/// Usage:
+/// PointCloudPLYWriter<Point3fC3u8Nf> writer;
+/// writer.Open(path);
+/// writer.Write(points, count);  // as often as required
+/// writer.Close();
+template <typename PointT>
+class PointCloudPLYWriter {
+ public:
+  /// Value for the vertex_count parameter of Open() if the number of points is
+  /// not known in advance.
+  static constexpr usize kUnknownVertexCount = numeric_limits<usize>::max();
+  
+  /// Number of points which are encoded into the buffer before writing it.
+  static constexpr usize kBufferPointCount = 64 * 1024;
+  
+  PointCloudPLYWriter()
+      : file_(nullptr) {}
+  
+  ~PointCloudPLYWriter() {
+    if (file_) {
+      Close();
+    }
+  }
+  
+  /// Creates the file and writes the header. If vertex_count is given, exactly
+  /// this number of points must be written before calling Close().
+  bool Open(const char* path, usize vertex_count = kUnknownVertexCount) {
+    file_ = fopen(path, "wb");
+    if (!file_) {
+      return false;
+    }
+    
+    expected_vertex_count_ = vertex_count;
+    written_vertex_count_ = 0;
+    
+    std::ostringstream header;
+    header <<  "ply\n"
+               "format binary_little_endian 1.0\n"
+               "element vertex ";
+    vertex_count_offset_ = header.tellp();
+    if (vertex_count == kUnknownVertexCount) {
+      // Reserve enough space for any count. The trailing whitespace of the
+      // line is ignored by .ply readers.
+      header << string(kVertexCountFieldWidth, ' ') << "\n";
+    } else {
+      header << vertex_count << "\n";
+    }
+    
+    header << "property float x\n"
+              "property float y\n"
+              "property float z\n";
+    
+    if (PointTraits<PointT>::has_color) {
+      header << "property uchar red\n"
+                "property uchar green\n"
+                "property uchar blue\n";
+    }
+    
+    if (PointTraits<PointT>::has_normal) {
+      header << "property float nx\n"
+                "property float ny\n"
+                "property float nz\n";
+    }
+    
+    header << "end_header\n";
+    string header_string = header.str();
+    return fwrite(header_string.data(), 1, header_string.size(), file_) == header_string.size();
+  }
+  
+  /// Encodes and writes the given points.
+  bool Write(const PointT* points, usize count) {
+    const usize buffer_point_count = kBufferPointCount;
+    buffer_.resize(std::min(count, buffer_point_count) * kEncodedSize);
+    
+    for (usize start = 0; start < count; start += buffer_point_count) {
+      usize end = std::min(count, start + buffer_point_count);
+      u8* ptr = buffer_.data();
+      for (usize i = start; i < end; ++ i) {
+        ptr = PLYPointEncoding<PointT>::Encode(points[i], ptr);
+      }
+      if (!WriteEncoded(buffer_.data(), end - start)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  
+  /// Writes point_count points which have already been encoded with
+  /// PLYPointEncoding<PointT>::Encode() to data.
+  bool WriteEncoded(const u8* data, usize point_count) {
+    written_vertex_count_ += point_count;
+    return fwrite(data, kEncodedSize, point_count, file_) == point_count;
+  }
+  
+  /// Completes the header if the vertex count was not given to Open(), and
+  /// closes the file. Returns false if an error occurred.
+  bool Close() {
+    bool result = true;
+    if (expected_vertex_count_ == kUnknownVertexCount) {
+      string count_string = std::to_string(written_vertex_count_);
+      result &= fseek(file_, vertex_count_offset_, SEEK_SET) == 0;
+      result &= fwrite(count_string.data(), 1, count_string.size(), file_) == count_string.size();
+    } else if (expected_vertex_count_ != written_vertex_count_) {
+      LOG(ERROR) << "PointCloudPLYWriter: Announced " << expected_vertex_count_
+                 << " points in the header, but wrote " << written_vertex_count_;
+      result = false;
+    }
+    
+    result &= fclose(file_) == 0;
+    file_ = nullptr;
+    return result;
+  }
+  
+  /// Returns the number of points written so far.
+  inline usize written_vertex_count() const { return written_vertex_count_; }
+  
+  /// Size of one encoded point in the file in bytes.
+  static constexpr usize kEncodedSize = PLYPointEncoding<PointT>::kEncodedSize;
+  
+ private:
+  /// Number of characters reserved for the vertex count if it is not known
+  /// in advance. Sufficient for any 64-bit count.
+  static constexpr usize kVertexCountFieldWidth = 20;
+  
+  FILE* file_;
+  long vertex_count_offset_;
+  usize expected_vertex_count_;
+  usize written_vertex_count_;
+  vector<u8> buffer_;
+};
+
+
 /// Generic point cloud type, templated with the point type PointT, storing the
 /// points in CPU memory.
 /// 
@@ -349,15 +548,26 @@ class PointCloud {
     
     Resize(point_count);
     
-    // Create the points.
+    // Create the points. The directions are unprojected one row at a time with
+    // the batch camera API.
+    vector<float> row_x(depth_image.width());
+    vector<float> row_y(depth_image.width());
+    vector<float> nx(depth_image.width());
+    vector<float> ny(depth_image.width());
+    for (u32 x = 0; x < depth_image.width(); ++ x) {
+      row_x[x] = x;
+    }
     point_count = 0;
     for (u32 y = 0; y < depth_image.height(); ++ y) {
+      std::fill(row_y.begin(), row_y.end(), static_cast<float>(y));
+      camera.UnprojectPointsFromPixelCenterConv(depth_image.width(), row_x.data(), row_y.data(), nx.data(), ny.data());
+      
       const DepthT* ptr = depth_image.row(y);
       for (u32 x = 0; x < depth_image.width(); ++ x) {
         if (*ptr != invalid_depth_value) {
           data_[point_count].position() =
               (depth_is_inverse ? (1.f / *ptr) : *ptr) *
-              camera.UnprojectFromPixelCenterConv(Vec2f(x, y)).template cast<typename PositionT::Scalar>();
+              Vec3f(nx[x], ny[x], 1.f).template cast<typename PositionT::Scalar>();
           ++ point_count;
         }
         ++ ptr;
@@ -392,16 +602,27 @@ class PointCloud {
     
     Resize(point_count);
     
-    // Create the points.
+    // Create the points. The directions are unprojected one row at a time with
+    // the batch camera API.
+    vector<float> row_x(depth_image.width());
+    vector<float> row_y(depth_image.width());
+    vector<float> nx(depth_image.width());
+    vector<float> ny(depth_image.width());
+    for (u32 x = 0; x < depth_image.width(); ++ x) {
+      row_x[x] = x;
+    }
     point_count = 0;
     for (u32 y = 0; y < depth_image.height(); ++ y) {
+      std::fill(row_y.begin(), row_y.end(), static_cast<float>(y));
+      camera.UnprojectPointsFromPixelCenterConv(depth_image.width(), row_x.data(), row_y.data(), nx.data(), ny.data());
+      
       const DepthT* d_ptr = depth_image.row(y);
       const ColorT* rgb_ptr = color_image.row(y);
       for (u32 x = 0; x < depth_image.width(); ++ x) {
         if (*d_ptr != invalid_depth_value) {
           data_[point_count].position() =
               (depth_is_inverse ? (1.f / *d_ptr) : *d_ptr) *
-              camera.UnprojectFromPixelCenterConv(Vec2f(x, y)).template cast<typename PositionT::Scalar>();
+              Vec3f(nx[x], ny[x], 1.f).template cast<typename PositionT::Scalar>();
           data_[point_count].color() =
               CastEigenOrScalar<ColorT>().template Cast<typename PointTraits<PointT>::ColorT>(*rgb_ptr);
           ++ point_count;
@@ -491,45 +712,12 @@ class PointCloud {
   /// Saves the point cloud in .ply format (in its binary variant). Returns true
   /// if successful.
   bool WriteAsPLY(const char* path) {
-    FILE* file = fopen(path, "wb");
-    if (!file) {
+    PointCloudPLYWriter<PointT> writer;
+    if (!writer.Open(path, size())) {
       return false;
     }
-    
-    // Write header
-    std::ostringstream header;  // TODO: Use something faster than ostringstream?
-    header <<  "ply\n"
-               "format binary_little_endian 1.0\n"
-               "element vertex " << size() << "\n";
-    
-    // TODO: Make also work with other types than float
-    header << "property float x\n"
-              "property float y\n"
-              "property float z\n";
-    
-    if (PointTraits<PointT>::has_color) {
-      // TODO: Make also work with other types than uchar
-      header << "property uchar red\n"
-                "property uchar green\n"
-                "property uchar blue\n";
-    }
-    
-    if (PointTraits<PointT>::has_normal) {
-      // TODO: Make also work with other types than float
-      header << "property float nx\n"
-                "property float ny\n"
-                "property float nz\n";
-    }
-    
-    header << "end_header\n";
-    string header_string = header.str();
-    fwrite(header_string.data(), 1, header_string.size(), file);
-    
-    // Write points
-    WriteAsPLYHelper(file, *this);
-    
-    fclose(file);
-    return true;
+    bool result = writer.Write(data_, size_);
+    return writer.Close() && result;
   }
   
   /// Returns the i-th point in the cloud.
@@ -560,7 +748,7 @@ class PointCloud {
       *stream << "v " << point.position().x()
               << " " << point.position().y()
               << " " << point.position().z()
-              << std::endl;
+              << '\n';
     }
   }
   
@@ -577,7 +765,7 @@ class PointCloud {
               << " " << (kNormalizationFactor * point.color().x())
               << " " << (kNormalizationFactor * point.color().y())
               << " " << (kNormalizationFactor * point.color().z())
-              << std::endl;
+              << '\n';
     }
   }
   
@@ -602,50 +790,7 @@ class PointCloud {
               << " " << (kNormalizationFactor * point.color().x())
               << " " << (kNormalizationFactor * point.color().y())
               << " " << (kNormalizationFactor * point.color().z())
-              << std::endl;
-    }
-  }
-  
-  
-  template<typename PositionT>
-  static void WriteAsPLYHelper(FILE* file, const PointCloud<Point<PositionT>>& cloud) {
-    for (usize i = 0; i < cloud.size(); ++ i) {
-      const PointT& point = cloud.data_[i];
-      
-      fwrite(&point.position().x(), sizeof(typename PositionT::Scalar), 1, file);
-      fwrite(&point.position().y(), sizeof(typename PositionT::Scalar), 1, file);
-      fwrite(&point.position().z(), sizeof(typename PositionT::Scalar), 1, file);
-    }
-  }
-  
-  template<typename PositionT, typename ColorT>
-  static void WriteAsPLYHelper(FILE* file, const PointCloud<PointC<PositionT, ColorT>>& cloud) {
-    for (usize i = 0; i < cloud.size(); ++ i) {
-      const PointT& point = cloud.data_[i];
-      
-      fwrite(&point.position().x(), sizeof(typename PositionT::Scalar), 1, file);
-      fwrite(&point.position().y(), sizeof(typename PositionT::Scalar), 1, file);
-      fwrite(&point.position().z(), sizeof(typename PositionT::Scalar), 1, file);
-      fwrite(&point.color().x(), sizeof(typename ColorT::Scalar), 1, file);
-      fwrite(&point.color().y(), sizeof(typename ColorT::Scalar), 1, file);
-      fwrite(&point.color().z(), sizeof(typename ColorT::Scalar), 1, file);
-    }
-  }
-  
-  template<typename PositionT, typename ColorT, typename NormalT>
-  static void WriteAsPLYHelper(FILE* file, const PointCloud<PointCN<PositionT, ColorT, NormalT>>& cloud) {
-    for (usize i = 0; i < cloud.size(); ++ i) {
-      const PointT& point = cloud.data_[i];
-      
-      fwrite(&point.position().x(), sizeof(typename PositionT::Scalar), 1, file);
-      fwrite(&point.position().y(), sizeof(typename PositionT::Scalar), 1, file);
-      fwrite(&point.position().z(), sizeof(typename PositionT::Scalar), 1, file);
-      fwrite(&point.color().x(), sizeof(typename ColorT::Scalar), 1, file);
-      fwrite(&point.color().y(), sizeof(typename ColorT::Scalar), 1, file);
-      fwrite(&point.color().z(), sizeof(typename ColorT::Scalar), 1, file);
-      fwrite(&point.normal().x(), sizeof(typename NormalT::Scalar), 1, file);
-      fwrite(&point.normal().y(), sizeof(typename NormalT::Scalar), 1, file);
-      fwrite(&point.normal().z(), sizeof(typename NormalT::Scalar), 1, file);
+              << '\n';
     }
   }
   
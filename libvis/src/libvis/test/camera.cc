@@ -101,6 +101,99 @@ void TestUnprojectProjectIsIdentity(const CameraT& test_camera) {
   }
 }
 
+
+template <class CameraT>
+void TestBatchMatchesSinglePoint(const CameraT& test_camera) {
+  typedef typename CameraT::ScalarT Scalar;
+  constexpr float kEpsilon = 1e-4;
+  constexpr usize kCount = 37;
+  
+  vector<float> px(kCount);
+  vector<float> py(kCount);
+  for (usize i = 0; i < kCount; ++ i) {
+    px[i] = -3 + (test_camera.width() + 6) * (i / (kCount - 1.f));
+    py[i] = 0.37f * (i * 13 % test_camera.height());
+  }
+  
+  // Unprojection, once via the derived type and once via the Camera base class.
+  vector<float> nx(kCount);
+  vector<float> ny(kCount);
+  test_camera.UnprojectPointsFromPixelCenterConv(kCount, px.data(), py.data(), nx.data(), ny.data());
+  vector<float> base_nx(kCount);
+  vector<float> base_ny(kCount);
+  static_cast<const Camera&>(test_camera).UnprojectPointsFromPixelCenterConv(kCount, px.data(), py.data(), base_nx.data(), base_ny.data());
+  for (usize i = 0; i < kCount; ++ i) {
+    Matrix<Scalar, 3, 1> direction = test_camera.UnprojectFromPixelCenterConv(Matrix<Scalar, 2, 1>(px[i], py[i]));
+    EXPECT_NEAR(direction.x() / direction.z(), nx[i], kEpsilon);
+    EXPECT_NEAR(direction.y() / direction.z(), ny[i], kEpsilon);
+    EXPECT_EQ(nx[i], base_nx[i]);
+    EXPECT_EQ(ny[i], base_ny[i]);
+  }
+  
+  // Projection of points at varying depths, including some behind the camera.
+  vector<float> x(kCount);
+  vector<float> y(kCount);
+  vector<float> z(kCount);
+  for (usize i = 0; i < kCount; ++ i) {
+    z[i] = (i % 7 == 0) ? -1.5f : (0.5f + 0.1f * i);
+    x[i] = z[i] * nx[i];
+    y[i] = z[i] * ny[i];
+  }
+  vector<float> projected_x(kCount);
+  vector<float> projected_y(kCount);
+  test_camera.ProjectPointsToPixelCornerConv(kCount, x.data(), y.data(), z.data(), projected_x.data(), projected_y.data());
+  vector<float> visible_x(kCount);
+  vector<float> visible_y(kCount);
+  vector<u8> visible(kCount);
+  static_cast<const Camera&>(test_camera).ProjectPointsToPixelCornerConvIfVisible(
+      kCount, x.data(), y.data(), z.data(), /*pixel_border*/ 0, visible_x.data(), visible_y.data(), visible.data());
+  for (usize i = 0; i < kCount; ++ i) {
+    Matrix<Scalar, 3, 1> point(x[i], y[i], z[i]);
+    Matrix<Scalar, 2, 1> pixel = test_camera.ProjectToPixelCornerConv(point);
+    EXPECT_NEAR(pixel.x(), projected_x[i], kEpsilon);
+    EXPECT_NEAR(pixel.y(), projected_y[i], kEpsilon);
+    
+    Matrix<Scalar, 2, 1> visible_pixel;
+    bool is_visible = test_camera.ProjectToPixelCornerConvIfVisible(point, /*pixel_border*/ 0, &visible_pixel);
+    EXPECT_EQ(is_visible ? 1 : 0, visible[i]);
+    if (is_visible) {
+      EXPECT_NEAR(visible_pixel.x(), visible_x[i], kEpsilon);
+      EXPECT_NEAR(visible_pixel.y(), visible_y[i], kEpsilon);
+    } else {
+      EXPECT_TRUE(std::isnan(visible_x[i]));
+      EXPECT_TRUE(std::isnan(visible_y[i]));
+    }
+  }
+  
+  // The Ratio convention, via the Camera base class.
+  vector<float> ratio_x(kCount);
+  vector<float> ratio_y(kCount);
+  vector<u8> ratio_visible(kCount);
+  static_cast<const Camera&>(test_camera).ProjectPointsToRatioConvIfVisible(
+      kCount, x.data(), y.data(), z.data(), /*pixel_border*/ 0, ratio_x.data(), ratio_y.data(), ratio_visible.data());
+  vector<float> ratio_nx(kCount);
+  vector<float> ratio_ny(kCount);
+  static_cast<const Camera&>(test_camera).UnprojectPointsFromRatioConv(kCount, ratio_x.data(), ratio_y.data(), ratio_nx.data(), ratio_ny.data());
+  for (usize i = 0; i < kCount; ++ i) {
+    Matrix<Scalar, 2, 1> ratio_pixel;
+    bool is_visible = test_camera.ProjectToRatioConvIfVisible(Matrix<Scalar, 3, 1>(x[i], y[i], z[i]), /*pixel_border*/ 0, &ratio_pixel);
+    EXPECT_EQ(is_visible ? 1 : 0, ratio_visible[i]);
+    if (is_visible) {
+      EXPECT_NEAR(ratio_pixel.x(), ratio_x[i], kEpsilon);
+      EXPECT_NEAR(ratio_pixel.y(), ratio_y[i], kEpsilon);
+      EXPECT_NEAR(nx[i], ratio_nx[i], kEpsilon);
+      EXPECT_NEAR(ny[i], ratio_ny[i], kEpsilon);
+    }
+  }
+  
+  // In-place operation.
+  test_camera.ProjectPointsToPixelCornerConv(kCount, x.data(), y.data(), z.data(), x.data(), y.data());
+  for (usize i = 0; i < kCount; ++ i) {
+    EXPECT_EQ(projected_x[i], x[i]);
+    EXPECT_EQ(projected_y[i], y[i]);
+  }
+}
+
 }
 
 // Tests that unprojection followed by projection equals the identity function.
@@ -128,3 +221,18 @@ TEST(Camera, IdentityScaling) {
   EXPECT_FLOAT_EQ(test_camera.parameters()[3], scaled_camera->parameters()[3]);
   delete scaled_camera;
 }
+
+// Tests that the batch projection functions match the single-point versions.
+TEST(Camera, BatchMatchesSinglePoint) {
+  float pinhole_parameters[4] = {120, 121, 119.5, 118.5};  // fx, fy, cx, cy.
+  PinholeCamera4f pinhole_camera(240, 240, pinhole_parameters);
+  TestBatchMatchesSinglePoint(pinhole_camera);
+  
+  double radtan_parameters[8] = {0.05, -0.01, 0.002, -0.001, 120, 121, 119.5, 118.5};
+  RadtanCamera8d radtan_camera(240, 240, radtan_parameters);
+  TestBatchMatchesSinglePoint(radtan_camera);
+  
+  double thin_prism_fisheye_parameters[12] = {0.01, 0.02, -0.024, 0.003, 0.002, -0.001, 0.005, -0.006, 120, 120, 120, 120};
+  ThinPrismFisheyeCamera12d thin_prism_fisheye_camera(240, 240, thin_prism_fisheye_parameters);
+  TestBatchMatchesSinglePoint(thin_prism_fisheye_camera);
+}
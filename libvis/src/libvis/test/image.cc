@@ -27,6 +27,8 @@
 // POSSIBILITY OF SUCH DAMAGE.
 
 
+#include <random>
+
 #include "libvis/logging.h"
 #include <gtest/gtest.h>
 
@@ -149,6 +151,240 @@ TEST(Image, DownscaleToHalfSize) {
   EXPECT_TRUE(image_result_expected == image_result);
 }
 
+namespace {
+// Fills the image with deterministic pseudo-random values in [0, max_value].
+template <typename T>
+void SetToRandomValues(int max_value, Image<T>* image) {
+  std::mt19937 generator(42);
+  std::uniform_int_distribution<int> distribution(0, max_value);
+  for (u32 y = 0; y < image->height(); ++ y) {
+    for (u32 x = 0; x < image->width(); ++ x) {
+      (*image)(x, y) = distribution(generator);
+    }
+  }
+}
+
+template <typename T>
+void ExpectCorrectlyRoundedHalfSize(const Image<T>& image) {
+  Image<T> result;
+  image.DownscaleToHalfSize(&result);
+  ASSERT_EQ(image.width() / 2, result.width());
+  ASSERT_EQ(image.height() / 2, result.height());
+  for (u32 y = 0; y < result.height(); ++ y) {
+    for (u32 x = 0; x < result.width(); ++ x) {
+      u64 sum = static_cast<u64>(image(2 * x, 2 * y)) + image(2 * x + 1, 2 * y) +
+                image(2 * x, 2 * y + 1) + image(2 * x + 1, 2 * y + 1);
+      ASSERT_EQ((sum + 2) / 4, result(x, y)) << "at " << x << ", " << y;
+    }
+  }
+}
+}
+
+// Tests that downscaling to half size rounds integer averages correctly, also
+// for widths which are not a multiple of the SIMD width and for images which
+// are large enough to be processed in parallel.
+TEST(Image, DownscaleToHalfSizeRounding) {
+  u8 small_values_data[] = {
+      1, 1, 2, 3, 3, 2,
+      1, 0, 2, 3, 3, 3};
+  Image<u8> small_values(6, 2, small_values_data);
+  Image<u8> small_values_result;
+  small_values.DownscaleToHalfSize(&small_values_result);
+  EXPECT_EQ(1, small_values_result(0, 0));
+  EXPECT_EQ(3, small_values_result(1, 0));
+  EXPECT_EQ(3, small_values_result(2, 0));
+  
+  for (u32 width : {6u, 38u, 1024u}) {
+    u32 height = (width == 1024) ? 640 : 6;
+    
+    Image<u8> image_u8(width, height);
+    SetToRandomValues(255, &image_u8);
+    ExpectCorrectlyRoundedHalfSize(image_u8);
+    
+    Image<u16> image_u16(width, height);
+    SetToRandomValues(65535, &image_u16);
+    ExpectCorrectlyRoundedHalfSize(image_u16);
+    
+    Image<u32> image_u32(width, height);
+    SetToRandomValues(1000000, &image_u32);
+    ExpectCorrectlyRoundedHalfSize(image_u32);
+    
+    Image<Vec3u8> image_Vec3u8(width, height);
+    for (u32 y = 0; y < height; ++ y) {
+      for (u32 x = 0; x < width; ++ x) {
+        image_Vec3u8(x, y) = Vec3u8(image_u8(x, y), 255 - image_u8(x, y), image_u16(x, y) & 0xff);
+      }
+    }
+    Image<Vec3u8> result_Vec3u8;
+    image_Vec3u8.DownscaleToHalfSize(&result_Vec3u8);
+    for (int c = 0; c < 3; ++ c) {
+      Image<u8> channel(width, height);
+      Image<u8> result_channel;
+      for (u32 y = 0; y < height; ++ y) {
+        for (u32 x = 0; x < width; ++ x) {
+          channel(x, y) = image_Vec3u8(x, y)(c);
+        }
+      }
+      channel.DownscaleToHalfSize(&result_channel);
+      for (u32 y = 0; y < result_Vec3u8.height(); ++ y) {
+        for (u32 x = 0; x < result_Vec3u8.width(); ++ x) {
+          ASSERT_EQ(result_channel(x, y), result_Vec3u8(x, y)(c));
+        }
+      }
+    }
+    
+    Image<float> image_float(width, height);
+    SetToRandomValues(1000, &image_float);
+    Image<float> result_float;
+    image_float.DownscaleToHalfSize(&result_float);
+    for (u32 y = 0; y < result_float.height(); ++ y) {
+      for (u32 x = 0; x < result_float.width(); ++ x) {
+        ASSERT_EQ(0.25f * (image_float(2 * x, 2 * y) + image_float(2 * x + 1, 2 * y) +
+                           image_float(2 * x, 2 * y + 1) + image_float(2 * x + 1, 2 * y + 1)),
+                  result_float(x, y));
+      }
+    }
+  }
+}
+
+// Tests median downscaling against sorting all values of each output pixel.
+TEST(Image, DownscaleUsingMedian) {
+  Image<u16> image(64, 48);
+  SetToRandomValues(20, &image);  // Use a small range to get many ties.
+  
+  Image<u16> result;
+  Image<u16> result_excluding;
+  image.DownscaleUsingMedian(20, 15, &result);
+  image.DownscaleUsingMedianWhileExcluding(0, 20, 15, &result_excluding);
+  for (u32 y = 0; y < result.height(); ++ y) {
+    for (u32 x = 0; x < result.width(); ++ x) {
+      for (bool excluding : {false, true}) {
+        vector<u16> values;
+        float sum = 0;
+        for (u32 oy = (48 * y) / 15; oy < (48 * (y + 1)) / 15; ++ oy) {
+          for (u32 ox = (64 * x) / 20; ox < (64 * (x + 1)) / 20; ++ ox) {
+            if (!excluding || image(ox, oy) != 0) {
+              values.push_back(image(ox, oy));
+              sum += image(ox, oy);
+            }
+          }
+        }
+        u16 expected = 0;
+        if (!values.empty()) {
+          std::sort(values.begin(), values.end());
+          float average = sum / values.size();
+          const u16 low_value = values[(values.size() - 1) / 2];
+          const u16 high_value = values[values.size() / 2];
+          expected = (fabs(average - low_value) < fabs(average - high_value)) ? low_value : high_value;
+        }
+        EXPECT_EQ(expected, excluding ? result_excluding(x, y) : result(x, y));
+      }
+    }
+  }
+}
+
+namespace {
+// Straightforward version of Image::BilateralFilter() which evaluates all
+// weights per sample.
+template <typename T>
+void ReferenceBilateralFilter(const Image<T>& image, float sigma_xy, const T sigma_value,
+                              const T value_to_ignore, float radius_factor, Image<T>* result) {
+  result->SetSizeToMatch(image);
+  int radius = radius_factor * sigma_xy + 0.5f;
+  float denom_xy = 2.0f * sigma_xy * sigma_xy;
+  T denom_value = 2.0f * sigma_value * sigma_value;
+  for (int y = 0; y < static_cast<int>(image.height()); ++ y) {
+    for (int x = 0; x < static_cast<int>(image.width()); ++ x) {
+      T center_value = image(x, y);
+      if (center_value == value_to_ignore) {
+        (*result)(x, y) = value_to_ignore;
+        continue;
+      }
+      float sum = 0;
+      float weight = 0;
+      for (int sample_y = std::max(0, y - radius); sample_y <= std::min<int>(image.height() - 1, y + radius); ++ sample_y) {
+        for (int sample_x = std::max(0, x - radius); sample_x <= std::min<int>(image.width() - 1, x + radius); ++ sample_x) {
+          int grid_distance_squared = (sample_x - x) * (sample_x - x) + (sample_y - y) * (sample_y - y);
+          T sample = image(sample_x, sample_y);
+          if (grid_distance_squared > radius * radius || sample == value_to_ignore) {
+            continue;
+          }
+          float value_distance_squared = center_value - sample;
+          value_distance_squared *= value_distance_squared;
+          float w = exp(-grid_distance_squared / denom_xy) *
+                    exp(-value_distance_squared / denom_value);
+          sum += w * sample;
+          weight += w;
+        }
+      }
+      (*result)(x, y) = (weight == 0) ? value_to_ignore : static_cast<T>(sum / weight);
+    }
+  }
+}
+}
+
+// Tests the bilateral filter against the reference implementation. The image
+// is large enough to be processed in parallel.
+TEST(Image, BilateralFilter) {
+  Image<u8> image_u8(200, 120);
+  SetToRandomValues(255, &image_u8);
+  Image<u8> result_u8;
+  Image<u8> expected_u8;
+  image_u8.BilateralFilter(2.f, 10, 0, 2.f, &result_u8);
+  ReferenceBilateralFilter<u8>(image_u8, 2.f, 10, 0, 2.f, &expected_u8);
+  EXPECT_TRUE(expected_u8 == result_u8);
+  
+  Image<u16> image_u16(200, 120);
+  SetToRandomValues(2000, &image_u16);
+  Image<u16> result_u16;
+  Image<u16> expected_u16;
+  image_u16.BilateralFilter(2.f, 100, 0, 2.f, &result_u16);
+  ReferenceBilateralFilter<u16>(image_u16, 2.f, 100, 0, 2.f, &expected_u16);
+  EXPECT_TRUE(expected_u16 == result_u16);
+  
+  Image<float> image_float(200, 120);
+  SetToRandomValues(2000, &image_float);
+  Image<float> result_float;
+  Image<float> expected_float;
+  image_float.BilateralFilter(1.5f, 200.f, 0.f, 3.f, &result_float);
+  ReferenceBilateralFilter<float>(image_float, 1.5f, 200.f, 0.f, 3.f, &expected_float);
+  EXPECT_TRUE(expected_float == result_float);
+}
+
+// Tests the integral image against direct summation.
+TEST(Image, ComputeIntegralImage) {
+  Image<u8> image(37, 23);
+  SetToRandomValues(255, &image);
+  Image<u32> integral_image;
+  image.ComputeIntegralImage(&integral_image);
+  for (u32 y = 0; y < image.height(); ++ y) {
+    for (u32 x = 0; x < image.width(); ++ x) {
+      u32 sum = 0;
+      for (u32 sy = 0; sy <= y; ++ sy) {
+        for (u32 sx = 0; sx <= x; ++ sx) {
+          sum += image(sx, sy);
+        }
+      }
+      ASSERT_EQ(sum, integral_image(x, y));
+    }
+  }
+  EXPECT_EQ(image(3, 4) + image(4, 4) + image(3, 5) + image(4, 5),
+            integral_image.AccessIntegralImage(3, 4, 4, 5));
+}
+
+// Tests grayscale conversion.
+TEST(Image, ConvertToGrayscale) {
+  Image<Vec3u8> image(3, 1);
+  image(0, 0) = Vec3u8(255, 0, 0);
+  image(1, 0) = Vec3u8(0, 255, 0);
+  image(2, 0) = Vec3u8(10, 20, 30);
+  Image<float> gray;
+  image.ConvertToGrayscale(&gray);
+  EXPECT_FLOAT_EQ(0.299f * 255, gray(0, 0));
+  EXPECT_FLOAT_EQ(0.587f * 255, gray(1, 0));
+  EXPECT_FLOAT_EQ(0.299f * 10 + 0.587f * 20 + 0.114f * 30, gray(2, 0));
+}
+
 // Tests average calculation.
 TEST(Image, CalcAverage) {
   u32 image_data[] = {
@@ -27,6 +27,9 @@
 // POSSIBILITY OF SUCH DAMAGE.
 
 
+#include <atomic>
+#include <thread>
+
 #include "libvis/logging.h"
 #include <gtest/gtest.h>
 
@@ -55,3 +58,226 @@ TEST(ImageCache, ImagePyramid) {
       ImagePyramid(&image_cache, 2).GetOrComputeResult();
   EXPECT_EQ(pyramid_image.get(), pyramid_image_2.get());
 }
+
+// Verifies that computing a pyramid level also caches the intermediate
+// levels, such that they are shared with later requests.
+TEST(ImageCache, ImagePyramidIntermediateLevels) {
+  shared_ptr<Image<u8>> image(new Image<u8>(32, 16));
+  image->SetTo(42);
+  
+  ImageCache<u8> image_cache(image);
+  shared_ptr<Image<u8>> level_2 = ImagePyramid(&image_cache, 2).GetOrComputeResult();
+  
+  ImageCacheResult<u8> level_1_result = ImagePyramid(&image_cache, 1);
+  usize bytes_before = image_cache.cached_bytes();
+  shared_ptr<Image<u8>> level_1 = level_1_result.GetOrComputeResult();
+  EXPECT_EQ(32u / 2, level_1->width());
+  EXPECT_EQ(bytes_before, image_cache.cached_bytes());
+  
+  // Chaining from level 1 refers to the same image as requesting level 2.
+  EXPECT_EQ(level_2.get(), ImagePyramid(level_1_result, 1).GetOrComputeResult().get());
+  EXPECT_EQ(image.get(), ImagePyramid(&image_cache, 0).GetOrComputeResult().get());
+}
+
+// Verifies that derived images are identified by the operation parameters and
+// that operations can be chained.
+TEST(ImageCache, OperationParameters) {
+  shared_ptr<Image<u8>> image(new Image<u8>(32, 16));
+  image->SetTo(42);
+  (*image)(0, 0) = 200;
+  
+  ImageCache<u8> image_cache(image);
+  shared_ptr<Image<u8>> cutoff_100 = MaxCutoff<u8>(&image_cache, 100, 0).GetOrComputeResult();
+  shared_ptr<Image<u8>> cutoff_100_1 = MaxCutoff<u8>(&image_cache, 100, 1).GetOrComputeResult();
+  shared_ptr<Image<u8>> cutoff_250 = MaxCutoff<u8>(&image_cache, 250, 0).GetOrComputeResult();
+  EXPECT_NE(cutoff_100.get(), cutoff_100_1.get());
+  EXPECT_NE(cutoff_100.get(), cutoff_250.get());
+  EXPECT_EQ(cutoff_100.get(), MaxCutoff<u8>(&image_cache, 100, 0).GetOrComputeResult().get());
+  EXPECT_EQ(0, (*cutoff_100)(0, 0));
+  EXPECT_EQ(1, (*cutoff_100_1)(0, 0));
+  EXPECT_EQ(200, (*cutoff_250)(0, 0));
+  EXPECT_EQ(42, (*cutoff_100)(1, 0));
+  
+  shared_ptr<Image<u8>> cutoff_pyramid =
+      ImagePyramid(MaxCutoff<u8>(&image_cache, 100, 0), 1).GetOrComputeResult();
+  EXPECT_EQ(32u / 2, cutoff_pyramid->width());
+  EXPECT_NE(ImagePyramid(&image_cache, 1).GetOrComputeResult().get(), cutoff_pyramid.get());
+}
+
+// Verifies that derived images exceeding kImageCacheMaxDerivedImages are
+// computed without being cached.
+TEST(ImageCache, DerivedImageTableFull) {
+  shared_ptr<Image<u8>> image(new Image<u8>(32, 16));
+  image->SetTo(42);
+  
+  ImageCache<u8> image_cache(image);
+  for (int i = 0; i < kImageCacheMaxDerivedImages; ++ i) {
+    MaxCutoff<u8>(&image_cache, 100 + i, 0).GetOrComputeResult();
+  }
+  usize bytes_before = image_cache.cached_bytes();
+  
+  ImageCacheResult<u8> uncached = MaxCutoff<u8>(&image_cache, 10, 1);
+  EXPECT_EQ(kImageCacheUncachedImage, uncached.index);
+  shared_ptr<Image<u8>> cutoff_10 = uncached.GetOrComputeResult();
+  ASSERT_TRUE(cutoff_10 != nullptr);
+  EXPECT_EQ(1, (*cutoff_10)(0, 0));
+  EXPECT_EQ(bytes_before, image_cache.cached_bytes());
+  
+  // Chaining from an uncached result works as well.
+  shared_ptr<Image<u8>> cutoff_pyramid = ImagePyramid(uncached, 1).GetOrComputeResult();
+  EXPECT_EQ(32u / 2, cutoff_pyramid->width());
+  EXPECT_EQ(1, (*cutoff_pyramid)(0, 0));
+  
+  // Cached results are still returned.
+  EXPECT_NE(kImageCacheUncachedImage, MaxCutoff<u8>(&image_cache, 100, 0).index);
+}
+
+namespace {
+// Writes an image with the given size and the value 16 * index to a temporary
+// file and returns its path.
+string WriteTemporaryImage(int index, int width, int height) {
+  ostringstream path;
+  path << "/tmp/__image_cache_test_" << index << ".png";  // TODO: use random temporary filename
+  Image<u8> image(width, height);
+  image.SetTo(static_cast<u8>(16 * index));
+  EXPECT_TRUE(image.Write(path.str()));
+  return path.str();
+}
+}
+
+// Verifies that clearing the derived data frees the pyramid images (which are
+// then re-computed on the next access).
+TEST(ImageCache, ClearDerivedData) {
+  shared_ptr<Image<u8>> image(new Image<u8>(32, 16));
+  image->SetTo(42);
+  
+  ImageCache<u8> image_cache(image);
+  weak_ptr<Image<u8>> pyramid_image = ImagePyramid(&image_cache, 1).GetOrComputeResult();
+  EXPECT_FALSE(pyramid_image.expired());
+  
+  image_cache.ClearDerivedData();
+  EXPECT_TRUE(pyramid_image.expired());
+  EXPECT_TRUE(image_cache.IsImageLoaded());
+  EXPECT_EQ(image->stride() * image->height(), image_cache.cached_bytes());
+  
+  EXPECT_EQ(32u / 2, ImagePyramid(&image_cache, 1).GetOrComputeResult()->width());
+}
+
+// Verifies that the least recently used images are evicted when the budget
+// is exceeded, that images in use are never evicted, and that evicted images
+// are re-loaded on access.
+TEST(ImageCache, BudgetEviction) {
+  constexpr int kCacheCount = 4;
+  vector<shared_ptr<ImageCache<u8>>> caches;
+  for (int i = 0; i < kCacheCount; ++ i) {
+    caches.emplace_back(new ImageCache<u8>(WriteTemporaryImage(i, 64, 64)));
+  }
+  const usize image_bytes = caches[0]->GetImage()->stride() * 64;
+  caches[0]->ClearImageAndDerivedData();
+  
+  // Budget for two images.
+  shared_ptr<ImageCacheBudget> budget(new ImageCacheBudget(2 * image_bytes));
+  for (auto& cache : caches) {
+    cache->SetBudget(budget);
+  }
+  
+  caches[0]->GetImage();
+  caches[1]->GetImage();
+  EXPECT_TRUE(caches[0]->IsImageLoaded());
+  EXPECT_TRUE(caches[1]->IsImageLoaded());
+  
+  // Access image 0 such that image 1 is the least recently used one.
+  caches[0]->GetImage();
+  caches[2]->GetImage();
+  EXPECT_TRUE(caches[0]->IsImageLoaded());
+  EXPECT_FALSE(caches[1]->IsImageLoaded());
+  EXPECT_TRUE(caches[2]->IsImageLoaded());
+  
+  // Keep image 0 in use. It must not be evicted even though it is the least
+  // recently used one.
+  shared_ptr<Image<u8>> image_0 = caches[0]->GetImage();
+  caches[2]->GetImage();
+  caches[3]->GetImage();
+  EXPECT_TRUE(caches[0]->IsImageLoaded());
+  EXPECT_FALSE(caches[2]->IsImageLoaded());
+  EXPECT_TRUE(caches[3]->IsImageLoaded());
+  
+  // Evicted images are re-loaded.
+  EXPECT_EQ(16, (*caches[1]->GetImage())(0, 0));
+  
+  ImageCacheStatistics statistics = budget->statistics();
+  EXPECT_EQ(5u, statistics.miss_count);
+  EXPECT_EQ(3u, statistics.hit_count);
+  EXPECT_EQ(3u, statistics.eviction_count);
+  EXPECT_LE(statistics.used_bytes, statistics.max_bytes + image_bytes);
+  
+  // Derived data is accounted for as well.
+  image_0.reset();
+  caches[1]->ClearImageAndDerivedData();
+  caches[3]->ClearImageAndDerivedData();
+  ImagePyramid(caches[0].get(), 1).GetOrComputeResult();
+  EXPECT_EQ(image_bytes + 32 * ImagePyramid(caches[0].get(), 1).GetOrComputeResult()->stride(),
+            budget->statistics().used_bytes);
+}
+
+// Verifies that concurrent requests for the same image and derived data only
+// load and compute them once, while evictions happen concurrently.
+TEST(ImageCache, ConcurrentAccess) {
+  constexpr int kCacheCount = 8;
+  vector<shared_ptr<ImageCache<u8>>> caches;
+  for (int i = 0; i < kCacheCount; ++ i) {
+    caches.emplace_back(new ImageCache<u8>(WriteTemporaryImage(i, 64, 64)));
+  }
+  
+  // Unlimited budget, used for the statistics.
+  shared_ptr<ImageCacheBudget> budget(new ImageCacheBudget());
+  for (auto& cache : caches) {
+    cache->SetBudget(budget);
+  }
+  
+  constexpr int kThreadCount = 8;
+  vector<thread> threads;
+  vector<Image<u8>*> results(kThreadCount * kCacheCount);
+  for (int t = 0; t < kThreadCount; ++ t) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < kCacheCount; ++ i) {
+        results[t * kCacheCount + i] = ImagePyramid(caches[i].get(), 2).GetOrComputeResult().get();
+      }
+    });
+  }
+  for (thread& t : threads) {
+    t.join();
+  }
+  
+  for (int t = 0; t < kThreadCount; ++ t) {
+    for (int i = 0; i < kCacheCount; ++ i) {
+      EXPECT_EQ(results[i], results[t * kCacheCount + i]);
+    }
+  }
+  // The image and both pyramid levels are computed by a single request.
+  EXPECT_EQ(1u * kCacheCount, budget->statistics().miss_count);
+  
+  // Now, access the images randomly from multiple threads with a budget
+  // which only allows a few images at a time.
+  budget->SetMaxBytes(3 * caches[0]->GetImage()->stride() * 64);
+  threads.clear();
+  std::atomic<int> failure_count(0);
+  for (int t = 0; t < kThreadCount; ++ t) {
+    threads.emplace_back([&, t]() {
+      for (int iteration = 0; iteration < 200; ++ iteration) {
+        int i = (iteration * 7 + t * 3) % kCacheCount;
+        shared_ptr<Image<u8>> image = (iteration % 2) ?
+            caches[i]->GetImage() :
+            ImagePyramid(caches[i].get(), 1).GetOrComputeResult();
+        if (!image || (*image)(0, 0) != 16 * i) {
+          ++ failure_count;
+        }
+      }
+    });
+  }
+  for (thread& t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(0, failure_count);
+  EXPECT_GT(budget->statistics().eviction_count, 0u);
+}
@@ -0,0 +1,84 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "libvis/logging.h"
+#include <gtest/gtest.h>
+
+#include "libvis/image_pool.h"
+
+using namespace vis;
+
+// Tests that released images are re-used for acquisitions of the same size.
+TEST(ImagePool, ReusesImages) {
+  ImagePool<u16> pool;
+  
+  Image<u16>* first_address;
+  {
+    shared_ptr<Image<u16>> image = pool.Acquire(32, 16);
+    EXPECT_EQ(32, image->width());
+    EXPECT_EQ(16, image->height());
+    first_address = image.get();
+    EXPECT_EQ(32 * 16 * sizeof(u16), pool.metrics().in_use_bytes);
+  }
+  EXPECT_EQ(32 * 16 * sizeof(u16), pool.metrics().pooled_bytes);
+  
+  // An image of a different size requires a new allocation.
+  shared_ptr<Image<u16>> other_size_image = pool.Acquire(16, 16);
+  shared_ptr<Image<u16>> image = pool.Acquire(32, 16);
+  EXPECT_EQ(first_address, image.get());
+  
+  PoolMetrics metrics = pool.metrics();
+  EXPECT_EQ(3, metrics.acquire_count);
+  EXPECT_EQ(2, metrics.allocation_count);
+  EXPECT_EQ(1, metrics.reuse_count);
+  EXPECT_EQ(0, metrics.free_count);
+  EXPECT_EQ(0, metrics.pooled_bytes);
+}
+
+// Tests that the pool does not keep more than the maximum byte count, and that
+// images may outlive the pool.
+TEST(ImagePool, Limits) {
+  shared_ptr<Image<u8>> outliving_image;
+  {
+    ImagePool<u8> pool(/*max_pooled_bytes*/ 100);
+    shared_ptr<Image<u8>> image_a = pool.Acquire(10, 10);
+    shared_ptr<Image<u8>> image_b = pool.Acquire(10, 10);
+    outliving_image = pool.Acquire(10, 10);
+    
+    image_a.reset();
+    image_b.reset();
+    EXPECT_EQ(100, pool.metrics().pooled_bytes);
+    EXPECT_EQ(1, pool.metrics().free_count);
+    
+    pool.Trim();
+    EXPECT_EQ(0, pool.metrics().pooled_bytes);
+    EXPECT_EQ(2, pool.metrics().free_count);
+  }
+  outliving_image.reset();
+}
@@ -0,0 +1,146 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "libvis/logging.h"
+#include <gtest/gtest.h>
+
+#include "libvis/camera.h"
+#include "libvis/image.h"
+#include "libvis/patch_match_stereo.h"
+#include "libvis/test/synthetic_texture.h"
+
+using namespace vis;
+
+namespace {
+// Renders the view of a textured fronto-parallel plane at the given depth in
+// the global frame.
+void RenderPlane(const Camera& camera, const SE3f& global_tr_image, float plane_depth, Image<u8>* image) {
+  image->SetSize(camera.width(), camera.height());
+  for (u32 y = 0; y < camera.height(); ++ y) {
+    for (u32 x = 0; x < camera.width(); ++ x) {
+      Vec3f direction = global_tr_image.so3() * camera.UnprojectFromPixelCenterConv(Vec2f(x, y)).cast<float>();
+      Vec3f point = global_tr_image.translation() +
+                    ((plane_depth - global_tr_image.translation().z()) / direction.z()) * direction;
+      (*image)(x, y) = TextureValue(point.x(), point.y()) + 0.5f;
+    }
+  }
+}
+}
+
+// Verifies that PatchMatch stereo recovers the depth of a textured plane, and
+// that the result does not depend on the number of threads.
+TEST(PatchMatchStereoCPU, TexturedPlane) {
+  constexpr int kWidth = 80;
+  constexpr int kHeight = 60;
+  constexpr float kPlaneDepth = 2.f;
+  float camera_parameters[4] = {60, 60, 40, 30};
+  PinholeCamera4f camera(kWidth, kHeight, camera_parameters);
+  
+  SE3f reference_tr_global;
+  SE3f stereo_tr_global = SE3f(Matrix3f::Identity(), Vec3f(-0.2f, 0, 0));
+  Image<u8> reference_image;
+  Image<u8> stereo_image;
+  RenderPlane(camera, reference_tr_global.inverse(), kPlaneDepth, &reference_image);
+  RenderPlane(camera, stereo_tr_global.inverse(), kPlaneDepth, &stereo_image);
+  
+  PatchMatchStereoCPU patch_match(kWidth, kHeight);
+  patch_match.SetMinInitialDepth(0.5f);
+  patch_match.SetMaxInitialDepth(10.f);
+  patch_match.SetIterationCount(8);
+  
+  Image<float> inv_depth_map;
+  patch_match.SetThreadCount(1);
+  patch_match.ComputeDepthMap(camera, reference_image, reference_tr_global,
+                              camera, stereo_image, stereo_tr_global, &inv_depth_map);
+  
+  int checked_count = 0;
+  int correct_count = 0;
+  for (int y = patch_match.context_radius(); y < kHeight - patch_match.context_radius(); ++ y) {
+    // Only check the part of the image which is visible in the stereo image.
+    for (int x = patch_match.context_radius() + 10; x < kWidth - patch_match.context_radius(); ++ x) {
+      ++ checked_count;
+      if (fabs(inv_depth_map(x, y) - 1.f / kPlaneDepth) < 0.02f) {
+        ++ correct_count;
+      }
+    }
+  }
+  EXPECT_GT(correct_count, 0.8f * checked_count);
+  
+  // Running with multiple threads (and on the buffers from the previous call)
+  // gives the same result.
+  Image<float> inv_depth_map_2;
+  patch_match.SetThreadCount(3);
+  patch_match.ComputeDepthMap(camera, reference_image, reference_tr_global,
+                              camera, stereo_image, stereo_tr_global, &inv_depth_map_2);
+  EXPECT_TRUE(inv_depth_map == inv_depth_map_2);
+}
+
+// Verifies that multi-view PatchMatch stereo also recovers the depth in the
+// image parts which are only visible in one of the stereo views.
+TEST(PatchMatchStereoCPU, MultiViewTexturedPlane) {
+  constexpr int kWidth = 80;
+  constexpr int kHeight = 60;
+  constexpr float kPlaneDepth = 2.f;
+  float camera_parameters[4] = {60, 60, 40, 30};
+  PinholeCamera4f camera(kWidth, kHeight, camera_parameters);
+  
+  SE3f reference_tr_global;
+  SE3f left_tr_global = SE3f(Matrix3f::Identity(), Vec3f(0.2f, 0, 0));
+  SE3f right_tr_global = SE3f(Matrix3f::Identity(), Vec3f(-0.2f, 0, 0));
+  Image<u8> reference_image;
+  Image<u8> left_image;
+  Image<u8> right_image;
+  RenderPlane(camera, reference_tr_global.inverse(), kPlaneDepth, &reference_image);
+  RenderPlane(camera, left_tr_global.inverse(), kPlaneDepth, &left_image);
+  RenderPlane(camera, right_tr_global.inverse(), kPlaneDepth, &right_image);
+  
+  PatchMatchStereoCPU patch_match(kWidth, kHeight);
+  patch_match.SetMinInitialDepth(0.5f);
+  patch_match.SetMaxInitialDepth(10.f);
+  patch_match.SetIterationCount(8);
+  
+  aligned_vector<PatchMatchStereoCPU::StereoView> stereo_views;
+  stereo_views.emplace_back(&camera, &left_image, left_tr_global);
+  stereo_views.emplace_back(&camera, &right_image, right_tr_global);
+  Image<float> inv_depth_map;
+  patch_match.ComputeDepthMap(camera, reference_image, reference_tr_global,
+                              stereo_views, &inv_depth_map);
+  
+  int checked_count = 0;
+  int correct_count = 0;
+  for (int y = patch_match.context_radius(); y < kHeight - patch_match.context_radius(); ++ y) {
+    for (int x = patch_match.context_radius(); x < kWidth - patch_match.context_radius(); ++ x) {
+      ++ checked_count;
+      if (fabs(inv_depth_map(x, y) - 1.f / kPlaneDepth) < 0.02f) {
+        ++ correct_count;
+      }
+    }
+  }
+  EXPECT_GT(correct_count, 0.9f * checked_count);
+}
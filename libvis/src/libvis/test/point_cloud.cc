@@ -121,3 +121,54 @@ TEST(PointCloud, Save) {
   
   // TODO: Extend this test to load the saved files again and ensure that the results are equal to the original clouds
 }
+
+namespace {
+// Returns the contents of the given file, or an empty string on error.
+string ReadFileContents(const char* path) {
+  std::ifstream file(path, std::ios::in | std::ios::binary);
+  return string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+}
+
+TEST(PointCloud, PLYWriterStreaming) {
+  Point3fC3u8NfCloud cloud(5);
+  for (usize i = 0; i < cloud.size(); ++ i) {
+    cloud[i] = Point3fC3u8Nf(Vec3f(i, 2 * i, 3 * i), Vec3u8(i, 10 * i, 20 * i), Vec3f(i, 1, 2).normalized());
+  }
+  ASSERT_TRUE(cloud.WriteAsPLY("/tmp/__ply_writer_test_a.ply"));  // TODO: use random temporary filename
+  
+  // Write the same cloud in chunks without announcing the point count.
+  PointCloudPLYWriter<Point3fC3u8Nf> writer;
+  ASSERT_TRUE(writer.Open("/tmp/__ply_writer_test_b.ply"));  // TODO: use random temporary filename
+  ASSERT_TRUE(writer.Write(cloud.data(), 2));
+  vector<u8> encoded(3 * PointCloudPLYWriter<Point3fC3u8Nf>::kEncodedSize);
+  u8* ptr = encoded.data();
+  for (usize i = 2; i < cloud.size(); ++ i) {
+    ptr = PLYPointEncoding<Point3fC3u8Nf>::Encode(cloud[i], ptr);
+  }
+  ASSERT_TRUE(writer.WriteEncoded(encoded.data(), 3));
+  EXPECT_EQ(cloud.size(), writer.written_vertex_count());
+  ASSERT_TRUE(writer.Close());
+  
+  string a = ReadFileContents("/tmp/__ply_writer_test_a.ply");
+  string b = ReadFileContents("/tmp/__ply_writer_test_b.ply");
+  const string kEndHeader = "end_header\n";
+  usize a_data = a.find(kEndHeader);
+  usize b_data = b.find(kEndHeader);
+  ASSERT_NE(string::npos, a_data);
+  ASSERT_NE(string::npos, b_data);
+  
+  // The vertex data must be identical, and the (patched) vertex count in the
+  // header must be parsed as the same value.
+  EXPECT_EQ(a.substr(a_data), b.substr(b_data));
+  EXPECT_EQ(27u * cloud.size(), a.size() - a_data - kEndHeader.size());
+  std::istringstream a_header(a.substr(0, a_data));
+  std::istringstream b_header(b.substr(0, b_data));
+  string a_token, b_token;
+  while (a_header >> a_token) {
+    ASSERT_TRUE(static_cast<bool>(b_header >> b_token));
+    EXPECT_EQ(a_token, b_token);
+  }
+  EXPECT_FALSE(static_cast<bool>(b_header >> b_token));
+}
+
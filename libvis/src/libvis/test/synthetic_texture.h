@@ -0,0 +1,57 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <cmath>
+
+#include "libvis/libvis.h"
+
+namespace vis {
+
+// Returns the intensity of a random texture at the given position, as
+// bilinearly interpolated value noise. Used by the tests for rendering
+// synthetic textured surfaces.
+inline float TextureValue(float x, float y) {
+  constexpr float kCellSize = 0.05f;
+  auto grid_value = [](int gx, int gy) {
+    u32 hash = static_cast<u32>(gx) * 73856093u ^ static_cast<u32>(gy) * 19349663u;
+    hash = (hash ^ (hash >> 13)) * 0x5bd1e995u;
+    return static_cast<float>((hash ^ (hash >> 15)) & 0xff);
+  };
+  float fx = x / kCellSize;
+  float fy = y / kCellSize;
+  int gx = static_cast<int>(std::floor(fx));
+  int gy = static_cast<int>(std::floor(fy));
+  fx -= gx;
+  fy -= gy;
+  return (1 - fy) * ((1 - fx) * grid_value(gx, gy) + fx * grid_value(gx + 1, gy)) +
+         fy * ((1 - fx) * grid_value(gx, gy + 1) + fx * grid_value(gx + 1, gy + 1));
+}
+
+}
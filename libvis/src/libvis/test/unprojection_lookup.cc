@@ -0,0 +1,105 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "libvis/logging.h"
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include "libvis/camera.h"
+#include "libvis/unprojection_lookup.h"
+
+using namespace vis;
+
+namespace {
+ThinPrismFisheyeCamera12d CreateTestCamera(double fx = 60) {
+  double parameters[12] = {0.01, 0.02, -0.024, 0.003, 0.002, -0.001, 0.005, -0.006, fx, 60, 40, 30};
+  return ThinPrismFisheyeCamera12d(80, 60, parameters);
+}
+}
+
+// Tests that the table contains the unprojections of the pixel centers, and
+// that interpolated positions are close to the exact unprojection.
+TEST(UnprojectionLookup2D, MatchesCamera) {
+  ThinPrismFisheyeCamera12d camera = CreateTestCamera();
+  UnprojectionLookup2D lookup(camera);
+  ASSERT_EQ(camera.width(), lookup.width());
+  ASSERT_EQ(camera.height(), lookup.height());
+  
+  for (int y = 0; y < static_cast<int>(camera.height()); ++ y) {
+    for (int x = 0; x < static_cast<int>(camera.width()); ++ x) {
+      Vec2f expected = camera.UnprojectFromPixelCenterConv(Vec2d(x, y)).cast<float>().topRows<2>();
+      EXPECT_EQ(expected, lookup.UnprojectPixel(x, y));
+      EXPECT_EQ(expected, lookup.UnprojectPoint(x, y));
+    }
+  }
+  
+  // Allow for an interpolation error of about 0.05 pixels.
+  constexpr float kEpsilon = 1e-3f;
+  for (float y = 0.25f; y < camera.height() - 1; y += 3.7f) {
+    for (float x = 0.25f; x < camera.width() - 1; x += 3.3f) {
+      Vec2f expected = camera.UnprojectFromPixelCenterConv(Vec2d(x, y)).cast<float>().topRows<2>();
+      Vec2f result = lookup.UnprojectPoint(x, y);
+      EXPECT_NEAR(expected.x(), result.x(), kEpsilon);
+      EXPECT_NEAR(expected.y(), result.y(), kEpsilon);
+    }
+  }
+  
+  // Positions outside of the image are clamped.
+  EXPECT_EQ(lookup.UnprojectPixel(0, 0), lookup.UnprojectPoint(-3, -0.5f));
+  EXPECT_EQ(lookup.UnprojectPixel(camera.width() - 1, camera.height() - 1),
+            lookup.UnprojectPoint(camera.width() + 2, camera.height()));
+}
+
+// Tests that the cached tables are shared for cameras with equal parameters.
+TEST(UnprojectionLookup2D, Cache) {
+  shared_ptr<const UnprojectionLookup2D> lookup = UnprojectionLookup2D::Get(CreateTestCamera());
+  EXPECT_EQ(lookup, UnprojectionLookup2D::Get(CreateTestCamera()));
+  
+  shared_ptr<const UnprojectionLookup2D> other_lookup = UnprojectionLookup2D::Get(CreateTestCamera(61));
+  EXPECT_NE(lookup, other_lookup);
+  EXPECT_NE(UnprojectionLookup2D::ComputeCameraHash(CreateTestCamera()),
+            UnprojectionLookup2D::ComputeCameraHash(CreateTestCamera(61)));
+  
+  // Concurrent requests return the same table.
+  constexpr int kThreadCount = 4;
+  shared_ptr<const UnprojectionLookup2D> results[kThreadCount];
+  vector<std::thread> threads;
+  for (int i = 0; i < kThreadCount; ++ i) {
+    threads.emplace_back([i, &results]() {
+      results[i] = UnprojectionLookup2D::Get(CreateTestCamera(62));
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  for (int i = 1; i < kThreadCount; ++ i) {
+    EXPECT_EQ(results[0], results[i]);
+  }
+}
@@ -63,3 +63,38 @@ TEST(Util, erase_if_no_deletion) {
     EXPECT_EQ(gt[i], test[i]);
   }
 }
+
+TEST(Util, ParallelForBlocks_covers_range) {
+  constexpr usize kBegin = 3;
+  constexpr usize kEnd = 1003;
+  vector<int> visit_count(kEnd, 0);
+  vector<usize> block_sizes(7, 0);
+  ParallelForBlocks(kBegin, kEnd, block_sizes.size(), [&](usize block_index, usize block_begin, usize block_end) {
+    block_sizes[block_index] = block_end - block_begin;
+    for (usize i = block_begin; i < block_end; ++ i) {
+      ++ visit_count[i];
+    }
+  });
+  for (usize i = 0; i < kEnd; ++ i) {
+    EXPECT_EQ((i < kBegin) ? 0 : 1, visit_count[i]);
+  }
+  for (usize block_size : block_sizes) {
+    EXPECT_GE(block_size, (kEnd - kBegin) / block_sizes.size());
+    EXPECT_LE(block_size, (kEnd - kBegin) / block_sizes.size() + 1);
+  }
+}
+
+TEST(Util, ParallelForBlocks_more_blocks_than_items) {
+  vector<int> visit_count(2, 0);
+  usize calls = 0;
+  ParallelForBlocks(0, 2, 16, [&](usize /*block_index*/, usize block_begin, usize block_end) {
+    for (usize i = block_begin; i < block_end; ++ i) {
+      ++ visit_count[i];
+    }
+  });
+  ParallelForBlocks(0, 0, 16, [&](usize, usize, usize) { ++ calls; });
+  EXPECT_EQ(1, visit_count[0]);
+  EXPECT_EQ(1, visit_count[1]);
+  EXPECT_EQ(0u, calls);
+}
+
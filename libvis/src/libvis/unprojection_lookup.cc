@@ -0,0 +1,162 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include "libvis/unprojection_lookup.h"
+
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#include "libvis/util.h"
+
+namespace vis {
+
+namespace {
+
+template <typename CameraT>
+void BuildUnprojectionLookup(const CameraT& camera, Image<Vec2f>* lookup) {
+  const int width = camera.width();
+  ParallelForBlocks(0, camera.height(), DefaultThreadCount(), [&](usize /*block_index*/, usize block_begin, usize block_end) {
+    for (int y = block_begin; y < static_cast<int>(block_end); ++ y) {
+      Vec2f* lookup_row = lookup->row(y);
+      for (int x = 0; x < width; ++ x) {
+        lookup_row[x] = camera.UnprojectFromPixelCenterConv(Vec2d(x, y).cast<typename CameraT::ScalarT>()).template cast<float>().template topRows<2>();
+      }
+    }
+  });
+}
+
+template <typename CameraT>
+void GetCameraParameterBytes(const CameraT& camera, vector<u8>* bytes) {
+  bytes->resize(camera.parameter_count() * sizeof(typename CameraT::ScalarT));
+  memcpy(bytes->data(), camera.parameters(), bytes->size());
+}
+
+vector<u8> GetCameraParameterBytes(const Camera& camera) {
+  vector<u8> bytes;
+  IDENTIFY_CAMERA(camera, GetCameraParameterBytes(_camera, &bytes));
+  return bytes;
+}
+
+// Cache for UnprojectionLookup2D::Get(). Multiple tables may have the same
+// hash.
+struct UnprojectionLookupCache {
+  std::mutex mutex;
+  unordered_multimap<u64, weak_ptr<const UnprojectionLookup2D>> tables;
+};
+
+UnprojectionLookupCache& GetUnprojectionLookupCache() {
+  static UnprojectionLookupCache cache;
+  return cache;
+}
+
+}  // namespace
+
+
+UnprojectionLookup2D::UnprojectionLookup2D(const Camera& camera)
+    : lookup_(camera.width(), camera.height()),
+      camera_type_int_(camera.type_int()),
+      camera_parameters_(GetCameraParameterBytes(camera)) {
+  IDENTIFY_CAMERA(camera, BuildUnprojectionLookup(_camera, &lookup_));
+}
+
+shared_ptr<const UnprojectionLookup2D> UnprojectionLookup2D::Get(const Camera& camera) {
+  const u64 hash = ComputeCameraHash(camera);
+  UnprojectionLookupCache& cache = GetUnprojectionLookupCache();
+  
+  auto find_table = [&]() -> shared_ptr<const UnprojectionLookup2D> {
+    auto range = cache.tables.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++ it) {
+      shared_ptr<const UnprojectionLookup2D> table = it->second.lock();
+      if (table && table->IsForCamera(camera)) {
+        return table;
+      }
+    }
+    return nullptr;
+  };
+  
+  {
+    lock_guard<mutex> lock(cache.mutex);
+    shared_ptr<const UnprojectionLookup2D> table = find_table();
+    if (table) {
+      return table;
+    }
+  }
+  
+  // Build the table without holding the lock, such that other cameras can
+  // be looked up in the meantime.
+  shared_ptr<const UnprojectionLookup2D> new_table(new UnprojectionLookup2D(camera));
+  
+  lock_guard<mutex> lock(cache.mutex);
+  // Another thread may have built the same table in the meantime.
+  shared_ptr<const UnprojectionLookup2D> table = find_table();
+  if (table) {
+    return table;
+  }
+  
+  // Drop the entries of released tables.
+  for (auto it = cache.tables.begin(); it != cache.tables.end(); ) {
+    if (it->second.expired()) {
+      it = cache.tables.erase(it);
+    } else {
+      ++ it;
+    }
+  }
+  cache.tables.emplace(hash, new_table);
+  return new_table;
+}
+
+u64 UnprojectionLookup2D::ComputeCameraHash(const Camera& camera) {
+  // FNV-1a
+  u64 hash = 14695981039346656037ull;
+  auto add_bytes = [&](const void* data, usize size) {
+    const u8* bytes = static_cast<const u8*>(data);
+    for (usize i = 0; i < size; ++ i) {
+      hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+  };
+  
+  const int type_int = camera.type_int();
+  const u32 width = camera.width();
+  const u32 height = camera.height();
+  add_bytes(&type_int, sizeof(type_int));
+  add_bytes(&width, sizeof(width));
+  add_bytes(&height, sizeof(height));
+  const vector<u8> parameters = GetCameraParameterBytes(camera);
+  add_bytes(parameters.data(), parameters.size());
+  return hash;
+}
+
+bool UnprojectionLookup2D::IsForCamera(const Camera& camera) const {
+  return camera.type_int() == camera_type_int_ &&
+         camera.width() == lookup_.width() &&
+         camera.height() == lookup_.height() &&
+         GetCameraParameterBytes(camera) == camera_parameters_;
+}
+
+}
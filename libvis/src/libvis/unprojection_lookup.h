@@ -0,0 +1,101 @@
+// Copyright 2019 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <memory>
+
+#include "libvis/camera.h"
+#include "libvis/eigen.h"
+#include "libvis/image.h"
+#include "libvis/libvis.h"
+
+namespace vis {
+
+// Lookup table for 2D unprojection of image pixels to directions on the CPU,
+// i.e., assuming that the z component of the unprojected vectors is always 1.
+// This avoids the iterative undistortion of the camera models with distortion
+// for each unprojection. The table stores the unprojections of all pixel
+// centers; positions in between are bilinearly interpolated.
+// 
+// Since the table is immutable after construction, it can be shared between
+// threads. Use Get() to obtain a table that is shared with other users of a
+// camera with the same parameters.
+class UnprojectionLookup2D {
+ public:
+  // Builds the table for the given camera (in parallel).
+  explicit UnprojectionLookup2D(const Camera& camera);
+  
+  // Returns the table for the given camera from a global cache, building it
+  // if it does not exist yet. The cache is keyed by a hash of the camera type,
+  // size and parameters, and only holds weak references: a table is released
+  // once no user holds it anymore. Thread-safe.
+  static shared_ptr<const UnprojectionLookup2D> Get(const Camera& camera);
+  
+  // Returns a hash of the camera type, size and parameters.
+  static u64 ComputeCameraHash(const Camera& camera);
+  
+  // Returns the unprojection of the pixel center of the given pixel.
+  inline const Vec2f& UnprojectPixel(int x, int y) const {
+    return lookup_(x, y);
+  }
+  
+  // Returns the unprojection of the given position in pixel center
+  // convention, bilinearly interpolated from the table. Positions outside of
+  // the image are clamped to the border pixel centers.
+  inline Vec2f UnprojectPoint(float x, float y) const {
+    x = std::max(0.f, std::min(x, lookup_.width() - 1.f));
+    y = std::max(0.f, std::min(y, lookup_.height() - 1.f));
+    const int ix = std::min(static_cast<int>(x), static_cast<int>(lookup_.width()) - 2);
+    const int iy = std::min(static_cast<int>(y), static_cast<int>(lookup_.height()) - 2);
+    const float fx = x - ix;
+    const float fy = y - iy;
+    const Vec2f* row = lookup_.row(iy);
+    const Vec2f* next_row = lookup_.row(iy + 1);
+    return (1 - fy) * ((1 - fx) * row[ix] + fx * row[ix + 1]) +
+           fy * ((1 - fx) * next_row[ix] + fx * next_row[ix + 1]);
+  }
+  
+  // Returns the table, which has the size of the camera images.
+  inline const Image<Vec2f>& lookup() const { return lookup_; }
+  
+  inline u32 width() const { return lookup_.width(); }
+  inline u32 height() const { return lookup_.height(); }
+  
+ private:
+  // Returns true if the camera has the same type, size and parameters as the
+  // one that the table was built for.
+  bool IsForCamera(const Camera& camera) const;
+  
+  Image<Vec2f> lookup_;
+  
+  int camera_type_int_;
+  vector<u8> camera_parameters_;
+};
+
+}
@@ -29,6 +29,10 @@
 
 #pragma once
 
+#include <algorithm>
+#include <thread>
+#include <vector>
+
 #include "libvis/libvis.h"
 
 namespace vis {
@@ -70,4 +74,55 @@ void erase_if(vector<T>& container, Cond condition) {
       container.end());
 }
 
+/// Returns the number of threads to use for CPU-parallel loops if the caller
+/// does not specify it: the number of hardware threads, or 1 if that is
+/// unknown.
+inline usize DefaultThreadCount() {
+  usize count = std::thread::hardware_concurrency();
+  return (count == 0) ? 1 : count;
+}
+
+/// Splits the index range [begin, end) into block_count contiguous blocks of
+/// (almost) equal size and calls func(block_index, block_begin, block_end) for
+/// each block, running the blocks in parallel. The first block is processed by
+/// the calling thread. Returns once all blocks have been processed. The split
+/// only depends on the range and on block_count, so calling this function
+/// twice with the same arguments yields the same blocks (which is useful for
+/// count-then-write passes).
+template <typename Func>
+void ParallelForBlocks(usize begin, usize end, usize block_count, const Func& func) {
+  if (end <= begin) {
+    return;
+  }
+  block_count = std::max<usize>(1, std::min(block_count, end - begin));
+  
+  const usize range = end - begin;
+  auto block_begin = [&](usize block_index) {
+    return begin + (range * block_index) / block_count;
+  };
+  
+  vector<std::thread> threads;
+  threads.reserve(block_count - 1);
+  for (usize block_index = 1; block_index < block_count; ++ block_index) {
+    threads.emplace_back([&, block_index]() {
+      func(block_index, block_begin(block_index), block_begin(block_index + 1));
+    });
+  }
+  func(0, block_begin(0), block_begin(1));
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+/// Version of ParallelForBlocks() which calls func(index) for each index in
+/// [begin, end), distributing the indices over DefaultThreadCount() threads.
+template <typename Func>
+void ParallelFor(usize begin, usize end, const Func& func) {
+  ParallelForBlocks(begin, end, DefaultThreadCount(), [&](usize /*block_index*/, usize block_begin, usize block_end) {
+    for (usize i = block_begin; i < block_end; ++ i) {
+      func(i);
+    }
+  });
+}
+
 }